@@ -0,0 +1,306 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "ApiIndex.h"
+
+// What a candidate export has, checked against what each rule requires
+#define API_NAMED			0x01
+#define API_ANSI_UNICODE	0x02	// name ends in 'A' or 'W'
+#define API_NO_UNDERLINE	0x04	// name has no '_'
+#define API_PRIORITY		0x08	// module priority 1 or more
+#define API_PRIORITY0		0x10
+#define API_PRIORITY1		0x20
+#define API_PRIORITY2		0x40
+
+#define SUSPECT_KEEP	0
+#define SUSPECT_CLEAR	1
+#define SUSPECT_SET		2
+
+typedef struct ApiIndexRule
+{
+	uint8_t	Required;
+	int		FirstWins;		// otherwise the pick has to be the only match
+} APIINDEXRULE;
+
+// In the order getApiByVirtualAddress tries them; picks after the first are suspect
+static const APIINDEXRULE Rules[] =
+{
+	{ API_NAMED | API_PRIORITY, 0 },						// any high priority with a name
+	{ API_NAMED | API_ANSI_UNICODE | API_PRIORITY, 0 },		// high priority with a name and ansi/unicode name
+	{ API_NAMED | API_NO_UNDERLINE | API_PRIORITY2, 0 },	// priority 2 with no underline in name
+	{ API_NAMED | API_PRIORITY1, 0 },						// priority 1 with a name
+	{ API_NAMED, 0 },										// with a name
+	{ API_NAMED | API_ANSI_UNICODE | API_PRIORITY, 1 },		// any with priority, name, ansi/unicode
+	{ API_PRIORITY, 1 },									// any with priority
+	{ API_PRIORITY0, 1 },									// has prio 0
+};
+
+typedef struct ApiIndexKey
+{
+	uintptr_t	Address;
+	uint32_t	Sequence;	// position among the candidates as given
+	uint8_t		Traits;
+} APIINDEXKEY, *PAPIINDEXKEY;
+
+typedef struct ApiIndexGroup
+{
+	void		*Pick;
+	uint32_t	First;		// into Candidates
+	uint32_t	Count;
+	uint8_t		Suspect;
+} APIINDEXGROUP, *PAPIINDEXGROUP;
+
+// The addresses are laid out as an implicit binary search tree, the root at
+// 1 and the children of n at 2n and 2n+1, so a search walks down through
+// neighbouring slots instead of jumping across the whole array
+struct ApiIndex
+{
+	uintptr_t		*Addresses;		// distinct, in search order from 1, searched on their own
+	PAPIINDEXGROUP	Groups;			// in the same order
+	size_t			Count;
+	void			**Candidates;	// by address, then in the order given
+};
+
+static uint8_t CandidateTraits(const APICANDIDATE *Candidate)
+{
+	uint8_t Traits = 0;
+
+	if (Candidate->Name && Candidate->Name[0])
+	{
+		char Last = Candidate->Name[strlen(Candidate->Name) - 1];
+
+		Traits |= API_NAMED;
+		if (Last == 'A' || Last == 'W')
+			Traits |= API_ANSI_UNICODE;
+		if (!strchr(Candidate->Name, '_'))
+			Traits |= API_NO_UNDERLINE;
+	}
+
+	if (Candidate->Priority >= 1)
+		Traits |= API_PRIORITY;
+	if (Candidate->Priority == 0)
+		Traits |= API_PRIORITY0;
+	else if (Candidate->Priority == 1)
+		Traits |= API_PRIORITY1;
+	else if (Candidate->Priority == 2)
+		Traits |= API_PRIORITY2;
+
+	return Traits;
+}
+
+static int CompareKeys(const void *A, const void *B)
+{
+	const APIINDEXKEY *a = (const APIINDEXKEY*)A, *b = (const APIINDEXKEY*)B;
+
+	if (a->Address != b->Address)
+		return a->Address < b->Address ? -1 : 1;
+	return a->Sequence < b->Sequence ? -1 : a->Sequence > b->Sequence;
+}
+
+// Runs the rules over one address's candidates, as getScoredApi did pass by pass
+static void PickCandidate(PAPIINDEX Index, PAPIINDEXGROUP Group, const APIINDEXKEY *Keys)
+{
+	Group->Pick = Index->Candidates[Group->First];
+
+	if (Group->Count == 1)
+	{
+		Group->Suspect = SUSPECT_CLEAR;
+		return;
+	}
+
+	for (size_t Rule = 0; Rule < sizeof(Rules) / sizeof(Rules[0]); Rule++)
+	{
+		uint8_t Required = Rules[Rule].Required;
+		uint32_t Matches = 0, Match = 0;
+
+		Group->Suspect = Rule ? SUSPECT_SET : SUSPECT_KEEP;
+
+		for (uint32_t i = 0; i < Group->Count; i++)
+		{
+			if ((Keys[i].Traits & Required) != Required)
+				continue;
+
+			Match = i;
+			if (++Matches > 1 || Rules[Rule].FirstWins)
+				break;
+		}
+
+		if (Matches == 1)
+		{
+			Group->Pick = Index->Candidates[Group->First + Match];
+			return;
+		}
+	}
+
+	Group->Pick = NULL;
+}
+
+// Places the sorted addresses from Next on in the subtree rooted at Slot
+static size_t Layout(PAPIINDEX Index, const uintptr_t *Addresses, const APIINDEXGROUP *Groups, size_t Next, size_t Slot)
+{
+	if (Slot > Index->Count)
+		return Next;
+
+	Next = Layout(Index, Addresses, Groups, Next, 2 * Slot);
+	Index->Addresses[Slot] = Addresses[Next];
+	Index->Groups[Slot] = Groups[Next];
+	return Layout(Index, Addresses, Groups, Next + 1, 2 * Slot + 1);
+}
+
+//**************************************************************************************
+PAPIINDEX ApiIndexBuild(const APICANDIDATE *Candidates, size_t Count)
+//**************************************************************************************
+{
+	PAPIINDEX Index;
+	PAPIINDEXKEY Keys;
+	uintptr_t *Addresses = NULL;
+	PAPIINDEXGROUP Groups = NULL;
+
+	if (Count >= UINT32_MAX)
+		return NULL;
+
+	Index = (PAPIINDEX)calloc(1, sizeof(APIINDEX));
+	Keys = (PAPIINDEXKEY)malloc((Count + 1) * sizeof(APIINDEXKEY));
+	if (!Index || !Keys)
+		goto fail;
+
+	for (size_t i = 0; i < Count; i++)
+	{
+		Keys[i].Address = Candidates[i].Address;
+		Keys[i].Sequence = (uint32_t)i;
+		Keys[i].Traits = CandidateTraits(&Candidates[i]);
+	}
+
+	qsort(Keys, Count, sizeof(APIINDEXKEY), CompareKeys);
+
+	// one address each at most
+	Addresses = (uintptr_t*)malloc((Count + 1) * sizeof(uintptr_t));
+	Groups = (PAPIINDEXGROUP)malloc((Count + 1) * sizeof(APIINDEXGROUP));
+	Index->Candidates = (void**)malloc((Count + 1) * sizeof(void*));
+	if (!Addresses || !Groups || !Index->Candidates)
+		goto fail;
+
+	for (size_t i = 0; i < Count; i++)
+		Index->Candidates[i] = Candidates[Keys[i].Sequence].Api;
+
+	for (size_t i = 0; i < Count; )
+	{
+		PAPIINDEXGROUP Group = &Groups[Index->Count];
+		size_t End = i + 1;
+
+		while (End < Count && Keys[End].Address == Keys[i].Address)
+			End++;
+
+		Addresses[Index->Count++] = Keys[i].Address;
+		Group->First = (uint32_t)i;
+		Group->Count = (uint32_t)(End - i);
+		PickCandidate(Index, Group, &Keys[i]);
+		i = End;
+	}
+
+	Index->Addresses = (uintptr_t*)malloc((Index->Count + 1) * sizeof(uintptr_t));
+	Index->Groups = (PAPIINDEXGROUP)malloc((Index->Count + 1) * sizeof(APIINDEXGROUP));
+	if (!Index->Addresses || !Index->Groups)
+		goto fail;
+
+	Layout(Index, Addresses, Groups, 0, 1);
+
+	free(Addresses);
+	free(Groups);
+	free(Keys);
+	return Index;
+
+fail:
+	free(Keys);
+	free(Addresses);
+	free(Groups);
+	ApiIndexFree(Index);
+	return NULL;
+}
+
+//**************************************************************************************
+void ApiIndexFree(PAPIINDEX Index)
+//**************************************************************************************
+{
+	if (!Index)
+		return;
+
+	free(Index->Addresses);
+	free(Index->Groups);
+	free(Index->Candidates);
+	free(Index);
+}
+
+//**************************************************************************************
+size_t ApiIndexCount(PAPIINDEX Index)
+//**************************************************************************************
+{
+	return Index ? Index->Count : 0;
+}
+
+static PAPIINDEXGROUP FindGroup(PAPIINDEX Index, uintptr_t Address)
+{
+	size_t Slot = 1;
+
+	if (!Index)
+		return NULL;
+
+	while (Slot <= Index->Count)
+		Slot = 2 * Slot + (Index->Addresses[Slot] < Address);
+
+	// back up to the last node where the search went left, the lower bound
+	while (Slot & 1)
+		Slot >>= 1;
+	Slot >>= 1;
+
+	if (!Slot || Index->Addresses[Slot] != Address)
+		return NULL;
+
+	return &Index->Groups[Slot];
+}
+
+//**************************************************************************************
+void *ApiIndexLookup(PAPIINDEX Index, uintptr_t Address, int *Suspect)
+//**************************************************************************************
+{
+	PAPIINDEXGROUP Group = FindGroup(Index, Address);
+
+	if (!Group)
+		return NULL;
+
+	if (Suspect && Group->Suspect != SUSPECT_KEEP)
+		*Suspect = Group->Suspect == SUSPECT_SET;
+
+	return Group->Pick;
+}
+
+//**************************************************************************************
+size_t ApiIndexCandidates(PAPIINDEX Index, uintptr_t Address, void *const **Candidates)
+//**************************************************************************************
+{
+	PAPIINDEXGROUP Group = FindGroup(Index, Address);
+
+	if (!Group)
+		return 0;
+
+	if (Candidates)
+		*Candidates = &Index->Candidates[Group->First];
+
+	return Group->Count;
+}
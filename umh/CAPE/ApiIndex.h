@@ -0,0 +1,59 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Address index of the exports of every module in a process, for Scylla's
+// import reconstruction. Exports at one address are kept together in the
+// order they were added, and the one to use for each address is picked once
+// when the index is built, by the same rules getApiByVirtualAddress always
+// applied: named exports from kernel32 and the other normal priority
+// modules first, falling back through names, ansi/unicode suffixes and
+// module priority. A lookup is then a binary search over the addresses.
+
+typedef struct ApiIndex APIINDEX, *PAPIINDEX;
+
+typedef struct ApiCandidate
+{
+	uintptr_t	Address;
+	void		*Api;		// the caller's record of the export
+	const char	*Name;		// NULL or empty for exports by ordinal only
+	int			Priority;	// of the exporting module, see ApiReader::setModulePriority
+} APICANDIDATE, *PAPICANDIDATE;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Candidates are in the order they were added; names are only read while building
+PAPIINDEX ApiIndexBuild(const APICANDIDATE *Candidates, size_t Count);
+void ApiIndexFree(PAPIINDEX Index);
+// The number of distinct addresses
+size_t ApiIndexCount(PAPIINDEX Index);
+// The export picked for Address, or NULL if there is none or no rule picks
+// one. Suspect is cleared if Address has one export, set if the pick needed
+// more than the first rule, and left alone otherwise.
+void *ApiIndexLookup(PAPIINDEX Index, uintptr_t Address, int *Suspect);
+// All the exports at Address, in the order they were added
+size_t ApiIndexCandidates(PAPIINDEX Index, uintptr_t Address, void *const **Candidates);
+
+#ifdef __cplusplus
+}
+#endif
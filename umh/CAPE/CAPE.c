@@ -27,6 +27,7 @@ along with this program.If not, see <http://www.gnu.org/licenses/>.
 #define BUFSIZE				 1024	// For hashing
 #define DUMP_MAX				10
 #define CAPE_OUTPUT_FILE "CapeOutput.bin"
+#define MAX_FORWARDS			4
 //#define SUSPENDED_THREAD_MAX	4096
 
 #include <stdlib.h>
@@ -47,6 +48,9 @@ along with this program.If not, see <http://www.gnu.org/licenses/>.
 #include "Debugger.h"
 #include "Unpacker.h"
 #include "YaraHarness.h"
+#include "RegionTree.h"
+#include "ZeroScan.h"
+#include "ExportIndex.h"
 #include "..\alloc.h"
 #include "..\pipe.h"
 #include "..\config.h"
@@ -159,6 +163,8 @@ OSVERSIONINFO OSVersion;
 BOOL ProcessDumped, ImageBaseRemapped;
 PVOID ImageBase;
 
+static REGIONTREE TrackedRegions;
+
 static __inline ULONG_PTR get_stack_top(void)
 {
 #ifndef _WIN64
@@ -557,13 +563,60 @@ PVOID GetCLRAddress(HMODULE ModuleBase, PCHAR FunctionName)
 	return NULL;
 }
 
+// Looks up an export by name, or by ordinal if FunctionName is NULL, in the
+// shared index of its module, following forwarders to modules already loaded
+static PVOID ResolveExport(HMODULE ModuleBase, PCHAR FunctionName, DWORD Ordinal, unsigned int Depth)
+{
+	PEXPORTINDEX Index = ExportIndexAcquire((uintptr_t)ModuleBase);
+	EXPORTINFO Info;
+	PVOID ExportAddress = NULL;
+	BOOL Found;
+
+	if (!Index)
+		return NULL;
+
+	Found = FunctionName ? ExportIndexLookupName(Index, FunctionName, &Info) : ExportIndexLookupOrdinal(Index, Ordinal, &Info);
+
+	ExportIndexRelease(Index);
+
+	if (!Found)
+		return NULL;
+
+	if (!Info.Forwarder)
+		ExportAddress = (PVOID)((PBYTE)ModuleBase + Info.Rva);
+	else if (Depth < MAX_FORWARDS)
+	{
+		char ModuleName[MAX_PATH];
+		PCHAR Dot = strrchr(Info.Forwarder, '.');
+		HMODULE Forwarded;
+
+		if (!Dot || Dot - Info.Forwarder >= MAX_PATH)
+			return NULL;
+
+		memcpy(ModuleName, Info.Forwarder, Dot - Info.Forwarder);
+		ModuleName[Dot - Info.Forwarder] = '\0';
+		Forwarded = GetModuleHandle(ModuleName);
+#ifdef DEBUG_COMMENTS
+		DebugOutput("ResolveExport: %s forwarded to %s (0x%p)\n", FunctionName ? FunctionName : "(ordinal)", Info.Forwarder, Forwarded);
+#endif
+		if (!Forwarded)
+			return NULL;
+
+		if (Dot[1] == '#')
+			ExportAddress = ResolveExport(Forwarded, NULL, (DWORD)atoi(Dot + 2), Depth + 1);
+		else
+			ExportAddress = ResolveExport(Forwarded, Dot + 1, 0, Depth + 1);
+	}
+
+	return ExportAddress;
+}
+
 //**************************************************************************************
 PVOID GetExportAddress(HMODULE ModuleBase, PCHAR FunctionName)
 //**************************************************************************************
 {
 	PIMAGE_DOS_HEADER DosHeader;
 	PIMAGE_NT_HEADERS NtHeader;
-	PIMAGE_EXPORT_DIRECTORY ImageExportDirectory;
 	PVOID ExportAddress = NULL;
 
 	if (!ModuleBase || !FunctionName)
@@ -597,39 +650,16 @@ PVOID GetExportAddress(HMODULE ModuleBase, PCHAR FunctionName)
 	if (!NtHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress)
 		return NULL;
 
-	ImageExportDirectory = (PIMAGE_EXPORT_DIRECTORY)((PBYTE)ModuleBase + (DWORD_PTR)NtHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress);
-
-	if (!ImageExportDirectory->AddressOfNames)
-		return NULL;
-
-	if (ImageExportDirectory->AddressOfNames > NtHeader->OptionalHeader.SizeOfImage)
-	{
-#ifdef DEBUG_COMMENTS
-		DebugOutput("GetExportAddress: AddressOfNames 0x%x SizeOfImage 0x%x", ImageExportDirectory->AddressOfNames, NtHeader->OptionalHeader.SizeOfImage);
-#endif
-		return NULL;
-	}
-
-	unsigned int *NameRVA = (unsigned int*)((PBYTE)ModuleBase + ImageExportDirectory->AddressOfNames);
-
 	__try
 	{
-		for (unsigned int i = 0; i < ImageExportDirectory->NumberOfNames; i++)
-		{
-			if (NameRVA[i])
-			{
-				if (!strcmp((PCHAR)((PBYTE)ModuleBase + NameRVA[i]), FunctionName))
-					ExportAddress = (PVOID)((PBYTE)ModuleBase + ((DWORD*)((PBYTE)ModuleBase + ImageExportDirectory->AddressOfFunctions))[((unsigned short*)((PBYTE)ModuleBase + ImageExportDirectory->AddressOfNameOrdinals))[i]]);
-			}
-		}
+		ExportAddress = ResolveExport(ModuleBase, FunctionName, 0, 0);
 	}
 	__except(EXCEPTION_EXECUTE_HANDLER)
 	{
-		DebugOutput("GetExportAddress: Exception occurred around 0x%p\n", NameRVA);
+		DebugOutput("GetExportAddress: Exception occurred indexing exports of 0x%p\n", ModuleBase);
 		return NULL;
 	}
 
-
 	if (!ExportAddress && ModuleBase == GetModuleHandle("clr"))
 		return GetCLRAddress(ModuleBase, FunctionName);
 
@@ -703,11 +733,27 @@ BOOL IsInTrackedRegion(PTRACKEDREGION TrackedRegion, PVOID Address)
 	return FALSE;
 }
 
+typedef struct _TRACKEDREGIONQUERY
+{
+	PVOID	Address;
+	BOOL	Found;
+} TRACKEDREGIONQUERY, *PTRACKEDREGIONQUERY;
+
+//**************************************************************************************
+static void TrackedRegionContainsAddress(uintptr_t Start, uintptr_t End, void *Data, void *Context)
+//**************************************************************************************
+{
+	PTRACKEDREGIONQUERY Query = (PTRACKEDREGIONQUERY)Context;
+
+	if (!Query->Found && IsInTrackedRegion((PTRACKEDREGION)Data, Query->Address))
+		Query->Found = TRUE;
+}
+
 //**************************************************************************************
 BOOL IsInTrackedRegions(PVOID Address)
 //**************************************************************************************
 {
-	PTRACKEDREGION CurrentTrackedRegion = TrackedRegionList;
+	TRACKEDREGIONQUERY Query;
 
 	if (Address == NULL)
 	{
@@ -715,65 +761,35 @@ BOOL IsInTrackedRegions(PVOID Address)
 		return FALSE;
 	}
 
-	if (TrackedRegionList == NULL)
+	if (!TrackedRegions.Count)
 		return FALSE;
 
-	while (CurrentTrackedRegion)
-	{
-		if ((DWORD_PTR)Address >= (DWORD_PTR)CurrentTrackedRegion->AllocationBase && (DWORD_PTR)Address < ((DWORD_PTR)CurrentTrackedRegion->AllocationBase + (DWORD_PTR)GetAccessibleSize(CurrentTrackedRegion->AllocationBase)))
-			return TRUE;
+	Query.Address = Address;
+	Query.Found = FALSE;
 
-		CurrentTrackedRegion = CurrentTrackedRegion->NextTrackedRegion;
-	}
+	RegionTreeOverlaps(&TrackedRegions, (uintptr_t)Address, (uintptr_t)Address + 1, TrackedRegionContainsAddress, &Query);
 
-	return FALSE;
+	return Query.Found;
 }
 
 //**************************************************************************************
 PTRACKEDREGION GetTrackedRegion(PVOID Address)
 //**************************************************************************************
 {
-	PTRACKEDREGION CurrentTrackedRegion;
+	PVOID AllocationBase;
 
 	if (Address == NULL)
 		return NULL;
 
-	if (TrackedRegionList == NULL)
+	if (!TrackedRegions.Count)
 		return NULL;
 
-	CurrentTrackedRegion = TrackedRegionList;
-
-	while (CurrentTrackedRegion)
-	{
-		if (GetAllocationBase(Address) == CurrentTrackedRegion->AllocationBase)
-			return CurrentTrackedRegion;
+	AllocationBase = GetAllocationBase(Address);
 
-		CurrentTrackedRegion = CurrentTrackedRegion->NextTrackedRegion;
-	}
-
-	return NULL;
-}
-
-//**************************************************************************************
-PTRACKEDREGION CreateTrackedRegion()
-//**************************************************************************************
-{
-	if (TrackedRegionList)
-		return TrackedRegionList;
-
-	PTRACKEDREGION FirstTrackedRegion = ((struct TrackedRegion*)calloc(sizeof(struct TrackedRegion), sizeof(BYTE)));
-
-	if (FirstTrackedRegion == NULL)
-	{
-		DebugOutput("CreateTrackedRegion: failed to allocate memory for initial tracked region list.\n");
+	if (AllocationBase == NULL)
 		return NULL;
-	}
-
-	TrackedRegionList = FirstTrackedRegion;
 
-	//DebugOutput("CreateTrackedRegion: Tracked region list created at 0x%p.\n", TrackedRegionList);
-
-	return TrackedRegionList;
+	return (PTRACKEDREGION)RegionTreeLookup(&TrackedRegions, (uintptr_t)AllocationBase);
 }
 
 //**************************************************************************************
@@ -781,49 +797,47 @@ PTRACKEDREGION AddTrackedRegion(PVOID Address, ULONG Protect)
 //**************************************************************************************
 {
 	BOOL PageAlreadyTracked = FALSE;
-	unsigned int NumberOfTrackedRegions = 0;
-	PTRACKEDREGION TrackedRegion, PreviousTrackedRegion = NULL;
+	SIZE_T AllocationSize;
+	PTRACKEDREGION TrackedRegion;
 
 	if (!Address)
 		return NULL;
 
-	if (TrackedRegionList == NULL)
-		CreateTrackedRegion();
-
-	TrackedRegion = TrackedRegionList;
-
-	while (TrackedRegion)
-	{
-		NumberOfTrackedRegions++;
-		PreviousTrackedRegion = TrackedRegion;
-		TrackedRegion = TrackedRegion->NextTrackedRegion;
-	}
-
-	if (NumberOfTrackedRegions > 100)
-		DebugOutput("AddTrackedRegion: DEBUG Warning - number of tracked regions %d.\n", NumberOfTrackedRegions);
-
-	if (GetPageAddress(Address) == GetPageAddress(TrackedRegionList))
-	{
-		DebugOutput("AddTrackedRegion: Warning - attempting to track the page (0x%p) containing the tracked region list at 0x%p.\n", Address, TrackedRegionList);
-		return NULL;
-	}
+	if (TrackedRegions.Count > 100)
+		DebugOutput("AddTrackedRegion: DEBUG Warning - number of tracked regions %d.\n", (unsigned int)TrackedRegions.Count);
 
 	TrackedRegion = GetTrackedRegion(Address);
 
-	if (!TrackedRegion && PreviousTrackedRegion)
+	if (!TrackedRegion)
 	{
-		// We haven't found it in the linked list, so create a new one
-		TrackedRegion = PreviousTrackedRegion;
+		// We haven't found it in the tracked regions, so create a new one
+		TrackedRegion = ((struct TrackedRegion*)calloc(sizeof(struct TrackedRegion), sizeof(BYTE)));
 
-		TrackedRegion->NextTrackedRegion = ((struct TrackedRegion*)calloc(sizeof(struct TrackedRegion), sizeof(BYTE)));
-
-		if (TrackedRegion->NextTrackedRegion == NULL)
+		if (TrackedRegion == NULL)
 		{
 			DebugOutput("AddTrackedRegion: Failed to allocate new tracked region struct.\n");
 			return NULL;
 		}
 
-		TrackedRegion = TrackedRegion->NextTrackedRegion;
+		if (!VirtualQuery(Address, &TrackedRegion->MemInfo, sizeof(MEMORY_BASIC_INFORMATION)) || !TrackedRegion->MemInfo.AllocationBase)
+		{
+			ErrorOutput("AddTrackedRegion: unable to query memory region 0x%p", Address);
+			free(TrackedRegion);
+			return NULL;
+		}
+
+		// Regions are indexed by their whole allocation
+		TrackedRegion->AllocationBase = TrackedRegion->MemInfo.AllocationBase;
+		AllocationSize = GetAllocationSize(TrackedRegion->AllocationBase);
+		if (AllocationSize < TrackedRegion->MemInfo.RegionSize)
+			AllocationSize = (DWORD_PTR)TrackedRegion->MemInfo.BaseAddress + TrackedRegion->MemInfo.RegionSize - (DWORD_PTR)TrackedRegion->AllocationBase;
+
+		if (!RegionTreeInsert(&TrackedRegions, (uintptr_t)TrackedRegion->AllocationBase, (uintptr_t)TrackedRegion->AllocationBase + AllocationSize, TrackedRegion))
+		{
+			DebugOutput("AddTrackedRegion: Failed to index new tracked region at 0x%p.\n", TrackedRegion->AllocationBase);
+			free(TrackedRegion);
+			return NULL;
+		}
 #ifdef DEBUG_COMMENTS
 		DebugOutput("AddTrackedRegion: Created new tracked region for address 0x%p.\n", Address);
 #endif
@@ -836,14 +850,12 @@ PTRACKEDREGION AddTrackedRegion(PVOID Address, ULONG Protect)
 #endif
 	}
 
-	if (!VirtualQuery(Address, &TrackedRegion->MemInfo, sizeof(MEMORY_BASIC_INFORMATION)))
+	if (PageAlreadyTracked && !VirtualQuery(Address, &TrackedRegion->MemInfo, sizeof(MEMORY_BASIC_INFORMATION)))
 	{
 		ErrorOutput("AddTrackedRegion: unable to query memory region 0x%p", Address);
 		return NULL;
 	}
 
-	TrackedRegion->AllocationBase = TrackedRegion->MemInfo.AllocationBase;
-
 	if (Address != TrackedRegion->AllocationBase)
 		TrackedRegion->Address = Address;
 
@@ -891,65 +903,29 @@ PTRACKEDREGION AddTrackedRegion(PVOID Address, ULONG Protect)
 BOOL DropTrackedRegion(PTRACKEDREGION TrackedRegion)
 //**************************************************************************************
 {
-	PTRACKEDREGION CurrentTrackedRegion, PreviousTrackedRegion;
-
 	if (TrackedRegion == NULL)
 	{
 		DebugOutput("DropTrackedRegion: NULL passed as argument - error.\n");
 		return FALSE;
 	}
 
-	PreviousTrackedRegion = NULL;
-
-	if (TrackedRegionList == NULL)
+	if (RegionTreeLookup(&TrackedRegions, (uintptr_t)TrackedRegion->AllocationBase) != TrackedRegion)
 	{
-		DebugOutput("DropTrackedRegion: failed to obtain initial tracked region list.\n");
+		DebugOutput("DropTrackedRegion: failed to find tracked region in list.\n");
 		return FALSE;
 	}
 
-	CurrentTrackedRegion = TrackedRegionList;
-
-	while (CurrentTrackedRegion)
-	{
-#ifdef DEBUG_COMMENTS
-		DebugOutput("DropTrackedRegion: CurrentTrackedRegion 0x%x, AllocationBase 0x%x.\n", CurrentTrackedRegion, CurrentTrackedRegion->AllocationBase);
-#endif
+	// Clear any breakpoints in this region
+	//if (g_config.unpacker > 1)
+	//	ClearBreakpointsInRegion(TrackedRegion->AllocationBase);
 
-		if (CurrentTrackedRegion == TrackedRegion)
-		{
-			// Clear any breakpoints in this region
-			//if (g_config.unpacker > 1)
-			//	ClearBreakpointsInRegion(TrackedRegion->AllocationBase);
-
-			// Unlink this from the list and free the memory
-			if (PreviousTrackedRegion && CurrentTrackedRegion->NextTrackedRegion)
-			{
-				DebugOutput("DropTrackedRegion: removed region at 0x%p from tracked region list.\n", TrackedRegion->AllocationBase);
-				PreviousTrackedRegion->NextTrackedRegion = CurrentTrackedRegion->NextTrackedRegion;
-			}
-			else if (PreviousTrackedRegion && CurrentTrackedRegion->NextTrackedRegion == NULL)
-			{
-				DebugOutput("DropTrackedRegion: removed region at 0x%p from the end of the tracked region list.\n", TrackedRegion->AllocationBase);
-				PreviousTrackedRegion->NextTrackedRegion = NULL;
-			}
-			else if (!PreviousTrackedRegion)
-			{
-				DebugOutput("DropTrackedRegion: removed region at 0x%p from the head of the tracked region list.\n", TrackedRegion->AllocationBase);
-				TrackedRegionList = NULL;
-			}
-
-			free(CurrentTrackedRegion);
-
-			return TRUE;
-		}
+	RegionTreeRemove(&TrackedRegions, (uintptr_t)TrackedRegion->AllocationBase);
 
-		PreviousTrackedRegion = CurrentTrackedRegion;
-		CurrentTrackedRegion = CurrentTrackedRegion->NextTrackedRegion;
-	}
+	DebugOutput("DropTrackedRegion: removed region at 0x%p from tracked regions.\n", TrackedRegion->AllocationBase);
 
-	DebugOutput("DropTrackedRegion: failed to find tracked region in list.\n");
+	free(TrackedRegion);
 
-	return FALSE;
+	return TRUE;
 }
 
 //**************************************************************************************
@@ -1587,12 +1563,22 @@ void DumpStrings()
 	}
 }
 
+//**************************************************************************************
+static int ScanExceptionFilter(struct _EXCEPTION_POINTERS* ExceptionInfo, PVOID* FaultAddress)
+//**************************************************************************************
+{
+	if (ExceptionInfo->ExceptionRecord->ExceptionCode == EXCEPTION_ACCESS_VIOLATION && ExceptionInfo->ExceptionRecord->NumberParameters > 1)
+		*FaultAddress = (PVOID)ExceptionInfo->ExceptionRecord->ExceptionInformation[1];
+
+	return EXCEPTION_EXECUTE_HANDLER;
+}
+
 //**************************************************************************************
 int ScanPageForNonZero(PVOID Address)
 //**************************************************************************************
 {
-	unsigned int p;
 	DWORD_PTR AddressOfPage;
+	PVOID FaultAddress = NULL;
 
 	if (!Address)
 	{
@@ -1613,13 +1599,12 @@ int ScanPageForNonZero(PVOID Address)
 
 	__try
 	{
-		for (p=0; p<SystemInfo.dwPageSize-1; p++)
-			if (*((char*)AddressOfPage+p) != 0)
-				return 1;
+		if (!ZeroScanIsZero((PVOID)AddressOfPage, SystemInfo.dwPageSize-1))
+			return 1;
 	}
-	__except(EXCEPTION_EXECUTE_HANDLER)
+	__except(ScanExceptionFilter(GetExceptionInformation(), &FaultAddress))
 	{
-		DebugOutput("ScanPageForNonZero: Exception occurred reading memory address 0x%p\n", (char*)AddressOfPage+p);
+		DebugOutput("ScanPageForNonZero: Exception occurred reading memory address 0x%p\n", FaultAddress);
 		return 0;
 	}
 
@@ -1674,6 +1659,7 @@ int ScanForNonZero(PVOID Buffer, SIZE_T Size)
 //**************************************************************************************
 {
 	SIZE_T p;
+	PVOID FaultAddress = NULL;
 
 	if (!Buffer)
 	{
@@ -1692,24 +1678,25 @@ int ScanForNonZero(PVOID Buffer, SIZE_T Size)
 
 	__try
 	{
-		for (p=0; p <= Size-1; p++)
-			if (*((char*)Buffer+p) != 0)
-			{
-#ifdef DEBUG_COMMENTS
-				DebugOutput("ScanForNonZero: Non-zero found at 0x%p (0x%x)\n", (char*)Buffer+p, *((char*)Buffer+p));
-#endif
-				if (p)
-					return (int)p;
-				else
-					return 1;
-			}
+		p = ZeroScanForward(Buffer, Size);
 	}
-	__except(EXCEPTION_EXECUTE_HANDLER)
+	__except(ScanExceptionFilter(GetExceptionInformation(), &FaultAddress))
 	{
-		DebugOutput("ScanForNonZero: Exception occurred reading memory address 0x%p (buffer at 0x%p, size 0x%x)\n", (char*)Buffer+p, Buffer, Size);
+		DebugOutput("ScanForNonZero: Exception occurred reading memory address 0x%p (buffer at 0x%p, size 0x%x)\n", FaultAddress, Buffer, Size);
 		return 0;
 	}
 
+	if (p < Size)
+	{
+#ifdef DEBUG_COMMENTS
+		DebugOutput("ScanForNonZero: Non-zero found at 0x%p (0x%x)\n", (char*)Buffer+p, *((char*)Buffer+p));
+#endif
+		if (p)
+			return (int)p;
+		else
+			return 1;
+	}
+
 #ifdef DEBUG_COMMENTS
 	DebugOutput("ScanForNonZero: No data found at 0x%p (size %d bytes)\n", Buffer, Size);
 #endif
@@ -1721,6 +1708,7 @@ int ReverseScanForNonZero(PVOID Buffer, SIZE_T Size)
 //**************************************************************************************
 {
 	SIZE_T p;
+	PVOID FaultAddress = NULL;
 
 	if (!Buffer)
 	{
@@ -1740,19 +1728,22 @@ int ReverseScanForNonZero(PVOID Buffer, SIZE_T Size)
 		return 0;
 	}
 
+	// The first byte is not considered, as before
 	__try
 	{
-		for (p = Size - 1; p > 0; p--)
-			if (*((char*)Buffer+p) != 0)
-				return (int)p + 1;
+		p = ZeroScanReverse((PUCHAR)Buffer+1, Size-1);
 	}
-	__except(EXCEPTION_EXECUTE_HANDLER)
+	__except(ScanExceptionFilter(GetExceptionInformation(), &FaultAddress))
 	{
-		DebugOutput("ReverseScanForNonZero: Exception occurred reading memory address 0x%p (buffer at 0x%p, size 0x%x)\n", (char*)Buffer+p, Buffer, Size);
-		GetMemoryInfo((char*)Buffer+p);
+		DebugOutput("ReverseScanForNonZero: Exception occurred reading memory address 0x%p (buffer at 0x%p, size 0x%x)\n", FaultAddress, Buffer, Size);
+		if (FaultAddress)
+			GetMemoryInfo(FaultAddress);
 		return 0;
 	}
 
+	if (p)
+		return (int)p + 1;
+
 	return 0;
 }
 
@@ -1845,24 +1836,26 @@ int ScanForPE(PVOID Buffer, SIZE_T Size, PVOID* Offset)
 PCHAR ScanForExport(PVOID Address, SIZE_T ScanMax)
 //**************************************************************************************
 {
+	PEXPORTINDEX Index;
+	EXPORTINFO Info;
+	PCHAR ExportName = NULL;
+
 	if (!Address)
 		return NULL;
 
 	PVOID Base = GetAllocationBase(Address);
-	PIMAGE_NT_HEADERS pNtHeader = (PIMAGE_NT_HEADERS)((PUCHAR)Base + (ULONG)((PIMAGE_DOS_HEADER)Base)->e_lfanew);
-	PIMAGE_EXPORT_DIRECTORY ExportDirectory = (PIMAGE_EXPORT_DIRECTORY)((PUCHAR)Base + pNtHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress);
-	PDWORD AddressOfNames = (PDWORD)((PUCHAR)Base + ExportDirectory->AddressOfNames);
-	PDWORD AddressOfFunctions = (PDWORD)((PUCHAR)Base + ExportDirectory->AddressOfFunctions);
-	PWORD AddressOfNameOrdinals = (PWORD)((PUCHAR)Base + ExportDirectory->AddressOfNameOrdinals);
 
-	for (unsigned int j = 0; j < ExportDirectory->NumberOfFunctions; j++)
-	{
-		if ((PUCHAR)Address - (PUCHAR)Base > (int)AddressOfFunctions[AddressOfNameOrdinals[j]]
-		&& (PUCHAR)Address - (PUCHAR)Base - AddressOfFunctions[AddressOfNameOrdinals[j]] <= (int)ScanMax)
-			return (PCHAR)Base + AddressOfNames[j];
-	}
+	if (!Base)
+		return NULL;
+
+	Index = ExportIndexAcquire((uintptr_t)Base);
+
+	if (ExportIndexLookupRva(Index, (uint32_t)((PUCHAR)Address - (PUCHAR)Base), (uint32_t)ScanMax, &Info))
+		ExportName = (PCHAR)Info.Name;
+
+	ExportIndexRelease(Index);
 
-    return NULL;
+	return ExportName;
 }
 
 //**************************************************************************************
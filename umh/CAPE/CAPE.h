@@ -159,11 +159,8 @@ typedef struct TrackedRegion
 	BOOL						BreakpointsSet;
 	BOOL						BreakpointsSaved;
 	struct ThreadBreakpoints	*TrackedRegionBreakpoints;
-	struct TrackedRegion		*NextTrackedRegion;
 } TRACKEDREGION, *PTRACKEDREGION;
 
-struct TrackedRegion *TrackedRegionList;
-
 PTRACKEDREGION AddTrackedRegion(PVOID Address, ULONG Protect);
 PTRACKEDREGION GetTrackedRegion(PVOID Address);
 BOOL DropTrackedRegion(PTRACKEDREGION TrackedRegion);
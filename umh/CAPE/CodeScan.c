@@ -0,0 +1,473 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "CodeScan.h"
+
+#define CODESCAN_MAX_THREADS 16
+#define CODESCAN_CHUNK_SIZE (1 << 20)
+#define CODESCAN_OVERLAP 4096
+#define CODESCAN_MIN_OVERLAP 256
+#define CODESCAN_BATCH 200
+// Instructions starting this close to where a chunk's decoding stops may
+// have been cut short, so only those before it are used
+#define CODESCAN_MARGIN 32
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef HANDLE THREAD;
+typedef volatile LONG COUNTER;
+
+#define NextChunk(Scan) ((size_t)InterlockedIncrement(&(Scan)->Claimed) - 1)
+#else
+#include <pthread.h>
+#include <unistd.h>
+
+typedef pthread_t THREAD;
+typedef long COUNTER;
+
+#define NextChunk(Scan) ((size_t)__atomic_fetch_add(&(Scan)->Claimed, 1, __ATOMIC_RELAXED))
+#endif
+
+typedef struct CodeScanChunk
+{
+	size_t			Start, End;		// the chunk's own bytes
+	size_t			Reliable;		// instructions starting before here were decoded in full
+	size_t			Stop;			// the end of its last instruction before Reliable
+	unsigned char	*Head;			// a bit for each of the first Overlap bytes: an instruction starts there
+	size_t			*Tail;			// the instructions starting between End and Reliable
+	size_t			TailCount;
+	_DInst			*Hits;			// the instructions accepted by the filter
+	size_t			*HitOffsets;
+	size_t			HitCount, HitCapacity;
+	int				Failed;
+} CODESCANCHUNK, *PCODESCANCHUNK;
+
+typedef struct CodeScan
+{
+	CODESCANCONFIG		Config;
+	const unsigned char	*Code;
+	size_t				Size;
+	uintptr_t			Address;
+	uint64_t			Mask;			// of the addresses distorm returns
+	PCODESCANCHUNK		Chunks;
+	size_t				ChunkCount;
+	COUNTER				Claimed;
+} CODESCAN, *PCODESCAN;
+
+typedef int (*CODESCAN_VISIT)(void *Context, size_t Offset, const _DInst *Instruction);
+
+// Decodes from Position in batches, each resuming where distorm stopped, so
+// that the instructions are those of one pass however the batches fall.
+// Visit is called for each instruction until it declines one, whose offset
+// is returned, or the code runs out.
+static size_t Sweep(PCODESCAN Scan, size_t Position, size_t Length, _DInst *Batch, CODESCAN_VISIT Visit, void *Context)
+{
+	_CodeInfo CodeInfo;
+	_DecodeResult Result;
+	unsigned int Count, i;
+	size_t Next;
+
+	while (Position < Length)
+	{
+		memset(&CodeInfo, 0, sizeof(CodeInfo));
+		CodeInfo.code = Scan->Code + Position;
+		CodeInfo.codeLen = (int)(Length - Position);
+		CodeInfo.codeOffset = Scan->Address + Position;
+		CodeInfo.dt = Scan->Config.DecodeType;
+
+		Count = 0;
+		Result = distorm_decompose(&CodeInfo, Batch, CODESCAN_BATCH, &Count);
+
+		if (Result == DECRES_INPUTERR || !Count)
+			break;
+
+		for (i = 0; i < Count; i++)
+		{
+			size_t Offset = Position + (size_t)((Batch[i].addr - Batch[0].addr) & Scan->Mask);
+
+			if (!Visit(Context, Offset, &Batch[i]))
+				return Offset;
+		}
+
+		if (Result == DECRES_SUCCESS)
+			break;
+
+		// Runs of prefixes don't move nextOffset, but always end a batch whole
+		Next = (size_t)((CodeInfo.nextOffset - CodeInfo.codeOffset) & Scan->Mask);
+		if (!Next)
+			Next = (size_t)((Batch[Count - 1].addr - Batch[0].addr) & Scan->Mask) + Batch[Count - 1].size;
+		Position += Next;
+	}
+
+	return Length;
+}
+
+static int AddHit(PCODESCANCHUNK Chunk, size_t Offset, const _DInst *Instruction)
+{
+	if (Chunk->HitCount == Chunk->HitCapacity)
+	{
+		size_t Capacity = Chunk->HitCapacity ? Chunk->HitCapacity * 2 : 64;
+		_DInst *Hits = (_DInst *)realloc(Chunk->Hits, Capacity * sizeof(_DInst));
+		size_t *Offsets;
+
+		if (!Hits)
+			return 0;
+		Chunk->Hits = Hits;
+
+		Offsets = (size_t *)realloc(Chunk->HitOffsets, Capacity * sizeof(size_t));
+		if (!Offsets)
+			return 0;
+		Chunk->HitOffsets = Offsets;
+
+		Chunk->HitCapacity = Capacity;
+	}
+
+	Chunk->Hits[Chunk->HitCount] = *Instruction;
+	Chunk->HitOffsets[Chunk->HitCount] = Offset;
+	Chunk->HitCount++;
+
+	return 1;
+}
+
+static int HeadStart(PCODESCAN Scan, PCODESCANCHUNK Chunk, size_t Offset)
+{
+	size_t Bit = Offset - Chunk->Start;
+
+	return Offset >= Chunk->Start && Bit < Scan->Config.Overlap && (Chunk->Head[Bit / 8] & (1 << (Bit % 8)));
+}
+
+typedef struct ChunkVisit
+{
+	PCODESCAN		Scan;
+	PCODESCANCHUNK	Chunk;
+} CHUNKVISIT;
+
+static int VisitChunk(void *Context, size_t Offset, const _DInst *Instruction)
+{
+	CHUNKVISIT *Visit = (CHUNKVISIT *)Context;
+	PCODESCANCHUNK Chunk = Visit->Chunk;
+	size_t Bit = Offset - Chunk->Start;
+
+	if (Offset >= Chunk->Reliable)
+		return 0;
+
+	// Undecodable bytes may be inside an instruction distorm dropped, so
+	// streams are only joined and resumed at instructions
+	if (Instruction->flags == FLAG_NOT_DECODABLE)
+		return 1;
+
+	if (Bit < Visit->Scan->Config.Overlap)
+		Chunk->Head[Bit / 8] |= 1 << (Bit % 8);
+
+	if (Offset >= Chunk->End)
+		Chunk->Tail[Chunk->TailCount++] = Offset;
+
+	if (Visit->Scan->Config.Filter(Instruction, Visit->Scan->Config.Context) && !AddHit(Chunk, Offset, Instruction))
+	{
+		Chunk->Failed = 1;
+		return 0;
+	}
+
+	Chunk->Stop = Offset + Instruction->size;
+
+	return 1;
+}
+
+static void DecodeChunk(PCODESCAN Scan, PCODESCANCHUNK Chunk, _DInst *Batch)
+{
+	CHUNKVISIT Visit;
+	size_t Limit = Chunk->End + Scan->Config.Overlap < Scan->Size ? Chunk->End + Scan->Config.Overlap : Scan->Size;
+
+	Chunk->Reliable = Limit == Scan->Size ? Limit : Limit - CODESCAN_MARGIN;
+	Chunk->Head = (unsigned char *)calloc(Scan->Config.Overlap / 8 + 1, 1);
+	Chunk->Tail = (size_t *)malloc((Limit - Chunk->End + 1) * sizeof(size_t));
+
+	if (!Chunk->Head || !Chunk->Tail)
+	{
+		Chunk->Failed = 1;
+		return;
+	}
+
+	Visit.Scan = Scan;
+	Visit.Chunk = Chunk;
+	Chunk->Stop = Chunk->Start;
+	Sweep(Scan, Chunk->Start, Limit, Batch, VisitChunk, &Visit);
+}
+
+static void Worker(PCODESCAN Scan)
+{
+	_DInst *Batch = (_DInst *)malloc(CODESCAN_BATCH * sizeof(_DInst));
+	size_t i;
+
+	while ((i = NextChunk(Scan)) < Scan->ChunkCount)
+	{
+		if (Batch)
+			DecodeChunk(Scan, &Scan->Chunks[i], Batch);
+		else
+			Scan->Chunks[i].Failed = 1;
+	}
+
+	free(Batch);
+}
+
+static void ThreadWorker(PCODESCAN Scan)
+{
+	if (Scan->Config.ThreadStart)
+		Scan->Config.ThreadStart(Scan->Config.Context);
+
+	Worker(Scan);
+
+	if (Scan->Config.ThreadEnd)
+		Scan->Config.ThreadEnd(Scan->Config.Context);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI WorkerThread(LPVOID Parameter)
+{
+	ThreadWorker((PCODESCAN)Parameter);
+	return 0;
+}
+#else
+static void *WorkerThread(void *Parameter)
+{
+	ThreadWorker((PCODESCAN)Parameter);
+	return NULL;
+}
+#endif
+
+static int StartThread(PCODESCAN Scan, THREAD *Thread)
+{
+#ifdef _WIN32
+	*Thread = CreateThread(NULL, 0, WorkerThread, Scan, 0, NULL);
+	return *Thread != NULL;
+#else
+	return !pthread_create(Thread, NULL, WorkerThread, Scan);
+#endif
+}
+
+static void JoinThread(THREAD Thread)
+{
+#ifdef _WIN32
+	WaitForSingleObject(Thread, INFINITE);
+	CloseHandle(Thread);
+#else
+	pthread_join(Thread, NULL);
+#endif
+}
+
+static unsigned int ProcessorCount(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO SystemInfo;
+
+	GetSystemInfo(&SystemInfo);
+	return SystemInfo.dwNumberOfProcessors;
+#else
+	long Count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return Count > 0 ? (unsigned int)Count : 1;
+#endif
+}
+
+typedef struct MergeVisit
+{
+	PCODESCAN		Scan;
+	PCODESCANCHUNK	Chunk;		// the chunk being rejoined
+	PCODESCANCHUNK	Output;
+} MERGEVISIT;
+
+// Decoding on from where a chunk left off, until an instruction starts on the next chunk's stream or past it
+static int VisitMerge(void *Context, size_t Offset, const _DInst *Instruction)
+{
+	MERGEVISIT *Visit = (MERGEVISIT *)Context;
+
+	if (Instruction->flags == FLAG_NOT_DECODABLE)
+		return 1;
+
+	if (Offset >= Visit->Chunk->End || HeadStart(Visit->Scan, Visit->Chunk, Offset))
+		return 0;
+
+	if (Visit->Scan->Config.Filter(Instruction, Visit->Scan->Config.Context) && !AddHit(Visit->Output, Offset, Instruction))
+	{
+		Visit->Output->Failed = 1;
+		return 0;
+	}
+
+	return 1;
+}
+
+static int Merge(PCODESCAN Scan, PCODESCANCHUNK Output)
+{
+	_DInst *Batch = NULL;
+	size_t Position = 0, Join, i, k;
+
+	for (k = 0; k < Scan->ChunkCount && Position < Scan->Size; k++)
+	{
+		PCODESCANCHUNK Chunk = &Scan->Chunks[k], Next = k + 1 < Scan->ChunkCount ? &Scan->Chunks[k + 1] : NULL;
+
+		if (Chunk->Failed)
+		{
+			Output->Failed = 1;
+			break;
+		}
+
+		if (!HeadStart(Scan, Chunk, Position))
+		{
+			MERGEVISIT Visit;
+
+			if (!Batch && !(Batch = (_DInst *)malloc(CODESCAN_BATCH * sizeof(_DInst))))
+			{
+				Output->Failed = 1;
+				break;
+			}
+
+			Visit.Scan = Scan;
+			Visit.Chunk = Chunk;
+			Visit.Output = Output;
+			Position = Sweep(Scan, Position, Scan->Size, Batch, VisitMerge, &Visit);
+
+			if (Output->Failed)
+				break;
+
+			if (!HeadStart(Scan, Chunk, Position))
+				continue;
+		}
+
+		// On the chunk's stream: its instructions are used up to where they meet the next chunk's
+		Join = Chunk->Stop;
+		if (Next)
+		{
+			for (i = 0; i < Chunk->TailCount; i++)
+			{
+				if (Chunk->Tail[i] >= Position && HeadStart(Scan, Next, Chunk->Tail[i]))
+				{
+					Join = Chunk->Tail[i];
+					break;
+				}
+			}
+		}
+
+		for (i = 0; i < Chunk->HitCount; i++)
+		{
+			if (Chunk->HitOffsets[i] >= Position && Chunk->HitOffsets[i] < Join && !AddHit(Output, Chunk->HitOffsets[i], &Chunk->Hits[i]))
+			{
+				Output->Failed = 1;
+				break;
+			}
+		}
+
+		Position = Join;
+	}
+
+	free(Batch);
+
+	return !Output->Failed;
+}
+
+//**************************************************************************************
+int CodeScanDecompose(const CODESCANCONFIG *Config, const unsigned char *Code, size_t Size, uintptr_t Address, _DInst **Instructions, size_t *Count)
+//**************************************************************************************
+{
+	CODESCAN Scan;
+	CODESCANCHUNK Output;
+	THREAD Threads[CODESCAN_MAX_THREADS];
+	unsigned int ThreadCount = 0, Wanted;
+	size_t i;
+	int Result;
+
+	*Instructions = NULL;
+	*Count = 0;
+
+	memset(&Scan, 0, sizeof(Scan));
+	memset(&Output, 0, sizeof(Output));
+	Scan.Config = *Config;
+	Scan.Code = Code;
+	Scan.Size = Size;
+	Scan.Address = Address;
+	Scan.Mask = Config->DecodeType == Decode64Bits ? (uint64_t)-1 : Config->DecodeType == Decode32Bits ? 0xffffffff : 0xffff;
+
+	if (!Size)
+		return 1;
+
+	Wanted = Config->Threads ? Config->Threads : ProcessorCount();
+	if (Wanted > CODESCAN_MAX_THREADS)
+		Wanted = CODESCAN_MAX_THREADS;
+
+	if (!Scan.Config.ChunkSize)
+		Scan.Config.ChunkSize = CODESCAN_CHUNK_SIZE;
+	if (!Scan.Config.Overlap)
+		Scan.Config.Overlap = CODESCAN_OVERLAP;
+	if (Scan.Config.Overlap < CODESCAN_MIN_OVERLAP)
+		Scan.Config.Overlap = CODESCAN_MIN_OVERLAP;
+
+	// A single chunk is one pass on the caller's thread
+	if (Wanted < 2)
+		Scan.Config.ChunkSize = Size;
+
+	Scan.ChunkCount = (Size + Scan.Config.ChunkSize - 1) / Scan.Config.ChunkSize;
+	Scan.Chunks = (PCODESCANCHUNK)calloc(Scan.ChunkCount, sizeof(CODESCANCHUNK));
+	if (!Scan.Chunks)
+		return 0;
+
+	for (i = 0; i < Scan.ChunkCount; i++)
+	{
+		Scan.Chunks[i].Start = i * Scan.Config.ChunkSize;
+		Scan.Chunks[i].End = i + 1 < Scan.ChunkCount ? Scan.Chunks[i].Start + Scan.Config.ChunkSize : Size;
+	}
+
+	// The caller decodes too, and alone if no thread starts
+	while (ThreadCount + 1 < Wanted && ThreadCount + 1 < Scan.ChunkCount && StartThread(&Scan, &Threads[ThreadCount]))
+		ThreadCount++;
+
+	Worker(&Scan);
+
+	for (i = 0; i < ThreadCount; i++)
+		JoinThread(Threads[i]);
+
+	Result = Merge(&Scan, &Output);
+
+	for (i = 0; i < Scan.ChunkCount; i++)
+	{
+		free(Scan.Chunks[i].Head);
+		free(Scan.Chunks[i].Tail);
+		free(Scan.Chunks[i].Hits);
+		free(Scan.Chunks[i].HitOffsets);
+	}
+	free(Scan.Chunks);
+	free(Output.HitOffsets);
+
+	if (!Result)
+	{
+		free(Output.Hits);
+		return 0;
+	}
+
+	*Instructions = Output.Hits;
+	*Count = Output.HitCount;
+
+	return 1;
+}
+
+//**************************************************************************************
+void CodeScanFree(_DInst *Instructions)
+//**************************************************************************************
+{
+	free(Instructions);
+}
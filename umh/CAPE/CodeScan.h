@@ -0,0 +1,58 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <distorm.h>
+
+// Parallel decomposition of a large block of code, for Scylla's IAT
+// reference scan. The code is split into chunks decoded by a pool of
+// workers, each also decoding a little way into the next chunk. Where a
+// chunk's instructions meet an instruction start of the next, the two agree
+// from there on, which is where the next chunk's instructions are joined in.
+// Chunks that never meet are decoded again on the caller's thread from where
+// the last one left off, so the result is always that of one distorm pass
+// from the start: the instructions the filter accepts, in address order.
+
+typedef int (*CODESCAN_FILTER)(const _DInst *Instruction, void *Context);
+typedef void (*CODESCAN_THREAD_CALLBACK)(void *Context);
+
+typedef struct CodeScanConfig
+{
+	_DecodeType					DecodeType;
+	unsigned int				Threads;		// 0 for one per processor, 1 to decode on the caller's thread only
+	size_t						ChunkSize;		// 0 for the default
+	size_t						Overlap;		// decoded past the end of each chunk, 0 for the default
+	CODESCAN_FILTER				Filter;			// called on the workers for each decodable instruction
+	CODESCAN_THREAD_CALLBACK	ThreadStart;	// called by each worker thread as it starts, optional
+	CODESCAN_THREAD_CALLBACK	ThreadEnd;		// and as it exits, optional
+	void						*Context;
+} CODESCANCONFIG, *PCODESCANCONFIG;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns 0 on allocation failure; Instructions is freed with CodeScanFree
+int CodeScanDecompose(const CODESCANCONFIG *Config, const unsigned char *Code, size_t Size, uintptr_t Address, _DInst **Instructions, size_t *Count);
+void CodeScanFree(_DInst *Instructions);
+
+#ifdef __cplusplus
+}
+#endif
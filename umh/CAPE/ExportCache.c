@@ -0,0 +1,519 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ExportCache.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef SRWLOCK LOCK;
+
+#define LockInit(Lock) InitializeSRWLock(Lock)
+#define LockFree(Lock)
+#define LockAcquire(Lock) AcquireSRWLockExclusive(Lock)
+#define LockRelease(Lock) ReleaseSRWLockExclusive(Lock)
+#else
+#include <pthread.h>
+
+typedef pthread_mutex_t LOCK;
+
+#define LockInit(Lock) pthread_mutex_init(Lock, NULL)
+#define LockFree(Lock) pthread_mutex_destroy(Lock)
+#define LockAcquire(Lock) pthread_mutex_lock(Lock)
+#define LockRelease(Lock) pthread_mutex_unlock(Lock)
+#endif
+
+#define INITIAL_MODULES	64
+
+typedef struct ExportCacheEntry
+{
+	uintptr_t		Base;
+	uint32_t		Size;
+	uint64_t		Stamp;
+	void			*Exports;
+	uintptr_t		*Targets;		// modules its forwarders resolved into
+	size_t			TargetCount;
+	char			*Unresolved;	// the modules forwarders named that did not resolve, one name after another
+	size_t			UnresolvedCount;
+	int				Stale;
+	unsigned int	Pass;			// the last pass it was used in
+} EXPORTCACHEENTRY, *PEXPORTCACHEENTRY;
+
+typedef struct ExportCacheList
+{
+	PEXPORTCACHEENTRY	*Entries;
+	size_t				Count, Capacity;
+} EXPORTCACHELIST, *PEXPORTCACHELIST;
+
+struct ExportCache
+{
+	LOCK				Lock;
+	EXPORTCACHEFREE		Free;
+	EXPORTCACHELIST		Modules;	// sorted by Base
+	EXPORTCACHELIST		Retired;	// replaced during the pass, freed at its end
+	unsigned int		Pass;
+};
+
+static int ListInsert(PEXPORTCACHELIST List, size_t Position, PEXPORTCACHEENTRY Entry)
+{
+	if (List->Count == List->Capacity)
+	{
+		size_t NewCapacity = List->Capacity ? List->Capacity * 2 : INITIAL_MODULES;
+		PEXPORTCACHEENTRY *NewEntries = (PEXPORTCACHEENTRY*)realloc(List->Entries, NewCapacity * sizeof(PEXPORTCACHEENTRY));
+
+		if (!NewEntries)
+			return 0;
+
+		List->Entries = NewEntries;
+		List->Capacity = NewCapacity;
+	}
+
+	memmove(&List->Entries[Position + 1], &List->Entries[Position], (List->Count - Position) * sizeof(PEXPORTCACHEENTRY));
+	List->Entries[Position] = Entry;
+	List->Count++;
+
+	return 1;
+}
+
+// The position of the module at Base, or where it would go
+static size_t FindModule(PEXPORTCACHE Cache, uintptr_t Base)
+{
+	size_t Low = 0, High = Cache->Modules.Count;
+
+	while (Low < High)
+	{
+		size_t Middle = Low + (High - Low) / 2;
+
+		if (Cache->Modules.Entries[Middle]->Base < Base)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	return Low;
+}
+
+static PEXPORTCACHEENTRY ModuleAt(PEXPORTCACHE Cache, uintptr_t Base, size_t *Position)
+{
+	*Position = FindModule(Cache, Base);
+
+	if (*Position < Cache->Modules.Count && Cache->Modules.Entries[*Position]->Base == Base)
+		return Cache->Modules.Entries[*Position];
+
+	return NULL;
+}
+
+static void FreeEntry(PEXPORTCACHE Cache, PEXPORTCACHEENTRY Entry)
+{
+	if (Cache->Free)
+		Cache->Free(Entry->Exports);
+
+	free(Entry->Targets);
+	free(Entry->Unresolved);
+	free(Entry);
+}
+
+// The file name at the end of a path
+static const char *FileName(const char *Path)
+{
+	const char *Name = Path;
+
+	for (; *Path; Path++)
+		if (*Path == '\\' || *Path == '/')
+			Name = Path + 1;
+
+	return Name;
+}
+
+static int SameName(const char *A, const char *B)
+{
+	while (*A && tolower((unsigned char)*A) == tolower((unsigned char)*B))
+	{
+		A++;
+		B++;
+	}
+
+	return tolower((unsigned char)*A) == tolower((unsigned char)*B);
+}
+
+// Marks modules with forwarders into the module Name that did not resolve,
+// or with any that did not if the name is not known
+static void MarkWaiting(PEXPORTCACHE Cache, const char *Name)
+{
+	if (Name)
+		Name = FileName(Name);
+
+	for (size_t i = 0; i < Cache->Modules.Count; i++)
+	{
+		PEXPORTCACHEENTRY Entry = Cache->Modules.Entries[i];
+		const char *Unresolved = Entry->Unresolved;
+
+		for (size_t j = 0; j < Entry->UnresolvedCount && !Entry->Stale; j++)
+		{
+			if (!Name || SameName(Unresolved, Name))
+				Entry->Stale = 1;
+			Unresolved += strlen(Unresolved) + 1;
+		}
+	}
+}
+
+//**************************************************************************************
+PEXPORTCACHE ExportCacheCreate(EXPORTCACHEFREE Free)
+//**************************************************************************************
+{
+	PEXPORTCACHE Cache = (PEXPORTCACHE)calloc(1, sizeof(EXPORTCACHE));
+
+	if (!Cache)
+		return NULL;
+
+	LockInit(&Cache->Lock);
+	Cache->Free = Free;
+
+	return Cache;
+}
+
+//**************************************************************************************
+void ExportCacheDestroy(PEXPORTCACHE Cache)
+//**************************************************************************************
+{
+	if (!Cache)
+		return;
+
+	for (size_t i = 0; i < Cache->Modules.Count; i++)
+		FreeEntry(Cache, Cache->Modules.Entries[i]);
+	for (size_t i = 0; i < Cache->Retired.Count; i++)
+		FreeEntry(Cache, Cache->Retired.Entries[i]);
+
+	free(Cache->Modules.Entries);
+	free(Cache->Retired.Entries);
+	LockFree(&Cache->Lock);
+	free(Cache);
+}
+
+//**************************************************************************************
+size_t ExportCacheCount(PEXPORTCACHE Cache)
+//**************************************************************************************
+{
+	size_t Count;
+
+	if (!Cache)
+		return 0;
+
+	LockAcquire(&Cache->Lock);
+	Count = Cache->Modules.Count;
+	LockRelease(&Cache->Lock);
+
+	return Count;
+}
+
+static int CompareModules(const void *A, const void *B)
+{
+	const EXPORTCACHEMODULE *a = (const EXPORTCACHEMODULE*)A, *b = (const EXPORTCACHEMODULE*)B;
+
+	return a->Base < b->Base ? -1 : a->Base > b->Base;
+}
+
+// The module at Base in a list sorted by base, or NULL
+static const EXPORTCACHEMODULE *ListedModule(const EXPORTCACHEMODULE *Modules, size_t Count, uintptr_t Base)
+{
+	size_t Low = 0, High = Count;
+
+	while (Low < High)
+	{
+		size_t Middle = Low + (High - Low) / 2;
+
+		if (Modules[Middle].Base < Base)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	return Low < Count && Modules[Low].Base == Base ? &Modules[Low] : NULL;
+}
+
+// Marks modules whose forwarders resolved into a stale module or one no
+// longer cached, in two steps so that a module is not judged by a target
+// only marked in this call
+static void MarkDependents(PEXPORTCACHE Cache)
+{
+	size_t Count = Cache->Modules.Count;
+	uint8_t *Changed = (uint8_t*)malloc(Count + 1);
+
+	for (size_t i = 0; i < Count; i++)
+	{
+		PEXPORTCACHEENTRY Entry = Cache->Modules.Entries[i];
+
+		if (Changed)
+			Changed[i] = (uint8_t)Entry->Stale;
+		else
+			Entry->Stale = 1;
+	}
+
+	if (!Changed)
+		return;
+
+	for (size_t i = 0; i < Count; i++)
+	{
+		PEXPORTCACHEENTRY Entry = Cache->Modules.Entries[i];
+
+		for (size_t j = 0; j < Entry->TargetCount && !Entry->Stale; j++)
+		{
+			size_t Position;
+
+			if (!ModuleAt(Cache, Entry->Targets[j], &Position) || Changed[Position])
+				Entry->Stale = 1;
+		}
+	}
+
+	free(Changed);
+}
+
+//**************************************************************************************
+void ExportCacheBegin(PEXPORTCACHE Cache, const EXPORTCACHEMODULE *Modules, size_t Count)
+//**************************************************************************************
+{
+	PEXPORTCACHEMODULE Sorted = NULL;
+	uint8_t *Added = NULL;
+
+	if (!Cache)
+		return;
+
+	if (Count)
+	{
+		Added = (uint8_t*)malloc(Count);
+		Sorted = (PEXPORTCACHEMODULE)malloc(Count * sizeof(EXPORTCACHEMODULE));
+		if (Sorted)
+		{
+			memcpy(Sorted, Modules, Count * sizeof(EXPORTCACHEMODULE));
+			qsort(Sorted, Count, sizeof(EXPORTCACHEMODULE), CompareModules);
+		}
+	}
+
+	LockAcquire(&Cache->Lock);
+	Cache->Pass++;
+
+	// modules that have gone or changed
+	for (size_t i = 0; i < Cache->Modules.Count; i++)
+	{
+		PEXPORTCACHEENTRY Entry = Cache->Modules.Entries[i];
+		const EXPORTCACHEMODULE *Module = Sorted ? ListedModule(Sorted, Count, Entry->Base) : NULL;
+
+		if (!Module || Module->Size != Entry->Size || Module->Stamp != Entry->Stamp)
+			Entry->Stale = 1;
+	}
+
+	// modules that are new, or changed, may resolve forwarders into them that
+	// did not resolve before, found before marking so that a module is not
+	// taken as changed for waiting on another
+	for (size_t i = 0; i < Count; i++)
+	{
+		size_t Position;
+		PEXPORTCACHEENTRY Entry = ModuleAt(Cache, Modules[i].Base, &Position);
+
+		if (!Added && (!Entry || Entry->Stale))
+			MarkWaiting(Cache, NULL);
+		else if (Added)
+			Added[i] = !Entry || Entry->Stale;
+	}
+
+	for (size_t i = 0; i < Count && Added; i++)
+		if (Added[i])
+			MarkWaiting(Cache, Modules[i].Name);
+
+	MarkDependents(Cache);
+	LockRelease(&Cache->Lock);
+
+	free(Added);
+	free(Sorted);
+}
+
+//**************************************************************************************
+void *ExportCacheLookup(PEXPORTCACHE Cache, uintptr_t Base, uint32_t Size, uint64_t Stamp)
+//**************************************************************************************
+{
+	PEXPORTCACHEENTRY Entry;
+	void *Exports = NULL;
+	size_t Position;
+
+	if (!Cache)
+		return NULL;
+
+	LockAcquire(&Cache->Lock);
+	Entry = ModuleAt(Cache, Base, &Position);
+	if (Entry && !Entry->Stale && Entry->Size == Size && Entry->Stamp == Stamp)
+	{
+		Entry->Pass = Cache->Pass;
+		Exports = Entry->Exports;
+	}
+	LockRelease(&Cache->Lock);
+
+	return Exports;
+}
+
+//**************************************************************************************
+int ExportCacheStore(PEXPORTCACHE Cache, uintptr_t Base, uint32_t Size, uint64_t Stamp, void *Exports, const uintptr_t *Targets, size_t TargetCount, const char * const *Unresolved, size_t UnresolvedCount)
+//**************************************************************************************
+{
+	PEXPORTCACHEENTRY Entry, Old;
+	size_t Position, Length = 0;
+
+	if (!Cache)
+		return 0;
+
+	Entry = (PEXPORTCACHEENTRY)calloc(1, sizeof(EXPORTCACHEENTRY));
+	if (!Entry)
+		return 0;
+
+	if (TargetCount)
+	{
+		Entry->Targets = (uintptr_t*)malloc(TargetCount * sizeof(uintptr_t));
+		if (!Entry->Targets)
+		{
+			free(Entry);
+			return 0;
+		}
+		memcpy(Entry->Targets, Targets, TargetCount * sizeof(uintptr_t));
+	}
+
+	for (size_t i = 0; i < UnresolvedCount; i++)
+		Length += strlen(Unresolved[i]) + 1;
+
+	if (Length)
+	{
+		Entry->Unresolved = (char*)malloc(Length);
+		if (!Entry->Unresolved)
+		{
+			free(Entry->Targets);
+			free(Entry);
+			return 0;
+		}
+		Length = 0;
+		for (size_t i = 0; i < UnresolvedCount; i++)
+		{
+			size_t NameLength = strlen(Unresolved[i]) + 1;
+
+			memcpy(Entry->Unresolved + Length, Unresolved[i], NameLength);
+			Length += NameLength;
+		}
+	}
+
+	Entry->Base = Base;
+	Entry->Size = Size;
+	Entry->Stamp = Stamp;
+	Entry->Exports = Exports;
+	Entry->TargetCount = TargetCount;
+	Entry->UnresolvedCount = Length ? UnresolvedCount : 0;
+
+	LockAcquire(&Cache->Lock);
+	Entry->Pass = Cache->Pass;
+	Old = ModuleAt(Cache, Base, &Position);
+	if (Old)
+	{
+		// its exports may have been handed out earlier in the pass
+		if (!ListInsert(&Cache->Retired, Cache->Retired.Count, Old))
+		{
+			LockRelease(&Cache->Lock);
+			free(Entry->Targets);
+			free(Entry->Unresolved);
+			free(Entry);
+			return 0;
+		}
+		Cache->Modules.Entries[Position] = Entry;
+	}
+	else if (!ListInsert(&Cache->Modules, Position, Entry))
+	{
+		LockRelease(&Cache->Lock);
+		free(Entry->Targets);
+		free(Entry->Unresolved);
+		free(Entry);
+		return 0;
+	}
+	LockRelease(&Cache->Lock);
+
+	return 1;
+}
+
+//**************************************************************************************
+void ExportCacheEnd(PEXPORTCACHE Cache)
+//**************************************************************************************
+{
+	EXPORTCACHELIST Unused;
+	size_t Kept = 0;
+
+	if (!Cache)
+		return;
+
+	LockAcquire(&Cache->Lock);
+	Unused = Cache->Retired;
+	memset(&Cache->Retired, 0, sizeof(Cache->Retired));
+	for (size_t i = 0; i < Cache->Modules.Count; i++)
+	{
+		PEXPORTCACHEENTRY Entry = Cache->Modules.Entries[i];
+
+		if (Entry->Pass == Cache->Pass || !ListInsert(&Unused, Unused.Count, Entry))
+			Cache->Modules.Entries[Kept++] = Entry;
+	}
+	Cache->Modules.Count = Kept;
+	LockRelease(&Cache->Lock);
+
+	// freed outside the lock, as notifications may be waiting on it
+	for (size_t i = 0; i < Unused.Count; i++)
+		FreeEntry(Cache, Unused.Entries[i]);
+	free(Unused.Entries);
+}
+
+//**************************************************************************************
+void ExportCacheModuleLoaded(PEXPORTCACHE Cache, uintptr_t Base, const char *Name)
+//**************************************************************************************
+{
+	PEXPORTCACHEENTRY Entry;
+	size_t Position;
+
+	if (!Cache)
+		return;
+
+	LockAcquire(&Cache->Lock);
+	Entry = ModuleAt(Cache, Base, &Position);
+	if (Entry)
+		Entry->Stale = 1;
+	MarkWaiting(Cache, Name);
+	MarkDependents(Cache);
+	LockRelease(&Cache->Lock);
+}
+
+//**************************************************************************************
+void ExportCacheModuleUnloaded(PEXPORTCACHE Cache, uintptr_t Base)
+//**************************************************************************************
+{
+	PEXPORTCACHEENTRY Entry;
+	size_t Position;
+
+	if (!Cache)
+		return;
+
+	LockAcquire(&Cache->Lock);
+	Entry = ModuleAt(Cache, Base, &Position);
+	if (Entry)
+	{
+		Entry->Stale = 1;
+		MarkDependents(Cache);
+	}
+	LockRelease(&Cache->Lock);
+}
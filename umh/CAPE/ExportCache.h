@@ -0,0 +1,72 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Cache of the exports read from each module of a process, kept across
+// Scylla dumps so that only modules that are new or have changed since the
+// last dump need their export tables read again. The exports themselves are
+// the caller's, handed over with a function to free them. A module is known
+// by its base, size of image and a stamp taken from its headers, and also
+// depends on the modules its forwarded exports resolved into, so it is read
+// again when one of those changes or goes, and when a module is loaded that
+// some of its forwarders named but did not resolve into. Each pass starts
+// from the process's current module list; loader notifications can also mark
+// modules stale from any thread. Nothing is freed until the reading thread ends its
+// pass, so exports looked up in a pass stay valid until the next one ends.
+
+typedef struct ExportCache EXPORTCACHE, *PEXPORTCACHE;
+
+typedef void (*EXPORTCACHEFREE)(void *Exports);
+
+typedef struct ExportCacheModule
+{
+	uintptr_t	Base;
+	uint32_t	Size;
+	uint64_t	Stamp;
+	const char	*Name;		// its file name or path, NULL if not known
+} EXPORTCACHEMODULE, *PEXPORTCACHEMODULE;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+PEXPORTCACHE ExportCacheCreate(EXPORTCACHEFREE Free);
+// Frees everything, so no pass may be in progress
+void ExportCacheDestroy(PEXPORTCACHE Cache);
+size_t ExportCacheCount(PEXPORTCACHE Cache);
+// Starts a pass over the modules a process has now, from one thread at a time
+void ExportCacheBegin(PEXPORTCACHE Cache, const EXPORTCACHEMODULE *Modules, size_t Count);
+// The exports stored for the module at Base, if they are still good
+void *ExportCacheLookup(PEXPORTCACHE Cache, uintptr_t Base, uint32_t Size, uint64_t Stamp);
+// Hands over the exports just read for the module at Base, with the bases of
+// the modules its forwarders resolved into, and the file names of those the
+// rest named. Returns 0 if they could not be stored and are still the caller's.
+int ExportCacheStore(PEXPORTCACHE Cache, uintptr_t Base, uint32_t Size, uint64_t Stamp, void *Exports, const uintptr_t *Targets, size_t TargetCount, const char * const *Unresolved, size_t UnresolvedCount);
+// Ends the pass, freeing the exports of modules that were not used in it
+void ExportCacheEnd(PEXPORTCACHE Cache);
+// The module Name (a file name or path, NULL if not known) was loaded at Base
+void ExportCacheModuleLoaded(PEXPORTCACHE Cache, uintptr_t Base, const char *Name);
+// The module at Base was unloaded
+void ExportCacheModuleUnloaded(PEXPORTCACHE Cache, uintptr_t Base);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,639 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "ExportIndex.h"
+
+#define NIL 0xffffffff
+
+#define MAX_FUNCTIONS	0x10000		// ordinals are 16 bit
+#define INITIAL_MODULES	64
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef SRWLOCK LOCK;
+
+#define LOCK_INITIALIZER SRWLOCK_INIT
+#define LockAcquire(Lock) AcquireSRWLockExclusive(Lock)
+#define LockRelease(Lock) ReleaseSRWLockExclusive(Lock)
+#else
+#include <pthread.h>
+
+typedef pthread_mutex_t LOCK;
+
+#define LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define LockAcquire(Lock) pthread_mutex_lock(Lock)
+#define LockRelease(Lock) pthread_mutex_unlock(Lock)
+#endif
+
+typedef struct ExportIndexEntry
+{
+	uint32_t	Rva;
+	uint32_t	Ordinal;
+	const char	*Name;
+	const char	*Forwarder;
+} EXPORTINDEXENTRY, *PEXPORTINDEXENTRY;
+
+typedef struct ExportIndexName
+{
+	uint32_t	Hash;
+	uint32_t	Entry;
+	const char	*Name;		// NULL if the slot is free
+} EXPORTINDEXNAME, *PEXPORTINDEXNAME;
+
+struct ExportIndex
+{
+	uintptr_t			Base;			// for shared indexes
+	uint64_t			Stamp;			// timestamp and size of the image it was built from
+	unsigned int		References;
+	uint32_t			OrdinalBase;
+	uint32_t			NumberOfFunctions;
+	uint32_t			*ByOrdinal;		// function index to entry, or NIL
+	PEXPORTINDEXENTRY	Entries;		// functions by RVA, then forwarders
+	uint32_t			Count;
+	uint32_t			CodeCount;		// entries that are not forwarded
+	PEXPORTINDEXNAME	Names;
+	uint32_t			NameMask;
+};
+
+// The parts of the headers needed to find things in the image
+typedef struct PeImage
+{
+	const uint8_t	*Data;
+	size_t			Size;
+	int				Mapped;
+	const uint8_t	*Sections;
+	unsigned int	NumberOfSections;
+	uint32_t		SizeOfHeaders;
+} PEIMAGE, *PPEIMAGE;
+
+static LOCK RegistryLock = LOCK_INITIALIZER;
+static PEXPORTINDEX *Registry;		// sorted by Base
+static size_t RegistryCount, RegistryCapacity;
+
+static uint16_t Read16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t Read32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t NameHash(const char *Name)
+{
+	uint32_t Hash = 2166136261u;
+
+	while (*Name)
+	{
+		Hash ^= (unsigned char)*Name++;
+		Hash *= 16777619u;
+	}
+
+	return Hash;
+}
+
+// Reads the file and optional headers, returning the export directory
+static int ParseHeaders(PPEIMAGE Pe, uint32_t *ExportRva, uint32_t *ExportSize)
+{
+	const uint8_t *Nt, *Optional, *Directory;
+	uint32_t NtOffset, NumberOfRvaAndSizes;
+	uint16_t Magic, SizeOfOptionalHeader;
+
+	if (Pe->Size < 0x40 || Read16(Pe->Data) != 0x5a4d)		// MZ
+		return 0;
+
+	NtOffset = Read32(Pe->Data + 0x3c);
+	if (NtOffset > Pe->Size || Pe->Size - NtOffset < 24 || Read32(Pe->Data + NtOffset) != 0x4550)	// PE\0\0
+		return 0;
+
+	Nt = Pe->Data + NtOffset;
+	Pe->NumberOfSections = Read16(Nt + 6);
+	SizeOfOptionalHeader = Read16(Nt + 20);
+	Optional = Nt + 24;
+
+	if (Pe->Size - NtOffset - 24 < (size_t)SizeOfOptionalHeader + Pe->NumberOfSections * 40 || SizeOfOptionalHeader < 2)
+		return 0;
+
+	Pe->Sections = Optional + SizeOfOptionalHeader;
+	Magic = Read16(Optional);
+
+	if (Magic == 0x10b && SizeOfOptionalHeader >= 104)			// PE32
+	{
+		NumberOfRvaAndSizes = Read32(Optional + 92);
+		Directory = Optional + 96;
+	}
+	else if (Magic == 0x20b && SizeOfOptionalHeader >= 120)		// PE32+
+	{
+		NumberOfRvaAndSizes = Read32(Optional + 108);
+		Directory = Optional + 112;
+	}
+	else
+		return 0;
+
+	Pe->SizeOfHeaders = Read32(Optional + 60);
+
+	if (!NumberOfRvaAndSizes)
+	{
+		*ExportRva = *ExportSize = 0;
+		return 1;
+	}
+
+	*ExportRva = Read32(Directory);
+	*ExportSize = Read32(Directory + 4);
+
+	return 1;
+}
+
+// A pointer to Length bytes at Rva, or NULL if they are not all in the image
+static const uint8_t *RvaToPointer(PPEIMAGE Pe, uint32_t Rva, size_t Length)
+{
+	size_t Offset = Rva;
+
+	if (!Pe->Mapped && Rva >= Pe->SizeOfHeaders)
+	{
+		unsigned int i;
+
+		for (i = 0; i < Pe->NumberOfSections; i++)
+		{
+			const uint8_t *Section = Pe->Sections + i * 40;
+			uint32_t VirtualAddress = Read32(Section + 12), SizeOfRawData = Read32(Section + 16);
+
+			if (Rva < VirtualAddress || Rva - VirtualAddress >= SizeOfRawData)
+				continue;
+
+			if (SizeOfRawData - (Rva - VirtualAddress) < Length)
+				return NULL;
+
+			Offset = (size_t)Read32(Section + 20) + (Rva - VirtualAddress);
+			break;
+		}
+
+		if (i == Pe->NumberOfSections)
+			return NULL;
+	}
+
+	if (Offset > Pe->Size || Pe->Size - Offset < Length)
+		return NULL;
+
+	return Pe->Data + Offset;
+}
+
+// A pointer to the terminated string at Rva, or NULL
+static const char *RvaToString(PPEIMAGE Pe, uint32_t Rva)
+{
+	const uint8_t *String = RvaToPointer(Pe, Rva, 1);
+
+	if (!String || !Rva || !memchr(String, 0, Pe->Size - (String - Pe->Data)))
+		return NULL;
+
+	return (const char*)String;
+}
+
+static int CompareEntries(const void *A, const void *B)
+{
+	const EXPORTINDEXENTRY *a = (const EXPORTINDEXENTRY*)A, *b = (const EXPORTINDEXENTRY*)B;
+
+	if (!a->Forwarder != !b->Forwarder)
+		return a->Forwarder ? 1 : -1;
+	if (a->Rva != b->Rva)
+		return a->Rva < b->Rva ? -1 : 1;
+	if (!a->Name != !b->Name)
+		return a->Name ? -1 : 1;
+	return a->Ordinal < b->Ordinal ? -1 : a->Ordinal > b->Ordinal;
+}
+
+static void FillInfo(PEXPORTINDEXENTRY Entry, PEXPORTINFO Info)
+{
+	if (!Info)
+		return;
+
+	Info->Rva = Entry->Rva;
+	Info->Ordinal = Entry->Ordinal;
+	Info->Name = Entry->Name;
+	Info->Forwarder = Entry->Forwarder;
+}
+
+//**************************************************************************************
+PEXPORTINDEX ExportIndexBuild(const void *Image, size_t Size, int Mapped)
+//**************************************************************************************
+{
+	PEIMAGE Pe;
+	PEXPORTINDEX Index;
+	const uint8_t *Directory, *Functions, *Names = NULL, *NameOrdinals = NULL;
+	uint32_t ExportRva, ExportSize, NumberOfNames, NameSlots;
+
+	if (!Image)
+		return NULL;
+
+	memset(&Pe, 0, sizeof(Pe));
+	Pe.Data = (const uint8_t*)Image;
+	Pe.Size = Size;
+	Pe.Mapped = Mapped;
+
+	if (!ParseHeaders(&Pe, &ExportRva, &ExportSize))
+		return NULL;
+
+	Index = (PEXPORTINDEX)calloc(1, sizeof(EXPORTINDEX));
+	if (!Index)
+		return NULL;
+
+	Directory = ExportRva ? RvaToPointer(&Pe, ExportRva, 40) : NULL;
+	if (!Directory)
+		return Index;
+
+	Index->OrdinalBase = Read32(Directory + 16);
+	Index->NumberOfFunctions = Read32(Directory + 20);
+	NumberOfNames = Read32(Directory + 24);
+
+	if (Index->NumberOfFunctions > MAX_FUNCTIONS)
+		Index->NumberOfFunctions = MAX_FUNCTIONS;
+	if (NumberOfNames > MAX_FUNCTIONS)
+		NumberOfNames = MAX_FUNCTIONS;
+
+	Functions = RvaToPointer(&Pe, Read32(Directory + 28), (size_t)Index->NumberOfFunctions * 4);
+	if (NumberOfNames)
+	{
+		Names = RvaToPointer(&Pe, Read32(Directory + 32), (size_t)NumberOfNames * 4);
+		NameOrdinals = RvaToPointer(&Pe, Read32(Directory + 36), (size_t)NumberOfNames * 2);
+	}
+	if (!Functions)
+		Index->NumberOfFunctions = 0;
+	if (!Names || !NameOrdinals)
+		NumberOfNames = 0;
+
+	for (NameSlots = 16; NameSlots < NumberOfNames * 2; NameSlots *= 2)
+		;
+
+	Index->ByOrdinal = (uint32_t*)malloc(((size_t)Index->NumberOfFunctions + 1) * sizeof(uint32_t));
+	Index->Entries = (PEXPORTINDEXENTRY)malloc(((size_t)Index->NumberOfFunctions + 1) * sizeof(EXPORTINDEXENTRY));
+	Index->Names = (PEXPORTINDEXNAME)calloc(NameSlots, sizeof(EXPORTINDEXNAME));
+	Index->NameMask = NameSlots - 1;
+
+	if (!Index->ByOrdinal || !Index->Entries || !Index->Names)
+	{
+		ExportIndexFree(Index);
+		return NULL;
+	}
+
+	for (uint32_t i = 0; i < Index->NumberOfFunctions; i++)
+	{
+		uint32_t Rva = Read32(Functions + i * 4);
+		PEXPORTINDEXENTRY Entry;
+
+		Index->ByOrdinal[i] = NIL;
+		if (!Rva)
+			continue;
+
+		Entry = &Index->Entries[Index->Count];
+		Entry->Rva = Rva;
+		Entry->Ordinal = Index->OrdinalBase + i;
+		Entry->Name = NULL;
+		Entry->Forwarder = NULL;
+		if (Rva >= ExportRva && Rva - ExportRva < ExportSize)
+		{
+			Entry->Forwarder = RvaToString(&Pe, Rva);
+			if (!Entry->Forwarder)
+				continue;
+		}
+		Index->ByOrdinal[i] = Index->Count++;
+	}
+
+	// the first name given to a function is the one it is known by
+	for (uint32_t i = 0; i < NumberOfNames; i++)
+	{
+		uint16_t Function = Read16(NameOrdinals + i * 2);
+		const char *Name;
+
+		if (Function >= Index->NumberOfFunctions || Index->ByOrdinal[Function] == NIL)
+			continue;
+
+		Name = RvaToString(&Pe, Read32(Names + i * 4));
+		if (!Name)
+			continue;
+
+		if (!Index->Entries[Index->ByOrdinal[Function]].Name)
+			Index->Entries[Index->ByOrdinal[Function]].Name = Name;
+	}
+
+	qsort(Index->Entries, Index->Count, sizeof(EXPORTINDEXENTRY), CompareEntries);
+
+	for (uint32_t i = 0; i < Index->Count; i++)
+	{
+		Index->ByOrdinal[Index->Entries[i].Ordinal - Index->OrdinalBase] = i;
+		if (!Index->Entries[i].Forwarder)
+			Index->CodeCount = i + 1;
+	}
+
+	// every name, aliases included, with the first of any duplicates kept
+	for (uint32_t i = 0; i < NumberOfNames; i++)
+	{
+		uint16_t Function = Read16(NameOrdinals + i * 2);
+		const char *Name;
+		uint32_t Hash, Slot;
+
+		if (Function >= Index->NumberOfFunctions || Index->ByOrdinal[Function] == NIL)
+			continue;
+
+		Name = RvaToString(&Pe, Read32(Names + i * 4));
+		if (!Name)
+			continue;
+
+		Hash = NameHash(Name);
+		for (Slot = Hash & Index->NameMask; Index->Names[Slot].Name; Slot = (Slot + 1) & Index->NameMask)
+			if (Index->Names[Slot].Hash == Hash && !strcmp(Index->Names[Slot].Name, Name))
+				break;
+
+		if (Index->Names[Slot].Name)
+			continue;
+
+		Index->Names[Slot].Hash = Hash;
+		Index->Names[Slot].Entry = Index->ByOrdinal[Function];
+		Index->Names[Slot].Name = Name;
+	}
+
+	return Index;
+}
+
+//**************************************************************************************
+void ExportIndexFree(PEXPORTINDEX Index)
+//**************************************************************************************
+{
+	if (!Index)
+		return;
+
+	free(Index->ByOrdinal);
+	free(Index->Entries);
+	free(Index->Names);
+	free(Index);
+}
+
+//**************************************************************************************
+size_t ExportIndexCount(PEXPORTINDEX Index)
+//**************************************************************************************
+{
+	return Index ? Index->Count : 0;
+}
+
+//**************************************************************************************
+int ExportIndexLookupName(PEXPORTINDEX Index, const char *Name, PEXPORTINFO Info)
+//**************************************************************************************
+{
+	uint32_t Hash, Slot;
+
+	if (!Index || !Name || !Index->Names)
+		return 0;
+
+	Hash = NameHash(Name);
+
+	for (Slot = Hash & Index->NameMask; Index->Names[Slot].Name; Slot = (Slot + 1) & Index->NameMask)
+	{
+		if (Index->Names[Slot].Hash == Hash && !strcmp(Index->Names[Slot].Name, Name))
+		{
+			FillInfo(&Index->Entries[Index->Names[Slot].Entry], Info);
+			// an alias is known by the name it was asked for
+			if (Info)
+				Info->Name = Index->Names[Slot].Name;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+//**************************************************************************************
+int ExportIndexLookupOrdinal(PEXPORTINDEX Index, uint32_t Ordinal, PEXPORTINFO Info)
+//**************************************************************************************
+{
+	uint32_t Function;
+
+	if (!Index || Ordinal < Index->OrdinalBase)
+		return 0;
+
+	Function = Ordinal - Index->OrdinalBase;
+
+	if (Function >= Index->NumberOfFunctions || Index->ByOrdinal[Function] == NIL)
+		return 0;
+
+	FillInfo(&Index->Entries[Index->ByOrdinal[Function]], Info);
+
+	return 1;
+}
+
+//**************************************************************************************
+int ExportIndexLookupRva(PEXPORTINDEX Index, uint32_t Rva, uint32_t ScanMax, PEXPORTINFO Info)
+//**************************************************************************************
+{
+	uint32_t Low = 0, High, Found;
+
+	if (!Index)
+		return 0;
+
+	// the first entry above Rva
+	High = Index->CodeCount;
+	while (Low < High)
+	{
+		uint32_t Middle = Low + (High - Low) / 2;
+
+		if (Index->Entries[Middle].Rva <= Rva)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	if (!Low)
+		return 0;
+
+	Found = Low - 1;
+	if (Rva - Index->Entries[Found].Rva > ScanMax)
+		return 0;
+
+	// aliases are sorted with named ones first
+	while (Found && Index->Entries[Found - 1].Rva == Index->Entries[Found].Rva)
+		Found--;
+
+	FillInfo(&Index->Entries[Found], Info);
+
+	return 1;
+}
+
+// Index into the registry of the first module at or above Base
+static size_t RegistryFind(uintptr_t Base)
+{
+	size_t Low = 0, High = RegistryCount;
+
+	while (Low < High)
+	{
+		size_t Middle = Low + (High - Low) / 2;
+
+		if (Registry[Middle]->Base < Base)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	return Low;
+}
+
+// The size of the mapped image at Base from its headers, with a stamp to tell
+// a different image mapped at the same address
+static size_t MappedImageSize(const uint8_t *Base, uint64_t *Stamp)
+{
+	uint32_t NtOffset;
+	const uint8_t *Optional;
+
+	if (Read16(Base) != 0x5a4d)
+		return 0;
+
+	NtOffset = Read32(Base + 0x3c);
+	if (NtOffset > 0x1000 || Read32(Base + NtOffset) != 0x4550)
+		return 0;
+
+	Optional = Base + NtOffset + 24;
+	if (Read16(Optional) != 0x10b && Read16(Optional) != 0x20b)
+		return 0;
+
+	*Stamp = (uint64_t)Read32(Base + NtOffset + 8) << 32 | Read32(Optional + 56);
+
+	return Read32(Optional + 56);
+}
+
+// Takes the index at Position out of the registry, returning it if it is no longer in use
+static PEXPORTINDEX RegistryRemove(size_t Position)
+{
+	PEXPORTINDEX Index = Registry[Position];
+
+	memmove(&Registry[Position], &Registry[Position + 1], (RegistryCount - Position - 1) * sizeof(PEXPORTINDEX));
+	RegistryCount--;
+
+	return --Index->References ? NULL : Index;
+}
+
+//**************************************************************************************
+PEXPORTINDEX ExportIndexAcquire(uintptr_t Base)
+//**************************************************************************************
+{
+	PEXPORTINDEX Index, Built, Stale = NULL;
+	size_t Position, Size;
+	uint64_t Stamp;
+
+	if (!Base)
+		return NULL;
+
+	Size = MappedImageSize((const uint8_t*)Base, &Stamp);
+	if (!Size)
+		return NULL;
+
+	LockAcquire(&RegistryLock);
+	Position = RegistryFind(Base);
+	if (Position < RegistryCount && Registry[Position]->Base == Base)
+	{
+		if (Registry[Position]->Stamp == Stamp)
+		{
+			Index = Registry[Position];
+			Index->References++;
+			LockRelease(&RegistryLock);
+			return Index;
+		}
+		Stale = RegistryRemove(Position);
+	}
+	LockRelease(&RegistryLock);
+
+	ExportIndexFree(Stale);
+
+	// built outside the lock, as reading the image may fault
+	Built = ExportIndexBuild((const void*)Base, Size, 1);
+	if (!Built)
+		return NULL;
+	Built->Base = Base;
+	Built->Stamp = Stamp;
+	Built->References = 1;
+
+	LockAcquire(&RegistryLock);
+	Position = RegistryFind(Base);
+	if (Position < RegistryCount && Registry[Position]->Base == Base && Registry[Position]->Stamp == Stamp)
+	{
+		Index = Registry[Position];
+		ExportIndexFree(Built);
+	}
+	else
+	{
+		if (Position < RegistryCount && Registry[Position]->Base == Base)
+			Stale = RegistryRemove(Position);
+
+		Index = Built;
+		if (RegistryCount == RegistryCapacity)
+		{
+			size_t NewCapacity = RegistryCapacity ? RegistryCapacity * 2 : INITIAL_MODULES;
+			PEXPORTINDEX *NewRegistry = (PEXPORTINDEX*)realloc(Registry, NewCapacity * sizeof(PEXPORTINDEX));
+
+			// still usable, just not shared
+			if (!NewRegistry)
+			{
+				LockRelease(&RegistryLock);
+				ExportIndexFree(Stale);
+				return Index;
+			}
+
+			Registry = NewRegistry;
+			RegistryCapacity = NewCapacity;
+		}
+		memmove(&Registry[Position + 1], &Registry[Position], (RegistryCount - Position) * sizeof(PEXPORTINDEX));
+		Registry[Position] = Index;
+		RegistryCount++;
+	}
+	Index->References++;
+	LockRelease(&RegistryLock);
+
+	ExportIndexFree(Stale);
+
+	return Index;
+}
+
+//**************************************************************************************
+void ExportIndexRelease(PEXPORTINDEX Index)
+//**************************************************************************************
+{
+	if (!Index)
+		return;
+
+	LockAcquire(&RegistryLock);
+	if (--Index->References)
+		Index = NULL;
+	LockRelease(&RegistryLock);
+
+	ExportIndexFree(Index);
+}
+
+//**************************************************************************************
+void ExportIndexDrop(uintptr_t Base)
+//**************************************************************************************
+{
+	PEXPORTINDEX Index = NULL;
+	size_t Position;
+
+	LockAcquire(&RegistryLock);
+	Position = RegistryFind(Base);
+	if (Position < RegistryCount && Registry[Position]->Base == Base)
+		Index = RegistryRemove(Position);
+	LockRelease(&RegistryLock);
+
+	ExportIndexFree(Index);
+}
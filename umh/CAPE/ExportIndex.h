@@ -0,0 +1,63 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Index of a PE image's export directory, built once and then queried by
+// name through a hash table, by ordinal, or by address through a list of
+// exported functions sorted by RVA. Images are either mapped, with RVAs as
+// offsets, or raw files, with RVAs translated through the section headers.
+// Names and forwarder strings point into the image, so an index is only
+// good for as long as its image is. Loaded modules share one index each,
+// built on first use and dropped when they unload.
+
+typedef struct ExportIndex EXPORTINDEX, *PEXPORTINDEX;
+
+typedef struct ExportInfo
+{
+	uint32_t	Rva;
+	uint32_t	Ordinal;
+	const char	*Name;		// NULL for exports by ordinal only
+	const char	*Forwarder;	// "module.function" or "module.#ordinal", NULL unless forwarded
+} EXPORTINFO, *PEXPORTINFO;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns NULL if Image is not a valid PE image, and an empty index if it has no exports
+PEXPORTINDEX ExportIndexBuild(const void *Image, size_t Size, int Mapped);
+void ExportIndexFree(PEXPORTINDEX Index);
+size_t ExportIndexCount(PEXPORTINDEX Index);
+int ExportIndexLookupName(PEXPORTINDEX Index, const char *Name, PEXPORTINFO Info);
+int ExportIndexLookupOrdinal(PEXPORTINDEX Index, uint32_t Ordinal, PEXPORTINFO Info);
+// The closest function exported at or below Rva and at most ScanMax bytes
+// from it, preferring named exports among aliases; forwarders are skipped
+int ExportIndexLookupRva(PEXPORTINDEX Index, uint32_t Rva, uint32_t ScanMax, PEXPORTINFO Info);
+// The shared index for the image mapped at Base, building it if needed or if
+// the image there has changed, to be handed back with ExportIndexRelease
+PEXPORTINDEX ExportIndexAcquire(uintptr_t Base);
+void ExportIndexRelease(PEXPORTINDEX Index);
+// Forgets the index for an image that has been unmapped
+void ExportIndexDrop(uintptr_t Base);
+
+#ifdef __cplusplus
+}
+#endif
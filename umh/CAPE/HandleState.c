@@ -0,0 +1,464 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "HandleState.h"
+#include "PtrMap.h"
+
+#define PAGE_SHIFT 10
+#define PAGE_ENTRIES (1 << PAGE_SHIFT)
+#define DIRECT_PAGES 256	// handles below 0x100000 are indexed directly
+#define DIRECT_LIMIT ((uintptr_t)DIRECT_PAGES * PAGE_ENTRIES)
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef SRWLOCK LOCK;
+
+#define LockInit(Lock) InitializeSRWLock(Lock)
+#define LockFree(Lock)
+#define LockAcquire(Lock) AcquireSRWLockExclusive(Lock)
+#define LockRelease(Lock) ReleaseSRWLockExclusive(Lock)
+#else
+#include <pthread.h>
+
+typedef pthread_mutex_t LOCK;
+
+#define LockInit(Lock) pthread_mutex_init(Lock, NULL)
+#define LockFree(Lock) pthread_mutex_destroy(Lock)
+#define LockAcquire(Lock) pthread_mutex_lock(Lock)
+#define LockRelease(Lock) pthread_mutex_unlock(Lock)
+#endif
+
+struct HandleStateTable
+{
+	LOCK			Lock;
+	size_t			Count;
+	PTRMAP			Overflow;	// handles out of direct range, to allocated entries
+	PHANDLESTATE	Pages[DIRECT_PAGES];
+};
+
+// Called with the lock held. Entries found without Create are always in use;
+// with Create, a new entry is empty until the caller sets its flags and calls Settle.
+static PHANDLESTATE Find(PHANDLESTATETABLE Table, uintptr_t Handle, int Create)
+{
+	PHANDLESTATE State;
+
+	if (!(Handle & 3) && (Handle >> 2) < DIRECT_LIMIT)
+	{
+		uintptr_t Index = Handle >> 2;
+		PHANDLESTATE Page = Table->Pages[Index >> PAGE_SHIFT];
+
+		if (!Page)
+		{
+			if (!Create)
+				return NULL;
+
+			Page = (PHANDLESTATE)calloc(PAGE_ENTRIES, sizeof(HANDLESTATE));
+			if (!Page)
+				return NULL;
+
+			Table->Pages[Index >> PAGE_SHIFT] = Page;
+		}
+
+		State = &Page[Index & (PAGE_ENTRIES - 1)];
+
+		return (Create || State->Flags) ? State : NULL;
+	}
+
+	State = (PHANDLESTATE)PtrMapGet(&Table->Overflow, Handle);
+
+	if (State || !Create)
+		return State;
+
+	State = (PHANDLESTATE)calloc(1, sizeof(HANDLESTATE));
+
+	if (State && !PtrMapSet(&Table->Overflow, Handle, State))
+	{
+		free(State);
+		return NULL;
+	}
+
+	return State;
+}
+
+// Called with the lock held after an entry's flags may have changed from Previous
+static void Settle(PHANDLESTATETABLE Table, uintptr_t Handle, PHANDLESTATE State, uint32_t Previous)
+{
+	if (!Previous && State->Flags)
+		Table->Count++;
+	else if (Previous && !State->Flags)
+		Table->Count--;
+
+	if (!State->Flags)
+	{
+		memset(State, 0, sizeof(HANDLESTATE));
+
+		if ((Handle & 3) || (Handle >> 2) >= DIRECT_LIMIT)
+		{
+			PtrMapRemove(&Table->Overflow, Handle);
+			free(State);
+		}
+	}
+}
+
+static void Release(PHANDLESTATEFILE File)
+{
+	if (File && !--File->References)
+		free(File);
+}
+
+//**************************************************************************************
+PHANDLESTATETABLE HandleStateCreate(void)
+//**************************************************************************************
+{
+	PHANDLESTATETABLE Table = (PHANDLESTATETABLE)calloc(1, sizeof(HANDLESTATETABLE));
+
+	if (!Table)
+		return NULL;
+
+	LockInit(&Table->Lock);
+	PtrMapInit(&Table->Overflow);
+
+	return Table;
+}
+
+//**************************************************************************************
+void HandleStateDestroy(PHANDLESTATETABLE Table)
+//**************************************************************************************
+{
+	size_t i, j;
+
+	if (!Table)
+		return;
+
+	for (i = 0; i < DIRECT_PAGES; i++)
+	{
+		if (!Table->Pages[i])
+			continue;
+
+		for (j = 0; j < PAGE_ENTRIES; j++)
+			Release(Table->Pages[i][j].File);
+
+		free(Table->Pages[i]);
+	}
+
+	for (i = 0; i < Table->Overflow.Capacity; i++)
+	{
+		PHANDLESTATE State = (PHANDLESTATE)Table->Overflow.Entries[i].Value;
+
+		if (State)
+		{
+			Release(State->File);
+			free(State);
+		}
+	}
+
+	PtrMapFree(&Table->Overflow);
+	LockFree(&Table->Lock);
+	free(Table);
+}
+
+//**************************************************************************************
+int HandleStateTrackLog(PHANDLESTATETABLE Table, uintptr_t Handle)
+//**************************************************************************************
+{
+	PHANDLESTATE State;
+	uint32_t Previous;
+
+	LockAcquire(&Table->Lock);
+
+	State = Find(Table, Handle, 1);
+
+	if (State)
+	{
+		Previous = State->Flags;
+
+		if (!(State->Flags & HANDLE_STATE_LOG))
+		{
+			State->Flags |= HANDLE_STATE_LOG;
+			State->ReadCount = State->WriteCount = 0;
+		}
+
+		Settle(Table, Handle, State, Previous);
+	}
+
+	LockRelease(&Table->Lock);
+
+	return State != NULL;
+}
+
+static unsigned int Increment(PHANDLESTATETABLE Table, uintptr_t Handle, int Write)
+{
+	PHANDLESTATE State;
+	unsigned int Result = 0;
+
+	LockAcquire(&Table->Lock);
+
+	State = Find(Table, Handle, 0);
+
+	if (State && (State->Flags & HANDLE_STATE_LOG))
+		Result = Write ? ++State->WriteCount : ++State->ReadCount;
+
+	LockRelease(&Table->Lock);
+
+	return Result;
+}
+
+//**************************************************************************************
+unsigned int HandleStateCountRead(PHANDLESTATETABLE Table, uintptr_t Handle)
+//**************************************************************************************
+{
+	return Increment(Table, Handle, 0);
+}
+
+//**************************************************************************************
+unsigned int HandleStateCountWrite(PHANDLESTATETABLE Table, uintptr_t Handle)
+//**************************************************************************************
+{
+	return Increment(Table, Handle, 1);
+}
+
+//**************************************************************************************
+int HandleStateSetFile(PHANDLESTATETABLE Table, uintptr_t Handle, const void *Data, size_t Size)
+//**************************************************************************************
+{
+	PHANDLESTATEFILE File;
+	PHANDLESTATE State;
+	int Attached = 0;
+
+	// Allocated and copied outside the lock, discarded if the handle already has one
+	File = (PHANDLESTATEFILE)malloc(offsetof(HANDLESTATEFILE, Data) + Size);
+	if (!File)
+		return 0;
+
+	File->References = 1;
+	File->Size = Size;
+	if (Size)
+		memcpy(File->Data, Data, Size);
+
+	LockAcquire(&Table->Lock);
+
+	State = Find(Table, Handle, 1);
+
+	if (State)
+	{
+		uint32_t Previous = State->Flags;
+
+		if (!(State->Flags & HANDLE_STATE_FILE))
+		{
+			State->File = File;
+			State->Flags |= HANDLE_STATE_FILE;
+			Attached = 1;
+		}
+
+		Settle(Table, Handle, State, Previous);
+	}
+
+	LockRelease(&Table->Lock);
+
+	if (!Attached)
+		free(File);
+
+	return Attached;
+}
+
+//**************************************************************************************
+int HandleStateSetSectionView(PHANDLESTATETABLE Table, uintptr_t Handle, void *SectionView)
+//**************************************************************************************
+{
+	PHANDLESTATE State;
+
+	LockAcquire(&Table->Lock);
+
+	State = Find(Table, Handle, SectionView != NULL);
+
+	if (State)
+	{
+		uint32_t Previous = State->Flags;
+
+		State->SectionView = SectionView;
+
+		if (SectionView)
+			State->Flags |= HANDLE_STATE_SECTION;
+		else
+			State->Flags &= ~HANDLE_STATE_SECTION;
+
+		Settle(Table, Handle, State, Previous);
+	}
+
+	LockRelease(&Table->Lock);
+
+	return State != NULL || !SectionView;
+}
+
+//**************************************************************************************
+void *HandleStateGetSectionView(PHANDLESTATETABLE Table, uintptr_t Handle)
+//**************************************************************************************
+{
+	PHANDLESTATE State;
+	void *SectionView = NULL;
+
+	LockAcquire(&Table->Lock);
+
+	State = Find(Table, Handle, 0);
+
+	if (State)
+		SectionView = State->SectionView;
+
+	LockRelease(&Table->Lock);
+
+	return SectionView;
+}
+
+//**************************************************************************************
+int HandleStateDuplicate(PHANDLESTATETABLE Table, uintptr_t Source, uintptr_t Target)
+//**************************************************************************************
+{
+	PHANDLESTATE SourceState, TargetState;
+	PHANDLESTATEFILE Replaced = NULL;
+	int Result = 1;
+
+	if (Source == Target)
+		return 1;
+
+	LockAcquire(&Table->Lock);
+
+	SourceState = Find(Table, Source, 0);
+
+	if (SourceState && (SourceState->Flags & (HANDLE_STATE_LOG | HANDLE_STATE_FILE)))
+	{
+		// Entries never move, so SourceState stays valid if the target is added
+		TargetState = Find(Table, Target, 1);
+
+		if (TargetState)
+		{
+			uint32_t Previous = TargetState->Flags;
+
+			Replaced = TargetState->File;
+
+			TargetState->Flags = (TargetState->Flags & HANDLE_STATE_SECTION) | (SourceState->Flags & (HANDLE_STATE_LOG | HANDLE_STATE_FILE));
+			TargetState->ReadCount = SourceState->ReadCount;
+			TargetState->WriteCount = SourceState->WriteCount;
+			TargetState->File = SourceState->File;
+
+			if (SourceState->File)
+				SourceState->File->References++;
+
+			Settle(Table, Target, TargetState, Previous);
+		}
+		else
+			Result = 0;
+	}
+
+	Release(Replaced);
+
+	LockRelease(&Table->Lock);
+
+	return Result;
+}
+
+//**************************************************************************************
+int HandleStateClose(PHANDLESTATETABLE Table, uintptr_t Handle, PHANDLESTATE State)
+//**************************************************************************************
+{
+	PHANDLESTATE Entry;
+
+	memset(State, 0, sizeof(HANDLESTATE));
+
+	LockAcquire(&Table->Lock);
+
+	Entry = Find(Table, Handle, 0);
+
+	if (Entry)
+	{
+		uint32_t Previous = Entry->Flags;
+
+		*State = *Entry;
+		Entry->Flags = 0;
+		Settle(Table, Handle, Entry, Previous);
+	}
+
+	LockRelease(&Table->Lock);
+
+	return Entry != NULL;
+}
+
+//**************************************************************************************
+void HandleStateReleaseFile(PHANDLESTATETABLE Table, PHANDLESTATEFILE File)
+//**************************************************************************************
+{
+	if (!File)
+		return;
+
+	LockAcquire(&Table->Lock);
+	Release(File);
+	LockRelease(&Table->Lock);
+}
+
+//**************************************************************************************
+size_t HandleStateForEachFile(PHANDLESTATETABLE Table, HANDLESTATE_FILE_CALLBACK Callback, void *Context)
+//**************************************************************************************
+{
+	size_t i, j, Files = 0;
+
+	LockAcquire(&Table->Lock);
+
+	for (i = 0; i < DIRECT_PAGES; i++)
+	{
+		if (!Table->Pages[i])
+			continue;
+
+		for (j = 0; j < PAGE_ENTRIES; j++)
+		{
+			if (Table->Pages[i][j].Flags & HANDLE_STATE_FILE)
+			{
+				Callback(((i << PAGE_SHIFT) + j) << 2, Table->Pages[i][j].File, Context);
+				Files++;
+			}
+		}
+	}
+
+	for (i = 0; i < Table->Overflow.Capacity; i++)
+	{
+		PHANDLESTATE State = (PHANDLESTATE)Table->Overflow.Entries[i].Value;
+
+		if (State && (State->Flags & HANDLE_STATE_FILE))
+		{
+			Callback(Table->Overflow.Entries[i].Key, State->File, Context);
+			Files++;
+		}
+	}
+
+	LockRelease(&Table->Lock);
+
+	return Files;
+}
+
+//**************************************************************************************
+size_t HandleStateCount(PHANDLESTATETABLE Table)
+//**************************************************************************************
+{
+	size_t Count;
+
+	LockAcquire(&Table->Lock);
+	Count = Table->Count;
+	LockRelease(&Table->Lock);
+
+	return Count;
+}
@@ -0,0 +1,83 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Everything tracked per open handle (file logging counters, the path of a
+// file being written, a section view mapped through it) kept together so that
+// closing or duplicating a handle is a single lookup. Handle values are small
+// multiples of four, so entries are indexed directly by value >> 2 in lazily
+// allocated pages, with a hash map for anything out of that range.
+
+#define HANDLE_STATE_LOG		1	// ReadCount and WriteCount are kept for this handle
+#define HANDLE_STATE_FILE		2	// File is set
+#define HANDLE_STATE_SECTION	4	// SectionView is set
+
+// Reference counted copy of data attached to a handle, shared by its duplicates
+typedef struct HandleStateFile
+{
+	unsigned int	References;
+	size_t			Size;
+	unsigned char	Data[1];
+} HANDLESTATEFILE, *PHANDLESTATEFILE;
+
+typedef struct HandleState
+{
+	uint32_t			Flags;
+	uint32_t			ReadCount;
+	uint32_t			WriteCount;
+	PHANDLESTATEFILE	File;
+	void				*SectionView;
+} HANDLESTATE, *PHANDLESTATE;
+
+typedef struct HandleStateTable HANDLESTATETABLE, *PHANDLESTATETABLE;
+
+typedef void (*HANDLESTATE_FILE_CALLBACK)(uintptr_t Handle, PHANDLESTATEFILE File, void *Context);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+PHANDLESTATETABLE HandleStateCreate(void);
+void HandleStateDestroy(PHANDLESTATETABLE Table);
+// Starts counting reads and writes for the handle
+int HandleStateTrackLog(PHANDLESTATETABLE Table, uintptr_t Handle);
+// Returns the new count, or 0 if the handle is not tracked
+unsigned int HandleStateCountRead(PHANDLESTATETABLE Table, uintptr_t Handle);
+unsigned int HandleStateCountWrite(PHANDLESTATETABLE Table, uintptr_t Handle);
+// Attaches a copy of Data unless the handle already has a file, returning 1 if attached
+int HandleStateSetFile(PHANDLESTATETABLE Table, uintptr_t Handle, const void *Data, size_t Size);
+// Associates (or with NULL, disassociates) a section view
+int HandleStateSetSectionView(PHANDLESTATETABLE Table, uintptr_t Handle, void *SectionView);
+void *HandleStateGetSectionView(PHANDLESTATETABLE Table, uintptr_t Handle);
+// Copies the logging state and file of Source to Target (which replaces
+// anything Target had); section views stay with the handle they were mapped through
+int HandleStateDuplicate(PHANDLESTATETABLE Table, uintptr_t Source, uintptr_t Target);
+// Removes the handle, returning 1 and its state if it was tracked. The
+// caller owns the reference to State->File and releases it when done.
+int HandleStateClose(PHANDLESTATETABLE Table, uintptr_t Handle, PHANDLESTATE State);
+void HandleStateReleaseFile(PHANDLESTATETABLE Table, PHANDLESTATEFILE File);
+// Calls Callback for every handle with a file, with the table locked
+size_t HandleStateForEachFile(PHANDLESTATETABLE Table, HANDLESTATE_FILE_CALLBACK Callback, void *Context);
+size_t HandleStateCount(PHANDLESTATETABLE Table);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,334 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "IatScan.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define IAT_SSE2
+#endif
+
+#define SLOT_NULL		0x01	// 0 or -1
+#define SLOT_IN_RANGE	0x02	// between the lowest and highest api
+#define SLOT_API		0x04	// in the api index
+#define SLOT_MAPPED		0x08	// asked, and mapped
+#define SLOT_UNMAPPED	0x10	// asked, and not mapped
+
+#define IAT_MIN_CAPACITY 64
+
+uint64_t IatScanValue(const IATSCAN *Scan, size_t Slot)
+{
+	uint64_t Value = 0;
+	size_t Offset = Slot * Scan->PointerSize, Length = Scan->PointerSize;
+
+	if (Slot >= Scan->Slots)
+		return 0;
+
+	if (Length > Scan->Size - Offset)
+		Length = Scan->Size - Offset;
+
+	// little-endian, as both targets are
+	memcpy(&Value, Scan->Data + Offset, Length);
+	return Value;
+}
+
+static int Verify(PIATSCAN Scan, size_t Slot)
+{
+	size_t *ApiSlots;
+
+	Scan->InRange++;
+
+	if (!ApiIndexCandidates(Scan->Apis, (uintptr_t)IatScanValue(Scan, Slot), NULL))
+		return 1;
+
+	if (Scan->Verified == Scan->ApiCapacity)
+	{
+		size_t Capacity = Scan->ApiCapacity ? Scan->ApiCapacity * 2 : IAT_MIN_CAPACITY;
+		ApiSlots = (size_t*)realloc(Scan->ApiSlots, Capacity * sizeof(size_t));
+		if (!ApiSlots)
+			return 0;
+		Scan->ApiSlots = ApiSlots;
+		Scan->ApiCapacity = Capacity;
+	}
+
+	Scan->ApiSlots[Scan->Verified++] = Slot;
+	Scan->Kinds[Slot] |= SLOT_API;
+	return 1;
+}
+
+#ifdef IAT_SSE2
+// A bit for each of four lanes spread to the low bit of a byte each
+static __inline uint32_t SpreadLanes(unsigned int Lanes)
+{
+	return (Lanes & 1) | (Lanes & 2) << 7 | (Lanes & 4) << 14 | (Lanes & 8) << 21;
+}
+
+// Verifies the slots from First whose bits are set in Lanes
+static int VerifyLanes(PIATSCAN Scan, size_t First, unsigned int Lanes)
+{
+	unsigned int Lane;
+
+	for (Lane = 0; Lanes >> Lane; Lane++)
+	{
+		if (((Lanes >> Lane) & 1) && !Verify(Scan, First + Lane))
+			return 0;
+	}
+
+	return 1;
+}
+#endif
+
+int IatScanInit(PIATSCAN Scan, const void *Data, size_t Size, uint32_t PointerSize, uint64_t Min, uint64_t Max, PAPIINDEX Apis, IATMAPPED Mapped, void *Context)
+{
+	// in range if Value - Low < Span, unsigned
+	uint64_t Low = Min + 1, Span = Max - Min - 1, AllOnes = (uint64_t)-1;
+	size_t i = 0;
+
+	memset(Scan, 0, sizeof(*Scan));
+	Scan->Data = (const unsigned char*)Data;
+	Scan->Size = Size;
+	Scan->PointerSize = PointerSize;
+	Scan->Slots = (Size + PointerSize - 1) / PointerSize;
+	Scan->Apis = Apis;
+	Scan->Mapped = Mapped;
+	Scan->Context = Context;
+
+	if (PointerSize == 4)
+	{
+		Low &= 0xFFFFFFFF;
+		Span &= 0xFFFFFFFF;
+		AllOnes &= 0xFFFFFFFF;
+	}
+	else if (PointerSize != 8)
+		return 0;
+
+	Scan->Kinds = (unsigned char*)calloc(Scan->Slots + 1, 1);
+	if (!Scan->Kinds)
+		return 0;
+
+	// 0 in range means no apis
+	if (Min >= Max)
+		Span = 0;
+
+#ifdef IAT_SSE2
+	if (PointerSize == 4)
+	{
+		const __m128i Bias = _mm_set1_epi32((int)0x80000000), VectorLow = _mm_set1_epi32((int)(uint32_t)Low);
+		const __m128i VectorSpan = _mm_set1_epi32((int)((uint32_t)Span ^ 0x80000000)), Ones = _mm_set1_epi32(-1);
+
+		for (; i + 4 <= Size / 4; i += 4)
+		{
+			__m128i Values = _mm_loadu_si128((const __m128i*)(Scan->Data + i * 4));
+			__m128i Offset = _mm_xor_si128(_mm_sub_epi32(Values, VectorLow), Bias);
+			unsigned int InRange = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(Offset, VectorSpan)));
+			unsigned int Null = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(_mm_cmpeq_epi32(Values, _mm_setzero_si128()), _mm_cmpeq_epi32(Values, Ones))));
+
+			if (!(InRange | Null))
+				continue;
+
+			InRange &= ~Null;
+			{
+				uint32_t Lanes = SpreadLanes(InRange) * SLOT_IN_RANGE | SpreadLanes(Null) * SLOT_NULL;
+				memcpy(Scan->Kinds + i, &Lanes, sizeof(Lanes));
+			}
+			if (InRange && !VerifyLanes(Scan, i, InRange))
+				return 0;
+		}
+	}
+	else
+	{
+		// SSE2 compares 32 bits at a time, so the high halves decide unless equal
+		const __m128i Bias = _mm_set1_epi32((int)0x80000000), VectorLow = _mm_set_epi32((int)(uint32_t)(Low >> 32), (int)(uint32_t)Low, (int)(uint32_t)(Low >> 32), (int)(uint32_t)Low);
+		const uint64_t BiasedSpan = Span ^ 0x8000000080000000ULL;
+		const __m128i VectorSpan = _mm_set_epi32((int)(uint32_t)(BiasedSpan >> 32), (int)(uint32_t)BiasedSpan, (int)(uint32_t)(BiasedSpan >> 32), (int)(uint32_t)BiasedSpan);
+		const __m128i Ones = _mm_set1_epi32(-1);
+
+		for (; i + 2 <= Size / 8; i += 2)
+		{
+			__m128i Values = _mm_loadu_si128((const __m128i*)(Scan->Data + i * 8));
+			__m128i Offset = _mm_xor_si128(_mm_sub_epi64(Values, VectorLow), Bias);
+			__m128i Less = _mm_cmplt_epi32(Offset, VectorSpan), Equal = _mm_cmpeq_epi32(Offset, VectorSpan);
+			__m128i Zero = _mm_cmpeq_epi32(Values, _mm_setzero_si128()), AllSet = _mm_cmpeq_epi32(Values, Ones);
+			unsigned int InRange, Null;
+
+			Less = _mm_or_si128(Less, _mm_and_si128(Equal, _mm_slli_epi64(Less, 32)));
+			Zero = _mm_and_si128(Zero, _mm_slli_epi64(Zero, 32));
+			AllSet = _mm_and_si128(AllSet, _mm_slli_epi64(AllSet, 32));
+			InRange = (unsigned int)_mm_movemask_pd(_mm_castsi128_pd(Less));
+			Null = (unsigned int)_mm_movemask_pd(_mm_castsi128_pd(_mm_or_si128(Zero, AllSet)));
+
+			if (!(InRange | Null))
+				continue;
+
+			InRange &= ~Null;
+			Scan->Kinds[i] = (unsigned char)((InRange & 1) * SLOT_IN_RANGE | (Null & 1) * SLOT_NULL);
+			Scan->Kinds[i + 1] = (unsigned char)((InRange >> 1) * SLOT_IN_RANGE | (Null >> 1) * SLOT_NULL);
+			if (InRange && !VerifyLanes(Scan, i, InRange))
+				return 0;
+		}
+	}
+#endif
+
+	for (; i < Scan->Slots; i++)
+	{
+		uint64_t Value = IatScanValue(Scan, i);
+
+		if (Value == 0 || Value == AllOnes)
+			Scan->Kinds[i] = SLOT_NULL;
+		else if (Value - Low < Span)
+		{
+			Scan->Kinds[i] = SLOT_IN_RANGE;
+			if (!Verify(Scan, i))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+void IatScanFree(PIATSCAN Scan)
+{
+	free(Scan->Kinds);
+	free(Scan->ApiSlots);
+	free(Scan->Blocks);
+	memset(Scan, 0, sizeof(*Scan));
+}
+
+int IatScanIsApi(const IATSCAN *Scan, size_t Slot)
+{
+	return Slot < Scan->Slots && (Scan->Kinds[Slot] & SLOT_API);
+}
+
+int IatScanIsInvalid(PIATSCAN Scan, size_t Slot)
+{
+	unsigned char Kind;
+
+	if (Slot >= Scan->Slots)
+		return 1;
+
+	Kind = Scan->Kinds[Slot];
+
+	if (Kind & (SLOT_NULL | SLOT_UNMAPPED))
+		return 1;
+	if (Kind & (SLOT_API | SLOT_MAPPED))
+		return 0;
+
+	Scan->Queries++;
+	if (Scan->Mapped(Scan->Context, IatScanValue(Scan, Slot)))
+	{
+		Scan->Kinds[Slot] |= SLOT_MAPPED;
+		return 0;
+	}
+
+	Scan->Kinds[Slot] |= SLOT_UNMAPPED;
+	return 1;
+}
+
+int IatScanStart(PIATSCAN Scan, size_t Offset, size_t *Start)
+{
+	size_t Slot;
+
+	for (Slot = Offset / Scan->PointerSize; Slot > 0; Slot--)
+	{
+		if (IatScanIsInvalid(Scan, Slot) && IatScanIsInvalid(Scan, Slot - 1) && Slot >= 2 && !IatScanIsApi(Scan, Slot - 2))
+		{
+			*Start = Slot * Scan->PointerSize;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Non-zero if an IAT ends at Slot
+static int EndsAt(PIATSCAN Scan, size_t Slot)
+{
+	return IatScanIsInvalid(Scan, Slot) && IatScanIsInvalid(Scan, Slot + 1) && !IatScanIsApi(Scan, Slot + 2);
+}
+
+int IatScanEnd(PIATSCAN Scan, size_t Start, size_t *Size)
+{
+	size_t First = Start / Scan->PointerSize, Slot;
+
+	for (Slot = First; Scan->Size && Slot * Scan->PointerSize < Scan->Size - 1; Slot++)
+	{
+		if (EndsAt(Scan, Slot))
+		{
+			*Size = (Slot - First) * Scan->PointerSize;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+size_t IatScanCluster(PIATSCAN Scan)
+{
+	size_t i, Capacity = 0, Slot, Last = 0, Gap;
+	PIATBLOCK Block = NULL, Blocks;
+
+	free(Scan->Blocks);
+	Scan->Blocks = NULL;
+	Scan->BlockCount = 0;
+
+	for (i = 0; i < Scan->Verified; i++)
+	{
+		Slot = Scan->ApiSlots[i];
+
+		if (Block && (Slot - Last) * Scan->PointerSize <= IAT_MAX_GAP)
+		{
+			// an end can only fall among the slots that aren't apis
+			for (Gap = Last + 1; Gap + 2 < Slot; Gap++)
+			{
+				if (EndsAt(Scan, Gap))
+					break;
+			}
+
+			if (Gap + 2 >= Slot)
+			{
+				Block->Size = (Slot + 1) * Scan->PointerSize - Block->Offset;
+				Block->Apis++;
+				Last = Slot;
+				continue;
+			}
+		}
+
+		if (Scan->BlockCount == Capacity)
+		{
+			Capacity = Capacity ? Capacity * 2 : IAT_MIN_CAPACITY;
+			Blocks = (PIATBLOCK)realloc(Scan->Blocks, Capacity * sizeof(IATBLOCK));
+			if (!Blocks)
+			{
+				free(Scan->Blocks);
+				Scan->Blocks = NULL;
+				Scan->BlockCount = 0;
+				return 0;
+			}
+			Scan->Blocks = Blocks;
+		}
+
+		Block = &Scan->Blocks[Scan->BlockCount++];
+		Block->Offset = Slot * Scan->PointerSize;
+		Block->Size = Scan->PointerSize;
+		Block->Apis = 1;
+		Last = Slot;
+	}
+
+	return Scan->BlockCount;
+}
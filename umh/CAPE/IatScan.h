@@ -0,0 +1,104 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "ApiIndex.h"
+
+// Finds import address tables in a copy of memory by what they hold rather
+// than by the code that calls through them. One pass, sixteen bytes at a
+// time, marks the pointer-sized slots that are null (0 or -1) or fall
+// strictly between the lowest and highest api addresses; only those in range
+// are then looked up in the api index, once each. Runs of verified apis are
+// clustered into blocks, a block ending where the apis are more than
+// IAT_MAX_GAP bytes apart or where two invalid slots are followed by
+// anything other than an api, the end Scylla's IAT search has always used.
+// Whether other values point to committed, accessible memory is asked only
+// where an end is being looked for, and only once per slot.
+
+#define IAT_MAX_GAP		0x100
+
+// Returns non-zero if Address is in committed memory that can be accessed
+typedef int (*IATMAPPED)(void *Context, uint64_t Address);
+
+typedef struct IatBlock
+{
+	size_t	Offset;		// of the first api in the block
+	size_t	Size;		// to the end of the last api
+	size_t	Apis;
+} IATBLOCK, *PIATBLOCK;
+
+typedef struct IatScan
+{
+	const unsigned char	*Data;
+	size_t				Size;
+	size_t				Slots;			// the last may run past Size, the rest reading as 0
+	uint32_t			PointerSize;	// 4 or 8
+	unsigned char		*Kinds;			// what each slot is known to hold
+	PAPIINDEX			Apis;
+	IATMAPPED			Mapped;
+	void				*Context;
+	size_t				InRange;		// slots between the lowest and highest api
+	size_t				*ApiSlots;		// of those, the api addresses, in order
+	size_t				Verified;
+	size_t				ApiCapacity;
+	size_t				Queries;		// calls to Mapped
+	PIATBLOCK			Blocks;			// by offset, after IatScanCluster
+	size_t				BlockCount;
+} IATSCAN, *PIATSCAN;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Marks the PointerSize-byte slots of Size bytes at Data, with Min and Max
+// the exclusive bounds of the api addresses, and verifies those in range
+// against Apis. Returns 0 on allocation failure; the scan is freed with
+// IatScanFree either way.
+int IatScanInit(PIATSCAN Scan, const void *Data, size_t Size, uint32_t PointerSize, uint64_t Min, uint64_t Max, PAPIINDEX Apis, IATMAPPED Mapped, void *Context);
+
+void IatScanFree(PIATSCAN Scan);
+
+// The value of a slot, 0 past the end of Data
+uint64_t IatScanValue(const IATSCAN *Scan, size_t Slot);
+
+// Non-zero if a slot holds an api address
+int IatScanIsApi(const IATSCAN *Scan, size_t Slot);
+
+// Non-zero if a slot holds 0, -1 or an address that isn't mapped. Api
+// addresses are taken to be mapped.
+int IatScanIsInvalid(PIATSCAN Scan, size_t Slot);
+
+// Looks down from the slot at Offset for the start of the IAT it is in: the
+// first slot that is invalid, as is the slot below it, with no api below
+// that. Returns 0 if there is none above the second slot.
+int IatScanStart(PIATSCAN Scan, size_t Offset, size_t *Start);
+
+// Looks up from Start for the first slot that is invalid, as is the next,
+// with no api after that, and gives its distance from Start. Returns 0 if
+// there is none before Size - 1.
+int IatScanEnd(PIATSCAN Scan, size_t Start, size_t *Size);
+
+// Clusters the verified apis into Blocks, returning how many there are, or
+// 0 on allocation failure
+size_t IatScanCluster(PIATSCAN Scan);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,287 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "ImportTable.h"
+
+#define IMPORT_DESCRIPTOR_SIZE	20
+#define IMPORT_HINT_SIZE		2
+#define IMPORT_MIN_CAPACITY		16
+
+static int Reserve(void **Array, size_t *Capacity, size_t Needed, size_t ElementSize)
+{
+	size_t NewCapacity = *Capacity ? *Capacity : IMPORT_MIN_CAPACITY;
+	void *NewArray;
+
+	if (Needed <= *Capacity)
+		return 1;
+
+	while (NewCapacity < Needed)
+		NewCapacity *= 2;
+
+	NewArray = realloc(*Array, NewCapacity * ElementSize);
+	if (!NewArray)
+		return 0;
+
+	*Array = NewArray;
+	*Capacity = NewCapacity;
+	return 1;
+}
+
+// Returns the offset of Name in the pool, or -1 if it could not be added
+static int64_t AddName(PIMPORTTABLE Table, const char *Name, uint16_t *NameSize)
+{
+	size_t Length = strlen(Name) + 1;
+	int64_t Offset = (int64_t)Table->PoolSize;
+
+	if (Length > UINT16_MAX || Table->PoolSize + Length > UINT32_MAX)
+		return -1;
+
+	if (!Reserve((void**)&Table->Pool, &Table->PoolCapacity, Table->PoolSize + Length, 1))
+		return -1;
+
+	memcpy(Table->Pool + Table->PoolSize, Name, Length);
+	Table->PoolSize += Length;
+	*NameSize = (uint16_t)Length;
+
+	return Offset;
+}
+
+static void PutPointer(unsigned char *Data, uint64_t Value, size_t PointerSize)
+{
+	uint32_t Value32 = (uint32_t)Value;
+
+	if (PointerSize == sizeof(uint64_t))
+		memcpy(Data, &Value, sizeof(Value));
+	else
+		memcpy(Data, &Value32, sizeof(Value32));
+}
+
+static void PutDword(unsigned char *Data, uint32_t Value)
+{
+	memcpy(Data, &Value, sizeof(Value));
+}
+
+// Only the fields Scylla sets are written, the rest being left as they are
+static void PutDescriptor(unsigned char *Descriptor, uint32_t OriginalFirstThunk, uint32_t Name, uint32_t FirstThunk, int UseOft)
+{
+	if (UseOft)
+		PutDword(Descriptor, OriginalFirstThunk);
+	PutDword(Descriptor + 12, Name);
+	PutDword(Descriptor + 16, FirstThunk);
+}
+
+int ImportTableInit(PIMPORTTABLE Table, size_t Modules, size_t Entries, size_t PoolSize)
+{
+	memset(Table, 0, sizeof(*Table));
+
+	if (!Reserve((void**)&Table->Modules, &Table->ModuleCapacity, Modules, sizeof(IMPORTMODULE))
+		|| !Reserve((void**)&Table->Entries, &Table->EntryCapacity, Entries, sizeof(IMPORTENTRY))
+		|| !Reserve((void**)&Table->Pool, &Table->PoolCapacity, PoolSize, 1))
+	{
+		ImportTableFree(Table);
+		return 0;
+	}
+
+	return 1;
+}
+
+void ImportTableFree(PIMPORTTABLE Table)
+{
+	free(Table->Modules);
+	free(Table->Entries);
+	free(Table->Pool);
+	memset(Table, 0, sizeof(*Table));
+}
+
+int ImportTableAddModule(PIMPORTTABLE Table, uint64_t FirstThunk, const char *Name)
+{
+	PIMPORTMODULE Module;
+	uint16_t NameSize;
+	int64_t Offset;
+
+	if (!Reserve((void**)&Table->Modules, &Table->ModuleCapacity, Table->ModuleCount + 1, sizeof(IMPORTMODULE)))
+		return 0;
+
+	Offset = AddName(Table, Name, &NameSize);
+	if (Offset < 0)
+		return 0;
+
+	Module = &Table->Modules[Table->ModuleCount++];
+	Module->FirstThunk = FirstThunk;
+	Module->Name = (uint32_t)Offset;
+	Module->NameSize = NameSize;
+	Module->First = Table->EntryCount;
+	Module->Count = 0;
+
+	return 1;
+}
+
+int ImportTableAddEntry(PIMPORTTABLE Table, uint64_t Rva, const char *Name, uint16_t Ordinal, uint16_t Hint)
+{
+	PIMPORTENTRY Entry;
+	uint16_t NameSize = IMPORT_BY_ORDINAL;
+	int64_t Offset = 0;
+
+	if (!Table->ModuleCount)
+		return 0;
+
+	if (!Reserve((void**)&Table->Entries, &Table->EntryCapacity, Table->EntryCount + 1, sizeof(IMPORTENTRY)))
+		return 0;
+
+	if (Name[0])
+	{
+		Offset = AddName(Table, Name, &NameSize);
+		if (Offset < 0)
+			return 0;
+	}
+
+	Entry = &Table->Entries[Table->EntryCount++];
+	Entry->Rva = Rva;
+	Entry->Name = (uint32_t)Offset;
+	Entry->NameSize = NameSize;
+	Entry->Ordinal = Ordinal;
+	Entry->Hint = Hint;
+	Table->Modules[Table->ModuleCount - 1].Count++;
+
+	return 1;
+}
+
+void ImportTableMove(PIMPORTTABLE Table, uint64_t OldRva, uint64_t NewRva)
+{
+	size_t i;
+
+	for (i = 0; i < Table->ModuleCount; i++)
+		Table->Modules[i].FirstThunk = Table->Modules[i].FirstThunk - OldRva + NewRva;
+
+	for (i = 0; i < Table->EntryCount; i++)
+		Table->Entries[i].Rva = Table->Entries[i].Rva - OldRva + NewRva;
+}
+
+// A break in a module's thunks costs a descriptor and two more slots in
+// the OriginalFirstThunk arrays, one more than are used
+void ImportTableLayout(PIMPORTTABLE Table, size_t PointerSize, PIMPORTLAYOUT Layout)
+{
+	PIMPORTMODULE Module;
+	PIMPORTENTRY Entry, End;
+	uint64_t LastRva;
+	size_t i;
+
+	Layout->Descriptors = Table->ModuleCount + 1;
+	Layout->NamesSize = 0;
+	Layout->ThunksSize = 0;
+
+	for (i = 0; i < Table->ModuleCount; i++)
+	{
+		Module = &Table->Modules[i];
+		LastRva = Module->FirstThunk - PointerSize;
+		Layout->NamesSize += Module->NameSize;
+
+		for (Entry = &Table->Entries[Module->First], End = Entry + Module->Count; Entry < End; Entry++)
+		{
+			if (LastRva + PointerSize != Entry->Rva)
+			{
+				Layout->Descriptors++;
+				Layout->ThunksSize += 2 * PointerSize;
+			}
+
+			if (Entry->NameSize != IMPORT_BY_ORDINAL)
+				Layout->NamesSize += IMPORT_HINT_SIZE + Entry->NameSize;
+
+			Layout->ThunksSize += PointerSize;
+			LastRva = Entry->Rva;
+		}
+
+		// and the array's terminator
+		Layout->ThunksSize += PointerSize;
+	}
+
+	Layout->Size = Layout->ThunksSize + Layout->NamesSize + Layout->Descriptors * IMPORT_DESCRIPTOR_SIZE;
+}
+
+size_t ImportTableWrite(PIMPORTTABLE Table, PIMPORTLAYOUT Layout, size_t PointerSize, unsigned char *Section, uint32_t SectionRva, size_t Offset, int UseOft, IMPORTSLOT Slot, void *Context)
+{
+	uint64_t OrdinalFlag = PointerSize == sizeof(uint64_t) ? 0x8000000000000000ULL : 0x80000000;
+	size_t ThunkOffset = Offset;
+	unsigned char *Descriptor, *Thunk;
+	PIMPORTMODULE Module;
+	PIMPORTENTRY Entry, End;
+	uint64_t LastRva;
+	uint32_t Name;
+	size_t i;
+
+	if (UseOft)
+		Offset += Layout->ThunksSize;
+
+	Descriptor = Section + Offset;
+	Offset += Layout->Descriptors * IMPORT_DESCRIPTOR_SIZE;
+
+	for (i = 0; i < Table->ModuleCount; i++)
+	{
+		Module = &Table->Modules[i];
+		Name = SectionRva + (uint32_t)Offset;
+		memcpy(Section + Offset, Table->Pool + Module->Name, Module->NameSize);
+		PutDescriptor(Descriptor, SectionRva + (uint32_t)ThunkOffset, Name, (uint32_t)Module->FirstThunk, UseOft);
+		Offset += Module->NameSize;
+		LastRva = Module->FirstThunk - PointerSize;
+
+		for (Entry = &Table->Entries[Module->First], End = Entry + Module->Count; Entry < End; Entry++)
+		{
+			if (UseOft)
+			{
+				Thunk = Section + ThunkOffset;
+				ThunkOffset += PointerSize;
+			}
+			else
+				Thunk = Slot(Context, Entry->Rva);
+
+			if (!Thunk)
+				return 0;
+
+			// The slot taken before a break terminates the run before it
+			if (LastRva + PointerSize != Entry->Rva)
+			{
+				Descriptor += IMPORT_DESCRIPTOR_SIZE;
+				PutDescriptor(Descriptor, SectionRva + (uint32_t)ThunkOffset, Name, (uint32_t)Entry->Rva, UseOft);
+				if (UseOft)
+				{
+					Thunk = Section + ThunkOffset;
+					ThunkOffset += PointerSize;
+				}
+			}
+			LastRva = Entry->Rva;
+
+			if (Entry->NameSize == IMPORT_BY_ORDINAL)
+				PutPointer(Thunk, Entry->Ordinal | OrdinalFlag, PointerSize);
+			else
+			{
+				memcpy(Section + Offset, &Entry->Hint, IMPORT_HINT_SIZE);
+				memcpy(Section + Offset + IMPORT_HINT_SIZE, Table->Pool + Entry->Name, Entry->NameSize);
+				PutPointer(Thunk, SectionRva + Offset, PointerSize);
+				// clearing the slot after it, which the next import overwrites
+				PutPointer(Thunk + PointerSize, 0, PointerSize);
+				Offset += IMPORT_HINT_SIZE + Entry->NameSize;
+			}
+		}
+
+		ThunkOffset += PointerSize;
+		Descriptor += IMPORT_DESCRIPTOR_SIZE;
+	}
+
+	return Offset;
+}
@@ -0,0 +1,97 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The imports ImportRebuilder writes into a dump's new import section, held
+// flat: modules in order of their first thunk, each owning a run of entries
+// in order of RVA, with all the names in one pool. The section's size is
+// worked out in one pass over them and it is written in another, laid out
+// as Scylla lays it out: the OriginalFirstThunk arrays (if used), then the
+// import descriptors, then each module's name followed by the hint/name
+// entries of its imports. A module whose thunks are not contiguous gets
+// another descriptor, with the same name, for each run after the first.
+
+#define IMPORT_BY_ORDINAL	0
+
+typedef struct ImportEntry
+{
+	uint64_t	Rva;
+	uint32_t	Name;		// offset of the name in the pool
+	uint16_t	NameSize;	// including the terminator, or IMPORT_BY_ORDINAL
+	uint16_t	Ordinal;
+	uint16_t	Hint;
+} IMPORTENTRY, *PIMPORTENTRY;
+
+typedef struct ImportModule
+{
+	uint64_t	FirstThunk;
+	uint32_t	Name;
+	uint16_t	NameSize;
+	size_t		First;		// index of its first entry
+	size_t		Count;
+} IMPORTMODULE, *PIMPORTMODULE;
+
+typedef struct ImportTable
+{
+	PIMPORTMODULE	Modules;
+	size_t			ModuleCount;
+	size_t			ModuleCapacity;
+	PIMPORTENTRY	Entries;
+	size_t			EntryCount;
+	size_t			EntryCapacity;
+	char			*Pool;
+	size_t			PoolSize;
+	size_t			PoolCapacity;
+} IMPORTTABLE, *PIMPORTTABLE;
+
+typedef struct ImportLayout
+{
+	size_t	Descriptors;	// the terminating descriptor included
+	size_t	NamesSize;		// module names and hint/name entries
+	size_t	ThunksSize;		// OriginalFirstThunk arrays
+	size_t	Size;
+} IMPORTLAYOUT, *PIMPORTLAYOUT;
+
+// Returns where the IAT slot at Rva is written when there are no
+// OriginalFirstThunk arrays, with room for the slot after it, or NULL
+typedef unsigned char *(*IMPORTSLOT)(void *Context, uint64_t Rva);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Room for the given numbers of modules, entries and bytes of names is
+// reserved up front; more is made as needed
+int ImportTableInit(PIMPORTTABLE Table, size_t Modules, size_t Entries, size_t PoolSize);
+void ImportTableFree(PIMPORTTABLE Table);
+int ImportTableAddModule(PIMPORTTABLE Table, uint64_t FirstThunk, const char *Name);
+// Adds an entry to the last module added, by ordinal if Name is empty
+int ImportTableAddEntry(PIMPORTTABLE Table, uint64_t Rva, const char *Name, uint16_t Ordinal, uint16_t Hint);
+// Moves every thunk from an IAT at OldRva to one at NewRva
+void ImportTableMove(PIMPORTTABLE Table, uint64_t OldRva, uint64_t NewRva);
+void ImportTableLayout(PIMPORTTABLE Table, size_t PointerSize, PIMPORTLAYOUT Layout);
+// Writes the table into Section, which starts at SectionRva, from Offset on.
+// Returns the offset just past the names, or 0 if Slot gave no slot.
+size_t ImportTableWrite(PIMPORTTABLE Table, PIMPORTLAYOUT Layout, size_t PointerSize, unsigned char *Section, uint32_t SectionRva, size_t Offset, int UseOft, IMPORTSLOT Slot, void *Context);
+
+#ifdef __cplusplus
+}
+#endif
@@ -28,6 +28,8 @@ along with this program.If not, see <http://www.gnu.org/licenses/>.
 #include "Debugger.h"
 #include "CAPE.h"
 #include "Injection.h"
+#include "PtrMap.h"
+#include "HandleState.h"
 #include "Shlwapi.h"
 
 #pragma comment(lib, "shlwapi.lib")
@@ -45,96 +47,81 @@ extern wchar_t *our_dll_path_w;
 extern char *our_process_name;
 extern void hook_disable();
 extern void hook_enable();
+extern PHANDLESTATETABLE g_handles;
+
+static PTRMAP InjectionInfoByPid, InjectionInfoByHandle;
+static PINJECTIONINFO InjectionInfoTail;
+static PINJECTIONSECTIONVIEW SectionViewTail;
 
 //**************************************************************************************
 PINJECTIONINFO GetInjectionInfo(DWORD ProcessId)
 //**************************************************************************************
 {
-	DWORD CurrentProcessId;
-
-	PINJECTIONINFO CurrentInjectionInfo = InjectionInfoList;
-	while (CurrentInjectionInfo)
-	{
-		CurrentProcessId = CurrentInjectionInfo->ProcessId;
-
-		if (CurrentProcessId == ProcessId)
-			return CurrentInjectionInfo;
-		else
-			CurrentInjectionInfo = CurrentInjectionInfo->NextInjectionInfo;
-	}
-
-	return NULL;
+	return (PINJECTIONINFO)PtrMapGet(&InjectionInfoByPid, (uintptr_t)ProcessId);
 }
 
 //**************************************************************************************
 PINJECTIONINFO GetInjectionInfoFromHandle(HANDLE ProcessHandle)
 //**************************************************************************************
 {
-	HANDLE CurrentProcessHandle;
+	return (PINJECTIONINFO)PtrMapGet(&InjectionInfoByHandle, (uintptr_t)ProcessHandle);
+}
 
-	PINJECTIONINFO CurrentInjectionInfo = InjectionInfoList;
-	while (CurrentInjectionInfo)
+//**************************************************************************************
+void SetInjectionInfoHandle(PINJECTIONINFO InjectionInfo, HANDLE ProcessHandle)
+//**************************************************************************************
+{
+	if (InjectionInfo->ProcessHandle == ProcessHandle)
 	{
-		CurrentProcessHandle = CurrentInjectionInfo->ProcessHandle;
-
-		if (CurrentProcessHandle == ProcessHandle)
-			return CurrentInjectionInfo;
-		else
-			CurrentInjectionInfo = CurrentInjectionInfo->NextInjectionInfo;
+		if (ProcessHandle && !GetInjectionInfoFromHandle(ProcessHandle))
+			PtrMapSet(&InjectionInfoByHandle, (uintptr_t)ProcessHandle, InjectionInfo);
+		return;
 	}
 
-	return NULL;
+	// Handle values are recycled, so only drop the index entry if it is still ours
+	if (InjectionInfo->ProcessHandle && GetInjectionInfoFromHandle(InjectionInfo->ProcessHandle) == InjectionInfo)
+		PtrMapRemove(&InjectionInfoByHandle, (uintptr_t)InjectionInfo->ProcessHandle);
+
+	InjectionInfo->ProcessHandle = ProcessHandle;
+
+	if (ProcessHandle && !PtrMapSet(&InjectionInfoByHandle, (uintptr_t)ProcessHandle, InjectionInfo))
+		DebugOutput("SetInjectionInfoHandle: Failed to index handle 0x%x for pid %d.\n", ProcessHandle, InjectionInfo->ProcessId);
 }
 
 //**************************************************************************************
 PINJECTIONINFO CreateInjectionInfo(DWORD ProcessId)
 //**************************************************************************************
 {
-	PINJECTIONINFO CurrentInjectionInfo, PreviousInjectionInfo;
-
-	PreviousInjectionInfo = NULL;
+	PINJECTIONINFO CurrentInjectionInfo = GetInjectionInfo(ProcessId);
 
-	if (InjectionInfoList == NULL)
-	{
-		InjectionInfoList = ((struct InjectionInfo*)calloc(sizeof(struct InjectionInfo), sizeof(BYTE)));
+	if (CurrentInjectionInfo)
+		return CurrentInjectionInfo;
 
-		if (InjectionInfoList == NULL)
-		{
-			DebugOutput("CreateInjectionInfo: failed to allocate memory for initial injection info list.\n");
-			return NULL;
-		}
+	CurrentInjectionInfo = ((struct InjectionInfo*)calloc(sizeof(struct InjectionInfo), sizeof(BYTE)));
 
-		InjectionInfoList->ProcessId = ProcessId;
+	if (CurrentInjectionInfo == NULL)
+	{
+		DebugOutput("CreateInjectionInfo: Failed to allocate new injection info.\n");
+		return NULL;
 	}
 
-	CurrentInjectionInfo = InjectionInfoList;
+	CurrentInjectionInfo->ProcessId = ProcessId;
+	WriteCaptureInit(&CurrentInjectionInfo->WriteCapture, WRITE_CAPTURE_LIMIT);
 
-	while (CurrentInjectionInfo)
+	if (!PtrMapSet(&InjectionInfoByPid, (uintptr_t)ProcessId, CurrentInjectionInfo))
 	{
-		if ((CurrentInjectionInfo->ProcessId) == ProcessId)
-			break;
-
-		PreviousInjectionInfo = CurrentInjectionInfo;
-		CurrentInjectionInfo = CurrentInjectionInfo->NextInjectionInfo;
+		DebugOutput("CreateInjectionInfo: Failed to index injection info for pid %d.\n", ProcessId);
+		free(CurrentInjectionInfo);
+		return NULL;
 	}
 
-	if (!CurrentInjectionInfo && PreviousInjectionInfo)
-	{
-		// We haven't found it in the linked list, so create a new one
-		CurrentInjectionInfo = PreviousInjectionInfo;
-
-		CurrentInjectionInfo->NextInjectionInfo = ((struct InjectionInfo*)calloc(sizeof(struct InjectionInfo), sizeof(BYTE)));
-
-		if (CurrentInjectionInfo->NextInjectionInfo == NULL)
-		{
-			DebugOutput("CreateInjectionInfo: Failed to allocate new thread breakpoints.\n");
-			return NULL;
-		}
-
-		CurrentInjectionInfo = CurrentInjectionInfo->NextInjectionInfo;
+	// The list is kept in creation order for TerminateHandler
+	if (InjectionInfoTail)
+		InjectionInfoTail->NextInjectionInfo = CurrentInjectionInfo;
+	else
+		InjectionInfoList = CurrentInjectionInfo;
 
-		CurrentInjectionInfo->ProcessId = ProcessId;
-	}
+	InjectionInfoTail = CurrentInjectionInfo;
 
 	return CurrentInjectionInfo;
 }
@@ -143,122 +130,86 @@ PINJECTIONINFO CreateInjectionInfo(DWORD ProcessId)
 BOOL DropInjectionInfo(HANDLE ProcessHandle)
 //**************************************************************************************
 {
-	HANDLE CurrentProcessHandle;
-	PINJECTIONINFO PreviousInjectionInfo, CurrentInjectionInfo = InjectionInfoList;
+	PINJECTIONINFO PreviousInjectionInfo, CurrentInjectionInfo = GetInjectionInfoFromHandle(ProcessHandle);
+
+	if (!CurrentInjectionInfo)
+		return FALSE;
 
 	PreviousInjectionInfo = NULL;
 
-	while (CurrentInjectionInfo)
+	if (InjectionInfoList != CurrentInjectionInfo)
 	{
-		CurrentProcessHandle = CurrentInjectionInfo->ProcessHandle;
+		PreviousInjectionInfo = InjectionInfoList;
+		while (PreviousInjectionInfo && PreviousInjectionInfo->NextInjectionInfo != CurrentInjectionInfo)
+			PreviousInjectionInfo = PreviousInjectionInfo->NextInjectionInfo;
+	}
 
-		if (CurrentProcessHandle == ProcessHandle)
-		{
-			// Unlink this from the list and free the memory
-			if (PreviousInjectionInfo && CurrentInjectionInfo->NextInjectionInfo)
-			{
-				PreviousInjectionInfo->NextInjectionInfo = CurrentInjectionInfo->NextInjectionInfo;
-				DebugOutput("DropInjectionInfo: removed injection info for pid %d.\n", CurrentInjectionInfo->ProcessId);
-			}
-			else if (PreviousInjectionInfo && CurrentInjectionInfo->NextInjectionInfo == NULL)
-			{
-				PreviousInjectionInfo->NextInjectionInfo = NULL;
-				DebugOutput("DropInjectionInfo: removed injection info for pid %d from the end of the section view list.\n", CurrentInjectionInfo->ProcessId);
-			}
-			else if (!PreviousInjectionInfo)
-			{
-				InjectionInfoList = NULL;
-				DebugOutput("DropInjectionInfo: removed the head of the injection info list for pid %d.\n", CurrentInjectionInfo->ProcessId);
-			}
+	if (PreviousInjectionInfo)
+		PreviousInjectionInfo->NextInjectionInfo = CurrentInjectionInfo->NextInjectionInfo;
+	else
+		InjectionInfoList = CurrentInjectionInfo->NextInjectionInfo;
 
-			free(CurrentInjectionInfo);
+	if (InjectionInfoTail == CurrentInjectionInfo)
+		InjectionInfoTail = PreviousInjectionInfo;
 
-			return TRUE;
-		}
+	PtrMapRemove(&InjectionInfoByHandle, (uintptr_t)ProcessHandle);
 
-		PreviousInjectionInfo = CurrentInjectionInfo;
-		CurrentInjectionInfo = CurrentInjectionInfo->NextInjectionInfo;
-	}
+	if (GetInjectionInfo(CurrentInjectionInfo->ProcessId) == CurrentInjectionInfo)
+		PtrMapRemove(&InjectionInfoByPid, (uintptr_t)CurrentInjectionInfo->ProcessId);
 
-	return FALSE;
+	DebugOutput("DropInjectionInfo: removed injection info for pid %d.\n", CurrentInjectionInfo->ProcessId);
+
+	WriteCaptureFree(&CurrentInjectionInfo->WriteCapture);
+	free(CurrentInjectionInfo);
+
+	return TRUE;
 }
 
 //**************************************************************************************
 PINJECTIONSECTIONVIEW GetSectionView(HANDLE SectionHandle)
 //**************************************************************************************
 {
-	PINJECTIONSECTIONVIEW CurrentSectionView = SectionViewList;
-
-	while (CurrentSectionView)
-	{
-		if (CurrentSectionView->SectionHandle == SectionHandle)
-			return CurrentSectionView;
-
-		CurrentSectionView = CurrentSectionView->NextSectionView;
-	}
-
-	return NULL;
+	return (PINJECTIONSECTIONVIEW)HandleStateGetSectionView(g_handles, (uintptr_t)SectionHandle);
 }
 
 //**************************************************************************************
 PINJECTIONSECTIONVIEW AddSectionView(HANDLE SectionHandle, PVOID LocalView, SIZE_T ViewSize)
 //**************************************************************************************
 {
-	PINJECTIONSECTIONVIEW CurrentSectionView, PreviousSectionView;
+	PINJECTIONSECTIONVIEW CurrentSectionView = GetSectionView(SectionHandle);
 
-	PreviousSectionView = NULL;
+	if (CurrentSectionView)
+		return CurrentSectionView;
 
-	if (SectionViewList == NULL)
-	{
-		SectionViewList = ((struct InjectionSectionView*)calloc(sizeof(struct InjectionSectionView), sizeof(BYTE)));
+	CurrentSectionView = ((struct InjectionSectionView*)calloc(sizeof(struct InjectionSectionView), sizeof(BYTE)));
 
-		if (SectionViewList == NULL)
-		{
-			DebugOutput("AddSectionView: failed to allocate memory for initial section view list.\n");
-			return NULL;
-		}
-
-		SectionViewList->SectionHandle = SectionHandle;
-		if (LocalView)
-		{
-			SectionViewList->LocalView = LocalView;
-			SectionViewList->ViewSize = ViewSize;
-		}
+	if (CurrentSectionView == NULL)
+	{
+		DebugOutput("AddSectionView: Failed to allocate new injection section view structure.\n");
+		return NULL;
 	}
 
-	CurrentSectionView = SectionViewList;
+	CurrentSectionView->SectionHandle = SectionHandle;
 
-	while (CurrentSectionView)
+	if (LocalView)
 	{
-		if ((CurrentSectionView->SectionHandle) == SectionHandle)
-			break;
-
-		PreviousSectionView = CurrentSectionView;
-		CurrentSectionView = CurrentSectionView->NextSectionView;
+		CurrentSectionView->LocalView = LocalView;
+		CurrentSectionView->ViewSize = ViewSize;
 	}
 
-	if (!CurrentSectionView && PreviousSectionView)
+	if (!HandleStateSetSectionView(g_handles, (uintptr_t)SectionHandle, CurrentSectionView))
 	{
-		// We haven't found it in the linked list, so create a new one
-		CurrentSectionView = PreviousSectionView;
-
-		CurrentSectionView->NextSectionView = ((struct InjectionSectionView*)calloc(sizeof(struct InjectionSectionView), sizeof(BYTE)));
-
-		if (CurrentSectionView->NextSectionView == NULL)
-		{
-			DebugOutput("CreateSectionView: Failed to allocate new injection sectionview structure.\n");
-			return NULL;
-		}
+		DebugOutput("AddSectionView: Failed to index section view with handle 0x%x.\n", SectionHandle);
+		free(CurrentSectionView);
+		return NULL;
+	}
 
-		CurrentSectionView = CurrentSectionView->NextSectionView;
-		CurrentSectionView->SectionHandle = SectionHandle;
+	if (SectionViewTail)
+		SectionViewTail->NextSectionView = CurrentSectionView;
+	else
+		SectionViewList = CurrentSectionView;
 
-		if (LocalView)
-		{
-			CurrentSectionView->LocalView = LocalView;
-			CurrentSectionView->ViewSize = ViewSize;
-		}
-	}
+	SectionViewTail = CurrentSectionView;
 
 	return CurrentSectionView;
 }
@@ -267,49 +218,44 @@ PINJECTIONSECTIONVIEW AddSectionView(HANDLE SectionHandle, PVOID LocalView, SIZE
 BOOL DropSectionView(PINJECTIONSECTIONVIEW SectionView)
 //**************************************************************************************
 {
-	PINJECTIONSECTIONVIEW CurrentSectionView, PreviousSectionView;
-
-	PreviousSectionView = NULL;
+	PINJECTIONSECTIONVIEW PreviousSectionView = NULL;
 
-	if (SectionViewList == NULL)
+	if (!SectionView || !SectionViewList)
 	{
-		DebugOutput("DropSectionView: failed to obtain initial section view list.\n");
+		DebugOutput("DropSectionView: failed to find section view in section view list.\n");
 		return FALSE;
 	}
 
-	CurrentSectionView = SectionViewList;
-
-	while (CurrentSectionView)
+	// Views outlive their section handles, so membership is checked on the list
+	if (SectionViewList != SectionView)
 	{
-		if (CurrentSectionView == SectionView)
+		PreviousSectionView = SectionViewList;
+		while (PreviousSectionView && PreviousSectionView->NextSectionView != SectionView)
+			PreviousSectionView = PreviousSectionView->NextSectionView;
+
+		if (!PreviousSectionView)
 		{
-			// Unlink this from the list and free the memory
-			if (PreviousSectionView && CurrentSectionView->NextSectionView)
-			{
-				PreviousSectionView->NextSectionView = CurrentSectionView->NextSectionView;
-				DebugOutput("DropSectionView: removed a view from section view list.\n");
-			}
-			else if (PreviousSectionView && CurrentSectionView->NextSectionView == NULL)
-			{
-				PreviousSectionView->NextSectionView = NULL;
-				DebugOutput("DropSectionView: removed the view from the end of the section view list.\n");
-			}
-			else if (!PreviousSectionView)
-			{
-				SectionViewList = NULL;
-				DebugOutput("DropSectionView: removed the head of the section view list.\n");
-			}
+			DebugOutput("DropSectionView: failed to find section view in section view list.\n");
+			return FALSE;
+		}
+	}
 
-			free(CurrentSectionView);
+	if (PreviousSectionView)
+		PreviousSectionView->NextSectionView = SectionView->NextSectionView;
+	else
+		SectionViewList = SectionView->NextSectionView;
 
-			return TRUE;
-		}
+	if (SectionViewTail == SectionView)
+		SectionViewTail = PreviousSectionView;
 
-		PreviousSectionView = CurrentSectionView;
-		CurrentSectionView = CurrentSectionView->NextSectionView;
-	}
+	if (GetSectionView(SectionView->SectionHandle) == SectionView)
+		HandleStateSetSectionView(g_handles, (uintptr_t)SectionView->SectionHandle, NULL);
 
-	return FALSE;
+	DebugOutput("DropSectionView: removed a view from section view list.\n");
+
+	free(SectionView);
+
+	return TRUE;
 }
 
 //**************************************************************************************
@@ -492,26 +438,65 @@ void DumpSectionView(PINJECTIONSECTIONVIEW SectionView)
 }
 
 //**************************************************************************************
-void DumpSectionViewsForHandle(HANDLE SectionHandle)
+void CloseSectionHandler(PINJECTIONSECTIONVIEW SectionView)
 //**************************************************************************************
 {
-	PINJECTIONSECTIONVIEW CurrentSectionView = SectionViewList;
-
-	while (CurrentSectionView)
+	// The view mapped through the handle being closed, if any
+	if (SectionView && SectionView->TargetProcessId)
 	{
-		if (CurrentSectionView->SectionHandle == SectionHandle)
-			break;
-
-		CurrentSectionView = CurrentSectionView->NextSectionView;
+		DebugOutput("CloseSectionHandler: Dumping section view at 0x%p for handle 0x%x (target process %d).\n", SectionView->LocalView, SectionView->SectionHandle, SectionView->TargetProcessId);
+		DumpSectionView(SectionView);
 	}
 
-	if (CurrentSectionView && CurrentSectionView->TargetProcessId)
+	return;
+}
+
+//**************************************************************************************
+void DumpWriteCapture(PINJECTIONINFO InjectionInfo)
+//**************************************************************************************
+{
+	PWRITECAPTUREBLOCK Block;
+	SIZE_T Size;
+	size_t i;
+
+	if (!InjectionInfo || !InjectionInfo->WriteCapture.Count)
+		return;
+
+	for (i = 0; i < InjectionInfo->WriteCapture.Count; i++)
 	{
-		DebugOutput("DumpSectionViewsForHandle: Dumping section view at 0x%p for handle 0x%x (target process %d).\n", CurrentSectionView->LocalView, SectionHandle, CurrentSectionView->TargetProcessId);
-		DumpSectionView(CurrentSectionView);
+		Block = &InjectionInfo->WriteCapture.Blocks[i];
+		Size = (SIZE_T)(Block->End - Block->Start);
+
+		if (Size <= 0x10)	// As for individual writes
+			continue;
+
+		if (InjectionInfo->ImageDumped && InjectionInfo->ImageBase >= Block->Start && InjectionInfo->ImageBase < Block->End)
+		{
+			DebugOutput("DumpWriteCapture: Skipping captured writes at 0x%p (size 0x%x) containing PE image already dumped.\n", Block->Start, Size);
+			continue;
+		}
+
+		DebugOutput("DumpWriteCapture: Dumping %d captured writes at 0x%p (size 0x%x) in process %d.\n", Block->Writes, Block->Start, Size, InjectionInfo->ProcessId);
+
+		CapeMetaData->DumpType = INJECTION_PE;
+		CapeMetaData->TargetPid = InjectionInfo->ProcessId;
+
+		if (DumpPEsInRange(Block->Data, Size))
+			DebugOutput("DumpWriteCapture: Dumped PE image from captured writes.\n");
+		else
+		{
+			CapeMetaData->DumpType = INJECTION_SHELLCODE;
+			CapeMetaData->TargetPid = InjectionInfo->ProcessId;
+
+			if (DumpMemory(Block->Data, Size))
+				DebugOutput("DumpWriteCapture: Dumped injected code/data from captured writes.\n");
+			else
+				DebugOutput("DumpWriteCapture: Failed to dump injected code/data from captured writes.\n");
+		}
 	}
 
-	return;
+	// Writes after this trigger start a fresh capture
+	WriteCaptureFree(&InjectionInfo->WriteCapture);
 }
 
 void GetThreadContextHandler(DWORD Pid, LPCONTEXT Context)
@@ -540,6 +525,8 @@ void SetThreadContextHandler(DWORD Pid, const CONTEXT *Context)
 	if (!CurrentInjectionInfo)
 		return;
 
+	DumpWriteCapture(CurrentInjectionInfo);
+
 #ifdef _WIN64
 	if (VirtualQueryEx(CurrentInjectionInfo->ProcessHandle, (PVOID)Context->Rcx, &MemoryInfo, sizeof(MemoryInfo)))
 		CurrentInjectionInfo->ImageBase = (DWORD_PTR)MemoryInfo.AllocationBase;
@@ -629,7 +616,7 @@ void CreateProcessHandler(LPWSTR lpApplicationName, LPWSTR lpCommandLine, LPPROC
 		return;
 	}
 
-	CurrentInjectionInfo->ProcessHandle = lpProcessInformation->hProcess;
+	SetInjectionInfoHandle(CurrentInjectionInfo, lpProcessInformation->hProcess);
 	CurrentInjectionInfo->InitialThreadId = lpProcessInformation->dwThreadId;
 	CurrentInjectionInfo->ImageBase = (DWORD_PTR)get_process_image_base(lpProcessInformation->hProcess);
 	CurrentInjectionInfo->EntryPoint = (DWORD_PTR)NULL;
@@ -693,7 +680,7 @@ PCHAR OpenProcessHandler(HANDLE ProcessHandle, DWORD Pid)
 		CurrentInjectionInfo = CreateInjectionInfo(Pid);
 		if (CurrentInjectionInfo)
 		{
-			CurrentInjectionInfo->ProcessHandle = ProcessHandle;
+			SetInjectionInfoHandle(CurrentInjectionInfo, ProcessHandle);
 			CurrentInjectionInfo->EntryPoint = (DWORD_PTR)NULL;
 			CurrentInjectionInfo->ImageDumped = FALSE;
 
@@ -750,7 +737,8 @@ void MapSectionViewHandler(HANDLE ProcessHandle, HANDLE SectionHandle, PVOID Bas
 	{
 		ErrorOutput("MapSectionViewHandler: Failed to obtain pid from process handle 0x%x", ProcessHandle);
 		CurrentInjectionInfo = GetInjectionInfoFromHandle(ProcessHandle);
-		Pid = CurrentInjectionInfo->ProcessId;
+		if (CurrentInjectionInfo)
+			Pid = CurrentInjectionInfo->ProcessId;
 	}
 	else
 		CurrentInjectionInfo = GetInjectionInfo(Pid);
@@ -783,7 +771,7 @@ void MapSectionViewHandler(HANDLE ProcessHandle, HANDLE SectionHandle, PVOID Bas
 	}
 	else if (CurrentInjectionInfo && CurrentInjectionInfo->ProcessId == Pid)
 	{
-		CurrentInjectionInfo->ProcessHandle = ProcessHandle;
+		SetInjectionInfoHandle(CurrentInjectionInfo, ProcessHandle);
 		CurrentSectionView = GetSectionView(SectionHandle);
 
 		if (!CurrentSectionView)
@@ -806,7 +794,7 @@ void MapSectionViewHandler(HANDLE ProcessHandle, HANDLE SectionHandle, PVOID Bas
 
 		if (CurrentInjectionInfo)
 		{
-			CurrentInjectionInfo->ProcessHandle = ProcessHandle;
+			SetInjectionInfoHandle(CurrentInjectionInfo, ProcessHandle);
 			CurrentInjectionInfo->ProcessId = Pid;
 			CurrentInjectionInfo->EntryPoint = (DWORD_PTR)NULL;
 			CurrentInjectionInfo->ImageDumped = FALSE;
@@ -861,12 +849,15 @@ void MapSectionViewHandler(HANDLE ProcessHandle, HANDLE SectionHandle, PVOID Bas
 
 void UnmapSectionViewHandler(PVOID BaseAddress)
 {
-	PINJECTIONSECTIONVIEW CurrentSectionView;
+	PINJECTIONSECTIONVIEW CurrentSectionView, NextSectionView;
 
 	CurrentSectionView = SectionViewList;
 
 	while (CurrentSectionView)
 	{
+		// DumpSectionView may drop the view
+		NextSectionView = CurrentSectionView->NextSectionView;
+
 		if (CurrentSectionView->TargetProcessId && CurrentSectionView->LocalView == BaseAddress)
 		{
 			DebugOutput("UnmapSectionViewHandler: Attempt to unmap view at 0x%p, dumping.\n", BaseAddress);
@@ -874,7 +865,7 @@ void UnmapSectionViewHandler(PVOID BaseAddress)
 			DumpSectionView(CurrentSectionView);
 		}
 
-		CurrentSectionView = CurrentSectionView->NextSectionView;
+		CurrentSectionView = NextSectionView;
 	}
 }
 
@@ -882,6 +873,7 @@ void WriteMemoryHandler(HANDLE ProcessHandle, LPVOID BaseAddress, LPCVOID Buffer
 {
 	DWORD Pid;
 	struct InjectionInfo *CurrentInjectionInfo;
+	PWRITECAPTUREBLOCK CaptureBlock = NULL;
 	char DevicePath[MAX_PATH];
 	unsigned int PathLength;
 
@@ -902,7 +894,7 @@ void WriteMemoryHandler(HANDLE ProcessHandle, LPVOID BaseAddress, LPCVOID Buffer
 		}
 		else
 		{
-			CurrentInjectionInfo->ProcessHandle = ProcessHandle;
+			SetInjectionInfoHandle(CurrentInjectionInfo, ProcessHandle);
 			CurrentInjectionInfo->ProcessId = Pid;
 			CurrentInjectionInfo->EntryPoint = (DWORD_PTR)NULL;
 			CurrentInjectionInfo->ImageDumped = FALSE;
@@ -933,9 +925,26 @@ void WriteMemoryHandler(HANDLE ProcessHandle, LPVOID BaseAddress, LPCVOID Buffer
 	if (!CurrentInjectionInfo || CurrentInjectionInfo->ProcessId != Pid)
 		return;
 
+	// Mirror the written bytes so that an image written piecemeal is dumped once, at the next trigger
+	__try
+	{
+		CaptureBlock = WriteCaptureAdd(&CurrentInjectionInfo->WriteCapture, (uintptr_t)BaseAddress, Buffer, NumberOfBytesWritten);
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		DebugOutput("WriteMemoryHandler: Exception reading written buffer at 0x%p.\n", Buffer);
+		return;
+	}
+
 	// Check if we have a valid DOS and PE header at the beginning of Buffer
-	if (IsDisguisedPEHeader((PVOID)Buffer))
+	if (IsDisguisedPEHeader((PVOID)Buffer) > 0)
 	{
+		PIMAGE_NT_HEADERS pNtHeader = (PIMAGE_NT_HEADERS)((char*)Buffer + ((PIMAGE_DOS_HEADER)Buffer)->e_lfanew);
+
+		// Sections written later at their virtual addresses join the header's block
+		if (NumberOfBytesWritten >= (SIZE_T)((PBYTE)&pNtHeader->OptionalHeader.SizeOfImage + sizeof(DWORD) - (PBYTE)Buffer))
+			WriteCaptureReserve(&CurrentInjectionInfo->WriteCapture, (uintptr_t)BaseAddress, pNtHeader->OptionalHeader.SizeOfImage);
+
 		CurrentInjectionInfo->ImageBase = (DWORD_PTR)BaseAddress;
 		DebugOutput("WriteMemoryHandler: Executable binary injected into process %d (ImageBase 0x%x)\n", Pid, CurrentInjectionInfo->ImageBase);
 
@@ -977,6 +986,10 @@ void WriteMemoryHandler(HANDLE ProcessHandle, LPVOID BaseAddress, LPCVOID Buffer
 			// We don't want to dump these writes.
 			DebugOutput("WriteMemoryHandler: injection of section of PE image which has already been dumped.\n");
 		}
+		else if (CaptureBlock)
+		{
+			DebugOutput("WriteMemoryHandler: shellcode at 0x%p (size 0x%x) injected into process %d, captured at 0x%p (%d writes, size 0x%x).\n", Buffer, NumberOfBytesWritten, Pid, CaptureBlock->Start, CaptureBlock->Writes, CaptureBlock->End - CaptureBlock->Start);
+		}
 		else
 		{
 			DebugOutput("WriteMemoryHandler: shellcode at 0x%p (size 0x%x) injected into process %d.\n", Buffer, NumberOfBytesWritten, Pid);
@@ -1011,7 +1024,8 @@ void DuplicationHandler(HANDLE SourceHandle, HANDLE TargetHandle)
 	{
 		ErrorOutput("DuplicationHandler: Failed to obtain pid from target process handle 0x%x", TargetHandle);
 		CurrentInjectionInfo = GetInjectionInfoFromHandle(TargetHandle);
-		Pid = CurrentInjectionInfo->ProcessId;
+		if (CurrentInjectionInfo)
+			Pid = CurrentInjectionInfo->ProcessId;
 	}
 	else
 		CurrentInjectionInfo = GetInjectionInfo(Pid);
@@ -1045,7 +1059,7 @@ void DuplicationHandler(HANDLE SourceHandle, HANDLE TargetHandle)
 		}
 		else
 		{
-			CurrentInjectionInfo->ProcessHandle = SourceHandle;
+			SetInjectionInfoHandle(CurrentInjectionInfo, SourceHandle);
 			CurrentInjectionInfo->ProcessId = Pid;
 			CurrentInjectionInfo->EntryPoint = (DWORD_PTR)NULL;
 			CurrentInjectionInfo->ImageDumped = FALSE;
@@ -1087,21 +1101,29 @@ void DuplicationHandler(HANDLE SourceHandle, HANDLE TargetHandle)
 void CreateRemoteThreadHandler(DWORD Pid)
 {
 	DumpSectionViewsForPid(Pid);
+	DumpWriteCapture(GetInjectionInfo(Pid));
 }
 
 void ResumeThreadHandler(DWORD Pid)
 {
 	DumpSectionViewsForPid(Pid);
+	DumpWriteCapture(GetInjectionInfo(Pid));
 }
 
 void ResumeProcessHandler(HANDLE ProcessHandle, DWORD Pid)
 {
 	DumpSectionViewsForPid(Pid);
+	DumpWriteCapture(GetInjectionInfo(Pid));
 }
 
 void TerminateHandler()
 {
-	PINJECTIONINFO CurrentInjectionInfo = InjectionInfoList;
+	PINJECTIONINFO CurrentInjectionInfo;
+
+	for (CurrentInjectionInfo = InjectionInfoList; CurrentInjectionInfo; CurrentInjectionInfo = CurrentInjectionInfo->NextInjectionInfo)
+		DumpWriteCapture(CurrentInjectionInfo);
+
+	CurrentInjectionInfo = InjectionInfoList;
 
 	while (CurrentInjectionInfo && CurrentInjectionInfo->ProcessHandle && CurrentInjectionInfo->ProcessId)
 	{
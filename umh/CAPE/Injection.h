@@ -15,10 +15,12 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.If not, see <http://www.gnu.org/licenses/>.
 */
+#include "WriteCapture.h"
+
 #define MAX_UNICODE_PATH 32768
+#define WRITE_CAPTURE_LIMIT 0x4000000
 
 void DumpSectionViewsForPid(DWORD Pid);
-void DumpSectionViewsForHandle(HANDLE SectionHandle);
 
 typedef enum _SECTION_INHERIT {
 	ViewShare = 1,
@@ -54,6 +56,7 @@ typedef struct InjectionInfo
 	unsigned int	BufferSizeOfImage;
 	HANDLE			SectionHandle;
 	BOOL			DontMonitor;
+	WRITECAPTURE	WriteCapture;
 //	struct InjectionSectionView *SectionViewList;
 	struct InjectionInfo *NextInjectionInfo;
 } INJECTIONINFO, *PINJECTIONINFO;
@@ -64,11 +67,14 @@ struct InjectionSectionView *SectionViewList;
 PINJECTIONINFO GetInjectionInfo(DWORD ProcessId);
 PINJECTIONINFO GetInjectionInfoFromHandle(HANDLE ProcessHandle);
 PINJECTIONINFO CreateInjectionInfo(DWORD ProcessId);
+void SetInjectionInfoHandle(PINJECTIONINFO InjectionInfo, HANDLE ProcessHandle);
 BOOL DropInjectionInfo(HANDLE ProcessHandle);
 void CreateProcessHandler(LPWSTR lpApplicationName, LPWSTR lpCommandLine, LPPROCESS_INFORMATION lpProcessInformation);
 PCHAR OpenProcessHandler(HANDLE ProcessHandle, DWORD Pid);
 void ResumeProcessHandler(HANDLE ProcessHandle, DWORD Pid);
 void MapSectionViewHandler(HANDLE ProcessHandle, HANDLE SectionHandle, PVOID BaseAddress, SIZE_T ViewSize);
 void UnmapSectionViewHandler(PVOID BaseAddress);
+void CloseSectionHandler(PINJECTIONSECTIONVIEW SectionView);
 void WriteMemoryHandler(HANDLE ProcessHandle, LPVOID BaseAddress, LPCVOID Buffer, SIZE_T NumberOfBytesWritten);
+void DumpWriteCapture(PINJECTIONINFO InjectionInfo);
 void TerminateHandler();
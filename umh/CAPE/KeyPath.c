@@ -0,0 +1,166 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "KeyPath.h"
+
+static const struct
+{
+	uintptr_t		Key;
+	const wchar_t	*Name;
+} PredefinedRoots[] =
+{
+	{KEY_PATH_ROOT(0x80000000), L"HKEY_CLASSES_ROOT"},
+	{KEY_PATH_ROOT(0x80000001), L"HKEY_CURRENT_USER"},
+	{KEY_PATH_ROOT(0x80000002), L"HKEY_LOCAL_MACHINE"},
+	{KEY_PATH_ROOT(0x80000003), L"HKEY_USERS"},
+	{KEY_PATH_ROOT(0x80000004), L"HKEY_PERFORMANCE_DATA"},
+	{KEY_PATH_ROOT(0x80000050), L"HKEY_PERFORMANCE_TEXT"},
+	{KEY_PATH_ROOT(0x80000060), L"HKEY_PERFORMANCE_NLSTEXT"},
+	{KEY_PATH_ROOT(0x80000005), L"HKEY_CURRENT_CONFIG"},
+	{KEY_PATH_ROOT(0x80000006), L"HKEY_DYN_DATA"},
+	{KEY_PATH_ROOT(0x80000007), L"HKEY_CURRENT_USER_LOCAL_SETTINGS"},
+};
+
+// Case-insensitive for ASCII letters, which is all the prefixes contain
+static int HasPrefix(const wchar_t *Path, size_t Length, const wchar_t *Prefix, size_t PrefixLength)
+{
+	size_t i;
+
+	if (Length < PrefixLength)
+		return 0;
+
+	for (i = 0; i < PrefixLength; i++)
+	{
+		wchar_t a = Path[i], b = Prefix[i];
+
+		if (a >= L'A' && a <= L'Z')
+			a += L'a' - L'A';
+		if (b >= L'A' && b <= L'Z')
+			b += L'a' - L'A';
+
+		if (a != b)
+			return 0;
+	}
+
+	return 1;
+}
+
+// A prefix ending at a key name boundary
+static int HasRoot(const wchar_t *Path, size_t Length, const wchar_t *Root, size_t RootLength)
+{
+	return HasPrefix(Path, Length, Root, RootLength) && (Length == RootLength || Path[RootLength] == L'\\');
+}
+
+// Replaces the first Old characters of Path with New
+static size_t Replace(wchar_t *Path, size_t Size, size_t Length, size_t Old, const wchar_t *New)
+{
+	size_t NewLength = wcslen(New);
+
+	if (Length - Old + NewLength + 1 > Size)
+		return Length;
+
+	memmove(Path + NewLength, Path + Old, (Length - Old) * sizeof(wchar_t));
+	memcpy(Path, New, NewLength * sizeof(wchar_t));
+	Length = Length - Old + NewLength;
+	Path[Length] = L'\0';
+
+	return Length;
+}
+
+//**************************************************************************************
+const wchar_t *KeyPathPredefinedRoot(uintptr_t Key)
+//**************************************************************************************
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(PredefinedRoots) / sizeof(PredefinedRoots[0]); i++)
+		if (PredefinedRoots[i].Key == Key)
+			return PredefinedRoots[i].Name;
+
+	return NULL;
+}
+
+//**************************************************************************************
+size_t KeyPathEncodedLength(const wchar_t *Name, size_t Length)
+//**************************************************************************************
+{
+	size_t i, Nulls = 0;
+
+	for (i = 0; i < Length; i++)
+		if (Name[i] == L'\0')
+			Nulls++;
+
+	return Length + Nulls * 3;
+}
+
+//**************************************************************************************
+size_t KeyPathEncode(wchar_t *Out, const wchar_t *Name, size_t Length)
+//**************************************************************************************
+{
+	size_t i, x = 0;
+
+	for (i = 0; i < Length; i++)
+	{
+		if (Name[i] == L'\0')
+		{
+			Out[x++] = L'\\';
+			Out[x++] = L'x';
+			Out[x++] = L'0';
+			Out[x++] = L'0';
+		}
+		else
+			Out[x++] = Name[i];
+	}
+
+	Out[x] = L'\0';
+
+	return x;
+}
+
+//**************************************************************************************
+size_t KeyPathJoin(wchar_t *Path, size_t Size, size_t Length, const wchar_t *SubKey, size_t SubKeyLength)
+//**************************************************************************************
+{
+	size_t Encoded = KeyPathEncodedLength(SubKey, SubKeyLength);
+
+	if (Length + 1 + Encoded + 1 > Size)
+		return 0;
+
+	Path[Length++] = L'\\';
+
+	return Length + KeyPathEncode(Path + Length, SubKey, SubKeyLength);
+}
+
+//**************************************************************************************
+size_t KeyPathNormalize(wchar_t *Path, size_t Size, size_t Length, const wchar_t *UserKey, size_t UserKeyLength)
+//**************************************************************************************
+{
+	if (UserKeyLength && HasRoot(Path, Length, UserKey, UserKeyLength))
+		return Replace(Path, Size, Length, UserKeyLength, L"HKEY_CURRENT_USER");
+
+	if (UserKeyLength && HasPrefix(Path, Length, UserKey, UserKeyLength) && HasPrefix(Path + UserKeyLength, Length - UserKeyLength, L"_Classes", 8))
+		return Replace(Path, Size, Length, UserKeyLength + 8, L"HKEY_CURRENT_USER\\Software\\Classes");
+
+	if (HasRoot(Path, Length, L"\\REGISTRY\\MACHINE", 17))
+		return Replace(Path, Size, Length, 17, L"HKEY_LOCAL_MACHINE");
+
+	if (HasRoot(Path, Length, L"\\REGISTRY\\USER", 14))
+		return Replace(Path, Size, Length, 14, L"HKEY_USERS");
+
+	return Length;
+}
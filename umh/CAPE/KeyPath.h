@@ -0,0 +1,53 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+// Registry key paths as they are logged: a root key's name (one of the
+// predefined roots, or the kernel's name for an open key, which callers
+// cache by handle) joined to a subkey, then with the kernel's \REGISTRY
+// prefixes rewritten to the familiar HKEY_ names. Lengths are in characters.
+
+#define KEY_PATH_ROOT(Value) ((uintptr_t)(intptr_t)(int32_t)(Value))	// as HKEY constants are defined
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Name of a predefined root key such as HKEY_LOCAL_MACHINE, or NULL
+const wchar_t *KeyPathPredefinedRoot(uintptr_t Key);
+// Length of Name once embedded nulls are written out as \x00
+size_t KeyPathEncodedLength(const wchar_t *Name, size_t Length);
+// Writes Name with embedded nulls written out and a terminator, returning the encoded length
+size_t KeyPathEncode(wchar_t *Out, const wchar_t *Name, size_t Length);
+// Appends a backslash and the encoded SubKey to the Length characters in
+// Path, returning the new length, or 0 if that and the terminator would not
+// fit in Size characters
+size_t KeyPathJoin(wchar_t *Path, size_t Size, size_t Length, const wchar_t *SubKey, size_t SubKeyLength);
+// Rewrites \REGISTRY\MACHINE, \REGISTRY\USER and the current user's key
+// (UserKey, \REGISTRY\USER\<sid>) and classes key at the start of Path in
+// place, returning the new length. Path is left as is if a rewrite would
+// not fit in Size characters.
+size_t KeyPathNormalize(wchar_t *Path, size_t Size, size_t Length, const wchar_t *UserKey, size_t UserKeyLength);
+
+#ifdef __cplusplus
+}
+#endif
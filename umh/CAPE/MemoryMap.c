@@ -0,0 +1,189 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "MemoryMap.h"
+
+#define MEMORYMAP_MIN_CAPACITY	64
+
+static uint64_t RegionEnd(const MEMREGION *Region)
+{
+	uint64_t End = Region->Base + Region->Size;
+	return End < Region->Base ? UINT64_MAX : End;
+}
+
+// The number of regions starting at or below Address
+static size_t Position(PMEMORYMAP Map, uint64_t Address)
+{
+	size_t Low = 0, High = Map->Count, Middle;
+
+	while (Low < High)
+	{
+		Middle = Low + (High - Low) / 2;
+		if (Map->Regions[Middle].Base <= Address)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	return Low;
+}
+
+static int Insert(PMEMORYMAP Map, size_t Index, const MEMREGION *Region)
+{
+	if (Map->Count == Map->Capacity)
+	{
+		size_t NewCapacity = Map->Capacity ? Map->Capacity * 2 : MEMORYMAP_MIN_CAPACITY;
+		PMEMREGION NewRegions = realloc(Map->Regions, NewCapacity * sizeof(MEMREGION));
+		if (!NewRegions)
+			return 0;
+		Map->Regions = NewRegions;
+		Map->Capacity = NewCapacity;
+	}
+
+	memmove(&Map->Regions[Index + 1], &Map->Regions[Index], (Map->Count - Index) * sizeof(MEMREGION));
+	Map->Regions[Index] = *Region;
+	Map->Count++;
+
+	return 1;
+}
+
+void MemoryMapInit(PMEMORYMAP Map, const MEMORYOS *Os)
+{
+	memset(Map, 0, sizeof(*Map));
+	Map->Os = *Os;
+}
+
+void MemoryMapFree(PMEMORYMAP Map)
+{
+	free(Map->Regions);
+	Map->Regions = NULL;
+	Map->Count = Map->Capacity = 0;
+}
+
+void MemoryMapReset(PMEMORYMAP Map)
+{
+	Map->Count = 0;
+}
+
+PMEMREGION MemoryMapQuery(PMEMORYMAP Map, uint64_t Address)
+{
+	MEMREGION Region;
+	size_t Index = Position(Map, Address);
+
+	Map->Lookups++;
+
+	if (Index && Address < RegionEnd(&Map->Regions[Index - 1]))
+		return &Map->Regions[Index - 1];
+
+	Map->Queries++;
+
+	if (!Map->Os.Query(Map->Os.Context, Address, &Region) || Address < Region.Base || Address >= RegionEnd(&Region))
+		return NULL;
+
+	// Memory that changed since the snapshot was taken can come back
+	// overlapping its neighbours, which keep the part they cover
+	if (Index && Region.Base < RegionEnd(&Map->Regions[Index - 1]))
+	{
+		Region.Size = RegionEnd(&Region) - RegionEnd(&Map->Regions[Index - 1]);
+		Region.Base = RegionEnd(&Map->Regions[Index - 1]);
+	}
+
+	if (Index < Map->Count && RegionEnd(&Region) > Map->Regions[Index].Base)
+		Region.Size = Map->Regions[Index].Base - Region.Base;
+
+	// Without room to keep it the region is still answered
+	if (!Insert(Map, Index, &Region))
+	{
+		Map->Uncached = Region;
+		return &Map->Uncached;
+	}
+
+	return &Map->Regions[Index];
+}
+
+size_t MemoryMapAddRange(PMEMORYMAP Map, uint64_t Address, uint64_t Size)
+{
+	PMEMREGION Region;
+	size_t Count = Map->Count;
+	uint64_t End = Address + Size < Address ? UINT64_MAX : Address + Size;
+
+	while (Address < End)
+	{
+		Region = MemoryMapQuery(Map, Address);
+		if (!Region || RegionEnd(Region) == UINT64_MAX)
+			break;
+		Address = RegionEnd(Region);
+	}
+
+	return Map->Count - Count;
+}
+
+int MemoryMapRead(PMEMORYMAP Map, uint64_t Address, size_t Size, void *Buffer)
+{
+	unsigned char *Data = Buffer;
+	uint64_t SplitEnd = 0;
+	PMEMREGION Region;
+	size_t Length, Run, Regions;
+
+	while (Size)
+	{
+		Region = MemoryMapQuery(Map, Address);
+		if (!Region)
+			return 0;
+
+		Length = RegionEnd(Region) - Address < Size ? (size_t)(RegionEnd(Region) - Address) : Size;
+
+		if (Region->State != MEMREGION_COMMIT)
+		{
+			memset(Data, 0, Length);
+			Data += Length;
+			Address += Length;
+			Size -= Length;
+			continue;
+		}
+
+		// Committed regions that follow on are read in the same call, unless
+		// that already failed and they are being read one at a time
+		Run = Length;
+		Regions = 1;
+		while (Address >= SplitEnd && Run < Size)
+		{
+			Region = MemoryMapQuery(Map, Address + Run);
+			if (!Region || Region->State != MEMREGION_COMMIT)
+				break;
+			Run += RegionEnd(Region) - (Address + Run) < Size - Run ? (size_t)(RegionEnd(Region) - (Address + Run)) : Size - Run;
+			Regions++;
+		}
+
+		Map->Reads++;
+		if (!Map->Os.Read(Map->Os.Context, Address, Data, Run))
+		{
+			if (Regions == 1)
+				return 0;
+			SplitEnd = Address + Run;
+			continue;
+		}
+
+		Data += Run;
+		Address += Run;
+		Size -= Run;
+	}
+
+	return 1;
+}
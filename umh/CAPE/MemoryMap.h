@@ -0,0 +1,96 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A snapshot of a process's address space for the length of a dump: the
+// regions VirtualQueryEx reports, kept sorted by address so each is queried
+// once however often it is looked up again. Regions are added as they are
+// first looked up, or a range at a time. Reads copy committed memory in as
+// few calls as the regions allow and fill everything else with zeroes. The
+// OS is reached only through MEMORYOS, so the same code runs elsewhere.
+
+#define MEMREGION_COMMIT	0x1000		// the values of MEM_COMMIT, MEM_RESERVE and MEM_FREE
+#define MEMREGION_RESERVE	0x2000
+#define MEMREGION_FREE		0x10000
+
+typedef struct MemRegion
+{
+	uint64_t	Base;
+	uint64_t	Size;
+	uint64_t	AllocationBase;
+	uint32_t	AllocationProtect;
+	uint32_t	State;
+	uint32_t	Protect;
+	uint32_t	Type;
+} MEMREGION, *PMEMREGION;
+
+// Fills Region with the region holding Address, returning 0 if there is none
+typedef int (*MEMQUERY)(void *Context, uint64_t Address, PMEMREGION Region);
+
+// Copies Size bytes at Address to Buffer, returning 0 unless all were copied
+typedef int (*MEMREAD)(void *Context, uint64_t Address, void *Buffer, size_t Size);
+
+typedef struct MemoryOs
+{
+	MEMQUERY	Query;
+	MEMREAD		Read;
+	void		*Context;
+} MEMORYOS, *PMEMORYOS;
+
+typedef struct MemoryMap
+{
+	PMEMREGION	Regions;
+	size_t		Count;
+	size_t		Capacity;
+	MEMORYOS	Os;
+	MEMREGION	Uncached;	// a region there was no room to add
+	size_t		Queries;	// calls to Os.Query
+	size_t		Lookups;	// regions looked up, from the snapshot or not
+	size_t		Reads;		// calls to Os.Read
+} MEMORYMAP, *PMEMORYMAP;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void MemoryMapInit(PMEMORYMAP Map, const MEMORYOS *Os);
+
+void MemoryMapFree(PMEMORYMAP Map);
+
+// Forgets every region, keeping the storage for the next snapshot
+void MemoryMapReset(PMEMORYMAP Map);
+
+// Queries the regions across [Address, Address + Size) in one pass, returning
+// how many were added
+size_t MemoryMapAddRange(PMEMORYMAP Map, uint64_t Address, uint64_t Size);
+
+// Returns the region holding Address, or NULL if the OS reports none. The
+// pointer is only good until the next region is added.
+PMEMREGION MemoryMapQuery(PMEMORYMAP Map, uint64_t Address);
+
+// Copies Size bytes at Address to Buffer, with zeroes for memory that is not
+// committed. Returns 0 if a committed region could not be read, or an
+// address had no region.
+int MemoryMapRead(PMEMORYMAP Map, uint64_t Address, size_t Size, void *Buffer);
+
+#ifdef __cplusplus
+}
+#endif
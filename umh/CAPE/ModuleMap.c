@@ -0,0 +1,324 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "ModuleMap.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef SRWLOCK LOCK;
+
+#define LockInit(Lock) InitializeSRWLock(Lock)
+#define LockFree(Lock)
+#define LockAcquire(Lock) AcquireSRWLockExclusive(Lock)
+#define LockRelease(Lock) ReleaseSRWLockExclusive(Lock)
+#define LockAcquireShared(Lock) AcquireSRWLockShared(Lock)
+#define LockReleaseShared(Lock) ReleaseSRWLockShared(Lock)
+#else
+#include <pthread.h>
+
+typedef pthread_rwlock_t LOCK;
+
+#define LockInit(Lock) pthread_rwlock_init(Lock, NULL)
+#define LockFree(Lock) pthread_rwlock_destroy(Lock)
+#define LockAcquire(Lock) pthread_rwlock_wrlock(Lock)
+#define LockRelease(Lock) pthread_rwlock_unlock(Lock)
+#define LockAcquireShared(Lock) pthread_rwlock_rdlock(Lock)
+#define LockReleaseShared(Lock) pthread_rwlock_unlock(Lock)
+#endif
+
+#define INITIAL_MODULES	64
+#define INITIAL_NAMES	64		// power of two
+
+typedef struct ModuleMapEntry
+{
+	uintptr_t	Base;
+	uintptr_t	End;
+	const char	*Name;
+} MODULEMAPENTRY, *PMODULEMAPENTRY;
+
+struct ModuleMap
+{
+	LOCK			Lock;
+	PMODULEMAPENTRY	Entries;	// sorted by Base
+	size_t			Count;
+	size_t			Capacity;
+	char			**Names;	// open addressing set of interned names
+	size_t			NameCount;
+	size_t			NameMask;
+};
+
+static uint32_t NameHash(const char *Name, size_t Length)
+{
+	uint32_t Hash = 2166136261u;
+
+	for (size_t i = 0; i < Length; i++)
+	{
+		Hash ^= (unsigned char)Name[i];
+		Hash *= 16777619u;
+	}
+
+	return Hash;
+}
+
+static int GrowNames(PMODULEMAP Map)
+{
+	size_t NewMask = Map->NameMask * 2 + 1;
+	char **NewNames = (char**)calloc(NewMask + 1, sizeof(char*));
+
+	if (!NewNames)
+		return 0;
+
+	for (size_t i = 0; i <= Map->NameMask; i++)
+	{
+		char *Name = Map->Names[i];
+		size_t Slot;
+
+		if (!Name)
+			continue;
+
+		Slot = NameHash(Name, strlen(Name)) & NewMask;
+		while (NewNames[Slot])
+			Slot = (Slot + 1) & NewMask;
+		NewNames[Slot] = Name;
+	}
+
+	free(Map->Names);
+	Map->Names = NewNames;
+	Map->NameMask = NewMask;
+
+	return 1;
+}
+
+// Called with the lock held exclusively
+static const char *InternName(PMODULEMAP Map, const char *Name, size_t Length)
+{
+	size_t Slot;
+	char *Copy;
+
+	if ((Map->NameCount + 1) * 4 > (Map->NameMask + 1) * 3 && !GrowNames(Map))
+		return NULL;
+
+	Slot = NameHash(Name, Length) & Map->NameMask;
+
+	while (Map->Names[Slot])
+	{
+		if (!strncmp(Map->Names[Slot], Name, Length) && Map->Names[Slot][Length] == '\0')
+			return Map->Names[Slot];
+		Slot = (Slot + 1) & Map->NameMask;
+	}
+
+	Copy = (char*)malloc(Length + 1);
+
+	if (!Copy)
+		return NULL;
+
+	memcpy(Copy, Name, Length);
+	Copy[Length] = '\0';
+	Map->Names[Slot] = Copy;
+	Map->NameCount++;
+
+	return Copy;
+}
+
+// Index of the first entry ending after Address, which is the only one that
+// can contain it since ranges are sorted and disjoint
+static size_t FirstEndingAfter(PMODULEMAP Map, uintptr_t Address)
+{
+	size_t Low = 0, High = Map->Count;
+
+	while (Low < High)
+	{
+		size_t Middle = Low + (High - Low) / 2;
+
+		if (Map->Entries[Middle].End <= Address)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	return Low;
+}
+
+//**************************************************************************************
+PMODULEMAP ModuleMapCreate(void)
+//**************************************************************************************
+{
+	PMODULEMAP Map = (PMODULEMAP)calloc(1, sizeof(MODULEMAP));
+
+	if (!Map)
+		return NULL;
+
+	Map->Capacity = INITIAL_MODULES;
+	Map->Entries = (PMODULEMAPENTRY)malloc(Map->Capacity * sizeof(MODULEMAPENTRY));
+	Map->NameMask = INITIAL_NAMES - 1;
+	Map->Names = (char**)calloc(INITIAL_NAMES, sizeof(char*));
+
+	if (!Map->Entries || !Map->Names)
+	{
+		free(Map->Entries);
+		free(Map->Names);
+		free(Map);
+		return NULL;
+	}
+
+	LockInit(&Map->Lock);
+
+	return Map;
+}
+
+//**************************************************************************************
+void ModuleMapDestroy(PMODULEMAP Map)
+//**************************************************************************************
+{
+	if (!Map)
+		return;
+
+	for (size_t i = 0; i <= Map->NameMask; i++)
+		free(Map->Names[i]);
+
+	LockFree(&Map->Lock);
+	free(Map->Names);
+	free(Map->Entries);
+	free(Map);
+}
+
+//**************************************************************************************
+int ModuleMapAdd(PMODULEMAP Map, uintptr_t Base, uintptr_t End, const char *Name, size_t NameLength)
+//**************************************************************************************
+{
+	const char *Interned = NULL;
+	size_t First, Last;
+	int Ret = 0;
+
+	if (!Map || End <= Base)
+		return 0;
+
+	LockAcquire(&Map->Lock);
+
+	if (Name)
+	{
+		Interned = InternName(Map, Name, NameLength);
+		if (!Interned)
+			goto out;
+	}
+
+	// [First, Last) are the entries the new range overlaps
+	First = FirstEndingAfter(Map, Base);
+	for (Last = First; Last < Map->Count && Map->Entries[Last].Base < End; Last++)
+		;
+
+	if (First == Last && Map->Count == Map->Capacity)
+	{
+		size_t NewCapacity = Map->Capacity * 2;
+		PMODULEMAPENTRY NewEntries = (PMODULEMAPENTRY)realloc(Map->Entries, NewCapacity * sizeof(MODULEMAPENTRY));
+
+		if (!NewEntries)
+			goto out;
+
+		Map->Entries = NewEntries;
+		Map->Capacity = NewCapacity;
+	}
+
+	if (Last != First + 1)
+	{
+		memmove(&Map->Entries[First + 1], &Map->Entries[Last], (Map->Count - Last) * sizeof(MODULEMAPENTRY));
+		Map->Count = Map->Count + 1 - (Last - First);
+	}
+
+	Map->Entries[First].Base = Base;
+	Map->Entries[First].End = End;
+	Map->Entries[First].Name = Interned;
+	Ret = 1;
+
+out:
+	LockRelease(&Map->Lock);
+
+	return Ret;
+}
+
+//**************************************************************************************
+int ModuleMapRemove(PMODULEMAP Map, uintptr_t Base)
+//**************************************************************************************
+{
+	size_t Index;
+	int Ret = 0;
+
+	if (!Map)
+		return 0;
+
+	LockAcquire(&Map->Lock);
+
+	Index = FirstEndingAfter(Map, Base);
+
+	if (Index < Map->Count && Map->Entries[Index].Base == Base)
+	{
+		memmove(&Map->Entries[Index], &Map->Entries[Index + 1], (Map->Count - Index - 1) * sizeof(MODULEMAPENTRY));
+		Map->Count--;
+		Ret = 1;
+	}
+
+	LockRelease(&Map->Lock);
+
+	return Ret;
+}
+
+//**************************************************************************************
+int ModuleMapLookup(PMODULEMAP Map, uintptr_t Address, uintptr_t *Base, const char **Name)
+//**************************************************************************************
+{
+	size_t Index;
+	int Ret = 0;
+
+	if (!Map)
+		return 0;
+
+	LockAcquireShared(&Map->Lock);
+
+	Index = FirstEndingAfter(Map, Address);
+
+	if (Index < Map->Count && Map->Entries[Index].Base <= Address)
+	{
+		if (Base)
+			*Base = Map->Entries[Index].Base;
+		if (Name)
+			*Name = Map->Entries[Index].Name;
+		Ret = 1;
+	}
+
+	LockReleaseShared(&Map->Lock);
+
+	return Ret;
+}
+
+//**************************************************************************************
+size_t ModuleMapCount(PMODULEMAP Map)
+//**************************************************************************************
+{
+	size_t Count;
+
+	if (!Map)
+		return 0;
+
+	LockAcquireShared(&Map->Lock);
+	Count = Map->Count;
+	LockReleaseShared(&Map->Lock);
+
+	return Count;
+}
@@ -0,0 +1,50 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sorted index of loaded module ranges [Base, End) for address-to-module
+// resolution in O(log n). Ranges never overlap: adding one drops any it
+// overlaps, as a module can only be mapped where an earlier one has gone.
+// Names are interned for the lifetime of the map, so lookups hand out
+// pointers that need no freeing and stay valid after the module unloads.
+// Lookups take a shared lock and may run concurrently with each other.
+
+typedef struct ModuleMap MODULEMAP, *PMODULEMAP;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+PMODULEMAP ModuleMapCreate(void);
+void ModuleMapDestroy(PMODULEMAP Map);
+// Adds [Base, End) under Name (which may be NULL), replacing any ranges it
+// overlaps, returning 0 on failure or an empty range
+int ModuleMapAdd(PMODULEMAP Map, uintptr_t Base, uintptr_t End, const char *Name, size_t NameLength);
+// Removes the module at Base, returning 1 if there was one
+int ModuleMapRemove(PMODULEMAP Map, uintptr_t Base);
+// Returns 1 if Address is within a module, giving its base and interned name
+// through Base and Name if they are not NULL
+int ModuleMapLookup(PMODULEMAP Map, uintptr_t Address, uintptr_t *Base, const char **Name);
+size_t ModuleMapCount(PMODULEMAP Map);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,473 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "MultiReplace.h"
+
+#define NIL				0xffffffff
+#define MAX_STATES		0xfffe
+#define MAX_MATCHES		64		// beyond this the patterns are applied one by one
+#define MAX_CANDIDATES	(2 * MAX_MATCHES)
+
+typedef struct MultiReplaceEntry
+{
+	const unsigned char	*Find;
+	const unsigned char	*Replace;
+	uint32_t			Length;		// 0 if ignored
+	uint32_t			Flags;
+	uint32_t			NextOutput;	// next pattern ending in the same state
+} MULTIREPLACEENTRY, *PMULTIREPLACEENTRY;
+
+struct MultiReplace
+{
+	unsigned int		Count;
+	unsigned int		Classes;
+	unsigned int		States;
+	uint8_t				ClassMap[256];	// character to column, letters folded, 0 for any other
+	uint32_t			*Next;			// States x Classes transitions to a row, shifted left, with bit 0 set if patterns end there
+	uint32_t			*Output;		// first pattern ending in a state
+	uint32_t			*Dictionary;	// nearest shorter suffix state with outputs
+	PMULTIREPLACEENTRY	Entries;
+	unsigned char		*Strings;
+};
+
+typedef struct MultiReplaceMatch
+{
+	uint32_t	Pattern;
+	size_t		Start;
+} MULTIREPLACEMATCH, *PMULTIREPLACEMATCH;
+
+typedef struct MultiReplaceRange
+{
+	size_t	Start;
+	size_t	End;
+} MULTIREPLACERANGE, *PMULTIREPLACERANGE;
+
+static unsigned int Fold(unsigned int c)
+{
+	return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+static unsigned int Unit(const void *Buffer, int Wide, size_t Offset)
+{
+	return Wide ? ((const uint16_t*)Buffer)[Offset] : ((const unsigned char*)Buffer)[Offset];
+}
+
+static int MatchAt(PMULTIREPLACEENTRY Entry, const void *Buffer, int Wide, size_t Offset)
+{
+	uint32_t i;
+
+	if (!Wide && !(Entry->Flags & MULTI_REPLACE_NOCASE))
+		return !memcmp((const unsigned char*)Buffer + Offset, Entry->Find, Entry->Length);
+
+	for (i = 0; i < Entry->Length; i++)
+	{
+		unsigned int c = Unit(Buffer, Wide, Offset + i), f = Entry->Find[i];
+
+		if (Entry->Flags & MULTI_REPLACE_NOCASE)
+		{
+			c = Fold(c);
+			f = Fold(f);
+		}
+
+		if (c != f)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void Write(PMULTIREPLACEENTRY Entry, void *Buffer, int Wide, size_t Offset)
+{
+	uint32_t i;
+
+	if (!Wide)
+	{
+		memcpy((unsigned char*)Buffer + Offset, Entry->Replace, Entry->Length);
+		return;
+	}
+
+	for (i = 0; i < Entry->Length; i++)
+		((uint16_t*)Buffer)[Offset + i] = Entry->Replace[i];
+}
+
+// The patterns from First on, one at a time over the whole buffer
+static size_t Sequential(PMULTIREPLACE Replace, void *Buffer, int Wide, size_t Length, unsigned int First)
+{
+	size_t Replaced = 0, i;
+	unsigned int k;
+
+	for (k = First; k < Replace->Count; k++)
+	{
+		PMULTIREPLACEENTRY Entry = &Replace->Entries[k];
+
+		if (!Entry->Length || Entry->Length > Length)
+			continue;
+
+		for (i = 0; i <= Length - Entry->Length; i++)
+		{
+			if (MatchAt(Entry, Buffer, Wide, i))
+			{
+				Write(Entry, Buffer, Wide, i);
+				Replaced++;
+				i += Entry->Length - 1;
+			}
+		}
+	}
+
+	return Replaced;
+}
+
+static int Overlaps(PMULTIREPLACERANGE Ranges, unsigned int RangeCount, size_t Start, size_t End)
+{
+	unsigned int i;
+
+	for (i = 0; i < RangeCount; i++)
+		if (Start < Ranges[i].End && Ranges[i].Start < End)
+			return 1;
+
+	return 0;
+}
+
+// Applies the matches found in the original buffer pattern by pattern. A
+// match stays valid unless it overlaps text an earlier pattern rewrote, and
+// only windows overlapping rewritten text need checking for new matches;
+// within a pattern, taking its matches left to right without overlap is
+// what the one-at-a-time loop does.
+static size_t Resolve(PMULTIREPLACE Replace, void *Buffer, int Wide, size_t Length, PMULTIREPLACEMATCH Matches, unsigned int MatchCount)
+{
+	MULTIREPLACERANGE Ranges[MAX_CANDIDATES];
+	size_t Candidates[MAX_CANDIDATES], Replaced = 0, End, Low, High, p;
+	unsigned int RangeCount = 0, CandidateCount, i, j, k;
+
+	for (k = 0; k < Replace->Count; k++)
+	{
+		PMULTIREPLACEENTRY Entry = &Replace->Entries[k];
+
+		if (!Entry->Length || Entry->Length > Length)
+			continue;
+
+		CandidateCount = 0;
+
+		for (i = 0; i < MatchCount; i++)
+			if (Matches[i].Pattern == k && !Overlaps(Ranges, RangeCount, Matches[i].Start, Matches[i].Start + Entry->Length))
+				Candidates[CandidateCount++] = Matches[i].Start;
+
+		for (i = 0; i < RangeCount; i++)
+		{
+			Low = Ranges[i].Start >= Entry->Length ? Ranges[i].Start - Entry->Length + 1 : 0;
+			High = Ranges[i].End - 1 < Length - Entry->Length ? Ranges[i].End - 1 : Length - Entry->Length;
+
+			for (p = Low; p <= High; p++)
+			{
+				if (!MatchAt(Entry, Buffer, Wide, p))
+					continue;
+
+				if (CandidateCount == MAX_CANDIDATES)
+					return Replaced + Sequential(Replace, Buffer, Wide, Length, k);
+
+				Candidates[CandidateCount++] = p;
+			}
+		}
+
+		if (!CandidateCount)
+			continue;
+
+		if (RangeCount + CandidateCount > MAX_CANDIDATES)
+			return Replaced + Sequential(Replace, Buffer, Wide, Length, k);
+
+		for (i = 1; i < CandidateCount; i++)
+		{
+			p = Candidates[i];
+			for (j = i; j && Candidates[j - 1] > p; j--)
+				Candidates[j] = Candidates[j - 1];
+			Candidates[j] = p;
+		}
+
+		// Duplicates fall inside the match before them
+		End = 0;
+		for (i = 0; i < CandidateCount; i++)
+		{
+			if (Candidates[i] < End)
+				continue;
+
+			Write(Entry, Buffer, Wide, Candidates[i]);
+			Replaced++;
+			End = Candidates[i] + Entry->Length;
+			Ranges[RangeCount].Start = Candidates[i];
+			Ranges[RangeCount].End = End;
+			RangeCount++;
+		}
+	}
+
+	return Replaced;
+}
+
+// Records the patterns ending at Offset, returning 0 if there are too many
+static int Report(PMULTIREPLACE Replace, const void *Buffer, int Wide, uint32_t Row, size_t Offset, PMULTIREPLACEMATCH Matches, unsigned int *MatchCount)
+{
+	uint32_t State = Row / Replace->Classes, s, k;
+
+	for (s = Replace->Output[State] != NIL ? State : Replace->Dictionary[State]; s != NIL; s = Replace->Dictionary[s])
+	{
+		for (k = Replace->Output[s]; k != NIL; k = Replace->Entries[k].NextOutput)
+		{
+			PMULTIREPLACEENTRY Entry = &Replace->Entries[k];
+			size_t Start = Offset + 1 - Entry->Length;
+
+			// The automaton ignores case
+			if (!(Entry->Flags & MULTI_REPLACE_NOCASE) && !MatchAt(Entry, Buffer, Wide, Start))
+				continue;
+
+			if (*MatchCount == MAX_MATCHES)
+				return 0;
+
+			Matches[*MatchCount].Pattern = k;
+			Matches[*MatchCount].Start = Start;
+			(*MatchCount)++;
+		}
+	}
+
+	return 1;
+}
+
+//**************************************************************************************
+size_t MultiReplaceBuffer(PMULTIREPLACE Replace, char *Buffer, size_t Length)
+//**************************************************************************************
+{
+	MULTIREPLACEMATCH Matches[MAX_MATCHES];
+	const unsigned char *Text = (const unsigned char*)Buffer;
+	unsigned int MatchCount = 0;
+	uint32_t Next = 0;
+	size_t i;
+
+	if (!Replace || !Buffer)
+		return 0;
+
+	for (i = 0; i < Length; i++)
+	{
+		Next = Replace->Next[(Next >> 1) + Replace->ClassMap[Text[i]]];
+		if ((Next & 1) && !Report(Replace, Buffer, 0, Next >> 1, i, Matches, &MatchCount))
+			return Sequential(Replace, Buffer, 0, Length, 0);
+	}
+
+	if (!MatchCount)
+		return 0;
+
+	return Resolve(Replace, Buffer, 0, Length, Matches, MatchCount);
+}
+
+//**************************************************************************************
+size_t MultiReplaceBufferWide(PMULTIREPLACE Replace, uint16_t *Buffer, size_t Length)
+//**************************************************************************************
+{
+	MULTIREPLACEMATCH Matches[MAX_MATCHES];
+	unsigned int MatchCount = 0;
+	uint32_t Next = 0;
+	size_t i;
+
+	if (!Replace || !Buffer)
+		return 0;
+
+	for (i = 0; i < Length; i++)
+	{
+		Next = Replace->Next[(Next >> 1) + (Buffer[i] < 256 ? Replace->ClassMap[Buffer[i]] : 0)];
+		if ((Next & 1) && !Report(Replace, Buffer, 1, Next >> 1, i, Matches, &MatchCount))
+			return Sequential(Replace, Buffer, 1, Length, 0);
+	}
+
+	if (!MatchCount)
+		return 0;
+
+	return Resolve(Replace, Buffer, 1, Length, Matches, MatchCount);
+}
+
+//**************************************************************************************
+PMULTIREPLACE MultiReplaceCompile(const MULTIREPLACEPATTERN *Patterns, unsigned int Count)
+//**************************************************************************************
+{
+	PMULTIREPLACE Replace;
+	uint32_t *Fail = NULL, *Queue = NULL, Head = 0, Tail = 0, s, t, c;
+	size_t Total = 0, Size = 0, Length;
+	unsigned char *String;
+	unsigned int k, i;
+
+	if (!Patterns || !Count || Count >= NIL)
+		return NULL;
+
+	for (k = 0; k < Count; k++)
+	{
+		if (!Patterns[k].Find || !Patterns[k].Replace)
+			return NULL;
+		Length = strlen(Patterns[k].Find);
+		Size += Length + strlen(Patterns[k].Replace) + 2;
+		if (Length == strlen(Patterns[k].Replace))
+			Total += Length;
+	}
+
+	if (Total + 1 > MAX_STATES)
+		return NULL;
+
+	Replace = (PMULTIREPLACE)calloc(1, sizeof(MULTIREPLACE));
+	if (!Replace)
+		return NULL;
+
+	Replace->Count = Count;
+	Replace->Entries = (PMULTIREPLACEENTRY)calloc(Count, sizeof(MULTIREPLACEENTRY));
+	Replace->Strings = (unsigned char*)malloc(Size);
+	if (!Replace->Entries || !Replace->Strings)
+		goto fail;
+
+	// Columns for each character the patterns use, with both cases of a letter sharing one
+	Replace->Classes = 1;
+	String = Replace->Strings;
+
+	for (k = 0; k < Count; k++)
+	{
+		PMULTIREPLACEENTRY Entry = &Replace->Entries[k];
+
+		Length = strlen(Patterns[k].Find);
+		memcpy(String, Patterns[k].Find, Length + 1);
+		Entry->Find = String;
+		String += Length + 1;
+		memcpy(String, Patterns[k].Replace, strlen(Patterns[k].Replace) + 1);
+		Entry->Replace = String;
+		String += strlen(Patterns[k].Replace) + 1;
+		Entry->Flags = Patterns[k].Flags;
+		Entry->NextOutput = NIL;
+
+		if (Length != strlen(Patterns[k].Replace))
+			continue;
+
+		Entry->Length = (uint32_t)Length;
+
+		for (i = 0; i < Length; i++)
+		{
+			c = Fold(Entry->Find[i]);
+			if (Replace->ClassMap[c])
+				continue;
+			if (Replace->Classes == 256)
+				goto fail;
+			Replace->ClassMap[c] = (uint8_t)Replace->Classes;
+			if (c >= 'a' && c <= 'z')
+				Replace->ClassMap[c - 'a' + 'A'] = (uint8_t)Replace->Classes;
+			Replace->Classes++;
+		}
+	}
+
+	Replace->Next = (uint32_t*)malloc((Total + 1) * Replace->Classes * sizeof(uint32_t));
+	Replace->Output = (uint32_t*)malloc((Total + 1) * sizeof(uint32_t));
+	Replace->Dictionary = (uint32_t*)malloc((Total + 1) * sizeof(uint32_t));
+	Fail = (uint32_t*)malloc((Total + 1) * sizeof(uint32_t));
+	Queue = (uint32_t*)malloc((Total + 1) * sizeof(uint32_t));
+	if (!Replace->Next || !Replace->Output || !Replace->Dictionary || !Fail || !Queue)
+		goto fail;
+
+	memset(Replace->Next, 0xff, (Total + 1) * Replace->Classes * sizeof(uint32_t));
+	memset(Replace->Output, 0xff, (Total + 1) * sizeof(uint32_t));
+	memset(Replace->Dictionary, 0xff, (Total + 1) * sizeof(uint32_t));
+
+	// The trie of the folded patterns
+	Replace->States = 1;
+
+	for (k = 0; k < Count; k++)
+	{
+		PMULTIREPLACEENTRY Entry = &Replace->Entries[k];
+
+		if (!Entry->Length)
+			continue;
+
+		for (s = 0, i = 0; i < Entry->Length; i++)
+		{
+			uint32_t *Edge = &Replace->Next[s * Replace->Classes + Replace->ClassMap[Entry->Find[i]]];
+
+			if (*Edge == NIL)
+				*Edge = Replace->States++;
+			s = *Edge;
+		}
+
+		Entry->NextOutput = Replace->Output[s];
+		Replace->Output[s] = k;
+	}
+
+	// Failure links breadth first, filling in the missing transitions
+	Fail[0] = 0;
+	for (c = 0; c < Replace->Classes; c++)
+	{
+		t = Replace->Next[c];
+		if (t == NIL)
+			Replace->Next[c] = 0;
+		else
+		{
+			Fail[t] = 0;
+			Queue[Tail++] = t;
+		}
+	}
+
+	while (Head < Tail)
+	{
+		s = Queue[Head++];
+
+		for (c = 0; c < Replace->Classes; c++)
+		{
+			t = Replace->Next[s * Replace->Classes + c];
+			if (t == NIL)
+			{
+				Replace->Next[s * Replace->Classes + c] = Replace->Next[Fail[s] * Replace->Classes + c];
+				continue;
+			}
+
+			Fail[t] = Replace->Next[Fail[s] * Replace->Classes + c];
+			Replace->Dictionary[t] = Replace->Output[Fail[t]] != NIL ? Fail[t] : Replace->Dictionary[Fail[t]];
+			Queue[Tail++] = t;
+		}
+	}
+
+	// Transitions straight to a row, flagged where there is output to report
+	for (i = 0; i < Replace->States * Replace->Classes; i++)
+	{
+		t = Replace->Next[i];
+		Replace->Next[i] = t * Replace->Classes << 1 | (Replace->Output[t] != NIL || Replace->Dictionary[t] != NIL);
+	}
+
+	free(Fail);
+	free(Queue);
+
+	return Replace;
+
+fail:
+	free(Fail);
+	free(Queue);
+	MultiReplaceFree(Replace);
+	return NULL;
+}
+
+//**************************************************************************************
+void MultiReplaceFree(PMULTIREPLACE Replace)
+//**************************************************************************************
+{
+	if (!Replace)
+		return;
+
+	free(Replace->Next);
+	free(Replace->Output);
+	free(Replace->Dictionary);
+	free(Replace->Entries);
+	free(Replace->Strings);
+	free(Replace);
+}
@@ -0,0 +1,56 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Several same-length find and replace strings applied to a buffer in one
+// pass of a prebuilt Aho-Corasick automaton, with the result of replacing
+// each pattern over the whole buffer in table order: matches of a pattern
+// are taken left to right without overlapping, and a later pattern sees
+// the text written by earlier ones. Patterns whose find and replace strings
+// differ in length are ignored. Wide buffers are UTF-16, in which the
+// (ASCII) patterns are matched unit for character.
+
+#define MULTI_REPLACE_NOCASE	1	// ASCII letters match in either case
+
+typedef struct MultiReplacePattern
+{
+	const char		*Find;
+	const char		*Replace;
+	unsigned int	Flags;
+} MULTIREPLACEPATTERN, *PMULTIREPLACEPATTERN;
+
+typedef struct MultiReplace MULTIREPLACE, *PMULTIREPLACE;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Builds the automaton for Count patterns (copied), or returns NULL
+PMULTIREPLACE MultiReplaceCompile(const MULTIREPLACEPATTERN *Patterns, unsigned int Count);
+void MultiReplaceFree(PMULTIREPLACE Replace);
+// Rewrites Buffer in place, returning the number of replacements made
+size_t MultiReplaceBuffer(PMULTIREPLACE Replace, char *Buffer, size_t Length);
+// As above, with Length in characters
+size_t MultiReplaceBufferWide(PMULTIREPLACE Replace, uint16_t *Buffer, size_t Length);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,447 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "PathCache.h"
+#include "Xxh64.h"
+
+#define NIL 0xffffffff
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef SRWLOCK LOCK;
+
+#define LockInit(Lock) InitializeSRWLock(Lock)
+#define LockFree(Lock)
+#define LockAcquire(Lock) AcquireSRWLockExclusive(Lock)
+#define LockRelease(Lock) ReleaseSRWLockExclusive(Lock)
+#else
+#include <pthread.h>
+
+typedef pthread_mutex_t LOCK;
+
+#define LockInit(Lock) pthread_mutex_init(Lock, NULL)
+#define LockFree(Lock) pthread_mutex_destroy(Lock)
+#define LockAcquire(Lock) pthread_mutex_lock(Lock)
+#define LockRelease(Lock) pthread_mutex_unlock(Lock)
+#endif
+
+typedef struct PathCacheEntry
+{
+	uint64_t	Hash;
+	uintptr_t	Root;
+	uint32_t	Next;				// hash chain, or free list
+	uint32_t	LruPrev, LruNext;	// most recently used first
+	uint32_t	RootPrev, RootNext;	// entries in the same root bucket, for nonzero roots
+	uint32_t	NameLength;
+	uint32_t	PathLength;
+	wchar_t		*Data;				// name followed by path, NULL if the entry is free
+} PATHCACHEENTRY, *PPATHCACHEENTRY;
+
+struct PathCache
+{
+	LOCK			Lock;
+	uint32_t		Capacity;
+	uint32_t		Count;
+	uint32_t		Mask;
+	uint32_t		Free;
+	uint32_t		LruHead, LruTail;
+	uint32_t		*Buckets;
+	uint32_t		*RootBuckets;
+	PPATHCACHEENTRY	Entries;
+	size_t			Hits, Misses, Evictions;
+};
+
+static uint32_t RootBucket(PPATHCACHE Cache, uintptr_t Root)
+{
+	return (uint32_t)(((uint64_t)Root * 0x9E3779B97F4A7C15ULL) >> 32) & Cache->Mask;
+}
+
+static void LruUnlink(PPATHCACHE Cache, uint32_t Index)
+{
+	PPATHCACHEENTRY Entry = &Cache->Entries[Index];
+
+	if (Entry->LruPrev != NIL)
+		Cache->Entries[Entry->LruPrev].LruNext = Entry->LruNext;
+	else
+		Cache->LruHead = Entry->LruNext;
+
+	if (Entry->LruNext != NIL)
+		Cache->Entries[Entry->LruNext].LruPrev = Entry->LruPrev;
+	else
+		Cache->LruTail = Entry->LruPrev;
+}
+
+static void LruPushFront(PPATHCACHE Cache, uint32_t Index)
+{
+	PPATHCACHEENTRY Entry = &Cache->Entries[Index];
+
+	Entry->LruPrev = NIL;
+	Entry->LruNext = Cache->LruHead;
+
+	if (Cache->LruHead != NIL)
+		Cache->Entries[Cache->LruHead].LruPrev = Index;
+	else
+		Cache->LruTail = Index;
+
+	Cache->LruHead = Index;
+}
+
+// Called with the lock held
+static uint32_t Find(PPATHCACHE Cache, uint64_t Hash, uintptr_t Root, const wchar_t *Name, size_t NameLength)
+{
+	uint32_t Index = Cache->Buckets[Hash & Cache->Mask];
+
+	while (Index != NIL)
+	{
+		PPATHCACHEENTRY Entry = &Cache->Entries[Index];
+
+		if (Entry->Hash == Hash && Entry->Root == Root && Entry->NameLength == NameLength && !memcmp(Entry->Data, Name, NameLength * sizeof(wchar_t)))
+			return Index;
+
+		Index = Entry->Next;
+	}
+
+	return NIL;
+}
+
+// Called with the lock held: unlinks an entry from every list and frees its data
+static void Remove(PPATHCACHE Cache, uint32_t Index)
+{
+	PPATHCACHEENTRY Entry = &Cache->Entries[Index];
+	uint32_t *Link = &Cache->Buckets[Entry->Hash & Cache->Mask];
+
+	while (*Link != Index)
+		Link = &Cache->Entries[*Link].Next;
+	*Link = Entry->Next;
+
+	LruUnlink(Cache, Index);
+
+	if (Entry->Root)
+	{
+		if (Entry->RootPrev != NIL)
+			Cache->Entries[Entry->RootPrev].RootNext = Entry->RootNext;
+		else
+			Cache->RootBuckets[RootBucket(Cache, Entry->Root)] = Entry->RootNext;
+
+		if (Entry->RootNext != NIL)
+			Cache->Entries[Entry->RootNext].RootPrev = Entry->RootPrev;
+	}
+
+	free(Entry->Data);
+	Entry->Data = NULL;
+	Entry->Next = Cache->Free;
+	Cache->Free = Index;
+	Cache->Count--;
+}
+
+//**************************************************************************************
+PPATHCACHE PathCacheCreate(unsigned int Capacity)
+//**************************************************************************************
+{
+	PPATHCACHE Cache;
+	uint32_t Buckets = 16, i;
+
+	if (!Capacity || Capacity >= NIL / 2)
+		return NULL;
+
+	while (Buckets < 2 * Capacity)
+		Buckets <<= 1;
+
+	Cache = (PPATHCACHE)calloc(1, sizeof(PATHCACHE));
+	if (!Cache)
+		return NULL;
+
+	Cache->Buckets = (uint32_t*)malloc(Buckets * sizeof(uint32_t));
+	Cache->RootBuckets = (uint32_t*)malloc(Buckets * sizeof(uint32_t));
+	Cache->Entries = (PPATHCACHEENTRY)calloc(Capacity, sizeof(PATHCACHEENTRY));
+
+	if (!Cache->Buckets || !Cache->RootBuckets || !Cache->Entries)
+	{
+		free(Cache->Buckets);
+		free(Cache->RootBuckets);
+		free(Cache->Entries);
+		free(Cache);
+		return NULL;
+	}
+
+	memset(Cache->Buckets, 0xff, Buckets * sizeof(uint32_t));
+	memset(Cache->RootBuckets, 0xff, Buckets * sizeof(uint32_t));
+
+	for (i = 0; i < Capacity; i++)
+		Cache->Entries[i].Next = i + 1 < Capacity ? i + 1 : NIL;
+
+	Cache->Capacity = Capacity;
+	Cache->Mask = Buckets - 1;
+	Cache->Free = 0;
+	Cache->LruHead = Cache->LruTail = NIL;
+	LockInit(&Cache->Lock);
+
+	return Cache;
+}
+
+//**************************************************************************************
+void PathCacheDestroy(PPATHCACHE Cache)
+//**************************************************************************************
+{
+	uint32_t i;
+
+	if (!Cache)
+		return;
+
+	for (i = 0; i < Cache->Capacity; i++)
+		free(Cache->Entries[i].Data);
+
+	LockFree(&Cache->Lock);
+	free(Cache->Buckets);
+	free(Cache->RootBuckets);
+	free(Cache->Entries);
+	free(Cache);
+}
+
+//**************************************************************************************
+size_t PathCacheLookup(PPATHCACHE Cache, uintptr_t Root, const wchar_t *Name, size_t NameLength, wchar_t *Path, size_t PathSize)
+//**************************************************************************************
+{
+	uint64_t Hash;
+	uint32_t Index;
+	size_t Length = 0;
+
+	if (!Cache || NameLength > PATH_CACHE_MAX_LENGTH)
+		return 0;
+
+	Hash = Xxh64(Name, NameLength * sizeof(wchar_t), Root);
+
+	LockAcquire(&Cache->Lock);
+
+	Index = Find(Cache, Hash, Root, Name, NameLength);
+
+	if (Index != NIL && Cache->Entries[Index].PathLength < PathSize)
+	{
+		PPATHCACHEENTRY Entry = &Cache->Entries[Index];
+
+		Length = Entry->PathLength;
+		memcpy(Path, Entry->Data + Entry->NameLength, Length * sizeof(wchar_t));
+		Path[Length] = L'\0';
+
+		if (Cache->LruHead != Index)
+		{
+			LruUnlink(Cache, Index);
+			LruPushFront(Cache, Index);
+		}
+
+		Cache->Hits++;
+	}
+	else
+		Cache->Misses++;
+
+	LockRelease(&Cache->Lock);
+
+	return Length;
+}
+
+//**************************************************************************************
+int PathCacheInsert(PPATHCACHE Cache, uintptr_t Root, const wchar_t *Name, size_t NameLength, const wchar_t *Path, size_t PathLength)
+//**************************************************************************************
+{
+	PPATHCACHEENTRY Entry;
+	uint64_t Hash;
+	uint32_t Index;
+	wchar_t *Data;
+
+	if (!Cache || !PathLength || NameLength > PATH_CACHE_MAX_LENGTH || PathLength > PATH_CACHE_MAX_LENGTH)
+		return 0;
+
+	Hash = Xxh64(Name, NameLength * sizeof(wchar_t), Root);
+
+	// Copied before taking the lock, as Name may be in the caller's memory
+	Data = (wchar_t*)malloc((NameLength + PathLength) * sizeof(wchar_t));
+	if (!Data)
+		return 0;
+
+	memcpy(Data, Name, NameLength * sizeof(wchar_t));
+	memcpy(Data + NameLength, Path, PathLength * sizeof(wchar_t));
+
+	LockAcquire(&Cache->Lock);
+
+	Index = Find(Cache, Hash, Root, Name, NameLength);
+
+	if (Index != NIL)
+		Remove(Cache, Index);
+	else if (Cache->Free == NIL)
+	{
+		Remove(Cache, Cache->LruTail);
+		Cache->Evictions++;
+	}
+
+	Index = Cache->Free;
+	Entry = &Cache->Entries[Index];
+	Cache->Free = Entry->Next;
+	Cache->Count++;
+
+	Entry->Hash = Hash;
+	Entry->Root = Root;
+	Entry->NameLength = (uint32_t)NameLength;
+	Entry->PathLength = (uint32_t)PathLength;
+	Entry->Data = Data;
+
+	Entry->Next = Cache->Buckets[Hash & Cache->Mask];
+	Cache->Buckets[Hash & Cache->Mask] = Index;
+
+	LruPushFront(Cache, Index);
+
+	if (Root)
+	{
+		uint32_t Bucket = RootBucket(Cache, Root);
+
+		Entry->RootPrev = NIL;
+		Entry->RootNext = Cache->RootBuckets[Bucket];
+		if (Entry->RootNext != NIL)
+			Cache->Entries[Entry->RootNext].RootPrev = Index;
+		Cache->RootBuckets[Bucket] = Index;
+	}
+
+	LockRelease(&Cache->Lock);
+
+	return 1;
+}
+
+//**************************************************************************************
+size_t PathCacheDropRoot(PPATHCACHE Cache, uintptr_t Root)
+//**************************************************************************************
+{
+	uint32_t Index, Next;
+	size_t Dropped = 0;
+
+	if (!Cache || !Root)
+		return 0;
+
+	LockAcquire(&Cache->Lock);
+
+	for (Index = Cache->RootBuckets[RootBucket(Cache, Root)]; Index != NIL; Index = Next)
+	{
+		Next = Cache->Entries[Index].RootNext;
+
+		if (Cache->Entries[Index].Root == Root)
+		{
+			Remove(Cache, Index);
+			Dropped++;
+		}
+	}
+
+	LockRelease(&Cache->Lock);
+
+	return Dropped;
+}
+
+//**************************************************************************************
+void PathCacheFlush(PPATHCACHE Cache)
+//**************************************************************************************
+{
+	if (!Cache)
+		return;
+
+	LockAcquire(&Cache->Lock);
+
+	while (Cache->LruHead != NIL)
+		Remove(Cache, Cache->LruHead);
+
+	LockRelease(&Cache->Lock);
+}
+
+//**************************************************************************************
+void PathCacheGetStats(PPATHCACHE Cache, PPATHCACHESTATS Stats)
+//**************************************************************************************
+{
+	memset(Stats, 0, sizeof(PATHCACHESTATS));
+
+	if (!Cache)
+		return;
+
+	LockAcquire(&Cache->Lock);
+
+	Stats->Entries = Cache->Count;
+	Stats->Hits = Cache->Hits;
+	Stats->Misses = Cache->Misses;
+	Stats->Evictions = Cache->Evictions;
+
+	LockRelease(&Cache->Lock);
+}
+
+static int IsSeparator(wchar_t c)
+{
+	return c == L'\\' || c == L'/';
+}
+
+// Case-insensitive for ASCII letters, as the prefixes are
+static int HasPrefix(const wchar_t *Path, size_t Length, const wchar_t *Prefix)
+{
+	size_t i;
+
+	for (i = 0; Prefix[i]; i++)
+	{
+		wchar_t c = Path[i];
+
+		if (i >= Length)
+			return 0;
+
+		if (c >= L'A' && c <= L'Z')
+			c += L'a' - L'A';
+
+		if (c != Prefix[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+//**************************************************************************************
+int PathCacheIsAbsolute(const wchar_t *Path, size_t Length)
+//**************************************************************************************
+{
+	size_t i;
+
+	if (HasPrefix(Path, Length, L"\\??\\"))
+	{
+		Path += 4;
+		Length -= 4;
+	}
+	else if (HasPrefix(Path, Length, L"\\\\?\\globalroot"))
+	{
+		Path += 14;
+		Length -= 14;
+	}
+
+	for (i = 0; i < Length; i++)
+		if (Path[i] == L'~')
+			return 0;
+
+	if (HasPrefix(Path, Length, L"\\device\\") || HasPrefix(Path, Length, L"\\systemroot"))
+		return 1;
+
+	// C:\ but not the drive relative C:dir
+	if (Length >= 3 && ((Path[0] | 0x20) >= L'a' && (Path[0] | 0x20) <= L'z') && Path[1] == L':' && IsSeparator(Path[2]))
+		return 1;
+
+	// \\server\share, \\?\ and \\.\ but not the root relative \dir
+	if (Length >= 3 && IsSeparator(Path[0]) && IsSeparator(Path[1]))
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+// Bounded least-recently-used map from a (root, name) pair to a path, for
+// results that are expensive to compute and asked for over and over: raw
+// paths normalized to absolute paths (Root 0), or object names joined to the
+// path of the root directory handle they are relative to. Entries for a
+// root are dropped together when its handle is closed.
+
+#define PATH_CACHE_MAX_LENGTH	1024	// longer names or paths are not cached
+
+typedef struct PathCacheStats
+{
+	size_t	Entries;
+	size_t	Hits;
+	size_t	Misses;
+	size_t	Evictions;
+} PATHCACHESTATS, *PPATHCACHESTATS;
+
+typedef struct PathCache PATHCACHE, *PPATHCACHE;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+PPATHCACHE PathCacheCreate(unsigned int Capacity);
+void PathCacheDestroy(PPATHCACHE Cache);
+// Copies the cached path and its terminator to Path, returning its length,
+// or 0 if there is no entry or it would not fit in PathSize characters
+size_t PathCacheLookup(PPATHCACHE Cache, uintptr_t Root, const wchar_t *Name, size_t NameLength, wchar_t *Path, size_t PathSize);
+// Adds or replaces an entry, evicting the least recently used if full
+int PathCacheInsert(PPATHCACHE Cache, uintptr_t Root, const wchar_t *Name, size_t NameLength, const wchar_t *Path, size_t PathLength);
+// Drops every entry for Root, returning how many there were
+size_t PathCacheDropRoot(PPATHCACHE Cache, uintptr_t Root);
+void PathCacheFlush(PPATHCACHE Cache);
+void PathCacheGetStats(PPATHCACHE Cache, PPATHCACHESTATS Stats);
+// Whether a raw path names the same thing regardless of the current
+// directory and without short (8.3) names, whose long form can change as
+// files come and go: \??\ and \\?\globalroot prefixes, \Device\ and
+// \SystemRoot names, drive letter paths and UNC or \\?\ paths qualify.
+int PathCacheIsAbsolute(const wchar_t *Path, size_t Length);
+
+#ifdef __cplusplus
+}
+#endif
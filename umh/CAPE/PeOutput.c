@@ -0,0 +1,257 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "PeOutput.h"
+
+#define PE_OUTPUT_INITIAL_PIECES 32
+#define PE_CHECKSUM_FIELD_SIZE 4
+
+// Padding is written from here rather than from buffers allocated per gap
+static const unsigned char ZeroBlock[0x10000];
+
+// The folded sum of the file's 16-bit words depends only on their total
+// modulo 0xFFFF and on whether it is zero, so the bytes are summed as
+// 32-bit words, a word at an even offset being congruent to the sum of its
+// halves, and a byte at an odd offset counting 256 times.
+static uint64_t SumBytes(const unsigned char *Data, size_t Size, size_t Offset)
+{
+	uint64_t Sum = 0, Sum2 = 0;
+	uint32_t Word;
+	uint16_t Half;
+
+	if (Size && (Offset & 1))
+	{
+		Sum += (uint64_t)Data[0] << 8;
+		Data++;
+		Size--;
+	}
+
+	while (Size >= 8)
+	{
+		memcpy(&Word, Data, sizeof(Word));
+		Sum += Word;
+		memcpy(&Word, Data + 4, sizeof(Word));
+		Sum2 += Word;
+		Data += 8;
+		Size -= 8;
+	}
+
+	if (Size >= 4)
+	{
+		memcpy(&Word, Data, sizeof(Word));
+		Sum += Word;
+		Data += 4;
+		Size -= 4;
+	}
+
+	if (Size >= 2)
+	{
+		memcpy(&Half, Data, sizeof(Half));
+		Sum += Half;
+		Data += 2;
+		Size -= 2;
+	}
+
+	if (Size)
+		Sum += Data[0];
+
+	return Sum + Sum2;
+}
+
+void PeChecksumInit(PPECHECKSUM Checksum, size_t FieldOffset)
+{
+	memset(Checksum, 0, sizeof(*Checksum));
+	Checksum->FieldOffset = FieldOffset;
+}
+
+void PeChecksumUpdate(PPECHECKSUM Checksum, const void *Data, size_t Size)
+{
+	size_t Start = Checksum->Offset, End = Start + Size, i;
+
+	if (Data)
+	{
+		Checksum->Sum += SumBytes((const unsigned char *)Data, Size, Start);
+
+		// Keep the stored checksum, which CheckSumMappedFile sums and then takes off
+		if (Checksum->FieldOffset && End > Checksum->FieldOffset && Start < Checksum->FieldOffset + PE_CHECKSUM_FIELD_SIZE)
+		{
+			for (i = Start > Checksum->FieldOffset ? Start : Checksum->FieldOffset; i < End && i < Checksum->FieldOffset + PE_CHECKSUM_FIELD_SIZE; i++)
+				Checksum->Field |= (uint32_t)((const unsigned char *)Data)[i - Start] << (8 * (i - Checksum->FieldOffset));
+		}
+	}
+
+	Checksum->Offset = End;
+}
+
+uint32_t PeChecksumFinal(const PECHECKSUM *Checksum)
+{
+	uint16_t Partial = Checksum->Sum ? (uint16_t)((Checksum->Sum - 1) % 0xFFFF + 1) : 0;
+	uint16_t Low = (uint16_t)(Checksum->Field & 0xFFFF), High = (uint16_t)(Checksum->Field >> 16);
+
+	if (Checksum->FieldOffset)
+	{
+		// Taken off the way CheckSumMappedFile does, borrow first
+		Partial = (uint16_t)(Partial - (Partial < Low));
+		Partial = (uint16_t)(Partial - Low);
+		Partial = (uint16_t)(Partial - (Partial < High));
+		Partial = (uint16_t)(Partial - High);
+	}
+
+	return (uint32_t)Partial + (uint32_t)Checksum->Offset;
+}
+
+void PeOutputInit(PPEOUTPUT Output, size_t ChecksumOffset)
+{
+	memset(Output, 0, sizeof(*Output));
+	Output->ChecksumOffset = ChecksumOffset;
+}
+
+void PeOutputFree(PPEOUTPUT Output)
+{
+	free(Output->Pieces);
+	Output->Pieces = NULL;
+	Output->Count = Output->Capacity = 0;
+}
+
+static int AddPiece(PPEOUTPUT Output, size_t Offset, const void *Data, size_t Size)
+{
+	PPEOUTPUTPIECE Last = Output->Count ? &Output->Pieces[Output->Count - 1] : NULL;
+
+	if (!Size)
+		return 1;
+
+	if (Last && Last->Offset + Last->Size == Offset && (Data ? Last->Data && (const unsigned char *)Last->Data + Last->Size == Data : !Last->Data))
+	{
+		Last->Size += Size;
+		return 1;
+	}
+
+	if (Output->Count == Output->Capacity)
+	{
+		size_t Capacity = Output->Capacity ? Output->Capacity * 2 : PE_OUTPUT_INITIAL_PIECES;
+		PPEOUTPUTPIECE Pieces = (PPEOUTPUTPIECE)realloc(Output->Pieces, Capacity * sizeof(PEOUTPUTPIECE));
+
+		if (!Pieces)
+		{
+			Output->Failed = 1;
+			return 0;
+		}
+
+		Output->Pieces = Pieces;
+		Output->Capacity = Capacity;
+	}
+
+	Output->Pieces[Output->Count].Offset = Offset;
+	Output->Pieces[Output->Count].Data = Data;
+	Output->Pieces[Output->Count].Size = Size;
+	Output->Count++;
+
+	return 1;
+}
+
+int PeOutputAdd(PPEOUTPUT Output, const void *Data, size_t Size)
+{
+	if (!AddPiece(Output, Output->Position, Data, Size))
+		return 0;
+
+	Output->Position += Size;
+
+	return 1;
+}
+
+int PeOutputAddSection(PPEOUTPUT Output, uint32_t PointerToRawData, uint32_t SizeOfRawData, const void *Data, uint32_t DataSize)
+{
+	if (!PointerToRawData)
+		return 0;
+
+	if (PointerToRawData > Output->Position && !PeOutputAdd(Output, NULL, PointerToRawData - Output->Position))
+		return -1;
+
+	if (!DataSize)
+		return 0;
+
+	// At its raw offset, though the position moves on by its size regardless
+	if (!AddPiece(Output, PointerToRawData, Data, DataSize))
+		return -1;
+
+	Output->Position += DataSize;
+
+	if (DataSize < SizeOfRawData && !PeOutputAdd(Output, NULL, SizeOfRawData - DataSize))
+		return -1;
+
+	return 1;
+}
+
+int PeOutputWrite(PPEOUTPUT Output, PEOUTPUTSINK Sink, void *Context)
+{
+	PECHECKSUM Checksum;
+	unsigned char Field[PE_CHECKSUM_FIELD_SIZE];
+	int Sequential = Output->ChecksumOffset != 0;
+	size_t i, Done, Size;
+
+	Output->End = 0;
+	Output->Checksum = 0;
+	Output->ChecksumValid = 0;
+
+	if (Output->Failed)
+		return 0;
+
+	PeChecksumInit(&Checksum, Output->ChecksumOffset);
+
+	for (i = 0; i < Output->Count; i++)
+	{
+		PPEOUTPUTPIECE Piece = &Output->Pieces[i];
+
+		if (Piece->Offset != Checksum.Offset)
+			Sequential = 0;
+
+		if (Sequential)
+			PeChecksumUpdate(&Checksum, Piece->Data, Piece->Size);
+
+		if (Piece->Data)
+		{
+			if (!Sink(Context, Piece->Offset, Piece->Data, Piece->Size))
+				return 0;
+		}
+		else for (Done = 0; Done < Piece->Size; Done += Size)
+		{
+			Size = Piece->Size - Done < sizeof(ZeroBlock) ? Piece->Size - Done : sizeof(ZeroBlock);
+
+			if (!Sink(Context, Piece->Offset + Done, ZeroBlock, Size))
+				return 0;
+		}
+
+		Output->End = Piece->Offset + Piece->Size;
+	}
+
+	if (Sequential && Output->ChecksumOffset && Output->ChecksumOffset + PE_CHECKSUM_FIELD_SIZE <= Output->End)
+	{
+		Output->Checksum = PeChecksumFinal(&Checksum);
+
+		for (i = 0; i < PE_CHECKSUM_FIELD_SIZE; i++)
+			Field[i] = (unsigned char)(Output->Checksum >> (8 * i));
+
+		if (!Sink(Context, Output->ChecksumOffset, Field, sizeof(Field)))
+			return 0;
+
+		Output->ChecksumValid = 1;
+	}
+
+	return 1;
+}
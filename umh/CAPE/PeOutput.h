@@ -0,0 +1,90 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Output of a PE file being dumped, as a list of pieces that point at the
+// headers and section data where they already are, with zero padding kept
+// as a length only. Pieces are added in the order the file was always
+// written: each at the current position, or a section at its raw offset,
+// which moves the position on by its size either way. Writing hands the
+// pieces to a sink in that order, merging neighbours. Given the offset of
+// the checksum field, and when the pieces follow one another without gaps
+// or overlaps, the PE checksum is summed over the bytes as they go and
+// patched into the file at the end, the value CheckSumMappedFile gives for
+// the same file; otherwise the stored checksum is written as it is.
+
+typedef struct PeChecksum
+{
+	uint64_t	Sum;
+	size_t		Offset;
+	size_t		FieldOffset;
+	uint32_t	Field;
+} PECHECKSUM, *PPECHECKSUM;
+
+typedef struct PeOutputPiece
+{
+	size_t		Offset;
+	const void	*Data;		// zero padding if NULL
+	size_t		Size;
+} PEOUTPUTPIECE, *PPEOUTPUTPIECE;
+
+typedef struct PeOutput
+{
+	PEOUTPUTPIECE	*Pieces;
+	size_t			Count;
+	size_t			Capacity;
+	size_t			Position;		// where the next piece goes
+	size_t			End;			// where the last piece written ended
+	size_t			ChecksumOffset;	// of OptionalHeader.CheckSum, 0 for none
+	uint32_t		Checksum;
+	int				ChecksumValid;
+	int				Failed;
+} PEOUTPUT, *PPEOUTPUT;
+
+// Writes Size bytes at Offset, returning 0 on failure
+typedef int (*PEOUTPUTSINK)(void *Context, size_t Offset, const void *Data, size_t Size);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// FieldOffset is where the checksum field is in the file
+void PeChecksumInit(PPECHECKSUM Checksum, size_t FieldOffset);
+// Adds the next Size bytes of the file, zeroes if Data is NULL
+void PeChecksumUpdate(PPECHECKSUM Checksum, const void *Data, size_t Size);
+// The checksum of the file summed so far, its length being the bytes added
+uint32_t PeChecksumFinal(const PECHECKSUM *Checksum);
+
+void PeOutputInit(PPEOUTPUT Output, size_t ChecksumOffset);
+void PeOutputFree(PPEOUTPUT Output);
+// Adds Size bytes at the current position, zeroes if Data is NULL
+int PeOutputAdd(PPEOUTPUT Output, const void *Data, size_t Size);
+// Adds a section the way savePeFileToDisk lays it out: padding up to its raw
+// offset, its data there and padding up to SizeOfRawData. Returns 1 if it
+// had data, 0 if not and -1 if the pieces could not be stored.
+int PeOutputAddSection(PPEOUTPUT Output, uint32_t PointerToRawData, uint32_t SizeOfRawData, const void *Data, uint32_t DataSize);
+// Hands the pieces to Sink, setting End, and Checksum if ChecksumValid,
+// which has also been written to the file. Returns 0 if Sink failed.
+int PeOutputWrite(PPEOUTPUT Output, PEOUTPUTSINK Sink, void *Context);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,181 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include "PtrMap.h"
+
+#define PTRMAP_MIN_CAPACITY 16
+
+// Pids and handles are multiples of four, so mix the bits before masking
+static size_t Slot(uintptr_t Key, size_t Capacity)
+{
+	uint64_t Hash = (uint64_t)Key * 0x9E3779B97F4A7C15ULL;
+
+	return (size_t)(Hash >> 32) & (Capacity - 1);
+}
+
+static int Grow(PPTRMAP Map)
+{
+	PPTRMAPENTRY OldEntries = Map->Entries, NewEntries;
+	size_t OldCapacity = Map->Capacity, NewCapacity, i, j;
+
+	NewCapacity = OldCapacity ? OldCapacity * 2 : PTRMAP_MIN_CAPACITY;
+
+	NewEntries = (PPTRMAPENTRY)calloc(NewCapacity, sizeof(PTRMAPENTRY));
+	if (!NewEntries)
+		return 0;
+
+	for (i = 0; i < OldCapacity; i++)
+	{
+		if (!OldEntries[i].Value)
+			continue;
+
+		j = Slot(OldEntries[i].Key, NewCapacity);
+
+		while (NewEntries[j].Value)
+			j = (j + 1) & (NewCapacity - 1);
+
+		NewEntries[j] = OldEntries[i];
+	}
+
+	free(OldEntries);
+	Map->Entries = NewEntries;
+	Map->Capacity = NewCapacity;
+
+	return 1;
+}
+
+static PPTRMAPENTRY Find(PPTRMAP Map, uintptr_t Key)
+{
+	size_t i;
+
+	if (!Map->Count)
+		return NULL;
+
+	i = Slot(Key, Map->Capacity);
+
+	while (Map->Entries[i].Value)
+	{
+		if (Map->Entries[i].Key == Key)
+			return &Map->Entries[i];
+
+		i = (i + 1) & (Map->Capacity - 1);
+	}
+
+	return NULL;
+}
+
+//**************************************************************************************
+void PtrMapInit(PPTRMAP Map)
+//**************************************************************************************
+{
+	Map->Entries = NULL;
+	Map->Capacity = 0;
+	Map->Count = 0;
+}
+
+//**************************************************************************************
+void PtrMapFree(PPTRMAP Map)
+//**************************************************************************************
+{
+	free(Map->Entries);
+	PtrMapInit(Map);
+}
+
+//**************************************************************************************
+int PtrMapSet(PPTRMAP Map, uintptr_t Key, void *Value)
+//**************************************************************************************
+{
+	PPTRMAPENTRY Entry;
+	size_t i;
+
+	if (!Value)
+		return 0;
+
+	Entry = Find(Map, Key);
+
+	if (Entry)
+	{
+		Entry->Value = Value;
+		return 1;
+	}
+
+	// Keep the load factor at or below 3/4
+	if ((Map->Count + 1) * 4 > Map->Capacity * 3 && !Grow(Map))
+		return 0;
+
+	i = Slot(Key, Map->Capacity);
+
+	while (Map->Entries[i].Value)
+		i = (i + 1) & (Map->Capacity - 1);
+
+	Map->Entries[i].Key = Key;
+	Map->Entries[i].Value = Value;
+	Map->Count++;
+
+	return 1;
+}
+
+//**************************************************************************************
+void *PtrMapGet(PPTRMAP Map, uintptr_t Key)
+//**************************************************************************************
+{
+	PPTRMAPENTRY Entry = Find(Map, Key);
+
+	return Entry ? Entry->Value : NULL;
+}
+
+//**************************************************************************************
+void *PtrMapRemove(PPTRMAP Map, uintptr_t Key)
+//**************************************************************************************
+{
+	PPTRMAPENTRY Entry = Find(Map, Key);
+	size_t Mask = Map->Capacity - 1, Hole, i, Home;
+	void *Value;
+
+	if (!Entry)
+		return NULL;
+
+	Value = Entry->Value;
+	Hole = (size_t)(Entry - Map->Entries);
+	i = Hole;
+
+	// Backward-shift deletion: pull later members of the probe chain into the hole
+	// so that lookups never need tombstones
+	for (;;)
+	{
+		i = (i + 1) & Mask;
+
+		if (!Map->Entries[i].Value)
+			break;
+
+		Home = Slot(Map->Entries[i].Key, Map->Capacity);
+
+		// Move the entry only if its home slot is not cyclically within (Hole, i]
+		if (((i - Home) & Mask) >= ((i - Hole) & Mask))
+		{
+			Map->Entries[Hole] = Map->Entries[i];
+			Hole = i;
+		}
+	}
+
+	Map->Entries[Hole].Key = 0;
+	Map->Entries[Hole].Value = NULL;
+	Map->Count--;
+
+	return Value;
+}
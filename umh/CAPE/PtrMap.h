@@ -0,0 +1,53 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Open-addressing (linear probing) hash map from pointer-sized keys such as
+// process ids and handles to non-NULL pointers. A zeroed PTRMAP is empty.
+
+typedef struct PtrMapEntry
+{
+	uintptr_t	Key;
+	void		*Value;
+} PTRMAPENTRY, *PPTRMAPENTRY;
+
+typedef struct PtrMap
+{
+	PPTRMAPENTRY	Entries;
+	size_t			Capacity;
+	size_t			Count;
+} PTRMAP, *PPTRMAP;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void PtrMapInit(PPTRMAP Map);
+void PtrMapFree(PPTRMAP Map);
+// Inserts or replaces; fails on a NULL value or allocation failure
+int PtrMapSet(PPTRMAP Map, uintptr_t Key, void *Value);
+void *PtrMapGet(PPTRMAP Map, uintptr_t Key);
+// Returns the value removed, or NULL if the key was not present
+void *PtrMapRemove(PPTRMAP Map, uintptr_t Key);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,287 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include "RegionTree.h"
+
+static int Height(PREGIONNODE Node)
+{
+	return Node ? Node->Height : 0;
+}
+
+static void Update(PREGIONNODE Node)
+{
+	int LeftHeight = Height(Node->Left), RightHeight = Height(Node->Right);
+
+	Node->Height = (LeftHeight > RightHeight ? LeftHeight : RightHeight) + 1;
+	Node->MaxEnd = Node->End;
+
+	if (Node->Left && Node->Left->MaxEnd > Node->MaxEnd)
+		Node->MaxEnd = Node->Left->MaxEnd;
+
+	if (Node->Right && Node->Right->MaxEnd > Node->MaxEnd)
+		Node->MaxEnd = Node->Right->MaxEnd;
+}
+
+static PREGIONNODE RotateRight(PREGIONNODE Node)
+{
+	PREGIONNODE Left = Node->Left;
+
+	Node->Left = Left->Right;
+	Left->Right = Node;
+	Update(Node);
+	Update(Left);
+
+	return Left;
+}
+
+static PREGIONNODE RotateLeft(PREGIONNODE Node)
+{
+	PREGIONNODE Right = Node->Right;
+
+	Node->Right = Right->Left;
+	Right->Left = Node;
+	Update(Node);
+	Update(Right);
+
+	return Right;
+}
+
+static PREGIONNODE Rebalance(PREGIONNODE Node)
+{
+	int Balance;
+
+	Update(Node);
+
+	Balance = Height(Node->Left) - Height(Node->Right);
+
+	if (Balance > 1)
+	{
+		if (Height(Node->Left->Left) < Height(Node->Left->Right))
+			Node->Left = RotateLeft(Node->Left);
+		return RotateRight(Node);
+	}
+
+	if (Balance < -1)
+	{
+		if (Height(Node->Right->Right) < Height(Node->Right->Left))
+			Node->Right = RotateRight(Node->Right);
+		return RotateLeft(Node);
+	}
+
+	return Node;
+}
+
+static PREGIONNODE InsertNode(PREGIONNODE Node, PREGIONNODE NewNode, int *Inserted)
+{
+	if (!Node)
+	{
+		*Inserted = 1;
+		return NewNode;
+	}
+
+	if (NewNode->Start < Node->Start)
+		Node->Left = InsertNode(Node->Left, NewNode, Inserted);
+	else if (NewNode->Start > Node->Start)
+		Node->Right = InsertNode(Node->Right, NewNode, Inserted);
+	else
+		return Node;
+
+	return Rebalance(Node);
+}
+
+static PREGIONNODE RemoveMin(PREGIONNODE Node, PREGIONNODE *Min)
+{
+	if (!Node->Left)
+	{
+		*Min = Node;
+		return Node->Right;
+	}
+
+	Node->Left = RemoveMin(Node->Left, Min);
+
+	return Rebalance(Node);
+}
+
+static PREGIONNODE RemoveNode(PREGIONNODE Node, uintptr_t Start, PREGIONNODE *Removed)
+{
+	PREGIONNODE Min, Right;
+
+	if (!Node)
+		return NULL;
+
+	if (Start < Node->Start)
+		Node->Left = RemoveNode(Node->Left, Start, Removed);
+	else if (Start > Node->Start)
+		Node->Right = RemoveNode(Node->Right, Start, Removed);
+	else
+	{
+		*Removed = Node;
+
+		if (!Node->Left)
+			return Node->Right;
+
+		if (!Node->Right)
+			return Node->Left;
+
+		Right = RemoveMin(Node->Right, &Min);
+		Min->Left = Node->Left;
+		Min->Right = Right;
+
+		return Rebalance(Min);
+	}
+
+	return Rebalance(Node);
+}
+
+static size_t Overlaps(PREGIONNODE Node, uintptr_t Start, uintptr_t End, REGIONTREE_CALLBACK Callback, void *Context)
+{
+	size_t Count = 0;
+
+	while (Node && Node->MaxEnd > Start)
+	{
+		Count += Overlaps(Node->Left, Start, End, Callback, Context);
+
+		if (Node->Start >= End)
+			break;
+
+		if (Node->End > Start)
+		{
+			if (Callback)
+				Callback(Node->Start, Node->End, Node->Data, Context);
+			Count++;
+		}
+
+		Node = Node->Right;
+	}
+
+	return Count;
+}
+
+static void FreeNodes(PREGIONNODE Node, REGIONTREE_CALLBACK Callback, void *Context)
+{
+	PREGIONNODE Right;
+
+	while (Node)
+	{
+		FreeNodes(Node->Left, Callback, Context);
+
+		if (Callback)
+			Callback(Node->Start, Node->End, Node->Data, Context);
+
+		Right = Node->Right;
+		free(Node);
+		Node = Right;
+	}
+}
+
+//**************************************************************************************
+void RegionTreeInit(PREGIONTREE Tree)
+//**************************************************************************************
+{
+	Tree->Root = NULL;
+	Tree->Count = 0;
+}
+
+//**************************************************************************************
+void RegionTreeFree(PREGIONTREE Tree, REGIONTREE_CALLBACK Callback, void *Context)
+//**************************************************************************************
+{
+	FreeNodes(Tree->Root, Callback, Context);
+	RegionTreeInit(Tree);
+}
+
+//**************************************************************************************
+int RegionTreeInsert(PREGIONTREE Tree, uintptr_t Start, uintptr_t End, void *Data)
+//**************************************************************************************
+{
+	PREGIONNODE NewNode;
+	int Inserted = 0;
+
+	if (End <= Start)
+		return 0;
+
+	NewNode = (PREGIONNODE)calloc(1, sizeof(REGIONNODE));
+	if (!NewNode)
+		return 0;
+
+	NewNode->Start = Start;
+	NewNode->End = End;
+	NewNode->MaxEnd = End;
+	NewNode->Data = Data;
+	NewNode->Height = 1;
+
+	Tree->Root = InsertNode(Tree->Root, NewNode, &Inserted);
+
+	if (!Inserted)
+	{
+		free(NewNode);
+		return 0;
+	}
+
+	Tree->Count++;
+
+	return 1;
+}
+
+//**************************************************************************************
+void *RegionTreeLookup(PREGIONTREE Tree, uintptr_t Start)
+//**************************************************************************************
+{
+	PREGIONNODE Node = Tree->Root;
+
+	while (Node)
+	{
+		if (Start < Node->Start)
+			Node = Node->Left;
+		else if (Start > Node->Start)
+			Node = Node->Right;
+		else
+			return Node->Data;
+	}
+
+	return NULL;
+}
+
+//**************************************************************************************
+void *RegionTreeRemove(PREGIONTREE Tree, uintptr_t Start)
+//**************************************************************************************
+{
+	PREGIONNODE Removed = NULL;
+	void *Data;
+
+	Tree->Root = RemoveNode(Tree->Root, Start, &Removed);
+
+	if (!Removed)
+		return NULL;
+
+	Data = Removed->Data;
+	free(Removed);
+	Tree->Count--;
+
+	return Data;
+}
+
+//**************************************************************************************
+size_t RegionTreeOverlaps(PREGIONTREE Tree, uintptr_t Start, uintptr_t End, REGIONTREE_CALLBACK Callback, void *Context)
+//**************************************************************************************
+{
+	if (End <= Start)
+		return 0;
+
+	return Overlaps(Tree->Root, Start, End, Callback, Context);
+}
@@ -0,0 +1,64 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Balanced (AVL) interval tree of half-open address ranges [Start, End),
+// keyed by Start and augmented with the maximum End of each subtree so that
+// point and overlap queries are O(log n + matches).
+
+typedef struct RegionNode
+{
+	uintptr_t			Start;
+	uintptr_t			End;
+	uintptr_t			MaxEnd;
+	void				*Data;
+	int					Height;
+	struct RegionNode	*Left;
+	struct RegionNode	*Right;
+} REGIONNODE, *PREGIONNODE;
+
+typedef struct RegionTree
+{
+	PREGIONNODE			Root;
+	size_t				Count;
+} REGIONTREE, *PREGIONTREE;
+
+typedef void (*REGIONTREE_CALLBACK)(uintptr_t Start, uintptr_t End, void *Data, void *Context);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void RegionTreeInit(PREGIONTREE Tree);
+// Removes all ranges, calling Callback (if any) for each one
+void RegionTreeFree(PREGIONTREE Tree, REGIONTREE_CALLBACK Callback, void *Context);
+// Fails if the range is empty, a range with the same Start exists, or allocation fails
+int RegionTreeInsert(PREGIONTREE Tree, uintptr_t Start, uintptr_t End, void *Data);
+// Exact lookup by Start
+void *RegionTreeLookup(PREGIONTREE Tree, uintptr_t Start);
+// Removes the range beginning at Start, returning its data
+void *RegionTreeRemove(PREGIONTREE Tree, uintptr_t Start);
+// Calls Callback for every range overlapping [Start, End) in ascending order, returning the count
+size_t RegionTreeOverlaps(PREGIONTREE Tree, uintptr_t Start, uintptr_t End, REGIONTREE_CALLBACK Callback, void *Context);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,361 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "Relocate.h"
+
+#define RELOC_BLOCK_HEADER	8
+#define RELOC_PAGE_SIZE		0x1000
+
+typedef struct RelocState
+{
+	PRELOCSECTION	Sections;
+	size_t			Count;
+	int				Sorted;
+	uint64_t		Delta;
+	uint64_t		CheckBase;
+	uint64_t		CheckSize;
+	RELOCPREPARE	Prepare;
+	void			*Context;
+	PRELOCRESULT	Result;
+} RELOCSTATE, *PRELOCSTATE;
+
+static uint16_t ReadEntry(const unsigned char *Entries, size_t Index)
+{
+	uint16_t Entry;
+	memcpy(&Entry, Entries + Index * sizeof(Entry), sizeof(Entry));
+	return Entry;
+}
+
+static int SectionContains(PRELOCSECTION Section, uint32_t Rva)
+{
+	return Rva - Section->VirtualAddress < Section->VirtualSize;
+}
+
+// When the sections ascend without overlapping, an RVA can only belong to
+// the last section starting at or below it, which a binary search finds
+static PRELOCSECTION FindSection(PRELOCSTATE State, uint32_t Rva)
+{
+	size_t Low = 0, High = State->Count, Middle;
+
+	if (!State->Sorted)
+	{
+		for (Low = 0; Low < State->Count; Low++)
+			if (SectionContains(&State->Sections[Low], Rva))
+				return &State->Sections[Low];
+		return NULL;
+	}
+
+	while (Low < High)
+	{
+		Middle = Low + (High - Low) / 2;
+		if (State->Sections[Middle].VirtualAddress <= Rva)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	if (Low && SectionContains(&State->Sections[Low - 1], Rva))
+		return &State->Sections[Low - 1];
+
+	return NULL;
+}
+
+static int SectionsSorted(PRELOCSECTION Sections, size_t Count)
+{
+	size_t i;
+
+	for (i = 1; i < Count; i++)
+		if (Sections[i].VirtualAddress < (uint64_t)Sections[i - 1].VirtualAddress + Sections[i - 1].VirtualSize)
+			return 0;
+
+	return 1;
+}
+
+// Returns where a fixup of Width bytes at Offset may be read, or NULL when
+// the section has no data under some of it
+static unsigned char *FixupData(PRELOCSTATE State, PRELOCSECTION Section, uint32_t Offset, uint32_t Width)
+{
+	if (Section->DataSize < Width || Offset > Section->DataSize - Width || !Section->Data)
+	{
+		State->Result->Outside++;
+		return NULL;
+	}
+
+	return Section->Data + Offset;
+}
+
+// Returns where a fixup at Offset is written, asking for the section to be
+// made writable the first time
+static unsigned char *WritableData(PRELOCSTATE State, PRELOCSECTION Section, uint32_t Offset)
+{
+	if (!Section->Prepared)
+	{
+		Section->Prepared = 1;
+		if (State->Prepare)
+		{
+			Section->Data = State->Prepare(State->Context, (size_t)(Section - State->Sections));
+		}
+	}
+
+	if (!Section->Data)
+	{
+		State->Result->Outside++;
+		return NULL;
+	}
+
+	return Section->Data + Offset;
+}
+
+static void ApplyHighLow(PRELOCSTATE State, PRELOCSECTION Section, uint32_t Offset)
+{
+	unsigned char *Data = FixupData(State, Section, Offset, sizeof(uint32_t));
+	uint32_t Value;
+
+	if (!Data)
+		return;
+
+	memcpy(&Value, Data, sizeof(Value));
+
+	if (State->CheckSize && (uint32_t)(Value - (uint32_t)State->CheckBase) >= State->CheckSize)
+	{
+		State->Result->Unchanged++;
+		return;
+	}
+
+	Data = WritableData(State, Section, Offset);
+	if (!Data)
+		return;
+
+	Value += (uint32_t)State->Delta;
+	memcpy(Data, &Value, sizeof(Value));
+	State->Result->Applied++;
+}
+
+static void ApplyDir64(PRELOCSTATE State, PRELOCSECTION Section, uint32_t Offset)
+{
+	unsigned char *Data = FixupData(State, Section, Offset, sizeof(uint64_t));
+	uint64_t Value;
+
+	if (!Data)
+		return;
+
+	memcpy(&Value, Data, sizeof(Value));
+
+	if (State->CheckSize && Value - State->CheckBase >= State->CheckSize)
+	{
+		State->Result->Unchanged++;
+		return;
+	}
+
+	Data = WritableData(State, Section, Offset);
+	if (!Data)
+		return;
+
+	Value += State->Delta;
+	memcpy(Data, &Value, sizeof(Value));
+	State->Result->Applied++;
+}
+
+// HIGH, LOW and HIGHADJ hold part of a 32-bit value, so are moved whatever
+// it is. HIGHADJ takes the low half from the entry after it and rounds.
+static void ApplyHalf(PRELOCSTATE State, PRELOCSECTION Section, uint32_t Offset, unsigned int Type, uint16_t Low)
+{
+	unsigned char *Data = FixupData(State, Section, Offset, sizeof(uint16_t));
+	uint32_t Delta = (uint32_t)State->Delta;
+	uint16_t Value;
+
+	if (!Data)
+		return;
+
+	memcpy(&Value, Data, sizeof(Value));
+
+	if (Type == RELOC_LOW)
+		Value = (uint16_t)(Value + Delta);
+	else if (Type == RELOC_HIGH)
+		Value = (uint16_t)(Value + (Delta >> 16));
+	else
+		Value = (uint16_t)((((uint32_t)Value << 16) + (uint32_t)(int32_t)(int16_t)Low + Delta + 0x8000) >> 16);
+
+	Data = WritableData(State, Section, Offset);
+	if (!Data)
+		return;
+
+	memcpy(Data, &Value, sizeof(Value));
+	State->Result->Applied++;
+}
+
+// Applies the entry at *Index, stepping past the extra entry HIGHADJ uses
+static void ApplyEntry(PRELOCSTATE State, PRELOCSECTION Section, uint32_t Offset, const unsigned char *Entries, size_t Count, size_t *Index)
+{
+	unsigned int Type = ReadEntry(Entries, *Index) >> 12;
+	uint16_t Low = 0;
+
+	if (Type == RELOC_HIGHADJ)
+	{
+		if (*Index + 1 >= Count)
+		{
+			State->Result->Malformed = 1;
+			return;
+		}
+		Low = ReadEntry(Entries, ++*Index);
+	}
+
+	if (Type == RELOC_ABSOLUTE)
+		return;
+
+	if (!Section)
+	{
+		State->Result->Outside++;
+		return;
+	}
+
+	switch (Type)
+	{
+	case RELOC_HIGHLOW:
+		ApplyHighLow(State, Section, Offset);
+		break;
+	case RELOC_DIR64:
+		ApplyDir64(State, Section, Offset);
+		break;
+	case RELOC_HIGH:
+	case RELOC_LOW:
+	case RELOC_HIGHADJ:
+		ApplyHalf(State, Section, Offset, Type, Low);
+		break;
+	default:
+		State->Result->Unsupported++;
+		break;
+	}
+}
+
+// A block whose page lies inside Section has its runs of pointer fixups
+// applied without going back through the type dispatch
+static void ApplyBlockInSection(PRELOCSTATE State, PRELOCSECTION Section, uint32_t Page, const unsigned char *Entries, size_t Count)
+{
+	uint32_t Base = Page - Section->VirtualAddress;
+	uint16_t Entry;
+	size_t i = 0;
+
+	while (i < Count)
+	{
+		Entry = ReadEntry(Entries, i);
+
+		switch (Entry >> 12)
+		{
+		case RELOC_DIR64:
+			do
+			{
+				ApplyDir64(State, Section, Base + (Entry & 0xFFF));
+				if (++i == Count)
+					break;
+				Entry = ReadEntry(Entries, i);
+			}
+			while (Entry >> 12 == RELOC_DIR64);
+			break;
+		case RELOC_HIGHLOW:
+			do
+			{
+				ApplyHighLow(State, Section, Base + (Entry & 0xFFF));
+				if (++i == Count)
+					break;
+				Entry = ReadEntry(Entries, i);
+			}
+			while (Entry >> 12 == RELOC_HIGHLOW);
+			break;
+		case RELOC_ABSOLUTE:
+			i++;
+			break;
+		default:
+			ApplyEntry(State, Section, Base + (Entry & 0xFFF), Entries, Count, &i);
+			i++;
+			break;
+		}
+	}
+}
+
+// Otherwise each fixup is looked up on its own
+static void ApplyBlockBySection(PRELOCSTATE State, uint32_t Page, const unsigned char *Entries, size_t Count)
+{
+	PRELOCSECTION Section;
+	uint32_t Rva;
+	size_t i;
+
+	for (i = 0; i < Count; i++)
+	{
+		Rva = Page + (ReadEntry(Entries, i) & 0xFFF);
+		Section = FindSection(State, Rva);
+		ApplyEntry(State, Section, Section ? Rva - Section->VirtualAddress : 0, Entries, Count, &i);
+	}
+}
+
+void RelocApply(const void *Relocations, size_t Size, PRELOCSECTION Sections, size_t Count, uint64_t Delta, uint64_t CheckBase, uint64_t CheckSize, RELOCPREPARE Prepare, void *Context, PRELOCRESULT Result)
+{
+	const unsigned char *Blocks = (const unsigned char*)Relocations;
+	PRELOCSECTION Section = NULL;
+	RELOCRESULT Ignored;
+	RELOCSTATE State;
+	uint32_t Page, BlockSize;
+	size_t Offset = 0;
+
+	if (!Result)
+		Result = &Ignored;
+	memset(Result, 0, sizeof(*Result));
+
+	State.Sections = Sections;
+	State.Count = Count;
+	State.Sorted = SectionsSorted(Sections, Count);
+	State.Delta = Delta;
+	State.CheckBase = CheckBase;
+	State.CheckSize = CheckSize;
+	State.Prepare = Prepare;
+	State.Context = Context;
+	State.Result = Result;
+
+	while (Size - Offset >= RELOC_BLOCK_HEADER)
+	{
+		memcpy(&Page, Blocks + Offset, sizeof(Page));
+		memcpy(&BlockSize, Blocks + Offset + sizeof(Page), sizeof(BlockSize));
+
+		// A zero-sized block pads the directory out
+		if (!BlockSize)
+			break;
+
+		if (BlockSize < RELOC_BLOCK_HEADER || BlockSize > Size - Offset)
+		{
+			Result->Malformed = 1;
+			break;
+		}
+
+		// Blocks normally ascend, so the section the last block fell in, or
+		// the one after it, is tried before searching
+		if (State.Sorted)
+		{
+			if (Section && !SectionContains(Section, Page) && Section + 1 < Sections + Count && SectionContains(Section + 1, Page))
+				Section++;
+			else if (!Section || !SectionContains(Section, Page))
+				Section = FindSection(&State, Page);
+		}
+
+		if (Section && Section->VirtualSize >= RELOC_PAGE_SIZE && Page - Section->VirtualAddress <= Section->VirtualSize - RELOC_PAGE_SIZE)
+			ApplyBlockInSection(&State, Section, Page, Blocks + Offset + RELOC_BLOCK_HEADER, (BlockSize - RELOC_BLOCK_HEADER) / 2);
+		else
+			ApplyBlockBySection(&State, Page, Blocks + Offset + RELOC_BLOCK_HEADER, (BlockSize - RELOC_BLOCK_HEADER) / 2);
+
+		Offset += BlockSize;
+	}
+}
@@ -0,0 +1,73 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Applies a PE base relocation directory to the sections of an image held
+// apart from it, as PeParser holds a dump. Each block's page is looked up
+// among the sections once, starting from the section the previous block
+// fell in, and when the page lies wholly inside it the block's fixups are
+// applied in runs of the same type without looking anything up again.
+// Blocks that are too short or run past the directory end it. Fixups are
+// written only where the section has data under all their bytes.
+
+#define RELOC_ABSOLUTE	0
+#define RELOC_HIGH		1
+#define RELOC_LOW		2
+#define RELOC_HIGHLOW	3
+#define RELOC_HIGHADJ	4
+#define RELOC_DIR64		10
+
+typedef struct RelocSection
+{
+	uint32_t		VirtualAddress;
+	uint32_t		VirtualSize;
+	unsigned char	*Data;
+	uint32_t		DataSize;
+	int				Prepared;	// set once Prepare has been asked for the section
+} RELOCSECTION, *PRELOCSECTION;
+
+typedef struct RelocResult
+{
+	size_t	Applied;		// fixups written
+	size_t	Unchanged;		// values outside the range being moved
+	size_t	Outside;		// fixups without section data under them
+	size_t	Unsupported;	// fixup types not applied here
+	int		Malformed;		// a block was malformed, or a HIGHADJ lacked its low half
+} RELOCRESULT, *PRELOCRESULT;
+
+// Called before the first fixup is written to a section, returning the data
+// to write to, or NULL to leave the section alone
+typedef unsigned char *(*RELOCPREPARE)(void *Context, size_t Index);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Adds Delta to the fixups Relocations describes. If CheckSize is non-zero
+// only the HIGHLOW and DIR64 values in [CheckBase, CheckBase + CheckSize)
+// are moved, the way a dump taken at CheckBase is moved back to its
+// preferred base. Sections must be in the order of the image's headers, and
+// as there an RVA belongs to the first section whose VirtualSize covers it.
+void RelocApply(const void *Relocations, size_t Size, PRELOCSECTION Sections, size_t Count, uint64_t Delta, uint64_t CheckBase, uint64_t CheckSize, RELOCPREPARE Prepare, void *Context, PRELOCRESULT Result);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,259 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "RulesCache.h"
+#include "Xxh64.h"
+
+#define RULES_CACHE_MAGIC 0x43525943	// 'CYRC'
+#define RULES_CACHE_FORMAT 1
+#define RULES_CACHE_SEED 0x796172615F796163ULL
+
+typedef struct RulesCacheHeader
+{
+	uint32_t	Magic;
+	uint32_t	Format;
+	uint32_t	YaraVersion;
+	uint32_t	Flags;
+	uint32_t	FileCount;
+	uint32_t	BlobCount;
+	uint64_t	ManifestSize;
+	uint64_t	BlobSizes[RULES_CACHE_MAX_BLOBS];
+	uint64_t	Checksum;
+} RULESCACHEHEADER;
+
+// Manifest records: Size, Hash, NameLength then the name, padded to 8 bytes
+#define RECORD_HEADER_SIZE (sizeof(uint64_t) * 2 + sizeof(uint32_t))
+#define ALIGN8(x) (((x) + 7) & ~(size_t)7)
+
+static int CompareEntries(const void *a, const void *b)
+{
+	return strcmp(((const RULESMANIFESTENTRY*)a)->Name, ((const RULESMANIFESTENTRY*)b)->Name);
+}
+
+static void SortManifest(PRULESMANIFEST Manifest)
+{
+	if (Manifest->Count > 1)
+		qsort(Manifest->Entries, Manifest->Count, sizeof(RULESMANIFESTENTRY), CompareEntries);
+}
+
+static size_t ManifestSize(PRULESMANIFEST Manifest)
+{
+	size_t Size = 0;
+	for (size_t i = 0; i < Manifest->Count; i++)
+		Size += ALIGN8(RECORD_HEADER_SIZE + strlen(Manifest->Entries[i].Name));
+	return Size;
+}
+
+//**************************************************************************************
+void RulesManifestInit(PRULESMANIFEST Manifest, uint32_t YaraVersion, uint32_t Flags)
+//**************************************************************************************
+{
+	memset(Manifest, 0, sizeof(RULESMANIFEST));
+	Manifest->YaraVersion = YaraVersion;
+	Manifest->Flags = Flags;
+}
+
+//**************************************************************************************
+void RulesManifestFree(PRULESMANIFEST Manifest)
+//**************************************************************************************
+{
+	for (size_t i = 0; i < Manifest->Count; i++)
+		free(Manifest->Entries[i].Name);
+	free(Manifest->Entries);
+	Manifest->Entries = NULL;
+	Manifest->Count = Manifest->Capacity = 0;
+}
+
+//**************************************************************************************
+int RulesManifestAdd(PRULESMANIFEST Manifest, const char *Name, const void *Content, size_t Size)
+//**************************************************************************************
+{
+	PRULESMANIFESTENTRY Entry;
+	size_t Length = strlen(Name);
+
+	if (Manifest->Count == Manifest->Capacity)
+	{
+		size_t Capacity = Manifest->Capacity ? Manifest->Capacity * 2 : 16;
+		PRULESMANIFESTENTRY Entries = (PRULESMANIFESTENTRY)realloc(Manifest->Entries, Capacity * sizeof(RULESMANIFESTENTRY));
+		if (!Entries)
+			return 0;
+		Manifest->Entries = Entries;
+		Manifest->Capacity = Capacity;
+	}
+
+	Entry = &Manifest->Entries[Manifest->Count];
+	Entry->Name = (char*)malloc(Length + 1);
+	if (!Entry->Name)
+		return 0;
+	memcpy(Entry->Name, Name, Length + 1);
+	Entry->Size = Size;
+	Entry->Hash = Xxh64(Content, Size, RULES_CACHE_SEED);
+	Manifest->Count++;
+
+	return 1;
+}
+
+//**************************************************************************************
+size_t RulesCacheSize(PRULESMANIFEST Manifest, const RULESCACHEBLOB *Blobs, unsigned int BlobCount)
+//**************************************************************************************
+{
+	size_t Size = sizeof(RULESCACHEHEADER) + ManifestSize(Manifest);
+
+	if (BlobCount > RULES_CACHE_MAX_BLOBS)
+		return 0;
+
+	for (unsigned int i = 0; i < BlobCount; i++)
+		Size += Blobs[i].Size;
+
+	return Size;
+}
+
+//**************************************************************************************
+size_t RulesCacheWrite(PRULESMANIFEST Manifest, const RULESCACHEBLOB *Blobs, unsigned int BlobCount, void *Buffer, size_t BufferSize)
+//**************************************************************************************
+{
+	RULESCACHEHEADER Header;
+	unsigned char *p = (unsigned char*)Buffer + sizeof(RULESCACHEHEADER);
+	size_t Size = RulesCacheSize(Manifest, Blobs, BlobCount);
+
+	if (!Size || Size > BufferSize)
+		return 0;
+
+	// Entries are stored in name order so validation is a single pass
+	SortManifest(Manifest);
+
+	memset(&Header, 0, sizeof(Header));
+	Header.Magic = RULES_CACHE_MAGIC;
+	Header.Format = RULES_CACHE_FORMAT;
+	Header.YaraVersion = Manifest->YaraVersion;
+	Header.Flags = Manifest->Flags;
+	Header.FileCount = (uint32_t)Manifest->Count;
+	Header.BlobCount = BlobCount;
+	Header.ManifestSize = ManifestSize(Manifest);
+
+	for (size_t i = 0; i < Manifest->Count; i++)
+	{
+		PRULESMANIFESTENTRY Entry = &Manifest->Entries[i];
+		uint32_t Length = (uint32_t)strlen(Entry->Name);
+		size_t RecordSize = ALIGN8(RECORD_HEADER_SIZE + Length);
+
+		memset(p, 0, RecordSize);
+		memcpy(p, &Entry->Size, sizeof(uint64_t));
+		memcpy(p + sizeof(uint64_t), &Entry->Hash, sizeof(uint64_t));
+		memcpy(p + sizeof(uint64_t) * 2, &Length, sizeof(uint32_t));
+		memcpy(p + RECORD_HEADER_SIZE, Entry->Name, Length);
+		p += RecordSize;
+	}
+
+	for (unsigned int i = 0; i < BlobCount; i++)
+	{
+		Header.BlobSizes[i] = Blobs[i].Size;
+		if (Blobs[i].Size)
+			memcpy(p, Blobs[i].Data, Blobs[i].Size);
+		p += Blobs[i].Size;
+	}
+
+	Header.Checksum = Xxh64((unsigned char*)Buffer + sizeof(RULESCACHEHEADER), Size - sizeof(RULESCACHEHEADER), RULES_CACHE_SEED);
+	memcpy(Buffer, &Header, sizeof(Header));
+
+	return Size;
+}
+
+//**************************************************************************************
+RULESCACHESTATUS RulesCacheValidate(const void *Cache, size_t CacheSize, PRULESMANIFEST Manifest, PRULESCACHEBLOB Blobs, unsigned int *BlobCount)
+//**************************************************************************************
+{
+	RULESCACHEHEADER Header;
+	const unsigned char *p = (const unsigned char*)Cache + sizeof(RULESCACHEHEADER), *End;
+	uint64_t Remaining;
+
+	if (CacheSize < sizeof(RULESCACHEHEADER))
+		return RULES_CACHE_CORRUPT;
+
+	memcpy(&Header, Cache, sizeof(Header));
+
+	if (Header.Magic != RULES_CACHE_MAGIC || Header.BlobCount > RULES_CACHE_MAX_BLOBS)
+		return RULES_CACHE_CORRUPT;
+
+	if (Header.Format != RULES_CACHE_FORMAT || Header.YaraVersion != Manifest->YaraVersion)
+		return RULES_CACHE_VERSION;
+
+	// Check the layout adds up before trusting any of it
+	Remaining = CacheSize - sizeof(RULESCACHEHEADER);
+	if (Header.ManifestSize > Remaining)
+		return RULES_CACHE_CORRUPT;
+	Remaining -= Header.ManifestSize;
+	for (unsigned int i = 0; i < Header.BlobCount; i++)
+	{
+		if (Header.BlobSizes[i] > Remaining)
+			return RULES_CACHE_CORRUPT;
+		Remaining -= Header.BlobSizes[i];
+	}
+	for (unsigned int i = Header.BlobCount; i < RULES_CACHE_MAX_BLOBS; i++)
+		if (Header.BlobSizes[i])
+			return RULES_CACHE_CORRUPT;
+	if (Remaining)
+		return RULES_CACHE_CORRUPT;
+
+	if (Xxh64(p, CacheSize - sizeof(RULESCACHEHEADER), RULES_CACHE_SEED) != Header.Checksum)
+		return RULES_CACHE_CORRUPT;
+
+	if (Header.Flags != Manifest->Flags)
+		return RULES_CACHE_FLAGS;
+
+	if (Header.FileCount != Manifest->Count)
+		return RULES_CACHE_STALE;
+
+	SortManifest(Manifest);
+
+	End = p + Header.ManifestSize;
+	for (size_t i = 0; i < Manifest->Count; i++)
+	{
+		PRULESMANIFESTENTRY Entry = &Manifest->Entries[i];
+		uint64_t Size, Hash;
+		uint32_t Length;
+
+		if ((size_t)(End - p) < RECORD_HEADER_SIZE)
+			return RULES_CACHE_CORRUPT;
+		memcpy(&Size, p, sizeof(uint64_t));
+		memcpy(&Hash, p + sizeof(uint64_t), sizeof(uint64_t));
+		memcpy(&Length, p + sizeof(uint64_t) * 2, sizeof(uint32_t));
+		if ((size_t)(End - p) < ALIGN8(RECORD_HEADER_SIZE + (size_t)Length))
+			return RULES_CACHE_CORRUPT;
+
+		if (Size != Entry->Size || Hash != Entry->Hash || Length != strlen(Entry->Name) || memcmp(p + RECORD_HEADER_SIZE, Entry->Name, Length))
+			return RULES_CACHE_STALE;
+
+		p += ALIGN8(RECORD_HEADER_SIZE + (size_t)Length);
+	}
+
+	if (p != End)
+		return RULES_CACHE_CORRUPT;
+
+	memset(Blobs, 0, sizeof(RULESCACHEBLOB) * RULES_CACHE_MAX_BLOBS);
+	for (unsigned int i = 0; i < Header.BlobCount; i++)
+	{
+		Blobs[i].Data = p;
+		Blobs[i].Size = (size_t)Header.BlobSizes[i];
+		p += Blobs[i].Size;
+	}
+	*BlobCount = Header.BlobCount;
+
+	return RULES_CACHE_VALID;
+}
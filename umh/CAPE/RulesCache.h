@@ -0,0 +1,79 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Cache file for compiled rules: a header, a manifest of the rule sources the
+// rules were compiled from (names, sizes and content hashes) along with the
+// libyara version and compile flags, then the compiled rule blobs. A checksum
+// over everything after the header catches truncated or damaged files.
+
+#define RULES_CACHE_MAX_BLOBS 4
+
+typedef struct RulesManifestEntry
+{
+	char		*Name;
+	uint64_t	Size;
+	uint64_t	Hash;
+} RULESMANIFESTENTRY, *PRULESMANIFESTENTRY;
+
+typedef struct RulesManifest
+{
+	uint32_t			YaraVersion;
+	uint32_t			Flags;
+	PRULESMANIFESTENTRY	Entries;
+	size_t				Count;
+	size_t				Capacity;
+} RULESMANIFEST, *PRULESMANIFEST;
+
+typedef struct RulesCacheBlob
+{
+	const void	*Data;
+	size_t		Size;
+} RULESCACHEBLOB, *PRULESCACHEBLOB;
+
+typedef enum RulesCacheStatus
+{
+	RULES_CACHE_VALID,
+	RULES_CACHE_CORRUPT,	// not a cache file, truncated or damaged
+	RULES_CACHE_VERSION,	// different cache format or libyara version
+	RULES_CACHE_FLAGS,		// compiled with different options
+	RULES_CACHE_STALE		// sources added, removed or changed
+} RULESCACHESTATUS;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void RulesManifestInit(PRULESMANIFEST Manifest, uint32_t YaraVersion, uint32_t Flags);
+void RulesManifestFree(PRULESMANIFEST Manifest);
+// Records a source file, hashing its content; the order files are added in does not matter
+int RulesManifestAdd(PRULESMANIFEST Manifest, const char *Name, const void *Content, size_t Size);
+// Size of the cache file for the manifest and blobs, or 0 if too many blobs
+size_t RulesCacheSize(PRULESMANIFEST Manifest, const RULESCACHEBLOB *Blobs, unsigned int BlobCount);
+// Writes the cache file image into Buffer, returning its size or 0 if Buffer is too small
+size_t RulesCacheWrite(PRULESMANIFEST Manifest, const RULESCACHEBLOB *Blobs, unsigned int BlobCount, void *Buffer, size_t BufferSize);
+// Checks a cache file image against the manifest of the current sources. When
+// valid, Blobs (of RULES_CACHE_MAX_BLOBS entries) point into Cache.
+RULESCACHESTATUS RulesCacheValidate(const void *Cache, size_t CacheSize, PRULESMANIFEST Manifest, PRULESCACHEBLOB Blobs, unsigned int *BlobCount);
+
+#ifdef __cplusplus
+}
+#endif
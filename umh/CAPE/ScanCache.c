@@ -0,0 +1,144 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include "ScanCache.h"
+#include "Xxh64.h"
+
+static void FreeEntry(uintptr_t Start, uintptr_t End, void *Data, void *Context)
+{
+	(void)Start, (void)End, (void)Context;
+	free(Data);
+}
+
+typedef struct ScanCacheRemoval
+{
+	uintptr_t	Bases[64];
+	size_t		Count;
+} SCANCACHEREMOVAL;
+
+static void CollectEntry(uintptr_t Start, uintptr_t End, void *Data, void *Context)
+{
+	SCANCACHEREMOVAL *Removal = (SCANCACHEREMOVAL*)Context;
+
+	(void)End, (void)Data;
+
+	if (Removal->Count < sizeof(Removal->Bases) / sizeof(Removal->Bases[0]))
+		Removal->Bases[Removal->Count++] = Start;
+}
+
+//**************************************************************************************
+void ScanCacheInit(PSCANCACHE Cache, size_t Limit, uint64_t Seed)
+//**************************************************************************************
+{
+	RegionTreeInit(&Cache->Entries);
+	Cache->Limit = Limit;
+	Cache->Seed = Seed;
+	Cache->Hits = 0;
+	Cache->Misses = 0;
+}
+
+//**************************************************************************************
+void ScanCacheFree(PSCANCACHE Cache)
+//**************************************************************************************
+{
+	RegionTreeFree(&Cache->Entries, FreeEntry, NULL);
+}
+
+//**************************************************************************************
+uint64_t ScanCacheDigest(PSCANCACHE Cache, const void *Buffer, size_t Size)
+//**************************************************************************************
+{
+	return Xxh64(Buffer, Size, Cache->Seed);
+}
+
+//**************************************************************************************
+int ScanCacheLookup(PSCANCACHE Cache, uintptr_t Base, size_t Size, uint64_t Digest, unsigned int *Matches)
+//**************************************************************************************
+{
+	PSCANCACHEENTRY Entry = (PSCANCACHEENTRY)RegionTreeLookup(&Cache->Entries, Base);
+
+	if (!Entry || Entry->Size != Size || Entry->Digest != Digest)
+	{
+		Cache->Misses++;
+		return 0;
+	}
+
+	if (Matches)
+		*Matches = Entry->Matches;
+
+	Cache->Hits++;
+
+	return 1;
+}
+
+//**************************************************************************************
+void ScanCacheStore(PSCANCACHE Cache, uintptr_t Base, size_t Size, uint64_t Digest, unsigned int Matches)
+//**************************************************************************************
+{
+	PSCANCACHEENTRY Entry;
+
+	if (!Size || Base + Size < Base)
+		return;
+
+	Entry = (PSCANCACHEENTRY)RegionTreeRemove(&Cache->Entries, Base);
+
+	// A full cache is simply emptied; the regions of interest are rescanned soon enough
+	if (!Entry && Cache->Limit && Cache->Entries.Count >= Cache->Limit)
+		RegionTreeFree(&Cache->Entries, FreeEntry, NULL);
+
+	if (!Entry)
+		Entry = (PSCANCACHEENTRY)malloc(sizeof(SCANCACHEENTRY));
+
+	if (!Entry)
+		return;
+
+	Entry->Base = Base;
+	Entry->Size = Size;
+	Entry->Digest = Digest;
+	Entry->Matches = Matches;
+
+	if (!RegionTreeInsert(&Cache->Entries, Base, Base + Size, Entry))
+		free(Entry);
+}
+
+//**************************************************************************************
+size_t ScanCacheInvalidate(PSCANCACHE Cache, uintptr_t Start, size_t Size)
+//**************************************************************************************
+{
+	SCANCACHEREMOVAL Removal;
+	uintptr_t End = Start + Size;
+	size_t i, Count = 0;
+
+	if (End < Start)
+		End = UINTPTR_MAX;
+
+	// Entries may overlap, so collect before removing, in batches
+	do
+	{
+		Removal.Count = 0;
+		RegionTreeOverlaps(&Cache->Entries, Start, End, CollectEntry, &Removal);
+
+		for (i = 0; i < Removal.Count; i++)
+			free(RegionTreeRemove(&Cache->Entries, Removal.Bases[i]));
+
+		Count += Removal.Count;
+	}
+	while (Removal.Count == sizeof(Removal.Bases) / sizeof(Removal.Bases[0]));
+
+	return Count;
+}
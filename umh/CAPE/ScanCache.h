@@ -0,0 +1,64 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "RegionTree.h"
+
+// Results of previous scans keyed by region base and size and a seeded 64-bit
+// digest of the content scanned, so that unchanged memory need not be
+// rescanned. Entries are dropped when their range is invalidated (protection
+// changes, frees) or when the cache fills.
+
+typedef struct ScanCacheEntry
+{
+	uintptr_t		Base;
+	size_t			Size;
+	uint64_t		Digest;
+	unsigned int	Matches;
+} SCANCACHEENTRY, *PSCANCACHEENTRY;
+
+typedef struct ScanCache
+{
+	REGIONTREE	Entries;	// keyed by Base
+	size_t		Limit;
+	uint64_t	Seed;
+	size_t		Hits;
+	size_t		Misses;
+} SCANCACHE, *PSCANCACHE;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void ScanCacheInit(PSCANCACHE Cache, size_t Limit, uint64_t Seed);
+void ScanCacheFree(PSCANCACHE Cache);
+// Seeded XXH64 of the buffer
+uint64_t ScanCacheDigest(PSCANCACHE Cache, const void *Buffer, size_t Size);
+// Returns nonzero, with the match count of the earlier scan, if [Base, Base + Size)
+// was scanned with this digest
+int ScanCacheLookup(PSCANCACHE Cache, uintptr_t Base, size_t Size, uint64_t Digest, unsigned int *Matches);
+// Records a completed scan, replacing any earlier result for Base
+void ScanCacheStore(PSCANCACHE Cache, uintptr_t Base, size_t Size, uint64_t Digest, unsigned int Matches);
+// Drops results for scans overlapping [Start, Start + Size), returning how many
+size_t ScanCacheInvalidate(PSCANCACHE Cache, uintptr_t Start, size_t Size);
+
+#ifdef __cplusplus
+}
+#endif
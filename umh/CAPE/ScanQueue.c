@@ -0,0 +1,360 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include "ScanQueue.h"
+
+#define SCAN_QUEUE_MAX_THREADS 32
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef SRWLOCK LOCK;
+typedef CONDITION_VARIABLE CONDITION;
+typedef HANDLE THREAD;
+
+#define LockInit(Lock) InitializeSRWLock(Lock)
+#define LockFree(Lock)
+#define LockAcquire(Lock) AcquireSRWLockExclusive(Lock)
+#define LockRelease(Lock) ReleaseSRWLockExclusive(Lock)
+#define ConditionInit(Condition) InitializeConditionVariable(Condition)
+#define ConditionFree(Condition)
+#define ConditionWait(Condition, Lock) SleepConditionVariableSRW(Condition, Lock, INFINITE, 0)
+#define ConditionSignal(Condition) WakeConditionVariable(Condition)
+#define ConditionBroadcast(Condition) WakeAllConditionVariable(Condition)
+#else
+#include <pthread.h>
+
+typedef pthread_mutex_t LOCK;
+typedef pthread_cond_t CONDITION;
+typedef pthread_t THREAD;
+
+#define LockInit(Lock) pthread_mutex_init(Lock, NULL)
+#define LockFree(Lock) pthread_mutex_destroy(Lock)
+#define LockAcquire(Lock) pthread_mutex_lock(Lock)
+#define LockRelease(Lock) pthread_mutex_unlock(Lock)
+#define ConditionInit(Condition) pthread_cond_init(Condition, NULL)
+#define ConditionFree(Condition) pthread_cond_destroy(Condition)
+#define ConditionWait(Condition, Lock) pthread_cond_wait(Condition, Lock)
+#define ConditionSignal(Condition) pthread_cond_signal(Condition)
+#define ConditionBroadcast(Condition) pthread_cond_broadcast(Condition)
+#endif
+
+struct ScanQueue
+{
+	SCANQUEUECONFIG	Config;
+	LOCK			Lock;
+	CONDITION		Work;		// jobs posted, or stopping
+	CONDITION		Idle;		// nothing outstanding
+	PSCANJOB		Head, Tail;	// posted, waiting for a worker
+	PSCANJOB		DoneHead, DoneTail;
+	SCANQUEUESTATS	Stats;
+	int				Stopping;
+	unsigned int	ThreadCount;
+	THREAD			Threads[SCAN_QUEUE_MAX_THREADS];
+};
+
+static void Append(PSCANJOB *Head, PSCANJOB *Tail, PSCANJOB Job)
+{
+	Job->Next = NULL;
+
+	if (*Tail)
+		(*Tail)->Next = Job;
+	else
+		*Head = Job;
+
+	*Tail = Job;
+}
+
+// Called with the lock held once a reserved job's snapshot is released
+static void Release(PSCANQUEUE Queue, PSCANJOB Job)
+{
+	Queue->Stats.SnapshotBytes -= Job->Size;
+
+	if (!--Queue->Stats.Outstanding)
+		ConditionBroadcast(&Queue->Idle);
+}
+
+static void Worker(PSCANQUEUE Queue)
+{
+	PSCANJOB Job;
+
+	if (Queue->Config.ThreadStart)
+		Queue->Config.ThreadStart(Queue->Config.Context);
+
+	LockAcquire(&Queue->Lock);
+
+	while (1)
+	{
+		while (!Queue->Head && !Queue->Stopping)
+			ConditionWait(&Queue->Work, &Queue->Lock);
+
+		// Posted jobs are finished before stopping
+		Job = Queue->Head;
+		if (!Job)
+			break;
+
+		Queue->Head = Job->Next;
+		if (!Queue->Head)
+			Queue->Tail = NULL;
+
+		LockRelease(&Queue->Lock);
+
+		Queue->Config.Scan(Job, Queue->Config.Context);
+
+		free(Job->Snapshot);
+		Job->Snapshot = NULL;
+
+		LockAcquire(&Queue->Lock);
+
+		Append(&Queue->DoneHead, &Queue->DoneTail, Job);
+		Queue->Stats.Scanned++;
+		Release(Queue, Job);
+	}
+
+	LockRelease(&Queue->Lock);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI WorkerThread(LPVOID Parameter)
+{
+	Worker((PSCANQUEUE)Parameter);
+	return 0;
+}
+#else
+static void *WorkerThread(void *Parameter)
+{
+	Worker((PSCANQUEUE)Parameter);
+	return NULL;
+}
+#endif
+
+static int StartThread(PSCANQUEUE Queue, THREAD *Thread)
+{
+#ifdef _WIN32
+	*Thread = CreateThread(NULL, 0, WorkerThread, Queue, 0, NULL);
+	return *Thread != NULL;
+#else
+	return !pthread_create(Thread, NULL, WorkerThread, Queue);
+#endif
+}
+
+static void JoinThread(THREAD Thread)
+{
+#ifdef _WIN32
+	WaitForSingleObject(Thread, INFINITE);
+	CloseHandle(Thread);
+#else
+	pthread_join(Thread, NULL);
+#endif
+}
+
+//**************************************************************************************
+PSCANQUEUE ScanQueueCreate(const SCANQUEUECONFIG *Config)
+//**************************************************************************************
+{
+	PSCANQUEUE Queue;
+	unsigned int i, Threads = Config->Threads;
+
+	if (!Config->Scan || !Threads)
+		return NULL;
+
+	if (Threads > SCAN_QUEUE_MAX_THREADS)
+		Threads = SCAN_QUEUE_MAX_THREADS;
+
+	Queue = (PSCANQUEUE)calloc(1, sizeof(SCANQUEUE));
+	if (!Queue)
+		return NULL;
+
+	Queue->Config = *Config;
+	LockInit(&Queue->Lock);
+	ConditionInit(&Queue->Work);
+	ConditionInit(&Queue->Idle);
+
+	for (i = 0; i < Threads; i++)
+	{
+		if (!StartThread(Queue, &Queue->Threads[Queue->ThreadCount]))
+			break;
+		Queue->ThreadCount++;
+	}
+
+	if (!Queue->ThreadCount)
+	{
+		ScanQueueDestroy(Queue);
+		return NULL;
+	}
+
+	return Queue;
+}
+
+//**************************************************************************************
+void ScanQueueDestroy(PSCANQUEUE Queue)
+//**************************************************************************************
+{
+	unsigned int i;
+
+	if (!Queue)
+		return;
+
+	LockAcquire(&Queue->Lock);
+	Queue->Stopping = 1;
+	ConditionBroadcast(&Queue->Work);
+	LockRelease(&Queue->Lock);
+
+	for (i = 0; i < Queue->ThreadCount; i++)
+		JoinThread(Queue->Threads[i]);
+
+	ScanQueueDrain(Queue);
+
+	ConditionFree(&Queue->Idle);
+	ConditionFree(&Queue->Work);
+	LockFree(&Queue->Lock);
+	free(Queue);
+}
+
+//**************************************************************************************
+PSCANJOB ScanQueueReserve(PSCANQUEUE Queue, uintptr_t Address, size_t Size, void *Context)
+//**************************************************************************************
+{
+	PSCANJOB Job;
+
+	if (!Queue || !Size)
+		return NULL;
+
+	LockAcquire(&Queue->Lock);
+
+	if (Queue->Stopping || Queue->Stats.Outstanding >= Queue->Config.Depth || Size > Queue->Config.SnapshotLimit - Queue->Stats.SnapshotBytes)
+	{
+		Queue->Stats.Rejected++;
+		LockRelease(&Queue->Lock);
+		return NULL;
+	}
+
+	Queue->Stats.Outstanding++;
+	Queue->Stats.SnapshotBytes += Size;
+
+	LockRelease(&Queue->Lock);
+
+	Job = (PSCANJOB)calloc(1, sizeof(SCANJOB));
+	if (Job)
+	{
+		Job->Address = Address;
+		Job->Size = Size;
+		Job->Context = Context;
+		Job->Snapshot = (unsigned char*)malloc(Size);
+	}
+
+	if (!Job || !Job->Snapshot)
+	{
+		if (Job)
+			free(Job);
+
+		LockAcquire(&Queue->Lock);
+		Queue->Stats.Rejected++;
+		Queue->Stats.SnapshotBytes -= Size;
+		if (!--Queue->Stats.Outstanding)
+			ConditionBroadcast(&Queue->Idle);
+		LockRelease(&Queue->Lock);
+
+		return NULL;
+	}
+
+	return Job;
+}
+
+//**************************************************************************************
+void ScanQueueCancel(PSCANQUEUE Queue, PSCANJOB Job)
+//**************************************************************************************
+{
+	free(Job->Snapshot);
+
+	LockAcquire(&Queue->Lock);
+	Release(Queue, Job);
+	LockRelease(&Queue->Lock);
+
+	free(Job);
+}
+
+//**************************************************************************************
+void ScanQueuePost(PSCANQUEUE Queue, PSCANJOB Job)
+//**************************************************************************************
+{
+	LockAcquire(&Queue->Lock);
+	Append(&Queue->Head, &Queue->Tail, Job);
+	Queue->Stats.Posted++;
+	ConditionSignal(&Queue->Work);
+	LockRelease(&Queue->Lock);
+}
+
+//**************************************************************************************
+size_t ScanQueueDrain(PSCANQUEUE Queue)
+//**************************************************************************************
+{
+	PSCANJOB Job, Next;
+	size_t Count = 0;
+
+	if (!Queue)
+		return 0;
+
+	LockAcquire(&Queue->Lock);
+	Job = Queue->DoneHead;
+	Queue->DoneHead = Queue->DoneTail = NULL;
+	LockRelease(&Queue->Lock);
+
+	// Complete may scan (and so drain) again, which only sees later jobs
+	for (; Job; Job = Next)
+	{
+		Next = Job->Next;
+		if (Queue->Config.Complete)
+			Queue->Config.Complete(Job, Queue->Config.Context);
+		free(Job);
+		Count++;
+	}
+
+	if (Count)
+	{
+		LockAcquire(&Queue->Lock);
+		Queue->Stats.Completed += Count;
+		LockRelease(&Queue->Lock);
+	}
+
+	return Count;
+}
+
+//**************************************************************************************
+size_t ScanQueueFlush(PSCANQUEUE Queue)
+//**************************************************************************************
+{
+	if (!Queue)
+		return 0;
+
+	LockAcquire(&Queue->Lock);
+	while (Queue->Stats.Outstanding)
+		ConditionWait(&Queue->Idle, &Queue->Lock);
+	LockRelease(&Queue->Lock);
+
+	return ScanQueueDrain(Queue);
+}
+
+//**************************************************************************************
+void ScanQueueGetStats(PSCANQUEUE Queue, PSCANQUEUESTATS Stats)
+//**************************************************************************************
+{
+	LockAcquire(&Queue->Lock);
+	*Stats = Queue->Stats;
+	LockRelease(&Queue->Lock);
+}
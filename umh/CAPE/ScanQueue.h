@@ -0,0 +1,88 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded pool of worker threads scanning snapshots of memory regions off the
+// caller's thread. A caller reserves a job (which fails when the queue is full
+// or the snapshot memory limit would be exceeded, in which case it should scan
+// synchronously), copies the region into the job's snapshot and posts it. The
+// Scan callback runs on a worker; finished jobs are then held until a caller
+// drains them, so that Complete runs in that caller's context.
+
+typedef struct ScanJob
+{
+	uintptr_t		Address;	// where the snapshot was taken
+	size_t			Size;
+	unsigned char	*Snapshot;	// freed once scanned
+	void			*Context;
+	int				Result;		// set by the Scan callback
+	struct ScanJob	*Next;
+} SCANJOB, *PSCANJOB;
+
+typedef void (*SCANQUEUE_SCAN)(PSCANJOB Job, void *Context);
+typedef void (*SCANQUEUE_COMPLETE)(PSCANJOB Job, void *Context);
+typedef void (*SCANQUEUE_THREAD_START)(void *Context);
+
+typedef struct ScanQueueConfig
+{
+	unsigned int			Threads;
+	size_t					Depth;			// jobs reserved but not yet scanned
+	size_t					SnapshotLimit;	// bytes held in snapshots
+	SCANQUEUE_SCAN			Scan;			// called on a worker thread
+	SCANQUEUE_COMPLETE		Complete;		// called by ScanQueueDrain, optional
+	SCANQUEUE_THREAD_START	ThreadStart;	// called by each worker as it starts, optional
+	void					*Context;
+} SCANQUEUECONFIG, *PSCANQUEUECONFIG;
+
+typedef struct ScanQueueStats
+{
+	size_t	Posted;
+	size_t	Rejected;		// reservations refused, scanned synchronously by the caller
+	size_t	Scanned;
+	size_t	Completed;
+	size_t	Outstanding;	// reserved but not yet scanned
+	size_t	SnapshotBytes;
+} SCANQUEUESTATS, *PSCANQUEUESTATS;
+
+typedef struct ScanQueue SCANQUEUE, *PSCANQUEUE;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns NULL if no worker thread could be started
+PSCANQUEUE ScanQueueCreate(const SCANQUEUECONFIG *Config);
+// Finishes the scans already posted, drains them and stops the workers
+void ScanQueueDestroy(PSCANQUEUE Queue);
+// Returns a job with a Size byte snapshot buffer to fill, or NULL if the caller should scan synchronously
+PSCANJOB ScanQueueReserve(PSCANQUEUE Queue, uintptr_t Address, size_t Size, void *Context);
+// Releases a reserved job that will not be posted, e.g. when the copy faulted
+void ScanQueueCancel(PSCANQUEUE Queue, PSCANJOB Job);
+void ScanQueuePost(PSCANQUEUE Queue, PSCANJOB Job);
+// Calls Complete on this thread for each job scanned, in the order they finished, returning how many
+size_t ScanQueueDrain(PSCANQUEUE Queue);
+// Waits for every posted job to be scanned, then drains
+size_t ScanQueueFlush(PSCANQUEUE Queue);
+void ScanQueueGetStats(PSCANQUEUE Queue, PSCANQUEUESTATS Stats);
+
+#ifdef __cplusplus
+}
+#endif
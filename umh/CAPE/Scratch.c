@@ -0,0 +1,258 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "Scratch.h"
+
+#define SCRATCH_ALIGN 16
+#define ALIGN_UP(x) (((x) + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1))
+
+// Heap allocations that did not fit, most recent first
+typedef struct ScratchFallback
+{
+	struct ScratchFallback	*Next;
+	size_t					Size;
+} SCRATCHFALLBACK, *PSCRATCHFALLBACK;
+
+typedef struct ScratchArena
+{
+	size_t				Capacity;
+	size_t				Offset;
+	size_t				HighWater;
+	size_t				FallbackCount;
+	size_t				FallbacksLive;
+	PSCRATCHFALLBACK	Fallbacks;
+	unsigned char		*Base;
+} SCRATCHARENA, *PSCRATCHARENA;
+
+static void ThreadExit(void *Value)
+{
+	PSCRATCHARENA Arena = (PSCRATCHARENA)Value;
+	PSCRATCHFALLBACK Fallback, Next;
+
+	if (!Arena)
+		return;
+
+	for (Fallback = Arena->Fallbacks; Fallback; Fallback = Next)
+	{
+		Next = Fallback->Next;
+		free(Fallback);
+	}
+
+	free(Arena);
+}
+
+#ifdef _WIN32
+#include <windows.h>
+
+static INIT_ONCE ArenaInit = INIT_ONCE_STATIC_INIT;
+static DWORD ArenaIndex = FLS_OUT_OF_INDEXES;
+
+static VOID WINAPI FlsThreadExit(PVOID Value)
+{
+	ThreadExit(Value);
+}
+
+static BOOL CALLBACK ArenaIndexInit(PINIT_ONCE InitOnce, PVOID Parameter, PVOID *Context)
+{
+	// Fiber local storage, unlike TLS, calls back as each thread exits
+	ArenaIndex = FlsAlloc(FlsThreadExit);
+	return TRUE;
+}
+
+static PSCRATCHARENA GetArenaSlot(void)
+{
+	PSCRATCHARENA Arena = NULL;
+	DWORD LastError = GetLastError();
+
+	InitOnceExecuteOnce(&ArenaInit, ArenaIndexInit, NULL, NULL);
+
+	if (ArenaIndex != FLS_OUT_OF_INDEXES)
+		Arena = (PSCRATCHARENA)FlsGetValue(ArenaIndex);
+
+	SetLastError(LastError);
+
+	return Arena;
+}
+
+static int SetArenaSlot(PSCRATCHARENA Arena)
+{
+	DWORD LastError = GetLastError();
+	BOOL Set = ArenaIndex != FLS_OUT_OF_INDEXES && FlsSetValue(ArenaIndex, Arena);
+
+	SetLastError(LastError);
+
+	return Set;
+}
+#else
+#include <pthread.h>
+
+static pthread_once_t ArenaInit = PTHREAD_ONCE_INIT;
+static pthread_key_t ArenaKey;
+static int ArenaKeyValid;
+
+static void ArenaKeyInit(void)
+{
+	ArenaKeyValid = !pthread_key_create(&ArenaKey, ThreadExit);
+}
+
+static PSCRATCHARENA GetArenaSlot(void)
+{
+	pthread_once(&ArenaInit, ArenaKeyInit);
+
+	return ArenaKeyValid ? (PSCRATCHARENA)pthread_getspecific(ArenaKey) : NULL;
+}
+
+static int SetArenaSlot(PSCRATCHARENA Arena)
+{
+	return ArenaKeyValid && !pthread_setspecific(ArenaKey, Arena);
+}
+#endif
+
+// Returns the calling thread's arena, creating it on first use, or NULL if
+// there is none (everything then comes from the heap)
+static PSCRATCHARENA GetArena(int Create)
+{
+	PSCRATCHARENA Arena = GetArenaSlot();
+
+	if (Arena || !Create)
+		return Arena;
+
+	// The arena is not touched until used, so untouched pages cost nothing
+	Arena = (PSCRATCHARENA)malloc(ALIGN_UP(sizeof(SCRATCHARENA)) + SCRATCH_ARENA_SIZE);
+	if (!Arena)
+		return NULL;
+
+	memset(Arena, 0, sizeof(SCRATCHARENA));
+	Arena->Capacity = SCRATCH_ARENA_SIZE;
+	Arena->Base = (unsigned char*)Arena + ALIGN_UP(sizeof(SCRATCHARENA));
+
+	if (!SetArenaSlot(Arena))
+	{
+		free(Arena);
+		return NULL;
+	}
+
+	return Arena;
+}
+
+//**************************************************************************************
+void ScratchPush(PSCRATCHFRAME Frame)
+//**************************************************************************************
+{
+	PSCRATCHARENA Arena = GetArena(1);
+
+	Frame->Offset = Arena ? Arena->Offset : 0;
+	Frame->Fallbacks = Arena ? Arena->Fallbacks : NULL;
+}
+
+//**************************************************************************************
+void ScratchPop(PSCRATCHFRAME Frame)
+//**************************************************************************************
+{
+	PSCRATCHARENA Arena = GetArena(0);
+	PSCRATCHFALLBACK Fallback;
+
+	if (!Arena)
+		return;
+
+	while (Arena->Fallbacks && Arena->Fallbacks != (PSCRATCHFALLBACK)Frame->Fallbacks)
+	{
+		Fallback = Arena->Fallbacks;
+		Arena->Fallbacks = Fallback->Next;
+		Arena->FallbacksLive--;
+		free(Fallback);
+	}
+
+	if (Frame->Offset <= Arena->Offset)
+		Arena->Offset = Frame->Offset;
+}
+
+//**************************************************************************************
+void *ScratchAlloc(size_t Size)
+//**************************************************************************************
+{
+	PSCRATCHARENA Arena = GetArena(1);
+	PSCRATCHFALLBACK Fallback;
+	size_t Aligned = ALIGN_UP(Size);
+	void *Buffer;
+
+	if (!Arena)
+		return NULL;
+
+	if (Aligned >= Size && Aligned <= Arena->Capacity - Arena->Offset)
+	{
+		Buffer = Arena->Base + Arena->Offset;
+		Arena->Offset += Aligned;
+
+		if (Arena->Offset > Arena->HighWater)
+			Arena->HighWater = Arena->Offset;
+
+		return Buffer;
+	}
+
+	if (Size > (size_t)-1 - ALIGN_UP(sizeof(SCRATCHFALLBACK)))
+		return NULL;
+
+	Fallback = (PSCRATCHFALLBACK)malloc(ALIGN_UP(sizeof(SCRATCHFALLBACK)) + Size);
+	if (!Fallback)
+		return NULL;
+
+	Fallback->Size = Size;
+	Fallback->Next = Arena->Fallbacks;
+	Arena->Fallbacks = Fallback;
+	Arena->FallbackCount++;
+	Arena->FallbacksLive++;
+
+	return (unsigned char*)Fallback + ALIGN_UP(sizeof(SCRATCHFALLBACK));
+}
+
+//**************************************************************************************
+void *ScratchCalloc(size_t Count, size_t Size)
+//**************************************************************************************
+{
+	void *Buffer;
+
+	if (Size && Count > (size_t)-1 / Size)
+		return NULL;
+
+	Buffer = ScratchAlloc(Count * Size);
+
+	if (Buffer)
+		memset(Buffer, 0, Count * Size);
+
+	return Buffer;
+}
+
+//**************************************************************************************
+void ScratchGetStats(PSCRATCHSTATS Stats)
+//**************************************************************************************
+{
+	PSCRATCHARENA Arena = GetArena(0);
+
+	memset(Stats, 0, sizeof(SCRATCHSTATS));
+
+	if (!Arena)
+		return;
+
+	Stats->Capacity = Arena->Capacity;
+	Stats->Used = Arena->Offset;
+	Stats->HighWater = Arena->HighWater;
+	Stats->Fallbacks = Arena->FallbackCount;
+	Stats->FallbacksLive = Arena->FallbacksLive;
+}
@@ -0,0 +1,61 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-thread scratch arenas for temporary buffers (paths, key names) that
+// hooks would otherwise allocate from the heap on every call. Allocations are
+// carved from a thread's arena and released together by popping the frame
+// they were made in; memory is not zeroed unless ScratchCalloc is used.
+// Anything that doesn't fit in the arena comes from the heap and is freed by
+// the same pop. A thread's arena is freed when the thread exits.
+
+#define SCRATCH_ARENA_SIZE 0x80000
+
+typedef struct ScratchFrame
+{
+	size_t	Offset;
+	void	*Fallbacks;
+} SCRATCHFRAME, *PSCRATCHFRAME;
+
+typedef struct ScratchStats
+{
+	size_t	Capacity;
+	size_t	Used;
+	size_t	HighWater;
+	size_t	Fallbacks;		// allocations that did not fit and went to the heap
+	size_t	FallbacksLive;
+} SCRATCHSTATS, *PSCRATCHSTATS;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void ScratchPush(PSCRATCHFRAME Frame);
+// Releases everything allocated on this thread since the matching push
+void ScratchPop(PSCRATCHFRAME Frame);
+void *ScratchAlloc(size_t Size);
+void *ScratchCalloc(size_t Count, size_t Size);
+// Statistics for the calling thread's arena
+void ScratchGetStats(PSCRATCHSTATS Stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,5 +1,6 @@
 
 #include "ApiReader.h"
+#include <algorithm>
 
 #include "Architecture.h"
 #include "SystemInformation.h"
@@ -11,7 +12,11 @@
 extern "C" void DebugOutput(_In_ LPCTSTR lpOutputString, ...);
 extern "C" void ErrorOutput(_In_ LPCTSTR lpOutputString, ...);
 
-stdext::hash_multimap<DWORD_PTR, ApiInfo *> ApiReader::apiList; //api look up table
+std::vector<ApiInfo *> ApiReader::apiList; //all apis, in the order they were read
+PAPIINDEX ApiReader::apiIndex; //api look up table, built from apiList
+PEXPORTCACHE ApiReader::exportCache; //apis of each module, kept between dumps
+std::vector<void *> ApiReader::apiListSources;
+std::vector<std::vector<ApiInfo *> *> ApiReader::uncachedApis;
 std::map<DWORD_PTR, ImportModuleThunk> *  ApiReader::moduleThunkList; //store found apis
 
 DWORD_PTR ApiReader::minApiAddress = (DWORD_PTR)-1;
@@ -19,8 +24,25 @@ DWORD_PTR ApiReader::maxApiAddress = 0;
 
 //#define DEBUG_COMMENTS
 
+static void freeModuleApis(void *exports)
+{
+	std::vector<ApiInfo *> *moduleApis = (std::vector<ApiInfo *> *)exports;
+
+	for (size_t i = 0; i < moduleApis->size(); i++)
+	{
+		delete (*moduleApis)[i];
+	}
+
+	delete moduleApis;
+}
+
 void ApiReader::readApisFromModuleList()
 {
+	std::vector<ApiInfo *> *moduleApis = 0;
+	std::vector<void *> sources;
+	std::vector<std::vector<ApiInfo *> *> previousUncached;
+	std::vector<EXPORTCACHEMODULE> modules(moduleList.size());
+
 	if (APIS_ALWAYS_FROM_DISK)
 	{
 		readExportTableAlwaysFromDisk = true;
@@ -30,6 +52,24 @@ void ApiReader::readApisFromModuleList()
 		readExportTableAlwaysFromDisk = false;
 	}
 
+	if (!exportCache)
+	{
+		exportCache = ExportCacheCreate(freeModuleApis);
+	}
+
+	previousUncached.swap(uncachedApis);
+
+	//modules unchanged since an earlier dump keep the apis read then
+	for (unsigned int i = 0; i < moduleList.size(); i++)
+	{
+		modules[i].Base = moduleList[i].modBaseAddr;
+		modules[i].Size = moduleList[i].modBaseSize;
+		modules[i].Stamp = getModuleStamp(&moduleList[i]);
+		modules[i].Name = moduleList[i].getFilename();
+	}
+
+	ExportCacheBegin(exportCache, modules.empty() ? 0 : &modules[0], modules.size());
+
 	DebugOutput("ApiReader: module list size: %i", moduleList.size());
 	for (unsigned int i = 0; i < moduleList.size();i++)
 	{
@@ -40,12 +80,47 @@ void ApiReader::readApisFromModuleList()
 			maxValidAddress = moduleList[i].modBaseAddr + moduleList[i].modBaseSize;
 		}
 
-		DebugOutput("Module parsing: %s", moduleList[i].fullPath);
+		moduleApis = (std::vector<ApiInfo *> *)ExportCacheLookup(exportCache, modules[i].Base, modules[i].Size, modules[i].Stamp);
 
-		if (!moduleList[i].isAlreadyParsed)
+		if (moduleApis)
+		{
+			for (size_t j = 0; j < moduleApis->size(); j++)
+			{
+				(*moduleApis)[j]->module = &moduleList[i];
+			}
+
+			moduleList[i].apiList = *moduleApis;
+			moduleList[i].isAlreadyParsed = true;
+		}
+		else
 		{
+			DebugOutput("Module parsing: %s", moduleList[i].fullPath);
+
+			moduleList[i].apiList.clear();
+			unresolvedForwards.clear();
 			parseModule(&moduleList[i]);
+
+			moduleApis = new std::vector<ApiInfo *>(moduleList[i].apiList);
+
+			if (!storeModuleApis(&moduleList[i], modules[i].Stamp, moduleApis))
+			{
+				uncachedApis.push_back(moduleApis);
+			}
 		}
+
+		sources.push_back(moduleApis);
+	}
+
+	if (!apiIndex || sources != apiListSources)
+	{
+		buildApiList(sources);
+	}
+
+	ExportCacheEnd(exportCache);
+
+	for (size_t i = 0; i < previousUncached.size(); i++)
+	{
+		freeModuleApis(previousUncached[i]);
 	}
 
 #ifdef DEBUG_COMMENTS
@@ -53,6 +128,101 @@ void ApiReader::readApisFromModuleList()
 #endif
 }
 
+void ApiReader::buildApiList(std::vector<void *> &sources)
+{
+	std::vector<ApiInfo *> *moduleApis = 0;
+
+	apiList.clear();
+	ApiIndexFree(apiIndex);
+	apiIndex = 0;
+
+	minApiAddress = (DWORD_PTR)-1;
+	maxApiAddress = 0;
+
+	for (size_t i = 0; i < sources.size(); i++)
+	{
+		moduleApis = (std::vector<ApiInfo *> *)sources[i];
+
+		for (size_t j = 0; j < moduleApis->size(); j++)
+		{
+			apiList.push_back((*moduleApis)[j]);
+			setMinMaxApiAddress((*moduleApis)[j]->va);
+		}
+	}
+
+	apiListSources.swap(sources);
+
+	buildApiIndex();
+}
+
+ULONGLONG ApiReader::getModuleStamp(ModuleInfo * module)
+{
+	PIMAGE_DOS_HEADER pDosHeader = 0;
+	PIMAGE_NT_HEADERS pNtHeader = 0;
+	BYTE *bufferHeader = getHeaderFromProcess(module);
+	ULONGLONG stamp = 0;
+
+	if (!bufferHeader)
+	{
+		return 0;
+	}
+
+	pDosHeader = (PIMAGE_DOS_HEADER)bufferHeader;
+
+	if (module->modBaseSize >= PE_HEADER_BYTES_COUNT && pDosHeader->e_magic == IMAGE_DOS_SIGNATURE && pDosHeader->e_lfanew > 0 && (DWORD)pDosHeader->e_lfanew + sizeof(IMAGE_NT_HEADERS) <= PE_HEADER_BYTES_COUNT)
+	{
+		pNtHeader = (PIMAGE_NT_HEADERS)(bufferHeader + pDosHeader->e_lfanew);
+
+		if (pNtHeader->Signature == IMAGE_NT_SIGNATURE)
+		{
+			stamp = ((ULONGLONG)pNtHeader->FileHeader.TimeDateStamp << 32) | pNtHeader->OptionalHeader.CheckSum;
+		}
+	}
+
+	delete[] bufferHeader;
+
+	return stamp;
+}
+
+bool ApiReader::storeModuleApis(ModuleInfo * module, ULONGLONG stamp, std::vector<ApiInfo *> *moduleApis)
+{
+	std::vector<uintptr_t> targets;
+	DWORD_PTR va = 0;
+
+	//a module has to be read again if a module its forwarders resolved into changes
+	for (size_t i = 0; i < module->apiList.size(); i++)
+	{
+		if (!module->apiList[i]->isForwarded)
+		{
+			continue;
+		}
+
+		va = module->apiList[i]->va;
+
+		for (size_t j = 0; j < moduleList.size(); j++)
+		{
+			if (va >= moduleList[j].modBaseAddr && va < moduleList[j].modBaseAddr + moduleList[j].modBaseSize)
+			{
+				if (std::find(targets.begin(), targets.end(), moduleList[j].modBaseAddr) == targets.end())
+				{
+					targets.push_back(moduleList[j].modBaseAddr);
+				}
+				break;
+			}
+		}
+	}
+
+	//and if a module its other forwarders named is loaded
+	std::vector<const char *> unresolved;
+
+	for (size_t i = 0; i < unresolvedForwards.size(); i++)
+	{
+		unresolved.push_back(unresolvedForwards[i].c_str());
+	}
+
+	return ExportCacheStore(exportCache, module->modBaseAddr, module->modBaseSize, stamp, moduleApis, targets.empty() ? 0 : &targets[0], targets.size(), unresolved.empty() ? 0 : &unresolved[0], unresolved.size()) != 0;
+}
+
 void ApiReader::parseModule(ModuleInfo *module)
 {
 	module->parsing = true;
@@ -181,6 +351,10 @@ void ApiReader::handleForwardedApi(DWORD_PTR vaStringPointer,char * functionName
 		{
 			addApi(functionNameParent,0, ordinalParent, (DWORD_PTR)address, (DWORD_PTR)address - (DWORD_PTR)hModTemp, true, moduleParent);
 		}
+		else
+		{
+			addUnresolvedForward(dllName);
+		}
 
 		return;
 	}
@@ -230,13 +404,31 @@ void ApiReader::handleForwardedApi(DWORD_PTR vaStringPointer,char * functionName
 #ifdef DEBUG_COMMENTS
 			DebugOutput("handleForwardedApi: Api not found, this is really BAD! %s",fordwardedString);
 #endif
+			addUnresolvedForward(dllName);
 		}
 		else
 		{
 			addApi(functionNameParent,0, ordinalParent, vaApi, rvaApi, true, moduleParent);
 		}
 	}
+	else
+	{
+		addUnresolvedForward(dllName);
+	}
+
+}
+
+void ApiReader::addUnresolvedForward(const CHAR *dllName)
+{
+	for (size_t i = 0; i < unresolvedForwards.size(); i++)
+	{
+		if (!_stricmp(unresolvedForwards[i].c_str(), dllName))
+		{
+			return;
+		}
+	}
 
+	unresolvedForwards.push_back(dllName);
 }
 
 ModuleInfo * ApiReader::findModuleByName(CHAR *name)
@@ -279,8 +471,6 @@ void ApiReader::addApi(char *functionName, WORD hint, WORD ordinal, DWORD_PTR va
 	setMinMaxApiAddress(va);
 
 	moduleInfo->apiList.push_back(apiInfo);
-
-	apiList.insert(API_Pair(va, apiInfo));
 }
 
 BYTE * ApiReader::getHeaderFromProcess(ModuleInfo * module)
@@ -681,216 +871,85 @@ void ApiReader::setModulePriority(ModuleInfo * module)
 	}
 }
 
-bool ApiReader::isApiAddressValid(DWORD_PTR virtualAddress)
+void ApiReader::buildApiIndex()
 {
-	return apiList.count(virtualAddress) > 0;
-}
-
-ApiInfo * ApiReader::getApiByVirtualAddress(DWORD_PTR virtualAddress, bool * isSuspect)
-{
-	stdext::hash_multimap<DWORD_PTR, ApiInfo *>::iterator it1, it2;
-	size_t c = 0;
-	size_t countDuplicates = apiList.count(virtualAddress);
-	int countHighPriority = 0;
-	ApiInfo *apiFound = 0;
-
-
-	if (countDuplicates == 0)
-	{
-		return 0;
-	}
-	else if (countDuplicates == 1)
+	if (apiIndex)
 	{
-		//API is 100% correct
-		*isSuspect = false;
-		it1 = apiList.find(virtualAddress); // Find first match.
-		return (ApiInfo *)((*it1).second);
+		return;
 	}
-	else
-	{
-		it1 = apiList.find(virtualAddress); // Find first match.
-
-		//any high priority with a name
-		apiFound = getScoredApi(it1,countDuplicates,true,false,false,true,false,false,false,false);
-
-		if (apiFound)
-			return apiFound;
-
-		*isSuspect = true;
 
-		//high priority with a name and ansi/unicode name
-		apiFound = getScoredApi(it1,countDuplicates,true,true,false,true,false,false,false,false);
+	std::vector<APICANDIDATE> candidates(apiList.size());
 
-		if (apiFound)
-			return apiFound;
-
-		//priority 2 with no underline in name
-		apiFound = getScoredApi(it1,countDuplicates,true,false,true,false,false,false,true,false);
-
-		if (apiFound)
-			return apiFound;
-
-		//priority 1 with a name
-		apiFound = getScoredApi(it1,countDuplicates,true,false,false,false,false,true,false,false);
-
-		if (apiFound)
-			return apiFound;
-
-		//With a name
-		apiFound = getScoredApi(it1,countDuplicates,true,false,false,false,false,false,false,false);
-
-		if (apiFound)
-			return apiFound;
-
-		//any with priority, name, ansi/unicode
-		apiFound = getScoredApi(it1,countDuplicates,true,true,false,true,false,false,false,true);
-
-		if (apiFound)
-			return apiFound;
-
-		//any with priority
-		apiFound = getScoredApi(it1,countDuplicates,false,false,false,true,false,false,false,true);
-
-		if (apiFound)
-			return apiFound;
+	for (size_t i = 0; i < apiList.size(); i++)
+	{
+		candidates[i].Address = apiList[i]->va;
+		candidates[i].Api = apiList[i];
+		candidates[i].Name = apiList[i]->name;
+		candidates[i].Priority = apiList[i]->module->priority;
+	}
 
-		//has prio 0 and name
-		apiFound = getScoredApi(it1,countDuplicates,false,false,false,false,true,false,false,true);
+	apiIndex = ApiIndexBuild(candidates.empty() ? 0 : &candidates[0], candidates.size());
 
-		if (apiFound)
-			return apiFound;
+	if (!apiIndex)
+	{
+		DebugOutput("ApiReader: Failed to build api index for %d apis", apiList.size());
 	}
-
-	//is never reached
-	DebugOutput("getApiByVirtualAddress: There is a api resolving bug, VA: " PRINTF_DWORD_PTR_FULL, virtualAddress);
-	for (size_t c = 0; c < countDuplicates; c++, it1++)
+#ifdef DEBUG_COMMENTS
+	else
 	{
-		apiFound = (ApiInfo *)((*it1).second);
-		DebugOutput("-> Possible API: %s ord: %d ", apiFound->name, apiFound->ordinal);
+		DebugOutput("ApiReader: Api index built, %d apis at %d addresses", apiList.size(), ApiIndexCount(apiIndex));
 	}
-	return (ApiInfo *) 1; 
+#endif
 }
 
-ApiInfo * ApiReader::getScoredApi(stdext::hash_multimap<DWORD_PTR, ApiInfo *>::iterator it1,size_t countDuplicates, bool hasName, bool hasUnicodeAnsiName, bool hasNoUnderlineInName, bool hasPrioDll,bool hasPrio0Dll,bool hasPrio1Dll, bool hasPrio2Dll, bool firstWin )
+bool ApiReader::isApiAddressValid(DWORD_PTR virtualAddress)
 {
-	ApiInfo * foundApi = 0;
-	ApiInfo * foundMatchingApi = 0;
-	int countFoundApis = 0;
-	int scoreNeeded = 0;
-	int scoreValue = 0;
-	size_t apiNameLength = 0;
-
-	if (hasUnicodeAnsiName || hasNoUnderlineInName)
-	{
-		hasName = true;
-	}
+	buildApiIndex();
 
-	if (hasName)
-		scoreNeeded++;
+	return ApiIndexCandidates(apiIndex, virtualAddress, 0) > 0;
+}
 
-	if (hasUnicodeAnsiName)
-		scoreNeeded++;
+PAPIINDEX ApiReader::getApiIndex()
+{
+	buildApiIndex();
 
-	if (hasNoUnderlineInName)
-		scoreNeeded++;
+	return apiIndex;
+}
 
-	if (hasPrioDll)
-		scoreNeeded++;
+ApiInfo * ApiReader::getApiByVirtualAddress(DWORD_PTR virtualAddress, bool * isSuspect)
+{
+	void * const *candidates = 0;
+	size_t countDuplicates = 0;
+	int suspect = *isSuspect;
+	ApiInfo *apiFound = 0;
 
-	if (hasPrio0Dll)
-		scoreNeeded++;
+	buildApiIndex();
 
-	if (hasPrio1Dll)
-		scoreNeeded++;
+	//the pick among duplicates is made once, when the index is built
+	apiFound = (ApiInfo *)ApiIndexLookup(apiIndex, virtualAddress, &suspect);
 
-	if (hasPrio2Dll)
-		scoreNeeded++;
+	*isSuspect = suspect != 0;
 
-	for (size_t c = 0; c < countDuplicates; c++, it1++)
+	if (apiFound)
 	{
-		foundApi = (ApiInfo *)((*it1).second);
-		scoreValue = 0;
-
-		if (hasName)
-		{
-			if (foundApi->name[0] != 0x00)
-			{
-				scoreValue++;
-
-				if (hasUnicodeAnsiName)
-				{
-					apiNameLength = strlen(foundApi->name);
-
-					if ((foundApi->name[apiNameLength - 1] == 'W') || (foundApi->name[apiNameLength - 1] == 'A'))
-					{
-						scoreValue++;
-					}
-				}
-
-				if (hasNoUnderlineInName)
-				{
-					if (!strrchr(foundApi->name, '_'))
-					{
-						scoreValue++;
-					}
-				}
-			}
-		}
-
-		if (hasPrioDll)
-		{
-			if (foundApi->module->priority >= 1)
-			{
-				scoreValue++;
-			}
-		}
-
-		if (hasPrio0Dll)
-		{
-			if (foundApi->module->priority == 0)
-			{
-				scoreValue++;
-			}
-		}
-
-		if (hasPrio1Dll)
-		{
-			if (foundApi->module->priority == 1)
-			{
-				scoreValue++;
-			}
-		}
-
-		if (hasPrio2Dll)
-		{
-			if (foundApi->module->priority == 2)
-			{
-				scoreValue++;
-			}
-		}
-
-
-		if (scoreValue == scoreNeeded)
-		{
-			foundMatchingApi = foundApi;
-			countFoundApis++;
-
-			if (firstWin)
-			{
-				return foundMatchingApi;
-			}
-		}
+		return apiFound;
 	}
 
-	if (countFoundApis == 1)
+	countDuplicates = ApiIndexCandidates(apiIndex, virtualAddress, &candidates);
+
+	if (countDuplicates == 0)
 	{
-		return foundMatchingApi;
+		return 0;
 	}
-	else
+
+	//is never reached
+	DebugOutput("getApiByVirtualAddress: There is a api resolving bug, VA: " PRINTF_DWORD_PTR_FULL, virtualAddress);
+	for (size_t c = 0; c < countDuplicates; c++)
 	{
-		return (ApiInfo *)0;
+		apiFound = (ApiInfo *)candidates[c];
+		DebugOutput("-> Possible API: %s ord: %d ", apiFound->name, apiFound->ordinal);
 	}
-
+	return (ApiInfo *) 1; 
 }
 
 void ApiReader::setMinMaxApiAddress(DWORD_PTR virtualAddress)
@@ -1105,19 +1164,31 @@ bool ApiReader::addFunctionToModuleList(ApiInfo * apiFound, DWORD_PTR va, DWORD_
 
 void ApiReader::clearAll()
 {
-	minApiAddress = (DWORD_PTR)-1;
-	maxApiAddress = 0;
+	clearApis();
 
-	for ( stdext::hash_map<DWORD_PTR, ApiInfo *>::iterator it = apiList.begin(); it != apiList.end(); ++it )
+	if (moduleThunkList != 0)
 	{
-		delete it->second;
+		(*moduleThunkList).clear();
 	}
+}
+
+void ApiReader::clearApis()
+{
+	minApiAddress = (DWORD_PTR)-1;
+	maxApiAddress = 0;
+
 	apiList.clear();
+	apiListSources.clear();
 
-	if (moduleThunkList != 0)
+	ApiIndexFree(apiIndex);
+	apiIndex = 0;
+
+	//the apis themselves belong to exportCache
+	for (size_t i = 0; i < uncachedApis.size(); i++)
 	{
-		(*moduleThunkList).clear();
+		freeModuleApis(uncachedApis[i]);
 	}
+	uncachedApis.clear();
 }
 
 bool ApiReader::addNotFoundApiToModuleList(DWORD_PTR iatAddressVA, DWORD_PTR apiAddress)
@@ -1251,7 +1322,7 @@ bool ApiReader::isInvalidMemoryForIat( DWORD_PTR address )
 
    MEMORY_BASIC_INFORMATION memBasic = {0};
 
-   if (VirtualQueryEx(ProcessAccessHelp::hProcess, (LPCVOID)address, &memBasic, sizeof(MEMORY_BASIC_INFORMATION)))
+   if (ProcessAccessHelp::queryMemory(address, &memBasic))
    {
 	   if((memBasic.State == MEM_COMMIT) && ProcessAccessHelp::isPageAccessable(memBasic.Protect))
 	   {
@@ -2,16 +2,18 @@
 
 #include <windows.h>
 #include <map>
-#include <hash_map>
+#include <string>
 #include "ProcessAccessHelp.h"
 #include "Thunks.h"
-
-typedef std::pair<DWORD_PTR, ApiInfo *> API_Pair;
+#include "..\ApiIndex.h"
+#include "..\ExportCache.h"
 
 class ApiReader : public ProcessAccessHelp
 {
 public:
-	static stdext::hash_multimap<DWORD_PTR, ApiInfo *> apiList; //api look up table
+	static std::vector<ApiInfo *> apiList; //all apis, in the order they were read
+	static PAPIINDEX apiIndex; //api look up table, built from apiList
+	static PEXPORTCACHE exportCache; //apis of each module, kept between dumps
 
 	static std::map<DWORD_PTR, ImportModuleThunk> * moduleThunkList; //store found apis
 
@@ -24,14 +26,19 @@ public:
 	void readApisFromModuleList();
 
 	bool isApiAddressValid(DWORD_PTR virtualAddress);
+	PAPIINDEX getApiIndex();
 	ApiInfo * getApiByVirtualAddress(DWORD_PTR virtualAddress, bool * isSuspect);
 	void readAndParseIAT(DWORD_PTR addressIAT, DWORD sizeIAT, std::map<DWORD_PTR, ImportModuleThunk> &moduleListNew );
 	void addFoundApiToModuleList(DWORD_PTR iatAddress, ApiInfo * apiFound, bool isNewModule, bool isSuspect);
 	void clearAll();
+	void clearApis();
 	bool isInvalidMemoryForIat( DWORD_PTR address );
 	void parseModuleWithOwnProcess( ModuleInfo * module );
 private:
 	bool readExportTableAlwaysFromDisk;
+	std::vector<std::string> unresolvedForwards; //modules named by forwarders that did not resolve
+	static std::vector<void *> apiListSources; //module api lists apiList was built from
+	static std::vector<std::vector<ApiInfo *> *> uncachedApis;
 	void parseIAT(DWORD_PTR addressIAT, BYTE * iatBuffer, SIZE_T size);
 
 	void addApi(char *functionName, WORD hint, WORD ordinal, DWORD_PTR va, DWORD_PTR rva, bool isForwarded, ModuleInfo *moduleInfo);
@@ -59,6 +66,11 @@ private:
 
 	void setModulePriority(ModuleInfo * module);
 	void setMinMaxApiAddress(DWORD_PTR virtualAddress);
+	void buildApiIndex();
+	void buildApiList(std::vector<void *> &sources);
+	ULONGLONG getModuleStamp(ModuleInfo * module);
+	bool storeModuleApis(ModuleInfo * module, ULONGLONG stamp, std::vector<ApiInfo *> *moduleApis);
+	void addUnresolvedForward(const CHAR *dllName);
 	
 	void parseModuleWithMapping(ModuleInfo *moduleInfo); //not used
 	
@@ -70,6 +82,4 @@ private:
 	bool isApiBlacklisted( const char * functionName );
 	bool isWinSxSModule( ModuleInfo * module );
 
-	ApiInfo * getScoredApi(stdext::hash_map<DWORD_PTR, ApiInfo *>::iterator it1,size_t countDuplicates, bool hasName, bool hasUnicodeAnsiName, bool hasNoUnderlineInName, bool hasPrioDll,bool hasPrio0Dll,bool hasPrio1Dll, bool hasPrio2Dll, bool firstWin );
-
 };
@@ -1,11 +1,16 @@
 #include "IATReferenceScan.h"
 #include "Architecture.h"
-#include <set>
+#include <algorithm>
 
 //#define DEBUG_COMMENTS
 
 extern "C" void DebugOutput(_In_ LPCTSTR lpOutputString, ...);
 extern "C" void ErrorOutput(_In_ LPCTSTR lpOutputString, ...);
+extern "C" void hook_disable();
+
+//the decoding threads of scanMemoryPage, kept from being hooked, suspended or terminated like the yara scan threads
+#define CODESCAN_THREADS_MAX 16
+static volatile LONG codeScanThreadIds[CODESCAN_THREADS_MAX];
 
 //FileLog IATReferenceScan::directImportLog("Scylla_direct_imports.log");
 
@@ -16,30 +21,40 @@ int IATReferenceScan::numberOfFoundDirectImports()
 
 int IATReferenceScan::numberOfFoundUniqueDirectImports()
 {
-	std::set<DWORD_PTR> apiPointers;
-	for (std::vector<IATReference>::iterator iter = iatDirectImportList.begin(); iter != iatDirectImportList.end(); iter++)
-	{
-		IATReference * ref = &(*iter);
-		apiPointers.insert(ref->targetAddressInIat);
-	}
-
-	return (int)apiPointers.size();
+	return uniqueDirectImports;
 }
 
 int IATReferenceScan::numberOfDirectImportApisNotInIat()
 {
-	std::set<DWORD_PTR> apiPointers;
+	return directImportApisNotInIat;
+}
+
+//count the apis of the direct imports, and those without an iat entry, in one pass
+void IATReferenceScan::countDirectImports()
+{
+	PTRMAP apiPointers;
+
+	PtrMapInit(&apiPointers);
+	uniqueDirectImports = 0;
+	directImportApisNotInIat = 0;
+
 	for (std::vector<IATReference>::iterator iter = iatDirectImportList.begin(); iter != iatDirectImportList.end(); iter++)
 	{
 		IATReference * ref = &(*iter);
 
-		if (ref->targetPointer == 0)
+		//every reference to an api has the same iat entry
+		if (!PtrMapGet(&apiPointers, ref->targetAddressInIat) && PtrMapSet(&apiPointers, ref->targetAddressInIat, ref))
 		{
-			apiPointers.insert(ref->targetAddressInIat);
+			uniqueDirectImports++;
+
+			if (ref->targetPointer == 0)
+			{
+				directImportApisNotInIat++;
+			}
 		}
 	}
 
-	return (int)apiPointers.size();
+	PtrMapFree(&apiPointers);
 }
 
 int IATReferenceScan::getSizeInBytesOfJumpTableInSection()
@@ -56,6 +71,14 @@ void IATReferenceScan::startScan(DWORD_PTR imageBase, DWORD imageSize, DWORD_PTR
 	ImageBase = imageBase;
 	ImageSize = imageSize;
 
+	//the iat is read again for each scan
+	if (iatBackup)
+	{
+		free(iatBackup);
+		iatBackup = 0;
+	}
+	PtrMapFree(&iatPointers);
+
 	if (ScanForNormalImports)
 	{
 		iatReferenceList.clear();
@@ -71,7 +94,7 @@ void IATReferenceScan::startScan(DWORD_PTR imageBase, DWORD imageSize, DWORD_PTR
 
 	do
 	{
-		if (!VirtualQueryEx(ProcessAccessHelp::hProcess, (LPCVOID)section, &memBasic, sizeof(MEMORY_BASIC_INFORMATION)))
+		if (!ProcessAccessHelp::queryMemory(section, &memBasic))
 		{
 #ifdef DEBUG_COMMENTS
 			DebugOutput("VirtualQueryEx failed %d", GetLastError());
@@ -92,6 +115,10 @@ void IATReferenceScan::startScan(DWORD_PTR imageBase, DWORD imageSize, DWORD_PTR
 
 	} while (section < (imageBase + imageSize));
 
+	if (ScanForDirectImports)
+	{
+		countDirectImports();
+	}
 
 }
 
@@ -124,62 +151,129 @@ void IATReferenceScan::patchDirectImportsMemory( bool junkByteAfterInstruction )
 	}
 }
 
+static void codeScanThreadStart( void * context )
+{
+	LONG threadId = (LONG)GetCurrentThreadId();
+
+	hook_disable();
+
+	for (int i = 0; i < CODESCAN_THREADS_MAX; i++)
+	{
+		if (!InterlockedCompareExchange(&codeScanThreadIds[i], threadId, 0))
+			return;
+	}
+}
+
+static void codeScanThreadEnd( void * context )
+{
+	LONG threadId = (LONG)GetCurrentThreadId();
+
+	for (int i = 0; i < CODESCAN_THREADS_MAX; i++)
+	{
+		if (InterlockedCompareExchange(&codeScanThreadIds[i], 0, threadId) == threadId)
+			return;
+	}
+}
+
+extern "C" BOOL IsCodeScanThread(DWORD ThreadId)
+{
+	for (int i = 0; i < CODESCAN_THREADS_MAX; i++)
+	{
+		if ((DWORD)codeScanThreadIds[i] == ThreadId)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
 void IATReferenceScan::scanMemoryPage( PVOID BaseAddress, SIZE_T RegionSize )
 {
 	BYTE * dataBuffer = (BYTE *)calloc(RegionSize, 1);
-	BYTE * currentPos = dataBuffer;
-	int currentSize = (int)RegionSize;
-	DWORD_PTR currentOffset = (DWORD_PTR)BaseAddress;
-	_DecodeResult res;
-	unsigned int instructionsCount = 0, next = 0;
+	CODESCANCONFIG config = {};
+	_DInst * instructions = 0;
+	size_t instructionsCount = 0;
 
 	if (!dataBuffer)
 		return;
 
 	if (ProcessAccessHelp::readMemoryFromProcess((DWORD_PTR)BaseAddress, RegionSize, (LPVOID)dataBuffer))
 	{
-		while (1)
+		//decode in parallel chunks, keeping only what analyzeInstruction could take as a reference
+		config.DecodeType = ProcessAccessHelp::dt;
+		config.Filter = isReferenceCandidate;
+		config.ThreadStart = codeScanThreadStart;
+		config.ThreadEnd = codeScanThreadEnd;
+		config.Context = this;
+
+		if (CodeScanDecompose(&config, dataBuffer, RegionSize, (uintptr_t)BaseAddress, &instructions, &instructionsCount))
 		{
-			ZeroMemory(&ProcessAccessHelp::decomposerCi, sizeof(_CodeInfo));
-			ProcessAccessHelp::decomposerCi.code = currentPos;
-			ProcessAccessHelp::decomposerCi.codeLen = currentSize;
-			ProcessAccessHelp::decomposerCi.dt = ProcessAccessHelp::dt;
-			ProcessAccessHelp::decomposerCi.codeOffset = currentOffset;
-
-			instructionsCount = 0;
-
-			res = distorm_decompose(&ProcessAccessHelp::decomposerCi, ProcessAccessHelp::decomposerResult, sizeof(ProcessAccessHelp::decomposerResult)/sizeof(ProcessAccessHelp::decomposerResult[0]), &instructionsCount);
-
-			if (res == DECRES_INPUTERR)
+			for (size_t i = 0; i < instructionsCount; i++)
 			{
-				break;
+				analyzeInstruction(&instructions[i]);
 			}
+		}
+		else
+		{
+			DebugOutput("IATReferenceScan::scanMemoryPage: Failed to decode region at " PRINTF_DWORD_PTR_FULL, (DWORD_PTR)BaseAddress);
+		}
 
-			for (unsigned int i = 0; i < instructionsCount; i++) 
-			{
-				if (ProcessAccessHelp::decomposerResult[i].flags != FLAG_NOT_DECODABLE)
-				{
-					analyzeInstruction(&ProcessAccessHelp::decomposerResult[i]);
-				}
-			}
+		CodeScanFree(instructions);
+	}
 
-			if (res == DECRES_SUCCESS) break; // All instructions were decoded.
-			else if (instructionsCount == 0) break;
+	free(dataBuffer);
+}
 
-			next = (unsigned long)(ProcessAccessHelp::decomposerResult[instructionsCount-1].addr - ProcessAccessHelp::decomposerResult[0].addr);
+bool IATReferenceScan::isPossibleDirectTarget( DWORD_PTR address ) const
+{
+	//the range checks of checkMemoryRangeAndAddToList
+	return address > 0x000FFFFF && address != (DWORD_PTR)-1 && ((address < ImageBase) || (address > (ImageBase+ImageSize)));
+}
 
-			if (ProcessAccessHelp::decomposerResult[instructionsCount-1].flags != FLAG_NOT_DECODABLE)
-			{
-				next += ProcessAccessHelp::decomposerResult[instructionsCount-1].size;
-			}
+bool IATReferenceScan::isPossibleReference( const _DInst * instruction ) const
+{
+	bool isBranch = (META_GET_FC(instruction->meta) == FC_CALL || META_GET_FC(instruction->meta) == FC_UNC_BRANCH);
 
-			currentPos += next;
-			currentOffset += next;
-			currentSize -= next;
+	if (ScanForNormalImports && isBranch && instruction->size >= 5)
+	{
+#ifdef _WIN64
+		if ((instruction->flags & FLAG_RIP_RELATIVE) && INSTRUCTION_GET_RIP_TARGET(instruction) >= IatAddressVA && INSTRUCTION_GET_RIP_TARGET(instruction) < (IatAddressVA + IatSize))
+#else
+		if (instruction->ops[0].type == O_DISP && instruction->disp >= IatAddressVA && instruction->disp < (IatAddressVA + IatSize))
+#endif
+		{
+			return true;
 		}
 	}
 
-	free(dataBuffer);
+	if (ScanForDirectImports)
+	{
+#ifdef _WIN64
+		if (instruction->opcode == I_MOV && instruction->size >= 7 && instruction->ops[0].type == O_REG && instruction->ops[1].type == O_IMM)
+#else
+		if (instruction->opcode == I_MOV && instruction->size >= 5 && instruction->ops[0].type == O_REG && instruction->ops[1].type == O_IMM)
+#endif
+		{
+			if (isPossibleDirectTarget((DWORD_PTR)instruction->imm.qword))
+				return true;
+		}
+
+#ifndef _WIN64
+		if (isBranch && instruction->size >= 5 && instruction->ops[0].type == O_PC && isPossibleDirectTarget((DWORD_PTR)INSTRUCTION_GET_TARGET(instruction)))
+			return true;
+		if (instruction->size >= 5 && instruction->opcode == I_PUSH && isPossibleDirectTarget((DWORD_PTR)instruction->imm.qword))
+			return true;
+		if (instruction->size >= 5 && instruction->opcode == I_LEA && instruction->ops[0].type == O_REG && instruction->ops[1].type == O_DISP && isPossibleDirectTarget((DWORD_PTR)instruction->disp))
+			return true;
+#endif
+	}
+
+	return false;
+}
+
+int IATReferenceScan::isReferenceCandidate( const _DInst * instruction, void * context )
+{
+	//called from the decoding threads, so only reads the scan settings
+	return ((const IATReferenceScan *)context)->isPossibleReference(instruction) ? 1 : 0;
 }
 
 void IATReferenceScan::analyzeInstruction( _DInst * instruction )
@@ -283,7 +377,7 @@ bool IATReferenceScan::isAddressValidImageMemory( DWORD_PTR address )
 {
 	MEMORY_BASIC_INFORMATION memBasic = {0};
 
-	if (!VirtualQueryEx(ProcessAccessHelp::hProcess, (LPCVOID)address, &memBasic, sizeof(MEMORY_BASIC_INFORMATION)))
+	if (!ProcessAccessHelp::queryMemory(address, &memBasic))
 	{
 		return false;
 	}
@@ -358,17 +452,18 @@ DWORD_PTR IATReferenceScan::lookUpIatForPointer( DWORD_PTR addr )
 			iatBackup = 0;
 			return 0;
 		}
-	}
 
-	for (int i = 0; i < ((int)IatSize / (int)sizeof(DWORD_PTR));i++)
-	{
-		if (iatBackup[i] == addr)
+		//index the iat once, keeping the first entry for apis that appear more than once
+		for (int i = 0; i < ((int)IatSize / (int)sizeof(DWORD_PTR));i++)
 		{
-			return (DWORD_PTR)&iatBackup[i] - (DWORD_PTR)iatBackup + IatAddressVA;
+			if (iatBackup[i] && !PtrMapGet(&iatPointers, iatBackup[i]))
+			{
+				PtrMapSet(&iatPointers, iatBackup[i], (void *)(IatAddressVA + i * sizeof(DWORD_PTR)));
+			}
 		}
 	}
 
-	return 0;
+	return (DWORD_PTR)PtrMapGet(&iatPointers, addr);
 }
 
 void IATReferenceScan::patchNewIat(DWORD_PTR stdImagebase, DWORD_PTR newIatBaseAddress, PeParser * peParser)
@@ -558,81 +653,85 @@ void IATReferenceScan::checkMemoryRangeAndAddToList( IATReference * ref, _DInst
 	}
 }
 
-void IATReferenceScan::patchDirectJumpTableEntry(DWORD_PTR targetIatPointer, DWORD_PTR stdImagebase, DWORD directImportsJumpTableRVA, PeParser * peParser, BYTE * jmpTableMemory, DWORD newIatBase )
+void IATReferenceScan::patchDirectJumpTableEntry(IATReference * ref, DWORD_PTR stdImagebase, DWORD directImportsJumpTableRVA, PeParser * peParser)
 {
 	DWORD patchBytes = 0;
-	for (std::vector<IATReference>::iterator iter = iatDirectImportList.begin(); iter != iatDirectImportList.end(); iter++)
-	{
-		IATReference * ref = &(*iter);
 
-		//only one jmp in table for different direct imports with same iat address
-		if (ref->targetPointer == targetIatPointer)
-		{
-			//patch dump
-			DWORD patchOffset = (DWORD)peParser->convertRVAToOffsetRelative(ref->addressVA - ImageBase);
-			int index = peParser->convertRVAToOffsetVectorIndex(ref->addressVA - ImageBase);
-			BYTE * memory = peParser->getSectionMemoryByIndex(index);
-			DWORD memorySize = peParser->getSectionMemorySizeByIndex(index);
-			DWORD sectionRVA = peParser->getSectionAddressRVAByIndex(index);
+	//patch dump
+	DWORD patchOffset = (DWORD)peParser->convertRVAToOffsetRelative(ref->addressVA - ImageBase);
+	int index = peParser->convertRVAToOffsetVectorIndex(ref->addressVA - ImageBase);
+	BYTE * memory = peParser->getSectionMemoryByIndex(index);
+	DWORD memorySize = peParser->getSectionMemorySizeByIndex(index);
+	DWORD sectionRVA = peParser->getSectionAddressRVAByIndex(index);
 
-			if (ref->type == IAT_REFERENCE_DIRECT_CALL || ref->type == IAT_REFERENCE_DIRECT_JMP)
-			{
+	if (ref->type == IAT_REFERENCE_DIRECT_CALL || ref->type == IAT_REFERENCE_DIRECT_JMP)
+	{
 #ifndef _WIN64
-				if (ref->instructionSize == 5)
-				{
-					patchBytes = directImportsJumpTableRVA - (ref->addressVA - ImageBase) - 5;
-					patchDirectImportInDump32(1, 5, patchBytes, memory, memorySize, false, patchOffset, sectionRVA);
-				}
+		if (ref->instructionSize == 5)
+		{
+			patchBytes = directImportsJumpTableRVA - (ref->addressVA - ImageBase) - 5;
+			patchDirectImportInDump32(1, 5, patchBytes, memory, memorySize, false, patchOffset, sectionRVA);
+		}
 #endif
-			}
-			else if (ref->type == IAT_REFERENCE_DIRECT_PUSH || ref->type == IAT_REFERENCE_DIRECT_MOV)
-			{
+	}
+	else if (ref->type == IAT_REFERENCE_DIRECT_PUSH || ref->type == IAT_REFERENCE_DIRECT_MOV)
+	{
 #ifndef _WIN64
-				if (ref->instructionSize == 5) //for x86
-				{
-					patchBytes = directImportsJumpTableRVA + stdImagebase;
-					patchDirectImportInDump32(1, 5, patchBytes, memory, memorySize, true, patchOffset, sectionRVA);				
-				}
+		if (ref->instructionSize == 5) //for x86
+		{
+			patchBytes = directImportsJumpTableRVA + stdImagebase;
+			patchDirectImportInDump32(1, 5, patchBytes, memory, memorySize, true, patchOffset, sectionRVA);				
+		}
 #else
-				if (ref->instructionSize == 10) //for x64
-				{
-					DWORD_PTR patchBytes64 = directImportsJumpTableRVA + stdImagebase;
-					patchDirectImportInDump64(2, 10, patchBytes64, memory, memorySize, true, patchOffset, sectionRVA);
-				}
+		if (ref->instructionSize == 10) //for x64
+		{
+			DWORD_PTR patchBytes64 = directImportsJumpTableRVA + stdImagebase;
+			patchDirectImportInDump64(2, 10, patchBytes64, memory, memorySize, true, patchOffset, sectionRVA);
+		}
 #endif
-			}
-			else if (ref->type == IAT_REFERENCE_DIRECT_LEA)
-			{
+	}
+	else if (ref->type == IAT_REFERENCE_DIRECT_LEA)
+	{
 #ifndef _WIN64
-				if (ref->instructionSize == 6)
-				{
-					patchBytes = directImportsJumpTableRVA + stdImagebase;
-					patchDirectImportInDump32(2, 6, patchBytes, memory, memorySize, true, patchOffset, sectionRVA);
-				}
-#endif
-			}
+		if (ref->instructionSize == 6)
+		{
+			patchBytes = directImportsJumpTableRVA + stdImagebase;
+			patchDirectImportInDump32(2, 6, patchBytes, memory, memorySize, true, patchOffset, sectionRVA);
 		}
+#endif
 	}
 }
 
-void IATReferenceScan::patchDirectJumpTable( DWORD_PTR stdImagebase, DWORD directImportsJumpTableRVA, PeParser * peParser, BYTE * jmpTableMemory, DWORD newIatBase )
+static bool compareTargetPointer(const IATReference * a, const IATReference * b)
+{
+	return a->targetPointer < b->targetPointer;
+}
+
+static bool compareTargetAddressInIat(const IATReference * a, const IATReference * b)
 {
+	return a->targetAddressInIat < b->targetAddressInIat;
+}
 
-	std::set<DWORD_PTR> apiPointers;
+void IATReferenceScan::patchDirectJumpTable( DWORD_PTR stdImagebase, DWORD directImportsJumpTableRVA, PeParser * peParser, BYTE * jmpTableMemory, DWORD newIatBase )
+{
+	//group the references by iat address, only one jmp in table for different direct imports with same iat address
+	std::vector<IATReference *> references;
+	references.reserve(iatDirectImportList.size());
 	for (std::vector<IATReference>::iterator iter = iatDirectImportList.begin(); iter != iatDirectImportList.end(); iter++)
 	{
-		IATReference * ref = &(*iter);
-		apiPointers.insert(ref->targetPointer);
+		references.push_back(&(*iter));
 	}
+	std::stable_sort(references.begin(), references.end(), compareTargetPointer);
 
 	DWORD patchBytes;
 
-	for (std::set<DWORD_PTR>::iterator apiIter = apiPointers.begin(); apiIter != apiPointers.end(); apiIter++)
+	for (size_t i = 0; i < references.size(); )
 	{
-		DWORD_PTR refTargetPointer = *apiIter;
+		DWORD_PTR targetIatPointer = references[i]->targetPointer;
+		DWORD_PTR refTargetPointer = targetIatPointer;
 		if (newIatBase) //create new iat in section
 		{
-			refTargetPointer = (*apiIter - IatAddressVA) + newIatBase + ImageBase;
+			refTargetPointer = (targetIatPointer - IatAddressVA) + newIatBase + ImageBase;
 		}
 		//create jump table in section
 		DWORD_PTR newIatAddressPointer = refTargetPointer - ImageBase + stdImagebase;
@@ -648,7 +747,10 @@ void IATReferenceScan::patchDirectJumpTable( DWORD_PTR stdImagebase, DWORD direc
 		jmpTableMemory[1] = 0x25;
 		*((DWORD *)&jmpTableMemory[2]) = patchBytes;
 
-		patchDirectJumpTableEntry(*apiIter, stdImagebase, directImportsJumpTableRVA, peParser, jmpTableMemory, newIatBase);
+		for (; i < references.size() && references[i]->targetPointer == targetIatPointer; i++)
+		{
+			patchDirectJumpTableEntry(references[i], stdImagebase, directImportsJumpTableRVA, peParser);
+		}
 
 		jmpTableMemory += 6;
 		directImportsJumpTableRVA += 6;
@@ -695,39 +797,41 @@ void IATReferenceScan::patchDirectImportInDump64( int patchPreFixBytes, int inst
 
 DWORD IATReferenceScan::addAdditionalApisToList()
 {
-	std::set<DWORD_PTR> apiPointers;
-
+	//group the references to apis outside the iat by api
+	std::vector<IATReference *> references;
 	for (std::vector<IATReference>::iterator iter = iatDirectImportList.begin(); iter != iatDirectImportList.end(); iter++)
 	{
 		IATReference * ref = &(*iter);
 
 		if (ref->targetPointer == 0)
 		{
-			apiPointers.insert(ref->targetAddressInIat);
+			references.push_back(ref);
 		}
 	}
+	std::stable_sort(references.begin(), references.end(), compareTargetAddressInIat);
 
 	DWORD_PTR iatAddy = IatAddressVA + IatSize;
 	DWORD newIatSize = IatSize;
 
 	bool isSuspect = false;
-	for (std::set<DWORD_PTR>::iterator apiIter = apiPointers.begin(); apiIter != apiPointers.end(); apiIter++)
+	for (size_t i = 0; i < references.size(); )
 	{
-		for (std::vector<IATReference>::iterator iter = iatDirectImportList.begin(); iter != iatDirectImportList.end(); iter++)
+		DWORD_PTR apiAddress = references[i]->targetAddressInIat;
+
+		for (; i < references.size() && references[i]->targetAddressInIat == apiAddress; i++)
 		{
-			IATReference * ref = &(*iter);
+			IATReference * ref = references[i];
 
-			if (ref->targetPointer == 0  && ref->targetAddressInIat == *apiIter)
-			{
-				ref->targetPointer = iatAddy;
-				ApiInfo * apiInfo = apiReader->getApiByVirtualAddress(ref->targetAddressInIat, &isSuspect);
-				apiReader->addFoundApiToModuleList(iatAddy, apiInfo, true, isSuspect);
-			}
+			ref->targetPointer = iatAddy;
+			ApiInfo * apiInfo = apiReader->getApiByVirtualAddress(ref->targetAddressInIat, &isSuspect);
+			apiReader->addFoundApiToModuleList(iatAddy, apiInfo, true, isSuspect);
 		}
 
 		iatAddy += sizeof(DWORD_PTR);
 		newIatSize += sizeof(DWORD_PTR);
 	}
 
+	countDirectImports();
+
 	return newIatSize;
 }
@@ -3,6 +3,8 @@
 #include "ProcessAccessHelp.h"
 #include "PeParser.h"
 #include "ApiReader.h"
+#include "..\PtrMap.h"
+#include "..\CodeScan.h"
 
 enum IATReferenceType {
 	IAT_REFERENCE_PTR_JMP,
@@ -37,6 +39,9 @@ public:
 		ImageBase = 0;
 		ImageSize = 0;
 		iatBackup = 0;
+		uniqueDirectImports = 0;
+		directImportApisNotInIat = 0;
+		PtrMapInit(&iatPointers);
 		ScanForDirectImports = false;
 		ScanForNormalImports = true;
 	}
@@ -50,6 +55,8 @@ public:
 		{
 			free(iatBackup);
 		}
+
+		PtrMapFree(&iatPointers);
 	}
 
 	bool ScanForDirectImports;
@@ -82,11 +89,18 @@ private:
 
 
 	DWORD_PTR * iatBackup;
+	PTRMAP iatPointers; //api address -> first iat entry holding it
+
+	int uniqueDirectImports;
+	int directImportApisNotInIat;
 
 	std::vector<IATReference> iatReferenceList;
 	std::vector<IATReference> iatDirectImportList;
 
 	void scanMemoryPage( PVOID BaseAddress, SIZE_T RegionSize );
+	bool isPossibleDirectTarget( DWORD_PTR address ) const;
+	bool isPossibleReference( const _DInst * instruction ) const;
+	static int isReferenceCandidate( const _DInst * instruction, void * context );
 	void analyzeInstruction( _DInst * instruction );
 	void findNormalIatReference( _DInst * instruction );
 	void getIatEntryAddress( IATReference* ref );
@@ -96,13 +110,14 @@ private:
 	void patchReferenceInFile( IATReference* ref );
 	void patchDirectImportInMemory( IATReference * iter );
 	DWORD_PTR lookUpIatForPointer( DWORD_PTR addr );
+	void countDirectImports();
 	void findDirectIatReferenceMov( _DInst * instruction );
 	void findDirectIatReferencePush( _DInst * instruction );
 	void checkMemoryRangeAndAddToList( IATReference * ref, _DInst * instruction );
 	void findDirectIatReferenceLea( _DInst * instruction );
 	void patchDirectImportInDump32( int patchPreFixBytes, int instructionSize, DWORD patchBytes, BYTE * memory, DWORD memorySize, bool generateReloc, DWORD patchOffset, DWORD sectionRVA );
 	void patchDirectImportInDump64( int patchPreFixBytes, int instructionSize, DWORD_PTR patchBytes, BYTE * memory, DWORD memorySize, bool generateReloc, DWORD patchOffset, DWORD sectionRVA );
-	void patchDirectJumpTableEntry(DWORD_PTR targetIatPointer, DWORD_PTR stdImagebase, DWORD directImportsJumpTableRVA, PeParser * peParser, BYTE * jmpTableMemory, DWORD newIatBase );
+	void patchDirectJumpTableEntry(IATReference * ref, DWORD_PTR stdImagebase, DWORD directImportsJumpTableRVA, PeParser * peParser);
 
 
 };
@@ -37,65 +37,50 @@ bool IATSearch::findIATAdvanced( DWORD_PTR startAddress, DWORD_PTR* addressIAT,
 {
 	BYTE *dataBuffer;
 	DWORD_PTR baseAddress;
-	SIZE_T memorySize;
+	SIZE_T imageSize;
+	IATSCAN scan;
+	PIATBLOCK best = 0;
 
-	findExecutableMemoryPagesByStartAddress(startAddress, &baseAddress, &memorySize);
+	findImageByStartAddress(startAddress, &baseAddress, &imageSize);
 
-	if (memorySize == 0)
+	if (imageSize == 0)
 		return false;
 
-	dataBuffer = new BYTE[memorySize];
+	dataBuffer = new BYTE[imageSize];
 
-	if (!readMemoryFromProcess((DWORD_PTR)baseAddress, memorySize,dataBuffer))
+	//pages that can't be read come back as zeroes
+	if (!readMemoryPartlyFromProcess(baseAddress, imageSize, dataBuffer))
 	{
 #ifdef DEBUG_COMMENTS
-		DebugOutput("findAPIAddressInIAT2 :: error reading memory");
+		DebugOutput("findIATAdvanced :: error reading memory");
 #endif
 		delete [] dataBuffer;
 		return false;
 	}
 
-	std::set<DWORD_PTR> iatPointers;
-	DWORD_PTR next;
-	BYTE * tempBuf = dataBuffer;
-	while(decomposeMemory(tempBuf, memorySize, (DWORD_PTR)baseAddress) && decomposerInstructionsCount != 0)
+	//every pointer in the image between the lowest and highest api, checked against the api index once each
+	if (!IatScanInit(&scan, dataBuffer, imageSize, sizeof(DWORD_PTR), minApiAddress, maxApiAddress, getApiIndex(), isMappedForIat, this) || !IatScanCluster(&scan))
 	{
-		findIATPointers(iatPointers);
-
-		next = (DWORD_PTR)(decomposerResult[decomposerInstructionsCount - 1].addr - baseAddress);
-		next += decomposerResult[decomposerInstructionsCount - 1].size;
-		// Advance ptr and recalc offset.
-		tempBuf += next;
+		IatScanFree(&scan);
+		delete [] dataBuffer;
+		return false;
+	}
 
-		if (memorySize <= next)
+	//the block with the most apis is the IAT
+	for (size_t i = 0; i < scan.BlockCount; i++)
+	{
+		if (!best || scan.Blocks[i].Apis > best->Apis)
 		{
-			break;
+			best = &scan.Blocks[i];
 		}
-		memorySize -= next;
-		baseAddress += next;
 	}
 
-	if (iatPointers.size() == 0)
-		return false;
-
-	filterIATPointersList(iatPointers);
-
-	if (iatPointers.size() == 0)
-		return false;
+	*addressIAT = baseAddress + best->Offset;
+	*sizeIAT = (DWORD)best->Size;
 
-	*addressIAT = *(iatPointers.begin());
-	*sizeIAT = (DWORD)(*(--iatPointers.end()) - *(iatPointers.begin()) + sizeof(DWORD_PTR));
-
-	//some check, more than 2 million addresses?
-	if ((DWORD)(2000000*sizeof(DWORD_PTR)) < *sizeIAT)
-	{
-		*addressIAT = 0;
-		*sizeIAT = 0;
-		return false;
-	}
-
-	DebugOutput("IAT Search: Found %d possible IAT entries: first " PRINTF_DWORD_PTR_FULL " last " PRINTF_DWORD_PTR_FULL ".", iatPointers.size(), *(iatPointers.begin()), *(--iatPointers.end()));
+	DebugOutput("IAT Search: Found %d possible IAT entries in %d blocks: first " PRINTF_DWORD_PTR_FULL " last " PRINTF_DWORD_PTR_FULL ".", best->Apis, scan.BlockCount, *addressIAT, *addressIAT + *sizeIAT - sizeof(DWORD_PTR));
 
+	IatScanFree(&scan);
 	delete [] dataBuffer;
 
 	return true;
@@ -259,19 +244,19 @@ bool IATSearch::findIATStartAndSize(DWORD_PTR address, DWORD_PTR * addressIAT, D
 	BYTE *dataBuffer = 0;
 	DWORD_PTR baseAddress = 0;
 	DWORD baseSize = 0;
+	DWORD phase = 0;
+	IATSCAN scan;
 
 	getMemoryBaseAndSizeForIat(address, &baseAddress, &baseSize);
 
 	if (!baseAddress)
 		return false;
 
-	dataBuffer = new BYTE[baseSize * (sizeof(DWORD_PTR)*3)];
+	dataBuffer = new BYTE[baseSize];
 
 	if (!dataBuffer)
 		return false;
 
-	ZeroMemory(dataBuffer, baseSize * (sizeof(DWORD_PTR)*3));
-
 	if (!readMemoryFromProcess(baseAddress, baseSize, dataBuffer))
 	{
 #ifdef DEBUG_COMMENTS
@@ -281,264 +266,107 @@ bool IATSearch::findIATStartAndSize(DWORD_PTR address, DWORD_PTR * addressIAT, D
 		return false;
 	}
 
-	//printf("address %X memBasic.BaseAddress %X memBasic.RegionSize %X\n",address,memBasic.BaseAddress,memBasic.RegionSize);
+	//pointers are read in steps from address, whatever its alignment
+	phase = (DWORD)((address - baseAddress) % sizeof(DWORD_PTR));
 
-	*addressIAT = findIATStartAddress(baseAddress, address, dataBuffer);
+	if (!IatScanInit(&scan, dataBuffer + phase, baseSize - phase, sizeof(DWORD_PTR), minApiAddress, maxApiAddress, getApiIndex(), isMappedForIat, this))
+	{
+		IatScanFree(&scan);
+		delete [] dataBuffer;
+		return false;
+	}
+
+	*addressIAT = findIATStartAddress(baseAddress + phase, address, &scan);
 
-	*sizeIAT = findIATSize(baseAddress, *addressIAT, dataBuffer, baseSize);
+	*sizeIAT = findIATSize(baseAddress + phase, *addressIAT, &scan);
 
+	IatScanFree(&scan);
 	delete [] dataBuffer;
 
 	return true;
 }
 
-DWORD_PTR IATSearch::findIATStartAddress(DWORD_PTR baseAddress, DWORD_PTR startAddress, BYTE * dataBuffer)
+DWORD_PTR IATSearch::findIATStartAddress(DWORD_PTR baseAddress, DWORD_PTR startAddress, IATSCAN * scan)
 {
-	DWORD_PTR *pIATAddress = 0;
-
-	pIATAddress = (DWORD_PTR *)((startAddress - baseAddress) + (DWORD_PTR)dataBuffer);
+	size_t start = 0;
 
-	while((DWORD_PTR)pIATAddress != (DWORD_PTR)dataBuffer)
+	//two invalid pointers with no api below them
+	if (IatScanStart(scan, startAddress - baseAddress, &start))
 	{
-		if (isInvalidMemoryForIat(*pIATAddress))
-		{
-			if ((DWORD_PTR)(pIATAddress - 1) >= (DWORD_PTR)dataBuffer)
-			{
-				if (isInvalidMemoryForIat(*(pIATAddress - 1)))
-				{
-					if ((DWORD_PTR)(pIATAddress - 2) >= (DWORD_PTR)dataBuffer)
-					{
-						if (!isApiAddressValid(*(pIATAddress - 2)))
-						{
-							return (((DWORD_PTR)pIATAddress - (DWORD_PTR)dataBuffer) + baseAddress);
-						}
-					}
-				}
-			}
-		}
-
-		pIATAddress--;
+		return baseAddress + start;
 	}
 
 	return baseAddress;
 }
 
-DWORD IATSearch::findIATSize(DWORD_PTR baseAddress, DWORD_PTR iatAddress, BYTE * dataBuffer, DWORD bufferSize)
+DWORD IATSearch::findIATSize(DWORD_PTR baseAddress, DWORD_PTR iatAddress, IATSCAN * scan)
 {
-	DWORD_PTR *pIATAddress = 0;
-
-	pIATAddress = (DWORD_PTR *)((iatAddress - baseAddress) + (DWORD_PTR)dataBuffer);
+	size_t size = 0;
 
 #ifdef DEBUG_COMMENTS
-	DebugOutput("findIATSize :: baseAddress %X iatAddress %X dataBuffer %X pIATAddress %X", baseAddress, iatAddress, dataBuffer, pIATAddress);
+	DebugOutput("findIATSize :: baseAddress %X iatAddress %X", baseAddress, iatAddress);
 #endif
 
-	while((DWORD_PTR)pIATAddress < ((DWORD_PTR)dataBuffer + bufferSize - 1))
+	//two invalid pointers with no api after them
+	if (IatScanEnd(scan, iatAddress - baseAddress, &size))
 	{
-#ifdef DEBUG_COMMENTS
-		DebugOutput("findIATSize :: %X %X %X", pIATAddress, *pIATAddress, *(pIATAddress + 1));
-#endif
-		if (isInvalidMemoryForIat(*pIATAddress)) //normal is 0
-		{
-			if (isInvalidMemoryForIat(*(pIATAddress + 1)))
-			{
-				//IAT end
-				if (!isApiAddressValid(*(pIATAddress + 2)))
-				{
-					return (DWORD)((DWORD_PTR)pIATAddress - (DWORD_PTR)dataBuffer - (iatAddress - baseAddress));
-				}
-			}
-		}
-
-		pIATAddress++;
+		return (DWORD)size;
 	}
 
-	return bufferSize;
+	return (DWORD)scan->Size;
 }
 
-void IATSearch::findIATPointers(std::set<DWORD_PTR> & iatPointers)
+int IATSearch::isMappedForIat(void * context, uint64_t address)
 {
-#ifdef DEBUG_COMMENTS
-	_DecodedInst inst;
-#endif
-	for (unsigned int i = 0; i < decomposerInstructionsCount; i++)
+	return !((IATSearch *)context)->isInvalidMemoryForIat((DWORD_PTR)address);
+}
+
+//A big section size is a common anti-debug/anti-dump trick, limit the max size to 100 000 000 bytes
+
+void adjustSizeForBigSections(DWORD * badValue)
+{
+	if (*badValue > 100000000)
 	{
-		if (decomposerResult[i].flags != FLAG_NOT_DECODABLE)
-		{
-			if (META_GET_FC(decomposerResult[i].meta) == FC_CALL || META_GET_FC(decomposerResult[i].meta) == FC_UNC_BRANCH)
-			{
-				if (decomposerResult[i].size >= 5)
-				{
-#ifdef _WIN64
-					if (decomposerResult[i].flags & FLAG_RIP_RELATIVE)
-					{
-#ifdef DEBUG_COMMENTS
-						distorm_format(&decomposerCi, &decomposerResult[i], &inst);
-						DebugOutput("%s %s %d %d - target address: " PRINTF_DWORD_PTR_FULL, inst.mnemonic.p, inst.operands.p, decomposerResult[i].ops[0].type, decomposerResult[i].size, INSTRUCTION_GET_RIP_TARGET(&decomposerResult[i]));
-#endif
-						iatPointers.insert(INSTRUCTION_GET_RIP_TARGET(&decomposerResult[i]));
-					}
-#else
-					if (decomposerResult[i].ops[0].type == O_DISP)
-					{
-						//jmp dword ptr || call dword ptr
-#ifdef DEBUG_COMMENTS
-						distorm_format(&decomposerCi, &decomposerResult[i], &inst);
-						DebugOutput("%s %s %d %d - target address: " PRINTF_DWORD_PTR_FULL, inst.mnemonic.p, inst.operands.p, decomposerResult[i].ops[0].type, decomposerResult[i].size, decomposerResult[i].disp);
-#endif
-						iatPointers.insert((DWORD_PTR)decomposerResult[i].disp);
-					}
-#endif
-				}
-			}
-		}
+		*badValue = 100000000;
 	}
+}
 
-
+bool isSectionSizeTooBig(SIZE_T sectionSize) {
+	return (sectionSize > 100000000);
 }
 
-void IATSearch::findExecutableMemoryPagesByStartAddress( DWORD_PTR startAddress, DWORD_PTR* baseAddress, SIZE_T* memorySize )
+void IATSearch::findImageByStartAddress( DWORD_PTR startAddress, DWORD_PTR* baseAddress, SIZE_T* imageSize )
 {
 	MEMORY_BASIC_INFORMATION memBasic = {0};
-	DWORD_PTR tempAddress;
+	DWORD_PTR address = 0;
 
-	*memorySize = 0;
 	*baseAddress = 0;
+	*imageSize = 0;
 
-	if (VirtualQueryEx(hProcess,(LPCVOID)startAddress, &memBasic, sizeof(MEMORY_BASIC_INFORMATION)) != sizeof(MEMORY_BASIC_INFORMATION))
+	if (!queryMemory(startAddress, &memBasic) || memBasic.State != MEM_COMMIT)
 	{
 #ifdef DEBUG_COMMENTS
-		DebugOutput("findIATStartAddress :: VirtualQueryEx error %u", GetLastError());
+		DebugOutput("findImageByStartAddress :: no committed memory at " PRINTF_DWORD_PTR_FULL, startAddress);
 #endif
 		return;
 	}
 
-	//search down
-	do
-	{
-		*memorySize = memBasic.RegionSize;
-		*baseAddress = (DWORD_PTR)memBasic.BaseAddress;
-		tempAddress = (DWORD_PTR)memBasic.BaseAddress - 1;
-
-		if (VirtualQueryEx(hProcess, (LPCVOID)tempAddress, &memBasic, sizeof(MEMORY_BASIC_INFORMATION)) != sizeof(MEMORY_BASIC_INFORMATION))
-		{
-			break;
-		}
-	} while (isPageExecutable(memBasic.Protect));
+	//all the regions of the allocation holding the start address, the whole image
+	*baseAddress = (DWORD_PTR)memBasic.AllocationBase;
+	address = *baseAddress;
 
-	tempAddress = *baseAddress;
-	memBasic.RegionSize = *memorySize;
-	*memorySize = 0;
-	//search up
-	do
+	while (queryMemory(address, &memBasic) && (DWORD_PTR)memBasic.AllocationBase == *baseAddress)
 	{
-		tempAddress += memBasic.RegionSize;
-		*memorySize += memBasic.RegionSize;
+		address += memBasic.RegionSize;
 
-		if (VirtualQueryEx(hProcess, (LPCVOID)tempAddress, &memBasic, sizeof(MEMORY_BASIC_INFORMATION)) != sizeof(MEMORY_BASIC_INFORMATION))
+		if (isSectionSizeTooBig(address - *baseAddress))
 		{
+			address = *baseAddress + 100000000;
 			break;
 		}
-	} while (isPageExecutable(memBasic.Protect));
-}
-
-void IATSearch::filterIATPointersList( std::set<DWORD_PTR> & iatPointers )
-{
-	std::set<DWORD_PTR>::iterator iter;
-
-	if (iatPointers.size() <= 2)
-	{
-		return;
-	}
-
-	iter = iatPointers.begin();
-	std::advance(iter, iatPointers.size() / 2); //start in the middle, important!
-
-	DWORD_PTR lastPointer = *iter;
-	iter++;
-
-	for (; iter != iatPointers.end(); iter++)
-	{
-		if ((*iter - lastPointer) > 0x100) //check difference
-		{
-			if (isIATPointerValid(lastPointer, false) == false || isIATPointerValid(*iter, false) == false)
-			{
-				iatPointers.erase(iter, iatPointers.end());
-				break;
-			}
-			else
-			{
-				lastPointer = *iter;
-			}
-		}
-		else
-		{
-			lastPointer = *iter;
-		}
 	}
 
-	if (iatPointers.empty()) {
-		return;
-	}
-
-	//delete bad code pointers.
-
-	bool erased = true;
-
-	while(erased)
-	{
-		if (iatPointers.size() <= 1)
-			break;
-
-		iter = iatPointers.begin();
-		lastPointer = *iter;
-		iter++;
-
-		for (; iter != iatPointers.end(); iter++)
-		{
-			if ((*iter - lastPointer) > 0x100) //check pointer difference, a typical difference is 4 on 32bit systems
-			{
-				bool isLastValid = isIATPointerValid(lastPointer, false);
-				bool isCurrentValid = isIATPointerValid(*iter, false);
-				if (isLastValid == false || isCurrentValid == false)
-				{
-					if (isLastValid == false)
-					{
-						iter--;
-					}
-					
-					iatPointers.erase(iter);
-					erased = true;
-					break;
-				}
-				else
-				{
-					erased = false;
-					lastPointer = *iter;
-				}
-			}
-			else
-			{
-				erased = false;
-				lastPointer = *iter;
-			}
-		}
-	}
-
-}
-
-//A big section size is a common anti-debug/anti-dump trick, limit the max size to 100 000 000 bytes
-
-void adjustSizeForBigSections(DWORD * badValue)
-{
-	if (*badValue > 100000000)
-	{
-		*badValue = 100000000;
-	}
-}
-
-bool isSectionSizeTooBig(SIZE_T sectionSize) {
-	return (sectionSize > 100000000);
+	*imageSize = address - *baseAddress;
 }
 
 void IATSearch::getMemoryBaseAndSizeForIat( DWORD_PTR address, DWORD_PTR* baseAddress, DWORD* baseSize )
@@ -551,7 +379,7 @@ void IATSearch::getMemoryBaseAndSizeForIat( DWORD_PTR address, DWORD_PTR* baseAd
 	*baseAddress = 0;
 	*baseSize = 0;
 
-	if (!VirtualQueryEx(hProcess,(LPCVOID)address, &memBasic2, sizeof(MEMORY_BASIC_INFORMATION)))
+	if (!queryMemory(address, &memBasic2))
 	{
 		return;
 	}
@@ -562,9 +390,9 @@ void IATSearch::getMemoryBaseAndSizeForIat( DWORD_PTR address, DWORD_PTR* baseAd
 	adjustSizeForBigSections(baseSize);
 
 	//Get the neighbours
-	if (VirtualQueryEx(hProcess,(LPCVOID)((DWORD_PTR)memBasic2.BaseAddress - 1), &memBasic1, sizeof(MEMORY_BASIC_INFORMATION)))
+	if (queryMemory((DWORD_PTR)memBasic2.BaseAddress - 1, &memBasic1))
 	{
-		if (VirtualQueryEx(hProcess,(LPCVOID)((DWORD_PTR)memBasic2.BaseAddress + (DWORD_PTR)memBasic2.RegionSize), &memBasic3, sizeof(MEMORY_BASIC_INFORMATION)))
+		if (queryMemory((DWORD_PTR)memBasic2.BaseAddress + (DWORD_PTR)memBasic2.RegionSize, &memBasic3))
 		{
 			if (memBasic3.State != MEM_COMMIT || 
 				memBasic1.State != MEM_COMMIT || 
@@ -1,7 +1,7 @@
 #pragma once
 
 #include "ApiReader.h"
-#include <set>
+#include "..\IatScan.h"
 
 class IATSearch : protected ApiReader
 {
@@ -24,11 +24,11 @@ private:
 
 	bool findIATStartAndSize(DWORD_PTR address, DWORD_PTR * addressIAT, DWORD * sizeIAT);
 
-	DWORD_PTR findIATStartAddress( DWORD_PTR baseAddress, DWORD_PTR startAddress, BYTE * dataBuffer );
-	DWORD findIATSize( DWORD_PTR baseAddress, DWORD_PTR iatAddress, BYTE * dataBuffer, DWORD bufferSize );
+	DWORD_PTR findIATStartAddress( DWORD_PTR baseAddress, DWORD_PTR startAddress, IATSCAN * scan );
+	DWORD findIATSize( DWORD_PTR baseAddress, DWORD_PTR iatAddress, IATSCAN * scan );
 
-	void findIATPointers(std::set<DWORD_PTR> & iatPointers);
-	void findExecutableMemoryPagesByStartAddress( DWORD_PTR startAddress, DWORD_PTR* baseAddress, SIZE_T* memorySize );
-	void filterIATPointersList( std::set<DWORD_PTR> & iatPointers );
+	void findImageByStartAddress( DWORD_PTR startAddress, DWORD_PTR* baseAddress, SIZE_T* imageSize );
 	void getMemoryBaseAndSizeForIat( DWORD_PTR address, DWORD_PTR* baseAddress, DWORD* baseSize );
+
+	static int isMappedForIat(void * context, uint64_t address);
 };
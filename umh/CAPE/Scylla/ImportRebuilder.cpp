@@ -21,8 +21,12 @@ bool ImportRebuilder::rebuildImportTable(const CHAR * newFilePath, std::map<DWOR
 {
 	bool retValue = false;
 
-	std::map<DWORD_PTR, ImportModuleThunk> copyModule;
-	copyModule.insert(moduleList.begin(), moduleList.end());
+	if (!flattenModuleList(moduleList))
+	{
+		ImportTableFree(&importTable);
+		DebugOutput("Failed to allocate import table: import table rebuild failed.\n");
+		return false;
+	}
 
 	if (isValidPeFile())
 	{
@@ -30,7 +34,7 @@ bool ImportRebuilder::rebuildImportTable(const CHAR * newFilePath, std::map<DWOR
 		{
 			setDefaultFileAlignment();
 
-			retValue = buildNewImportTable(copyModule);
+			retValue = buildNewImportTable();
 
 			if (!retValue) DebugOutput("buildNewImportTable() failed.\n");
 
@@ -59,7 +63,7 @@ bool ImportRebuilder::rebuildImportTable(const CHAR * newFilePath, std::map<DWOR
 		{
 			setDefaultFileAlignment();
 
-			retValue = buildNewImportTable(copyModule);
+			retValue = buildNewImportTable();
 
 			if (!retValue) DebugOutput("buildNewImportTable() failed.\n");
 			
@@ -93,13 +97,51 @@ bool ImportRebuilder::rebuildImportTable(const CHAR * newFilePath, std::map<DWOR
 		else DebugOutput("readPeSectionsFromProcess() failed.\n");
 	}
 	else DebugOutput("Invalid PE file: import table rebuild failed.\n");
-	
+
+	ImportTableFree(&importTable);
+
 	return retValue;
 }
 
-bool ImportRebuilder::buildNewImportTable(std::map<DWORD_PTR, ImportModuleThunk> & moduleList)
+bool ImportRebuilder::flattenModuleList(std::map<DWORD_PTR, ImportModuleThunk> & moduleList)
+{
+	std::map<DWORD_PTR, ImportModuleThunk>::iterator mapIt;
+	std::map<DWORD_PTR, ImportThunk>::iterator mapIt2;
+	size_t thunkCount = 0;
+
+	for (mapIt = moduleList.begin(); mapIt != moduleList.end(); mapIt++)
+	{
+		thunkCount += (*mapIt).second.thunkList.size();
+	}
+
+	//names average well under 32 characters
+	if (!ImportTableInit(&importTable, moduleList.size(), thunkCount, (moduleList.size() + thunkCount) * 32))
+		return false;
+
+	for (mapIt = moduleList.begin(); mapIt != moduleList.end(); mapIt++)
+	{
+		if (!ImportTableAddModule(&importTable, (*mapIt).second.firstThunk, (*mapIt).second.moduleName))
+			return false;
+
+		for (mapIt2 = (*mapIt).second.thunkList.begin(); mapIt2 != (*mapIt).second.thunkList.end(); mapIt2++)
+		{
+			if (!ImportTableAddEntry(&importTable, (*mapIt2).second.rva, (*mapIt2).second.name, (*mapIt2).second.ordinal, (*mapIt2).second.hint))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+bool ImportRebuilder::buildNewImportTable()
 {
-	createNewImportSection(moduleList);
+	if (!importTable.ModuleCount)
+	{
+		DebugOutput("buildNewImportTable: No modules to import.\n");
+		return false;
+	}
+
+	createNewImportSection();
 
 	importSectionIndex = listPeSection.size() - 1;
 
@@ -118,10 +160,10 @@ bool ImportRebuilder::buildNewImportTable(std::map<DWORD_PTR, ImportModuleThunk>
 			newIatBaseAddressRVA += iatReferenceScan->getSizeInBytesOfJumpTableInSection();
 		}
 
-		changeIatBaseAddress(moduleList);
+		changeIatBaseAddress();
 	}
 
-	DWORD dwSize = fillImportSection(moduleList);
+	DWORD dwSize = fillImportSection();
 
 	if (!dwSize)
 	{
@@ -129,14 +171,14 @@ bool ImportRebuilder::buildNewImportTable(std::map<DWORD_PTR, ImportModuleThunk>
 		return false;
 	}
 
-	setFlagToIATSection((*moduleList.begin()).second.firstThunk);
+	setFlagToIATSection((DWORD_PTR)importTable.Modules[0].FirstThunk);
 
 	DWORD vaImportAddress = listPeSection[importSectionIndex].sectionHeader.VirtualAddress;
 
 	if (useOFT)
 	{
 		//OFT array is at the beginning of the import section
-		vaImportAddress += (DWORD)sizeOfOFTArray;
+		vaImportAddress += (DWORD)importLayout.ThunksSize;
 	}
 	if (newIatInSection)
 	{
@@ -151,23 +193,23 @@ bool ImportRebuilder::buildNewImportTable(std::map<DWORD_PTR, ImportModuleThunk>
 	if (isPE32())
 	{
 		pNTHeader32->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress = vaImportAddress;
-		pNTHeader32->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size = (DWORD)(numberOfImportDescriptors * sizeof(IMAGE_IMPORT_DESCRIPTOR));
+		pNTHeader32->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size = (DWORD)(importLayout.Descriptors * sizeof(IMAGE_IMPORT_DESCRIPTOR));
 	}
 	else
 	{
 		pNTHeader64->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress = vaImportAddress;
-		pNTHeader64->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size = (DWORD)(numberOfImportDescriptors * sizeof(IMAGE_IMPORT_DESCRIPTOR));
+		pNTHeader64->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size = (DWORD)(importLayout.Descriptors * sizeof(IMAGE_IMPORT_DESCRIPTOR));
 	}
 
 
 	return true;
 }
 
-bool ImportRebuilder::createNewImportSection(std::map<DWORD_PTR, ImportModuleThunk> & moduleList)
+bool ImportRebuilder::createNewImportSection()
 {
 	char sectionName[IMAGE_SIZEOF_SHORT_NAME + 1] = {0};
 
-	calculateImportSizes(moduleList);
+	calculateImportSizes();
 
 	strcpy_s(sectionName, ".CAPE");
 
@@ -195,22 +237,10 @@ void ImportRebuilder::setFlagToIATSection(DWORD_PTR iatAddress)
 	}
 }
 
-DWORD ImportRebuilder::fillImportSection(std::map<DWORD_PTR, ImportModuleThunk> & moduleList)
+DWORD ImportRebuilder::fillImportSection()
 {
-	std::map<DWORD_PTR, ImportModuleThunk>::iterator mapIt;
-	std::map<DWORD_PTR, ImportThunk>::iterator mapIt2;
-	PIMAGE_IMPORT_DESCRIPTOR pImportDesc = 0;
-	PIMAGE_IMPORT_BY_NAME pImportByName = 0;
-	PIMAGE_THUNK_DATA pThunk = 0;
-	ImportModuleThunk * importModuleThunk = 0;
-	ImportThunk * importThunk = 0;
-
-	size_t stringLength = 0;
-	DWORD_PTR lastRVA = 0;
-
 	BYTE * sectionData = listPeSection[importSectionIndex].data;
 	DWORD offset = 0;
-	DWORD offsetOFTArray = 0;
 
 	/*
 	New Scylla section contains:
@@ -224,225 +254,27 @@ DWORD ImportRebuilder::fillImportSection(std::map<DWORD_PTR, ImportModuleThunk>
 	if (BuildDirectImportsJumpTable)
 	{
 		offset += iatReferenceScan->getSizeInBytesOfJumpTableInSection();
-		offsetOFTArray += iatReferenceScan->getSizeInBytesOfJumpTableInSection();
 	}
 	if (newIatInSection)
 	{
 		offset += IatSize; //new iat at the beginning
-		offsetOFTArray += IatSize;
 		memset(sectionData, 0xFF, offset);
 	}
-	if (useOFT)
-	{
-		offset += (DWORD)sizeOfOFTArray; //size includes null termination
-	}
-
-	pImportDescriptor = (PIMAGE_IMPORT_DESCRIPTOR)((DWORD_PTR)sectionData + offset);
-
-	//skip the IMAGE_IMPORT_DESCRIPTOR
-	offset += (DWORD)(numberOfImportDescriptors * sizeof(IMAGE_IMPORT_DESCRIPTOR));
-
-	for ( mapIt = moduleList.begin() ; mapIt != moduleList.end(); mapIt++ )
-	{
-		importModuleThunk = &((*mapIt).second);
-
-		//DebugOutput("Calling addImportDescriptor with importModuleThunk:0x%x, offset: 0x%x, offsetOFTArray: 0x%x", importModuleThunk, offset, offsetOFTArray);
-		stringLength = addImportDescriptor(importModuleThunk, offset, offsetOFTArray);
-
-#ifdef DEBUG_COMMENTS		
-		//DebugOutput("fillImportSection :: importDesc.Name %s", pImportDescriptor->Name);
-#endif
-
-		offset += (DWORD)stringLength; //stringLength has null termination char
-
-		pImportByName = (PIMAGE_IMPORT_BY_NAME)((DWORD_PTR)sectionData + offset);
-
-		//pThunk = (PIMAGE_THUNK_DATA)(getMemoryPointerFromRVA(importModuleThunk->firstThunk));
-
-		lastRVA = importModuleThunk->firstThunk - sizeof(DWORD_PTR);
-
-		for ( mapIt2 = (*mapIt).second.thunkList.begin() ; mapIt2 != (*mapIt).second.thunkList.end(); mapIt2++ )
-		{
-			importThunk = &((*mapIt2).second);
-
-			if (useOFT)
-			{
-				pThunk = (PIMAGE_THUNK_DATA)((DWORD_PTR)sectionData + offsetOFTArray);
-				offsetOFTArray += sizeof(DWORD_PTR); //increase OFT array index
-			}
-			else
-			{
-				pThunk = (PIMAGE_THUNK_DATA)(getMemoryPointerFromRVA(importThunk->rva));
-			}
-
-			//check wrong iat pointer
-			if (!pThunk)
-			{
-#ifdef DEBUG_COMMENTS				
-				DebugOutput("fillImportSection :: Failed to get pThunk RVA: %X", importThunk->rva);
-#endif
-				return 0;
-			}
-
-			if ((lastRVA + sizeof(DWORD_PTR)) != importThunk->rva)
-			{
-				//add additional import desc
-				addSpecialImportDescriptor(importThunk->rva, offsetOFTArray);
-				if (useOFT)
-				{
-					pThunk = (PIMAGE_THUNK_DATA)((DWORD_PTR)sectionData + offsetOFTArray);
-					offsetOFTArray += sizeof(DWORD_PTR); //increase OFT array index, next module
-				}				
-			}
-			lastRVA = importThunk->rva;
-
-#ifdef DEBUG_COMMENTS			
-			DebugOutput("fillImportSection :: importThunk %X pThunk %X pImportByName %X offset %X", importThunk,pThunk,pImportByName,offset);
-#endif
-			stringLength = addImportToImportTable(importThunk, pThunk, pImportByName, offset);
-
-			offset += (DWORD)stringLength; //is 0 bei import by ordinal
-			pImportByName = (PIMAGE_IMPORT_BY_NAME)((DWORD_PTR)pImportByName + stringLength);
-		}
-
-		offsetOFTArray += sizeof(DWORD_PTR); //increase OFT array index, next module
-		pImportDescriptor++;
-	}
 
-	return offset;
+	//one sweep over the modules writes the descriptors, names and thunks
+	return (DWORD)ImportTableWrite(&importTable, &importLayout, sizeof(DWORD_PTR), sectionData, listPeSection[importSectionIndex].sectionHeader.VirtualAddress, offset, useOFT, getThunkSlot, this);
 }
 
-size_t ImportRebuilder::addImportDescriptor(ImportModuleThunk * pImportModule, DWORD sectionOffset, DWORD sectionOffsetOFTArray)
+void ImportRebuilder::calculateImportSizes()
 {
-	char dllName[MAX_PATH];
+	ImportTableLayout(&importTable, sizeof(DWORD_PTR), &importLayout);
 
-	strncpy_s(dllName, _countof(dllName), pImportModule->moduleName, strlen(pImportModule->moduleName));
-	size_t stringLength = strlen(dllName) + 1;
-
-	/*
-		Warning: stringLength MUST include null termination char
-	*/
-
-#ifdef DEBUG_COMMENTS		
-	DebugOutput("ImportRebuilder: dllName: %s, length %d", dllName, stringLength);
-#endif
-	
-	memcpy((listPeSection[importSectionIndex].data + sectionOffset), dllName, stringLength); //copy module name to section
-
-	pImportDescriptor->FirstThunk = (DWORD)pImportModule->firstThunk;
-	DWORD Name = (DWORD)convertOffsetToRVAVector(listPeSection[importSectionIndex].sectionHeader.PointerToRawData + sectionOffset);
-	pImportDescriptor->Name = (DWORD)convertOffsetToRVAVector(listPeSection[importSectionIndex].sectionHeader.PointerToRawData + sectionOffset);
-#ifdef DEBUG_COMMENTS		
-	DebugOutput("pImportDescriptor->Name: 0x%x, @0x%x\n", pImportDescriptor->Name, &pImportDescriptor->Name);
-#endif
-	   
-	if (useOFT)
-	{
-		pImportDescriptor->OriginalFirstThunk = (DWORD)convertOffsetToRVAVector(listPeSection[importSectionIndex].sectionHeader.PointerToRawData + sectionOffsetOFTArray);
-#ifdef DEBUG_COMMENTS		
-		DebugOutput("pImportDescriptor->OriginalFirstThunk set to: 0x%x\n", pImportDescriptor->OriginalFirstThunk);
-#endif
-		
-	}
-
-	return stringLength;
-}
-
-void ImportRebuilder::addSpecialImportDescriptor(DWORD_PTR rvaFirstThunk, DWORD sectionOffsetOFTArray)
-{
-	PIMAGE_IMPORT_DESCRIPTOR oldID = pImportDescriptor;
-	pImportDescriptor++;
-
-	pImportDescriptor->FirstThunk = (DWORD)rvaFirstThunk;
-	pImportDescriptor->Name = oldID->Name;
-
-	if (useOFT)
-	{
-		pImportDescriptor->OriginalFirstThunk = (DWORD)convertOffsetToRVAVector(listPeSection[importSectionIndex].sectionHeader.PointerToRawData + sectionOffsetOFTArray);
-	}
-}
-
-void ImportRebuilder::calculateImportSizes(std::map<DWORD_PTR, ImportModuleThunk> & moduleList)
-{
-	std::map<DWORD_PTR, ImportModuleThunk>::iterator mapIt;
-	std::map<DWORD_PTR, ImportThunk>::iterator mapIt2;
-	DWORD_PTR lastRVA = 0;
-
-
-	sizeOfImportSection = 0;
-	sizeOfApiAndModuleNames = 0;
-	sizeOfOFTArray = 0;
-
-	numberOfImportDescriptors = moduleList.size() + 1; //last is zero'd
-
-	for ( mapIt = moduleList.begin() ; mapIt != moduleList.end(); mapIt++ )
-	{
-		lastRVA = (*mapIt).second.firstThunk - sizeof(DWORD_PTR);
-
-		sizeOfApiAndModuleNames += (DWORD)(strlen((*mapIt).second.moduleName) + 1);
-
-		for ( mapIt2 = (*mapIt).second.thunkList.begin() ; mapIt2 != (*mapIt).second.thunkList.end(); mapIt2++ )
-		{
-			if ((lastRVA + sizeof(DWORD_PTR)) != (*mapIt2).second.rva)
-			{
-				numberOfImportDescriptors++; //add additional import desc
-				sizeOfOFTArray += sizeof(DWORD_PTR) + sizeof(DWORD_PTR);
-			}
-
-			if((*mapIt2).second.name[0] != '\0')
-			{
-				sizeOfApiAndModuleNames += sizeof(WORD); //Hint from IMAGE_IMPORT_BY_NAME
-				sizeOfApiAndModuleNames += (DWORD)(strlen((*mapIt2).second.name) + 1);
-			}
-
-			//OriginalFirstThunk Array in Import Section: value
-			sizeOfOFTArray += sizeof(DWORD_PTR);
-
-			lastRVA = (*mapIt2).second.rva;
-		}
-
-		//OriginalFirstThunk Array in Import Section: NULL termination
-		sizeOfOFTArray += sizeof(DWORD_PTR);
-	}
-
-	sizeOfImportSection = sizeOfOFTArray + sizeOfApiAndModuleNames + (numberOfImportDescriptors * sizeof(IMAGE_IMPORT_DESCRIPTOR));
+	sizeOfImportSection = importLayout.Size;
 }
 
-size_t ImportRebuilder::addImportToImportTable( ImportThunk * pImport, PIMAGE_THUNK_DATA pThunk, PIMAGE_IMPORT_BY_NAME pImportByName, DWORD sectionOffset)
+unsigned char * ImportRebuilder::getThunkSlot(void * context, uint64_t rva)
 {
-	size_t stringLength = 0;
-
-	if(pImport->name[0] == '\0')
-	{
-		pThunk->u1.AddressOfData = (IMAGE_ORDINAL(pImport->ordinal) | IMAGE_ORDINAL_FLAG);
-	}
-	else
-	{
-		pImportByName->Hint = pImport->hint;
-
-		stringLength = strlen(pImport->name) + 1;
-		memcpy(pImportByName->Name, pImport->name, stringLength);
-
-		pThunk->u1.AddressOfData = convertOffsetToRVAVector(listPeSection[importSectionIndex].sectionHeader.PointerToRawData + sectionOffset);
-
-		if (!pThunk->u1.AddressOfData)
-		{
-#ifdef DEBUG_COMMENTS		
-			DebugOutput("addImportToImportTable :: failed to get AddressOfData %X %X", listPeSection[importSectionIndex].sectionHeader.PointerToRawData, sectionOffset);
-#endif
-		}
-
-		//next import should be nulled
-		pThunk++;
-		pThunk->u1.AddressOfData = 0;
-
-#ifdef DEBUG_COMMENTS		
-		DebugOutput("addImportToImportTable :: pThunk->u1.AddressOfData %X %X %X", pThunk->u1.AddressOfData, pThunk, listPeSection[importSectionIndex].sectionHeader.PointerToRawData + sectionOffset);
-#endif
-		stringLength += sizeof(WORD);
-	}
-
-	return stringLength;
+	return ((ImportRebuilder *)context)->getMemoryPointerFromRVA((DWORD_PTR)rva);
 }
 
 BYTE * ImportRebuilder::getMemoryPointerFromRVA(DWORD_PTR dwRVA)
@@ -457,6 +289,8 @@ BYTE * ImportRebuilder::getMemoryPointerFromRVA(DWORD_PTR dwRVA)
 	DWORD rvaPointer = ((DWORD)dwRVA - listPeSection[peSectionIndex].sectionHeader.VirtualAddress);
 	DWORD minSectionSize = rvaPointer + (sizeof(DWORD_PTR) * 2); //add space for 1 IAT address
 
+	makeSectionWritable(listPeSection[peSectionIndex]);
+
 	if (listPeSection[peSectionIndex].data == 0 || listPeSection[peSectionIndex].dataSize == 0)
 	{
 		listPeSection[peSectionIndex].dataSize = minSectionSize; 
@@ -503,22 +337,11 @@ void ImportRebuilder::patchFileForNewIatLocation()
 	iatReferenceScan->patchNewIat(getStandardImagebase(), newIatBaseAddressRVA, (PeParser *)this);
 }
 
-void ImportRebuilder::changeIatBaseAddress( std::map<DWORD_PTR, ImportModuleThunk> & moduleList )
+void ImportRebuilder::changeIatBaseAddress()
 {
-	std::map<DWORD_PTR, ImportModuleThunk>::iterator mapIt;
-	std::map<DWORD_PTR, ImportThunk>::iterator mapIt2;
-
 	DWORD_PTR oldIatRva = IatAddress - ProcessAccessHelp::targetImageBase;
 
-	for ( mapIt = moduleList.begin() ; mapIt != moduleList.end(); mapIt++ )
-	{
-		(*mapIt).second.firstThunk = (*mapIt).second.firstThunk - oldIatRva + newIatBaseAddressRVA;
-
-		for ( mapIt2 = (*mapIt).second.thunkList.begin() ; mapIt2 != (*mapIt).second.thunkList.end(); mapIt2++ )
-		{
-			(*mapIt2).second.rva = (*mapIt2).second.rva - oldIatRva + newIatBaseAddressRVA;
-		}
-	}
+	ImportTableMove(&importTable, oldIatRva, newIatBaseAddressRVA);
 }
 
 void ImportRebuilder::patchFileForDirectImportJumpTable()
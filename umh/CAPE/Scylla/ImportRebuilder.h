@@ -4,22 +4,19 @@
 #include "PeParser.h"
 #include "Thunks.h"
 #include "IATReferenceScan.h"
+#include "..\ImportTable.h"
 
 
 class ImportRebuilder : public PeParser {
 public:
 	ImportRebuilder(const CHAR * file) : PeParser(file, true)
 	{
-		pImportDescriptor = 0;
-		pThunkData = 0;
-		pImportByName = 0;
+		ZeroMemory(&importTable, sizeof(importTable));
+		ZeroMemory(&importLayout, sizeof(importLayout));
 
-		numberOfImportDescriptors = 0;
 		sizeOfImportSection = 0;
-		sizeOfApiAndModuleNames = 0;
 		importSectionIndex = 0;
 		useOFT = false;
-		sizeOfOFTArray = 0;
 		newIatInSection = false;
 		BuildDirectImportsJumpTable = false;
 		sizeOfJumpTable = 0;
@@ -27,16 +24,12 @@ public:
 	
 	ImportRebuilder(const DWORD_PTR moduleBase) : PeParser(moduleBase, true)
 	{
-		pImportDescriptor = 0;
-		pThunkData = 0;
-		pImportByName = 0;
+		ZeroMemory(&importTable, sizeof(importTable));
+		ZeroMemory(&importLayout, sizeof(importLayout));
 
-		numberOfImportDescriptors = 0;
 		sizeOfImportSection = 0;
-		sizeOfApiAndModuleNames = 0;
 		importSectionIndex = 0;
 		useOFT = false;
-		sizeOfOFTArray = 0;
 		newIatInSection = false;
 		BuildDirectImportsJumpTable = false;
 		sizeOfJumpTable = 0;
@@ -49,17 +42,14 @@ public:
 	IATReferenceScan * iatReferenceScan;
 	bool BuildDirectImportsJumpTable;
 private:
-	PIMAGE_IMPORT_DESCRIPTOR pImportDescriptor;
-	PIMAGE_THUNK_DATA pThunkData;
-	PIMAGE_IMPORT_BY_NAME pImportByName;
+	//modules and thunks of the table being rebuilt, flattened from the module list
+	IMPORTTABLE importTable;
+	IMPORTLAYOUT importLayout;
 
-	size_t numberOfImportDescriptors;
 	size_t sizeOfImportSection;
-	size_t sizeOfApiAndModuleNames;
 	size_t importSectionIndex;
 
 	//OriginalFirstThunk Array in Import Section
-	size_t sizeOfOFTArray;
 	bool useOFT;
 	bool newIatInSection;
 	DWORD_PTR IatAddress;
@@ -73,19 +63,18 @@ private:
 	DWORD newIatBaseAddressRVA;
 	
 
-	DWORD fillImportSection(std::map<DWORD_PTR, ImportModuleThunk> & moduleList);
+	bool flattenModuleList(std::map<DWORD_PTR, ImportModuleThunk> & moduleList);
+	DWORD fillImportSection();
 	BYTE * getMemoryPointerFromRVA(DWORD_PTR dwRVA);
+	static unsigned char * getThunkSlot(void * context, uint64_t rva);
 
-	bool createNewImportSection(std::map<DWORD_PTR, ImportModuleThunk> & moduleList);
-	bool buildNewImportTable(std::map<DWORD_PTR, ImportModuleThunk> & moduleList);
+	bool createNewImportSection();
+	bool buildNewImportTable();
 	void setFlagToIATSection(DWORD_PTR iatAddress);
-	size_t addImportToImportTable( ImportThunk * pImport, PIMAGE_THUNK_DATA pThunk, PIMAGE_IMPORT_BY_NAME pImportByName, DWORD sectionOffset);
-	size_t addImportDescriptor(ImportModuleThunk * pImportModule, DWORD sectionOffset, DWORD sectionOffsetOFTArray);
 
-	void calculateImportSizes(std::map<DWORD_PTR, ImportModuleThunk> & moduleList);
+	void calculateImportSizes();
 
-	void addSpecialImportDescriptor(DWORD_PTR rvaFirstThunk, DWORD sectionOffsetOFTArray);
 	void patchFileForNewIatLocation();
-	void changeIatBaseAddress( std::map<DWORD_PTR, ImportModuleThunk> & moduleList );
+	void changeIatBaseAddress();
 	void patchFileForDirectImportJumpTable();
 };
\ No newline at end of file
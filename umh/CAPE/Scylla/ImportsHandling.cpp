@@ -219,43 +219,33 @@ bool ImportsHandling::addNotFoundApiToModuleList(const ImportThunk * apiNotFound
 
 	if (moduleListNew.size() > 0)
 	{
-		it_module = moduleListNew.begin();
-		while (it_module != moduleListNew.end())
+		//the module is the last one starting at or below the thunk
+		it_module = moduleListNew.upper_bound(rva);
+		if (it_module == moduleListNew.begin())
 		{
-			if (rva >= it_module->second.firstThunk)
+#ifdef DEBUG_COMMENTS
+			DebugOutput("Error iterator1 != (*moduleThunkList).end()");
+#endif
+		}
+		else if (it_module == moduleListNew.end())
+		{
+			it_module--;
+			//new unknown module
+			if (it_module->second.moduleName[0] == L'?')
 			{
-				it_module++;
-				if (it_module == moduleListNew.end())
-				{
-					it_module--;
-					//new unknown module
-					if (it_module->second.moduleName[0] == L'?')
-					{
-						module = &(it_module->second);
-					}
-					else
-					{
-						addUnknownModuleToModuleList(apiNotFound->rva);
-						module = &(moduleListNew.find(rva)->second);
-					}
-
-					break;
-				}
-				else if (rva < it_module->second.firstThunk)
-				{
-					it_module--;
-					module = &(it_module->second);
-					break;
-				}
+				module = &(it_module->second);
 			}
 			else
 			{
-#ifdef DEBUG_COMMENTS
-				DebugOutput("Error iterator1 != (*moduleThunkList).end()");
-#endif
-				break;
+				addUnknownModuleToModuleList(apiNotFound->rva);
+				module = &(moduleListNew.find(rva)->second);
 			}
 		}
+		else
+		{
+			it_module--;
+			module = &(it_module->second);
+		}
 	}
 	else
 	{
@@ -296,32 +286,18 @@ bool ImportsHandling::addFunctionToModuleList(const ImportThunk * apiFound)
 
 	if (moduleListNew.size() > 1)
 	{
-		it_module = moduleListNew.begin();
-		while (it_module != moduleListNew.end())
+		//the module is the last one starting at or below the thunk
+		it_module = moduleListNew.upper_bound(apiFound->rva);
+		if (it_module != moduleListNew.begin())
+		{
+			it_module--;
+			module = &(it_module->second);
+		}
+		else
 		{
-			if (apiFound->rva >= it_module->second.firstThunk)
-			{
-				it_module++;
-				if (it_module == moduleListNew.end())
-				{
-					it_module--;
-					module = &(it_module->second);
-					break;
-				}
-				else if (apiFound->rva < it_module->second.firstThunk)
-				{
-					it_module--;
-					module = &(it_module->second);
-					break;
-				}
-			}
-			else
-			{
 #ifdef DEBUG_COMMENTS
-				DebugOutput("Error iterator1 != moduleListNew.end()");
+			DebugOutput("Error iterator1 != moduleListNew.end()");
 #endif
-				break;
-			}
 		}
 	}
 	else
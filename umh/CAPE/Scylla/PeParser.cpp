@@ -1,5 +1,8 @@
 #include "PeParser.h"
 #include "ProcessAccessHelp.h"
+#include "..\PeOutput.h"
+#include "..\ZeroScan.h"
+#include "..\Relocate.h"
 #include <algorithm>
 #include <imagehlp.h>
 
@@ -78,13 +81,15 @@ PeParser::~PeParser()
 
 	for (size_t i = 0; i < listPeSection.size(); i++)
 	{
-		if (listPeSection[i].data)
+		if (listPeSection[i].data && !listPeSection[i].isView)
 		{
 			delete [] listPeSection[i].data;
 		}
 	}
 
 	listPeSection.clear();
+
+	unmapFile();
 }
 
 void PeParser::initClass()
@@ -105,6 +110,10 @@ void PeParser::initClass()
 	dumpSize = 0;
 	moduleBaseAddress = 0;
 	hFile = INVALID_HANDLE_VALUE;
+
+	hMappedFile = 0;
+	mappedFile = 0;
+	mappedFileSize = 0;
 }
 
 bool PeParser::isPE64()
@@ -341,6 +350,9 @@ bool PeParser::readPeSectionsFromProcess()
 	ImageBase = getStandardImagebase();
 	AllocationLimit = ImageBase + GetAllocationSize((PVOID)moduleBaseAddress);
 
+	//the image's regions are queried once here for every read and check of this dump
+	ProcessAccessHelp::mapMemoryRange(moduleBaseAddress, AllocationLimit - ImageBase);
+
 	for (WORD i = 0; i < NumberOfSections; i++)
 	{
 		DWORD EndOfSection, EndOfPreviousSection = 0;
@@ -467,6 +479,8 @@ bool PeParser::readPeSectionsFromFile()
 
 	if (openFileHandle())
 	{
+		mapFile();
+
 		for (WORD i = 0; i < getNumberOfSections(); i++)
 		{
 			readOffset = listPeSection[i].sectionHeader.PointerToRawData;
@@ -761,6 +775,127 @@ void PeParser::closeFileHandle()
 	}
 }
 
+void PeParser::mapFile()
+{
+	//sections are used from the mapping where they are rather than read into buffers
+	if (mappedFile || hFile == INVALID_HANDLE_VALUE)
+		return;
+
+	mappedFileSize = (DWORD)ProcessAccessHelp::getFileSize(hFile);
+
+	if (!mappedFileSize)
+		return;
+
+	hMappedFile = CreateFileMapping(hFile, 0, PAGE_READONLY, 0, 0, 0);
+
+	if (hMappedFile)
+	{
+		mappedFile = (BYTE *)MapViewOfFile(hMappedFile, FILE_MAP_READ, 0, 0, 0);
+
+		if (!mappedFile)
+		{
+			CloseHandle(hMappedFile);
+			hMappedFile = 0;
+		}
+	}
+}
+
+void PeParser::unmapFile()
+{
+	if (mappedFile)
+	{
+		for (size_t i = 0; i < listPeSection.size(); i++)
+		{
+			makeSectionWritable(listPeSection[i]);
+		}
+
+		UnmapViewOfFile(mappedFile);
+		mappedFile = 0;
+	}
+
+	if (hMappedFile)
+	{
+		CloseHandle(hMappedFile);
+		hMappedFile = 0;
+	}
+
+	mappedFileSize = 0;
+}
+
+BYTE * PeParser::getSectionView(const DWORD_PTR readOffset, DWORD readSize, const bool isProcess)
+{
+	MEMORY_BASIC_INFORMATION memBasic;
+	DWORD_PTR address = readOffset;
+
+	if (!isProcess)
+	{
+		if (mappedFile && readOffset + readSize <= mappedFileSize)
+			return mappedFile + readOffset;
+
+		return 0;
+	}
+
+	if (ProcessAccessHelp::hProcess != GetCurrentProcess())
+		return 0;
+
+	//every page must be committed and readable for the section to be used in place
+	while (address < readOffset + readSize)
+	{
+		if (!ProcessAccessHelp::queryMemory(address, &memBasic) || memBasic.State != MEM_COMMIT)
+			return 0;
+
+		if (!(memBasic.Protect & (PAGE_READONLY | PAGE_READWRITE | PAGE_WRITECOPY | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY)))
+			return 0;
+
+		if (memBasic.Protect & (PAGE_GUARD | PAGE_NOACCESS))
+			return 0;
+
+		address = (DWORD_PTR)memBasic.BaseAddress + memBasic.RegionSize;
+	}
+
+	return (BYTE *)readOffset;
+}
+
+bool PeParser::makeSectionWritable(PeFileSection & peFileSection)
+{
+	BYTE * data;
+	bool retValue = true;
+
+	if (!peFileSection.isView)
+		return true;
+
+	data = new BYTE[peFileSection.dataSize];
+
+	if (mappedFile && peFileSection.data >= mappedFile && peFileSection.data < mappedFile + mappedFileSize)
+	{
+		memcpy(data, peFileSection.data, peFileSection.dataSize);
+	}
+	else
+	{
+		retValue = ProcessAccessHelp::readMemoryPartlyFromProcess((DWORD_PTR)peFileSection.data, peFileSection.dataSize, data);
+	}
+
+	peFileSection.data = data;
+	peFileSection.isView = false;
+
+	return retValue;
+}
+
+static DWORD trimSectionView(const BYTE * data, DWORD size, bool & faulted)
+{
+	faulted = false;
+
+	__try
+	{
+		return (DWORD)ZeroScanReverse(data, size);
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		faulted = true;
+		return 0;
+	}
+}
+
 bool PeParser::readSectionFromProcess(const DWORD_PTR readOffset, PeFileSection & peFileSection)
 {
 	return readSectionFrom(readOffset, peFileSection, true); //process
@@ -795,6 +930,48 @@ bool PeParser::readSectionFrom(const DWORD_PTR readOffset, PeFileSection & peFil
 		return true; //section without data is valid
 	}
 
+	BYTE * view = getSectionView(readOffset, readSize > peFileSection.normalSize ? readSize : peFileSection.normalSize, isProcess);
+
+	if (view)
+	{
+		bool faulted = false;
+
+		if (readSize <= maxReadSize)
+		{
+			peFileSection.dataSize = readSize;
+			peFileSection.normalSize = readSize;
+		}
+		else
+		{
+			//trim the trailing zeroes where the section is rather than reading it back in chunks
+			valuesFound = trimSectionView(view, readSize, faulted);
+
+			if (valuesFound)
+			{
+				//some safety space, as below
+				peFileSection.dataSize = valuesFound + sizeof(DWORD);
+
+				if (peFileSection.normalSize < peFileSection.dataSize)
+				{
+					peFileSection.dataSize = peFileSection.normalSize;
+				}
+			}
+		}
+
+		if (!faulted)
+		{
+			if (peFileSection.dataSize)
+			{
+				peFileSection.data = view;
+				peFileSection.isView = true;
+			}
+#ifdef DEBUG_COMMENTS
+			DebugOutput("PeParser: readSectionFrom: Using section at 0x%p in place, size 0x%x.\n", view, peFileSection.dataSize);
+#endif
+			return true;
+		}
+	}
+
 	if (readSize <= maxReadSize)
 	{
 		peFileSection.dataSize = readSize;
@@ -915,15 +1092,7 @@ bool PeParser::readSectionFrom(const DWORD_PTR readOffset, PeFileSection & peFil
 
 DWORD PeParser::isMemoryNotNull( BYTE * data, int dataSize )
 {
-	for (int i = (dataSize - 1); i >= 0; i--)
-	{
-		if (data[i] != 0)
-		{
-			return i + 1;
-		}
-	}
-
-	return 0;
+	return dataSize > 0 ? (DWORD)ZeroScanReverse(data, dataSize) : 0;
 }
 
 bool PeParser::savePeFileToDisk(const CHAR *newFile)
@@ -935,8 +1104,6 @@ bool PeParser::savePeFileToDisk(const CHAR *newFile)
 	//DebugOutput("PeParser: savePeFileToDisk: Function entry.\n");
 #endif
 
-	DWORD dwFileOffset = 0, dwWriteSize = 0;
-
 	if (getNumberOfSections() != listPeSection.size())
 	{
 #ifdef DEBUG_COMMENTS
@@ -945,6 +1112,12 @@ bool PeParser::savePeFileToDisk(const CHAR *newFile)
 		return false;
 	}
 
+	if (newFile && filename && !_stricmp(newFile, filename))
+	{
+		//the file can't be replaced while its sections are used from a mapping of it
+		unmapFile();
+	}
+
 	if (!openWriteFileHandle(newFile))
 	{
 #ifdef DEBUG_COMMENTS
@@ -956,150 +1129,15 @@ bool PeParser::savePeFileToDisk(const CHAR *newFile)
 		return false;
 	}
 
-	//Dos header
-	dwWriteSize = sizeof(IMAGE_DOS_HEADER);
-	if (!ProcessAccessHelp::writeMemoryToFile(hFile, dwFileOffset, dwWriteSize, pDosHeader))
-	{
-#ifdef DEBUG_COMMENTS
-		DebugOutput("PeParser: savePeFileToDisk: Failure to write DOS header.\n");
-#endif
-		retValue = false;
-	}
-	dwFileOffset += dwWriteSize;
-
-
-	if (dosStubSize && pDosStub)
-	{
-		//Dos Stub
-		dwWriteSize = dosStubSize;
-		if (!ProcessAccessHelp::writeMemoryToFile(hFile, dwFileOffset, dwWriteSize, pDosStub))
-		{
-#ifdef DEBUG_COMMENTS
-			DebugOutput("PeParser: savePeFileToDisk: Failure to write DOS stub.\n");
-#endif
-			retValue = false;
-		}
-		dwFileOffset += dwWriteSize;
-	}
-
-	//PE header
-	if (isPE32())
-		dwWriteSize = sizeof(IMAGE_NT_HEADERS32);
-	else
-		dwWriteSize = sizeof(IMAGE_NT_HEADERS64);
-
-	if (!ProcessAccessHelp::writeMemoryToFile(hFile, dwFileOffset, dwWriteSize, pNTHeader32))
+	if (!writePeFile(hFile, true, SectionDataWritten))
 	{
 #ifdef DEBUG_COMMENTS
-		DebugOutput("PeParser: savePeFileToDisk: Failure to write PE header.\n");
+		DebugOutput("PeParser: savePeFileToDisk: Failure writing PE file.\n");
 #endif
 		retValue = false;
 	}
-	dwFileOffset += dwWriteSize;
-
-	//section headers
-	dwWriteSize = sizeof(IMAGE_SECTION_HEADER);
-
-	for (WORD i = 0; i < getNumberOfSections(); i++)
-	{
-		if (!ProcessAccessHelp::writeMemoryToFile(hFile, dwFileOffset, dwWriteSize, &listPeSection[i].sectionHeader))
-		{
-#ifdef DEBUG_COMMENTS
-			DebugOutput("PeParser: savePeFileToDisk: Failure to write section headers (size 0x%x bytes).\n", dwWriteSize);
-#endif
-			retValue = false;
-			break;
-		}
-		dwFileOffset += dwWriteSize;
-	}
-
-	//PE slack
-	if (SizeOfSlackData)
-	{
-		dwWriteSize = (DWORD)SizeOfSlackData;
-		if (!ProcessAccessHelp::writeMemoryToFile(hFile, dwFileOffset, dwWriteSize, SlackData))
-		{
-#ifdef DEBUG_COMMENTS
-			DebugOutput("PeParser: savePeFileToDisk: Failure to write header slack (size 0x%x bytes).\n", dwWriteSize);
-#endif
-			retValue = false;
-		}
-		dwFileOffset += dwWriteSize;
-	}
-
-	//sections
-	for (WORD i = 0; i < getNumberOfSections(); i++)
-	{
-		if (!listPeSection[i].sectionHeader.PointerToRawData)
-			continue;
-
-		if (listPeSection[i].sectionHeader.PointerToRawData > dwFileOffset)
-		{
-			dwWriteSize = listPeSection[i].sectionHeader.PointerToRawData - dwFileOffset; //padding
-
-			if (!writeZeroMemoryToFile(hFile, dwFileOffset, dwWriteSize))
-			{
-#ifdef DEBUG_COMMENTS
-				DebugOutput("PeParser: savePeFileToDisk: Failure to write padding prior to section %d.\n", i+1);
-#endif
-				retValue = false;
-				break;
-			}
-			dwFileOffset += dwWriteSize;
-		}
-
-		dwWriteSize = listPeSection[i].dataSize;
-
-		if (dwWriteSize)
-		{
-#ifdef DEBUG_COMMENTS
-			DebugOutput("PeParser: savePeFileToDisk: Writing section %d of size 0x%x bytes.\n", i+1, dwWriteSize);
-#endif
-			if (!ProcessAccessHelp::writeMemoryToFile(hFile, listPeSection[i].sectionHeader.PointerToRawData, dwWriteSize, listPeSection[i].data))
-			{
-				DebugOutput("PeParser: savePeFileToDisk: Failure to write section %d of size 0x%x bytes.\n", i+1, dwWriteSize);
-				retValue = false;
-				break;
-			}
-			dwFileOffset += dwWriteSize;
-
-			SectionDataWritten = true;
-
-			if (listPeSection[i].dataSize < listPeSection[i].sectionHeader.SizeOfRawData) //padding
-			{
-				dwWriteSize = listPeSection[i].sectionHeader.SizeOfRawData - listPeSection[i].dataSize;
-
-				if (!writeZeroMemoryToFile(hFile, dwFileOffset, dwWriteSize))
-				{
-					DebugOutput("PeParser: savePeFileToDisk: Failure to write padding to section %d.\n", i+1);
-					retValue = false;
-					break;
-				}
-				dwFileOffset += dwWriteSize;
-			}
-		}
-#ifdef DEBUG_COMMENTS
-		else
-			DebugOutput("PeParser: savePeFileToDisk: Nothing to write for section %d.\n", i+1);
-#endif
-	}
-
-	//add overlay?
-	if (overlaySize && overlayData)
-	{
-		dwWriteSize = overlaySize;
-		if (!ProcessAccessHelp::writeMemoryToFile(hFile, dwFileOffset, dwWriteSize, overlayData))
-		{
-#ifdef DEBUG_COMMENTS
-			DebugOutput("PeParser: savePeFileToDisk: Failure to write ovrelay data.\n");
-#endif
-			retValue = false;
-		}
-		dwFileOffset += dwWriteSize;
-	}
 
 	SetEndOfFile(hFile);
-	dumpSize = dwFileOffset;
 
 	closeFileHandle();
 
@@ -1192,8 +1230,6 @@ bool PeParser::savePeFileToHandle(HANDLE FileHandle)
 	//DebugOutput("PeParser: savePeFileToHandle: Function entry.\n");
 #endif
 
-	DWORD dwFileOffset = 0, dwWriteSize = 0;
-
 	if (getNumberOfSections() != listPeSection.size())
 	{
 #ifdef DEBUG_COMMENTS
@@ -1202,119 +1238,10 @@ bool PeParser::savePeFileToHandle(HANDLE FileHandle)
 		return false;
 	}
 
-	//Dos header
-	dwWriteSize = sizeof(IMAGE_DOS_HEADER);
-	if (!ProcessAccessHelp::writeMemoryToFile(FileHandle, dwFileOffset, dwWriteSize, pDosHeader))
-	{
-		retValue = false;
-	}
-	dwFileOffset += dwWriteSize;
-
-
-	if (dosStubSize && pDosStub)
-	{
-		//Dos Stub
-		dwWriteSize = dosStubSize;
-		if (!ProcessAccessHelp::writeMemoryToFile(FileHandle, dwFileOffset, dwWriteSize, pDosStub))
-		{
-			retValue = false;
-		}
-		dwFileOffset += dwWriteSize;
-	}
-
-	//Pe Header
-	if (isPE32())
-	{
-		dwWriteSize = sizeof(IMAGE_NT_HEADERS32);
-	}
-	else
-	{
-		dwWriteSize = sizeof(IMAGE_NT_HEADERS64);
-	}
-
-	if (!ProcessAccessHelp::writeMemoryToFile(FileHandle, dwFileOffset, dwWriteSize, pNTHeader32))
+	if (!writePeFile(FileHandle, false, SectionDataWritten))
 	{
 		retValue = false;
 	}
-	dwFileOffset += dwWriteSize;
-
-	//section headers
-	dwWriteSize = sizeof(IMAGE_SECTION_HEADER);
-
-	for (WORD i = 0; i < getNumberOfSections(); i++)
-	{
-		if (!ProcessAccessHelp::writeMemoryToFile(FileHandle, dwFileOffset, dwWriteSize, &listPeSection[i].sectionHeader))
-		{
-			retValue = false;
-			break;
-		}
-		dwFileOffset += dwWriteSize;
-	}
-
-	for (WORD i = 0; i < getNumberOfSections(); i++)
-	{
-		if (!listPeSection[i].sectionHeader.PointerToRawData)
-			continue;
-
-		if (listPeSection[i].sectionHeader.PointerToRawData > dwFileOffset)
-		{
-			dwWriteSize = listPeSection[i].sectionHeader.PointerToRawData - dwFileOffset; //padding
-
-			if (!writeZeroMemoryToFile(FileHandle, dwFileOffset, dwWriteSize))
-			{
-				retValue = false;
-				break;
-			}
-			dwFileOffset += dwWriteSize;
-		}
-
-		dwWriteSize = listPeSection[i].dataSize;
-
-		if (dwWriteSize)
-		{
-#ifdef DEBUG_COMMENTS
-			DebugOutput("PeParser: savePeFileToHandle: Writing section %d of size 0x%x bytes.\n", i+1, dwWriteSize);
-#endif
-			if (!ProcessAccessHelp::writeMemoryToFile(FileHandle, listPeSection[i].sectionHeader.PointerToRawData, dwWriteSize, listPeSection[i].data))
-			{
-				retValue = false;
-				break;
-			}
-			dwFileOffset += dwWriteSize;
-
-			SectionDataWritten = true;
-
-			if (listPeSection[i].dataSize < listPeSection[i].sectionHeader.SizeOfRawData) //padding
-			{
-				dwWriteSize = listPeSection[i].sectionHeader.SizeOfRawData - listPeSection[i].dataSize;
-
-				if (!writeZeroMemoryToFile(FileHandle, dwFileOffset, dwWriteSize))
-				{
-					retValue = false;
-					break;
-				}
-				dwFileOffset += dwWriteSize;
-			}
-		}
-#ifdef DEBUG_COMMENTS
-		else
-			DebugOutput("PeParser: savePeFileToHandle: Nothing to write for section %d.\n", i+1);
-#endif
-	}
-
-	//add overlay?
-	if (overlaySize && overlayData)
-	{
-		dwWriteSize = overlaySize;
-		if (!ProcessAccessHelp::writeMemoryToFile(FileHandle, dwFileOffset, dwWriteSize, overlayData))
-		{
-			retValue = false;
-		}
-		dwFileOffset += dwWriteSize;
-	}
-
-	//SetEndOfFile(FileHandle);
-	dumpSize = dwFileOffset;
 
 	// If only headers are written, fail
 	// (this will allow a subsequent 'raw' memory dump)
@@ -1447,17 +1374,113 @@ bool PeParser::saveCompletePeToHandle(HANDLE FileHandle)
 	return true;
 }
 
-bool PeParser::writeZeroMemoryToFile(HANDLE hFile, DWORD fileOffset, DWORD size)
+struct PeOutputFile
 {
-	bool retValue = false;
-	PVOID zeromemory = calloc(size, 1);
+	HANDLE fileHandle;
+	size_t position;
+};
+
+static int writePeOutputPiece(void * context, size_t offset, const void * data, size_t size)
+{
+	PeOutputFile * outputFile = (PeOutputFile *)context;
+	DWORD numberOfBytesWritten = 0;
+
+	//one sequential pass, only seeking when the pieces are out of order
+	if (offset != outputFile->position && SetFilePointer(outputFile->fileHandle, (LONG)offset, 0, FILE_BEGIN) == INVALID_SET_FILE_POINTER)
+	{
+		return 0;
+	}
+
+	if (!WriteFile(outputFile->fileHandle, data, (DWORD)size, &numberOfBytesWritten, 0) || numberOfBytesWritten != size)
+	{
+		return 0;
+	}
+
+	outputFile->position = offset + size;
+
+	return 1;
+}
 
-	if (zeromemory)
+static bool writePeOutput(PPEOUTPUT output, PeOutputFile * outputFile)
+{
+	//sections may be used in place in the image, which can change under us
+	__try
+	{
+		return PeOutputWrite(output, writePeOutputPiece, outputFile) != 0;
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		DebugOutput("PeParser: writePeOutput: Exception reading PE file data.\n");
+		return false;
+	}
+}
+
+bool PeParser::writePeFile(HANDLE FileHandle, bool withSlackData, bool & sectionDataWritten)
+{
+	PEOUTPUT output;
+	PeOutputFile outputFile;
+	bool retValue;
+
+	//the headers, sections and overlay as they are in memory, the checksum as stored
+	PeOutputInit(&output, 0);
+
+	PeOutputAdd(&output, pDosHeader, sizeof(IMAGE_DOS_HEADER));
+
+	if (dosStubSize && pDosStub)
+	{
+		PeOutputAdd(&output, pDosStub, dosStubSize);
+	}
+
+	if (isPE32())
+	{
+		PeOutputAdd(&output, pNTHeader32, sizeof(IMAGE_NT_HEADERS32));
+	}
+	else
 	{
-		retValue = ProcessAccessHelp::writeMemoryToFile(hFile, fileOffset, size, zeromemory);
-		free(zeromemory);
+		PeOutputAdd(&output, pNTHeader64, sizeof(IMAGE_NT_HEADERS64));
 	}
 
+	for (WORD i = 0; i < getNumberOfSections(); i++)
+	{
+		PeOutputAdd(&output, &listPeSection[i].sectionHeader, sizeof(IMAGE_SECTION_HEADER));
+	}
+
+	if (withSlackData && SizeOfSlackData)
+	{
+		PeOutputAdd(&output, SlackData, SizeOfSlackData);
+	}
+
+	for (WORD i = 0; i < getNumberOfSections(); i++)
+	{
+#ifdef DEBUG_COMMENTS
+		DebugOutput("PeParser: writePeFile: Section %d of size 0x%x bytes at 0x%x.\n", i+1, listPeSection[i].dataSize, listPeSection[i].sectionHeader.PointerToRawData);
+#endif
+		if (PeOutputAddSection(&output, listPeSection[i].sectionHeader.PointerToRawData, listPeSection[i].sectionHeader.SizeOfRawData, listPeSection[i].data, listPeSection[i].dataSize) > 0)
+		{
+			sectionDataWritten = true;
+		}
+	}
+
+	if (overlaySize && overlayData)
+	{
+		PeOutputAdd(&output, overlayData, overlaySize);
+	}
+
+	dumpSize = (DWORD)output.Position;
+
+	outputFile.fileHandle = FileHandle;
+	outputFile.position = (size_t)-1;
+
+	retValue = writePeOutput(&output, &outputFile);
+
+	//leave the file pointer after the last piece, where the file ends
+	if (retValue && outputFile.position != output.End)
+	{
+		SetFilePointer(FileHandle, (LONG)output.End, 0, FILE_BEGIN);
+	}
+
+	PeOutputFree(&output);
+
 	return retValue;
 }
 
@@ -1611,12 +1634,37 @@ DWORD_PTR PeParser::convertOffsetToRVAVector(DWORD_PTR dwOffset)
 	return 0;
 }
 
+unsigned char * PeParser::prepareRelocationTarget(void * context, size_t index)
+{
+	PeFileSection & peFileSection = ((PeParser *)context)->listPeSection[index];
+
+	if (!((PeParser *)context)->makeSectionWritable(peFileSection))
+		return 0;
+
+	return peFileSection.data;
+}
+
+static bool applyRelocations(const BYTE * relocations, ULONG relocationSize, RELOCSECTION * sections, size_t count, DWORD_PTR newBase, ULONGLONG imageBase, DWORD sizeOfImage, RELOCPREPARE prepare, void * context, RELOCRESULT * result)
+{
+	__try
+	{
+		RelocApply(relocations, relocationSize, sections, count, imageBase - newBase, newBase, sizeOfImage, prepare, context, result);
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		return false;
+	}
+
+	return true;
+}
+
 BOOL PeParser::reBasePEImage(DWORD_PTR NewBase)
 {
-	PIMAGE_BASE_RELOCATION Relocations;
+	PBYTE Relocations;
 	PIMAGE_NT_HEADERS NtHeaders;
 	DWORD_PTR Delta;
-	ULONG RelocationSize = 0, Size = 0;
+	ULONG RelocationSize = 0;
+	RELOCRESULT Result;
 
 	if (isPE32())
 		NtHeaders = (PIMAGE_NT_HEADERS)pNTHeader32;
@@ -1643,50 +1691,37 @@ BOOL PeParser::reBasePEImage(DWORD_PTR NewBase)
 		return FALSE;
 	}
 
-	Relocations = (PIMAGE_BASE_RELOCATION)((PBYTE)NewBase + NtHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].VirtualAddress);
+	Relocations = (PBYTE)NewBase + NtHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].VirtualAddress;
 	RelocationSize = NtHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].Size;
 	Delta = NewBase - NtHeaders->OptionalHeader.ImageBase;
 #ifdef DEBUG_COMMENTS
 	DebugOutput("reBasePEImage: Relocations set to 0x%p, size 0x%x, Delta 0x%p, ImageBase 0x%p\n", Relocations, RelocationSize, Delta, NtHeaders->OptionalHeader.ImageBase);
 #endif
 
-	__try
-	{
-		while (RelocationSize > Size && Relocations->SizeOfBlock)
-		{
-			ULONG NumOfRelocs = (Relocations->SizeOfBlock - 8) / 2;
-			PUSHORT Reloc = (PUSHORT)((PUCHAR)Relocations + 8);
+	//sections are made writable only once a fixup is written to them
+	std::vector<RELOCSECTION> sections(listPeSection.size());
 
-#ifdef DEBUG_COMMENTS
-			DebugOutput("reBasePEImage: VirtualAddress: 0x%.8x; Number of Relocs: %d; Size: %d\n", Relocations->VirtualAddress, NumOfRelocs, Relocations->SizeOfBlock);
-#endif
-			for (ULONG i = 0; i < NumOfRelocs; i++)
-			{
-				if (Reloc[i] > 0)
-				{
-					PUCHAR *RVA = (PUCHAR*)((PBYTE)(DWORD_PTR)Relocations->VirtualAddress + (Reloc[i] & 0x0FFF));
-#ifndef _WIN64
-					PUCHAR VA = (PUCHAR)*((PULONG)(listPeSection[convertRVAToOffsetVectorIndex((DWORD_PTR)RVA)].data + convertRVAToOffsetRelative((DWORD_PTR)RVA)));
-					if ((unsigned int)VA - NewBase < (unsigned int)NtHeaders->OptionalHeader.SizeOfImage)
-						*((PULONG)(listPeSection[convertRVAToOffsetVectorIndex((DWORD_PTR)RVA)].data + convertRVAToOffsetRelative((DWORD_PTR)RVA))) -= (ULONG)((ULONGLONG)Delta);
-#else
-					PULONGLONG VA = (PULONGLONG)*((PULONGLONG)(listPeSection[convertRVAToOffsetVectorIndex((DWORD_PTR)RVA)].data + convertRVAToOffsetRelative((DWORD_PTR)RVA)));
-					if ((ULONGLONG)VA - NewBase < (ULONGLONG)NtHeaders->OptionalHeader.SizeOfImage)
-						*((PULONGLONG)(listPeSection[convertRVAToOffsetVectorIndex((DWORD_PTR)RVA)].data + convertRVAToOffsetRelative((DWORD_PTR)RVA))) -= (ULONGLONG)Delta;
-#endif
-				}
-			}
-
-			Relocations = (PIMAGE_BASE_RELOCATION)((PUCHAR)Relocations + Relocations->SizeOfBlock);
-			Size += Relocations->SizeOfBlock;
-		}
+	for (size_t i = 0; i < listPeSection.size(); i++)
+	{
+		sections[i].VirtualAddress = listPeSection[i].sectionHeader.VirtualAddress;
+		sections[i].VirtualSize = listPeSection[i].sectionHeader.Misc.VirtualSize;
+		sections[i].Data = listPeSection[i].data;
+		sections[i].DataSize = listPeSection[i].dataSize;
+		sections[i].Prepared = 0;
 	}
-	__except(EXCEPTION_EXECUTE_HANDLER)
+
+	if (!applyRelocations(Relocations, RelocationSize, sections.empty() ? 0 : &sections[0], sections.size(), NewBase, NtHeaders->OptionalHeader.ImageBase, NtHeaders->OptionalHeader.SizeOfImage, prepareRelocationTarget, this, &Result))
 	{
 		DebugOutput("reBasePEImage: Exception rebasing image from 0x%p to 0x%p.\n", NewBase, NtHeaders->OptionalHeader.ImageBase);
 		return FALSE;
 	}
 
+	if (Result.Malformed)
+		DebugOutput("reBasePEImage: Relocation directory at 0x%p malformed, %d fixups applied before it.\n", Relocations, (int)Result.Applied);
+#ifdef DEBUG_COMMENTS
+	DebugOutput("reBasePEImage: %d fixups applied, %d values outside the image, %d without section data, %d of unsupported types.\n", (int)Result.Applied, (int)Result.Unchanged, (int)Result.Outside, (int)Result.Unsupported);
+#endif
+
 	return TRUE;
 }
 
@@ -2054,6 +2089,9 @@ bool PeParser::updatePeHeaderChecksum(const CHAR * targetFile, DWORD fileSize)
 
 BYTE * PeParser::getSectionMemoryByIndex(int index)
 {
+	//callers patch the section, so it can't stay in place
+	makeSectionWritable(listPeSection[index]);
+
 	return listPeSection[index].data;
 }
 
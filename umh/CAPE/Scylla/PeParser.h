@@ -13,6 +13,7 @@ public:
 	BYTE * data;
 	DWORD dataSize;
 	DWORD normalSize;
+	bool isView; //data is in the image or file mapping it was read from, not ours to change or free
 
 	PeFileSection()
 	{
@@ -20,6 +21,7 @@ public:
 		data = 0;
 		dataSize = 0;
 		normalSize = 0;
+		isView = false;
 	}
 };
 
@@ -133,6 +135,10 @@ protected:
 	HANDLE hInfoFile;
 	DWORD fileSize;
 
+	HANDLE hMappedFile;
+	BYTE * mappedFile;
+	DWORD mappedFileSize;
+
 	SIZE_T SizeOfSlackData;
 	BYTE* SlackData;
 
@@ -146,11 +152,12 @@ protected:
 	DWORD getInitialHeaderReadSize( bool readSectionHeaders );
 	bool openFileHandle();
 	void closeFileHandle();
+	void mapFile();
+	void unmapFile();
 	void initClass();
 	
 	DWORD isMemoryNotNull( BYTE * data, int dataSize );
 	bool openWriteFileHandle( const CHAR * newFile );
-	bool writeZeroMemoryToFile(HANDLE hFile, DWORD fileOffset, DWORD size);
 
 	bool readPeSectionFromFile( DWORD readOffset, PeFileSection & peFileSection );
 	bool readPeSectionFromProcess( DWORD_PTR readOffset, PeFileSection & peFileSection );
@@ -158,6 +165,10 @@ protected:
 	bool readSectionFromProcess(const DWORD_PTR readOffset, PeFileSection & peFileSection );
 	bool readSectionFromFile(const DWORD readOffset, PeFileSection & peFileSection );
 	bool readSectionFrom(const DWORD_PTR readOffset, PeFileSection & peFileSection, const bool isProcess);
+	BYTE * getSectionView(const DWORD_PTR readOffset, DWORD readSize, const bool isProcess);
+	bool makeSectionWritable(PeFileSection & peFileSection);
+	static unsigned char * prepareRelocationTarget(void * context, size_t index);
+	bool writePeFile(HANDLE FileHandle, bool withSlackData, bool & sectionDataWritten);
 
 	
 	DWORD_PTR getStandardImagebase();
@@ -3,6 +3,7 @@
 #include <psapi.h>
 #include "NativeWinApi.h"
 #include "PeParser.h"
+#include "..\Signature.h"
 
 #pragma comment(lib, "Psapi.lib")
 
@@ -29,6 +30,8 @@ _CodeInfo ProcessAccessHelp::decomposerCi = {0};
 
 BYTE ProcessAccessHelp::fileHeaderFromDisk[PE_HEADER_BYTES_COUNT];
 
+MEMORYMAP ProcessAccessHelp::memoryMap = {0};
+
 bool ProcessAccessHelp::openProcessHandle(DWORD dwPID)
 {
 	if (dwPID > 0)
@@ -49,6 +52,7 @@ bool ProcessAccessHelp::openProcessHandle(DWORD dwPID)
 
 			if (hProcess)
 			{
+				resetMemoryMap();
 				return true;
 			}
 			else
@@ -106,14 +110,11 @@ void ProcessAccessHelp::closeProcessHandle()
 	moduleList.clear();
 	targetImageBase = 0;
 	selectedModule = 0;
+	resetMemoryMap();
 }
 
 bool ProcessAccessHelp::readMemoryPartlyFromProcess(DWORD_PTR address, SIZE_T size, LPVOID dataBuffer)
 {
-	DWORD_PTR addressPart = 0;
-	DWORD_PTR readBytes = 0;
-	DWORD_PTR bytesToRead = 0;
-	MEMORY_BASIC_INFORMATION memBasic = {0};
 	bool returnValue = false;
 
 	if (!hProcess)
@@ -126,49 +127,13 @@ bool ProcessAccessHelp::readMemoryPartlyFromProcess(DWORD_PTR address, SIZE_T si
 
 	if (!readMemoryFromProcess(address, size, dataBuffer))
 	{
-		addressPart = address;
+		//region by region, committed regions that follow on read together and zeroes for the rest
+		returnValue = MemoryMapRead(getMemoryMap(), address, size, dataBuffer) != 0;
 
-		do 
-		{
-			if (!VirtualQueryEx(ProcessAccessHelp::hProcess,(LPCVOID)addressPart,&memBasic,sizeof(memBasic)))
-			{
 #ifdef DEBUG_COMMENTS
-				DebugOutput("readMemoryPartlyFromProcess: Error VirtualQueryEx %X %X err: %u", addressPart,size, GetLastError());
+		if (!returnValue)
+			DebugOutput("readMemoryPartlyFromProcess: Error reading %X %X", address, size);
 #endif
-				break;
-			}
-
-			bytesToRead = memBasic.RegionSize;
-
-			if ( (readBytes+bytesToRead) > size)
-			{
-				bytesToRead = size - readBytes;
-			}
-
-			if (memBasic.State == MEM_COMMIT)
-			{
-				if (!readMemoryFromProcess(addressPart, bytesToRead, (LPVOID)((DWORD_PTR)dataBuffer + readBytes)))
-				{
-					break;
-				}
-			}
-			else
-			{
-				ZeroMemory((LPVOID)((DWORD_PTR)dataBuffer + readBytes),bytesToRead);
-			}
-
-
-			readBytes += bytesToRead;
-
-			addressPart += memBasic.RegionSize;
-
-		} while (readBytes < size);
-
-		if (readBytes == size)
-		{
-			returnValue = true;
-		}
-		
 	}
 	else
 	{
@@ -331,23 +296,23 @@ bool ProcessAccessHelp::disassembleMemory(BYTE * dataBuffer, SIZE_T bufferSize,
 
 DWORD_PTR ProcessAccessHelp::findPattern(DWORD_PTR startOffset, DWORD size, BYTE * pattern, const char * mask)
 {
-	DWORD pos = 0;
-	size_t searchLen = strlen(mask) - 1;
+	SIGPATTERN signature;
+	BYTE byteMask[SIG_MAX_LENGTH];
+	size_t length = strlen(mask);
+
+	if (length > SIG_MAX_LENGTH)
+		return 0;
 
-	for(DWORD_PTR retAddress = startOffset; retAddress < startOffset + size; retAddress++)
+	//'?' matches any byte, anything else must match
+	for (size_t i = 0; i < length; i++)
 	{
-		if( *(BYTE*)retAddress == pattern[pos] || mask[pos] == '?' )
-		{
-			if(mask[pos+1] == 0x00)
-			{
-				return (retAddress - searchLen);
-			}
-			pos++;
-		} else {
-			pos = 0;
-		}
+		byteMask[i] = (mask[i] == '?') ? 0x00 : 0xFF;
 	}
-	return 0;
+
+	if (!SigFromMask(&signature, pattern, byteMask, length))
+		return 0;
+
+	return (DWORD_PTR)SigFind(&signature, (const void *)startOffset, size);
 }
 
 bool ProcessAccessHelp::readHeaderFromCurrentFile(const CHAR * filePath)
@@ -729,7 +694,7 @@ bool ProcessAccessHelp::getMemoryRegionFromAddress(DWORD_PTR address, DWORD_PTR
 {
 	MEMORY_BASIC_INFORMATION memBasic;
 
-	if (VirtualQueryEx(hProcess,(LPCVOID)address,&memBasic,sizeof(MEMORY_BASIC_INFORMATION)) != sizeof(MEMORY_BASIC_INFORMATION))
+	if (!queryMemory(address, &memBasic))
 	{
 #ifdef DEBUG_COMMENTS
 		ErrorOutput("getMemoryRegionFromAddress: VirtualQueryEx");
@@ -744,6 +709,73 @@ bool ProcessAccessHelp::getMemoryRegionFromAddress(DWORD_PTR address, DWORD_PTR
 	}
 }
 
+bool ProcessAccessHelp::queryMemory(DWORD_PTR address, MEMORY_BASIC_INFORMATION * memBasic)
+{
+	PMEMREGION region = MemoryMapQuery(getMemoryMap(), address);
+
+	if (!region)
+	{
+		return false;
+	}
+
+	ZeroMemory(memBasic, sizeof(MEMORY_BASIC_INFORMATION));
+	memBasic->BaseAddress = (PVOID)(DWORD_PTR)region->Base;
+	memBasic->AllocationBase = (PVOID)(DWORD_PTR)region->AllocationBase;
+	memBasic->AllocationProtect = region->AllocationProtect;
+	memBasic->RegionSize = (SIZE_T)region->Size;
+	memBasic->State = region->State;
+	memBasic->Protect = region->Protect;
+	memBasic->Type = region->Type;
+
+	return true;
+}
+
+void ProcessAccessHelp::mapMemoryRange(DWORD_PTR address, SIZE_T size)
+{
+	MemoryMapAddRange(getMemoryMap(), address, size);
+}
+
+void ProcessAccessHelp::resetMemoryMap()
+{
+	MemoryMapReset(getMemoryMap());
+}
+
+PMEMORYMAP ProcessAccessHelp::getMemoryMap()
+{
+	if (!memoryMap.Os.Query)
+	{
+		MEMORYOS os = { queryMemoryRegion, readMemoryRegion, 0 };
+		MemoryMapInit(&memoryMap, &os);
+	}
+
+	return &memoryMap;
+}
+
+int ProcessAccessHelp::queryMemoryRegion(void * context, uint64_t address, PMEMREGION region)
+{
+	MEMORY_BASIC_INFORMATION memBasic;
+
+	if ((DWORD_PTR)address != address || VirtualQueryEx(hProcess, (LPCVOID)(DWORD_PTR)address, &memBasic, sizeof(MEMORY_BASIC_INFORMATION)) != sizeof(MEMORY_BASIC_INFORMATION))
+	{
+		return 0;
+	}
+
+	region->Base = (DWORD_PTR)memBasic.BaseAddress;
+	region->Size = memBasic.RegionSize;
+	region->AllocationBase = (DWORD_PTR)memBasic.AllocationBase;
+	region->AllocationProtect = memBasic.AllocationProtect;
+	region->State = memBasic.State;
+	region->Protect = memBasic.Protect;
+	region->Type = memBasic.Type;
+
+	return 1;
+}
+
+int ProcessAccessHelp::readMemoryRegion(void * context, uint64_t address, void * buffer, size_t size)
+{
+	return readMemoryFromProcess((DWORD_PTR)address, size, buffer);
+}
+
 bool ProcessAccessHelp::getSizeOfImageCurrentProcess()
 {
 	DWORD_PTR newSizeOfImage = getSizeOfImageProcess(ProcessAccessHelp::hProcess, ProcessAccessHelp::targetImageBase);
@@ -878,6 +910,7 @@ DWORD ProcessAccessHelp::getModuleHandlesFromProcess(const HANDLE hProcess, HMOD
 void ProcessAccessHelp::setCurrentProcessAsTarget()
 {
 	ProcessAccessHelp::hProcess = GetCurrentProcess();
+	resetMemoryMap();
 }
 
 bool ProcessAccessHelp::suspendProcess()
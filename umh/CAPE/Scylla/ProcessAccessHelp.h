@@ -3,6 +3,7 @@
 #include <windows.h>
 #include <tlhelp32.h>
 #include <vector>
+#include "..\MemoryMap.h"
 
 /************************************************************************/
 /* distorm															  */
@@ -98,6 +99,8 @@ public:
 
 	static BYTE fileHeaderFromDisk[PE_HEADER_BYTES_COUNT];
 
+	static MEMORYMAP memoryMap; //regions of the target queried during this dump
+
 
 	//for decomposer
 	static _DInst decomposerResult[MAX_INSTRUCTIONS];
@@ -179,7 +182,7 @@ public:
 	static bool decomposeMemory(BYTE * dataBuffer, SIZE_T bufferSize, DWORD_PTR startAddress);
 
 	/*
-	 * Search for pattern
+	 * Search for pattern, '?' in mask for any byte
 	 */
 	static DWORD_PTR findPattern(DWORD_PTR startOffset, DWORD size, BYTE * pattern, const char * mask);
 
@@ -193,6 +196,17 @@ public:
 	 */
 	static bool getMemoryRegionFromAddress(DWORD_PTR address, DWORD_PTR * memoryRegionBase, SIZE_T * memoryRegionSize);
 
+	/*
+	 * VirtualQueryEx answered from the regions already queried during this dump
+	 */
+	static bool queryMemory(DWORD_PTR address, MEMORY_BASIC_INFORMATION * memBasic);
+
+	/*
+	 * Query the regions of a range in one pass, forget them when the target changes
+	 */
+	static void mapMemoryRange(DWORD_PTR address, SIZE_T size);
+	static void resetMemoryMap();
+
 
 	/*
 	 * Read PE Header from file
@@ -228,4 +242,9 @@ public:
 	static bool isPageExecutable( DWORD Protect );
 	static bool isPageAccessable( DWORD Protect );
 	static SIZE_T getSizeOfImageProcessNative( HANDLE processHandle, DWORD_PTR moduleBase );
+
+private:
+	static PMEMORYMAP getMemoryMap();
+	static int queryMemoryRegion(void * context, uint64_t address, PMEMREGION region);
+	static int readMemoryRegion(void * context, uint64_t address, void * buffer, size_t size);
 };
@@ -23,6 +23,7 @@ along with this program.If not, see <http://www.gnu.org/licenses/>.
 #include "Scylla\IATSearch.h"
 #include "Scylla\ImportRebuilder.h"
 #include "Scylla\ImportsHandling.h"
+#include "ExportIndex.h"
 
 typedef unsigned __int64 QWORD;
 
@@ -56,6 +57,8 @@ void ScyllaInit(HANDLE hProcess)
 	if (hProcess)
 	{
 		ProcessAccessHelp::hProcess = hProcess;
+		ProcessAccessHelp::resetMemoryMap();
+		ProcessAccessHelp::moduleList.clear();
 		ProcessAccessHelp::getProcessModules(ProcessAccessHelp::hProcess, ProcessAccessHelp::moduleList);
 	}
 	else
@@ -65,6 +68,20 @@ void ScyllaInit(HANDLE hProcess)
 	}
 }
 
+//**************************************************************************************
+extern "C" void ScyllaModuleLoaded(DWORD_PTR ModuleBase, const char *ModuleName)
+//**************************************************************************************
+{
+	ExportCacheModuleLoaded(ApiReader::exportCache, ModuleBase, ModuleName);
+}
+
+//**************************************************************************************
+extern "C" void ScyllaModuleUnloaded(DWORD_PTR ModuleBase)
+//**************************************************************************************
+{
+	ExportCacheModuleUnloaded(ApiReader::exportCache, ModuleBase);
+}
+
 //**************************************************************************************
 extern "C" DWORD_PTR GetEntryPointVA(DWORD_PTR ModuleBase)
 //**************************************************************************************
@@ -331,6 +348,9 @@ extern "C" int ScyllaDumpProcess(HANDLE hProcess, DWORD_PTR ModuleBase, DWORD_PT
 
 	if (FixImports)
 	{
+		//  Read the exports of every module, reusing those read by earlier dumps for modules that haven't changed
+		apiReader.readApisFromModuleList();
+
 		//  We'll try the simple search first
 		IAT_Found = iatSearch.searchImportAddressTableInProcess(entrypoint, &addressIAT, &sizeIAT, FALSE);
 
@@ -776,10 +796,10 @@ extern "C" BOOL ScyllaGetSectionByName(PVOID ImageBase, char* Name, PVOID* Secti
 extern "C" PCHAR ScyllaGetExportNameByScan(PVOID Address, PCHAR* ModuleName, SIZE_T ScanSize)
 //**************************************************************************************
 {
-	ApiReader apiReader;
-	ApiInfo* apiInfo = NULL;
 	unsigned int ModuleIndex = 0;
-	bool dummy = 0;
+	PEXPORTINDEX Index;
+	EXPORTINFO Info;
+	PCHAR FunctionName = NULL;
 
 	ScyllaInit(NULL);
 
@@ -796,69 +816,38 @@ extern "C" PCHAR ScyllaGetExportNameByScan(PVOID Address, PCHAR* ModuleName, SIZ
 		return NULL;
 	}
 
-	PVOID ModuleBase = GetAllocationBase(Address);
+	ModuleInfo *Module = &ProcessAccessHelp::ownModuleList[ModuleIndex-1];
 
-	if (!ModuleBase)
-	{
-#ifdef DEBUG_COMMENTS
-		DebugOutput("ScyllaGetExportNameByScan: GetAllocationBase failed for 0x%p.\n", Address);
-#endif
-		return NULL;
-	}
-#ifdef DEBUG_COMMENTS
-	else
-		DebugOutput("ScyllaGetExportNameByScan: AllocationBase 0x%p for 0x%p.\n", ModuleBase, Address);
-#endif
+	// The module's shared export index, as used for hooking and by the unpacker
+	Index = ExportIndexAcquire(Module->modBaseAddr);
 
-	PeParser *peFile = new PeParser((DWORD_PTR)ModuleBase, true);
-
-	if (!peFile->isValidPeFile())
+	if (!Index)
 	{
 #ifdef DEBUG_COMMENTS
-		DebugOutput("ScyllaGetExportNameByScan: Invalid PE image at 0x%p.\n", Address);
+		DebugOutput("ScyllaGetExportNameByScan: Invalid PE image at 0x%p.\n", Module->modBaseAddr);
 #endif
-		delete peFile;
 		return NULL;
 	}
 
-	if (!peFile->hasExportDirectory())
-	{
-#ifdef DEBUG_COMMENTS
-		DebugOutput("ScyllaGetExportNameByScan: Module has no exports.\n");
-#endif
-		delete peFile;
-		return NULL;
-	}
-
-	apiReader.clearAll();
+	if (ScanSize && ExportIndexLookupRva(Index, (uint32_t)((DWORD_PTR)Address - Module->modBaseAddr), (uint32_t)(ScanSize - 1), &Info))
+		FunctionName = (PCHAR)Info.Name;
 
-	// This creates moduleInfo->apiList
-	apiReader.parseModuleWithOwnProcess(&ProcessAccessHelp::ownModuleList[ModuleIndex-1]);
+	ExportIndexRelease(Index);
 
-	for (unsigned int i=0; i < ScanSize; i++)
-	{
-		apiInfo = apiReader.getApiByVirtualAddress((DWORD_PTR)Address-i, &dummy);
-		if (apiInfo)
-			break;
-	}
-
-	if (apiInfo)
+	if (FunctionName)
 	{
 		if (ModuleName)
-			*ModuleName = apiInfo->module->fullPath;
+			*ModuleName = Module->fullPath;
 #ifdef DEBUG_COMMENTS
-		DebugOutput("ScyllaGetExportNameByScan: Located function %s within module %s.\n", apiInfo->name, apiInfo->module->fullPath);
+		DebugOutput("ScyllaGetExportNameByScan: Located function %s within module %s.\n", FunctionName, Module->fullPath);
 #endif
-		delete peFile;
-		return (PCHAR)apiInfo->name;
 	}
 #ifdef DEBUG_COMMENTS
 	else
 		DebugOutput("ScyllaGetExportNameByScan: Failed to locate function among module exports.\n");
 #endif
 
-	delete peFile;
-	return NULL;
+	return FunctionName;
 }
 
 //**************************************************************************************
@@ -0,0 +1,462 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "Signature.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SIG_SSE2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define VECTOR_SIZE 16
+#define SIG_MIN_CAPACITY 16
+#define ANCHOR_BYTE (1 << 16)
+#define ANCHOR_PAIR (2 << 16)
+
+// Bytes most often found in x86 and x64 code, most common first; an anchor
+// is chosen to avoid them
+static const unsigned char CommonBytes[] =
+{
+	0x00, 0xFF, 0x8B, 0x48, 0xCC, 0x89, 0x24, 0x44, 0x0F, 0x4C, 0xE8, 0x83,
+	0x8D, 0x85, 0x01, 0xC3, 0x74, 0x75, 0x84, 0x45, 0xC0, 0x90, 0x08, 0x10,
+	0x04, 0x20, 0x40, 0x80, 0x49, 0x41, 0x33, 0xC7, 0x55, 0xEC, 0x50, 0x5D,
+	0xE9, 0xEB, 0x8E, 0x02, 0x03, 0x18, 0x28, 0x30, 0x38, 0xF8, 0xB8, 0x6A
+};
+
+static __inline unsigned int LowestSetBit(unsigned int Mask)
+{
+#ifdef _MSC_VER
+	unsigned long Index;
+	_BitScanForward(&Index, Mask);
+	return (unsigned int)Index;
+#else
+	return (unsigned int)__builtin_ctz(Mask);
+#endif
+}
+
+static unsigned int Rarity(unsigned char Byte)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(CommonBytes); i++)
+		if (CommonBytes[i] == Byte)
+			return i;
+
+	return sizeof(CommonBytes);
+}
+
+static void ChooseAnchor(PSIGPATTERN Pattern)
+{
+	unsigned int Best = 0, Score;
+	uint32_t i;
+
+	Pattern->Anchor = 0;
+	Pattern->AnchorSize = 0;
+
+	for (i = 0; i + 1 < Pattern->Length; i++)
+	{
+		if (Pattern->Mask[i] != 0xFF || Pattern->Mask[i + 1] != 0xFF)
+			continue;
+		Score = Rarity(Pattern->Bytes[i]) + Rarity(Pattern->Bytes[i + 1]) + 1;
+		if (Score > Best)
+		{
+			Best = Score;
+			Pattern->Anchor = i;
+			Pattern->AnchorSize = 2;
+		}
+	}
+
+	if (Pattern->AnchorSize)
+		return;
+
+	for (i = 0; i < Pattern->Length; i++)
+	{
+		if (Pattern->Mask[i] != 0xFF)
+			continue;
+		Score = Rarity(Pattern->Bytes[i]) + 1;
+		if (Score > Best)
+		{
+			Best = Score;
+			Pattern->Anchor = i;
+			Pattern->AnchorSize = 1;
+		}
+	}
+}
+
+static int HexDigit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+int SigParse(const char *Text, PSIGPATTERN Pattern)
+{
+	const char *Token;
+	size_t TokenLength;
+	int High, Low;
+
+	memset(Pattern, 0, sizeof(*Pattern));
+
+	while (*Text)
+	{
+		if (*Text == ' ' || *Text == '\t')
+		{
+			Text++;
+			continue;
+		}
+
+		Token = Text;
+		while (*Text && *Text != ' ' && *Text != '\t')
+			Text++;
+		TokenLength = Text - Token;
+
+		if (Pattern->Length == SIG_MAX_LENGTH)
+			return 0;
+
+		if (TokenLength == 1 && Token[0] == '?')
+		{
+			Pattern->Length++;
+			continue;
+		}
+
+		if (TokenLength != 2)
+			return 0;
+
+		High = Token[0] == '?' ? 0 : HexDigit(Token[0]);
+		Low = Token[1] == '?' ? 0 : HexDigit(Token[1]);
+		if (High < 0 || Low < 0)
+			return 0;
+
+		Pattern->Bytes[Pattern->Length] = (unsigned char)(High << 4 | Low);
+		Pattern->Mask[Pattern->Length] = (unsigned char)((Token[0] == '?' ? 0 : 0xF0) | (Token[1] == '?' ? 0 : 0x0F));
+		Pattern->Length++;
+	}
+
+	if (!Pattern->Length)
+		return 0;
+
+	ChooseAnchor(Pattern);
+	return 1;
+}
+
+int SigFromMask(PSIGPATTERN Pattern, const void *Bytes, const void *Mask, size_t Length)
+{
+	size_t i;
+
+	memset(Pattern, 0, sizeof(*Pattern));
+
+	if (!Length || Length > SIG_MAX_LENGTH)
+		return 0;
+
+	for (i = 0; i < Length; i++)
+	{
+		Pattern->Mask[i] = ((const unsigned char*)Mask)[i];
+		Pattern->Bytes[i] = ((const unsigned char*)Bytes)[i] & Pattern->Mask[i];
+	}
+	Pattern->Length = (uint32_t)Length;
+
+	ChooseAnchor(Pattern);
+	return 1;
+}
+
+static __inline int Matches(const SIGPATTERN *Pattern, const unsigned char *Data)
+{
+	uint32_t i;
+
+	for (i = 0; i < Pattern->Length; i++)
+		if ((Data[i] & Pattern->Mask[i]) != Pattern->Bytes[i])
+			return 0;
+
+	return 1;
+}
+
+static uint32_t AnchorKey(const SIGPATTERN *Pattern)
+{
+	if (Pattern->AnchorSize == 2)
+		return ANCHOR_PAIR | Pattern->Bytes[Pattern->Anchor] | Pattern->Bytes[Pattern->Anchor + 1] << 8;
+	if (Pattern->AnchorSize == 1)
+		return ANCHOR_BYTE | Pattern->Bytes[Pattern->Anchor];
+	return 0;
+}
+
+void SigSetInit(PSIGSET Set)
+{
+	memset(Set, 0, sizeof(*Set));
+}
+
+void SigSetFree(PSIGSET Set)
+{
+	free(Set->Patterns);
+	free(Set->Anchors);
+	free(Set->PairMap);
+	SigSetInit(Set);
+}
+
+int SigSetAdd(PSIGSET Set, const SIGPATTERN *Pattern)
+{
+	if (Set->Count == Set->Capacity)
+	{
+		size_t NewCapacity = Set->Capacity ? Set->Capacity * 2 : SIG_MIN_CAPACITY;
+		PSIGPATTERN NewPatterns = realloc(Set->Patterns, NewCapacity * sizeof(SIGPATTERN));
+		if (!NewPatterns)
+			return 0;
+		Set->Patterns = NewPatterns;
+		Set->Capacity = NewCapacity;
+	}
+
+	Set->Patterns[Set->Count++] = *Pattern;
+	return 1;
+}
+
+static int CompareAnchors(const void *a, const void *b)
+{
+	const SIGANCHOR *First = a, *Second = b;
+
+	if (First->Key != Second->Key)
+		return First->Key < Second->Key ? -1 : 1;
+
+	return First->Index < Second->Index ? -1 : First->Index > Second->Index;
+}
+
+int SigSetCompile(PSIGSET Set)
+{
+	PSIGANCHOR Anchors;
+	unsigned char *PairMap;
+	size_t i;
+
+	Anchors = realloc(Set->Anchors, (Set->Count ? Set->Count : 1) * sizeof(SIGANCHOR));
+	if (!Anchors)
+		return 0;
+	Set->Anchors = Anchors;
+
+	PairMap = Set->PairMap ? Set->PairMap : malloc(0x10000 / 8);
+	if (!PairMap)
+		return 0;
+	Set->PairMap = PairMap;
+
+	memset(PairMap, 0, 0x10000 / 8);
+	memset(Set->Starts, 0, sizeof(Set->Starts));
+	Set->Unanchored = 0;
+
+	for (i = 0; i < Set->Count; i++)
+	{
+		const SIGPATTERN *Pattern = &Set->Patterns[i];
+		uint32_t Key = AnchorKey(Pattern);
+
+		Anchors[i].Key = Key;
+		Anchors[i].Index = (uint32_t)i;
+
+		if (Pattern->AnchorSize == 2)
+		{
+			PairMap[(Key & 0xFFFF) >> 3] |= 1 << (Key & 7);
+			Set->Starts[Key & 0xFF] |= 2;
+		}
+		else if (Pattern->AnchorSize == 1)
+			Set->Starts[Key & 0xFF] |= 1;
+		else
+			Set->Unanchored++;
+	}
+
+	qsort(Anchors, Set->Count, sizeof(SIGANCHOR), CompareAnchors);
+	Set->Compiled = Set->Count;
+
+	return 1;
+}
+
+typedef struct SigReport
+{
+	SIGMATCH	Match;
+	void		*Context;
+	size_t		Count;
+	int			Stop;
+} SIGREPORT, *PSIGREPORT;
+
+static __inline void Report(PSIGREPORT Report, size_t Index, const unsigned char *Match)
+{
+	Report->Count++;
+	if (Report->Match && Report->Match(Report->Context, Index, Match))
+		Report->Stop = 1;
+}
+
+static void ScanOne(const SIGPATTERN *Pattern, size_t Index, const unsigned char *Data, size_t Size, PSIGREPORT Result)
+{
+	size_t Positions, i = 0;
+	const unsigned char *Anchor;
+	unsigned char First, Second;
+
+	if (Pattern->Length > Size)
+		return;
+
+	Positions = Size - Pattern->Length + 1;
+
+	if (!Pattern->AnchorSize)
+	{
+		for (i = 0; i < Positions && !Result->Stop; i++)
+			if (Matches(Pattern, Data + i))
+				Report(Result, Index, Data + i);
+		return;
+	}
+
+	Anchor = Data + Pattern->Anchor;
+	First = Pattern->Bytes[Pattern->Anchor];
+	Second = Pattern->AnchorSize == 2 ? Pattern->Bytes[Pattern->Anchor + 1] : 0;
+
+#ifdef SIG_SSE2
+	{
+		const __m128i VectorFirst = _mm_set1_epi8((char)First), VectorSecond = _mm_set1_epi8((char)Second);
+		unsigned int Candidates;
+
+		for (; i + VECTOR_SIZE <= Positions && !Result->Stop; i += VECTOR_SIZE)
+		{
+			__m128i Equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(Anchor + i)), VectorFirst);
+			if (Pattern->AnchorSize == 2)
+				Equal = _mm_and_si128(Equal, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(Anchor + i + 1)), VectorSecond));
+			Candidates = (unsigned int)_mm_movemask_epi8(Equal);
+
+			while (Candidates && !Result->Stop)
+			{
+				size_t Position = i + LowestSetBit(Candidates);
+				if (Matches(Pattern, Data + Position))
+					Report(Result, Index, Data + Position);
+				Candidates &= Candidates - 1;
+			}
+		}
+	}
+#endif
+
+	for (; i < Positions && !Result->Stop; i++)
+	{
+		if (Anchor[i] != First || (Pattern->AnchorSize == 2 && Anchor[i + 1] != Second))
+			continue;
+		if (Matches(Pattern, Data + i))
+			Report(Result, Index, Data + i);
+	}
+}
+
+// The first of the anchors with Key
+static size_t FindAnchor(const SIGSET *Set, uint32_t Key)
+{
+	size_t Low = Set->Unanchored, High = Set->Count, Middle;
+
+	while (Low < High)
+	{
+		Middle = Low + (High - Low) / 2;
+		if (Set->Anchors[Middle].Key < Key)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	return Low;
+}
+
+// Checks the signatures with Key anchored at Position
+static void CheckAnchored(const SIGSET *Set, uint32_t Key, const unsigned char *Data, size_t Size, size_t Position, PSIGREPORT Result)
+{
+	size_t i;
+
+	for (i = FindAnchor(Set, Key); i < Set->Count && Set->Anchors[i].Key == Key && !Result->Stop; i++)
+	{
+		const SIGPATTERN *Pattern = &Set->Patterns[Set->Anchors[i].Index];
+		size_t Start = Position - Pattern->Anchor;
+
+		if (Position < Pattern->Anchor || Pattern->Length > Size - Start)
+			continue;
+		if (Matches(Pattern, Data + Start))
+			Report(Result, Set->Anchors[i].Index, Data + Start);
+	}
+}
+
+size_t SigSetScan(const SIGSET *Set, const void *Data, size_t Size, SIGMATCH Match, void *Context)
+{
+	const unsigned char *Bytes = Data;
+	SIGREPORT Result = { Match, Context, 0, 0 };
+	size_t i, j;
+
+	if (Set->Count == 1)
+	{
+		ScanOne(&Set->Patterns[0], 0, Bytes, Size, &Result);
+		return Result.Count;
+	}
+
+	if (!Set->Count || Set->Compiled != Set->Count)
+		return 0;
+
+	for (i = 0; i < Size && !Result.Stop; i++)
+	{
+		unsigned char Starts;
+
+		// without unanchored signatures, skip to the next anchor's first byte
+		if (!Set->Unanchored)
+		{
+			while (i < Size && !Set->Starts[Bytes[i]])
+				i++;
+			if (i == Size)
+				break;
+		}
+
+		for (j = 0; j < Set->Unanchored && !Result.Stop; j++)
+		{
+			const SIGPATTERN *Pattern = &Set->Patterns[Set->Anchors[j].Index];
+			if (Pattern->Length <= Size - i && Matches(Pattern, Bytes + i))
+				Report(&Result, Set->Anchors[j].Index, Bytes + i);
+		}
+
+		Starts = Set->Starts[Bytes[i]];
+		if (!Starts)
+			continue;
+
+		if (Starts & 1)
+			CheckAnchored(Set, ANCHOR_BYTE | Bytes[i], Bytes, Size, i, &Result);
+
+		if ((Starts & 2) && i + 1 < Size)
+		{
+			uint32_t Pair = Bytes[i] | Bytes[i + 1] << 8;
+			if (Set->PairMap[Pair >> 3] & (1 << (Pair & 7)))
+				CheckAnchored(Set, ANCHOR_PAIR | Pair, Bytes, Size, i, &Result);
+		}
+	}
+
+	return Result.Count;
+}
+
+static int StopAtFirst(void *Context, size_t Index, const unsigned char *Match)
+{
+	(void)Index;
+	*(const unsigned char**)Context = Match;
+	return 1;
+}
+
+const unsigned char *SigFind(const SIGPATTERN *Pattern, const void *Data, size_t Size)
+{
+	const unsigned char *First = NULL;
+	SIGREPORT Result = { StopAtFirst, &First, 0, 0 };
+
+	ScanOne(Pattern, 0, Data, Size, &Result);
+	return First;
+}
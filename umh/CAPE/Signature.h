@@ -0,0 +1,96 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Masked byte signatures searched for in code, many in one pass. Signatures
+// are written the way IDA writes them, bytes in hex separated by spaces,
+// with ? or ?? for a byte that may be anything and ? in place of a digit for
+// a nibble that may: "8B FF 55 8B EC", "E8 ?? ?? ?? ??", "B? 78 56 34 12".
+// Each is anchored on its rarest pair of adjacent fixed bytes, or its rarest
+// fixed byte if no two are adjacent. A set is searched by looking each pair
+// of bytes up in a bitmap of its anchors and checking only the signatures
+// anchored there; a set of one is filtered sixteen positions at a time on
+// its anchor, as StrSearch filters. A signature with no fixed byte at all is
+// checked at every position.
+
+#define SIG_MAX_LENGTH	128
+
+typedef struct SigPattern
+{
+	unsigned char	Bytes[SIG_MAX_LENGTH];
+	unsigned char	Mask[SIG_MAX_LENGTH];	// the bits of each byte that must match
+	uint32_t		Length;
+	uint32_t		Anchor;		// offset of the anchor
+	uint32_t		AnchorSize;	// 2 for a pair, 1 for a byte, 0 for none
+} SIGPATTERN, *PSIGPATTERN;
+
+typedef struct SigAnchor
+{
+	uint32_t	Key;	// AnchorSize << 16 | the anchor's bytes, low first
+	uint32_t	Index;
+} SIGANCHOR, *PSIGANCHOR;
+
+typedef struct SigSet
+{
+	PSIGPATTERN		Patterns;
+	size_t			Count;
+	size_t			Capacity;
+	size_t			Compiled;		// signatures SigSetCompile has seen
+	PSIGANCHOR		Anchors;		// by key, signatures without an anchor first
+	size_t			Unanchored;
+	unsigned char	*PairMap;		// a bit for each anchor pair
+	unsigned char	Starts[256];	// 1 where a byte anchor is, 2 where a pair starts
+} SIGSET, *PSIGSET;
+
+// Called for each match with the index of the signature, in the order the
+// signatures were added, and where it matched. Returning non-zero ends the
+// search.
+typedef int (*SIGMATCH)(void *Context, size_t Index, const unsigned char *Match);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns 0 if Text isn't a signature or is longer than SIG_MAX_LENGTH
+int SigParse(const char *Text, PSIGPATTERN Pattern);
+
+// A signature from bytes and the bits of each that must match
+int SigFromMask(PSIGPATTERN Pattern, const void *Bytes, const void *Mask, size_t Length);
+
+void SigSetInit(PSIGSET Set);
+void SigSetFree(PSIGSET Set);
+
+// Returns 0 on allocation failure. Signatures can be added until the set is
+// compiled, and after it only if it is compiled again.
+int SigSetAdd(PSIGSET Set, const SIGPATTERN *Pattern);
+int SigSetCompile(PSIGSET Set);
+
+// Reports the matches lying wholly inside the Size bytes at Data, returning
+// how many were reported. A signature's matches are reported in address
+// order, and matches of different signatures in the order of their anchors.
+size_t SigSetScan(const SIGSET *Set, const void *Data, size_t Size, SIGMATCH Match, void *Context);
+
+// The first match of one signature, or NULL
+const unsigned char *SigFind(const SIGPATTERN *Pattern, const void *Data, size_t Size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,310 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "StrSearch.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define STR_SEARCH_SSE2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#else
+#define NO_SANITIZE_ADDRESS
+#endif
+
+#define VECTOR_SIZE 16
+
+// Terminated haystacks are measured and searched a chunk at a time
+#define FIRST_CHUNK 0x400
+#define MAX_CHUNK 0x100000
+
+#define IS_ALIGNED(p, n) (((uintptr_t)(p) & ((n) - 1)) == 0)
+
+static __inline unsigned int LowestSetBit(unsigned int Mask)
+{
+#ifdef _MSC_VER
+	unsigned long Index;
+	_BitScanForward(&Index, Mask);
+	return (unsigned int)Index;
+#else
+	return (unsigned int)__builtin_ctz(Mask);
+#endif
+}
+
+static __inline unsigned int FoldChar(unsigned int c)
+{
+	return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+// The bit that tells the cases of a letter apart, to be set on both sides of
+// a comparison, or 0 if c must match exactly
+static __inline unsigned int CaseBit(unsigned int c, int Fold)
+{
+	c = FoldChar(c);
+	return Fold && c >= 'a' && c <= 'z' ? 0x20 : 0;
+}
+
+static int EqualBytes(const unsigned char *a, const unsigned char *b, size_t Length, int Fold)
+{
+	size_t i;
+
+	if (!Fold)
+		return !memcmp(a, b, Length);
+
+	for (i = 0; i < Length; i++)
+		if (FoldChar(a[i]) != FoldChar(b[i]))
+			return 0;
+
+	return 1;
+}
+
+static int EqualUnits(const uint16_t *a, const uint16_t *b, size_t Length, int Fold)
+{
+	size_t i;
+
+	if (!Fold)
+		return !memcmp(a, b, Length * sizeof(uint16_t));
+
+	for (i = 0; i < Length; i++)
+		if (FoldChar(a[i]) != FoldChar(b[i]))
+			return 0;
+
+	return 1;
+}
+
+static const unsigned char *SearchBytes(const unsigned char *Haystack, size_t Length, const unsigned char *Needle, size_t NeedleLength, int Fold)
+{
+	unsigned int First, Last, FirstBit, LastBit;
+	size_t Positions, i = 0;
+
+	if (!NeedleLength)
+		return Haystack;
+
+	if (NeedleLength > Length)
+		return NULL;
+
+	if (NeedleLength == 1 && !Fold)
+		return (const unsigned char*)memchr(Haystack, Needle[0], Length);
+
+	FirstBit = CaseBit(Needle[0], Fold);
+	First = Needle[0] | FirstBit;
+	LastBit = CaseBit(Needle[NeedleLength - 1], Fold);
+	Last = Needle[NeedleLength - 1] | LastBit;
+	Positions = Length - NeedleLength + 1;
+
+#ifdef STR_SEARCH_SSE2
+	{
+		const __m128i VectorFirst = _mm_set1_epi8((char)First), VectorFirstBit = _mm_set1_epi8((char)FirstBit);
+		const __m128i VectorLast = _mm_set1_epi8((char)Last), VectorLastBit = _mm_set1_epi8((char)LastBit);
+
+		for (; Positions - i >= VECTOR_SIZE; i += VECTOR_SIZE)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i*)(Haystack + i));
+			__m128i b = _mm_loadu_si128((const __m128i*)(Haystack + i + NeedleLength - 1));
+			unsigned int Mask = _mm_movemask_epi8(_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_or_si128(a, VectorFirstBit), VectorFirst),
+				_mm_cmpeq_epi8(_mm_or_si128(b, VectorLastBit), VectorLast)));
+
+			while (Mask)
+			{
+				size_t Offset = i + LowestSetBit(Mask);
+
+				if (NeedleLength <= 2 || EqualBytes(Haystack + Offset + 1, Needle + 1, NeedleLength - 2, Fold))
+					return Haystack + Offset;
+
+				Mask &= Mask - 1;
+			}
+		}
+	}
+#endif
+
+	for (; i < Positions; i++)
+	{
+		if ((Haystack[i] | FirstBit) != First || (Haystack[i + NeedleLength - 1] | LastBit) != Last)
+			continue;
+
+		if (NeedleLength <= 2 || EqualBytes(Haystack + i + 1, Needle + 1, NeedleLength - 2, Fold))
+			return Haystack + i;
+	}
+
+	return NULL;
+}
+
+static const uint16_t *SearchUnits(const uint16_t *Haystack, size_t Length, const uint16_t *Needle, size_t NeedleLength, int Fold)
+{
+	unsigned int First, Last, FirstBit, LastBit;
+	size_t Positions, i = 0;
+
+	if (!NeedleLength)
+		return Haystack;
+
+	if (NeedleLength > Length)
+		return NULL;
+
+	FirstBit = CaseBit(Needle[0], Fold);
+	First = Needle[0] | FirstBit;
+	LastBit = CaseBit(Needle[NeedleLength - 1], Fold);
+	Last = Needle[NeedleLength - 1] | LastBit;
+	Positions = Length - NeedleLength + 1;
+
+#ifdef STR_SEARCH_SSE2
+	{
+		const __m128i VectorFirst = _mm_set1_epi16((short)First), VectorFirstBit = _mm_set1_epi16((short)FirstBit);
+		const __m128i VectorLast = _mm_set1_epi16((short)Last), VectorLastBit = _mm_set1_epi16((short)LastBit);
+
+		for (; Positions - i >= VECTOR_SIZE / 2; i += VECTOR_SIZE / 2)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i*)(Haystack + i));
+			__m128i b = _mm_loadu_si128((const __m128i*)(Haystack + i + NeedleLength - 1));
+			unsigned int Mask = _mm_movemask_epi8(_mm_and_si128(
+				_mm_cmpeq_epi16(_mm_or_si128(a, VectorFirstBit), VectorFirst),
+				_mm_cmpeq_epi16(_mm_or_si128(b, VectorLastBit), VectorLast))) & 0x5555;
+
+			while (Mask)
+			{
+				size_t Offset = i + LowestSetBit(Mask) / 2;
+
+				if (NeedleLength <= 2 || EqualUnits(Haystack + Offset + 1, Needle + 1, NeedleLength - 2, Fold))
+					return Haystack + Offset;
+
+				Mask &= Mask - 1;
+			}
+		}
+	}
+#endif
+
+	for (; i < Positions; i++)
+	{
+		if ((Haystack[i] | FirstBit) != First || (Haystack[i + NeedleLength - 1] | LastBit) != Last)
+			continue;
+
+		if (NeedleLength <= 2 || EqualUnits(Haystack + i + 1, Needle + 1, NeedleLength - 2, Fold))
+			return Haystack + i;
+	}
+
+	return NULL;
+}
+
+// As wcsnlen. The vector loads are aligned, so while they may read past the
+// terminator they never cross into a page the string does not reach.
+NO_SANITIZE_ADDRESS static size_t WideLength(const uint16_t *String, size_t Max)
+{
+	size_t Length = 0;
+
+#ifdef STR_SEARCH_SSE2
+	if (IS_ALIGNED(String, sizeof(uint16_t)) && Max)
+	{
+		const uint16_t *p = (const uint16_t*)((uintptr_t)String & ~(uintptr_t)(VECTOR_SIZE - 1));
+		unsigned int Mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_load_si128((const __m128i*)p), _mm_setzero_si128()));
+
+		Mask &= 0xFFFF << ((uintptr_t)String & (VECTOR_SIZE - 1));
+
+		while (!Mask)
+		{
+			p += VECTOR_SIZE / 2;
+			if ((size_t)(p - String) >= Max)
+				return Max;
+			Mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_load_si128((const __m128i*)p), _mm_setzero_si128()));
+		}
+
+		Length = (size_t)(p - String) + LowestSetBit(Mask) / 2;
+		return Length < Max ? Length : Max;
+	}
+#endif
+
+	while (Length < Max && String[Length])
+		Length++;
+
+	return Length;
+}
+
+//**************************************************************************************
+const void *StrSearchMemory(const void *Haystack, size_t Length, const void *Needle, size_t NeedleLength)
+//**************************************************************************************
+{
+	return SearchBytes((const unsigned char*)Haystack, Length, (const unsigned char*)Needle, NeedleLength, 0);
+}
+
+//**************************************************************************************
+char *StrSearchNoCase(const char *Haystack, const char *Needle)
+//**************************************************************************************
+{
+	const unsigned char *Found;
+	size_t NeedleLength = strlen(Needle), Known = 0, Start = 0, Chunk = FIRST_CHUNK, Length;
+
+	if (!NeedleLength)
+		return (char*)Haystack;
+
+	// An early match need not wait for the length of a long haystack
+	for (;;)
+	{
+		Length = strnlen(Haystack + Known, Chunk);
+		Known += Length;
+
+		if (Known - Start >= NeedleLength)
+		{
+			Found = SearchBytes((const unsigned char*)Haystack + Start, Known - Start, (const unsigned char*)Needle, NeedleLength, 1);
+			if (Found)
+				return (char*)Found;
+			Start = Known - NeedleLength + 1;
+		}
+
+		if (Length < Chunk)
+			return NULL;
+
+		if (Chunk < MAX_CHUNK)
+			Chunk *= 2;
+	}
+}
+
+//**************************************************************************************
+uint16_t *StrSearchNoCaseWide(const uint16_t *Haystack, const uint16_t *Needle)
+//**************************************************************************************
+{
+	const uint16_t *Found;
+	size_t NeedleLength = WideLength(Needle, (size_t)-1), Known = 0, Start = 0, Chunk = FIRST_CHUNK, Length;
+
+	if (!NeedleLength)
+		return (uint16_t*)Haystack;
+
+	for (;;)
+	{
+		Length = WideLength(Haystack + Known, Chunk);
+		Known += Length;
+
+		if (Known - Start >= NeedleLength)
+		{
+			Found = SearchUnits(Haystack + Start, Known - Start, Needle, NeedleLength, 1);
+			if (Found)
+				return (uint16_t*)Found;
+			Start = Known - NeedleLength + 1;
+		}
+
+		if (Length < Chunk)
+			return NULL;
+
+		if (Chunk < MAX_CHUNK)
+			Chunk *= 2;
+	}
+}
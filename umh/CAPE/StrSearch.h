@@ -0,0 +1,43 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Substring searches that filter candidate positions on the needle's first
+// and last characters sixteen bytes at a time, then compare the rest. The
+// case-insensitive searches fold ASCII letters only, as tolower and towlower
+// do in the C locale, and stop at the haystack's terminator. Wide strings
+// are UTF-16.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// First occurrence of Needle in the Length bytes at Haystack, or NULL. An
+// empty needle matches at the start.
+const void *StrSearchMemory(const void *Haystack, size_t Length, const void *Needle, size_t NeedleLength);
+// First occurrence of Needle in Haystack ignoring case, or NULL. An empty
+// needle matches at the start.
+char *StrSearchNoCase(const char *Haystack, const char *Needle);
+uint16_t *StrSearchNoCaseWide(const uint16_t *Haystack, const uint16_t *Needle);
+
+#ifdef __cplusplus
+}
+#endif
@@ -2224,8 +2224,6 @@ BOOL BreakpointCallback(PBREAKPOINTINFO pBreakpointInfo, struct _EXCEPTION_POINT
 			}
 			else
 				DebuggerOutput("Break at 0x%p in %s (RVA 0x%x, thread %d, ImageBase 0x%p, Stack 0x%p-0x%p)\n", CIP, ModuleName, DllRVA, GetCurrentThreadId(), ImageBase, get_stack_bottom(), get_stack_top());
-			if (PreviousModuleName)
-				free (PreviousModuleName);
 			PreviousModuleName = ModuleName;
 		}
 	}
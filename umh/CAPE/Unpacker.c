@@ -108,8 +108,7 @@ void AllocationHandler(PVOID BaseAddress, SIZE_T RegionSize, ULONG AllocationTyp
 #endif
 	hook_disable();
 
-	if (TrackedRegionList)
-		TrackedRegion = GetTrackedRegion(BaseAddress);
+	TrackedRegion = GetTrackedRegion(BaseAddress);
 
 	// if memory was previously reserved but not committed
 	if (TrackedRegion && !TrackedRegion->Committed && (AllocationType & MEM_COMMIT))
@@ -137,7 +136,7 @@ void AllocationHandler(PVOID BaseAddress, SIZE_T RegionSize, ULONG AllocationTyp
 		else
 			DebugOutput("AllocationHandler: Adding allocation to tracked region list: 0x%p, size: 0x%x.\n", BaseAddress, RegionSize);
 		TrackedRegion = AddTrackedRegion(BaseAddress, Protect);
-		if (!(AllocationType & MEM_RESERVE))
+		if (TrackedRegion && !(AllocationType & MEM_RESERVE))
 			TrackedRegion->SubAllocation = TRUE;
 	}
 
@@ -211,8 +210,7 @@ void ProtectionHandler(PVOID Address, ULONG Protect, PULONG OldProtect)
 
 	hook_disable();
 
-	if (TrackedRegionList)
-		TrackedRegion = GetTrackedRegion(Address);
+	TrackedRegion = GetTrackedRegion(Address);
 
 	if (!TrackedRegion)
 	{
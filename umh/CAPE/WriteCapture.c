@@ -0,0 +1,274 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "WriteCapture.h"
+
+#define WRITECAPTURE_MIN_BLOCKS 8
+
+static uintptr_t Reach(PWRITECAPTUREBLOCK Block)
+{
+	uintptr_t Reach = Block->End > Block->Reserved ? Block->End : Block->Reserved;
+
+	// Saturate rather than wrap at the top of the address space
+	if (Reach > UINTPTR_MAX - WRITECAPTURE_MERGE_GAP)
+		return UINTPTR_MAX;
+
+	return Reach + WRITECAPTURE_MERGE_GAP;
+}
+
+static int CheckLimit(PWRITECAPTURE Capture, size_t Released, size_t Requested)
+{
+	if (!Capture->Limit)
+		return 1;
+
+	return Capture->Bytes - Released + Requested <= Capture->Limit;
+}
+
+// Merges [Start, End) into the capture, with Buffer holding its bytes or NULL
+// to only extend the reserved extent to ReserveEnd
+static PWRITECAPTUREBLOCK Merge(PWRITECAPTURE Capture, uintptr_t Start, uintptr_t End, uintptr_t ReserveEnd, const void *Buffer)
+{
+	PWRITECAPTUREBLOCK Blocks = Capture->Blocks, Block;
+	uintptr_t Limit = End > ReserveEnd ? End : ReserveEnd, NewStart, NewEnd, NewReserved;
+	size_t First, Last, Low, High, Middle, k, Length, NewCapacity, Released = 0, Writes = 0;
+	unsigned char *Data;
+
+	if (Limit > UINTPTR_MAX - WRITECAPTURE_MERGE_GAP)
+		Limit = UINTPTR_MAX;
+	else
+		Limit += WRITECAPTURE_MERGE_GAP;
+
+	// Block reaches are disjoint and ascending, so the blocks to merge are the
+	// contiguous run from the first whose reach extends to Start
+	Low = 0;
+	High = Capture->Count;
+	while (Low < High)
+	{
+		Middle = Low + (High - Low) / 2;
+
+		if (Reach(&Blocks[Middle]) < Start)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	First = Last = Low;
+	while (Last < Capture->Count && Blocks[Last].Start <= Limit)
+		Last++;
+
+	if (First == Last)
+	{
+		Length = Buffer ? End - Start : 0;
+		Data = NULL;
+
+		if (Capture->Count == Capture->Capacity)
+		{
+			size_t NewCount = Capture->Capacity ? Capture->Capacity * 2 : WRITECAPTURE_MIN_BLOCKS;
+			PWRITECAPTUREBLOCK NewBlocks = (PWRITECAPTUREBLOCK)realloc(Blocks, NewCount * sizeof(WRITECAPTUREBLOCK));
+
+			if (!NewBlocks)
+				return NULL;
+
+			Capture->Blocks = Blocks = NewBlocks;
+			Capture->Capacity = NewCount;
+		}
+
+		if (Length)
+		{
+			if (!CheckLimit(Capture, 0, Length))
+				return NULL;
+
+			Data = (unsigned char*)malloc(Length);
+			if (!Data)
+				return NULL;
+
+			memcpy(Data, Buffer, Length);
+			Capture->Bytes += Length;
+		}
+
+		memmove(&Blocks[First + 1], &Blocks[First], (Capture->Count - First) * sizeof(WRITECAPTUREBLOCK));
+		Capture->Count++;
+
+		Block = &Blocks[First];
+		Block->Start = Start;
+		Block->End = Start + Length;
+		Block->Reserved = ReserveEnd > Block->End ? ReserveEnd : Block->End;
+		Block->Capacity = Length;
+		Block->Writes = Buffer ? 1 : 0;
+		Block->Data = Data;
+
+		return Block;
+	}
+
+	Block = &Blocks[First];
+
+	NewStart = Start < Block->Start ? Start : Block->Start;
+	NewEnd = NewStart;
+	if (Buffer && End > NewEnd)
+		NewEnd = End;
+
+	NewReserved = ReserveEnd;
+	for (k = First; k < Last; k++)
+	{
+		// Reserved blocks may hold no bytes yet
+		if (Blocks[k].End > Blocks[k].Start && Blocks[k].End > NewEnd)
+			NewEnd = Blocks[k].End;
+		if (Blocks[k].Reserved > NewReserved)
+			NewReserved = Blocks[k].Reserved;
+		if (k > First)
+			Released += Blocks[k].Capacity;
+		Writes += Blocks[k].Writes;
+	}
+
+	Length = NewEnd - NewStart;
+
+	// Allocate before touching anything so that failure leaves the capture intact
+	if (Length > Block->Capacity)
+	{
+		// Grow geometrically so that sequential writes are amortised
+		NewCapacity = Block->Capacity * 2 > Length ? Block->Capacity * 2 : Length;
+
+		if (!CheckLimit(Capture, Released + Block->Capacity, NewCapacity))
+			NewCapacity = Length;
+
+		if (!CheckLimit(Capture, Released + Block->Capacity, NewCapacity))
+			return NULL;
+
+		Data = (unsigned char*)realloc(Block->Data, NewCapacity);
+		if (!Data)
+			return NULL;
+
+		Capture->Bytes += NewCapacity - Block->Capacity;
+		Block->Data = Data;
+		Block->Capacity = NewCapacity;
+	}
+
+	Data = Block->Data;
+
+	if (Block->End > Block->Start)
+	{
+		size_t Shift = Block->Start - NewStart, OldLength = Block->End - Block->Start;
+
+		if (Shift)
+		{
+			memmove(Data + Shift, Data, OldLength);
+			memset(Data, 0, Shift);
+		}
+
+		memset(Data + Shift + OldLength, 0, Length - Shift - OldLength);
+	}
+	else if (Length)
+		memset(Data, 0, Length);
+
+	for (k = First + 1; k < Last; k++)
+	{
+		if (Blocks[k].End > Blocks[k].Start)
+			memcpy(Data + (Blocks[k].Start - NewStart), Blocks[k].Data, Blocks[k].End - Blocks[k].Start);
+		free(Blocks[k].Data);
+	}
+
+	Capture->Bytes -= Released;
+
+	Block->Start = NewStart;
+	Block->End = NewEnd;
+	Block->Reserved = NewReserved > NewEnd ? NewReserved : NewEnd;
+	Block->Writes = Writes;
+
+	if (Last - First > 1)
+	{
+		memmove(&Blocks[First + 1], &Blocks[Last], (Capture->Count - Last) * sizeof(WRITECAPTUREBLOCK));
+		Capture->Count -= Last - First - 1;
+	}
+
+	// The caller's buffer may fault, so it is read only once the capture is consistent
+	if (Buffer)
+	{
+		memcpy(Data + (Start - NewStart), Buffer, End - Start);
+		Block->Writes++;
+	}
+
+	return Block;
+}
+
+//**************************************************************************************
+void WriteCaptureInit(PWRITECAPTURE Capture, size_t Limit)
+//**************************************************************************************
+{
+	Capture->Blocks = NULL;
+	Capture->Count = 0;
+	Capture->Capacity = 0;
+	Capture->Bytes = 0;
+	Capture->Limit = Limit;
+}
+
+//**************************************************************************************
+void WriteCaptureFree(PWRITECAPTURE Capture)
+//**************************************************************************************
+{
+	size_t i;
+
+	for (i = 0; i < Capture->Count; i++)
+		free(Capture->Blocks[i].Data);
+
+	free(Capture->Blocks);
+	WriteCaptureInit(Capture, Capture->Limit);
+}
+
+//**************************************************************************************
+PWRITECAPTUREBLOCK WriteCaptureAdd(PWRITECAPTURE Capture, uintptr_t Address, const void *Buffer, size_t Size)
+//**************************************************************************************
+{
+	if (!Size || !Buffer || Address + Size < Address)
+		return NULL;
+
+	return Merge(Capture, Address, Address + Size, 0, Buffer);
+}
+
+//**************************************************************************************
+PWRITECAPTUREBLOCK WriteCaptureReserve(PWRITECAPTURE Capture, uintptr_t Address, size_t Size)
+//**************************************************************************************
+{
+	if (!Size || Address + Size < Address)
+		return NULL;
+
+	return Merge(Capture, Address, Address, Address + Size, NULL);
+}
+
+//**************************************************************************************
+PWRITECAPTUREBLOCK WriteCaptureFind(PWRITECAPTURE Capture, uintptr_t Address)
+//**************************************************************************************
+{
+	size_t Low = 0, High = Capture->Count, Middle;
+
+	// Last block starting at or below Address
+	while (Low < High)
+	{
+		Middle = Low + (High - Low) / 2;
+
+		if (Capture->Blocks[Middle].Start <= Address)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	if (Low && Address < Capture->Blocks[Low - 1].End)
+		return &Capture->Blocks[Low - 1];
+
+	return NULL;
+}
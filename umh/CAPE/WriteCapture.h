@@ -0,0 +1,68 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Local mirror of the bytes written into another process. Writes are merged
+// into blocks of contiguous target memory: overlapping, adjacent and nearby
+// writes (within WRITECAPTURE_MERGE_GAP, or inside a block's reserved extent)
+// join one block, later bytes overwriting earlier ones and unwritten gaps
+// reading as zero, so an image written piecemeal can be dumped in one go.
+
+#define WRITECAPTURE_MERGE_GAP 0x1000
+
+typedef struct WriteCaptureBlock
+{
+	uintptr_t		Start;		// target address of Data[0]
+	uintptr_t		End;		// end of the captured bytes
+	uintptr_t		Reserved;	// writes below this join the block
+	size_t			Capacity;
+	size_t			Writes;
+	unsigned char	*Data;
+} WRITECAPTUREBLOCK, *PWRITECAPTUREBLOCK;
+
+typedef struct WriteCapture
+{
+	PWRITECAPTUREBLOCK	Blocks;		// sorted by Start
+	size_t				Count;
+	size_t				Capacity;
+	size_t				Bytes;		// total allocated for block data
+	size_t				Limit;		// cap on Bytes, zero for none
+} WRITECAPTURE, *PWRITECAPTURE;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void WriteCaptureInit(PWRITECAPTURE Capture, size_t Limit);
+void WriteCaptureFree(PWRITECAPTURE Capture);
+// Mirrors Size bytes written at Address, returning the block now holding them, or
+// NULL (capture unchanged) if the range wraps or the limit or allocation fails.
+// The pointer is valid until the capture is next modified.
+PWRITECAPTUREBLOCK WriteCaptureAdd(PWRITECAPTURE Capture, uintptr_t Address, const void *Buffer, size_t Size);
+// Extends the block at Address so that later writes within Size bytes of it join
+// the block, e.g. the SizeOfImage of a PE header written there
+PWRITECAPTUREBLOCK WriteCaptureReserve(PWRITECAPTURE Capture, uintptr_t Address, size_t Size);
+// Block whose captured bytes contain Address, or NULL
+PWRITECAPTUREBLOCK WriteCaptureFind(PWRITECAPTURE Capture, uintptr_t Address);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,116 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "Xxh64.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t Read64(const unsigned char *p)
+{
+	uint64_t Value;
+	memcpy(&Value, p, sizeof(Value));
+	return Value;
+}
+
+static uint32_t Read32(const unsigned char *p)
+{
+	uint32_t Value;
+	memcpy(&Value, p, sizeof(Value));
+	return Value;
+}
+
+static uint64_t Round(uint64_t Accumulator, uint64_t Input)
+{
+	Accumulator += Input * PRIME64_2;
+	Accumulator = ROTL64(Accumulator, 31);
+	return Accumulator * PRIME64_1;
+}
+
+static uint64_t MergeRound(uint64_t Accumulator, uint64_t Value)
+{
+	Accumulator ^= Round(0, Value);
+	return Accumulator * PRIME64_1 + PRIME64_4;
+}
+
+//**************************************************************************************
+uint64_t Xxh64(const void *Buffer, size_t Size, uint64_t Seed)
+//**************************************************************************************
+{
+	const unsigned char *p = (const unsigned char*)Buffer, *End = p + Size;
+	uint64_t Hash;
+
+	if (Size >= 32)
+	{
+		const unsigned char *Limit = End - 32;
+		uint64_t v1 = Seed + PRIME64_1 + PRIME64_2, v2 = Seed + PRIME64_2, v3 = Seed, v4 = Seed - PRIME64_1;
+
+		do
+		{
+			v1 = Round(v1, Read64(p));
+			v2 = Round(v2, Read64(p + 8));
+			v3 = Round(v3, Read64(p + 16));
+			v4 = Round(v4, Read64(p + 24));
+			p += 32;
+		}
+		while (p <= Limit);
+
+		Hash = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+		Hash = MergeRound(Hash, v1);
+		Hash = MergeRound(Hash, v2);
+		Hash = MergeRound(Hash, v3);
+		Hash = MergeRound(Hash, v4);
+	}
+	else
+		Hash = Seed + PRIME64_5;
+
+	Hash += (uint64_t)Size;
+
+	while (p + 8 <= End)
+	{
+		Hash ^= Round(0, Read64(p));
+		Hash = ROTL64(Hash, 27) * PRIME64_1 + PRIME64_4;
+		p += 8;
+	}
+
+	if (p + 4 <= End)
+	{
+		Hash ^= (uint64_t)Read32(p) * PRIME64_1;
+		Hash = ROTL64(Hash, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+
+	while (p < End)
+	{
+		Hash ^= (*p++) * PRIME64_5;
+		Hash = ROTL64(Hash, 11) * PRIME64_1;
+	}
+
+	Hash ^= Hash >> 33;
+	Hash *= PRIME64_2;
+	Hash ^= Hash >> 29;
+	Hash *= PRIME64_3;
+	Hash ^= Hash >> 32;
+
+	return Hash;
+}
@@ -22,8 +22,21 @@ along with this program.If not, see <http://www.gnu.org/licenses/>.
 #include "CAPE.h"
 #include "Debugger.h"
 #include "YaraHarness.h"
+#include "ScanCache.h"
+#include "ScanQueue.h"
+#include "RulesCache.h"
 #include "..\config.h"
 
+#define YARA_SCAN_CACHE_LIMIT 4096
+#define YARA_SCAN_THREADS_MAX 8
+#define YARA_SCAN_QUEUE_DEPTH 64
+#define YARA_SNAPSHOT_LIMIT 0x4000000
+#define YARA_BACKGROUND_MIN_SIZE 0x10000
+#define YARA_BACKGROUND_TIMEOUT 10
+#define YARA_DEFERRED_HITS 16
+#define YARA_CACHE_YARASCAN 1
+#define YARA_CACHE_SPLIT 4	// 2 was the split that left 'dump' rules in the background
+
 extern void DebugOutput(_In_ LPCTSTR lpOutputString, ...);
 extern void ErrorOutput(_In_ LPCTSTR lpOutputString, ...);
 extern BOOL SetInitialBreakpoints(PVOID ImageBase), DumpRegion(PVOID Address);
@@ -33,6 +46,7 @@ extern int ReverseScanForNonZero(PVOID Buffer, SIZE_T Size);
 extern SIZE_T GetAccessibleSize(PVOID Buffer);
 extern char *our_dll_path;
 extern BOOL BreakpointsHit;
+extern void hook_disable();
 
 YR_RULES* Rules = NULL;
 BOOL YaraActivated, YaraLogging, CapemonRulesDetected;
@@ -42,6 +56,36 @@ extern PVOID LdrpInvertedFunctionTableSRWLock;
 
 static char NewLine[MAX_PATH];
 
+// Regions scanned without a hit are not rescanned until their content changes;
+// regions that hit are always rescanned so that their actions are repeated
+static SCANCACHE YaraScanCache, InternalScanCache;
+static CRITICAL_SECTION ScanCacheLock;
+static BOOL ScanCacheInitialised;
+
+typedef struct YaraScanContext
+{
+	PVOID			Address;
+	unsigned int	Matches;
+} YARASCANCONTEXT, *PYARASCANCONTEXT;
+
+// Large regions are scanned on a snapshot by background threads so the sample
+// is not held up. Rule files with cape_options set breakpoints, change the
+// config or dump the region, which has to happen before the scanned code
+// carries on and while the region still holds what matched, so these are
+// compiled separately into ImmediateRules and always scanned synchronously.
+// Hits from background scans are reported by the next thread to call YaraScan.
+static YR_RULES* ImmediateRules;
+static PSCANQUEUE YaraScanQueue;
+static DWORD YaraScanThreadIds[YARA_SCAN_THREADS_MAX];
+static volatile LONG YaraScanThreadCount;
+
+typedef struct YaraDeferredScan
+{
+	YARASCANCONTEXT	ScanContext;
+	unsigned int	HitCount;
+	YR_RULE*		Hits[YARA_DEFERRED_HITS];
+} YARADEFERREDSCAN, *PYARADEFERREDSCAN;
+
 char InternalYara[] =
 	"rule RtlInsertInvertedFunctionTable"
 	"{strings:$10_0_19041_662 = {48 8D 0D [4] E8 [4] [7] 8B 44 24 ?? 44 8B CB 4C 8B 44 24 ?? 48 8B D7 89 44 24 ?? E8}"
@@ -136,6 +180,9 @@ int YaraCallback(YR_SCAN_CONTEXT* context, int message, void* message_data, void
 			YR_STRING* String;
 			YR_META* Meta;
 			YR_RULE* Rule = (YR_RULE*)message_data;
+			PYARASCANCONTEXT ScanContext = (PYARASCANCONTEXT)user_data;
+
+			ScanContext->Matches++;
 
 			DebugOutput("YaraScan hit: %s\n", Rule->identifier);
 
@@ -204,12 +251,12 @@ int YaraCallback(YR_SCAN_CONTEXT* context, int message, void* message_data, void
 			}
 
 			if (DebuggerInitialised && SetBreakpoints)
-				SetInitialBreakpoints(user_data);
+				SetInitialBreakpoints(ScanContext->Address);
 
 			if (DoDumpRegion)
 			{
-				DebugOutput("YaraScan: Dump of region at 0x%p triggered by Yara.", user_data);
-				DumpRegion(user_data);
+				DebugOutput("YaraScan: Dump of region at 0x%p triggered by Yara.", ScanContext->Address);
+				DumpRegion(ScanContext->Address);
 			}
 
 			return CALLBACK_CONTINUE;
@@ -232,6 +279,9 @@ int InternalYaraCallback(YR_SCAN_CONTEXT* context, int message, void* message_da
 			YR_MATCH* Match;
 			YR_STRING* String;
 			YR_RULE* Rule = (YR_RULE*)message_data;
+			PYARASCANCONTEXT ScanContext = (PYARASCANCONTEXT)user_data;
+
+			ScanContext->Matches++;
 
 			if (YaraLogging)
 				DebugOutput("InternalYaraScan hit: %s\n", Rule->identifier);
@@ -245,7 +295,7 @@ int InternalYaraCallback(YR_SCAN_CONTEXT* context, int message, void* message_da
 					{
 						if (!strcmp(String->identifier, "$10_0_19041_662") || !strcmp(String->identifier, "$10_0_18362_1350") || !strcmp(String->identifier, "$10_0_10240_16384"))
 						{
-							PVOID RtlInsertInvertedFunctionTable = (PVOID)((PBYTE)user_data + Match->offset);
+							PVOID RtlInsertInvertedFunctionTable = (PVOID)((PBYTE)ScanContext->Address + Match->offset);
 							LdrpInvertedFunctionTableSRWLock = (PVOID)((PBYTE)RtlInsertInvertedFunctionTable + *(DWORD*)((PBYTE)RtlInsertInvertedFunctionTable + 3) + 7);
 							DebugOutput("RtlInsertInvertedFunctionTable 0x%p, LdrpInvertedFunctionTableSRWLock 0x%p", RtlInsertInvertedFunctionTable, LdrpInvertedFunctionTableSRWLock);
 						}
@@ -297,12 +347,250 @@ void ScannerError(int Error)
 	}
 }
 
+static BOOL ScanCacheCheck(PSCANCACHE Cache, PVOID Address, SIZE_T Size, UINT64 *Digest)
+{
+	unsigned int Matches = 0;
+	BOOL Cached;
+
+	if (!ScanCacheInitialised)
+		return FALSE;
+
+	__try
+	{
+		*Digest = ScanCacheDigest(Cache, Address, Size);
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		return FALSE;
+	}
+
+	EnterCriticalSection(&ScanCacheLock);
+	Cached = ScanCacheLookup(Cache, (uintptr_t)Address, Size, *Digest, &Matches) && !Matches;
+	LeaveCriticalSection(&ScanCacheLock);
+
+	return Cached;
+}
+
+static void ScanCacheUpdate(PSCANCACHE Cache, PVOID Address, SIZE_T Size, UINT64 Digest, unsigned int Matches)
+{
+	if (!ScanCacheInitialised)
+		return;
+
+	EnterCriticalSection(&ScanCacheLock);
+	ScanCacheStore(Cache, (uintptr_t)Address, Size, Digest, Matches);
+	LeaveCriticalSection(&ScanCacheLock);
+}
+
+// After scanning live memory: the digest taken before the scan only stands
+// for what was scanned if the region still has it afterwards
+static void ScanCacheUpdateIfUnchanged(PSCANCACHE Cache, PVOID Address, SIZE_T Size, UINT64 Digest, unsigned int Matches)
+{
+	UINT64 After;
+
+	if (!ScanCacheInitialised)
+		return;
+
+	__try
+	{
+		After = ScanCacheDigest(Cache, Address, Size);
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		return;
+	}
+
+	if (After == Digest)
+		ScanCacheUpdate(Cache, Address, Size, Digest, Matches);
+}
+
+void YaraScanCacheInvalidate(PVOID Address, SIZE_T Size)
+{
+	if (!ScanCacheInitialised)
+		return;
+
+	EnterCriticalSection(&ScanCacheLock);
+	ScanCacheInvalidate(&YaraScanCache, (uintptr_t)Address, Size);
+	ScanCacheInvalidate(&InternalScanCache, (uintptr_t)Address, Size);
+	LeaveCriticalSection(&ScanCacheLock);
+}
+
+static BOOL RuleHasOptions(YR_RULE* Rule)
+{
+	YR_META* Meta;
+
+	yr_rule_metas_foreach(Rule, Meta)
+	{
+		if (Meta->type == META_TYPE_STRING && !strcmp(Meta->identifier, "cape_options"))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static BOOL RulesNeedImmediateAction(YR_RULES* RuleSet)
+{
+	YR_RULE* Rule;
+
+	yr_rules_foreach(RuleSet, Rule)
+	{
+		if (RuleHasOptions(Rule))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static BOOL FileNeedsImmediateAction(FILE* RuleFile, const char* FileName)
+{
+	YR_COMPILER* Compiler = NULL;
+	YR_RULES* RuleSet = NULL;
+	BOOL Immediate = FALSE;
+
+	if (yr_compiler_create(&Compiler) != ERROR_SUCCESS)
+		return FALSE;
+
+	// Compile errors are left for the main compile to report
+	if (!yr_compiler_add_file(Compiler, RuleFile, NULL, FileName) && yr_compiler_get_rules(Compiler, &RuleSet) == ERROR_SUCCESS)
+	{
+		Immediate = RulesNeedImmediateAction(RuleSet);
+		yr_rules_destroy(RuleSet);
+	}
+
+	yr_compiler_destroy(Compiler);
+	rewind(RuleFile);
+
+	return Immediate;
+}
+
+int DeferredYaraCallback(YR_SCAN_CONTEXT* context, int message, void* message_data, void* user_data)
+{
+	PYARADEFERREDSCAN Scan = (PYARADEFERREDSCAN)user_data;
+
+	switch(message)
+	{
+		case CALLBACK_MSG_RULE_NOT_MATCHING:
+		case CALLBACK_MSG_IMPORT_MODULE:
+			return CALLBACK_CONTINUE;
+		case CALLBACK_MSG_RULE_MATCHING:
+			if (Scan->HitCount < YARA_DEFERRED_HITS)
+				Scan->Hits[Scan->HitCount] = (YR_RULE*)message_data;
+			Scan->HitCount++;
+			Scan->ScanContext.Matches++;
+			return CALLBACK_CONTINUE;
+	}
+
+	return CALLBACK_ERROR;
+}
+
+static void YaraScanThreadStart(void *Context)
+{
+	LONG Index;
+
+	hook_disable();
+
+	Index = InterlockedIncrement(&YaraScanThreadCount) - 1;
+	if (Index < YARA_SCAN_THREADS_MAX)
+		YaraScanThreadIds[Index] = GetCurrentThreadId();
+}
+
+static void YaraBackgroundScan(PSCANJOB Job, void *Context)
+{
+	PYARADEFERREDSCAN Scan = (PYARADEFERREDSCAN)Job->Context;
+
+	__try
+	{
+		Job->Result = yr_rules_scan_mem(Rules, Job->Snapshot, Job->Size, 0, DeferredYaraCallback, Scan, YARA_BACKGROUND_TIMEOUT);
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		Job->Result = ERROR_INTERNAL_FATAL_ERROR;
+	}
+
+	// The digest is of what was scanned, even if the region has moved on since
+	if (Job->Result == ERROR_SUCCESS)
+		ScanCacheUpdate(&YaraScanCache, Scan->ScanContext.Address, Job->Size, ScanCacheDigest(&YaraScanCache, Job->Snapshot, Job->Size), Scan->ScanContext.Matches);
+}
+
+static void YaraBackgroundScanComplete(PSCANJOB Job, void *Context)
+{
+	PYARADEFERREDSCAN Scan = (PYARADEFERREDSCAN)Job->Context;
+	unsigned int i;
+
+	if (Job->Result != ERROR_SUCCESS)
+		ScannerError(Job->Result);
+
+	// Deferred rules have no cape_options, so there is nothing to act on
+	for (i = 0; i < Scan->HitCount && i < YARA_DEFERRED_HITS; i++)
+		DebugOutput("YaraScan hit: %s\n", Scan->Hits[i]->identifier);
+
+	if (Scan->HitCount > YARA_DEFERRED_HITS)
+		DebugOutput("YaraScan: %d further hits in region at 0x%p not shown.\n", Scan->HitCount - YARA_DEFERRED_HITS, Scan->ScanContext.Address);
+
+	free(Scan);
+}
+
+static BOOL QueueYaraScan(PVOID Address, SIZE_T Size, unsigned int Matches)
+{
+	PYARADEFERREDSCAN Scan;
+	PSCANJOB Job;
+
+	if (!YaraScanQueue || Size < YARA_BACKGROUND_MIN_SIZE)
+		return FALSE;
+
+	Scan = (PYARADEFERREDSCAN)calloc(1, sizeof(YARADEFERREDSCAN));
+	if (!Scan)
+		return FALSE;
+
+	Scan->ScanContext.Address = Address;
+	Scan->ScanContext.Matches = Matches;
+
+	Job = ScanQueueReserve(YaraScanQueue, (uintptr_t)Address, Size, Scan);
+	if (!Job)
+	{
+#ifdef DEBUG_COMMENTS
+		DebugOutput("YaraScan: Scan queue full, scanning 0x%p synchronously.\n", Address);
+#endif
+		free(Scan);
+		return FALSE;
+	}
+
+	__try
+	{
+		memcpy(Job->Snapshot, Address, Size);
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		ScanQueueCancel(YaraScanQueue, Job);
+		free(Scan);
+		return FALSE;
+	}
+
+	ScanQueuePost(YaraScanQueue, Job);
+
+	return TRUE;
+}
+
+BOOL IsYaraScanThread(DWORD ThreadId)
+{
+	LONG i;
+
+	for (i = 0; i < YaraScanThreadCount && i < YARA_SCAN_THREADS_MAX; i++)
+		if (YaraScanThreadIds[i] == ThreadId)
+			return TRUE;
+
+	return FALSE;
+}
+
 void YaraScan(PVOID Address, SIZE_T Size)
 {
 	if (!YaraActivated)
 		return;
 
 	int Flags = 0, Timeout = 1, Result = ERROR_SUCCESS;
+	YARASCANCONTEXT ScanContext = {Address, 0};
+	UINT64 Digest = 0;
+
+	ScanQueueDrain(YaraScanQueue);
 
 	if (!Size)
 		return;
@@ -329,14 +617,44 @@ void YaraScan(PVOID Address, SIZE_T Size)
 		return;
 	}
 
+	if (ScanCacheCheck(&YaraScanCache, Address, Size, &Digest))
+	{
+#ifdef DEBUG_COMMENTS
+		DebugOutput("YaraScan: 0x%p (size 0x%x) unchanged since last scan.\n", Address, Size);
+#endif
+		return;
+	}
+
 #ifndef DEBUG_COMMENTS
 	if (YaraLogging)
 #endif
 		DebugOutput("YaraScan: Scanning 0x%p, size 0x%x\n", Address, Size);
 
+	if (ImmediateRules)
+	{
+		__try
+		{
+			Result = yr_rules_scan_mem(ImmediateRules, Address, Size, Flags, YaraCallback, &ScanContext, Timeout);
+		}
+		__except(EXCEPTION_EXECUTE_HANDLER)
+		{
+			DebugOutput("YaraScan: Unable to scan 0x%p\n", Address);
+			return;
+		}
+
+		if (Result != ERROR_SUCCESS)
+		{
+			ScannerError(Result);
+			return;
+		}
+	}
+
+	if (QueueYaraScan(Address, Size, ScanContext.Matches))
+		return;
+
 	__try
 	{
-		Result = yr_rules_scan_mem(Rules, Address, Size, Flags, YaraCallback, Address, Timeout);
+		Result = yr_rules_scan_mem(Rules, Address, Size, Flags, YaraCallback, &ScanContext, Timeout);
 	}
 	__except(EXCEPTION_EXECUTE_HANDLER)
 	{
@@ -345,10 +663,13 @@ void YaraScan(PVOID Address, SIZE_T Size)
 	}
 	if (Result != ERROR_SUCCESS)
 		ScannerError(Result);
-#ifdef DEBUG_COMMENTS
 	else
+	{
+		ScanCacheUpdateIfUnchanged(&YaraScanCache, Address, Size, Digest, ScanContext.Matches);
+#ifdef DEBUG_COMMENTS
 		DebugOutput("YaraScan: successfully scanned 0x%p\n", Address);
 #endif
+	}
 }
 
 void SilentYaraScan(PVOID Address, SIZE_T Size)
@@ -369,6 +690,8 @@ void InternalYaraScan(PVOID Address, SIZE_T Size)
 		return;
 
 	int Flags = 0, Timeout = 1, Result = ERROR_SUCCESS;
+	YARASCANCONTEXT ScanContext = {Address, 0};
+	UINT64 Digest = 0;
 
 	if (!Size)
 		return;
@@ -390,12 +713,15 @@ void InternalYaraScan(PVOID Address, SIZE_T Size)
 		return;
 	}
 
+	if (ScanCacheCheck(&InternalScanCache, Address, Size, &Digest))
+		return;
+
 	if (YaraLogging)
 		DebugOutput("InternalYaraScan: Scanning 0x%p, size 0x%x\n", Address, Size);
 
 	__try
 	{
-		Result = yr_rules_scan_mem(Rules, Address, Size, Flags, InternalYaraCallback, Address, Timeout);
+		Result = yr_rules_scan_mem(Rules, Address, Size, Flags, InternalYaraCallback, &ScanContext, Timeout);
 	}
 	__except(EXCEPTION_EXECUTE_HANDLER)
 	{
@@ -403,6 +729,8 @@ void InternalYaraScan(PVOID Address, SIZE_T Size)
 			DebugOutput("InternalYaraScan: Unable to scan 0x%p\n", Address);
 		return;
 	}
+	if (Result == ERROR_SUCCESS)
+		ScanCacheUpdateIfUnchanged(&InternalScanCache, Address, Size, Digest, ScanContext.Matches);
 	if (Result != ERROR_SUCCESS && YaraLogging)
 		ScannerError(Result);
 #ifdef DEBUG_COMMENTS
@@ -421,11 +749,277 @@ BOOL ScanForRulesCanary(PVOID Address, SIZE_T Size)
 	return CapemonRulesDetected;
 }
 
+// Compiled rules are cached in capemon.yac along with a manifest of the rule
+// sources (and internal rules) they were compiled from, and are recompiled
+// when any of these, the libyara version or the compile options change.
+typedef struct YaraMemoryStream
+{
+	unsigned char	*Buffer;
+	size_t			Size;
+	size_t			Capacity;
+	size_t			Offset;
+} YARAMEMORYSTREAM, *PYARAMEMORYSTREAM;
+
+static size_t MemoryStreamRead(void* ptr, size_t size, size_t count, void* user_data)
+{
+	PYARAMEMORYSTREAM Memory = (PYARAMEMORYSTREAM)user_data;
+	size_t Items;
+
+	if (!size)
+		return 0;
+
+	Items = (Memory->Size - Memory->Offset) / size;
+	if (Items > count)
+		Items = count;
+
+	memcpy(ptr, Memory->Buffer + Memory->Offset, Items * size);
+	Memory->Offset += Items * size;
+
+	return Items;
+}
+
+static size_t MemoryStreamWrite(const void* ptr, size_t size, size_t count, void* user_data)
+{
+	PYARAMEMORYSTREAM Memory = (PYARAMEMORYSTREAM)user_data;
+	size_t Length = size * count;
+
+	if (Memory->Size + Length > Memory->Capacity)
+	{
+		size_t Capacity = Memory->Capacity ? Memory->Capacity : 0x10000;
+		unsigned char *Buffer;
+
+		while (Capacity < Memory->Size + Length)
+			Capacity *= 2;
+
+		Buffer = (unsigned char*)realloc(Memory->Buffer, Capacity);
+		if (!Buffer)
+			return 0;
+
+		Memory->Buffer = Buffer;
+		Memory->Capacity = Capacity;
+	}
+
+	memcpy(Memory->Buffer + Memory->Size, ptr, Length);
+	Memory->Size += Length;
+
+	return count;
+}
+
+static unsigned int AddRuleSources(PRULESMANIFEST Manifest, const char* yara_dir)
+{
+	char FindString[MAX_PATH], file_name[MAX_PATH];
+	WIN32_FIND_DATA FindFileData;
+	unsigned int count = 0;
+	HANDLE hFind;
+
+	sprintf(FindString, "%s\\*.yar", yara_dir);
+	hFind = FindFirstFile(FindString, &FindFileData);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return 0;
+
+	do
+	{
+		FILE* rule_file;
+		char* Content;
+		long Size;
+
+		if (FindFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			continue;
+
+		snprintf(file_name, sizeof(file_name), "%s\\%s", yara_dir, FindFileData.cFileName);
+
+		rule_file = fopen(file_name, "rb");
+		if (!rule_file)
+			continue;
+
+		fseek(rule_file, 0, SEEK_END);
+		Size = ftell(rule_file);
+		rewind(rule_file);
+
+		Content = Size > 0 ? (char*)malloc(Size) : NULL;
+		if (Content && fread(Content, 1, Size, rule_file) == (size_t)Size && RulesManifestAdd(Manifest, FindFileData.cFileName, Content, Size))
+			count++;
+		else if (Size == 0 && RulesManifestAdd(Manifest, FindFileData.cFileName, "", 0))
+			count++;
+
+		free(Content);
+		fclose(rule_file);
+	}
+	while (FindNextFile(hFind, &FindFileData));
+
+	FindClose(hFind);
+
+	return count;
+}
+
+static BOOL LoadRulesBlob(PRULESCACHEBLOB Blob, YR_RULES** RuleSet)
+{
+	YARAMEMORYSTREAM Memory;
+	YR_STREAM Stream;
+	int Result;
+
+	memset(&Memory, 0, sizeof(Memory));
+	Memory.Buffer = (unsigned char*)Blob->Data;
+	Memory.Size = Blob->Size;
+	Stream.user_data = &Memory;
+	Stream.read = MemoryStreamRead;
+	Stream.write = NULL;
+
+	Result = yr_rules_load_stream(&Stream, RuleSet);
+
+	if (Result != ERROR_SUCCESS)
+	{
+		ScannerError(Result);
+		*RuleSet = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static BOOL LoadRulesCache(const char* CachePath, PRULESMANIFEST Manifest)
+{
+	static const char* StaleReasons[] = {
+		"", "is not a valid rules cache", "was compiled by a different libyara version",
+		"was compiled with different options", "is out of date with the rule sources"
+	};
+	RULESCACHEBLOB Blobs[RULES_CACHE_MAX_BLOBS];
+	RULESCACHESTATUS Status;
+	unsigned int BlobCount = 0;
+	LARGE_INTEGER FileSize;
+	HANDLE FileHandle, Mapping;
+	PVOID View;
+	BOOL Loaded = FALSE;
+
+	// Shared delete lets another process replace the cache while it is open
+	FileHandle = CreateFile(CachePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (FileHandle == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	if (!GetFileSizeEx(FileHandle, &FileSize) || !FileSize.QuadPart || (ULONGLONG)FileSize.QuadPart > (SIZE_T)-1)
+	{
+		CloseHandle(FileHandle);
+		return FALSE;
+	}
+
+	Mapping = CreateFileMapping(FileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(FileHandle);
+	if (!Mapping)
+		return FALSE;
+
+	View = MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(Mapping);
+	if (!View)
+		return FALSE;
+
+	__try
+	{
+		Status = RulesCacheValidate(View, (size_t)FileSize.QuadPart, Manifest, Blobs, &BlobCount);
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		Status = RULES_CACHE_CORRUPT;
+	}
+
+	if (Status == RULES_CACHE_VALID && BlobCount)
+	{
+		// yara copies the rules out of the view, so it is unmapped once loaded
+		Loaded = LoadRulesBlob(&Blobs[0], &Rules);
+
+		if (Loaded && BlobCount > 1 && !LoadRulesBlob(&Blobs[1], &ImmediateRules))
+		{
+			yr_rules_destroy(Rules);
+			Rules = NULL;
+			Loaded = FALSE;
+		}
+	}
+	else if (Status != RULES_CACHE_VALID)
+		DebugOutput("YaraInit: Compiled rules file %s %s.\n", CachePath, StaleReasons[Status]);
+
+	UnmapViewOfFile(View);
+
+	return Loaded;
+}
+
+static void SaveRulesCache(const char* CachePath, PRULESMANIFEST Manifest)
+{
+	YARAMEMORYSTREAM Saved[2];
+	RULESCACHEBLOB Blobs[2];
+	unsigned int BlobCount = ImmediateRules ? 2 : 1;
+	char TempPath[MAX_PATH];
+	unsigned char* Buffer = NULL;
+	HANDLE FileHandle;
+	DWORD BytesWritten = 0;
+	BOOL Written = FALSE;
+	SIZE_T Size;
+
+	memset(Saved, 0, sizeof(Saved));
+
+	for (unsigned int i = 0; i < BlobCount; i++)
+	{
+		YR_STREAM Stream;
+		int Result;
+
+		Stream.user_data = &Saved[i];
+		Stream.read = NULL;
+		Stream.write = MemoryStreamWrite;
+
+		Result = yr_rules_save_stream(i ? ImmediateRules : Rules, &Stream);
+
+		if (Result != ERROR_SUCCESS)
+		{
+			ScannerError(Result);
+			goto out;
+		}
+
+		Blobs[i].Data = Saved[i].Buffer;
+		Blobs[i].Size = Saved[i].Size;
+	}
+
+	Size = RulesCacheSize(Manifest, Blobs, BlobCount);
+	if (!Size || Size > MAXDWORD)
+		goto out;
+
+	Buffer = (unsigned char*)malloc(Size);
+	if (!Buffer || !RulesCacheWrite(Manifest, Blobs, BlobCount, Buffer, Size))
+		goto out;
+
+	// Written to a private name then moved over the cache in one step, so
+	// other processes loading it see either the old file or the new one
+	snprintf(TempPath, sizeof(TempPath), "%s.%u", CachePath, GetCurrentProcessId());
+
+	FileHandle = CreateFile(TempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (FileHandle == INVALID_HANDLE_VALUE)
+	{
+		ErrorOutput("YaraInit: Unable to create compiled rules file %s", TempPath);
+		goto out;
+	}
+
+	Written = WriteFile(FileHandle, Buffer, (DWORD)Size, &BytesWritten, NULL) && BytesWritten == Size;
+	CloseHandle(FileHandle);
+
+	if (Written && MoveFileEx(TempPath, CachePath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		DebugOutput("YaraInit: Compiled rules saved to file %s\n", CachePath);
+	else
+	{
+		ErrorOutput("YaraInit: Unable to save compiled rules to file %s", CachePath);
+		DeleteFile(TempPath);
+	}
+
+out:
+	free(Buffer);
+	free(Saved[0].Buffer);
+	free(Saved[1].Buffer);
+}
+
 BOOL YaraInit()
 {
-	YR_COMPILER* Compiler = NULL;
+	YR_COMPILER* Compiler = NULL, *ImmediateCompiler = NULL;
 	char analyzer_path[MAX_PATH], yara_dir[MAX_PATH], file_name[MAX_PATH], compiled_rules[MAX_PATH];
 	BOOL Result = FALSE, RulesCompiled = FALSE;
+	unsigned int ImmediateFiles = 0, SourceFiles = 0;
+	RULESMANIFEST Manifest;
+	FILE* rule_file;
 	int flags = 0;
 
 	strncpy(analyzer_path, our_dll_path, strlen(our_dll_path)+1);
@@ -437,24 +1031,16 @@ BOOL YaraInit()
 
 	yr_initialize();
 
-	FILE* rule_file = fopen(compiled_rules, "r");
-
-	if (rule_file)
-	{
-		Result = yr_rules_load(compiled_rules, &Rules);
-
-		fclose(rule_file);
+	RulesManifestInit(&Manifest, YR_VERSION_HEX, (g_config.yarascan ? YARA_CACHE_YARASCAN : 0) | (g_config.yara_threads ? YARA_CACHE_SPLIT : 0));
+	RulesManifestAdd(&Manifest, "<internal>", InternalYara, strlen(InternalYara));
+	if (g_config.yarascan)
+		SourceFiles = AddRuleSources(&Manifest, yara_dir);
 
-		if (Result == ERROR_SUCCESS)
-			DebugOutput("YaraInit: Compiled rules loaded from existing file %s\n", compiled_rules);
-		else if (Result == ERROR_COULD_NOT_OPEN_FILE)
-			DebugOutput("YaraInit: Unable to load existing compiled rules file %s\n", compiled_rules);
-		else
-		{
-			DebugOutput("YaraInit: Error loading existing compiled rules file %s\n", compiled_rules);
-			ScannerError(Result);
-		}
-	}
+	if (LoadRulesCache(compiled_rules, &Manifest))
+		DebugOutput("YaraInit: Compiled rules loaded from existing file %s\n", compiled_rules);
+	// Precompiled rules shipped without their sources
+	else if (!SourceFiles && PathFileExists(compiled_rules) && yr_rules_load(compiled_rules, &Rules) == ERROR_SUCCESS)
+		DebugOutput("YaraInit: Compiled rules loaded from existing file %s\n", compiled_rules);
 	else
 	{
 		if (yr_compiler_create(&Compiler) != ERROR_SUCCESS)
@@ -463,6 +1049,9 @@ BOOL YaraInit()
 			goto exit;
 		}
 
+		if (g_config.yara_threads && yr_compiler_create(&ImmediateCompiler) != ERROR_SUCCESS)
+			ImmediateCompiler = NULL;
+
 		if (g_config.yarascan)
 		{
 			char FindString[MAX_PATH];
@@ -485,7 +1074,15 @@ BOOL YaraInit()
 
 						if (rule_file)
 						{
-							int errors = yr_compiler_add_file(Compiler, rule_file, NULL, file_name);
+							YR_COMPILER* Target = Compiler;
+
+							if (ImmediateCompiler && FileNeedsImmediateAction(rule_file, file_name))
+							{
+								Target = ImmediateCompiler;
+								ImmediateFiles++;
+							}
+
+							int errors = yr_compiler_add_file(Target, rule_file, NULL, file_name);
 
 							if (errors == ERROR_COULD_NOT_OPEN_FILE)
 								DebugOutput("YaraInit: Unable to open file %s\n", file_name);
@@ -528,20 +1125,51 @@ BOOL YaraInit()
 			goto exit;
 		}
 
-		if (g_config.yarascan)
-		{
-			Result = yr_rules_save(Rules, compiled_rules);
+		if (ImmediateFiles && yr_compiler_get_rules(ImmediateCompiler, &ImmediateRules) != ERROR_SUCCESS)
+			ImmediateRules = NULL;
 
-			if (Result != ERROR_SUCCESS)
-				ScannerError(Result);
-			else
-				DebugOutput("YaraInit: Compiled rules saved to file %s\n", compiled_rules);
-		}
+		if (g_config.yarascan)
+			SaveRulesCache(compiled_rules, &Manifest);
 
 		yr_compiler_destroy(Compiler);
+
+		if (ImmediateCompiler)
+			yr_compiler_destroy(ImmediateCompiler);
 	}
 
 	Compiler = NULL;
+	ImmediateCompiler = NULL;
+	RulesManifestFree(&Manifest);
+
+	if (!ScanCacheInitialised)
+	{
+		UINT64 Seed = ((UINT64)GetCurrentProcessId() << 32) ^ GetTickCount() ^ (UINT64)(DWORD_PTR)&Seed;
+		InitializeCriticalSection(&ScanCacheLock);
+		ScanCacheInit(&YaraScanCache, YARA_SCAN_CACHE_LIMIT, Seed);
+		ScanCacheInit(&InternalScanCache, YARA_SCAN_CACHE_LIMIT, Seed);
+		ScanCacheInitialised = TRUE;
+	}
+
+	// Rules compiled without the split (or an older rules file) may need to act immediately
+	if (g_config.yara_threads && !YaraScanQueue && !RulesNeedImmediateAction(Rules))
+	{
+		SCANQUEUECONFIG QueueConfig;
+
+		memset(&QueueConfig, 0, sizeof(QueueConfig));
+		QueueConfig.Threads = g_config.yara_threads < YARA_SCAN_THREADS_MAX ? g_config.yara_threads : YARA_SCAN_THREADS_MAX;
+		QueueConfig.Depth = YARA_SCAN_QUEUE_DEPTH;
+		QueueConfig.SnapshotLimit = YARA_SNAPSHOT_LIMIT;
+		QueueConfig.Scan = YaraBackgroundScan;
+		QueueConfig.Complete = YaraBackgroundScanComplete;
+		QueueConfig.ThreadStart = YaraScanThreadStart;
+
+		YaraScanQueue = ScanQueueCreate(&QueueConfig);
+
+		if (YaraScanQueue)
+			DebugOutput("YaraInit: Scanning large regions with %d background threads.\n", QueueConfig.Threads);
+		else
+			DebugOutput("YaraInit: Unable to start background scan threads.\n");
+	}
 
 	YaraActivated = TRUE;
 	YaraLogging = TRUE;
@@ -564,9 +1192,14 @@ BOOL YaraInit()
 
 	return TRUE;
 exit:
+	RulesManifestFree(&Manifest);
+
 	if (Compiler != NULL)
 		yr_compiler_destroy(Compiler);
 
+	if (ImmediateCompiler != NULL)
+		yr_compiler_destroy(ImmediateCompiler);
+
 	if (Rules != NULL)
 		yr_rules_destroy(Rules);
 
@@ -579,9 +1212,24 @@ void YaraShutdown()
 {
 	YaraActivated = FALSE;
 
+	// Finishes the scans already queued and reports their hits
+	ScanQueueDestroy(YaraScanQueue);
+	YaraScanQueue = NULL;
+
+	if (ScanCacheInitialised)
+	{
+		EnterCriticalSection(&ScanCacheLock);
+		ScanCacheFree(&YaraScanCache);
+		ScanCacheFree(&InternalScanCache);
+		LeaveCriticalSection(&ScanCacheLock);
+	}
+
 	if (Rules != NULL)
 		yr_rules_destroy(Rules);
 
+	if (ImmediateRules != NULL)
+		yr_rules_destroy(ImmediateRules);
+
 	yr_finalize();
 
 	return;
@@ -8,4 +8,6 @@ BOOL YaraInit();
 BOOL ScanForRulesCanary(PVOID Address, SIZE_T Size);
 void YaraScan(PVOID Address, SIZE_T Size);
 void SilentYaraScan(PVOID Address, SIZE_T Size);
+void YaraScanCacheInvalidate(PVOID Address, SIZE_T Size);
+BOOL IsYaraScanThread(DWORD ThreadId);
 void YaraShutdown();
\ No newline at end of file
@@ -0,0 +1,211 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdint.h>
+#include "ZeroScan.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define ZERO_SCAN_SSE2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define VECTOR_SIZE 16
+#define BLOCK_SIZE 64
+
+#define IS_ALIGNED(p, n) (((uintptr_t)(p) & ((n) - 1)) == 0)
+
+static __inline unsigned int LowestSetBit(unsigned int Mask)
+{
+#ifdef _MSC_VER
+	unsigned long Index;
+	_BitScanForward(&Index, Mask);
+	return (unsigned int)Index;
+#else
+	return (unsigned int)__builtin_ctz(Mask);
+#endif
+}
+
+static __inline unsigned int HighestSetBit(unsigned int Mask)
+{
+#ifdef _MSC_VER
+	unsigned long Index;
+	_BitScanReverse(&Index, Mask);
+	return (unsigned int)Index;
+#else
+	return 31 - (unsigned int)__builtin_clz(Mask);
+#endif
+}
+
+#ifdef ZERO_SCAN_SSE2
+
+// Bit n of the result is set if byte n of the aligned vector is non-zero
+static __inline unsigned int NonZeroMask(const unsigned char *p)
+{
+	__m128i v = _mm_load_si128((const __m128i*)p);
+	return ~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & 0xFFFF;
+}
+
+// p is VECTOR_SIZE aligned, Size a multiple of BLOCK_SIZE
+static __inline int BlockIsZero(const unsigned char *p, size_t Size)
+{
+	__m128i Acc = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i < Size; i += BLOCK_SIZE)
+	{
+		__m128i a = _mm_or_si128(_mm_load_si128((const __m128i*)(p + i)), _mm_load_si128((const __m128i*)(p + i + 16)));
+		__m128i b = _mm_or_si128(_mm_load_si128((const __m128i*)(p + i + 32)), _mm_load_si128((const __m128i*)(p + i + 48)));
+		Acc = _mm_or_si128(Acc, _mm_or_si128(a, b));
+	}
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(Acc, _mm_setzero_si128())) == 0xFFFF;
+}
+
+#else
+
+static __inline unsigned int NonZeroMask(const unsigned char *p)
+{
+	const uintptr_t *w = (const uintptr_t*)p;
+	unsigned int i, Mask = 0;
+
+	for (i = 0; i < VECTOR_SIZE / sizeof(uintptr_t); i++)
+		if (w[i])
+			break;
+
+	if (i == VECTOR_SIZE / sizeof(uintptr_t))
+		return 0;
+
+	for (i = 0; i < VECTOR_SIZE; i++)
+		if (p[i])
+			Mask |= 1 << i;
+
+	return Mask;
+}
+
+static __inline int BlockIsZero(const unsigned char *p, size_t Size)
+{
+	const uintptr_t *w = (const uintptr_t*)p;
+	uintptr_t Acc = 0;
+	size_t i;
+
+	for (i = 0; i < Size / sizeof(uintptr_t); i += 4)
+		Acc |= w[i] | w[i+1] | w[i+2] | w[i+3];
+
+	return Acc == 0;
+}
+
+#endif
+
+//**************************************************************************************
+int ZeroScanIsZero(const void *Buffer, size_t Size)
+//**************************************************************************************
+{
+	return ZeroScanForward(Buffer, Size) == Size;
+}
+
+//**************************************************************************************
+size_t ZeroScanForward(const void *Buffer, size_t Size)
+//**************************************************************************************
+{
+	const unsigned char *Start = (const unsigned char*)Buffer, *p = Start, *End = Start + Size;
+	unsigned int Mask;
+
+	while (p < End && !IS_ALIGNED(p, VECTOR_SIZE))
+	{
+		if (*p)
+			return (size_t)(p - Start);
+		p++;
+	}
+
+	while ((size_t)(End - p) >= VECTOR_SIZE)
+	{
+		if (IS_ALIGNED(p, ZERO_SCAN_PAGE_SIZE) && (size_t)(End - p) >= ZERO_SCAN_PAGE_SIZE && BlockIsZero(p, ZERO_SCAN_PAGE_SIZE))
+		{
+			p += ZERO_SCAN_PAGE_SIZE;
+			continue;
+		}
+
+		if (IS_ALIGNED(p, BLOCK_SIZE) && (size_t)(End - p) >= BLOCK_SIZE && BlockIsZero(p, BLOCK_SIZE))
+		{
+			p += BLOCK_SIZE;
+			continue;
+		}
+
+		Mask = NonZeroMask(p);
+		if (Mask)
+			return (size_t)(p - Start) + LowestSetBit(Mask);
+
+		p += VECTOR_SIZE;
+	}
+
+	while (p < End)
+	{
+		if (*p)
+			return (size_t)(p - Start);
+		p++;
+	}
+
+	return Size;
+}
+
+//**************************************************************************************
+size_t ZeroScanReverse(const void *Buffer, size_t Size)
+//**************************************************************************************
+{
+	const unsigned char *Start = (const unsigned char*)Buffer, *p = Start + Size;
+	unsigned int Mask;
+
+	while (p > Start && !IS_ALIGNED(p, VECTOR_SIZE))
+	{
+		p--;
+		if (*p)
+			return (size_t)(p - Start) + 1;
+	}
+
+	while ((size_t)(p - Start) >= VECTOR_SIZE)
+	{
+		if (IS_ALIGNED(p, ZERO_SCAN_PAGE_SIZE) && (size_t)(p - Start) >= ZERO_SCAN_PAGE_SIZE && BlockIsZero(p - ZERO_SCAN_PAGE_SIZE, ZERO_SCAN_PAGE_SIZE))
+		{
+			p -= ZERO_SCAN_PAGE_SIZE;
+			continue;
+		}
+
+		if (IS_ALIGNED(p, BLOCK_SIZE) && (size_t)(p - Start) >= BLOCK_SIZE && BlockIsZero(p - BLOCK_SIZE, BLOCK_SIZE))
+		{
+			p -= BLOCK_SIZE;
+			continue;
+		}
+
+		p -= VECTOR_SIZE;
+		Mask = NonZeroMask(p);
+		if (Mask)
+			return (size_t)(p - Start) + HighestSetBit(Mask) + 1;
+	}
+
+	while (p > Start)
+	{
+		p--;
+		if (*p)
+			return (size_t)(p - Start) + 1;
+	}
+
+	return 0;
+}
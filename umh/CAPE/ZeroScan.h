@@ -0,0 +1,43 @@
+/*
+CAPE - Config And Payload Extraction
+Copyright(C) 2015-2018 Context Information Security. (kevin.oreilly@contextis.com)
+
+This program is free software : you can redistribute it and / or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+
+// Granularity used for the whole-page zero pre-check. All reads made by the
+// scanners below are naturally aligned and never leave the pages spanned by
+// the supplied buffer, so an inaccessible page faults at the same point a
+// byte-by-byte scan would.
+#define ZERO_SCAN_PAGE_SIZE 0x1000
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns non-zero if every byte in the buffer is zero.
+int ZeroScanIsZero(const void *Buffer, size_t Size);
+
+// Returns the offset of the first non-zero byte, or Size if there is none.
+size_t ZeroScanForward(const void *Buffer, size_t Size);
+
+// Returns the offset just past the last non-zero byte, or 0 if there is none.
+size_t ZeroScanReverse(const void *Buffer, size_t Size);
+
+#ifdef __cplusplus
+}
+#endif
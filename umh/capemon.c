@@ -144,6 +144,7 @@ VOID CALLBACK New_DllLoadNotification(
 
 	if (NotificationReason == 1) {
 		BOOL coverage_module = FALSE;
+		add_loaded_module((ULONG_PTR)NotificationData->Loaded.DllBase, (ULONG_PTR)NotificationData->Loaded.DllBase + NotificationData->Loaded.SizeOfImage, dllname, (unsigned int)wcslen(dllname));
 		for (unsigned int i = 0; i < ARRAYSIZE(g_config.coverage_modules); i++) {
 			if (!g_config.coverage_modules[i])
 				break;
@@ -216,6 +217,7 @@ VOID CALLBACK New_DllLoadNotification(
 	}
 	else {
 		// unload
+		remove_loaded_module((ULONG_PTR)NotificationData->Unloaded.DllBase);
 		if (!is_valid_address_range((ULONG_PTR)NotificationData->Unloaded.DllBase, 0x1000)) {
 			// if this unload actually caused removal of the DLL instead of a reference counter decrement,
 			// then we need to loop through our hooks and unmark the hooks eliminated by this removal
@@ -240,7 +242,6 @@ static int parse_stack_trace(void *msg, ULONG_PTR addr)
 			snprintf((char *)msg + strlen(msg), sizeof(msg) - strlen(msg) - 1, "%s::%s(0x%x)\n", buf, funcname, offset);
 		else
 			snprintf((char *)msg + strlen(msg), sizeof(msg) - strlen(msg) - 1, "%s+0x%x\n", buf, offset);
-		free(buf);
 	}
 
 	return 0;
@@ -462,7 +463,6 @@ LONG WINAPI capemon_exception_handler(__in struct _EXCEPTION_POINTERS *Exception
 					snprintf(msg + strlen(msg), sizeof(msg) - strlen(msg) - 1, " %s::%s(0x%x)\n", buf, funcname, offset);
 				else
 					snprintf(msg + strlen(msg), sizeof(msg) - strlen(msg) - 1, " %s+0x%x\n", buf, offset);
-				free(buf);
 			}
 			if (sizeof(msg) - strlen(msg) < 0x200)
 				goto next;
@@ -514,8 +514,6 @@ next:
 
 	DebugOutput(msg);
 
-	if (dllname)
-		free(dllname);
 	free(msg);
 
 	set_lasterrors(&lasterror);
@@ -646,6 +644,12 @@ BOOL APIENTRY DllMain(HANDLE hModule, DWORD dwReason, LPVOID lpReserved)
 		// initialize file stuff, needs to be performed prior to any file normalization
 		file_init();
 
+		// compile the string replacements used by the registry and device fakery
+		fakery_init();
+
+		// index the loaded modules for address to module name lookups
+		module_map_init();
+
 		get_our_dll_path();
 
 		get_our_process_path();
@@ -1202,6 +1202,13 @@ void parse_config_line(char* line)
 			else
 				DebugOutput("In-monitor YARA scans disabled.\n");
 		}
+		else if (!stricmp(key, "yara-threads")) {
+			g_config.yara_threads = (unsigned int)strtoul(value, NULL, 10);
+			if (g_config.yara_threads)
+				DebugOutput("Background YARA scans enabled with %d threads.\n", g_config.yara_threads);
+			else
+				DebugOutput("Background YARA scans disabled.\n");
+		}
 		else if (!stricmp(key, "amsidump")) {
 			g_config.amsidump = value[0] == '1';
 			if (g_config.amsidump)
@@ -1298,6 +1305,7 @@ int read_config(void)
 	g_config.api_cap = 5000;
 	g_config.api_rate_cap = 1;
 	g_config.yarascan = 1;
+	g_config.yara_threads = 2;
 	g_config.loaderlock_scans = 1;
 	g_config.amsidump = 1;
 	g_config.syscall = 1;
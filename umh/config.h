@@ -200,6 +200,9 @@ struct _g_config {
 	// YARA scans
 	int yarascan;
 
+	// YARA scan threads (0: scan synchronously)
+	unsigned int yara_threads;
+
 	// AMSI dumps (Win10+)
 	int amsidump;
 
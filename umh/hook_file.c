@@ -25,8 +25,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "pipe.h"
 #include "misc.h"
 #include "ignore.h"
-#include "lookup.h"
 #include "config.h"
+#include "CAPE\HandleState.h"
+#include "CAPE\Scratch.h"
 
 #define DUMP_FILE_MASK ((GENERIC_ALL | GENERIC_WRITE | FILE_WRITE_DATA | FILE_WRITE_ATTRIBUTES | FILE_WRITE_EA | FILE_APPEND_DATA | MAXIMUM_ALLOWED) & ~SYNCHRONIZE)
 
@@ -44,19 +45,18 @@ typedef struct _file_record_t {
 	wchar_t filename[0];
 } file_record_t;
 
-typedef struct _file_log_t {
-	unsigned int read_count;
-	unsigned int write_count;
-} file_log_t;
-
-static lookup_t g_files;
-static lookup_t g_file_logs;
+// Logging counters, files written and section views mapped, by handle
+PHANDLESTATETABLE g_handles;
 
 static void new_file(const UNICODE_STRING *obj);
 
 void file_init()
 {
 	specialname_map_init();
+	path_cache_init();
+
+	if (!g_handles)
+		g_handles = HandleStateCreate();
 
 	dropped_count = 0;
 	dropped_limit_reached = FALSE;
@@ -64,34 +64,20 @@ void file_init()
 
 static void add_file_to_log_tracking(HANDLE file_handle)
 {
-	file_log_t *r = lookup_get(&g_file_logs, (ULONG_PTR)file_handle, NULL);
-	if (r == NULL) {
-		r = lookup_add(&g_file_logs, (ULONG_PTR)file_handle, sizeof(file_log_t));
+	HandleStateTrackLog(g_handles, (uintptr_t)file_handle);
 #ifdef DEBUG_COMMENTS
-		DebugOutput("add_file_to_log_tracking: Adding file handle to tracking: 0x%x", file_handle);
+	DebugOutput("add_file_to_log_tracking: Adding file handle to tracking: 0x%x", file_handle);
 #endif
-	}
 }
 
 static unsigned int increment_file_log_read_count(HANDLE file_handle)
 {
-	file_log_t *r = lookup_get(&g_file_logs, (ULONG_PTR)file_handle, NULL);
-	if (r != NULL)
-		return ++r->read_count;
-	return 0;
+	return HandleStateCountRead(g_handles, (uintptr_t)file_handle);
 }
 
 static unsigned int increment_file_log_write_count(HANDLE file_handle)
 {
-	file_log_t *r = lookup_get(&g_file_logs, (ULONG_PTR)file_handle, NULL);
-	if (r != NULL)
-		return ++r->write_count;
-	return 0;
-}
-
-void remove_file_from_log_tracking(HANDLE file_handle)
-{
-	lookup_del(&g_file_logs, (ULONG_PTR)file_handle);
+	return HandleStateCountWrite(g_handles, (uintptr_t)file_handle);
 }
 
 static void new_file_path_ascii(const char *fname)
@@ -104,7 +90,9 @@ static void new_file_path_ascii(const char *fname)
 		return;
 	}
 
-	char *absolutename = malloc(32768);
+	SCRATCHFRAME frame;
+	ScratchPush(&frame);
+	char *absolutename = ScratchAlloc(32768);
 	if (absolutename != NULL) {
 		unsigned int len;
 		ensure_absolute_ascii_path(absolutename, fname);
@@ -115,6 +103,7 @@ static void new_file_path_ascii(const char *fname)
 		pipe("FILE_NEW:%s", len, absolutename);
 		dropped_count++;
 	}
+	ScratchPop(&frame);
 }
 
 static void new_file_path_unicode(const wchar_t *fname)
@@ -127,7 +116,9 @@ static void new_file_path_unicode(const wchar_t *fname)
 		return;
 	}
 
-	wchar_t *absolutename = malloc(32768 * sizeof(wchar_t));
+	SCRATCHFRAME frame;
+	ScratchPush(&frame);
+	wchar_t *absolutename = ScratchAlloc(32768 * sizeof(wchar_t));
 	if (absolutename != NULL) {
 		unsigned int len;
 		ensure_absolute_unicode_path(absolutename, fname);
@@ -138,6 +129,7 @@ static void new_file_path_unicode(const wchar_t *fname)
 		pipe("FILE_NEW:%S", len, absolutename);
 		dropped_count++;
 	}
+	ScratchPop(&frame);
 }
 
 static void new_file(const UNICODE_STRING *obj)
@@ -167,22 +159,27 @@ static void new_file(const UNICODE_STRING *obj)
 static void cache_file(HANDLE file_handle, const wchar_t *path, unsigned int length_in_chars, unsigned int attributes)
 {
 	file_record_t *r;
+	size_t size;
 	lasterror_t lasterror;
 
 	get_lasterrors(&lasterror);
 
-	r = lookup_get(&g_files, (ULONG_PTR)file_handle, NULL);
-	if (r == NULL) {
-		r = lookup_add(&g_files, (ULONG_PTR)file_handle, sizeof(file_record_t) + length_in_chars * sizeof(wchar_t) + sizeof(wchar_t));
-
+	size = sizeof(file_record_t) + length_in_chars * sizeof(wchar_t) + sizeof(wchar_t);
+	r = malloc(size);
+	if (r != NULL) {
 		memset(r, 0, sizeof(*r));
 		r->attributes = attributes;
 		r->length = length_in_chars;
 
 		wcsncpy(r->filename, path, r->length + 1);
+
+		// kept only if the handle isn't tracked already
+		if (HandleStateSetFile(g_handles, (uintptr_t)file_handle, r, size)) {
 #ifdef DEBUG_COMMENTS
-		DebugOutput("cache_file: Adding file handle to tracking: 0x%x, %ws", file_handle, path);
+			DebugOutput("cache_file: Adding file handle to tracking: 0x%x, %ws", file_handle, path);
 #endif
+		}
+		free(r);
 	}
 
 	set_lasterrors(&lasterror);
@@ -190,14 +187,13 @@ static void cache_file(HANDLE file_handle, const wchar_t *path, unsigned int len
 
 void file_write(HANDLE file_handle)
 {
-	file_record_t *r;
+	file_record_t r;
 	lasterror_t lasterror;
 
 	get_lasterrors(&lasterror);
 
-	r = lookup_get(&g_files, (ULONG_PTR)file_handle, NULL);
-	if (r == NULL) {
-		r = lookup_add(&g_files, (ULONG_PTR)file_handle, sizeof(file_record_t));
+	memset(&r, 0, sizeof(r));
+	if (HandleStateSetFile(g_handles, (uintptr_t)file_handle, &r, sizeof(r))) {
 #ifdef DEBUG_COMMENTS
 		DebugOutput("file_write: Adding file handle to tracking: 0x%x", file_handle);
 #endif
@@ -217,19 +213,21 @@ static void check_for_logging_resumption(const OBJECT_ATTRIBUTES *obj)
 	get_lasterrors(&lasterror);
 
 	if (g_config.file_of_interest && g_config.suspend_logging) {
-		wchar_t *fname = calloc(1, 32768 * sizeof(wchar_t));
-		wchar_t *absolutename = malloc(32768 * sizeof(wchar_t));
-		BOOLEAN ret = FALSE;
+		SCRATCHFRAME frame;
+		ScratchPush(&frame);
+		wchar_t *fname = ScratchAlloc(32768 * sizeof(wchar_t));
+		wchar_t *absolutename = ScratchAlloc(32768 * sizeof(wchar_t));
 
-		path_from_object_attributes(obj, fname, 32768);
+		if (fname && absolutename) {
+			path_from_object_attributes(obj, fname, 32768);
 
-		ensure_absolute_unicode_path(absolutename, fname);
+			ensure_absolute_unicode_path(absolutename, fname);
 
-		if (!wcsicmp(absolutename, g_config.file_of_interest))
-			g_config.suspend_logging = FALSE;
+			if (!wcsicmp(absolutename, g_config.file_of_interest))
+				g_config.suspend_logging = FALSE;
+		}
 
-		free(absolutename);
-		free(fname);
+		ScratchPop(&frame);
 	}
 
 	set_lasterrors(&lasterror);
@@ -242,108 +240,96 @@ static void handle_new_file(HANDLE file_handle, const OBJECT_ATTRIBUTES *obj)
 	get_lasterrors(&lasterror);
 
 	if (is_directory_objattr(obj) == 0) {
-
-		wchar_t *fname = calloc(32768, sizeof(wchar_t));
-		wchar_t *absolutename = calloc(32768, sizeof(wchar_t));
-
-		path_from_object_attributes(obj, fname, 32768);
-
-		if (absolutename != NULL) {
-			unsigned int len;
-			ensure_absolute_unicode_path(absolutename, fname);
-			len = lstrlenW(absolutename);
-			// cache this file
-			if (is_ignored_file_unicode(absolutename, len) == 0)
-				cache_file(file_handle, absolutename, len, obj->Attributes);
-			free(absolutename);
-		}
-		else {
-			if (is_ignored_file_objattr(obj) == 0)
-				cache_file(file_handle, fname, lstrlenW(fname), obj->Attributes);
+		SCRATCHFRAME frame;
+		ScratchPush(&frame);
+		wchar_t *fname = ScratchAlloc(32768 * sizeof(wchar_t));
+		wchar_t *absolutename = ScratchAlloc(32768 * sizeof(wchar_t));
+
+		if (fname != NULL) {
+			path_from_object_attributes(obj, fname, 32768);
+
+			if (absolutename != NULL) {
+				unsigned int len;
+				ensure_absolute_unicode_path(absolutename, fname);
+				len = lstrlenW(absolutename);
+				// cache this file
+				if (is_ignored_file_unicode(absolutename, len) == 0)
+					cache_file(file_handle, absolutename, len, obj->Attributes);
+			}
+			else {
+				if (is_ignored_file_objattr(obj) == 0)
+					cache_file(file_handle, fname, lstrlenW(fname), obj->Attributes);
+			}
 		}
-		free(fname);
+		ScratchPop(&frame);
 	}
 
 	set_lasterrors(&lasterror);
 }
 
-// XXX: if we ever track entries which contain pointers themselves that use runtime allocation
-// this needs to be rewritten, sufficient for now for file_log_t and file_record_t
-static void __handle_duplicate(lookup_t *d, HANDLE old_handle, HANDLE new_handle)
+void handle_duplicate(HANDLE old_handle, HANDLE new_handle)
 {
-	unsigned int size;
-	void *rdata;
-
 	lasterror_t lasterror;
 
 	get_lasterrors(&lasterror);
 
-	rdata = lookup_get(d, (ULONG_PTR)old_handle, &size);
-	if (rdata) {
-		void *data = lookup_add(d, (ULONG_PTR)new_handle, size);
-		if (data)
-			memcpy(data, rdata, size);
-	}
+	HandleStateDuplicate(g_handles, (uintptr_t)old_handle, (uintptr_t)new_handle);
 
 	set_lasterrors(&lasterror);
 }
 
-void handle_duplicate(HANDLE old_handle, HANDLE new_handle)
+static void report_file(PHANDLESTATEFILE file)
 {
-	__handle_duplicate(&g_file_logs, old_handle, new_handle);
-	__handle_duplicate(&g_files, old_handle, new_handle);
+	file_record_t *r = (file_record_t *)file->Data;
+	UNICODE_STRING str;
+
+	str.Length = (USHORT)r->length * sizeof(wchar_t);
+	str.MaximumLength = ((USHORT)r->length + 1) * sizeof(wchar_t);
+	str.Buffer = r->filename;
+	new_file(&str);
 }
 
-void file_close(HANDLE file_handle)
+void *handle_close(HANDLE handle)
 {
 	lasterror_t lasterror;
-	file_record_t *r;
+	HANDLESTATE state;
 
 	get_lasterrors(&lasterror);
 
-	r = lookup_get(&g_files, (ULONG_PTR)file_handle, NULL);
-	if (r != NULL) {
-		UNICODE_STRING str;
-		str.Length = (USHORT)r->length * sizeof(wchar_t);
-		str.MaximumLength = ((USHORT)r->length + 1) * sizeof(wchar_t);
-		str.Buffer = r->filename;
-		new_file(&str);
-		lookup_del(&g_files, (ULONG_PTR) file_handle);
+	path_cache_drop_handle(handle);
+
+	if (HandleStateClose(g_handles, (uintptr_t)handle, &state) && state.File) {
+		report_file(state.File);
+		HandleStateReleaseFile(g_handles, state.File);
 #ifdef DEBUG_COMMENTS
-		DebugOutput("file_close: Closing tracked file handle: 0x%x", file_handle);
+		DebugOutput("handle_close: Closing tracked file handle: 0x%x", handle);
 #endif
 	}
 
 	set_lasterrors(&lasterror);
+
+	return state.SectionView;
+}
+
+static void report_open_file(uintptr_t handle, PHANDLESTATEFILE file, void *context)
+{
+#ifdef DEBUG_COMMENTS
+	//DebugOutput("file_handle_terminate: new_file %ws", ((file_record_t *)file->Data)->filename);
+#endif
+	report_file(file);
 }
 
 void file_handle_terminate()
 {
-	entry_t *p;
-	file_record_t *r;
 	lasterror_t lasterror;
 
-	// ensure this only happens once as we can't lookup_del in the loop
+	// ensure this only happens once as the files stay tracked
 	if (files_dumped)
 		return;
 
 	get_lasterrors(&lasterror);
 
-	for (p = (entry_t*)&(g_files.root); p != NULL; p = p->next) {
-		if (p->id) {
-			r = lookup_get(&g_files, (ULONG_PTR)p->id, NULL);
-			if (r != NULL) {
-				UNICODE_STRING str;
-				str.Length = (USHORT)r->length * sizeof(wchar_t);
-				str.MaximumLength = ((USHORT)r->length + 1) * sizeof(wchar_t);
-				str.Buffer = r->filename;
-#ifdef DEBUG_COMMENTS
-				//DebugOutput("file_handle_terminate: new_file %ws", r->filename);
-#endif
-				new_file(&str);
-			}
-		}
-	}
+	HandleStateForEachFile(g_handles, report_open_file, NULL);
 
 	files_dumped = TRUE;
 
@@ -504,7 +490,9 @@ HOOKDEF(NTSTATUS, WINAPI, NtReadFile,
 	set_special_api(API_NTREADFILE, deletelast);
 
 	if (read_count <= 50) {
-		fname = calloc(32768, sizeof(wchar_t));
+		SCRATCHFRAME frame;
+		ScratchPush(&frame);
+		fname = ScratchAlloc(32768 * sizeof(wchar_t));
 		path_from_handle(FileHandle, fname, 32768);
 
 		if (read_count < 50)
@@ -514,7 +502,7 @@ HOOKDEF(NTSTATUS, WINAPI, NtReadFile,
 			LOQ_ntstatus("filesystem", "pFbls", "FileHandle", FileHandle,
 				"HandleName", fname, "Buffer", InitialBufferLength, InitialBuffer, "Length", AccumulatedLength, "Status", "Maximum logged reads reached for this file");
 
-		free(fname);
+		ScratchPop(&frame);
 	}
 
 	set_lasterrors(&lasterrors);
@@ -546,7 +534,9 @@ HOOKDEF(NTSTATUS, WINAPI, NtWriteFile,
 
 	write_count = increment_file_log_write_count(FileHandle);
 	if (write_count <= 50) {
-		fname = calloc(32768, sizeof(wchar_t));
+		SCRATCHFRAME frame;
+		ScratchPush(&frame);
+		fname = ScratchAlloc(32768 * sizeof(wchar_t));
 		path_from_handle(FileHandle, fname, 32768);
 
 		if (write_count < 50) {
@@ -558,7 +548,7 @@ HOOKDEF(NTSTATUS, WINAPI, NtWriteFile,
 				"HandleName", fname, "Buffer", length, Buffer, "Length", length, "Status", "Maximum logged writes reached for this file");
 		}
 
-		free(fname);
+		ScratchPop(&frame);
 	}
 
 	if (NT_SUCCESS(ret)) {
@@ -778,6 +768,9 @@ HOOKDEF(NTSTATUS, WINAPI, NtSetInformationFile,
 		FileInformation, Length, FileInformationClass);
 
 	if (FileInformation != NULL && FileInformationClass == FileRenameInformation) {
+		// names relative to the renamed handle have moved with it
+		if (NT_SUCCESS(ret))
+			path_cache_drop_handle(FileHandle);
 		if (NT_SUCCESS(ret) && dropped_count < g_config.dropped_limit) {
 #ifdef DEBUG_COMMENTS
 			DebugOutput("NtSetInformationFile: FILE_MOVE %ws::%ws\n", absolutepath, renamepath);
@@ -1472,6 +1465,21 @@ HOOKDEF(BOOL, WINAPI, GetVolumeNameForVolumeMountPointW,
 	return ret;
 }
 
+HOOKDEF(BOOL, WINAPI, DefineDosDeviceW,
+	_In_	 DWORD dwFlags,
+	_In_	 LPCWSTR lpDeviceName,
+	_In_opt_ LPCWSTR lpTargetPath
+) {
+	BOOL ret = Old_DefineDosDeviceW(dwFlags, lpDeviceName, lpTargetPath);
+	LOQ_bool("filesystem", "huu", "Flags", dwFlags, "DeviceName", lpDeviceName, "TargetPath", lpTargetPath);
+
+	// drive letters may now resolve elsewhere
+	if (ret)
+		path_cache_flush();
+
+	return ret;
+}
+
 HOOKDEF(BOOL, WINAPI, GetVolumeInformationByHandleW,
 	_In_	  HANDLE  hFile,
 	_Out_opt_ LPWSTR  lpVolumeNameBuffer,
@@ -18,6 +18,6 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "lookup.h"
 
 void file_init();
-void file_close(HANDLE file_handle);
+// Drops everything tracked for a closed handle, returning any section view mapped through it
+void *handle_close(HANDLE handle);
 void handle_duplicate(HANDLE old_handle, HANDLE new_handle);
-void remove_file_from_log_tracking(HANDLE fhandle);
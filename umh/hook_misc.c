@@ -399,11 +399,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtClose,
 	}
 	ret = Old_NtClose(Handle);
 	LOQ_ntstatus("system", "p", "Handle", Handle);
-	if(NT_SUCCESS(ret)) {
-		remove_file_from_log_tracking(Handle);
-		DumpSectionViewsForHandle(Handle);
-		file_close(Handle);
-	}
+	if(NT_SUCCESS(ret))
+		CloseSectionHandler(handle_close(Handle));
 	return ret;
 }
 
@@ -424,14 +421,10 @@ HOOKDEF(NTSTATUS, WINAPI, NtDuplicateObject,
 		LOQ_ntstatus("system", "pph", "SourceProcessHandle", SourceProcessHandle, "SourceHandle", SourceHandle, "Options", Options);
 
 	if (NT_SUCCESS(ret)) {
-		if (TargetProcessHandle == NtCurrentProcess() && TargetHandle) {
-			handle_duplicate(SourceHandle, *TargetHandle);
+		if (TargetProcessHandle == NtCurrentProcess() && TargetHandle)
 			handle_duplicate(SourceHandle, *TargetHandle);
-		}
-		if (SourceProcessHandle == NtCurrentProcess() && (Options & DUPLICATE_CLOSE_SOURCE)) {
-			remove_file_from_log_tracking(SourceHandle);
-			file_close(SourceHandle);
-		}
+		if (SourceProcessHandle == NtCurrentProcess() && (Options & DUPLICATE_CLOSE_SOURCE))
+			handle_close(SourceHandle);
 	}
 	return ret;
 }
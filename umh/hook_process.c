@@ -35,12 +35,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 extern void DebugOutput(_In_ LPCTSTR lpOutputString, ...);
 extern void ErrorOutput(_In_ LPCTSTR lpOutputString, ...);
-extern struct TrackedRegion *TrackedRegionList;
 extern void AllocationHandler(PVOID BaseAddress, SIZE_T RegionSize, ULONG AllocationType, ULONG Protect);
 extern void DebuggerAllocationHandler(PVOID BaseAddress, SIZE_T RegionSize, ULONG Protect);
 extern void ProtectionHandler(PVOID BaseAddress, ULONG Protect, PULONG OldProtect);
 extern void FreeHandler(PVOID BaseAddress), ProcessMessage(DWORD ProcessId, DWORD ThreadId);
 extern void ProcessTrackedRegion(), DebuggerShutdown(), DumpStrings();
+extern void YaraScanCacheInvalidate(PVOID Address, SIZE_T Size);
 extern LONG WINAPI mini_handler(__in struct _EXCEPTION_POINTERS *ExceptionInfo);
 
 extern lookup_t g_caller_regions;
@@ -730,9 +730,6 @@ HOOKDEF(NTSTATUS, WINAPI, NtMapViewOfSection,
 		}
 	}
 
-	if (ModuleName)
-		free(ModuleName);
-
 	return ret;
 }
 
@@ -1082,6 +1079,8 @@ HOOKDEF(NTSTATUS, WINAPI, NtProtectVirtualMemory,
 	if (NT_SUCCESS(ret) && BaseAddress && !called_by_hook() && NtCurrentProcess() == ProcessHandle)
 	{
 		PVOID AllocationBase = GetAllocationBase(*BaseAddress);
+		if (NumberOfBytesToProtect)
+			YaraScanCacheInvalidate(*BaseAddress, *NumberOfBytesToProtect);
 		if (g_config.unpacker)
 			ProtectionHandler(*BaseAddress, NewAccessProtection, OldAccessProtection);
 		if (g_config.caller_regions)
@@ -1111,9 +1110,6 @@ HOOKDEF(NTSTATUS, WINAPI, NtProtectVirtualMemory,
 			"NumberOfBytesProtected", NumberOfBytesToProtect, "MemoryType", meminfo.Type, "NewAccessProtection", NewAccessProtection,
 			"OldAccessProtection", OldAccessProtection, "StackPivoted", is_stack_pivoted() ? "yes" : "no");
 
-	if (ModuleName)
-		free(ModuleName);
-
 	return ret;
 }
 
@@ -1172,6 +1168,7 @@ HOOKDEF(BOOL, WINAPI, VirtualProtectEx,
 		char ModulePath[MAX_PATH];
 		PVOID AllocationBase = GetAllocationBase(lpAddress);
 		BOOL MappedModule = GetMappedFileName(GetCurrentProcess(), AllocationBase, ModulePath, MAX_PATH);
+		YaraScanCacheInvalidate(lpAddress, dwSize);
 		if (g_config.unpacker)
 			ProtectionHandler(lpAddress, flNewProtect, lpflOldProtect);
 		if (g_config.caller_regions)
@@ -1197,9 +1194,6 @@ HOOKDEF(BOOL, WINAPI, VirtualProtectEx,
 		LOQ_bool("process", "ppphhHs", "ProcessHandle", hProcess, "Address", lpAddress, "Size", dwSize, "MemType", meminfo.Type, 
 			"Protection", flNewProtect, "OldProtection", lpflOldProtect, "StackPivoted", is_stack_pivoted() ? "yes" : "no");
 
-	if (ModuleName)
-		free(ModuleName);
-
 	return ret;
 }
 
@@ -1216,6 +1210,9 @@ HOOKDEF(NTSTATUS, WINAPI, NtFreeVirtualMemory,
 	NTSTATUS ret = Old_NtFreeVirtualMemory(ProcessHandle, BaseAddress,
 		RegionSize, FreeType);
 
+	if (NT_SUCCESS(ret) && NtCurrentProcess() == ProcessHandle && BaseAddress && RegionSize)
+		YaraScanCacheInvalidate(*BaseAddress, *RegionSize);
+
 	LOQ_ntstatus("process", "pPPh", "ProcessHandle", ProcessHandle, "BaseAddress", BaseAddress,
 		"RegionSize", RegionSize, "FreeType", FreeType);
 
@@ -1350,8 +1347,6 @@ HOOKDEF_ALT(BOOL, WINAPI, RtlDispatchException,
 					LOQ_void("system", "pppp", "ExceptionCode", ExceptionRecord->ExceptionCode, "ExceptionAddress", ExceptionRecord->ExceptionAddress, "ExceptionFlags", ExceptionRecord->ExceptionFlags, "ExceptionInformation", ExceptionRecord->ExceptionInformation[0]);
 				return TRUE;
 			}
-			if (dllname)
-				free(dllname);
 		}
 	}
 
@@ -678,6 +678,8 @@ HOOKDEF(LONG, WINAPI, RegCloseKey,
 	) {
 	LONG ret = Old_RegCloseKey(hKey);
 	LOQ_zero("registry", "p", "Handle", hKey);
+	if (ret == ERROR_SUCCESS)
+		path_cache_drop_handle(hKey);
 	return ret;
 }
 
@@ -38,6 +38,8 @@ extern void CreateRemoteThreadHandler(DWORD Pid);
 extern void NtContinueHandler(PCONTEXT ThreadContext);
 extern void ProcessMessage(DWORD ProcessId, DWORD ThreadId);
 extern BOOL BreakpointsSet;
+extern BOOL IsYaraScanThread(DWORD ThreadId);
+extern BOOL IsCodeScanThread(DWORD ThreadId);
 
 static lookup_t g_ignored_threads;
 
@@ -90,8 +92,11 @@ HOOKDEF(NTSTATUS, WINAPI, NtQueueApcThread,
 	unsigned int offset;
 	NTSTATUS ret;
 
-	if (pid != GetCurrentProcessId())
+	// an APC is as good as a new thread for running what was written into a running process
+	if (pid != GetCurrentProcessId()) {
+		CreateRemoteThreadHandler(pid);
 		ProcessMessage(pid, 0);
+	}
 
 	ret = Old_NtQueueApcThread(ThreadHandle, ApcRoutine, ApcRoutineContext, ApcStatusBlock, ApcReserved);
 
@@ -102,9 +107,6 @@ HOOKDEF(NTSTATUS, WINAPI, NtQueueApcThread,
 	else
 		LOQ_ntstatus("threading", "iipp", "ProcessId", pid, "ThreadId", tid, "ThreadHandle", ThreadHandle, "ApcRoutine", ApcRoutine);
 
-	if (module_name)
-		free(module_name);
-
 	if (NT_SUCCESS(ret))
 		disable_sleep_skip();
 
@@ -125,8 +127,11 @@ HOOKDEF(NTSTATUS, WINAPI, NtQueueApcThreadEx,
 	unsigned int offset;
 	NTSTATUS ret;
 
-	if (pid != GetCurrentProcessId())
+	// an APC is as good as a new thread for running what was written into a running process
+	if (pid != GetCurrentProcessId()) {
+		CreateRemoteThreadHandler(pid);
 		ProcessMessage(pid, 0);
+	}
 
 	ret = Old_NtQueueApcThreadEx(ThreadHandle, UserApcReserveHandle, ApcRoutine, ApcRoutineContext, ApcStatusBlock, ApcReserved);
 
@@ -137,9 +142,6 @@ HOOKDEF(NTSTATUS, WINAPI, NtQueueApcThreadEx,
 	else
 		LOQ_ntstatus("threading", "iipp", "ProcessId", pid, "ThreadId", tid, "ThreadHandle", ThreadHandle, "ApcRoutine", ApcRoutine);
 
-	if (module_name)
-		free(module_name);
-
 	if (NT_SUCCESS(ret))
 		disable_sleep_skip();
 
@@ -263,9 +265,6 @@ HOOKDEF(NTSTATUS, WINAPI, NtCreateThreadEx,
 				"StartAddress", lpStartAddress, "CreateFlags", CreateFlags);
 	}
 
-	if (module_name)
-		free(module_name);
-
 	return ret;
 }
 
@@ -402,7 +401,7 @@ HOOKDEF(NTSTATUS, WINAPI, NtSuspendThread,
 
 	if (pid == GetCurrentProcessId() && tid && (tid == g_unhook_detect_thread_id || tid == g_unhook_watcher_thread_id ||
 		tid == g_watchdog_thread_id || tid == g_terminate_event_thread_id || tid == g_log_thread_id ||
-		tid == g_logwatcher_thread_id || tid == g_procname_watcher_thread_id)) {
+		tid == g_logwatcher_thread_id || tid == g_procname_watcher_thread_id || IsYaraScanThread(tid) || IsCodeScanThread(tid))) {
 		ret = 0;
 		*PreviousSuspendCount = 0;
 		LOQ_ntstatus("threading", "pLsi", "ThreadHandle", ThreadHandle,
@@ -457,7 +456,7 @@ HOOKDEF(NTSTATUS, WINAPI, NtTerminateThread,
 
 	if (pid == GetCurrentProcessId() && tid && (tid == g_unhook_detect_thread_id || tid == g_unhook_watcher_thread_id ||
 		tid == g_watchdog_thread_id || tid == g_terminate_event_thread_id || tid == g_log_thread_id ||
-		tid == g_logwatcher_thread_id || tid == g_procname_watcher_thread_id)) {
+		tid == g_logwatcher_thread_id || tid == g_procname_watcher_thread_id || IsYaraScanThread(tid) || IsCodeScanThread(tid))) {
 		ret = 0;
 		LOQ_ntstatus("threading", "phsi", "ThreadHandle", ThreadHandle, "ExitStatus", ExitStatus, "Alert", "Attempted to kill capemon thread",
 		"ProcessId", pid);
@@ -516,9 +515,6 @@ HOOKDEF(HANDLE, WINAPI, CreateThread,
 		LOQ_nonnull("threading", "pph", "StartRoutine", lpStartAddress, "Parameter", lpParameter,
 			"CreationFlags", dwCreationFlags);
 
-	if (module_name)
-		free(module_name);
-
 	return ret;
 }
 
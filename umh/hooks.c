@@ -137,6 +137,7 @@ hook_t full_hooks[] = {
 	HOOK(kernel32, GetDiskFreeSpaceW),
 	HOOK(kernel32, GetVolumeNameForVolumeMountPointW),
 	HOOK(kernel32, GetVolumeInformationByHandleW),
+	HOOK(kernel32, DefineDosDeviceW),
 	HOOK(shell32, SHGetFolderPathW),
 	HOOK(shell32, SHGetKnownFolderPath),
 	HOOK(shell32, SHGetFileInfoW),
@@ -802,6 +803,7 @@ hook_t office_hooks[] = {
 	HOOK(kernel32, GetDiskFreeSpaceW),
 	HOOK(kernel32, GetVolumeNameForVolumeMountPointW),
 	HOOK(kernel32, GetVolumeInformationByHandleW),
+	HOOK(kernel32, DefineDosDeviceW),
 	HOOK(shell32, SHGetFolderPathW),
 	HOOK(shell32, SHGetKnownFolderPath),
 	HOOK(shell32, SHGetFileInfoW),
@@ -359,6 +359,12 @@ HOOKDEF(BOOL, WINAPI, GetVolumeNameForVolumeMountPointW,
 	_In_ DWORD cchBufferLength
 );
 
+HOOKDEF(BOOL, WINAPI, DefineDosDeviceW,
+	_In_	 DWORD dwFlags,
+	_In_	 LPCWSTR lpDeviceName,
+	_In_opt_ LPCWSTR lpTargetPath
+);
+
 HOOKDEF(HRESULT, WINAPI, SHGetFolderPathW,
 	_In_ HWND hwndOwner,
 	_In_ int nFolder,
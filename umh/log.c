@@ -27,6 +27,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "bson.h"
 #include "pipe.h"
 #include "config.h"
+#include "CAPE\Scratch.h"
 
 extern char* GetResultsPath(char* FolderName);
 
@@ -594,16 +595,19 @@ void loq(int index, const char *category, const char *name,
 		}
 		else if (key == 'F') {
 			const wchar_t *s = va_arg(args, const wchar_t *);
-			wchar_t *absolutepath = malloc(32768 * sizeof(wchar_t));
+			SCRATCHFRAME frame;
+			wchar_t *absolutepath;
+			ScratchPush(&frame);
+			absolutepath = ScratchAlloc(32768 * sizeof(wchar_t));
 			if (s == NULL) s = L"";
 			if (absolutepath) {
 				ensure_absolute_unicode_path(absolutepath, s);
 				log_wstring(absolutepath, -1);
-				free(absolutepath);
 			}
 			else {
 				log_wstring(L"", -1);
 			}
+			ScratchPop(&frame);
 		}
 		else if (key == 'U') {
 			int len = va_arg(args, int);
@@ -687,54 +691,78 @@ void loq(int index, const char *category, const char *name,
 			HKEY reg = va_arg(args, HKEY);
 			const char *s = va_arg(args, const char *);
 			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
+			PKEY_NAME_INFORMATION keybuf;
+			SCRATCHFRAME frame;
+
+			ScratchPush(&frame);
+			keybuf = ScratchAlloc(allocsize);
 
 			log_wstring(get_full_key_pathA(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			ScratchPop(&frame);
 		}
 		else if (key == 'E') {
 			HKEY reg = va_arg(args, HKEY);
 			const wchar_t *s = va_arg(args, const wchar_t *);
 			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
+			PKEY_NAME_INFORMATION keybuf;
+			SCRATCHFRAME frame;
+
+			ScratchPush(&frame);
+			keybuf = ScratchAlloc(allocsize);
 
 			log_wstring(get_full_key_pathW(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			ScratchPop(&frame);
 		}
 		else if (key == 'K') {
 			OBJECT_ATTRIBUTES *obj = va_arg(args, OBJECT_ATTRIBUTES *);
 			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
+			PKEY_NAME_INFORMATION keybuf;
+			SCRATCHFRAME frame;
+
+			ScratchPush(&frame);
+			keybuf = ScratchAlloc(allocsize);
 
 			log_wstring(get_key_path(obj, keybuf, allocsize), -1);
-			free(keybuf);
+			ScratchPop(&frame);
 		}
 		else if (key == 'k') {
 			HKEY reg = va_arg(args, HKEY);
 			const PUNICODE_STRING s = va_arg(args, const PUNICODE_STRING);
 			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
+			PKEY_NAME_INFORMATION keybuf;
+			SCRATCHFRAME frame;
+
+			ScratchPush(&frame);
+			keybuf = ScratchAlloc(allocsize);
 
 			log_wstring(get_full_keyvalue_pathUS(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			ScratchPop(&frame);
 		}
 		else if (key == 'v') {
 			HKEY reg = va_arg(args, HKEY);
 			const char *s = va_arg(args, const char *);
 			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
+			PKEY_NAME_INFORMATION keybuf;
+			SCRATCHFRAME frame;
+
+			ScratchPush(&frame);
+			keybuf = ScratchAlloc(allocsize);
 
 			log_wstring(get_full_keyvalue_pathA(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			ScratchPop(&frame);
 		}
 		else if (key == 'V') {
 			HKEY reg = va_arg(args, HKEY);
 			const wchar_t *s = va_arg(args, const wchar_t *);
 			unsigned int allocsize = sizeof(KEY_NAME_INFORMATION) + MAX_KEY_BUFLEN;
-			PKEY_NAME_INFORMATION keybuf = malloc(allocsize);
+			PKEY_NAME_INFORMATION keybuf;
+			SCRATCHFRAME frame;
+
+			ScratchPush(&frame);
+			keybuf = ScratchAlloc(allocsize);
 
 			log_wstring(get_full_keyvalue_pathW(reg, s, keybuf, allocsize), -1);
-			free(keybuf);
+			ScratchPop(&frame);
 		}
 		else if (key == 'o') {
 			UNICODE_STRING *str = va_arg(args, UNICODE_STRING *);
@@ -752,17 +780,20 @@ void loq(int index, const char *category, const char *name,
 			}
 			else {
 				wchar_t path[MAX_PATH_PLUS_TOLERANCE];
-				wchar_t *absolutepath = malloc(32768 * sizeof(wchar_t));
+				SCRATCHFRAME frame;
+				wchar_t *absolutepath;
+				ScratchPush(&frame);
+				absolutepath = ScratchAlloc(32768 * sizeof(wchar_t));
 				if (absolutepath) {
 					path_from_object_attributes(obj, path, MAX_PATH_PLUS_TOLERANCE);
 
 					ensure_absolute_unicode_path(absolutepath, path);
 					log_wstring(absolutepath, -1);
-					free(absolutepath);
 				}
 				else {
 					log_wstring(L"", -1);
 				}
+				ScratchPop(&frame);
 			}
 		}
 		else if (key == 'a') {
@@ -29,10 +29,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "log.h"
 #include "pipe.h"
 #include "config.h"
+#include "CAPE\Scratch.h"
+#include "CAPE\PathCache.h"
+#include "CAPE\KeyPath.h"
+#include "CAPE\MultiReplace.h"
+#include "CAPE\StrSearch.h"
+#include "CAPE\Signature.h"
+#include "CAPE\ModuleMap.h"
+#include "CAPE\ExportIndex.h"
 
 extern char *our_process_name;
 extern int path_is_system(const wchar_t *path_w);
 extern void DebugOutput(_In_ LPCTSTR lpOutputString, ...);
+extern void ScyllaModuleLoaded(ULONG_PTR ModuleBase, const char *ModuleName);
+extern void ScyllaModuleUnloaded(ULONG_PTR ModuleBase);
 
 static _NtQueryInformationProcess pNtQueryInformationProcess;
 static _NtQueryInformationThread pNtQueryInformationThread;
@@ -178,16 +188,7 @@ int is_stack_pivoted(void)
 
 static PCHAR memmem(PCHAR haystack, ULONG hlen, PCHAR needle, ULONG nlen)
 {
-  if (nlen > hlen)
-	return NULL;
-
-  ULONG i;
-  for (i = 0; i < hlen - nlen + 1; i++) {
-	if (!memcmp(haystack + i, needle, nlen))
-	  return haystack + i;
-  }
-
-  return NULL;
+	return (PCHAR)StrSearchMemory(haystack, hlen, needle, nlen);
 }
 
 BOOL is_bytes_in_buf(PCHAR buf, ULONG len, PCHAR memstr, ULONG memlen, ULONG maxsearchbytes)
@@ -264,38 +265,106 @@ void replace_ci_wstring_in_buf(PWCHAR buf, ULONG len, PWCHAR findstr, PWCHAR rep
 	}
 }
 
-// https://stackoverflow.com/questions/27303062/strstr-function-like-that-ignores-upper-or-lower-case
+// case-insensitive for ASCII letters, as tolower and towlower are in the C locale we run in
 char* stristr(char* haystack, const char* needle) {
-	int c = tolower(*needle);
-	if (c == '\0')
-		return haystack;
-	for (; *haystack; haystack++) {
-		if (tolower(*haystack) == c) {
-			for (size_t i = 0;;) {
-				if (needle[++i] == '\0')
-					return haystack;
-				if (tolower(haystack[i]) != tolower(needle[i]))
-					break;
-			}
-		}
-	}
-	return NULL;
+	return StrSearchNoCase(haystack, needle);
 }
 
 wchar_t* wcsistr(wchar_t* haystack, const wchar_t* needle) {
-	wint_t c = towlower(*needle);
-	if (c == L'\0')
-		return haystack;
-	for (; *haystack; haystack++) {
-		if (towlower(*haystack) == c) {
-			for (size_t i = 0;;) {
-				if (needle[++i] == L'\0')
-					return haystack;
-				if (towlower(haystack[i]) != towlower(needle[i]))
-					break;
-			}
-		}
+	return (wchar_t *)StrSearchNoCaseWide((const uint16_t *)haystack, (const uint16_t *)needle);
+}
+
+#define MAX_FAKE_STRINGS 9
+
+// Same-length replacements applied in order, as the replace_*_in_buf calls
+// they stand for would be, but in a single pass over the buffer
+typedef struct _fake_strings_t {
+	MULTIREPLACEPATTERN patterns[MAX_FAKE_STRINGS];
+	PMULTIREPLACE replace;
+} fake_strings_t;
+
+static fake_strings_t fake_storage_model = { { { "QEMU", "DELL" }, { "VBOX", "DELL" }, { "VMware", "DELL__" }, { "Virtual", "C300_BD" } } };
+static fake_strings_t fake_wmi = { {
+	{ "Xen", "VIA" }, { "QEMU", "DELL" }, { "VBOX", "DELL" }, { "vbox", "dell" }, { "VMware", "DELL  " }, { "Red Hat", "Lenovo " },
+	{ "Virtual", "Compute" }, { "innotek GmbH", "ASUS Systems" }, { "MS_VM_CERT/SHA1", "Dell System	" }
+} };
+static fake_strings_t fake_disk_model = { { { "QEMU", "DELL" }, { "VMware", "DELL__" }, { "Virtual", "C300_BD" }, { "VBOX", "DELL" } } };
+static fake_strings_t fake_bios_version = { { { "VBOX", "DELL" }, { "BOCHS", "Award" } } };
+static fake_strings_t fake_video_bios_version = { { { "Oracle VM VirtualBox", "Intel VideoBios v1.3" } } };
+static fake_strings_t fake_bios_date = { { { "06/23/99", "01/01/02" } } };
+static fake_strings_t fake_acpi = { { { "VBOX", "DELL" } } };
+static fake_strings_t fake_smbios = { { { "vbox", "DELL" }, { "VirtualBox", "Gigabyte__" }, { "innotek GmbH", "HP Pavillion" } } };
+static fake_strings_t fake_processor_name = { { { "QEMU Virtual CPU version 2.0.0", "Intel(R) Core(TM) i7 CPU @3GHz" }, { "Xeon(R) ", "Core(TM)" } } };
+static fake_strings_t fake_system_product = { { { "VMware", "Lenovo" }, { "Virtual Platform", "X230 ThinkPad PC" } } };
+static fake_strings_t fake_manufacturer = { { { "QEMU", "DELL" } } };
+static fake_strings_t fake_device_enum = { { { "VMware", "Lenovo" }, { "VMWar", "Lenov" }, { "VBOX", "DELL" } } };
+
+static fake_strings_t *all_fake_strings[] = {
+	&fake_storage_model, &fake_wmi, &fake_disk_model, &fake_bios_version, &fake_video_bios_version, &fake_bios_date,
+	&fake_acpi, &fake_smbios, &fake_processor_name, &fake_system_product, &fake_manufacturer, &fake_device_enum
+};
+
+static const struct {
+	const wchar_t *keypath;
+	fake_strings_t *strings;
+	BOOL ascii_only;
+} registry_fakes[] = {
+	{ L"HKEY_LOCAL_MACHINE\\HARDWARE\\DEVICEMAP\\Scsi\\Scsi Port 0\\Scsi Bus 0\\Target Id 0\\Logical Unit Id 0\\Identifier", &fake_disk_model },
+	{ L"HKEY_LOCAL_MACHINE\\HARDWARE\\DEVICEMAP\\Scsi\\Scsi Port 1\\Scsi Bus 0\\Target Id 0\\Logical Unit Id 0\\Identifier", &fake_disk_model, TRUE },
+	{ L"HKEY_LOCAL_MACHINE\\HARDWARE\\DEVICEMAP\\Scsi\\Scsi Port 2\\Scsi Bus 0\\Target Id 0\\Logical Unit Id 0\\Identifier", &fake_disk_model, TRUE },
+	{ L"HKEY_LOCAL_MACHINE\\HARDWARE\\Description\\System\\SystemBiosVersion", &fake_bios_version },
+	{ L"HKEY_LOCAL_MACHINE\\HARDWARE\\Description\\System\\VideoBiosVersion", &fake_video_bios_version },
+	{ L"HKEY_LOCAL_MACHINE\\HARDWARE\\Description\\System\\SystemBiosDate", &fake_bios_date },
+	{ L"HKEY_LOCAL_MACHINE\\SYSTEM\\CurrentControlSet\\Services\\mssmbios\\Data\\AcpiData", &fake_acpi },
+	{ L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Services\\mssmbios\\Data\\AcpiData", &fake_acpi },
+	{ L"HKEY_LOCAL_MACHINE\\SYSTEM\\CurrentControlSet\\Services\\mssmbios\\Data\\SMBiosData", &fake_smbios },
+	{ L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Services\\mssmbios\\Data\\SMBiosData", &fake_smbios },
+	{ L"HKEY_LOCAL_MACHINE\\HARDWARE\\ACPI\\DSDT\\VBOX__\\VBOXBIOS\\00000002\\00000000", &fake_acpi },
+	{ L"HKEY_LOCAL_MACHINE\\HARDWARE\\ACPI\\FADT\\VBOX__\\VBOXFACP\\00000001\\00000000", &fake_acpi },
+	{ L"HKEY_LOCAL_MACHINE\\HARDWARE\\ACPI\\RSDT\\VBOX__\\VBOXRSDT\\00000001\\00000000", &fake_acpi },
+	{ L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Services\\Disk\\Enum\\0", &fake_disk_model },
+	{ L"HKEY_LOCAL_MACHINE\\HARDWARE\\DESCRIPTION\\System\\BIOS\\SystemManufacturer", &fake_system_product },
+	{ L"HKEY_LOCAL_MACHINE\\HARDWARE\\DESCRIPTION\\System\\BIOS\\SystemProductName", &fake_system_product },
+	// fake the manufacturer name
+	{ L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Control\\SystemInformation\\SystemManufacturer", &fake_manufacturer },
+	{ L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Enum\\IDE\\", &fake_device_enum },
+	{ L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Enum\\SCSI\\", &fake_device_enum },
+	{ L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Control\\DeviceClasses\\{53f5630d-b6bf-11d0-94f2-00a0c91efb8b}", &fake_device_enum },
+};
+
+void fakery_init(void)
+{
+	unsigned int i, count;
+
+	for (i = 0; i < ARRAYSIZE(all_fake_strings); i++) {
+		for (count = 0; count < MAX_FAKE_STRINGS && all_fake_strings[i]->patterns[count].Find; count++);
+		all_fake_strings[i]->replace = MultiReplaceCompile(all_fake_strings[i]->patterns, count);
+	}
+}
+
+static void replace_fake_strings(fake_strings_t *strings, PVOID buf, ULONG len, BOOL wide)
+{
+	if (wide)
+		MultiReplaceBufferWide(strings->replace, buf, len / sizeof(wchar_t));
+	else
+		MultiReplaceBuffer(strings->replace, buf, len);
+}
+
+static fake_strings_t *find_registry_fakes(PWCHAR keypath, BOOL ascii)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAYSIZE(registry_fakes); i++) {
+		if (registry_fakes[i].ascii_only && !ascii)
+			continue;
+		if (!wcsicmp(keypath, registry_fakes[i].keypath))
+			return registry_fakes[i].strings;
 	}
+
+	if (!wcsnicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\DESCRIPTION\\System\\CentralProcessor", 63) &&
+		!wcsicmp(keypath + wcslen(keypath) - wcslen(L"ProcessorNameString"), L"ProcessorNameString"))
+		return &fake_processor_name;
+
 	return NULL;
 }
 
@@ -325,25 +394,12 @@ void perform_device_fakery(PVOID OutputBuffer, ULONG OutputBufferLength, ULONG I
 	}
 
 	/* fake model name */
-	if (IoControlCode == IOCTL_STORAGE_QUERY_PROPERTY) {
-		replace_string_in_buf(OutputBuffer, OutputBufferLength, "QEMU", "DELL");
-		replace_string_in_buf(OutputBuffer, OutputBufferLength, "VBOX", "DELL");
-		replace_string_in_buf(OutputBuffer, OutputBufferLength, "VMware", "DELL__");
-		replace_string_in_buf(OutputBuffer, OutputBufferLength, "Virtual", "C300_BD");
-	}
+	if (IoControlCode == IOCTL_STORAGE_QUERY_PROPERTY)
+		replace_fake_strings(&fake_storage_model, OutputBuffer, OutputBufferLength, FALSE);
 
 	/* WMI fakery */
-	if (IoControlCode == 0x00224000) {
-		replace_string_in_buf(OutputBuffer, OutputBufferLength, "Xen", "VIA");
-		replace_string_in_buf(OutputBuffer, OutputBufferLength, "QEMU", "DELL");
-		replace_string_in_buf(OutputBuffer, OutputBufferLength, "VBOX", "DELL");
-		replace_string_in_buf(OutputBuffer, OutputBufferLength, "vbox", "dell");
-		replace_string_in_buf(OutputBuffer, OutputBufferLength, "VMware", "DELL  ");
-		replace_string_in_buf(OutputBuffer, OutputBufferLength, "Red Hat", "Lenovo ");
-		replace_string_in_buf(OutputBuffer, OutputBufferLength, "Virtual", "Compute");
-		replace_string_in_buf(OutputBuffer, OutputBufferLength, "innotek GmbH", "ASUS Systems");
-		replace_string_in_buf(OutputBuffer, OutputBufferLength, "MS_VM_CERT/SHA1", "Dell System	");
-	}
+	if (IoControlCode == 0x00224000)
+		replace_fake_strings(&fake_wmi, OutputBuffer, OutputBufferLength, FALSE);
 }
 
 void perform_create_time_fakery(FILETIME *createtime)
@@ -355,96 +411,14 @@ void perform_create_time_fakery(FILETIME *createtime)
 
 void perform_ascii_registry_fakery(PWCHAR keypath, LPVOID Data, ULONG DataLength)
 {
+	fake_strings_t *strings;
+
 	if (keypath == NULL || Data == NULL)
 		return;
 
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\DEVICEMAP\\Scsi\\Scsi Port 0\\Scsi Bus 0\\Target Id 0\\Logical Unit Id 0\\Identifier")) {
-		replace_string_in_buf(Data, DataLength, "QEMU", "DELL");
-		replace_string_in_buf(Data, DataLength, "VMware", "DELL__");
-		replace_string_in_buf(Data, DataLength, "Virtual", "C300_BD");
-		replace_string_in_buf(Data, DataLength, "VBOX", "DELL");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\DEVICEMAP\\Scsi\\Scsi Port 1\\Scsi Bus 0\\Target Id 0\\Logical Unit Id 0\\Identifier")) {
-		replace_string_in_buf(Data, DataLength, "QEMU", "DELL");
-		replace_string_in_buf(Data, DataLength, "VMware", "DELL__");
-		replace_string_in_buf(Data, DataLength, "Virtual", "C300_BD");
-		replace_string_in_buf(Data, DataLength, "VBOX", "DELL");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\DEVICEMAP\\Scsi\\Scsi Port 2\\Scsi Bus 0\\Target Id 0\\Logical Unit Id 0\\Identifier")) {
-		replace_string_in_buf(Data, DataLength, "QEMU", "DELL");
-		replace_string_in_buf(Data, DataLength, "VMware", "DELL__");
-		replace_string_in_buf(Data, DataLength, "Virtual", "C300_BD");
-		replace_string_in_buf(Data, DataLength, "VBOX", "DELL");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\Description\\System\\SystemBiosVersion")) {
-		replace_string_in_buf(Data, DataLength, "VBOX", "DELL");
-		replace_string_in_buf(Data, DataLength, "BOCHS", "Award");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\Description\\System\\VideoBiosVersion")) {
-		replace_string_in_buf(Data, DataLength, "Oracle VM VirtualBox", "Intel VideoBios v1.3");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\Description\\System\\SystemBiosDate")) {
-		replace_string_in_buf(Data, DataLength, "06/23/99", "01/01/02");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\CurrentControlSet\\Services\\mssmbios\\Data\\AcpiData") ||
-		!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Services\\mssmbios\\Data\\AcpiData")) {
-		replace_string_in_buf(Data, DataLength, "VBOX", "DELL");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\CurrentControlSet\\Services\\mssmbios\\Data\\SMBiosData") ||
-		!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Services\\mssmbios\\Data\\SMBiosData")) {
-		replace_string_in_buf(Data, DataLength, "vbox", "DELL");
-		replace_string_in_buf(Data, DataLength, "VirtualBox", "Gigabyte__");
-		replace_string_in_buf(Data, DataLength, "innotek GmbH", "HP Pavillion");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\ACPI\\DSDT\\VBOX__\\VBOXBIOS\\00000002\\00000000") ||
-		!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\ACPI\\FADT\\VBOX__\\VBOXFACP\\00000001\\00000000") ||
-		!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\ACPI\\RSDT\\VBOX__\\VBOXRSDT\\00000001\\00000000")) {
-		replace_string_in_buf(Data, DataLength, "VBOX", "DELL");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Services\\Disk\\Enum\\0")) {
-		replace_string_in_buf(Data, DataLength, "QEMU", "DELL");
-		replace_string_in_buf(Data, DataLength, "VMware", "DELL__");
-		replace_string_in_buf(Data, DataLength, "Virtual", "C300_BD");
-		replace_string_in_buf(Data, DataLength, "VBOX", "DELL");
-	}
-
-	if (!wcsnicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\DESCRIPTION\\System\\CentralProcessor", 63) &&
-		!wcsicmp(keypath + wcslen(keypath) - wcslen(L"ProcessorNameString"), L"ProcessorNameString")) {
-		replace_string_in_buf(Data, DataLength, "QEMU Virtual CPU version 2.0.0", "Intel(R) Core(TM) i7 CPU @3GHz");
-		replace_string_in_buf(Data, DataLength, "Xeon(R) ", "Core(TM)");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\DESCRIPTION\\System\\BIOS\\SystemManufacturer") ||
-		!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\DESCRIPTION\\System\\BIOS\\SystemProductName")) {
-		replace_string_in_buf(Data, DataLength, "VMware", "Lenovo");
-		replace_string_in_buf(Data, DataLength, "Virtual Platform", "X230 ThinkPad PC");
-	}
-
-	// fake the manufacturer name
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Control\\SystemInformation\\SystemManufacturer"))
-		replace_string_in_buf(Data, DataLength, "QEMU", "DELL");
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Enum\\IDE\\") ||
-		!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Enum\\SCSI\\")) {
-		replace_string_in_buf(Data, DataLength, "VMware", "Lenovo");
-		replace_string_in_buf(Data, DataLength, "VMWar", "Lenov");
-		replace_string_in_buf(Data, DataLength, "VBOX", "DELL");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Control\\DeviceClasses\\{53f5630d-b6bf-11d0-94f2-00a0c91efb8b}")) {
-		replace_string_in_buf(Data, DataLength, "VMware", "Lenovo");
-		replace_string_in_buf(Data, DataLength, "VMWar", "Lenov");
-		replace_string_in_buf(Data, DataLength, "VBOX", "DELL");
-	}
+	strings = find_registry_fakes(keypath, TRUE);
+	if (strings)
+		replace_fake_strings(strings, Data, DataLength, FALSE);
 
 	// Zloader macro checks using reg.exe to check macros are not enabled
 	if ((!wcsicmp(keypath, L"HKEY_CURRENT_USER\\Software\\Microsoft\\Office\\14.0\\Excel\\Security\\VBAWarnings")
@@ -470,82 +444,14 @@ void perform_ascii_registry_fakery(PWCHAR keypath, LPVOID Data, ULONG DataLength
 
 void perform_unicode_registry_fakery(PWCHAR keypath, LPVOID Data, ULONG DataLength)
 {
+	fake_strings_t *strings;
+
 	if (keypath == NULL || Data == NULL)
 		return;
 
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\DEVICEMAP\\Scsi\\Scsi Port 0\\Scsi Bus 0\\Target Id 0\\Logical Unit Id 0\\Identifier")) {
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"QEMU", L"DELL");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VMware", L"DELL__");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"Virtual", L"C300_BD");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VBOX", L"DELL");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\Description\\System\\SystemBiosVersion")) {
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VBOX", L"DELL");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"BOCHS", L"Award");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\Description\\System\\SystemBiosDate")) {
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"06/23/99", L"01/01/02");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\Description\\System\\VideoBiosVersion")) {
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"Oracle VM VirtualBox", L"Intel VideoBios v1.3");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\CurrentControlSet\\Services\\mssmbios\\Data\\AcpiData") ||
-		!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Services\\mssmbios\\Data\\AcpiData")) {
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VBOX", L"DELL");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\CurrentControlSet\\Services\\mssmbios\\Data\\SMBiosData") ||
-		!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Services\\mssmbios\\Data\\SMBiosData")) {
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"vbox", L"DELL");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VirtualBox", L"Gigabyte__");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"innotek GmbH", L"HP Pavillion");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\ACPI\\DSDT\\VBOX__\\VBOXBIOS\\00000002\\00000000") ||
-		!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\ACPI\\FADT\\VBOX__\\VBOXFACP\\00000001\\00000000") ||
-		!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\ACPI\\RSDT\\VBOX__\\VBOXRSDT\\00000001\\00000000")) {
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VBOX", L"DELL");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Services\\Disk\\Enum\\0")) {
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"QEMU", L"DELL");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VMware", L"DELL__");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"Virtual", L"C300_BD");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VBOX", L"DELL");
-	}
-
-	if (!wcsnicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\DESCRIPTION\\System\\CentralProcessor", 63) &&
-		!wcsicmp(keypath + wcslen(keypath) - wcslen(L"ProcessorNameString"), L"ProcessorNameString")) {
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"QEMU Virtual CPU version 2.0.0", L"Intel(R) Core(TM) i7 CPU @3GHz");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"Xeon(R) ", L"Core(TM)");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\DESCRIPTION\\System\\BIOS\\SystemManufacturer") ||
-		!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\HARDWARE\\DESCRIPTION\\System\\BIOS\\SystemProductName")) {
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VMware", L"Lenovo");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"Virtual Platform", L"X230 ThinkPad PC");
-	}
-
-	// fake the manufacturer name
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Control\\SystemInformation\\SystemManufacturer"))
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"QEMU", L"DELL");
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Enum\\IDE\\") ||
-		!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Enum\\SCSI\\")) {
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VMware", L"Lenovo");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VMWar", L"Lenov");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VBOX", L"DELL");
-	}
-
-	if (!wcsicmp(keypath, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Control\\DeviceClasses\\{53f5630d-b6bf-11d0-94f2-00a0c91efb8b}")) {
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VMware", L"Lenovo");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VMWar", L"Lenov");
-		replace_wstring_in_buf(Data, DataLength / sizeof(wchar_t), L"VBOX", L"DELL");
-	}
+	strings = find_registry_fakes(keypath, FALSE);
+	if (strings)
+		replace_fake_strings(strings, Data, DataLength, TRUE);
 
 	// Zloader macro checks using reg.exe to check macros are not enabled
 	if ((!wcsicmp(keypath, L"HKEY_CURRENT_USER\\Software\\Microsoft\\Office\\14.0\\Excel\\Security\\VBAWarnings")
@@ -787,30 +693,68 @@ BOOL file_exists(const OBJECT_ATTRIBUTES *obj)
 	return FALSE;
 }
 
-DWORD loaded_dlls;
-struct dll_range dll_ranges[MAX_DLLS];
+// address ranges of dlls whose callers are not of interest, and every loaded module by name
+static PMODULEMAP g_dll_ranges;
+static PMODULEMAP g_module_map;
 
 void add_dll_range(ULONG_PTR start, ULONG_PTR end)
 {
-	DWORD tmp_loaded_dlls = loaded_dlls;
-	if (tmp_loaded_dlls >= MAX_DLLS)
-		return;
 	if (is_in_dll_range(start))
 		return;
-	dll_ranges[tmp_loaded_dlls].start = start;
-	dll_ranges[tmp_loaded_dlls].end = end;
-
-	loaded_dlls++;
+	ModuleMapAdd(g_dll_ranges, start, end, NULL, 0);
 }
 
 BOOL is_in_dll_range(ULONG_PTR addr)
 {
-	DWORD i;
-	for (i = 0; i < loaded_dlls; i++) {
-		if (addr >= dll_ranges[i].start && addr < dll_ranges[i].end)
-			return TRUE;
+	return ModuleMapLookup(g_dll_ranges, addr, NULL, NULL);
+}
+
+void add_loaded_module(ULONG_PTR base, ULONG_PTR end, const wchar_t *name, unsigned int len)
+{
+	char buf[MAX_PATH];
+	unsigned int i;
+
+	if (len >= MAX_PATH)
+		len = MAX_PATH - 1;
+	for (i = 0; i < len; i++)
+		buf[i] = (char)name[i];
+	buf[len] = '\0';
+	ModuleMapAdd(g_module_map, base, end, buf, len);
+	ScyllaModuleLoaded(base, buf);
+}
+
+void remove_loaded_module(ULONG_PTR base)
+{
+	ModuleMapRemove(g_module_map, base);
+	ModuleMapRemove(g_dll_ranges, base);
+	ExportIndexDrop(base);
+	ScyllaModuleUnloaded(base);
+}
+
+static void add_all_loaded_modules(void)
+{
+	PLDR_DATA_TABLE_ENTRY mod;
+	PLIST_ENTRY pHeadEntry;
+	PLIST_ENTRY pListEntry;
+	PEB *peb = (PEB *)get_peb();
+
+	pHeadEntry = &peb->LoaderData->InLoadOrderModuleList;
+	for (pListEntry = pHeadEntry->Flink;
+		pListEntry != pHeadEntry;
+		pListEntry = pListEntry->Flink)
+	{
+		mod = CONTAINING_RECORD(pListEntry, LDR_DATA_TABLE_ENTRY, InLoadOrderModuleList);
+		add_loaded_module((ULONG_PTR)mod->BaseAddress, (ULONG_PTR)mod->BaseAddress + mod->SizeOfImage, mod->BaseDllName.Buffer, mod->BaseDllName.Length / sizeof(wchar_t));
 	}
-	return FALSE;
+}
+
+void module_map_init(void)
+{
+	if (!g_dll_ranges)
+		g_dll_ranges = ModuleMapCreate();
+	if (!g_module_map)
+		g_module_map = ModuleMapCreate();
+	add_all_loaded_modules();
 }
 
 ULONG_PTR base_of_dll_of_interest;
@@ -835,6 +779,9 @@ void add_all_dlls_to_dll_ranges(void)
 	ProcessPath.Buffer = calloc(ProcessPath.Length/sizeof(WCHAR) + 1, sizeof(WCHAR));
 	memcpy(ProcessPath.Buffer, mod->FullDllName.Buffer, ProcessPath.Length);
 
+	// catch up on modules loaded since module_map_init, the dll load notification adds the rest
+	add_all_loaded_modules();
+
 	// skip the base image
 	for (pListEntry = pHeadEntry->Flink->Flink;
 		pListEntry != pHeadEntry;
@@ -866,48 +813,27 @@ exit:
 	free(ProcessPath.Buffer);
 }
 
+// the returned name is interned and must not be freed
 char *convert_address_to_dll_name_and_offset(ULONG_PTR addr, unsigned int *offset)
 {
-	PLDR_DATA_TABLE_ENTRY mod;
-	PLIST_ENTRY pHeadEntry;
-	PLIST_ENTRY pListEntry;
-	PEB *peb = (PEB *)get_peb();
+	uintptr_t base;
+	const char *name;
 
 	if (addr >= g_our_dll_base && addr < (g_our_dll_base + g_our_dll_size))
 	{
 #ifdef _WIN64
-		char our_dll_name[] = "capemon_x64.dll";
+		static char our_dll_name[] = "capemon_x64.dll";
 #else
-		char our_dll_name[] = "capemon.dll";
+		static char our_dll_name[] = "capemon.dll";
 #endif
-		char *buf = calloc(1, strlen(our_dll_name) + 1);
-		if (buf == NULL)
-			return NULL;
-		strcpy(buf, our_dll_name);
 		*offset = (unsigned int)(addr - g_our_dll_base);
-		return buf;
+		return our_dll_name;
 	}
 
-	pHeadEntry = &peb->LoaderData->InLoadOrderModuleList;
-	for(pListEntry = pHeadEntry->Flink;
-		pListEntry != pHeadEntry;
-		pListEntry = pListEntry->Flink)
-	{
-		mod = CONTAINING_RECORD(pListEntry, LDR_DATA_TABLE_ENTRY, InLoadOrderModuleList);
-		char *buf;
-		unsigned int i;
-
-		if (addr < (ULONG_PTR)mod->BaseAddress || addr >= ((ULONG_PTR)mod->BaseAddress + mod->SizeOfImage))
-			continue;
-		buf = calloc(1, (mod->BaseDllName.Length / sizeof(wchar_t)) + 1);
-		if (buf == NULL)
-			return NULL;
-		for (i = 0; i < (mod->BaseDllName.Length / sizeof(wchar_t)); i++)
-			buf[i] = (char)mod->BaseDllName.Buffer[i];
-		*offset = (unsigned int)(addr - (ULONG_PTR)mod->BaseAddress);
-		return buf;
-	}
-	return NULL;
+	if (!ModuleMapLookup(g_module_map, addr, &base, &name) || !name)
+		return NULL;
+	*offset = (unsigned int)(addr - base);
+	return (char *)name;
 }
 
 // hide our module from PEB
@@ -1004,13 +930,52 @@ uint32_t path_from_handle(HANDLE handle,
 	return length;
 }
 
+#define PATH_CACHE_ENTRIES 512
+
+// normalized absolute paths by raw path
+static PPATHCACHE g_path_cache;
+// object names joined to the name of their root directory, by root handle
+static PPATHCACHE g_root_cache;
+// kernel names of open registry keys, by handle
+static PPATHCACHE g_key_cache;
+
+void path_cache_init(void)
+{
+	if (!g_path_cache)
+		g_path_cache = PathCacheCreate(PATH_CACHE_ENTRIES);
+	if (!g_root_cache)
+		g_root_cache = PathCacheCreate(PATH_CACHE_ENTRIES);
+	if (!g_key_cache)
+		g_key_cache = PathCacheCreate(PATH_CACHE_ENTRIES);
+}
+
+void path_cache_drop_handle(HANDLE handle)
+{
+	PathCacheDropRoot(g_root_cache, (uintptr_t)handle);
+	PathCacheDropRoot(g_key_cache, (uintptr_t)handle);
+}
+
+void path_cache_flush(void)
+{
+	PathCacheFlush(g_path_cache);
+}
+
 uint32_t path_from_object_attributes(const OBJECT_ATTRIBUTES *obj,
 	wchar_t *path, uint32_t buffer_length)
 {
 	uint32_t copylen, obj_length, length;
+	uintptr_t root = (uintptr_t)obj->RootDirectory;
 
 	if (obj->ObjectName == NULL || obj->ObjectName->Buffer == NULL) {
-		return path_from_handle(obj->RootDirectory, path, buffer_length);;
+		if (root) {
+			length = (uint32_t)PathCacheLookup(g_root_cache, root, L"", 0, path, buffer_length);
+			if (length)
+				return length;
+		}
+		length = path_from_handle(obj->RootDirectory, path, buffer_length);
+		if (root && length && length < buffer_length - 1)
+			PathCacheInsert(g_root_cache, root, L"", 0, path, length);
+		return length;
 	}
 
 	// ObjectName->Length is actually the size in bytes.
@@ -1024,6 +989,12 @@ uint32_t path_from_object_attributes(const OBJECT_ATTRIBUTES *obj,
 		return copylen;
 	}
 
+	if (obj_length) {
+		length = (uint32_t)PathCacheLookup(g_root_cache, root, obj->ObjectName->Buffer, obj_length, path, buffer_length);
+		if (length)
+			return length;
+	}
+
 	length = path_from_handle(obj->RootDirectory, path, buffer_length);
 
 	path[length++] = L'\\';
@@ -1034,6 +1005,11 @@ uint32_t path_from_object_attributes(const OBJECT_ATTRIBUTES *obj,
 	copylen = min(copylen, obj_length);
 	memcpy(&path[length], obj->ObjectName->Buffer, copylen * sizeof(wchar_t));
 	path[length + copylen] = L'\0';
+
+	// only names joined in full to a root that could be queried
+	if (length > 1 && obj_length && copylen == obj_length && length + copylen < buffer_length - 1)
+		PathCacheInsert(g_root_cache, root, obj->ObjectName->Buffer, obj_length, path, length + copylen);
+
 	return length + copylen;
 }
 
@@ -1111,11 +1087,16 @@ wchar_t *ensure_absolute_unicode_path(wchar_t *out, const wchar_t *in)
 	const wchar_t *inadj = NULL;
 	unsigned int inlen;
 	int is_globalroot = 0;
+	size_t keylen = 0;
+	SCRATCHFRAME frame;
 
 	lasterror_t lasterror;
 
 	get_lasterrors(&lasterror);
 
+	// temporary buffers are released together at out
+	ScratchPush(&frame);
+
 	__try {
 		if (!wcsncmp(in, L"\\??\\", 4)) {
 			inadj = in + 4;
@@ -1129,14 +1110,21 @@ wchar_t *ensure_absolute_unicode_path(wchar_t *out, const wchar_t *in)
 			inadj = in;
 
 		inlen = lstrlenW(inadj);
+
+		// results for paths independent of the current directory are cached
+		if (PathCacheIsAbsolute(in, (inadj - in) + inlen))
+			keylen = (inadj - in) + inlen;
 	}
 	__except (EXCEPTION_EXECUTE_HANDLER) {
 		out[0] = L'\0';
 		goto out;
 	}
 
-	tmpout = malloc(32768 * sizeof(wchar_t));
-	nonexistent = malloc(32768 * sizeof(wchar_t));
+	if (keylen && PathCacheLookup(g_path_cache, 0, in, keylen, out, 32768))
+		goto resolved;
+
+	tmpout = ScratchAlloc(32768 * sizeof(wchar_t));
+	nonexistent = ScratchAlloc(32768 * sizeof(wchar_t));
 
 	if (tmpout == NULL || nonexistent == NULL)
 		goto normal_copy;
@@ -1149,33 +1137,27 @@ wchar_t *ensure_absolute_unicode_path(wchar_t *out, const wchar_t *in)
 		if (retstr == NULL)
 			goto normal_copy;
 		// rewrite \\Device\\HarddiskVolumeX etc to the appropriate drive letter
-		tmpout2 = malloc(32768 * sizeof(wchar_t));
+		tmpout2 = ScratchAlloc(32768 * sizeof(wchar_t));
 		if (tmpout2 == NULL)
 			goto normal_copy;
 
 		wcscpy(tmpout2, L"\\\\?\\");
 		wcscat(tmpout2, retstr);
 		wcsncat(tmpout2, inadj + matchlen, 32768 - 4 - 3);
-		if (!GetFullPathNameW(tmpout2, 32768, tmpout, NULL)) {
-			free(tmpout2);
+		if (!GetFullPathNameW(tmpout2, 32768, tmpout, NULL))
 			goto normal_copy;
-		}
-		free(tmpout2);
 	}
 	else if (inlen > 1 && inadj[1] == L':') {
 		wchar_t *tmpout2;
 
-		tmpout2 = malloc(32768 * sizeof(wchar_t));
+		tmpout2 = ScratchAlloc(32768 * sizeof(wchar_t));
 		if (tmpout2 == NULL)
 			goto normal_copy;
 
 		wcscpy(tmpout2, L"\\\\?\\");
 		wcsncat(tmpout2, inadj, 32768 - 4);
-		if (!GetFullPathNameW(tmpout2, 32768, tmpout, NULL)) {
-			free(tmpout2);
+		if (!GetFullPathNameW(tmpout2, 32768, tmpout, NULL))
 			goto normal_copy;
-		}
-		free(tmpout2);
 	}
 	else if (is_globalroot) {
 		// handle \\??\\*\\*
@@ -1208,6 +1190,10 @@ wchar_t *ensure_absolute_unicode_path(wchar_t *out, const wchar_t *in)
 	if (!wcsncmp(out, L"\\\\?\\", 4))
 		memmove(out, out + 4, (lstrlenW(out) + 1 - 4) * sizeof(wchar_t));
 
+	if (keylen)
+		PathCacheInsert(g_path_cache, 0, in, keylen, out, lstrlenW(out));
+
+resolved:
 	if (is_wow64_fs_redirection_disabled() && !wcsnicmp(out, system32dir_w, system32dir_len)) {
 		memmove(out + system32dir_len + 1, out + system32dir_len, (lstrlenW(out + system32dir_len) + 1) * sizeof(wchar_t));
 		memcpy(out, sysnativedir_w, sysnativedir_len * sizeof(wchar_t));
@@ -1226,10 +1212,7 @@ normal_copy:
 		memmove(out, out + 4, (lstrlenW(out) + 1 - 4) * sizeof(wchar_t));
 out:
 	out[32767] = L'\0';
-	if (tmpout)
-		free(tmpout);
-	if (nonexistent)
-		free(nonexistent);
+	ScratchPop(&frame);
 	if (out[1] == L':' && out[2] == L'\\')
 		out[0] = toupper(out[0]);
 
@@ -1238,36 +1221,6 @@ out:
 	return out;
 }
 
-static unsigned int get_encoded_unicode_string_len(const wchar_t *buf, USHORT len)
-{
-	unsigned int numnulls = 0;
-	unsigned int i;
-
-	for (i = 0; i < len / sizeof(wchar_t); i++) {
-		if (buf[i] == L'\0')
-			numnulls++;
-	}
-
-	return len + (numnulls * 4 * sizeof(wchar_t));
-}
-
-static void copy_encoded_unicode_string(wchar_t *out, const wchar_t *in, unsigned int origlen, unsigned int newlen)
-{
-	unsigned int i, x;
-
-	for (i = 0, x = 0; i < origlen / sizeof(wchar_t); i++) {
-		if (in[i] == L'\0') {
-			out[x++] = L'\\';
-			out[x++] = L'x';
-			out[x++] = L'0';
-			out[x++] = L'0';
-		}
-		else
-			out[x++] = in[i];
-	}
-	out[newlen / sizeof(wchar_t)] = L'\0';
-}
-
 wchar_t *get_full_keyvalue_pathA(HKEY registry, const char *in, PKEY_NAME_INFORMATION keybuf, unsigned int len)
 {
 	if (in && in[0] != '\0')
@@ -1286,9 +1239,9 @@ wchar_t *get_full_keyvalue_pathUS(HKEY registry, const PUNICODE_STRING in, PKEY_
 {
 	wchar_t *ret;
 	if (in && in->Buffer && in->Length) {
-		unsigned int newlen = get_encoded_unicode_string_len(in->Buffer, in->Length);
-		wchar_t *incpy = malloc(newlen + (1 * sizeof(wchar_t)));
-		copy_encoded_unicode_string(incpy, in->Buffer, in->Length, newlen);
+		size_t newlen = KeyPathEncodedLength(in->Buffer, in->Length / sizeof(wchar_t));
+		wchar_t *incpy = malloc((newlen + 1) * sizeof(wchar_t));
+		KeyPathEncode(incpy, in->Buffer, in->Length / sizeof(wchar_t));
 		ret = get_full_key_pathW(registry, incpy, keybuf, len);
 		free(incpy);
 	}
@@ -1365,9 +1318,9 @@ wchar_t *get_key_path(POBJECT_ATTRIBUTES ObjectAttributes, PKEY_NAME_INFORMATION
 	ULONG reslen;
 	unsigned int maxlen = len - sizeof(KEY_NAME_INFORMATION);
 	unsigned int maxlen_chars = maxlen / sizeof(WCHAR);
-	unsigned int remaining;
-	unsigned int curlen;
+	size_t curlen;
 	HKEY rootkey;
+	const wchar_t *rootname;
 	lasterror_t lasterror;
 
 	get_lasterrors(&lasterror);
@@ -1375,94 +1328,42 @@ wchar_t *get_key_path(POBJECT_ATTRIBUTES ObjectAttributes, PKEY_NAME_INFORMATION
 	if (ObjectAttributes == NULL || ObjectAttributes->ObjectName == NULL)
 		goto error;
 	if (ObjectAttributes->RootDirectory == NULL) {
-		unsigned int copylen = min(maxlen, ObjectAttributes->ObjectName->Length);
-		unsigned int newlen = get_encoded_unicode_string_len(ObjectAttributes->ObjectName->Buffer, copylen);
-		copy_encoded_unicode_string(keybuf->KeyName, ObjectAttributes->ObjectName->Buffer, copylen, newlen);
-		keybuf->KeyNameLength = newlen;
+		unsigned int copylen = (unsigned int)min(maxlen_chars - 1, ObjectAttributes->ObjectName->Length / sizeof(WCHAR));
+		if (KeyPathEncodedLength(ObjectAttributes->ObjectName->Buffer, copylen) >= maxlen_chars)
+			goto error;
+		curlen = KeyPathEncode(keybuf->KeyName, ObjectAttributes->ObjectName->Buffer, copylen);
 		goto normal;
 	}
 
-	keybuf->KeyName[0] = L'\0';
-	keybuf->KeyNameLength = 0;
-
-	/* mingw doesn't like case statements with pointer values */
 	rootkey = (HKEY)ObjectAttributes->RootDirectory;
-	if (rootkey == HKEY_CLASSES_ROOT)
-		wcscpy(keybuf->KeyName, L"HKEY_CLASSES_ROOT");
-	else if (rootkey == HKEY_CURRENT_USER)
-		wcscpy(keybuf->KeyName, L"HKEY_CURRENT_USER");
-	else if (rootkey == HKEY_LOCAL_MACHINE)
-		wcscpy(keybuf->KeyName, L"HKEY_LOCAL_MACHINE");
-	else if (rootkey == HKEY_USERS)
-		wcscpy(keybuf->KeyName, L"HKEY_USERS");
-	else if (rootkey == HKEY_PERFORMANCE_DATA)
-		wcscpy(keybuf->KeyName, L"HKEY_PERFORMANCE_DATA");
-	else if (rootkey == HKEY_PERFORMANCE_TEXT)
-		wcscpy(keybuf->KeyName, L"HKEY_PERFORMANCE_TEXT");
-	else if (rootkey == HKEY_PERFORMANCE_NLSTEXT)
-		wcscpy(keybuf->KeyName, L"HKEY_PERFORMANCE_NLSTEXT");
-	else if (rootkey == HKEY_CURRENT_CONFIG)
-		wcscpy(keybuf->KeyName, L"HKEY_CURRENT_CONFIG");
-	else if (rootkey == HKEY_DYN_DATA)
-		wcscpy(keybuf->KeyName, L"HKEY_DYN_DATA");
-	else if (rootkey == HKEY_CURRENT_USER_LOCAL_SETTINGS)
-		wcscpy(keybuf->KeyName, L"HKEY_CURRENT_USER_LOCAL_SETTINGS");
-
-	keybuf->KeyNameLength = lstrlenW(keybuf->KeyName) * sizeof(wchar_t);
-	if (!keybuf->KeyNameLength) {
-		status = pNtQueryKey(ObjectAttributes->RootDirectory, KeyNameInformation, keybuf, len, &reslen);
-		if (status < 0)
-			goto error;
-	}
-
-	keybuf->KeyName[keybuf->KeyNameLength / sizeof(WCHAR)] = 0;
+	rootname = KeyPathPredefinedRoot((uintptr_t)rootkey);
 
-	curlen = (unsigned int)wcslen(keybuf->KeyName);
-	remaining = maxlen_chars - (unsigned int)wcslen(keybuf->KeyName) - 1;
-
-	if (ObjectAttributes->ObjectName == NULL) {
-		if (remaining < 10)
-			goto error;
-		wcscat(keybuf->KeyName, L"(Default)");
-		keybuf->KeyNameLength = (curlen + 9) * sizeof(WCHAR);
+	if (rootname) {
+		wcscpy(keybuf->KeyName, rootname);
+		curlen = lstrlenW(rootname);
 	}
 	else {
-		unsigned int newlen = get_encoded_unicode_string_len(ObjectAttributes->ObjectName->Buffer, ObjectAttributes->ObjectName->Length);
-
-		if ((remaining * sizeof(WCHAR)) < newlen + (1 * sizeof(WCHAR)))
-			goto error;
-
-		keybuf->KeyName[curlen++] = L'\\';
-		copy_encoded_unicode_string(keybuf->KeyName + curlen, ObjectAttributes->ObjectName->Buffer, ObjectAttributes->ObjectName->Length, newlen);
-		keybuf->KeyNameLength = curlen * sizeof(WCHAR) + newlen;
+		// the kernel's name for an open key is only queried once per handle
+		curlen = PathCacheLookup(g_key_cache, (uintptr_t)rootkey, L"", 0, keybuf->KeyName, maxlen_chars);
+		if (!curlen) {
+			status = pNtQueryKey(rootkey, KeyNameInformation, keybuf, len, &reslen);
+			if (status < 0)
+				goto error;
+			curlen = keybuf->KeyNameLength / sizeof(WCHAR);
+			if (curlen >= maxlen_chars)
+				goto error;
+			keybuf->KeyName[curlen] = 0;
+			PathCacheInsert(g_key_cache, (uintptr_t)rootkey, L"", 0, keybuf->KeyName, curlen);
+		}
 	}
 
+	curlen = KeyPathJoin(keybuf->KeyName, maxlen_chars, curlen, ObjectAttributes->ObjectName->Buffer, ObjectAttributes->ObjectName->Length / sizeof(WCHAR));
+	if (!curlen)
+		goto error;
+
 normal:
-	if (!wcsnicmp(keybuf->KeyName, g_hkcu.hkcu_string, g_hkcu.len) && (keybuf->KeyName[g_hkcu.len] == L'\\' || keybuf->KeyName[g_hkcu.len] == L'\0')) {
-		unsigned int ourlen = lstrlenW(L"HKEY_CURRENT_USER");
-		memcpy(keybuf->KeyName, L"HKEY_CURRENT_USER", ourlen * sizeof(WCHAR));
-		memmove(keybuf->KeyName + ourlen, keybuf->KeyName + g_hkcu.len, keybuf->KeyNameLength + (1 * sizeof(WCHAR)) - ((g_hkcu.len) * sizeof(WCHAR)));
-		keybuf->KeyNameLength -= (g_hkcu.len - ourlen) * sizeof(WCHAR);
-	}
-	else if (!wcsnicmp(keybuf->KeyName, g_hkcu.hkcu_string, g_hkcu.len) && !wcsnicmp(&keybuf->KeyName[g_hkcu.len], L"_Classes", 8)) {
-		unsigned int ourlen = lstrlenW(L"HKEY_CURRENT_USER\\Software\\Classes");
-		unsigned int existlen = g_hkcu.len + 8;
-		memmove(keybuf->KeyName + ourlen, keybuf->KeyName + existlen, keybuf->KeyNameLength + (1 * sizeof(WCHAR)) - (existlen * sizeof(WCHAR)));
-		memcpy(keybuf->KeyName, L"HKEY_CURRENT_USER\\Software\\Classes", ourlen * sizeof(WCHAR));
-		keybuf->KeyNameLength -= (existlen - ourlen) * sizeof(WCHAR);
-	}
-	else if (!wcsnicmp(keybuf->KeyName, L"\\REGISTRY\\MACHINE", 17) && (keybuf->KeyName[17] == L'\\' || keybuf->KeyName[17] == L'\0')) {
-		unsigned int ourlen = 18;
-		memmove(keybuf->KeyName + ourlen, keybuf->KeyName + 17, keybuf->KeyNameLength + (1 * sizeof(WCHAR)) - (17 * sizeof(WCHAR)));
-		memcpy(keybuf->KeyName, L"HKEY_LOCAL_MACHINE", ourlen * sizeof(WCHAR));
-		keybuf->KeyNameLength += (ourlen - 17) * sizeof(WCHAR);
-	}
-	else if (!wcsnicmp(keybuf->KeyName, L"\\REGISTRY\\USER", 14) && (keybuf->KeyName[14] == L'\\' || keybuf->KeyName[14] == L'\0')) {
-		unsigned int ourlen = 10;
-		memmove(keybuf->KeyName + ourlen, keybuf->KeyName + 14, keybuf->KeyNameLength + (1 * sizeof(WCHAR)) - (14 * sizeof(WCHAR)));
-		memcpy(keybuf->KeyName, L"HKEY_USERS", ourlen * sizeof(WCHAR));
-		keybuf->KeyNameLength -= (14 - ourlen) * sizeof(WCHAR);
-	}
+	curlen = KeyPathNormalize(keybuf->KeyName, maxlen_chars, curlen, g_hkcu.hkcu_string, g_hkcu.len);
+	keybuf->KeyNameLength = (ULONG)(curlen * sizeof(WCHAR));
 
 	goto out;
 
@@ -1730,12 +1631,35 @@ static PUCHAR get_rel_target(PUCHAR buf)
 	return buf + 5 + *(int *)&buf[1];
 }
 
+static PUCHAR find_signature(PUCHAR start, PUCHAR end, const SIGPATTERN *sig)
+{
+	// a match may not take in the last byte before end
+	if (end - start <= (LONG_PTR)sig->Length)
+		return NULL;
+	return (PUCHAR)SigFind(sig, start, end - start - 1);
+}
+
+// signature of an instruction taking target as a 32-bit immediate
+static void imm_signature(SIGPATTERN *sig, UCHAR opcode, UCHAR opmask, PUCHAR target)
+{
+	UCHAR bytes[5], mask[5];
+	DWORD imm = (DWORD)(ULONG_PTR)target;
+
+	bytes[0] = opcode;
+	memcpy(&bytes[1], &imm, sizeof(imm));
+	memset(mask, 0xff, sizeof(mask));
+	mask[0] = opmask;
+	SigFromMask(sig, bytes, mask, sizeof(bytes));
+}
+
 static PUCHAR find_first_caller_of_target(PUCHAR start, PUCHAR end, PUCHAR target)
 {
+	SIGPATTERN call;
 	PUCHAR p;
 
-	for (p = start; p < end - 5; p++) {
-		if (p[0] == 0xe8 && get_rel_target(p) == target)
+	SigParse("E8 ?? ?? ?? ??", &call);
+	for (p = start; (p = find_signature(p, end, &call)) != NULL; p++) {
+		if (get_rel_target(p) == target)
 			return p;
 	}
 	return NULL;
@@ -1743,21 +1667,20 @@ static PUCHAR find_first_caller_of_target(PUCHAR start, PUCHAR end, PUCHAR targe
 
 static PUCHAR find_first_imm_push_of_target(PUCHAR start, PUCHAR end, PUCHAR target)
 {
-	PUCHAR p;
+	SIGPATTERN push;
 
-	for (p = start; p < end - 5; p++) {
-		if (p[0] == 0x68 && *(DWORD *)&p[1] == (DWORD)(ULONG_PTR)target)
-			return p;
-	}
-	return NULL;
+	imm_signature(&push, 0x68, 0xff, target);
+	return find_signature(start, end, &push);
 }
 
 static PUCHAR find_first_lea_of_target(PUCHAR start, PUCHAR end, PUCHAR target)
 {
+	SIGPATTERN lea;
 	PUCHAR p;
 
-	for (p = start; p < end - 7; p++) {
-		if (p[0] == 0x48 && p[1] == 0x8d && get_rel_target(&p[2]) == target)
+	SigParse("48 8D ?? ?? ?? ?? ??", &lea);
+	for (p = start; (p = find_signature(p, end, &lea)) != NULL; p++) {
+		if (get_rel_target(&p[2]) == target)
 			return p;
 	}
 	return NULL;
@@ -1765,36 +1688,31 @@ static PUCHAR find_first_lea_of_target(PUCHAR start, PUCHAR end, PUCHAR target)
 
 static PUCHAR find_first_mov_reg_of_target(PUCHAR start, PUCHAR end, PUCHAR target)
 {
-	PUCHAR p;
-
-	for (p = start; p < end - 5; p++) {
-		if (((p[0] & 0xf8) == 0xb8) && *(DWORD *)&p[1] == (DWORD)(ULONG_PTR)target)
-			return p;
-	}
-	return NULL;
+	SIGPATTERN mov;
 
+	// b8+r, any of the eight registers
+	imm_signature(&mov, 0xb8, 0xf8, target);
+	return find_signature(start, end, &mov);
 }
 
 static PUCHAR find_string_in_bounds(PUCHAR start, PUCHAR end, PUCHAR str, DWORD len)
 {
-	PUCHAR p;
-
-	for (p = start; p < end - len; p++)
-		if (!memcmp(p, str, len))
-			return p;
-	return NULL;
+	// a match may not take in the last byte before end
+	if (end - start <= (LONG_PTR)len)
+		return NULL;
+	return (PUCHAR)StrSearchMemory(start, end - start - 1, str, len);
 }
 
 static PUCHAR find_next_relative_call(PUCHAR start, PUCHAR end, PUCHAR target)
 {
-	PUCHAR p;
+	SIGPATTERN call;
+	PUCHAR p, resolv;
 
-	for (p = target; p < end - 5; p++) {
-		if (p[0] == 0xe8) {
-			PUCHAR resolv = get_rel_target(p);
-			if (resolv >= start && resolv < end)
-				return p;
-		}
+	SigParse("E8 ?? ?? ?? ??", &call);
+	for (p = target; (p = find_signature(p, end, &call)) != NULL; p++) {
+		resolv = get_rel_target(p);
+		if (resolv >= start && resolv < end)
+			return p;
 	}
 	return NULL;
 }
@@ -1922,6 +1840,47 @@ PWCHAR get_dll_basename(PWCHAR ModulePath)
 	return dllname;
 }
 
+typedef struct _PUSH_OR_MOV {
+	PUCHAR push;
+	PUCHAR mov;
+} PUSH_OR_MOV;
+
+static int first_push_or_mov(void *context, size_t index, const unsigned char *match)
+{
+	PUSH_OR_MOV *found = (PUSH_OR_MOV *)context;
+
+	if (index == 0) {
+		found->push = (PUCHAR)match;
+		return 1;
+	}
+	if (found->mov == NULL)
+		found->mov = (PUCHAR)match;
+	return 0;
+}
+
+// the first push of target, or failing that the first mov of it to a register,
+// both looked for in one pass
+static PUCHAR find_first_push_or_mov_of_target(PUCHAR start, PUCHAR end, PUCHAR target)
+{
+	PUSH_OR_MOV found = { NULL, NULL };
+	SIGPATTERN sig;
+	SIGSET set;
+
+	if (end - start <= 5)
+		return NULL;
+
+	SigSetInit(&set);
+	imm_signature(&sig, 0x68, 0xff, target);
+	SigSetAdd(&set, &sig);
+	imm_signature(&sig, 0xb8, 0xf8, target);
+	SigSetAdd(&set, &sig);
+	if (SigSetCompile(&set))
+		SigSetScan(&set, start, end - start - 1, first_push_or_mov, &found);
+	SigSetFree(&set);
+
+	return found.push ? found.push : found.mov;
+}
+
 ULONG_PTR get_olescript_parsescripttext_addr(HMODULE mod)
 {
 	PUCHAR start, end;
@@ -1936,9 +1895,7 @@ ULONG_PTR get_olescript_parsescripttext_addr(HMODULE mod)
 #ifdef _WIN64
 	p = find_first_lea_of_target(start, end, scriptblockaddr);
 #else
-	p = find_first_imm_push_of_target(start, end, scriptblockaddr);
-	if (p == NULL)
-		p = find_first_mov_reg_of_target(start, end, scriptblockaddr);
+	p = find_first_push_or_mov_of_target(start, end, scriptblockaddr);
 #endif
 	if (p == NULL)
 		return 0;
@@ -1957,6 +1914,7 @@ ULONG_PTR get_cdocument_write_addr(HMODULE mod)
 	PUCHAR start, end;
 	PUCHAR p;
 	PUCHAR newline;
+	SIGPATTERN sig;
 
 	if (!get_section_bounds(mod, ".text", &start, &end))
 		return 0;
@@ -1965,8 +1923,9 @@ ULONG_PTR get_cdocument_write_addr(HMODULE mod)
 		return 0;
 
 #ifdef _WIN64
-	for (p = start; p < end - 10; p++) {
-		if (p[0] == 0x48 && p[1] == 0x8d && p[2] == 0x15 && (get_rel_target(&p[2]) == newline) && p[7] == 0xe8) {
+	SigParse("48 8D 15 ?? ?? ?? ?? E8", &sig);
+	for (p = start; p < end - 10 && (p = (PUCHAR)SigFind(&sig, p, end - 3 - p)) != NULL; p++) {
+		if (get_rel_target(&p[2]) == newline) {
 			PUCHAR x;
 			PUCHAR firstfunc = NULL, secondfunc = NULL;
 			PUCHAR writelnstart = find_function_prologue(start, end, p);
@@ -1995,24 +1954,33 @@ next_iter:
 #else
 	// got the newline, now find a push of the address of it followed immediately by a relative call within short distance of a retn 8
 	// this will give us CDocument::writeln
-	for (p = start; p < end - 10; p++) {
-		if (p[0] == 0x68 && *(DWORD *)&p[1] == (DWORD)newline && p[5] == 0xe8) {
-			PUCHAR x;
-			for (x = p + 10; x < p + 0x80; x++) {
-				if (!memcmp(x, "\xc2\x08\x00", 3)) {
-					PUCHAR y;
-					// found the retn 8
-					// now scan back to find a call pointing into .text preceded immediately by some form of a push (register or indirect through ebp plus offset)
-					for (y = p; y > p - 0x80; y--) {
-						if (y[0] == 0xe8) {
-							PUCHAR target = get_rel_target(y);
-							if (target > start && target < end) {
-								// if we find it, the target of the call is CDocument::write
-								if (*(y - 3) == 0xff && *(y - 2) == 0x75 && *(y - 1) < 0x20)
-									return (ULONG_PTR)target;
-								else if ((*(y - 1) & 0xf8) == 0x50)
-									return (ULONG_PTR)target;
-							}
+	{
+		// push offset newline, then the call's opcode
+		UCHAR bytes[6], mask[6];
+		DWORD imm = (DWORD)(ULONG_PTR)newline;
+
+		bytes[0] = 0x68;
+		memcpy(&bytes[1], &imm, sizeof(imm));
+		bytes[5] = 0xe8;
+		memset(mask, 0xff, sizeof(mask));
+		SigFromMask(&sig, bytes, mask, sizeof(bytes));
+	}
+	for (p = start; p < end - 10 && (p = (PUCHAR)SigFind(&sig, p, end - 5 - p)) != NULL; p++) {
+		PUCHAR x;
+		for (x = p + 10; x < p + 0x80; x++) {
+			if (!memcmp(x, "\xc2\x08\x00", 3)) {
+				PUCHAR y;
+				// found the retn 8
+				// now scan back to find a call pointing into .text preceded immediately by some form of a push (register or indirect through ebp plus offset)
+				for (y = p; y > p - 0x80; y--) {
+					if (y[0] == 0xe8) {
+						PUCHAR target = get_rel_target(y);
+						if (target > start && target < end) {
+							// if we find it, the target of the call is CDocument::write
+							if (*(y - 3) == 0xff && *(y - 2) == 0x75 && *(y - 1) < 0x20)
+								return (ULONG_PTR)target;
+							else if ((*(y - 1) & 0xf8) == 0x50)
+								return (ULONG_PTR)target;
 						}
 					}
 				}
@@ -2038,26 +2006,26 @@ void register_dll_notification_manually(PLDR_DLL_NOTIFICATION_FUNCTION notify)
 	return;
 #else
 	PUCHAR p, start, end;
+	SIGPATTERN sig;
 
 	if (!get_section_bounds(GetModuleHandleA("ntdll"), ".text", &start, &end))
 		return;
-	for (p = start; p < end - 30; p++){
-		if (p[0] == 0xb8 && p[5] == 0xa3 && p[10] == 0xa3 && p[15] == 0xb8 && p[20] == 0xa3 && p[25] == 0xa3) {
-			DWORD addr1, addr2;
-			PDLL_NOTIFICATION_STRUCT next, our;
-
-			addr1 = *(DWORD *)&p[1];
-			addr2 = *(DWORD *)&p[16];
-			// throw out RtlpLeakList/RtlpBusyList
-			if (addr1 == addr2 + 8)
-				continue;
-			next = ((PDLL_NOTIFICATION_STRUCT)(addr2))->Next;
-			our = (PDLL_NOTIFICATION_STRUCT)calloc(1, sizeof(DLL_NOTIFICATION_STRUCT));
-			our->Next = next;
-			our->RegistrationFptr = notify;
-			*(PDLL_NOTIFICATION_STRUCT *)(addr2) = our;
-			return;
-		}
+	SigParse("B8 ?? ?? ?? ?? A3 ?? ?? ?? ?? A3 ?? ?? ?? ?? B8 ?? ?? ?? ?? A3 ?? ?? ?? ?? A3", &sig);
+	for (p = start; p < end - 30 && (p = (PUCHAR)SigFind(&sig, p, end - 5 - p)) != NULL; p++) {
+		DWORD addr1, addr2;
+		PDLL_NOTIFICATION_STRUCT next, our;
+
+		addr1 = *(DWORD *)&p[1];
+		addr2 = *(DWORD *)&p[16];
+		// throw out RtlpLeakList/RtlpBusyList
+		if (addr1 == addr2 + 8)
+			continue;
+		next = ((PDLL_NOTIFICATION_STRUCT)(addr2))->Next;
+		our = (PDLL_NOTIFICATION_STRUCT)calloc(1, sizeof(DLL_NOTIFICATION_STRUCT));
+		our->Next = next;
+		our->RegistrationFptr = notify;
+		*(PDLL_NOTIFICATION_STRUCT *)(addr2) = our;
+		return;
 	}
 #endif
 }
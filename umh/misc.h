@@ -184,21 +184,21 @@ int is_shutting_down();
 
 #define CRLF "\r\n"
 
-struct dll_range {
-	ULONG_PTR start;
-	ULONG_PTR end;
-};
-#define MAX_DLLS 100
-
 DWORD get_pid_by_tid(DWORD tid);
 
 DWORD our_getprocessid(HANDLE Process);
 BOOL is_in_dll_range(ULONG_PTR addr);
 void add_all_dlls_to_dll_ranges(void);
 void add_dll_range(ULONG_PTR start, ULONG_PTR end);
+void module_map_init(void);
+void add_loaded_module(ULONG_PTR base, ULONG_PTR end, const wchar_t *name, unsigned int len);
+void remove_loaded_module(ULONG_PTR base);
 
 wchar_t *get_matching_unicode_specialname(const wchar_t *path, unsigned int *matchlen);
 void specialname_map_init(void);
+void path_cache_init(void);
+void path_cache_drop_handle(HANDLE handle);
+void path_cache_flush(void);
 
 char *convert_address_to_dll_name_and_offset(ULONG_PTR addr, unsigned int *offset);
 int is_wow64_fs_redirection_disabled(void);
@@ -238,6 +238,7 @@ void replace_string_in_buf(PCHAR buf, ULONG len, PCHAR findstr, PCHAR repstr);
 void replace_wstring_in_buf(PWCHAR buf, ULONG len, PWCHAR findstr, PWCHAR repstr);
 void replace_ci_string_in_buf(PCHAR buf, ULONG len, PCHAR findstr, PCHAR repstr);
 void replace_ci_wstring_in_buf(PWCHAR buf, ULONG len, PWCHAR findstr, PWCHAR repstr);
+void fakery_init(void);
 void perform_ascii_registry_fakery(PWCHAR keypath, LPVOID Data, ULONG DataLength);
 void perform_unicode_registry_fakery(PWCHAR keypath, LPVOID Data, ULONG DataLength);
 void perform_device_fakery(PVOID OutputBuffer, ULONG OutputBufferLength, ULONG IoControlCode);
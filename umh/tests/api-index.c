@@ -0,0 +1,586 @@
+// Tests for the api index behind Scylla's getApiByVirtualAddress and
+// isApiAddressValid: the export picked for each address, and whether it is
+// flagged suspect, checked against the old hash multimap and its scoring
+// passes over generated exports with shared addresses across modules of
+// every priority. Portable harness, build on Linux with:
+//   gcc -O2 -Wall -I../CAPE -o api-index api-index.c ../CAPE/ApiIndex.c ../CAPE/ExportIndex.c
+// Directories given on the command line, such as a copy of System32, have
+// their DLLs loaded at made up bases with forwarders resolved between them,
+// as ApiReader reads a process's modules, and every address is checked.
+// Run "./api-index bench" for build and lookup timings over 300 modules.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <time.h>
+#include "ApiIndex.h"
+#include "ExportIndex.h"
+
+#define MODULE_SPACING 0x10000000ULL
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// An export as ApiReader records it
+typedef struct {
+    uintptr_t va;
+    char name[64];
+    int priority;       // of the module it was read from
+} api_t;
+
+typedef struct {
+    api_t *api;
+    size_t count, capacity;
+} api_list_t;
+
+static void add_api(api_list_t *list, uintptr_t va, const char *name, int priority)
+{
+    api_t *api;
+
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        list->api = realloc(list->api, list->capacity * sizeof(api_t));
+    }
+    api = &list->api[list->count++];
+    api->va = va;
+    api->priority = priority;
+    api->name[0] = 0;
+    if (name && strlen(name) < sizeof(api->name))
+        strcpy(api->name, name);
+}
+
+// ApiReader::setModulePriority
+static int module_priority(const char *file_name)
+{
+    if (!strcasecmp(file_name, "kernelbase.dll"))
+        return -1;
+    if (!strcasecmp(file_name, "ntdll.dll") || !strcasecmp(file_name, "shlwapi.dll") || !strcasecmp(file_name, "ShimEng.dll"))
+        return 0;
+    if (!strcasecmp(file_name, "kernel32.dll"))
+        return 2;
+    if (!strncasecmp(file_name, "API-", 4) || !strncasecmp(file_name, "EXT-", 4))
+        return 0;
+    return 1;
+}
+
+static PAPIINDEX build_index(const api_list_t *list)
+{
+    APICANDIDATE *candidates = malloc((list->count + 1) * sizeof(APICANDIDATE));
+    PAPIINDEX index;
+
+    for (size_t i = 0; i < list->count; i++) {
+        candidates[i].Address = list->api[i].va;
+        candidates[i].Api = &list->api[i];
+        candidates[i].Name = list->api[i].name;
+        candidates[i].Priority = list->api[i].priority;
+    }
+    index = ApiIndexBuild(candidates, list->count);
+    free(candidates);
+    return index;
+}
+
+// The old look up table: a chained hash multimap with a node per export,
+// equal addresses kept together in the order they were added
+typedef struct node {
+    struct node *next;
+    uintptr_t va;
+    api_t *api;
+} node_t;
+
+typedef struct {
+    node_t **bucket;
+    size_t mask;
+} multimap_t;
+
+static size_t hash_va(uintptr_t va)
+{
+    return (size_t)((va ^ (va >> 16)) * 0x9e3779b1u);
+}
+
+static void multimap_build(multimap_t *map, api_list_t *list)
+{
+    size_t buckets = 8;
+
+    while (buckets < list->count)
+        buckets *= 2;
+    map->bucket = calloc(buckets, sizeof(node_t *));
+    map->mask = buckets - 1;
+
+    for (size_t i = 0; i < list->count; i++) {
+        node_t *node = malloc(sizeof(node_t)), **link = &map->bucket[hash_va(list->api[i].va) & map->mask];
+        node_t **after = NULL;
+
+        node->va = list->api[i].va;
+        node->api = &list->api[i];
+        for (; *link; link = &(*link)->next)
+            if ((*link)->va == node->va)
+                after = &(*link)->next;
+        if (after)
+            link = after;
+        node->next = *link;
+        *link = node;
+    }
+}
+
+static void multimap_free(multimap_t *map)
+{
+    for (size_t i = 0; i <= map->mask; i++) {
+        node_t *node = map->bucket[i];
+        while (node) {
+            node_t *next = node->next;
+            free(node);
+            node = next;
+        }
+    }
+    free(map->bucket);
+}
+
+static node_t *multimap_find(multimap_t *map, uintptr_t va, size_t *count)
+{
+    node_t *first = map->bucket[hash_va(va) & map->mask], *node;
+
+    while (first && first->va != va)
+        first = first->next;
+    *count = 0;
+    for (node = first; node && node->va == va; node = node->next)
+        (*count)++;
+    return first;
+}
+
+// ApiReader::getScoredApi and getApiByVirtualAddress as they were
+static api_t *old_scored_api(node_t *it, size_t count, int has_name, int has_unicode_ansi_name, int has_no_underline_in_name, int has_prio_dll, int has_prio0_dll, int has_prio1_dll, int has_prio2_dll, int first_win)
+{
+    api_t *found_matching = NULL;
+    int count_found = 0, score_needed = 0;
+
+    if (has_unicode_ansi_name || has_no_underline_in_name)
+        has_name = 1;
+
+    score_needed = has_name + has_unicode_ansi_name + has_no_underline_in_name + has_prio_dll + has_prio0_dll + has_prio1_dll + has_prio2_dll;
+
+    for (size_t c = 0; c < count; c++, it = it->next) {
+        api_t *found = it->api;
+        int score = 0;
+
+        if (has_name && found->name[0]) {
+            score++;
+            if (has_unicode_ansi_name) {
+                char last = found->name[strlen(found->name) - 1];
+                if (last == 'W' || last == 'A')
+                    score++;
+            }
+            if (has_no_underline_in_name && !strrchr(found->name, '_'))
+                score++;
+        }
+        if (has_prio_dll && found->priority >= 1)
+            score++;
+        if (has_prio0_dll && found->priority == 0)
+            score++;
+        if (has_prio1_dll && found->priority == 1)
+            score++;
+        if (has_prio2_dll && found->priority == 2)
+            score++;
+
+        if (score == score_needed) {
+            found_matching = found;
+            count_found++;
+            if (first_win)
+                return found_matching;
+        }
+    }
+
+    return count_found == 1 ? found_matching : NULL;
+}
+
+static api_t *old_api_by_va(multimap_t *map, uintptr_t va, int *is_suspect)
+{
+    size_t count;
+    node_t *it = multimap_find(map, va, &count);
+    api_t *found;
+
+    if (count == 0)
+        return NULL;
+    if (count == 1) {
+        *is_suspect = 0;
+        return it->api;
+    }
+
+    if ((found = old_scored_api(it, count, 1, 0, 0, 1, 0, 0, 0, 0)))
+        return found;
+    *is_suspect = 1;
+    if ((found = old_scored_api(it, count, 1, 1, 0, 1, 0, 0, 0, 0)))
+        return found;
+    if ((found = old_scored_api(it, count, 1, 0, 1, 0, 0, 0, 1, 0)))
+        return found;
+    if ((found = old_scored_api(it, count, 1, 0, 0, 0, 0, 1, 0, 0)))
+        return found;
+    if ((found = old_scored_api(it, count, 1, 0, 0, 0, 0, 0, 0, 0)))
+        return found;
+    if ((found = old_scored_api(it, count, 1, 1, 0, 1, 0, 0, 0, 1)))
+        return found;
+    if ((found = old_scored_api(it, count, 0, 0, 0, 1, 0, 0, 0, 1)))
+        return found;
+    if ((found = old_scored_api(it, count, 0, 0, 0, 0, 1, 0, 0, 1)))
+        return found;
+
+    return (api_t *)1;      // the resolving bug
+}
+
+// Every address, and some that are not exported, resolves the same way
+// through the index as through the old scoring, from either suspect state
+static size_t compare(api_list_t *list, const char *what)
+{
+    PAPIINDEX index = build_index(list);
+    multimap_t map;
+    size_t duplicates = 0, unresolved = 0;
+
+    CHECK(index != NULL, "%s: index not built", what);
+    if (!index)
+        return 0;
+    multimap_build(&map, list);
+
+    for (size_t i = 0; i < list->count * 2; i++) {
+        uintptr_t va = i < list->count ? list->api[i].va : list->api[next_random() % list->count].va + 1 + next_random() % 16;
+        size_t old_count;
+
+        multimap_find(&map, va, &old_count);
+        CHECK(ApiIndexCandidates(index, va, NULL) == old_count, "%s: %zu exports at %#zx, expected %zu", what, ApiIndexCandidates(index, va, NULL), (size_t)va, old_count);
+
+        for (int initial = 0; initial < 2; initial++) {
+            int old_suspect = initial, new_suspect = initial;
+            api_t *old_api = old_api_by_va(&map, va, &old_suspect);
+            api_t *new_api = ApiIndexLookup(index, va, &new_suspect);
+
+            if (!new_api && old_count)
+                new_api = (api_t *)1;
+            CHECK(new_api == old_api, "%s: %#zx picks %s, expected %s", what, (size_t)va,
+                new_api && new_api != (api_t *)1 ? new_api->name : "none", old_api && old_api != (api_t *)1 ? old_api->name : "none");
+            CHECK(new_suspect == old_suspect, "%s: %#zx suspect %d, expected %d", what, (size_t)va, new_suspect, old_suspect);
+            if (!initial && i < list->count && old_count > 1) {
+                duplicates++;
+                unresolved += old_api == (api_t *)1;
+            }
+        }
+    }
+
+    printf("%s: %zu exports at %zu addresses checked, %zu lookups among duplicates, %zu unresolved\n", what, list->count, ApiIndexCount(index), duplicates, unresolved);
+    multimap_free(&map);
+    ApiIndexFree(index);
+    return list->count;
+}
+
+static void test_rules(void)
+{
+    api_list_t list = { 0 };
+    PAPIINDEX index;
+    void *const *candidates;
+    int suspect;
+
+    // empty
+    index = ApiIndexBuild(NULL, 0);
+    CHECK(index && ApiIndexCount(index) == 0, "empty index");
+    CHECK(ApiIndexLookup(index, 0x1000, NULL) == NULL, "lookup in empty index");
+    ApiIndexFree(index);
+    CHECK(ApiIndexLookup(NULL, 0x1000, NULL) == NULL, "lookup in no index");
+
+    add_api(&list, 0x1000, "Sleep", 1);                 // unique
+    add_api(&list, 0x2000, "RtlAllocateHeap", 0);       // kernel32 forwarder over ntdll
+    add_api(&list, 0x2000, "HeapAlloc", 2);
+    add_api(&list, 0x3000, "GetFooA", 1);               // two normal modules, one ansi
+    add_api(&list, 0x3000, "GetFoo", 1);
+    add_api(&list, 0x4000, "Foo", -1);                  // kernelbase aliases
+    add_api(&list, 0x4000, "Bar", -1);
+    add_api(&list, 0x5000, "", 0);                      // ntdll aliases by ordinal
+    add_api(&list, 0x5000, "", 0);
+    index = build_index(&list);
+    CHECK(ApiIndexCount(index) == 5, "%zu addresses", ApiIndexCount(index));
+
+    suspect = 1;
+    CHECK(ApiIndexLookup(index, 0x1000, &suspect) == &list.api[0] && !suspect, "unique export");
+    suspect = 0;
+    CHECK(ApiIndexLookup(index, 0x2000, &suspect) == &list.api[2] && !suspect, "kernel32 over ntdll");
+    suspect = 1;
+    CHECK(ApiIndexLookup(index, 0x2000, &suspect) == &list.api[2] && suspect, "first rule leaves suspect alone");
+    suspect = 0;
+    CHECK(ApiIndexLookup(index, 0x3000, &suspect) == &list.api[3] && suspect, "ansi name");
+    suspect = 0;
+    CHECK(ApiIndexLookup(index, 0x4000, &suspect) == NULL && suspect, "nothing picked among kernelbase aliases");
+    CHECK(ApiIndexCandidates(index, 0x4000, &candidates) == 2 && candidates[0] == &list.api[5] && candidates[1] == &list.api[6], "kernelbase candidates");
+    CHECK(ApiIndexLookup(index, 0x5000, NULL) == &list.api[7], "first ntdll ordinal");
+    CHECK(ApiIndexCandidates(index, 0x1001, NULL) == 0 && ApiIndexLookup(index, 0x1001, NULL) == NULL, "unexported address");
+    CHECK(ApiIndexCandidates(index, 0, NULL) == 0 && ApiIndexCandidates(index, (uintptr_t)-1, NULL) == 0, "addresses outside");
+    ApiIndexFree(index);
+
+    compare(&list, "rules");
+    free(list.api);
+}
+
+static const char *module_names[] = {
+    "kernel32.dll", "kernelbase.dll", "ntdll.dll", "shlwapi.dll", "ShimEng.dll",
+    "api-ms-win-core-heap-l1-1-0.dll", "ext-ms-win-ntuser-window-l1-1-0.dll",
+    "user32.dll", "advapi32.dll", "msvcrt.dll", "ws2_32.dll", "ole32.dll",
+};
+
+static void random_name(char *name, size_t size)
+{
+    static const char *parts[] = { "Get", "Set", "Create", "Rtl", "Nt", "_", "Heap", "File", "Window", "Alloc", "Ex", "_s" };
+    size_t length = 0;
+
+    name[0] = 0;
+    for (int i = 1 + next_random() % 3; i; i--) {
+        const char *part = parts[next_random() % 12];
+        if (length + strlen(part) + 1 < size) {
+            strcpy(name + length, part);
+            length += strlen(part);
+        }
+    }
+    switch (next_random() % 4) {
+    case 0: strcpy(name + length, "A"); break;
+    case 1: strcpy(name + length, "W"); break;
+    }
+}
+
+// Modules of every priority, with exports that are often forwarded or
+// aliased so that an address has up to a handful of candidates
+static void generate(api_list_t *list, int modules, int exports)
+{
+    list->count = 0;
+    for (int m = 0; m < modules; m++) {
+        int priority = m < 12 ? module_priority(module_names[m]) : module_priority(module_names[7 + next_random() % 5]);
+        uintptr_t base = (uintptr_t)(MODULE_SPACING * (m + 1));
+
+        for (int e = 0; e < exports; e++) {
+            char name[48];
+            uintptr_t va = base + 0x1000 + (uintptr_t)e * 0x10;
+
+            if (next_random() % 4)
+                random_name(name, sizeof(name));
+            else
+                name[0] = 0;
+            if (list->count && next_random() % 5 == 0)
+                va = list->api[next_random() % list->count].va;     // forwarded, or an alias
+            add_api(list, va, name, priority);
+        }
+    }
+}
+
+static void test_generated(void)
+{
+    api_list_t list = { 0 };
+
+    for (int round = 0; round < 20; round++) {
+        generate(&list, 2 + round, 20 + round * 10);
+        compare(&list, "generated");
+    }
+    free(list.api);
+}
+
+// A directory of DLLs, read the way ApiReader reads a process's modules
+typedef struct {
+    char file_name[256];
+    uint8_t *data;
+    PEXPORTINDEX index;
+    uintptr_t base;
+} dll_t;
+
+static int compare_dlls(const void *a, const void *b)
+{
+    return strcasecmp(((const dll_t *)a)->file_name, ((const dll_t *)b)->file_name);
+}
+
+static uint8_t *read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t *data;
+    long length;
+
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(length > 0 ? length : 1);
+    if (length <= 0 || fread(data, 1, length, f) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *size = length;
+    return data;
+}
+
+static dll_t *find_dll(dll_t *dlls, size_t count, const char *module, size_t length)
+{
+    for (size_t i = 0; i < count; i++)
+        if (!strncasecmp(dlls[i].file_name, module, length) && !strcasecmp(dlls[i].file_name + length, ".dll"))
+            return &dlls[i];
+    return NULL;
+}
+
+static size_t read_directory(const char *path, api_list_t *list)
+{
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    dll_t *dlls = NULL;
+    size_t count = 0, forwarded = 0;
+
+    list->count = 0;
+    if (!dir) {
+        CHECK(0, "%s: cannot open", path);
+        return 0;
+    }
+    while ((entry = readdir(dir))) {
+        size_t length = strlen(entry->d_name), size;
+        char file[4096];
+        dll_t dll;
+
+        if (length < 5 || length >= sizeof(dll.file_name) || strcasecmp(entry->d_name + length - 4, ".dll"))
+            continue;
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        dll.data = read_file(file, &size);
+        dll.index = dll.data ? ExportIndexBuild(dll.data, size, 0) : NULL;
+        if (!dll.index) {
+            free(dll.data);
+            continue;
+        }
+        strcpy(dll.file_name, entry->d_name);
+        dlls = realloc(dlls, (count + 1) * sizeof(dll_t));
+        dlls[count++] = dll;
+    }
+    closedir(dir);
+
+    if (count)
+        qsort(dlls, count, sizeof(dll_t), compare_dlls);
+    for (size_t i = 0; i < count; i++)
+        dlls[i].base = (uintptr_t)(MODULE_SPACING * (i + 1));
+
+    // forwarded exports are added under the forwarding module's name and
+    // priority at the address they resolve to
+    for (size_t i = 0; i < count; i++) {
+        int priority = module_priority(dlls[i].file_name);
+
+        for (uint32_t ordinal = 0; ordinal < 0x10000; ordinal++) {
+            EXPORTINFO info, target;
+            const char *dot;
+            dll_t *module;
+
+            if (!ExportIndexLookupOrdinal(dlls[i].index, ordinal, &info))
+                continue;
+            if (!info.Forwarder) {
+                add_api(list, dlls[i].base + info.Rva, info.Name, priority);
+                continue;
+            }
+            dot = strchr(info.Forwarder, '.');
+            module = dot ? find_dll(dlls, count, info.Forwarder, dot - info.Forwarder) : NULL;
+            if (!module)
+                continue;
+            if (dot[1] == '#' ? !ExportIndexLookupOrdinal(module->index, (uint32_t)atoi(dot + 2), &target) : !ExportIndexLookupName(module->index, dot + 1, &target))
+                continue;
+            if (target.Forwarder)
+                continue;
+            add_api(list, module->base + target.Rva, info.Name, priority);
+            forwarded++;
+        }
+    }
+
+    printf("%s: %zu DLLs, %zu exports, %zu forwarded\n", path, count, list->count, forwarded);
+    for (size_t i = 0; i < count; i++) {
+        ExportIndexFree(dlls[i].index);
+        free(dlls[i].data);
+    }
+    free(dlls);
+    return list->count;
+}
+
+static void test_directory(const char *path)
+{
+    api_list_t list = { 0 };
+
+    if (read_directory(path, &list))
+        compare(&list, path);
+    free(list.api);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(api_list_t *list, const char *what)
+{
+    enum { LOOKUPS = 1000000 };
+    uintptr_t *vas = malloc(LOOKUPS * sizeof(uintptr_t));
+    PAPIINDEX index;
+    multimap_t map;
+    size_t old_sum = 0, new_sum = 0;
+    double t0, t1, t2;
+
+    // mostly imported functions, some other pointers an IAT search tries
+    for (int i = 0; i < LOOKUPS; i++)
+        vas[i] = list->api[next_random() % list->count].va + (next_random() % 4 == 0);
+
+    t0 = now();
+    multimap_build(&map, list);
+    t1 = now();
+    index = build_index(list);
+    t2 = now();
+    printf("%s: %zu exports, built in: multimap %.2f ms, index %.2f ms\n", what, list->count, (t1 - t0) * 1e3, (t2 - t1) * 1e3);
+
+    t0 = now();
+    for (int i = 0; i < LOOKUPS; i++) {
+        int suspect = 0;
+        old_sum += (uintptr_t)old_api_by_va(&map, vas[i], &suspect) + suspect;
+    }
+    t1 = now();
+    for (int i = 0; i < LOOKUPS; i++) {
+        int suspect = 0;
+        void *api = ApiIndexLookup(index, vas[i], &suspect);
+        if (!api && ApiIndexCandidates(index, vas[i], NULL))
+            api = (void *)1;
+        new_sum += (uintptr_t)api + suspect;
+    }
+    t2 = now();
+    printf("%d lookups: multimap %.1f ms, index %.1f ms%s\n", LOOKUPS, (t1 - t0) * 1e3, (t2 - t1) * 1e3, old_sum == new_sum ? "" : " (MISMATCH)");
+
+    multimap_free(&map);
+    ApiIndexFree(index);
+    free(vas);
+}
+
+int main(int argc, char **argv)
+{
+    int bench_mode = argc > 1 && !strcmp(argv[1], "bench");
+    api_list_t list = { 0 };
+
+    test_rules();
+    test_generated();
+    for (int i = bench_mode ? 2 : 1; i < argc; i++)
+        test_directory(argv[i]);
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (bench_mode) {
+        // hundreds of modules, tens of thousands of exports
+        generate(&list, 300, 150);
+        bench(&list, "generated");
+        for (int i = 2; i < argc; i++)
+            if (read_directory(argv[i], &list))
+                bench(&list, argv[i]);
+    }
+    free(list.api);
+
+    return failures != 0;
+}
@@ -0,0 +1,460 @@
+// Tests for the chunked, parallel decomposition behind Scylla's
+// scanMemoryPage: the instructions CodeScanDecompose returns for every
+// thread count, chunk size and overlap are checked against one serial
+// distorm pass, over generated code, random bytes, long prefix runs and real
+// binaries, with filters accepting every instruction and only those the IAT
+// reference scan looks at. Where the references differ from the batched loop
+// scanMemoryPage used before, the output says how far they agree. Portable
+// harness, build on Linux with:
+//   gcc -O2 -Wall -pthread -I../CAPE -I../distorm/include -o code-scan code-scan.c ../CAPE/CodeScan.c ../distorm/src/*.c
+// Files given on the command line are decoded as well: the executable
+// sections of PE files, and anything else whole as 32 and 64-bit code. The
+// harness itself and libc are always decoded.
+// Run "./code-scan bench" for scaling across 1 to 16 threads over 64MB.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <distorm.h>
+#include <mnemonics.h>
+#include "CodeScan.h"
+
+#define MAX_INSTRUCTIONS 200
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static int accept_all(const _DInst *instruction, void *context)
+{
+    (void)instruction;
+    (void)context;
+    return 1;
+}
+
+// The instructions analyzeInstruction might take as IAT references
+static int accept_references(const _DInst *instruction, void *context)
+{
+    (void)context;
+    if ((META_GET_FC(instruction->meta) == FC_CALL || META_GET_FC(instruction->meta) == FC_UNC_BRANCH) && instruction->size >= 5)
+        return 1;
+    if (instruction->opcode == I_MOV && instruction->size >= 5 && instruction->ops[0].type == O_REG && instruction->ops[1].type == O_IMM)
+        return 1;
+    return instruction->size >= 5 && (instruction->opcode == I_PUSH || instruction->opcode == I_LEA);
+}
+
+typedef struct {
+    _DInst *instruction;
+    size_t count, capacity;
+} list_t;
+
+static void add(list_t *list, const _DInst *instruction)
+{
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        list->instruction = realloc(list->instruction, list->capacity * sizeof(_DInst));
+    }
+    list->instruction[list->count++] = *instruction;
+}
+
+// One distorm pass over the whole region, in batches resuming where distorm stopped
+static void serial_scan(const uint8_t *code, size_t size, uintptr_t address, _DecodeType dt, CODESCAN_FILTER filter, list_t *list)
+{
+    static _DInst result[MAX_INSTRUCTIONS];
+    size_t position = 0;
+    _CodeInfo ci;
+
+    list->count = 0;
+    while (position < size) {
+        unsigned int count = 0;
+        _DecodeResult res;
+        size_t next;
+
+        memset(&ci, 0, sizeof(ci));
+        ci.code = code + position;
+        ci.codeLen = (int)(size - position);
+        ci.dt = dt;
+        ci.codeOffset = address + position;
+        res = distorm_decompose(&ci, result, MAX_INSTRUCTIONS, &count);
+        if (res == DECRES_INPUTERR || !count)
+            break;
+        for (unsigned int i = 0; i < count; i++)
+            if (result[i].flags != FLAG_NOT_DECODABLE && filter(&result[i], NULL))
+                add(list, &result[i]);
+        if (res == DECRES_SUCCESS)
+            break;
+        next = (size_t)(ci.nextOffset - ci.codeOffset);
+        if (!next)
+            next = (size_t)(result[count - 1].addr - result[0].addr) + result[count - 1].size;
+        position += next;
+    }
+}
+
+// scanMemoryPage as it was, which retried an undecodable byte ending a
+// batch of 200 from that byte, so what followed depended on where batches fell
+static void scylla_scan(const uint8_t *code, size_t size, uintptr_t address, _DecodeType dt, CODESCAN_FILTER filter, list_t *list)
+{
+    static _DInst result[MAX_INSTRUCTIONS];
+    const uint8_t *position = code;
+    int remaining = (int)size;
+    _CodeInfo ci;
+
+    list->count = 0;
+    for (;;) {
+        unsigned int count = 0, next;
+        _DecodeResult res;
+
+        memset(&ci, 0, sizeof(ci));
+        ci.code = position;
+        ci.codeLen = remaining;
+        ci.dt = dt;
+        ci.codeOffset = address;
+        res = distorm_decompose(&ci, result, MAX_INSTRUCTIONS, &count);
+        if (res == DECRES_INPUTERR)
+            break;
+        for (unsigned int i = 0; i < count; i++)
+            if (result[i].flags != FLAG_NOT_DECODABLE && filter(&result[i], NULL))
+                add(list, &result[i]);
+        if (res == DECRES_SUCCESS || !count)
+            break;
+        next = (unsigned int)(result[count - 1].addr - result[0].addr);
+        if (result[count - 1].flags != FLAG_NOT_DECODABLE)
+            next += result[count - 1].size;
+        position += next;
+        address += next;
+        remaining -= next;
+    }
+}
+
+static int same_instruction(const _DInst *a, const _DInst *b)
+{
+    if (a->addr != b->addr || a->size != b->size || a->flags != b->flags || a->opcode != b->opcode || a->meta != b->meta || a->disp != b->disp || a->imm.qword != b->imm.qword)
+        return 0;
+    for (int i = 0; i < OPERANDS_NO; i++)
+        if (a->ops[i].type != b->ops[i].type || a->ops[i].index != b->ops[i].index || a->ops[i].size != b->ops[i].size)
+            return 0;
+    return 1;
+}
+
+static void compare(const uint8_t *code, size_t size, uintptr_t address, _DecodeType dt, const char *what)
+{
+    static const struct { unsigned int threads; size_t chunk, overlap; } layouts[] = {
+        { 1, 0, 0 }, { 2, 0, 0 }, { 4, 4096, 256 }, { 3, 1000, 300 }, { 8, 65536, 0 }, { 16, 12345, 1024 }, { 0, 0, 0 },
+    };
+    CODESCAN_FILTER filters[] = { accept_all, accept_references };
+    list_t serial = { 0 }, scylla = { 0 };
+    size_t same = 0;
+
+    scylla_scan(code, size, address, dt, accept_references, &scylla);
+    for (int f = 0; f < 2; f++) {
+        serial_scan(code, size, address, dt, filters[f], &serial);
+        for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+            CODESCANCONFIG config = { 0 };
+            _DInst *instructions;
+            size_t count, mismatch = 0;
+
+            config.DecodeType = dt;
+            config.Threads = layouts[l].threads;
+            config.ChunkSize = layouts[l].chunk;
+            config.Overlap = layouts[l].overlap;
+            config.Filter = filters[f];
+            CHECK(CodeScanDecompose(&config, code, size, address, &instructions, &count), "%s: decomposition failed", what);
+            while (mismatch < count && mismatch < serial.count && same_instruction(&instructions[mismatch], &serial.instruction[mismatch]))
+                mismatch++;
+            CHECK(count == serial.count && mismatch == count, "%s, %u threads, chunks of %zu, overlap %zu, filter %d: %zu instructions, expected %zu, first difference at %zu",
+                what, layouts[l].threads, layouts[l].chunk, layouts[l].overlap, f, count, serial.count, mismatch);
+            CodeScanFree(instructions);
+        }
+    }
+    while (same < serial.count && same < scylla.count && same_instruction(&serial.instruction[same], &scylla.instruction[same]))
+        same++;
+    if (same == serial.count && same == scylla.count)
+        printf("%s: %zu bytes, %zu references, as before\n", what, size, serial.count);
+    else
+        printf("%s: %zu bytes, %zu references, %zu before, the same up to %zu\n", what, size, serial.count, scylla.count, same);
+    free(serial.instruction);
+    free(scylla.instruction);
+}
+
+// Code made of the instructions the reference scan looks for among ordinary ones
+static void generate_code(uint8_t *code, size_t size, int is64)
+{
+    static const uint8_t filler[][5] = {
+        { 1, 0x90 }, { 1, 0x55 }, { 2, 0x8b, 0xec }, { 1, 0xc3 }, { 2, 0x33, 0xc0 }, { 2, 0x85, 0xc0 }, { 3, 0x83, 0xec, 0x10 }, { 2, 0x74, 0x05 },
+        { 2, 0xff, 0xd0 }, { 4, 0x8b, 0x45, 0x08, 0x50 },
+    };
+    size_t at = 0;
+
+    while (at + 16 < size) {
+        uint64_t r = next_random();
+        uint32_t value = (uint32_t)(r >> 32);
+
+        switch (r % 10) {
+        case 0:
+            if (is64)
+                code[at++] = 0x48;
+            code[at++] = (uint8_t)(0xb8 + (r >> 8) % 8);
+            memcpy(code + at, &value, 4);
+            at += 4;
+            if (is64) {
+                memcpy(code + at, &value, 4);
+                at += 4;
+            }
+            break;
+        case 1:
+            code[at++] = 0x68;
+            memcpy(code + at, &value, 4);
+            at += 4;
+            break;
+        case 2:
+            code[at++] = r & 0x100 ? 0xe8 : 0xe9;
+            memcpy(code + at, &value, 4);
+            at += 4;
+            break;
+        case 3:
+            code[at++] = 0xff;
+            code[at++] = r & 0x100 ? 0x15 : 0x25;
+            memcpy(code + at, &value, 4);
+            at += 4;
+            break;
+        default:
+            {
+                const uint8_t *f = filler[(r >> 8) % 10];
+                memcpy(code + at, f + 1, f[0]);
+                at += f[0];
+            }
+            break;
+        }
+    }
+    while (at < size)
+        code[at++] = 0xcc;
+}
+
+static uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] | p[1] << 8); }
+static uint32_t get32(const uint8_t *p) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+
+static uint8_t *read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t *data;
+    long length;
+
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(length > 0 ? length : 1);
+    if (length <= 0 || fread(data, 1, length, f) != (size_t)length) {
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    *size = (size_t)length;
+    return data;
+}
+
+static void test_file(const char *path, int required)
+{
+    size_t size;
+    uint8_t *data = read_file(path, &size);
+    uint32_t nt;
+    char what[300];
+
+    CHECK(data || !required, "%s: cannot read", path);
+    if (!data)
+        return;
+    if (size > 0x200 && get16(data) == 0x5a4d && (nt = get32(data + 0x3c)) < size - 0x108 && get32(data + nt) == 0x4550) {
+        uint32_t opt = nt + 0x18, sections = get16(data + nt + 6);
+        int is64 = get16(data + opt) == 0x20b;
+        uintptr_t image_base = is64 ? (uintptr_t)get32(data + opt + 24) | (uintptr_t)get32(data + opt + 28) << 32 : get32(data + opt + 28);
+
+        for (uint32_t s = 0; s < sections; s++) {
+            const uint8_t *h = data + opt + get16(data + nt + 20) + s * 40;
+            uint32_t va = get32(h + 12), length = get32(h + 16), offset = get32(h + 20);
+
+            if (!(get32(h + 36) & 0x20000000) || offset >= size)
+                continue;
+            if (length > size - offset)
+                length = (uint32_t)(size - offset);
+            snprintf(what, sizeof(what), "%s section %u", path, s);
+            compare(data + offset, length, image_base + va, is64 ? Decode64Bits : Decode32Bits, what);
+        }
+    } else {
+        snprintf(what, sizeof(what), "%s as 64-bit code", path);
+        compare(data, size, 0x400000, Decode64Bits, what);
+        snprintf(what, sizeof(what), "%s as 32-bit code", path);
+        compare(data, size, 0x400000, Decode32Bits, what);
+    }
+    free(data);
+}
+
+// Workers are registered while they decode, as scanMemoryPage's are with hooking off
+typedef struct {
+    pthread_t caller;
+    int started, ended, unregistered;
+} threads_t;
+
+static __thread int registered;
+
+static void thread_start(void *context)
+{
+    __atomic_fetch_add(&((threads_t *)context)->started, 1, __ATOMIC_RELAXED);
+    registered = 1;
+}
+
+static void thread_end(void *context)
+{
+    registered = 0;
+    __atomic_fetch_add(&((threads_t *)context)->ended, 1, __ATOMIC_RELAXED);
+}
+
+static int accept_registered(const _DInst *instruction, void *context)
+{
+    threads_t *threads = context;
+    (void)instruction;
+    if (!registered && !pthread_equal(pthread_self(), threads->caller))
+        __atomic_fetch_add(&threads->unregistered, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void test_thread_callbacks(void)
+{
+    enum { SIZE = 1 << 20 };
+    uint8_t *code = malloc(SIZE);
+    CODESCANCONFIG config = { 0 };
+    threads_t threads = { pthread_self(), 0, 0, 0 };
+    _DInst *instructions;
+    size_t count;
+
+    generate_code(code, SIZE, 0);
+    config.DecodeType = Decode32Bits;
+    config.Threads = 4;
+    config.ChunkSize = 4096;
+    config.Filter = accept_registered;
+    config.ThreadStart = thread_start;
+    config.ThreadEnd = thread_end;
+    config.Context = &threads;
+    CHECK(CodeScanDecompose(&config, code, SIZE, 0x401000, &instructions, &count) && !count, "thread callbacks: decomposition failed");
+    CHECK(threads.started == 3 && threads.ended == 3, "thread callbacks: %d started, %d ended", threads.started, threads.ended);
+    CHECK(!threads.unregistered, "thread callbacks: %d instructions filtered on unregistered threads", threads.unregistered);
+    CodeScanFree(instructions);
+
+    // one thread is the caller's alone
+    threads.started = threads.ended = 0;
+    config.Threads = 1;
+    CHECK(CodeScanDecompose(&config, code, SIZE, 0x401000, &instructions, &count), "thread callbacks: serial decomposition failed");
+    CHECK(!threads.started && !threads.ended && !threads.unregistered, "thread callbacks: serial %d started", threads.started);
+    CodeScanFree(instructions);
+    free(code);
+}
+
+static void test_generated(void)
+{
+    enum { SIZE = 3 << 20 };
+    uint8_t *code = malloc(SIZE);
+
+    generate_code(code, SIZE, 0);
+    compare(code, SIZE, 0x401000, Decode32Bits, "generated x86 code");
+    generate_code(code, SIZE, 1);
+    compare(code, SIZE, 0x140001000ULL, Decode64Bits, "generated x64 code");
+
+    for (size_t i = 0; i < SIZE; i++)
+        code[i] = (uint8_t)next_random();
+    compare(code, SIZE, 0x401000, Decode32Bits, "random bytes");
+
+    // prefixes running past the longest instruction, across chunk boundaries
+    for (size_t i = 0; i < SIZE; i++)
+        code[i] = next_random() % 3 ? 0x66 : (uint8_t)next_random();
+    compare(code, SIZE, 0x401000, Decode32Bits, "prefix runs");
+
+    memset(code, 0, SIZE);
+    compare(code, SIZE, 0x401000, Decode32Bits, "zeroes");
+
+    // sizes around the chunk layouts, down to nothing
+    generate_code(code, SIZE, 0);
+    compare(code, 4097, 0x401000, Decode32Bits, "4097 bytes");
+    compare(code, 100, 0x401000, Decode32Bits, "100 bytes");
+    compare(code, 1, 0x401000, Decode32Bits, "1 byte");
+    compare(code, 0, 0x401000, Decode32Bits, "nothing");
+
+    free(code);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *self)
+{
+    enum { SIZE = 64 << 20 };
+    uint8_t *code = malloc(SIZE), *real;
+    size_t real_size = 0, count;
+    list_t serial = { 0 };
+    _DInst *instructions;
+    double t0, t1, serial_time;
+
+    // real code repeated, or generated code if there is none
+    real = read_file("/lib/x86_64-linux-gnu/libc.so.6", &real_size);
+    if (!real)
+        real = read_file(self, &real_size);
+    if (real)
+        for (size_t at = 0; at < SIZE; at += real_size)
+            memcpy(code + at, real, at + real_size <= SIZE ? real_size : SIZE - at);
+    else
+        generate_code(code, SIZE, 1);
+    free(real);
+
+    t0 = now();
+    serial_scan(code, SIZE, 0x140001000ULL, Decode64Bits, accept_references, &serial);
+    t1 = now();
+    serial_time = t1 - t0;
+    printf("64MB of 64-bit code, %zu references: serial scan %.0f ms\n", serial.count, serial_time * 1e3);
+    for (unsigned int threads = 1; threads <= 16; threads *= 2) {
+        CODESCANCONFIG config = { 0 };
+
+        config.DecodeType = Decode64Bits;
+        config.Threads = threads;
+        config.Filter = accept_references;
+        t0 = now();
+        CodeScanDecompose(&config, code, SIZE, 0x140001000ULL, &instructions, &count);
+        t1 = now();
+        printf("  %2u threads: %.0f ms, %.2fx%s\n", threads, (t1 - t0) * 1e3, serial_time / (t1 - t0), count == serial.count ? "" : " (differs)");
+        CodeScanFree(instructions);
+    }
+    free(serial.instruction);
+    free(code);
+}
+
+int main(int argc, char **argv)
+{
+    int bench_mode = argc > 1 && !strcmp(argv[1], "bench");
+
+    test_generated();
+    test_thread_callbacks();
+    test_file(argv[0], 1);
+    test_file("/lib/x86_64-linux-gnu/libc.so.6", 0);
+    for (int i = bench_mode ? 2 : 1; i < argc; i++)
+        test_file(argv[i], 1);
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (bench_mode)
+        bench(argv[0]);
+
+    return failures != 0;
+}
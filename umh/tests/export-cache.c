@@ -0,0 +1,836 @@
+// Tests for the export cache behind Scylla's readApisFromModuleList: the
+// exports read through the cache over a series of dumps, as modules load,
+// unload and change with and without notifications, are checked against
+// reading every module again, along with how many modules had to be read.
+// The reader here follows ApiReader, walking each module's export directory
+// and resolving forwarders into the other modules. Portable harness, build
+// on Linux with:
+//   gcc -O2 -Wall -pthread -I../CAPE -o export-cache export-cache.c ../CAPE/ExportCache.c ../CAPE/ApiIndex.c
+// DLLs given on the command line, such as copies of kernel32.dll and
+// ntdll.dll, are mapped and read as a process's modules as well.
+// Run "./export-cache bench" for consecutive reads of 100 modules.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+#include "ExportCache.h"
+#include "ApiIndex.h"
+
+#define MAX_MODULES 256
+#define EDATA_RVA 0x1000
+#define MODULE_SPACING 0x1000000
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static void put16(uint8_t *p, uint16_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+static void put32(uint8_t *p, uint32_t v) { put16(p, (uint16_t)v); put16(p + 2, (uint16_t)(v >> 16)); }
+static uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] | p[1] << 8); }
+static uint32_t get32(const uint8_t *p) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+
+// A DLL image in mapped layout, RVAs being offsets
+typedef struct {
+    char file_name[64];
+    uint8_t *data;
+    uint32_t size;
+} image_t;
+
+// An export of a generated DLL: code at an RVA, or forwarded
+typedef struct {
+    const char *name;       // NULL for exports by ordinal only
+    uint32_t rva;
+    char forwarder[64];
+} export_t;
+
+static uint32_t image_stamp(const image_t *image)
+{
+    return get32(image->data + get32(image->data + 0x3c) + 8);
+}
+
+static void set_stamp(image_t *image, uint32_t stamp)
+{
+    put32(image->data + get32(image->data + 0x3c) + 8, stamp);
+}
+
+static void build_image(image_t *image, const char *file_name, const export_t *exports, uint32_t count, uint32_t stamp)
+{
+    uint32_t names = 0, strings = 0, functions_rva, names_rva, ordinals_rva, at, size;
+    uint8_t *h, *e;
+
+    for (uint32_t i = 0; i < count; i++) {
+        names += exports[i].name != NULL;
+        strings += (exports[i].name ? (uint32_t)strlen(exports[i].name) + 1 : 0) + (uint32_t)strlen(exports[i].forwarder) + 1;
+    }
+    functions_rva = EDATA_RVA + 40;
+    names_rva = functions_rva + count * 4;
+    ordinals_rva = names_rva + names * 4;
+    at = ordinals_rva + names * 2;
+    size = (at + strings + 32 + 0xfff) & ~0xfff;
+
+    snprintf(image->file_name, sizeof(image->file_name), "%s", file_name);
+    image->size = size + 0x10000;       // code after the export directory
+    image->data = calloc(1, image->size);
+
+    h = image->data;
+    put16(h, 0x5a4d);
+    put32(h + 0x3c, 0x80);
+    put32(h + 0x80, 0x4550);
+    put16(h + 0x84, 0x14c);
+    put32(h + 0x88, stamp);
+    put16(h + 0x94, 0xe0);
+    put16(h + 0x98, 0x10b);
+    put32(h + 0x98 + 56, image->size);
+    put32(h + 0x98 + 60, 0x400);
+    put32(h + 0x98 + 64, stamp ^ 0x5a5a);
+    put32(h + 0x98 + 92, 16);
+    put32(h + 0x98 + 96, EDATA_RVA);
+
+    e = image->data + EDATA_RVA;
+    strcpy((char *)image->data + at, file_name);
+    put32(e + 12, at);
+    at += (uint32_t)strlen(file_name) + 1;
+    put32(e + 16, 1);
+    put32(e + 20, count);
+    put32(e + 24, names);
+    put32(e + 28, functions_rva);
+    put32(e + 32, names_rva);
+    put32(e + 36, ordinals_rva);
+    names = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t rva = size + exports[i].rva;
+        if (exports[i].forwarder[0]) {
+            rva = at;
+            strcpy((char *)image->data + at, exports[i].forwarder);
+            at += (uint32_t)strlen(exports[i].forwarder) + 1;
+        }
+        put32(image->data + functions_rva + i * 4, rva);
+        if (exports[i].name) {
+            strcpy((char *)image->data + at, exports[i].name);
+            put32(image->data + names_rva + names * 4, at);
+            put16(image->data + ordinals_rva + names * 2, (uint16_t)i);
+            at += (uint32_t)strlen(exports[i].name) + 1;
+            names++;
+        }
+    }
+    put32(h + 0x98 + 100, at - EDATA_RVA);
+}
+
+// A process's module list
+typedef struct {
+    image_t *image;
+    uintptr_t base;
+} module_t;
+
+typedef struct {
+    module_t module[MAX_MODULES];
+    size_t count;
+} process_t;
+
+// ApiInfo
+typedef struct {
+    char name[64];
+    uint16_t ordinal;
+    uintptr_t va;
+    int forwarded;
+    const module_t *module;
+} api_t;
+
+// The exports read from one module, as the cache holds them
+typedef struct {
+    api_t *api;
+    size_t count, capacity;
+} module_apis_t;
+
+static unsigned int created, freed;
+
+static void free_module_apis(void *exports)
+{
+    module_apis_t *apis = exports;
+    free(apis->api);
+    free(apis);
+    freed++;
+}
+
+// ApiReader's static state
+typedef struct {
+    PEXPORTCACHE cache;             // NULL to read every module every time
+    module_apis_t **sources;
+    size_t source_count;
+    module_apis_t **uncached;
+    size_t uncached_count;
+    const api_t **api_list;
+    size_t api_count;
+    PAPIINDEX index;
+    unsigned int parses, rebuilds;
+} reader_t;
+
+static void add_api(module_apis_t *apis, const char *name, uint16_t ordinal, uintptr_t va, int forwarded, const module_t *module)
+{
+    api_t *api;
+
+    if (apis->count == apis->capacity) {
+        apis->capacity = apis->capacity ? apis->capacity * 2 : 64;
+        apis->api = realloc(apis->api, apis->capacity * sizeof(api_t));
+    }
+    api = &apis->api[apis->count++];
+    api->name[0] = 0;
+    if (name && strlen(name) < sizeof(api->name))
+        strcpy(api->name, name);
+    api->ordinal = ordinal;
+    api->va = va;
+    api->forwarded = forwarded;
+    api->module = module;
+}
+
+static const module_t *find_module(const process_t *process, const char *file_name)
+{
+    for (size_t i = 0; i < process->count; i++)
+        if (!strcasecmp(process->module[i].image->file_name, file_name))
+            return &process->module[i];
+    return NULL;
+}
+
+// findApiInExportTable: the RVA of an export by name or ordinal, 0 if none
+static uint32_t find_export(const image_t *image, const char *name, uint16_t ordinal)
+{
+    const uint8_t *d = image->data, *e;
+    uint32_t dir = get32(d + get32(d + 0x3c) + 0x18 + 96), base, functions;
+
+    if (!dir)
+        return 0;
+    e = d + dir;
+    base = get32(e + 16);
+    functions = get32(e + 20);
+    if (!name)
+        return ordinal >= base && ordinal - base < functions ? get32(d + get32(e + 28) + (ordinal - base) * 4) : 0;
+    for (uint32_t i = 0; i < get32(e + 24); i++)
+        if (!strcmp((const char *)d + get32(d + get32(e + 32) + i * 4), name))
+            return get32(d + get32(e + 28) + get16(d + get32(e + 36) + i * 2) * 4);
+    return 0;
+}
+
+// The modules named by forwarders that did not resolve
+typedef struct {
+    char name[MAX_MODULES][80];
+    size_t count;
+} unresolved_t;
+
+// handleForwardedApi
+static void add_forwarded(const process_t *process, const module_t *parent, module_apis_t *apis, const char *forwarder, const char *name, uint16_t ordinal, unresolved_t *unresolved)
+{
+    const char *dot = strchr(forwarder, '.');
+    char file_name[80];
+    const module_t *target;
+    uint32_t rva;
+
+    if (!dot || dot - forwarder >= 64)
+        return;
+    snprintf(file_name, sizeof(file_name), "%.*s.dll", (int)(dot - forwarder), forwarder);
+    target = find_module(process, file_name);
+    rva = !target ? 0 : dot[1] == '#' ? find_export(target->image, NULL, (uint16_t)atoi(dot + 2)) : find_export(target->image, dot + 1, 0);
+    if (!rva) {
+        size_t i;
+        for (i = 0; i < unresolved->count && strcasecmp(unresolved->name[i], file_name); i++)
+            ;
+        if (i == unresolved->count && i < MAX_MODULES)
+            strcpy(unresolved->name[unresolved->count++], file_name);
+        return;
+    }
+    add_api(apis, name, ordinal, target->base + rva, 1, parent);
+}
+
+// parseExportTable
+static module_apis_t *parse_module(const process_t *process, const module_t *module, unresolved_t *unresolved)
+{
+    module_apis_t *apis = calloc(1, sizeof(module_apis_t));
+    const uint8_t *d = module->image->data, *e, *functions, *names, *ordinals;
+    uint32_t opt = get32(d + 0x3c) + 0x18, dir = get32(d + opt + 96), dir_size = get32(d + opt + 100), base, count, name_count;
+
+    created++;
+    if (!dir)
+        return apis;
+    e = d + dir;
+    base = get32(e + 16);
+    count = get32(e + 20);
+    name_count = get32(e + 24);
+    functions = d + get32(e + 28);
+    names = d + get32(e + 32);
+    ordinals = d + get32(e + 36);
+
+    for (uint32_t i = 0; i < name_count; i++) {
+        const char *name = (const char *)d + get32(names + i * 4);
+        uint16_t function = get16(ordinals + i * 2);
+        uint32_t rva = get32(functions + function * 4);
+
+        if (rva > dir && rva < dir + dir_size)
+            add_forwarded(process, module, apis, (const char *)d + rva, name, (uint16_t)(function + base), unresolved);
+        else
+            add_api(apis, name, (uint16_t)(function + base), module->base + rva, 0, module);
+    }
+    if (name_count != count) {
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t rva = get32(functions + i * 4), j;
+
+            for (j = 0; j < name_count && get16(ordinals + j * 2) != i; j++)
+                ;
+            if (j < name_count || !rva)
+                continue;
+            if (rva > dir && rva < dir + dir_size)
+                add_forwarded(process, module, apis, (const char *)d + rva, NULL, (uint16_t)(i + base), unresolved);
+            else
+                add_api(apis, NULL, (uint16_t)(i + base), module->base + rva, 0, module);
+        }
+    }
+    return apis;
+}
+
+static int module_priority(const char *file_name)
+{
+    if (!strcasecmp(file_name, "kernelbase.dll"))
+        return -1;
+    if (!strcasecmp(file_name, "ntdll.dll") || !strncasecmp(file_name, "api-", 4))
+        return 0;
+    if (!strcasecmp(file_name, "kernel32.dll"))
+        return 2;
+    return 1;
+}
+
+static void build_api_list(reader_t *reader, module_apis_t **sources, size_t count)
+{
+    APICANDIDATE *candidates;
+    size_t total = 0;
+
+    for (size_t i = 0; i < count; i++)
+        total += sources[i]->count;
+    free(reader->api_list);
+    ApiIndexFree(reader->index);
+    reader->api_list = malloc((total + 1) * sizeof(api_t *));
+    candidates = malloc((total + 1) * sizeof(APICANDIDATE));
+    reader->api_count = 0;
+    for (size_t i = 0; i < count; i++)
+        for (size_t j = 0; j < sources[i]->count; j++) {
+            const api_t *api = &sources[i]->api[j];
+            candidates[reader->api_count].Address = api->va;
+            candidates[reader->api_count].Api = (void *)api;
+            candidates[reader->api_count].Name = api->name;
+            candidates[reader->api_count].Priority = module_priority(api->module->image->file_name);
+            reader->api_list[reader->api_count++] = api;
+        }
+    reader->index = ApiIndexBuild(candidates, reader->api_count);
+    free(candidates);
+    free(reader->sources);
+    reader->sources = sources;
+    reader->source_count = count;
+    reader->rebuilds++;
+}
+
+// readApisFromModuleList
+static void read_apis(reader_t *reader, process_t *process)
+{
+    EXPORTCACHEMODULE modules[MAX_MODULES];
+    module_apis_t **sources = malloc((process->count + 1) * sizeof(module_apis_t *));
+    module_apis_t **previous_uncached = reader->uncached;
+    size_t previous_uncached_count = reader->uncached_count;
+
+    reader->uncached = malloc((process->count + 1) * sizeof(module_apis_t *));
+    reader->uncached_count = 0;
+
+    for (size_t i = 0; i < process->count; i++) {
+        modules[i].Base = process->module[i].base;
+        modules[i].Size = process->module[i].image->size;
+        modules[i].Stamp = (uint64_t)image_stamp(process->module[i].image) << 32 | get32(process->module[i].image->data + 0x80 + 0x18 + 64);
+        modules[i].Name = process->module[i].image->file_name;
+    }
+    ExportCacheBegin(reader->cache, modules, process->count);
+
+    for (size_t i = 0; i < process->count; i++) {
+        module_apis_t *apis = ExportCacheLookup(reader->cache, modules[i].Base, modules[i].Size, modules[i].Stamp);
+
+        if (apis) {
+            for (size_t j = 0; j < apis->count; j++)
+                apis->api[j].module = &process->module[i];
+        } else {
+            uintptr_t targets[MAX_MODULES];
+            const char *unresolved_names[MAX_MODULES];
+            size_t target_count = 0;
+            unresolved_t unresolved;
+
+            unresolved.count = 0;
+
+            apis = parse_module(process, &process->module[i], &unresolved);
+            reader->parses++;
+            for (size_t j = 0; j < apis->count; j++) {
+                if (!apis->api[j].forwarded)
+                    continue;
+                for (size_t k = 0; k < process->count; k++) {
+                    size_t t;
+                    if (apis->api[j].va < process->module[k].base || apis->api[j].va - process->module[k].base >= process->module[k].image->size)
+                        continue;
+                    for (t = 0; t < target_count && targets[t] != process->module[k].base; t++)
+                        ;
+                    if (t == target_count)
+                        targets[target_count++] = process->module[k].base;
+                    break;
+                }
+            }
+            for (size_t j = 0; j < unresolved.count; j++)
+                unresolved_names[j] = unresolved.name[j];
+            if (!ExportCacheStore(reader->cache, modules[i].Base, modules[i].Size, modules[i].Stamp, apis, targets, target_count, unresolved_names, unresolved.count))
+                reader->uncached[reader->uncached_count++] = apis;
+        }
+        sources[i] = apis;
+    }
+
+    if (!reader->index || reader->source_count != process->count || memcmp(sources, reader->sources, process->count * sizeof(module_apis_t *)))
+        build_api_list(reader, sources, process->count);
+    else
+        free(sources);
+
+    ExportCacheEnd(reader->cache);
+
+    for (size_t i = 0; i < previous_uncached_count; i++)
+        free_module_apis(previous_uncached[i]);
+    free(previous_uncached);
+}
+
+static void reader_free(reader_t *reader)
+{
+    for (size_t i = 0; i < reader->uncached_count; i++)
+        free_module_apis(reader->uncached[i]);
+    free(reader->uncached);
+    free(reader->sources);
+    free(reader->api_list);
+    ApiIndexFree(reader->index);
+    ExportCacheDestroy(reader->cache);
+    memset(reader, 0, sizeof(*reader));
+}
+
+// The cached reader's exports are those read from scratch, in the same order
+static void compare_fresh(reader_t *reader, process_t *process, const char *what)
+{
+    reader_t fresh = { 0 };
+    size_t mismatches = 0;
+
+    read_apis(&fresh, process);
+    CHECK(reader->api_count == fresh.api_count, "%s: %zu exports, expected %zu", what, reader->api_count, fresh.api_count);
+    for (size_t i = 0; i < reader->api_count && i < fresh.api_count; i++) {
+        const api_t *a = reader->api_list[i], *b = fresh.api_list[i];
+        if (strcmp(a->name, b->name) || a->ordinal != b->ordinal || a->va != b->va || a->forwarded != b->forwarded || a->module != b->module)
+            mismatches++;
+    }
+    CHECK(mismatches == 0, "%s: %zu exports differ", what, mismatches);
+    for (size_t i = 0; i < reader->api_count && i < fresh.api_count; i++) {
+        const api_t *a = ApiIndexLookup(reader->index, reader->api_list[i]->va, NULL), *b = ApiIndexLookup(fresh.index, reader->api_list[i]->va, NULL);
+        if (!a != !b || (a && (a->module != b->module || strcmp(a->name, b->name)))) {
+            CHECK(0, "%s: %#zx resolves differently", what, (size_t)reader->api_list[i]->va);
+            break;
+        }
+    }
+    reader_free(&fresh);
+}
+
+// A small process: ntdll, kernelbase, kernel32 forwarding into both and
+// into late.dll which is loaded later, an api set forwarding into
+// kernelbase, user32 forwarding into ntdll, and modules without forwarders
+enum { NTDLL, KERNELBASE, KERNEL32, API_SET, USER32, LATE, FILLER, IMAGES = FILLER + 8 };
+
+static image_t images[IMAGES];
+
+static const char *image_names[IMAGES] = {
+    "ntdll.dll", "kernelbase.dll", "kernel32.dll", "api-ms-win-core-test-l1-1-0.dll", "user32.dll", "late.dll",
+    "filler0.dll", "filler1.dll", "filler2.dll", "filler3.dll", "filler4.dll", "filler5.dll", "filler6.dll", "filler7.dll",
+};
+
+static char name_pool[IMAGES][200][32];
+
+static void generate_image(int which, uint32_t count, uint32_t stamp)
+{
+    export_t *exports = calloc(count, sizeof(export_t));
+
+    for (uint32_t i = 0; i < count; i++) {
+        exports[i].rva = i * 0x10;
+        // every ntdll export is named, kernel32 forwards to them by name
+        if (which == NTDLL || next_random() % 8) {
+            snprintf(name_pool[which][i], sizeof(name_pool[which][i]), "F%d_%u%s", which, i, which != NTDLL && next_random() % 2 ? "W" : "");
+            exports[i].name = name_pool[which][i];
+        }
+        switch (which) {
+        case KERNEL32:
+            if (i % 3 == 0)
+                snprintf(exports[i].forwarder, sizeof(exports[i].forwarder), "NTDLL.F%d_%u", NTDLL, (uint32_t)(next_random() % 100));
+            else if (i % 3 == 1)
+                snprintf(exports[i].forwarder, sizeof(exports[i].forwarder), "kernelbase.#%u", 1 + (uint32_t)(next_random() % 100));
+            else if (i % 10 == 2)
+                snprintf(exports[i].forwarder, sizeof(exports[i].forwarder), "late.#%u", 1 + (uint32_t)(next_random() % 50));
+            break;
+        case API_SET:
+            snprintf(exports[i].forwarder, sizeof(exports[i].forwarder), "kernelbase.#%u", 1 + (uint32_t)(next_random() % 100));
+            break;
+        case USER32:
+            if (i % 4 == 0)
+                snprintf(exports[i].forwarder, sizeof(exports[i].forwarder), "ntdll.#%u", 1 + (uint32_t)(next_random() % 100));
+            break;
+        }
+    }
+    free(images[which].data);
+    build_image(&images[which], image_names[which], exports, count, stamp);
+    free(exports);
+}
+
+static void load(process_t *process, image_t *image, uintptr_t base)
+{
+    process->module[process->count].image = image;
+    process->module[process->count].base = base;
+    process->count++;
+}
+
+static size_t unload(process_t *process, const char *file_name)
+{
+    for (size_t i = 0; i < process->count; i++)
+        if (!strcasecmp(process->module[i].image->file_name, file_name)) {
+            uintptr_t base = process->module[i].base;
+            memmove(&process->module[i], &process->module[i + 1], (process->count - i - 1) * sizeof(module_t));
+            process->count--;
+            return base;
+        }
+    return 0;
+}
+
+static void test_scenarios(void)
+{
+    static process_t process;
+    reader_t reader = { 0 };
+    unsigned int parses, rebuilds;
+    uintptr_t base;
+
+    generate_image(NTDLL, 150, 1);
+    generate_image(KERNELBASE, 150, 1);
+    generate_image(KERNEL32, 120, 1);
+    generate_image(API_SET, 40, 1);
+    generate_image(USER32, 100, 1);
+    generate_image(LATE, 60, 1);
+    for (int i = FILLER; i < IMAGES; i++)
+        generate_image(i, 50 + i, 1);
+
+    reader.cache = ExportCacheCreate(free_module_apis);
+    for (int i = 0; i < IMAGES; i++)
+        if (i != LATE)
+            load(&process, &images[i], MODULE_SPACING * (i + 1));
+
+    read_apis(&reader, &process);
+    CHECK(reader.parses == process.count, "first read parsed %u of %zu modules", reader.parses, process.count);
+    CHECK(ExportCacheCount(reader.cache) == process.count, "%zu modules cached", ExportCacheCount(reader.cache));
+    compare_fresh(&reader, &process, "first read");
+
+    // nothing changed: nothing read, nothing rebuilt
+    parses = reader.parses;
+    rebuilds = reader.rebuilds;
+    read_apis(&reader, &process);
+    CHECK(reader.parses == parses && reader.rebuilds == rebuilds, "unchanged read parsed %u, rebuilt %u", reader.parses - parses, reader.rebuilds - rebuilds);
+    compare_fresh(&reader, &process, "unchanged");
+
+    // ntdll goes: kernel32 and user32 forwarded into it
+    base = unload(&process, "ntdll.dll");
+    ExportCacheModuleUnloaded(reader.cache, base);
+    parses = reader.parses;
+    read_apis(&reader, &process);
+    CHECK(reader.parses - parses == 2, "after unloading ntdll %u parsed, expected 2", reader.parses - parses);
+    CHECK(ExportCacheCount(reader.cache) == process.count, "%zu modules cached after unload", ExportCacheCount(reader.cache));
+    compare_fresh(&reader, &process, "ntdll unloaded");
+
+    // late.dll arrives: kernel32 had forwarders into it, while user32's into
+    // ntdll still do not resolve
+    load(&process, &images[LATE], MODULE_SPACING * 40);
+    ExportCacheModuleLoaded(reader.cache, MODULE_SPACING * 40, "C:\\Windows\\System32\\LATE.dll");
+    parses = reader.parses;
+    read_apis(&reader, &process);
+    CHECK(reader.parses - parses == 2, "after loading late.dll %u parsed, expected 2", reader.parses - parses);
+    compare_fresh(&reader, &process, "late.dll loaded");
+
+    // ntdll back at another base, without a notification
+    load(&process, &images[NTDLL], MODULE_SPACING * 41);
+    parses = reader.parses;
+    read_apis(&reader, &process);
+    CHECK(reader.parses - parses == 3, "after ntdll came back %u parsed, expected 3", reader.parses - parses);
+    compare_fresh(&reader, &process, "ntdll reloaded");
+
+    // a module nothing depends on changes in place
+    set_stamp(&images[FILLER], 2);
+    parses = reader.parses;
+    read_apis(&reader, &process);
+    CHECK(reader.parses - parses == 1, "after a filler changed %u parsed, expected 1", reader.parses - parses);
+    compare_fresh(&reader, &process, "filler changed");
+
+    // kernelbase changes in place, moving its exports, without a notification
+    generate_image(KERNELBASE, 150, 3);
+    parses = reader.parses;
+    read_apis(&reader, &process);
+    CHECK(reader.parses - parses == 3, "after kernelbase changed %u parsed, expected 3", reader.parses - parses);
+    compare_fresh(&reader, &process, "kernelbase changed");
+
+    // a notification for a module that has not changed only costs a read
+    ExportCacheModuleUnloaded(reader.cache, MODULE_SPACING * (USER32 + 1));
+    parses = reader.parses;
+    read_apis(&reader, &process);
+    CHECK(reader.parses - parses == 1, "after a spurious notification %u parsed, expected 1", reader.parses - parses);
+    compare_fresh(&reader, &process, "spurious notification");
+
+    // churn: modules come and go at random bases, change, with and without notifications
+    for (int round = 0; round < 300; round++) {
+        int which = (int)(next_random() % IMAGES), loaded = find_module(&process, image_names[which]) != NULL;
+        char what[64];
+
+        switch (next_random() % 3) {
+        case 0:
+            if (loaded) {
+                base = unload(&process, image_names[which]);
+                if (next_random() % 2)
+                    ExportCacheModuleUnloaded(reader.cache, base);
+                break;
+            }
+            // fall through
+        case 1:
+            if (!loaded) {
+                base = MODULE_SPACING * (50 + next_random() % 150);
+                for (size_t i = 0; i < process.count; i++)
+                    if (process.module[i].base == base)
+                        base = 0;
+                if (base) {
+                    load(&process, &images[which], base);
+                    if (next_random() % 2)
+                        ExportCacheModuleLoaded(reader.cache, base, next_random() % 2 ? image_names[which] : NULL);
+                }
+                break;
+            }
+            // fall through
+        default:
+            if (which == NTDLL || which == KERNEL32)
+                set_stamp(&images[which], image_stamp(&images[which]) + 1);
+            else
+                generate_image(which, 30 + (uint32_t)(next_random() % 100), image_stamp(&images[which]) + 1);
+            break;
+        }
+        read_apis(&reader, &process);
+        snprintf(what, sizeof(what), "churn round %d", round);
+        compare_fresh(&reader, &process, what);
+        CHECK(ExportCacheCount(reader.cache) <= process.count, "%s: %zu modules cached for %zu", what, ExportCacheCount(reader.cache), process.count);
+    }
+    printf("scenarios: %u modules read, %u lists built\n", reader.parses, reader.rebuilds);
+
+    reader_free(&reader);
+}
+
+// Notifications from another thread while dumps read the same modules
+typedef struct {
+    PEXPORTCACHE cache;
+    int stop;
+} notifier_t;
+
+static void *notify(void *argument)
+{
+    notifier_t *notifier = argument;
+    uint64_t state = 12345;
+
+    while (!__atomic_load_n(&notifier->stop, __ATOMIC_ACQUIRE)) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        if (state % 2)
+            ExportCacheModuleLoaded(notifier->cache, MODULE_SPACING * (1 + state % IMAGES), image_names[state % IMAGES]);
+        else
+            ExportCacheModuleUnloaded(notifier->cache, MODULE_SPACING * (1 + state % IMAGES));
+    }
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    static process_t process;
+    reader_t reader = { 0 };
+    notifier_t notifier;
+    pthread_t thread;
+
+    for (int i = 0; i < IMAGES; i++)
+        load(&process, &images[i], MODULE_SPACING * (i + 1));
+    reader.cache = ExportCacheCreate(free_module_apis);
+    notifier.cache = reader.cache;
+    notifier.stop = 0;
+    pthread_create(&thread, NULL, notify, &notifier);
+    for (int i = 0; i < 50; i++)
+        read_apis(&reader, &process);
+    __atomic_store_n(&notifier.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+
+    read_apis(&reader, &process);
+    compare_fresh(&reader, &process, "after notifications");
+    printf("threads: %u modules read in 51 passes\n", reader.parses);
+    reader_free(&reader);
+}
+
+// DLL files mapped at made up bases
+static size_t load_files(process_t *process, image_t *files, int count, char **paths)
+{
+    for (int i = 0; i < count; i++) {
+        FILE *f = fopen(paths[i], "rb");
+        uint8_t *raw;
+        long size;
+        uint32_t nt, sections, size_of_image;
+        const char *slash = strrchr(paths[i], '/');
+
+        CHECK(f != NULL, "%s: cannot open", paths[i]);
+        if (!f)
+            continue;
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        raw = malloc(size > 0 ? size : 1);
+        if (size < 0x200 || fread(raw, 1, size, f) != (size_t)size || get16(raw) != 0x5a4d || (nt = get32(raw + 0x3c)) > (uint32_t)size - 0x108 || get32(raw + nt) != 0x4550) {
+            CHECK(0, "%s: not a PE file", paths[i]);
+            fclose(f);
+            free(raw);
+            continue;
+        }
+        fclose(f);
+
+        // map the sections
+        size_of_image = get32(raw + nt + 0x18 + 56);
+        sections = get16(raw + nt + 6);
+        snprintf(files->file_name, sizeof(files->file_name), "%s", slash ? slash + 1 : paths[i]);
+        files->size = size_of_image;
+        files->data = calloc(1, size_of_image);
+        memcpy(files->data, raw, get32(raw + nt + 0x18 + 60) < (uint32_t)size ? get32(raw + nt + 0x18 + 60) : (uint32_t)size);
+        for (uint32_t s = 0; s < sections; s++) {
+            const uint8_t *h = raw + nt + 0x18 + get16(raw + nt + 20) + s * 40;
+            uint32_t va = get32(h + 12), raw_size = get32(h + 16), offset = get32(h + 20);
+            if (va < size_of_image && offset < (uint32_t)size) {
+                uint32_t length = raw_size;
+                if (length > size_of_image - va)
+                    length = size_of_image - va;
+                if (length > (uint32_t)size - offset)
+                    length = (uint32_t)size - offset;
+                memcpy(files->data + va, raw + offset, length);
+            }
+        }
+        free(raw);
+        load(process, files, 0x70000000 + (uintptr_t)MODULE_SPACING * 4 * process->count);
+        files++;
+    }
+    return process->count;
+}
+
+static void test_files(int count, char **paths)
+{
+    static process_t process;
+    image_t *files = calloc(count, sizeof(image_t));
+    reader_t reader = { 0 };
+    unsigned int parses;
+
+    if (load_files(&process, files, count, paths)) {
+        reader.cache = ExportCacheCreate(free_module_apis);
+        read_apis(&reader, &process);
+        compare_fresh(&reader, &process, "files");
+        parses = reader.parses;
+        read_apis(&reader, &process);
+        CHECK(reader.parses == parses, "files read again");
+        printf("files: %zu modules, %zu exports\n", process.count, reader.api_count);
+        reader_free(&reader);
+    }
+    for (int i = 0; i < count; i++)
+        free(files[i].data);
+    free(files);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(void)
+{
+    enum { MODULES = 100, DUMPS = 20 };
+    static process_t process;
+    static image_t bench_images[MODULES];
+    static char names[MODULES][600][32];
+    reader_t cached = { 0 }, uncached = { 0 };
+    double t0, t1, t2, t3;
+
+    // a hundred modules of 600 exports, a quarter forwarding into the one before
+    for (int m = 0; m < MODULES; m++) {
+        export_t *exports = calloc(600, sizeof(export_t));
+        char file_name[32];
+
+        for (int i = 0; i < 600; i++) {
+            exports[i].rva = i * 0x10;
+            snprintf(names[m][i], sizeof(names[m][i]), "Function%d_%d", m, i);
+            exports[i].name = names[m][i];
+            if (m && i % 4 == 0)
+                snprintf(exports[i].forwarder, sizeof(exports[i].forwarder), "module%d.Function%d_%d", m - 1, m - 1, i + 1);
+        }
+        snprintf(file_name, sizeof(file_name), "module%d.dll", m);
+        build_image(&bench_images[m], file_name, exports, 600, 1);
+        load(&process, &bench_images[m], MODULE_SPACING * (m + 1));
+        free(exports);
+    }
+
+    cached.cache = ExportCacheCreate(free_module_apis);
+    t0 = now();
+    for (int i = 0; i < DUMPS; i++)
+        read_apis(&uncached, &process);
+    t1 = now();
+    read_apis(&cached, &process);
+    t2 = now();
+    for (int i = 1; i < DUMPS; i++)
+        read_apis(&cached, &process);
+    t3 = now();
+    printf("%d dumps of %d modules, %zu exports: every module read %.2f ms per dump, cached %.2f ms first and %.3f ms after\n",
+        DUMPS, MODULES, cached.api_count, (t1 - t0) * 1e3 / DUMPS, (t2 - t1) * 1e3, (t3 - t2) * 1e3 / (DUMPS - 1));
+
+    // one module changing between dumps
+    t0 = now();
+    for (int i = 1; i < DUMPS; i++) {
+        set_stamp(&bench_images[MODULES / 2], 100 + i);
+        read_apis(&cached, &process);
+    }
+    t1 = now();
+    printf("with one module changing each dump: %.2f ms per dump\n", (t1 - t0) * 1e3 / (DUMPS - 1));
+
+    reader_free(&cached);
+    reader_free(&uncached);
+    for (int m = 0; m < MODULES; m++)
+        free(bench_images[m].data);
+}
+
+int main(int argc, char **argv)
+{
+    int bench_mode = argc > 1 && !strcmp(argv[1], "bench");
+
+    test_scenarios();
+    test_threads();
+    if (argc > (bench_mode ? 2 : 1))
+        test_files(argc - (bench_mode ? 2 : 1), argv + (bench_mode ? 2 : 1));
+    CHECK(freed == created, "%u of %u export lists freed", freed, created);
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (bench_mode)
+        bench();
+
+    for (int i = 0; i < IMAGES; i++)
+        free(images[i].data);
+
+    return failures != 0;
+}
@@ -0,0 +1,577 @@
+// Tests for the export index behind GetExportAddress, ScanForExport and
+// ScyllaGetExportNameByScan: lookups by name, ordinal and address over
+// generated PE32 and PE32+ images in both file and mapped layouts, with
+// aliases, exports by ordinal only, forwarders and unused ordinals, checked
+// against a linear walk of the export directory; malformed directories; and
+// the shared per-module indexes. Portable harness, build on Linux with:
+//   gcc -O2 -Wall -pthread -I../CAPE -o export-index export-index.c ../CAPE/ExportIndex.c
+// DLLs given on the command line, such as copies of kernel32.dll or
+// ntdll.dll, are checked export by export as raw files.
+// Run "./export-index bench" for 1k name and 100k address lookups.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ExportIndex.h"
+
+#define FILE_ALIGN 0x200
+#define TEXT_RVA 0x1000
+#define EDATA_RVA 0x100000
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static void put16(uint8_t *p, uint16_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+static void put32(uint8_t *p, uint32_t v) { put16(p, (uint16_t)v); put16(p + 2, (uint16_t)(v >> 16)); }
+static uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] | p[1] << 8); }
+static uint32_t get32(const uint8_t *p) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+
+// What each generated function is
+typedef struct {
+    uint32_t rva;           // 0 for unused ordinals
+    char forwarder[48];     // empty unless forwarded
+} function_t;
+
+typedef struct {
+    int pe64;
+    uint32_t ordinal_base;
+    uint32_t functions;
+    function_t function[4096];
+    uint32_t names;
+    char name[8192][40];
+    uint16_t name_ordinal[8192];    // function index of each name
+} exports_t;
+
+typedef struct {
+    uint8_t *file, *mapped;
+    size_t file_size, mapped_size;
+} image_t;
+
+static exports_t ex;
+
+// Generates exports: functions at increasing addresses, some sharing an
+// address, some unused, some forwarded, most named once, some twice
+static void generate(uint32_t functions, int pe64, uint32_t ordinal_base)
+{
+    uint32_t rva = TEXT_RVA;
+
+    memset(&ex, 0, sizeof(ex));
+    ex.pe64 = pe64;
+    ex.ordinal_base = ordinal_base;
+    ex.functions = functions;
+
+    for (uint32_t i = 0; i < functions; i++) {
+        unsigned int kind = next_random() % 20;
+        function_t *f = &ex.function[i];
+
+        if (kind == 0)
+            continue;                                   // unused ordinal
+        if (kind == 1) {
+            if (next_random() % 2)
+                snprintf(f->forwarder, sizeof(f->forwarder), "NTDLL.Rtl%uForwarded", i);
+            else
+                snprintf(f->forwarder, sizeof(f->forwarder), "api-ms-win-core-test-l1-1-0.#%u", i);
+            continue;                                   // rva set when laid out
+        }
+        if (kind == 2 && i && ex.function[i - 1].rva) {
+            f->rva = ex.function[i - 1].rva;            // alias of the previous one
+            continue;
+        }
+        rva += 0x10 + (uint32_t)(next_random() % 0x200);
+        f->rva = rva;
+    }
+
+    for (uint32_t i = 0; i < functions; i++) {
+        unsigned int kind = next_random() % 10;
+
+        if (!ex.function[i].rva && !ex.function[i].forwarder[0])
+            continue;
+        if (kind == 0)
+            continue;                                   // by ordinal only
+        snprintf(ex.name[ex.names], sizeof(ex.name[0]), "Function%u", i);
+        ex.name_ordinal[ex.names++] = (uint16_t)i;
+        if (kind == 1) {
+            snprintf(ex.name[ex.names], sizeof(ex.name[0]), "Function%uAlias", i);
+            ex.name_ordinal[ex.names++] = (uint16_t)i;
+        }
+    }
+}
+
+// Lays out headers, a code section and an export section, as a file and as mapped
+static void build(image_t *image)
+{
+    uint32_t text_size = TEXT_RVA;
+    uint32_t dir = EDATA_RVA, functions_rva, names_rva, ordinals_rva, strings_rva;
+    uint32_t edata_size, edata_raw, text_raw = 0x400;
+    uint8_t *e, *h;
+    uint32_t opt_size = ex.pe64 ? 0xf0 : 0xe0;
+
+    for (uint32_t i = 0; i < ex.functions; i++)
+        if (ex.function[i].rva >= text_size)
+            text_size = ex.function[i].rva + 0x200;
+    text_size -= TEXT_RVA;
+
+    functions_rva = dir + 40;
+    names_rva = functions_rva + ex.functions * 4;
+    ordinals_rva = names_rva + ex.names * 4;
+    strings_rva = ordinals_rva + ex.names * 2;
+    edata_size = strings_rva - dir + 16 + ex.names * 40 + ex.functions * 48;
+    edata_raw = (text_raw + text_size + FILE_ALIGN - 1) & ~(FILE_ALIGN - 1);
+
+    image->file_size = edata_raw + ((edata_size + FILE_ALIGN - 1) & ~(FILE_ALIGN - 1));
+    image->file = calloc(1, image->file_size);
+    e = image->file + edata_raw;
+
+    // export directory, with strings as they go
+    {
+        uint32_t at = strings_rva;
+        strcpy((char *)e + (at - dir), "test.dll");
+        put32(e + 12, at);
+        at += 16;
+        put32(e + 16, ex.ordinal_base);
+        put32(e + 20, ex.functions);
+        put32(e + 24, ex.names);
+        put32(e + 28, functions_rva);
+        put32(e + 32, names_rva);
+        put32(e + 36, ordinals_rva);
+        for (uint32_t i = 0; i < ex.functions; i++) {
+            if (ex.function[i].forwarder[0]) {
+                strcpy((char *)e + (at - dir), ex.function[i].forwarder);
+                ex.function[i].rva = at;
+                at += (uint32_t)strlen(ex.function[i].forwarder) + 1;
+            }
+            put32(e + (functions_rva - dir) + i * 4, ex.function[i].rva);
+        }
+        for (uint32_t i = 0; i < ex.names; i++) {
+            strcpy((char *)e + (at - dir), ex.name[i]);
+            put32(e + (names_rva - dir) + i * 4, at);
+            put16(e + (ordinals_rva - dir) + i * 2, ex.name_ordinal[i]);
+            at += (uint32_t)strlen(ex.name[i]) + 1;
+        }
+        edata_size = at - dir;
+    }
+
+    // headers
+    h = image->file;
+    put16(h, 0x5a4d);
+    put32(h + 0x3c, 0x80);
+    put32(h + 0x80, 0x4550);
+    put16(h + 0x84, ex.pe64 ? 0x8664 : 0x14c);
+    put16(h + 0x86, 2);
+    put32(h + 0x88, 0x5f000000);
+    put16(h + 0x94, (uint16_t)opt_size);
+    {
+        uint8_t *opt = h + 0x98, *dirs = opt + (ex.pe64 ? 112 : 96), *sec = opt + opt_size;
+        put16(opt, ex.pe64 ? 0x20b : 0x10b);
+        put32(opt + 56, EDATA_RVA + ((edata_size + 0xfff) & ~0xfffu));
+        put32(opt + 60, 0x400);
+        put32(opt + (ex.pe64 ? 108 : 92), 16);
+        put32(dirs, dir);
+        put32(dirs + 4, edata_size);
+        memcpy(sec, ".text", 5);
+        put32(sec + 8, text_size);
+        put32(sec + 12, TEXT_RVA);
+        put32(sec + 16, edata_raw - text_raw);
+        put32(sec + 20, text_raw);
+        memcpy(sec + 40, ".edata", 6);
+        put32(sec + 48, edata_size);
+        put32(sec + 52, EDATA_RVA);
+        put32(sec + 56, (uint32_t)(image->file_size - edata_raw));
+        put32(sec + 60, edata_raw);
+    }
+
+    image->mapped_size = get32(h + 0x98 + 56);
+    image->mapped = calloc(1, image->mapped_size);
+    memcpy(image->mapped, image->file, 0x400);
+    memcpy(image->mapped + EDATA_RVA, e, edata_size);
+}
+
+static void release(image_t *image)
+{
+    free(image->file);
+    free(image->mapped);
+}
+
+// The old linear walks: the first name that matches, and the closest named
+// or unnamed code export at or below an address
+static int linear_name(const char *name, uint32_t *function)
+{
+    for (uint32_t i = 0; i < ex.names; i++) {
+        if (!strcmp(ex.name[i], name)) {
+            *function = ex.name_ordinal[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int linear_rva(uint32_t rva, uint32_t scan_max, uint32_t *found)
+{
+    int best = -1;
+
+    for (uint32_t i = 0; i < ex.functions; i++) {
+        const function_t *f = &ex.function[i];
+        if (!f->rva || f->forwarder[0] || f->rva > rva || rva - f->rva > scan_max)
+            continue;
+        if (best < 0 || f->rva > ex.function[best].rva)
+            best = (int)i;
+    }
+    if (best < 0)
+        return 0;
+    *found = ex.function[best].rva;
+    return 1;
+}
+
+// The name a function is known by: its first
+static const char *first_name(uint32_t function)
+{
+    for (uint32_t i = 0; i < ex.names; i++)
+        if (ex.name_ordinal[i] == function)
+            return ex.name[i];
+    return NULL;
+}
+
+static void check_index(PEXPORTINDEX index, const char *layout)
+{
+    EXPORTINFO info;
+    size_t used = 0;
+
+    for (uint32_t i = 0; i < ex.functions; i++)
+        used += ex.function[i].rva != 0;
+    CHECK(ExportIndexCount(index) == used, "%s: %zu exports, expected %zu", layout, ExportIndexCount(index), used);
+
+    for (uint32_t i = 0; i < ex.names; i++) {
+        uint32_t function = 0;
+        const function_t *f;
+
+        linear_name(ex.name[i], &function);
+        f = &ex.function[function];
+        CHECK(ExportIndexLookupName(index, ex.name[i], &info), "%s: %s not found", layout, ex.name[i]);
+        CHECK(info.Rva == f->rva && info.Ordinal == ex.ordinal_base + function && !strcmp(info.Name, ex.name[i]),
+            "%s: %s at 0x%x ordinal %u, expected 0x%x ordinal %u", layout, ex.name[i], info.Rva, info.Ordinal, f->rva, ex.ordinal_base + function);
+        CHECK(f->forwarder[0] ? info.Forwarder && !strcmp(info.Forwarder, f->forwarder) : !info.Forwarder,
+            "%s: %s forwarder %s", layout, ex.name[i], info.Forwarder ? info.Forwarder : "(none)");
+    }
+    CHECK(!ExportIndexLookupName(index, "Function", &info), "%s: prefix found", layout);
+    CHECK(!ExportIndexLookupName(index, "function1", &info), "%s: wrong case found", layout);
+    CHECK(!ExportIndexLookupName(index, "", &info), "%s: empty name found", layout);
+
+    for (uint32_t i = 0; i < ex.functions + 2; i++) {
+        const function_t *f = i < ex.functions ? &ex.function[i] : NULL;
+        int found = ExportIndexLookupOrdinal(index, ex.ordinal_base + i, &info);
+        if (!f || !f->rva) {
+            CHECK(!found, "%s: unused ordinal %u found", layout, ex.ordinal_base + i);
+            continue;
+        }
+        CHECK(found && info.Rva == f->rva, "%s: ordinal %u", layout, ex.ordinal_base + i);
+        CHECK(first_name(i) ? info.Name && !strcmp(info.Name, first_name(i)) : !info.Name, "%s: ordinal %u named %s", layout, ex.ordinal_base + i, info.Name ? info.Name : "(none)");
+    }
+    if (ex.ordinal_base)
+        CHECK(!ExportIndexLookupOrdinal(index, ex.ordinal_base - 1, &info), "%s: ordinal below base found", layout);
+
+    for (int probe = 0; probe < 20000; probe++) {
+        uint32_t rva = (uint32_t)(next_random() % (EDATA_RVA + 0x1000)), scan_max, expected = 0;
+        int found, expect_found;
+
+        if (probe % 4 == 0 && ex.functions) {
+            const function_t *f = &ex.function[next_random() % ex.functions];
+            rva = f->rva + (uint32_t)(next_random() % 3);
+        }
+        scan_max = probe % 3 == 0 ? 0 : (uint32_t)(next_random() % 0x100);
+        expect_found = linear_rva(rva, scan_max, &expected);
+        found = ExportIndexLookupRva(index, rva, scan_max, &info);
+        CHECK(found == expect_found && (!found || info.Rva == expected), "%s: 0x%x within 0x%x: %d 0x%x, expected %d 0x%x",
+            layout, rva, scan_max, found, info.Rva, expect_found, expected);
+        if (found && !info.Forwarder) {
+            // named aliases are preferred, by lowest ordinal
+            const char *name = NULL;
+            for (uint32_t i = 0; i < ex.functions && !name; i++)
+                if (ex.function[i].rva == info.Rva && !ex.function[i].forwarder[0])
+                    name = first_name(i);
+            CHECK(name ? info.Name && !strcmp(info.Name, name) : !info.Name, "%s: 0x%x named %s, expected %s", layout, rva, info.Name ? info.Name : "(none)", name ? name : "(none)");
+        }
+        CHECK(!found || !info.Forwarder, "%s: forwarder found by address", layout);
+        if (failures > 20)
+            break;
+    }
+}
+
+static void test_generated(void)
+{
+    static const uint32_t counts[] = { 0, 1, 2, 17, 300, 1600, 4096 };
+
+    for (unsigned int c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        for (int pe64 = 0; pe64 < 2; pe64++) {
+            image_t image;
+            PEXPORTINDEX index;
+
+            generate(counts[c], pe64, c % 2 ? 1 : 100);
+            build(&image);
+
+            index = ExportIndexBuild(image.file, image.file_size, 0);
+            CHECK(index != NULL, "file layout not indexed");
+            if (index)
+                check_index(index, pe64 ? "pe32+ file" : "pe32 file");
+            ExportIndexFree(index);
+
+            index = ExportIndexBuild(image.mapped, image.mapped_size, 1);
+            CHECK(index != NULL, "mapped layout not indexed");
+            if (index)
+                check_index(index, pe64 ? "pe32+ mapped" : "pe32 mapped");
+            ExportIndexFree(index);
+
+            release(&image);
+        }
+    }
+}
+
+static void test_malformed(void)
+{
+    image_t image;
+    PEXPORTINDEX index;
+    EXPORTINFO info;
+    uint8_t *dir;
+
+    generate(50, 0, 1);
+    build(&image);
+
+    CHECK(!ExportIndexBuild(image.mapped, 0x40, 1), "truncated headers accepted");
+    image.mapped[0] = 'X';
+    CHECK(!ExportIndexBuild(image.mapped, image.mapped_size, 1), "bad DOS signature accepted");
+    image.mapped[0] = 'M';
+    put32(image.mapped + 0x3c, (uint32_t)image.mapped_size);
+    CHECK(!ExportIndexBuild(image.mapped, image.mapped_size, 1), "e_lfanew beyond image accepted");
+    put32(image.mapped + 0x3c, 0x80);
+
+    // function and name tables running off the end of the image
+    dir = image.mapped + EDATA_RVA;
+    put32(dir + 20, 0x7fffffff);
+    put32(dir + 24, 0x7fffffff);
+    index = ExportIndexBuild(image.mapped, image.mapped_size, 1);
+    CHECK(index && ExportIndexCount(index) == 0 && !ExportIndexLookupName(index, "Function1", &info), "oversized tables used");
+    ExportIndexFree(index);
+
+    // names and ordinals out of range are ignored, the rest still index
+    put32(dir + 20, ex.functions);
+    put32(dir + 24, ex.names);
+    put32(image.mapped + get32(dir + 32), 0xfffffff0);
+    put16(image.mapped + get32(dir + 36) + 2, 0xffff);
+    index = ExportIndexBuild(image.mapped, image.mapped_size, 1);
+    CHECK(index && !ExportIndexLookupName(index, ex.name[1], &info), "name with bad ordinal found");
+    CHECK(index && ExportIndexLookupName(index, ex.name[2], &info), "good name lost");
+    ExportIndexFree(index);
+
+    // an unterminated string at the very end of the image
+    put32(image.mapped + get32(dir + 32) + 8, (uint32_t)image.mapped_size - 4);
+    memset(image.mapped + image.mapped_size - 4, 'A', 4);
+    index = ExportIndexBuild(image.mapped, image.mapped_size, 1);
+    CHECK(index && !ExportIndexLookupName(index, "AAAA", &info), "unterminated name found");
+    ExportIndexFree(index);
+
+    // no export directory
+    put32(image.mapped + 0x98 + 96, 0);
+    index = ExportIndexBuild(image.mapped, image.mapped_size, 1);
+    CHECK(index && ExportIndexCount(index) == 0 && !ExportIndexLookupRva(index, TEXT_RVA + 0x100, 0x1000, &info), "exports without a directory");
+    ExportIndexFree(index);
+
+    release(&image);
+}
+
+static void test_shared(void)
+{
+    image_t image, other;
+    PEXPORTINDEX first, second, third;
+    EXPORTINFO info;
+
+    generate(300, 1, 1);
+    build(&image);
+    build(&other);
+    put32(other.mapped + 0x88, 0x60000000);     // a different timestamp
+
+    CHECK(!ExportIndexAcquire(0), "null base");
+    first = ExportIndexAcquire((uintptr_t)image.mapped);
+    second = ExportIndexAcquire((uintptr_t)image.mapped);
+    CHECK(first && first == second, "index not shared");
+    CHECK(ExportIndexLookupName(second, ex.name[0], &info), "shared lookup");
+    ExportIndexRelease(second);
+
+    // dropped while still in use, then rebuilt on next use
+    ExportIndexDrop((uintptr_t)image.mapped);
+    CHECK(ExportIndexLookupName(first, ex.name[0], &info), "dropped index freed while in use");
+    second = ExportIndexAcquire((uintptr_t)image.mapped);
+    CHECK(second && second != first, "dropped index reused");
+    ExportIndexRelease(first);
+
+    // a different image at the same address replaces it
+    memcpy(image.mapped, other.mapped, 0x400);
+    third = ExportIndexAcquire((uintptr_t)image.mapped);
+    CHECK(third && third != second, "stale index reused");
+    ExportIndexRelease(second);
+    ExportIndexRelease(third);
+    ExportIndexDrop((uintptr_t)image.mapped);
+    ExportIndexDrop((uintptr_t)image.mapped);
+
+    // not an image
+    CHECK(!ExportIndexAcquire((uintptr_t)image.mapped + 0x1000), "non-image indexed");
+
+    release(&image);
+    release(&other);
+}
+
+// Checks a real DLL against a walk of its own export directory
+static void test_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t *data;
+    long size;
+    PEXPORTINDEX index;
+    EXPORTINFO info;
+    unsigned int checked = 0;
+
+    if (!f) {
+        CHECK(0, "%s: cannot open", path);
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(size);
+    if (fread(data, 1, size, f) != (size_t)size)
+        size = 0;
+    fclose(f);
+
+    index = ExportIndexBuild(data, size, 0);
+    CHECK(index != NULL, "%s: not a PE file", path);
+    if (index) {
+        // every named export resolves to the function its ordinal names,
+        // and is found by its own address
+        for (uint32_t ordinal = 0; ordinal < 0x10000; ordinal++) {
+            if (!ExportIndexLookupOrdinal(index, ordinal, &info))
+                continue;
+            if (info.Name) {
+                EXPORTINFO by_name, by_rva;
+                CHECK(ExportIndexLookupName(index, info.Name, &by_name) && by_name.Rva == info.Rva, "%s: %s by name", path, info.Name);
+                if (!info.Forwarder)
+                    CHECK(ExportIndexLookupRva(index, info.Rva, 0, &by_rva) && by_rva.Rva == info.Rva && by_rva.Name, "%s: %s by address", path, info.Name);
+            }
+            checked++;
+        }
+        printf("%s: %u exports checked\n", path, checked);
+    }
+    ExportIndexFree(index);
+    free(data);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The old GetExportAddress loop and ScanForExport loop over a mapped image
+static uint32_t old_export_address(const uint8_t *base, const char *name)
+{
+    const uint8_t *dir = base + EDATA_RVA;
+    uint32_t names = get32(dir + 24), found = 0;
+    const uint8_t *name_rva = base + get32(dir + 32);
+
+    for (uint32_t i = 0; i < names; i++)
+        if (!strcmp((const char *)base + get32(name_rva + i * 4), name))
+            found = get32(base + get32(dir + 28) + get16(base + get32(dir + 36) + i * 2) * 4);
+    return found;
+}
+
+static const char *old_scan_for_export(const uint8_t *base, uint32_t rva, uint32_t scan_max)
+{
+    const uint8_t *dir = base + EDATA_RVA;
+    uint32_t names = get32(dir + 24);
+
+    for (uint32_t j = 0; j < names; j++) {
+        uint32_t function = get32(base + get32(dir + 28) + get16(base + get32(dir + 36) + j * 2) * 4);
+        if (rva >= function && rva - function <= scan_max)
+            return (const char *)base + get32(base + get32(dir + 32) + j * 4);
+    }
+    return NULL;
+}
+
+static void bench(void)
+{
+    enum { NAMES = 1000, ADDRESSES = 100000 };
+    image_t image;
+    PEXPORTINDEX index;
+    uint32_t *rvas = malloc(ADDRESSES * sizeof(uint32_t));
+    const char **names = malloc(NAMES * sizeof(char *));
+    size_t old_sum = 0, new_sum = 0;
+    double t0, t1, t2, t3;
+
+    // about the size of kernel32
+    generate(1600, 1, 1);
+    build(&image);
+    for (int i = 0; i < NAMES; i++)
+        names[i] = ex.name[next_random() % ex.names];
+    for (int i = 0; i < ADDRESSES; i++)
+        rvas[i] = TEXT_RVA + (uint32_t)(next_random() % (ex.function[ex.functions - 1].rva + 0x100 - TEXT_RVA));
+
+    t0 = now();
+    index = ExportIndexBuild(image.mapped, image.mapped_size, 1);
+    t1 = now();
+    printf("index of %zu exports built in %.1f us\n", ExportIndexCount(index), (t1 - t0) * 1e6);
+
+    t0 = now();
+    for (int i = 0; i < NAMES; i++)
+        old_sum += old_export_address(image.mapped, names[i]);
+    t1 = now();
+    for (int i = 0; i < NAMES; i++) {
+        EXPORTINFO info;
+        if (ExportIndexLookupName(index, names[i], &info))
+            new_sum += info.Rva;
+    }
+    t2 = now();
+    printf("%d name lookups: linear %.2f ms, index %.3f ms%s\n", NAMES, (t1 - t0) * 1e3, (t2 - t1) * 1e3, old_sum == new_sum ? "" : " (MISMATCH)");
+
+    old_sum = new_sum = 0;
+    t1 = now();
+    for (int i = 0; i < ADDRESSES; i++)
+        old_sum += old_scan_for_export(image.mapped, rvas[i], 0x40) != NULL;
+    t2 = now();
+    for (int i = 0; i < ADDRESSES; i++) {
+        EXPORTINFO info;
+        new_sum += ExportIndexLookupRva(index, rvas[i], 0x40, &info) && info.Name;
+    }
+    t3 = now();
+    printf("%d address lookups: linear %.1f ms, index %.2f ms (%zu and %zu found)\n", ADDRESSES, (t2 - t1) * 1e3, (t3 - t2) * 1e3, old_sum, new_sum);
+
+    ExportIndexFree(index);
+    release(&image);
+    free(rvas);
+    free(names);
+}
+
+int main(int argc, char **argv)
+{
+    int bench_mode = argc > 1 && !strcmp(argv[1], "bench");
+
+    test_generated();
+    test_malformed();
+    test_shared();
+    for (int i = bench_mode ? 2 : 1; i < argc; i++)
+        test_file(argv[i]);
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (bench_mode)
+        bench();
+
+    return failures != 0;
+}
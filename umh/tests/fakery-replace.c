@@ -0,0 +1,346 @@
+// Tests for the multi-pattern replacement behind the registry and device
+// fakery: the automaton's output, narrow and UTF-16, compared with applying
+// the patterns one at a time as replace_string_in_buf and its case-insensitive
+// and wide variants do, including patterns that match text written by earlier
+// ones, patterns that lose their match to them, and buffers with more matches
+// than the single pass tracks. Portable harness, build on Linux with:
+//   gcc -O2 -Wall -I../CAPE -o fakery-replace fakery-replace.c ../CAPE/MultiReplace.c
+// Run "./fakery-replace bench" for timings over REG_MULTI_SZ and SMBIOS-sized buffers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "MultiReplace.h"
+
+#define MAX_PATTERNS 12
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// The pattern sets in misc.c
+static const MULTIREPLACEPATTERN disk[] = {
+    { "QEMU", "DELL" }, { "VMware", "DELL__" }, { "Virtual", "C300_BD" }, { "VBOX", "DELL" },
+};
+static const MULTIREPLACEPATTERN wmi[] = {
+    { "Xen", "VIA" }, { "QEMU", "DELL" }, { "VBOX", "DELL" }, { "vbox", "dell" }, { "VMware", "DELL  " },
+    { "Red Hat", "Lenovo " }, { "Virtual", "Compute" }, { "innotek GmbH", "ASUS Systems" }, { "MS_VM_CERT/SHA1", "Dell System\t" },
+};
+static const MULTIREPLACEPATTERN smbios[] = {
+    { "vbox", "DELL" }, { "VirtualBox", "Gigabyte__" }, { "innotek GmbH", "HP Pavillion" },
+};
+static const MULTIREPLACEPATTERN enum_ide[] = {
+    { "VMware", "Lenovo" }, { "VMWar", "Lenov" }, { "VBOX", "DELL" },
+};
+static const MULTIREPLACEPATTERN setupdi[] = {
+    { "VBOX", "DELL_", MULTI_REPLACE_NOCASE }, { "QEMU", "DELL", MULTI_REPLACE_NOCASE }, { "VMWARE", "DELL__", MULTI_REPLACE_NOCASE },
+};
+
+static int fold(int c)
+{
+    return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+// replace_string_in_buf and replace_ci_string_in_buf
+static void replace_string(char *buf, size_t len, const char *find, const char *rep, int nocase)
+{
+    size_t findlen = strlen(find), i, j;
+
+    if (findlen != strlen(rep) || !findlen || len < findlen)
+        return;
+
+    for (i = 0; i <= len - findlen; i++) {
+        for (j = 0; j < findlen; j++)
+            if (nocase ? fold((unsigned char)buf[i + j]) != fold((unsigned char)find[j]) : buf[i + j] != find[j])
+                break;
+        if (j == findlen) {
+            memcpy(&buf[i], rep, findlen);
+            i += findlen - 1;
+        }
+    }
+}
+
+// replace_wstring_in_buf and replace_ci_wstring_in_buf
+static void replace_wstring(uint16_t *buf, size_t len, const char *find, const char *rep, int nocase)
+{
+    size_t findlen = strlen(find), i, j;
+
+    if (findlen != strlen(rep) || !findlen || len < findlen)
+        return;
+
+    for (i = 0; i <= len - findlen; i++) {
+        for (j = 0; j < findlen; j++)
+            if (nocase ? fold(buf[i + j]) != fold((unsigned char)find[j]) : buf[i + j] != (unsigned char)find[j])
+                break;
+        if (j == findlen) {
+            for (j = 0; j < findlen; j++)
+                buf[i + j] = (unsigned char)rep[j];
+            i += findlen - 1;
+        }
+    }
+}
+
+static void sequential(const MULTIREPLACEPATTERN *patterns, unsigned int count, char *buf, size_t len)
+{
+    for (unsigned int k = 0; k < count; k++)
+        replace_string(buf, len, patterns[k].Find, patterns[k].Replace, patterns[k].Flags & MULTI_REPLACE_NOCASE);
+}
+
+static void sequential_wide(const MULTIREPLACEPATTERN *patterns, unsigned int count, uint16_t *buf, size_t len)
+{
+    for (unsigned int k = 0; k < count; k++)
+        replace_wstring(buf, len, patterns[k].Find, patterns[k].Replace, patterns[k].Flags & MULTI_REPLACE_NOCASE);
+}
+
+// Compares both widths for one buffer, returning 0 on a difference
+static int compare(const MULTIREPLACEPATTERN *patterns, unsigned int count, PMULTIREPLACE replace, const char *text, size_t len)
+{
+    char *a = malloc(len + 1), *b = malloc(len + 1);
+    uint16_t *wa = malloc((len + 1) * 2), *wb = malloc((len + 1) * 2);
+    int same;
+
+    memcpy(a, text, len);
+    memcpy(b, text, len);
+    for (size_t i = 0; i < len; i++)
+        wa[i] = wb[i] = (unsigned char)text[i];
+    sequential(patterns, count, a, len);
+    MultiReplaceBuffer(replace, b, len);
+    sequential_wide(patterns, count, wa, len);
+    MultiReplaceBufferWide(replace, wb, len);
+    same = !memcmp(a, b, len) && !memcmp(wa, wb, len * 2);
+    if (!same) {
+        printf("  text   \"%.*s\"\n  expect \"%.*s\"\n  got    \"%.*s\"\n", (int)len, text, (int)len, a, (int)len, b);
+        for (unsigned int k = 0; k < count; k++)
+            printf("  [%u] \"%s\" -> \"%s\" %u\n", k, patterns[k].Find, patterns[k].Replace, patterns[k].Flags);
+    }
+    free(a);
+    free(b);
+    free(wa);
+    free(wb);
+    return same;
+}
+
+static void test_fixed(void)
+{
+    static const MULTIREPLACEPATTERN chained[] = { { "ab", "xy" }, { "yc", "zz" } };
+    static const MULTIREPLACEPATTERN destroyed[] = { { "ab", "xy" }, { "bc", "qq" } };
+    static const MULTIREPLACEPATTERN repeat[] = { { "aa", "ab" } };
+    static const MULTIREPLACEPATTERN ignored[] = { { "VBOX", "DELL_" }, { "QEMU", "DELL" } };
+    static const struct {
+        const MULTIREPLACEPATTERN *patterns;
+        unsigned int count;
+        const char *text, *expect;
+    } cases[] = {
+        { chained, 2, "abc", "xzz" },
+        { destroyed, 2, "abc", "xyc" },
+        { repeat, 1, "aaaaa", "ababa" },
+        { ignored, 2, "VBOX QEMU", "VBOX DELL" },
+        { enum_ide, 3, "VMware VMWare vmware VBOX", "Lenovo Lenove vmware DELL" },
+        { wmi, 9, "Xen VBOX vbox Vbox VMware Red Hat VirtualBox innotek GmbH MS_VM_CERT/SHA1", "VIA DELL dell Vbox DELL   Lenovo  ComputeBox ASUS Systems MS_VM_CERT/SHA1" },
+        { smbios, 3, "VirtualBox innotek GmbH vboxVirtualBox", "Gigabyte__ HP Pavillion DELLGigabyte__" },
+        { setupdi, 3, "vBoX_qemu vmWARE", "vBoX_DELL DELL__" },
+    };
+    char buf[128];
+    uint16_t wide[128];
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        PMULTIREPLACE replace = MultiReplaceCompile(cases[c].patterns, cases[c].count);
+        size_t len = strlen(cases[c].text);
+
+        CHECK(replace != NULL, "compile %zu", c);
+        strcpy(buf, cases[c].text);
+        MultiReplaceBuffer(replace, buf, len);
+        CHECK(!strcmp(buf, cases[c].expect), "case %zu: \"%s\"", c, buf);
+        for (size_t i = 0; i < len; i++)
+            wide[i] = (unsigned char)cases[c].text[i];
+        MultiReplaceBufferWide(replace, wide, len);
+        for (size_t i = 0; i < len; i++)
+            buf[i] = (char)wide[i];
+        CHECK(!strcmp(buf, cases[c].expect), "wide case %zu: \"%s\"", c, buf);
+        CHECK(compare(cases[c].patterns, cases[c].count, replace, cases[c].text, len), "case %zu vs sequential", c);
+        MultiReplaceFree(replace);
+    }
+
+    // Units above 0xff never match, even where their low byte would
+    {
+        PMULTIREPLACE replace = MultiReplaceCompile(disk, 4);
+        uint16_t text[] = { 'Q', 'E', 'M', 'U', 0x151, 'E', 'M', 'U', 'Q', 'E', 'M', 'U' };
+        CHECK(MultiReplaceBufferWide(replace, text, 12) == 2 && text[0] == 'D' && text[4] == 0x151 && text[8] == 'D', "wide units");
+        CHECK(MultiReplaceBuffer(replace, buf, 0) == 0 && MultiReplaceBuffer(NULL, buf, 4) == 0, "empty");
+        MultiReplaceFree(replace);
+    }
+}
+
+// Small alphabets and patterns written from the same letters, so that
+// replacements often create and break matches of later patterns
+static void test_random(void)
+{
+    static const char alphabet[] = "abAB_";
+    MULTIREPLACEPATTERN patterns[MAX_PATTERNS];
+    char finds[MAX_PATTERNS][8], reps[MAX_PATTERNS][8], text[256];
+
+    for (int round = 0; round < 20000; round++) {
+        unsigned int count = 1 + next_random() % MAX_PATTERNS;
+        size_t len = next_random() % sizeof(text);
+        PMULTIREPLACE replace;
+
+        for (unsigned int k = 0; k < count; k++) {
+            size_t findlen = 1 + next_random() % 5, replen = findlen;
+            if (next_random() % 16 == 0)
+                replen = 1 + next_random() % 5;
+            for (size_t i = 0; i < findlen; i++)
+                finds[k][i] = alphabet[next_random() % 4];
+            for (size_t i = 0; i < replen; i++)
+                reps[k][i] = alphabet[next_random() % 5];
+            finds[k][findlen] = reps[k][replen] = '\0';
+            patterns[k].Find = finds[k];
+            patterns[k].Replace = reps[k];
+            patterns[k].Flags = next_random() % 3 == 0 ? MULTI_REPLACE_NOCASE : 0;
+        }
+        for (size_t i = 0; i < len; i++)
+            text[i] = alphabet[next_random() % 5];
+
+        replace = MultiReplaceCompile(patterns, count);
+        CHECK(replace != NULL, "compile");
+        if (!compare(patterns, count, replace, text, len)) {
+            CHECK(0, "round %d", round);
+            MultiReplaceFree(replace);
+            return;
+        }
+        MultiReplaceFree(replace);
+    }
+}
+
+// Text made of the fakery patterns, their fragments and case variants
+static void fill(char *text, size_t len, const MULTIREPLACEPATTERN *patterns, unsigned int count, int density)
+{
+    size_t i = 0;
+
+    while (i < len) {
+        if ((int)(next_random() % 100) < density) {
+            const char *find = patterns[next_random() % count].Find;
+            size_t n = strlen(find), from = 0;
+            if (next_random() % 2) {
+                from = next_random() % n;
+                n = from + next_random() % (n - from) + 1;
+            }
+            for (size_t j = from; j < n && i < len; j++)
+                text[i++] = next_random() % 8 ? find[j] : (char)(find[j] ^ 0x20);
+        } else
+            text[i++] = next_random() % 4 ? 'a' + next_random() % 26 : '\0';
+    }
+}
+
+static void test_fakery_sets(void)
+{
+    static const struct {
+        const MULTIREPLACEPATTERN *patterns;
+        unsigned int count;
+    } sets[] = { { disk, 4 }, { wmi, 9 }, { smbios, 3 }, { enum_ide, 3 }, { setupdi, 3 } };
+    static char text[4096];
+
+    for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); s++) {
+        PMULTIREPLACE replace = MultiReplaceCompile(sets[s].patterns, sets[s].count);
+        for (int round = 0; round < 400; round++) {
+            size_t len = next_random() % sizeof(text);
+            // Dense rounds overflow the single pass's match table
+            fill(text, len, sets[s].patterns, sets[s].count, round % 4 == 0 ? 90 : 5);
+            if (!compare(sets[s].patterns, sets[s].count, replace, text, len)) {
+                CHECK(0, "set %zu round %d", s, round);
+                break;
+            }
+        }
+        MultiReplaceFree(replace);
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A 64KB REG_MULTI_SZ of device instance paths with one VirtualBox disk, and
+// a 4KB SMBIOS table with a handful of vendor strings, as the WMI and SMBios
+// fakery see them
+static void bench(void)
+{
+    enum { ROUNDS = 2000, MULTI_SZ = 32768, SMBIOS = 4096 };
+    static uint16_t multi_sz[MULTI_SZ], work[MULTI_SZ];
+    static char table[SMBIOS], scratch[SMBIOS];
+    static const char *ids[] = { "PCI\\VEN_8086&DEV_2922&SUBSYS_11001AF4&REV_02\\3&267A616A&0&FA", "USB\\ROOT_HUB30\\4&1C3B2D1D&0", "ACPI\\PNP0A03\\0", "IDE\\DiskVBOX_HARDDISK___________________________1.0_____\\42562d3231303937" };
+    static const char *strings[] = { "innotek GmbH", "VirtualBox", "1.2", "Oracle Corporation", "To Be Filled By O.E.M.", "0", "Not Specified" };
+    PMULTIREPLACE replace = MultiReplaceCompile(wmi, 9), replace_smbios = MultiReplaceCompile(smbios, 3);
+    size_t i = 0, n = 0;
+    double t0, t1, t2, t3, t4;
+
+    while (i < MULTI_SZ - 200) {
+        const char *id = ids[n++ % 4];
+        if (n % 4 == 0 && n > 40)
+            id = ids[n % 3];
+        while (*id)
+            multi_sz[i++] = (unsigned char)*id++;
+        multi_sz[i++] = 0;
+    }
+    for (i = 0, n = 0; i < SMBIOS - 32; n++) {
+        if (n % 8 == 0) {
+            memset(table + i, (int)n, 24);
+            i += 24;
+        } else {
+            const char *string = strings[n < 16 ? n % 7 : 2 + n % 5];
+            strcpy(table + i, string);
+            i += strlen(string) + 1;
+        }
+    }
+
+    t0 = now();
+    for (int r = 0; r < ROUNDS; r++) {
+        memcpy(work, multi_sz, sizeof(work));
+        sequential_wide(wmi, 9, work, MULTI_SZ);
+    }
+    t1 = now();
+    for (int r = 0; r < ROUNDS; r++) {
+        memcpy(work, multi_sz, sizeof(work));
+        MultiReplaceBufferWide(replace, work, MULTI_SZ);
+    }
+    t2 = now();
+    for (int r = 0; r < ROUNDS * 8; r++) {
+        memcpy(scratch, table, sizeof(scratch));
+        sequential(smbios, 3, scratch, SMBIOS);
+    }
+    t3 = now();
+    for (int r = 0; r < ROUNDS * 8; r++) {
+        memcpy(scratch, table, sizeof(scratch));
+        MultiReplaceBuffer(replace_smbios, scratch, SMBIOS);
+    }
+    t4 = now();
+
+    printf("64KB REG_MULTI_SZ, 9 patterns: sequential %.1f us, automaton %.1f us\n", (t1 - t0) / ROUNDS * 1e6, (t2 - t1) / ROUNDS * 1e6);
+    printf("4KB SMBIOS, 3 patterns: sequential %.2f us, automaton %.2f us\n", (t3 - t2) / (ROUNDS * 8) * 1e6, (t4 - t3) / (ROUNDS * 8) * 1e6);
+    MultiReplaceFree(replace);
+    MultiReplaceFree(replace_smbios);
+}
+
+int main(int argc, char **argv)
+{
+    test_fixed();
+    test_random();
+    test_fakery_sets();
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        bench();
+
+    return failures != 0;
+}
@@ -0,0 +1,654 @@
+// Tests for Scylla's IATReferenceScan direct import collection: the
+// references found in code decomposed with distorm, the IAT entry each one
+// is given by the hash-indexed lookUpIatForPointer, the unique and missing
+// api counts and the grouping used for the jump table and the apis added
+// to the IAT, all checked against the linear IAT search and the std::set
+// passes they replace. Portable harness, build on Linux with:
+//   gcc -O2 -Wall -I../CAPE -I../distorm/include -o iat-reference-scan iat-reference-scan.c ../CAPE/PtrMap.c ../CAPE/ApiIndex.c ../distorm/src/*.c
+// DLLs given on the command line, such as a copy of kernel32.dll, have their
+// executable sections scanned too, with a synthetic IAT made of addresses
+// their code refers to outside the image.
+// Run "./iat-reference-scan bench" for scans of 4MB of code with a large IAT.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <distorm.h>
+#include <mnemonics.h>
+#include "PtrMap.h"
+#include "ApiIndex.h"
+
+#define MAX_INSTRUCTIONS 200
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+enum { DIRECT_JMP, DIRECT_CALL, DIRECT_MOV, DIRECT_PUSH, DIRECT_LEA };
+
+// IATReference
+typedef struct {
+    uintptr_t address_va;
+    uintptr_t target_pointer;
+    uintptr_t target_address_in_iat;
+    uint8_t instruction_size;
+    int type;
+} reference_t;
+
+typedef struct {
+    int is64;
+    uintptr_t image_base;
+    uint32_t image_size;
+    uintptr_t iat_va;
+    uint32_t iat_size;
+    const uintptr_t *iat;           // the process's IAT, as readMemoryFromProcess returns it
+    PAPIINDEX apis;                 // getApiByVirtualAddress, NULL for any address
+    int indexed;                    // hash-indexed lookUpIatForPointer, or the linear search
+    PTRMAP iat_pointers;
+    int iat_read;
+    reference_t *refs;
+    size_t count, capacity;
+} scan_t;
+
+static uintptr_t look_up_iat_for_pointer(scan_t *scan, uintptr_t addr)
+{
+    size_t slots = scan->iat_size / sizeof(uintptr_t);
+
+    if (!scan->indexed) {
+        for (size_t i = 0; i < slots; i++)
+            if (scan->iat[i] == addr)
+                return scan->iat_va + i * sizeof(uintptr_t);
+        return 0;
+    }
+    if (!scan->iat_read) {
+        scan->iat_read = 1;
+        for (size_t i = 0; i < slots; i++)
+            if (scan->iat[i] && !PtrMapGet(&scan->iat_pointers, scan->iat[i]))
+                PtrMapSet(&scan->iat_pointers, scan->iat[i], (void *)(scan->iat_va + i * sizeof(uintptr_t)));
+    }
+    return (uintptr_t)PtrMapGet(&scan->iat_pointers, addr);
+}
+
+// checkMemoryRangeAndAddToList
+static void check_and_add(scan_t *scan, reference_t *ref, const _DInst *instruction)
+{
+    if (ref->target_address_in_iat <= 0x000FFFFF || ref->target_address_in_iat == (uintptr_t)-1)
+        return;
+    if (ref->target_address_in_iat >= scan->image_base && ref->target_address_in_iat <= scan->image_base + scan->image_size)
+        return;
+    // without apis every address counts, to find those the code refers to
+    if (scan->apis && !ApiIndexLookup(scan->apis, ref->target_address_in_iat, NULL))
+        return;
+    ref->address_va = (uintptr_t)instruction->addr;
+    ref->instruction_size = instruction->size;
+    ref->target_pointer = look_up_iat_for_pointer(scan, ref->target_address_in_iat);
+    if (scan->count == scan->capacity) {
+        scan->capacity = scan->capacity ? scan->capacity * 2 : 50;
+        scan->refs = realloc(scan->refs, scan->capacity * sizeof(reference_t));
+    }
+    scan->refs[scan->count++] = *ref;
+}
+
+// analyzeInstruction with ScanForDirectImports
+static void analyze_instruction(scan_t *scan, const _DInst *instruction)
+{
+    reference_t ref = { 0 };
+
+    if (instruction->opcode == I_MOV && instruction->size >= (scan->is64 ? 7 : 5) && instruction->ops[0].type == O_REG && instruction->ops[1].type == O_IMM) {
+        ref.type = DIRECT_MOV;
+        ref.target_address_in_iat = (uintptr_t)instruction->imm.qword;
+        check_and_add(scan, &ref, instruction);
+    }
+    if (scan->is64)
+        return;
+    if ((META_GET_FC(instruction->meta) == FC_CALL || META_GET_FC(instruction->meta) == FC_UNC_BRANCH) && instruction->size >= 5 && instruction->ops[0].type == O_PC) {
+        ref.type = META_GET_FC(instruction->meta) == FC_CALL ? DIRECT_CALL : DIRECT_JMP;
+        ref.target_address_in_iat = (uintptr_t)INSTRUCTION_GET_TARGET(instruction);
+        check_and_add(scan, &ref, instruction);
+    }
+    if (instruction->size >= 5 && instruction->opcode == I_LEA && instruction->ops[0].type == O_REG && instruction->ops[1].type == O_DISP) {
+        ref.type = DIRECT_LEA;
+        ref.target_address_in_iat = (uintptr_t)instruction->disp;
+        check_and_add(scan, &ref, instruction);
+    }
+    if (instruction->size >= 5 && instruction->opcode == I_PUSH) {
+        ref.type = DIRECT_PUSH;
+        ref.target_address_in_iat = (uintptr_t)instruction->imm.qword;
+        check_and_add(scan, &ref, instruction);
+    }
+}
+
+// scanMemoryPage
+static void scan_memory_page(scan_t *scan, const uint8_t *code, size_t size, uintptr_t address)
+{
+    static _DInst result[MAX_INSTRUCTIONS];
+    const uint8_t *position = code;
+    int remaining = (int)size;
+    _CodeInfo ci;
+
+    for (;;) {
+        unsigned int count = 0, next;
+        _DecodeResult res;
+
+        memset(&ci, 0, sizeof(ci));
+        ci.code = position;
+        ci.codeLen = remaining;
+        ci.dt = scan->is64 ? Decode64Bits : Decode32Bits;
+        ci.codeOffset = address;
+        res = distorm_decompose(&ci, result, MAX_INSTRUCTIONS, &count);
+        if (res == DECRES_INPUTERR)
+            break;
+        for (unsigned int i = 0; i < count; i++)
+            if (result[i].flags != FLAG_NOT_DECODABLE)
+                analyze_instruction(scan, &result[i]);
+        if (res == DECRES_SUCCESS || !count)
+            break;
+        next = (unsigned int)(result[count - 1].addr - result[0].addr);
+        if (result[count - 1].flags != FLAG_NOT_DECODABLE)
+            next += result[count - 1].size;
+        position += next;
+        address += next;
+        remaining -= next;
+    }
+}
+
+static void scan_free(scan_t *scan)
+{
+    PtrMapFree(&scan->iat_pointers);
+    free(scan->refs);
+    scan->refs = NULL;
+    scan->count = scan->capacity = 0;
+    scan->iat_read = 0;
+}
+
+// The std::set passes: the unique apis, and the unique apis without an IAT entry
+static int compare_address(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static size_t unique_sorted(uintptr_t *values, size_t count)
+{
+    size_t unique = 0;
+
+    if (count)
+        qsort(values, count, sizeof(uintptr_t), compare_address);
+    for (size_t i = 0; i < count; i++)
+        if (!unique || values[i] != values[unique - 1])
+            values[unique++] = values[i];
+    return unique;
+}
+
+static void set_counts(const scan_t *scan, int *unique, int *missing)
+{
+    uintptr_t *values = malloc((scan->count + 1) * sizeof(uintptr_t));
+    size_t count = 0;
+
+    for (size_t i = 0; i < scan->count; i++)
+        values[i] = scan->refs[i].target_address_in_iat;
+    *unique = (int)unique_sorted(values, scan->count);
+    for (size_t i = 0; i < scan->count; i++)
+        if (!scan->refs[i].target_pointer)
+            values[count++] = scan->refs[i].target_address_in_iat;
+    *missing = (int)unique_sorted(values, count);
+    free(values);
+}
+
+// countDirectImports
+static void map_counts(const scan_t *scan, int *unique, int *missing)
+{
+    PTRMAP pointers;
+
+    PtrMapInit(&pointers);
+    *unique = *missing = 0;
+    for (size_t i = 0; i < scan->count; i++) {
+        reference_t *ref = &scan->refs[i];
+        if (!PtrMapGet(&pointers, ref->target_address_in_iat) && PtrMapSet(&pointers, ref->target_address_in_iat, ref)) {
+            (*unique)++;
+            if (!ref->target_pointer)
+                (*missing)++;
+        }
+    }
+    PtrMapFree(&pointers);
+}
+
+// The patches made by patchDirectJumpTable, as (table entry, reference) pairs
+typedef struct {
+    uintptr_t entry;
+    size_t reference;
+} patch_t;
+
+static size_t set_jump_table(const scan_t *scan, patch_t *patches)
+{
+    uintptr_t *pointers = malloc((scan->count + 1) * sizeof(uintptr_t));
+    size_t unique, count = 0;
+
+    for (size_t i = 0; i < scan->count; i++)
+        pointers[i] = scan->refs[i].target_pointer;
+    unique = unique_sorted(pointers, scan->count);
+    for (size_t p = 0; p < unique; p++)
+        for (size_t i = 0; i < scan->count; i++)
+            if (scan->refs[i].target_pointer == pointers[p]) {
+                patches[count].entry = pointers[p];
+                patches[count++].reference = i;
+            }
+    free(pointers);
+    return count;
+}
+
+// std::stable_sort of the references by one of their fields
+static const reference_t *sort_refs;
+static int sort_field;
+
+static int compare_references(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    uintptr_t u = sort_field ? sort_refs[x].target_address_in_iat : sort_refs[x].target_pointer;
+    uintptr_t v = sort_field ? sort_refs[y].target_address_in_iat : sort_refs[y].target_pointer;
+
+    if (u != v)
+        return u < v ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+static size_t sorted_references(const scan_t *scan, size_t *order, int field, int missing_only)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < scan->count; i++)
+        if (!missing_only || !scan->refs[i].target_pointer)
+            order[count++] = i;
+    sort_refs = scan->refs;
+    sort_field = field;
+    if (count)
+        qsort(order, count, sizeof(size_t), compare_references);
+    return count;
+}
+
+static size_t grouped_jump_table(const scan_t *scan, patch_t *patches)
+{
+    size_t *order = malloc((scan->count + 1) * sizeof(size_t)), count = sorted_references(scan, order, 0, 0);
+
+    for (size_t i = 0; i < count; i++) {
+        patches[i].entry = scan->refs[order[i]].target_pointer;
+        patches[i].reference = order[i];
+    }
+    free(order);
+    return count;
+}
+
+// addAdditionalApisToList, returning the new IAT size and the entries given
+// to the apis in the order addFoundApiToModuleList is called
+static uint32_t set_add_apis(scan_t *scan, patch_t *added, size_t *added_count)
+{
+    uintptr_t *apis = malloc((scan->count + 1) * sizeof(uintptr_t)), iat_addy = scan->iat_va + scan->iat_size;
+    size_t count = 0;
+    uint32_t new_size = scan->iat_size;
+
+    *added_count = 0;
+    for (size_t i = 0; i < scan->count; i++)
+        if (!scan->refs[i].target_pointer)
+            apis[count++] = scan->refs[i].target_address_in_iat;
+    count = unique_sorted(apis, count);
+    for (size_t a = 0; a < count; a++) {
+        for (size_t i = 0; i < scan->count; i++)
+            if (!scan->refs[i].target_pointer && scan->refs[i].target_address_in_iat == apis[a]) {
+                scan->refs[i].target_pointer = iat_addy;
+                added[*added_count].entry = iat_addy;
+                added[(*added_count)++].reference = i;
+            }
+        iat_addy += sizeof(uintptr_t);
+        new_size += sizeof(uintptr_t);
+    }
+    free(apis);
+    return new_size;
+}
+
+static uint32_t grouped_add_apis(scan_t *scan, patch_t *added, size_t *added_count)
+{
+    size_t *order = malloc((scan->count + 1) * sizeof(size_t)), count = sorted_references(scan, order, 1, 1);
+    uintptr_t iat_addy = scan->iat_va + scan->iat_size;
+    uint32_t new_size = scan->iat_size;
+
+    *added_count = 0;
+    for (size_t i = 0; i < count; ) {
+        uintptr_t api = scan->refs[order[i]].target_address_in_iat;
+        for (; i < count && scan->refs[order[i]].target_address_in_iat == api; i++) {
+            scan->refs[order[i]].target_pointer = iat_addy;
+            added[*added_count].entry = iat_addy;
+            added[(*added_count)++].reference = order[i];
+        }
+        iat_addy += sizeof(uintptr_t);
+        new_size += sizeof(uintptr_t);
+    }
+    free(order);
+    return new_size;
+}
+
+// Scans the code both ways and checks everything derived from the references
+static void compare_scans(scan_t *scan, const uint8_t *code, size_t size, uintptr_t address, const char *what)
+{
+    scan_t linear = *scan;
+    int unique[2], missing[2];
+    patch_t *patches[2], *added[2];
+    size_t patch_count[2], added_count[2], mismatches = 0;
+    uint32_t new_size[2];
+
+    linear.indexed = 0;
+    linear.refs = NULL;
+    linear.count = linear.capacity = 0;
+    scan->indexed = 1;
+    scan_memory_page(&linear, code, size, address);
+    scan_memory_page(scan, code, size, address);
+
+    CHECK(scan->count == linear.count, "%s: %zu references, expected %zu", what, scan->count, linear.count);
+    for (size_t i = 0; i < scan->count && i < linear.count; i++)
+        mismatches += memcmp(&scan->refs[i], &linear.refs[i], sizeof(reference_t)) != 0;
+    CHECK(mismatches == 0, "%s: %zu references differ", what, mismatches);
+
+    set_counts(&linear, &unique[0], &missing[0]);
+    map_counts(scan, &unique[1], &missing[1]);
+    CHECK(unique[0] == unique[1] && missing[0] == missing[1], "%s: %d/%d unique and missing apis, expected %d/%d", what, unique[1], missing[1], unique[0], missing[0]);
+
+    for (int k = 0; k < 2; k++) {
+        patches[k] = malloc((scan->count + 1) * sizeof(patch_t));
+        added[k] = malloc((scan->count + 1) * sizeof(patch_t));
+    }
+    patch_count[0] = set_jump_table(&linear, patches[0]);
+    patch_count[1] = grouped_jump_table(scan, patches[1]);
+    CHECK(patch_count[0] == patch_count[1] && !memcmp(patches[0], patches[1], patch_count[0] * sizeof(patch_t)), "%s: jump table patched differently", what);
+
+    new_size[0] = set_add_apis(&linear, added[0], &added_count[0]);
+    new_size[1] = grouped_add_apis(scan, added[1], &added_count[1]);
+    CHECK(new_size[0] == new_size[1] && added_count[0] == added_count[1] && !memcmp(added[0], added[1], added_count[0] * sizeof(patch_t)),
+        "%s: apis added to the IAT differently, size %#x, expected %#x", what, new_size[1], new_size[0]);
+    map_counts(scan, &unique[1], &missing[1]);
+    CHECK(unique[1] == unique[0] && missing[1] == 0, "%s: %d/%d unique and missing apis after adding", what, unique[1], missing[1]);
+
+    printf("%s: %zu references to %d apis, %d not in the IAT\n", what, linear.count, unique[0], missing[0]);
+    for (int k = 0; k < 2; k++) {
+        free(patches[k]);
+        free(added[k]);
+    }
+    scan_free(&linear);
+    scan_free(scan);
+}
+
+static PAPIINDEX build_apis(const uintptr_t *addresses, size_t count)
+{
+    APICANDIDATE *candidates = malloc((count + 1) * sizeof(APICANDIDATE));
+    PAPIINDEX index;
+
+    for (size_t i = 0; i < count; i++) {
+        candidates[i].Address = addresses[i];
+        candidates[i].Api = (void *)addresses[i];
+        candidates[i].Name = "Api";
+        candidates[i].Priority = 1;
+    }
+    index = ApiIndexBuild(candidates, count);
+    free(candidates);
+    return index;
+}
+
+// Code made of direct references to apis, most of them in the IAT, among
+// ordinary instructions and immediates
+static size_t generate_code(uint8_t *code, size_t size, uintptr_t base, int is64, const uintptr_t *apis, size_t api_count)
+{
+    static const uint8_t filler[][4] = {
+        { 1, 0x90 }, { 2, 0x55 }, { 3, 0x8b, 0xec }, { 2, 0xc3 }, { 3, 0x33, 0xc0 }, { 3, 0x85, 0xc0 }, { 2, 0x50 }, { 3, 0x74, 0x05 },
+    };
+    size_t at = 0;
+
+    while (at + 16 < size) {
+        uint64_t r = next_random();
+        uintptr_t api = apis[(r >> 8) % api_count], value = (r >> 3) % 4 ? api : (uintptr_t)(next_random() & (is64 ? 0x7fffffffffffULL : 0xffffffffULL));
+
+        switch (r % 8) {
+        case 0:
+            if (is64) {
+                code[at++] = 0x48;
+                code[at++] = (uint8_t)(0xb8 + (r >> 40) % 8);
+                memcpy(code + at, &value, 8);
+                at += 8;
+                break;
+            }
+            code[at++] = (uint8_t)(0xb8 + (r >> 40) % 8);
+            memcpy(code + at, &value, 4);
+            at += 4;
+            break;
+        case 1:
+            if (is64)
+                break;
+            code[at++] = 0x68;
+            memcpy(code + at, &value, 4);
+            at += 4;
+            break;
+        case 2:
+        case 3:
+            if (is64)
+                break;
+            {
+                uint32_t rel = (uint32_t)(value - (base + at + 5));
+                code[at++] = r % 8 == 2 ? 0xe8 : 0xe9;
+                memcpy(code + at, &rel, 4);
+                at += 4;
+            }
+            break;
+        case 4:
+            if (is64)
+                break;
+            code[at++] = 0x8d;
+            code[at++] = (uint8_t)(0x05 + ((r >> 40) % 8) * 8);
+            memcpy(code + at, &value, 4);
+            at += 4;
+            break;
+        default:
+            {
+                const uint8_t *f = filler[(r >> 20) % 8];
+                memcpy(code + at, f + 1, f[0] - 1);
+                at += f[0] - 1;
+            }
+            break;
+        }
+    }
+    return at;
+}
+
+// An IAT of apis in runs separated by zeroes, some appearing twice
+static uintptr_t *generate_iat(const uintptr_t *apis, size_t api_count, size_t slots)
+{
+    uintptr_t *iat = calloc(slots, sizeof(uintptr_t));
+
+    for (size_t i = 0; i < slots; i++)
+        iat[i] = next_random() % 16 == 0 ? 0 : apis[next_random() % (api_count * 3 / 4)];
+    return iat;
+}
+
+static void test_generated(int is64, const char *what)
+{
+    enum { APIS = 3000, SLOTS = 1500, CODE = 1 << 20 };
+    uintptr_t apis[APIS], *iat;
+    uint8_t *code = malloc(CODE);
+    scan_t scan = { 0 };
+    size_t size;
+
+    scan.is64 = is64;
+    scan.image_base = is64 ? 0x140000000ULL : 0x400000;
+    scan.image_size = 0x200000;
+    for (size_t i = 0; i < APIS; i++)
+        apis[i] = (is64 ? 0x7ff800000000ULL : 0x70000000) + i * 0x40 + (next_random() % 4) * 0x10000000;
+    iat = generate_iat(apis, APIS, SLOTS);
+    scan.iat = iat;
+    scan.iat_va = scan.image_base + 0x180000;
+    scan.iat_size = SLOTS * sizeof(uintptr_t);
+    scan.apis = build_apis(apis, APIS);
+    size = generate_code(code, CODE, scan.image_base + 0x1000, is64, apis, APIS);
+    compare_scans(&scan, code, size, scan.image_base + 0x1000, what);
+
+    // an IAT holding nothing but zeroes, and none at all
+    memset(iat, 0, SLOTS * sizeof(uintptr_t));
+    compare_scans(&scan, code, size, scan.image_base + 0x1000, "empty IAT");
+    scan.iat_size = 0;
+    compare_scans(&scan, code, size, scan.image_base + 0x1000, "no IAT");
+
+    ApiIndexFree(scan.apis);
+    free(iat);
+    free(code);
+}
+
+static uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] | p[1] << 8); }
+static uint32_t get32(const uint8_t *p) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+
+// Addresses outside the image that the code refers to the way direct imports do
+static size_t collect_targets(scan_t *scan, const uint8_t *code, size_t size, uintptr_t address, uintptr_t **targets)
+{
+    size_t count;
+
+    scan->apis = NULL;
+    scan->indexed = 1;
+    scan_memory_page(scan, code, size, address);
+    *targets = malloc((scan->count + 1) * sizeof(uintptr_t));
+    for (size_t i = 0; i < scan->count; i++)
+        (*targets)[i] = scan->refs[i].target_address_in_iat;
+    count = unique_sorted(*targets, scan->count);
+    scan_free(scan);
+    return count;
+}
+
+static void test_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t *raw;
+    long size;
+    uint32_t nt, sections, opt;
+    int is64;
+
+    CHECK(f != NULL, "%s: cannot open", path);
+    if (!f)
+        return;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    raw = malloc(size > 0 ? size : 1);
+    if (size < 0x200 || fread(raw, 1, size, f) != (size_t)size || get16(raw) != 0x5a4d || (nt = get32(raw + 0x3c)) > (uint32_t)size - 0x108 || get32(raw + nt) != 0x4550) {
+        CHECK(0, "%s: not a PE file", path);
+        fclose(f);
+        free(raw);
+        return;
+    }
+    fclose(f);
+
+    opt = nt + 0x18;
+    is64 = get16(raw + opt) == 0x20b;
+    sections = get16(raw + nt + 6);
+    for (uint32_t s = 0; s < sections; s++) {
+        const uint8_t *h = raw + opt + get16(raw + nt + 20) + s * 40;
+        uint32_t va = get32(h + 12), length = get32(h + 16), offset = get32(h + 20);
+        scan_t scan = { 0 };
+        uintptr_t *targets, *iat;
+        size_t count;
+        char what[300];
+
+        if (!(get32(h + 36) & 0x20000000) || offset >= (uint32_t)size)
+            continue;
+        if (length > (uint32_t)size - offset)
+            length = (uint32_t)size - offset;
+        scan.is64 = is64;
+        scan.image_base = is64 ? (uintptr_t)get32(raw + opt + 24) | (uintptr_t)get32(raw + opt + 28) << 32 : get32(raw + opt + 28);
+        scan.image_size = get32(raw + opt + 56);
+
+        count = collect_targets(&scan, raw + offset, length, scan.image_base + va, &targets);
+        if (count < 4) {
+            free(targets);
+            continue;
+        }
+        // every third target is an api, and most apis are in the IAT
+        for (size_t i = 0; i * 3 < count; i++)
+            targets[i] = targets[i * 3];
+        count = (count + 2) / 3;
+        iat = generate_iat(targets, count, count);
+        scan.iat = iat;
+        scan.iat_va = scan.image_base + scan.image_size;
+        scan.iat_size = (uint32_t)(count * sizeof(uintptr_t));
+        scan.apis = build_apis(targets, count);
+        snprintf(what, sizeof(what), "%s section %u", path, s);
+        compare_scans(&scan, raw + offset, length, scan.image_base + va, what);
+        ApiIndexFree(scan.apis);
+        free(iat);
+        free(targets);
+    }
+    free(raw);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(void)
+{
+    enum { APIS = 6000, SLOTS = 4000, CODE = 4 << 20 };
+    static uintptr_t apis[APIS];
+    uint8_t *code = malloc(CODE);
+    uintptr_t *iat;
+    scan_t scan = { 0 };
+    size_t size;
+    double t0, t1, t2;
+
+    scan.image_base = 0x400000;
+    scan.image_size = 0x800000;
+    for (size_t i = 0; i < APIS; i++)
+        apis[i] = 0x70000000 + i * 0x40;
+    iat = generate_iat(apis, APIS, SLOTS);
+    scan.iat = iat;
+    scan.iat_va = scan.image_base + 0x600000;
+    scan.iat_size = SLOTS * sizeof(uintptr_t);
+    scan.apis = build_apis(apis, APIS);
+    size = generate_code(code, CODE, scan.image_base + 0x1000, 0, apis, APIS);
+
+    scan.indexed = 0;
+    t0 = now();
+    scan_memory_page(&scan, code, size, scan.image_base + 0x1000);
+    t1 = now();
+    printf("%zu references in %zu bytes of code, %d IAT entries: linear IAT search %.1f ms", scan.count, size, SLOTS, (t1 - t0) * 1e3);
+    scan_free(&scan);
+    scan.indexed = 1;
+    t1 = now();
+    scan_memory_page(&scan, code, size, scan.image_base + 0x1000);
+    t2 = now();
+    printf(", indexed %.1f ms\n", (t2 - t1) * 1e3);
+    scan_free(&scan);
+
+    ApiIndexFree(scan.apis);
+    free(iat);
+    free(code);
+}
+
+int main(int argc, char **argv)
+{
+    int bench_mode = argc > 1 && !strcmp(argv[1], "bench");
+
+    test_generated(0, "x86 code");
+    test_generated(1, "x64 code");
+    for (int i = bench_mode ? 2 : 1; i < argc; i++)
+        test_file(argv[i]);
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (bench_mode)
+        bench();
+
+    return failures != 0;
+}
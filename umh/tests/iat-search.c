@@ -0,0 +1,794 @@
+// Tests for Scylla's IAT search over IatScan: pointers in range of the apis
+// marked sixteen bytes at a time, verified against the api index and
+// clustered into blocks, checked against a plain pass over the same slots,
+// and the IAT found in an image checked against the one the imports
+// describe. The start and size found from a pointer in the IAT are checked
+// against findIATStartAddress and findIATSize as they were, and the IAT
+// found against the old advanced search, which decomposed the code with
+// distorm and kept the pointers called through. Portable harness, build on
+// Linux with:
+//   gcc -O2 -Wall -I../CAPE -I../distorm/include -o iat-search iat-search.c ../CAPE/IatScan.c ../CAPE/ApiIndex.c ../distorm/src/*.c
+// PE files given on the command line, such as distlib's launchers, are
+// mapped with their imports bound to apis of made-up modules.
+// Run "./iat-search bench [PE files]" for the time each search takes per
+// image, the files given and a generated 16MB one.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <distorm.h>
+#include <mnemonics.h>
+#include "IatScan.h"
+
+#define MAX_INSTRUCTIONS 200
+#define MAX_MODULES 16
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// The made-up process: modules exporting apis, the image and a heap
+typedef struct {
+    uint64_t base, size;
+} range_t;
+
+typedef struct {
+    int is64;
+    uint32_t pointer;
+    range_t mapped[MAX_MODULES + 2];
+    size_t mapped_count;
+    uint64_t *apis;
+    size_t api_count;
+    PAPIINDEX index;
+    uint64_t min, max;          // exclusive, as setMinMaxApiAddress keeps them
+    uint64_t heap;
+    size_t queries;
+    size_t wasted;              // queries the scan should have answered itself
+    // the image, for the old search's reads
+    const uint8_t *image;
+    uint64_t image_base;
+    size_t image_size;
+} process_t;
+
+static uint64_t all_ones(const process_t *p)
+{
+    return p->is64 ? ~(uint64_t)0 : 0xFFFFFFFF;
+}
+
+static int is_mapped(void *context, uint64_t address)
+{
+    process_t *p = context;
+    p->queries++;
+    for (size_t i = 0; i < p->mapped_count; i++)
+        if (address - p->mapped[i].base < p->mapped[i].size)
+            return 1;
+    return 0;
+}
+
+// Modules of 1MB with an api every 16 bytes from 0x1000, the image and a heap
+static void make_process(process_t *p, int is64, uint64_t image_base, size_t image_size, size_t modules, size_t apis_per_module)
+{
+    uint64_t module_base = is64 ? 0x7FF810000000ULL : 0x75000000;
+    APICANDIDATE *candidates;
+
+    memset(p, 0, sizeof(*p));
+    p->is64 = is64;
+    p->pointer = is64 ? 8 : 4;
+    p->api_count = modules * apis_per_module;
+    p->apis = malloc(p->api_count * sizeof(uint64_t));
+    candidates = malloc(p->api_count * sizeof(APICANDIDATE));
+    p->min = all_ones(p);
+    for (size_t m = 0; m < modules; m++) {
+        p->mapped[p->mapped_count].base = module_base + m * 0x200000;
+        p->mapped[p->mapped_count++].size = 0x100000;
+        for (size_t j = 0; j < apis_per_module; j++) {
+            uint64_t api = module_base + m * 0x200000 + 0x1000 + j * 0x10;
+            size_t k = m * apis_per_module + j;
+            p->apis[k] = api;
+            candidates[k].Address = (uintptr_t)api;
+            candidates[k].Api = &p->apis[k];
+            candidates[k].Name = "Api";
+            candidates[k].Priority = 1;
+            if (api - 1 < p->min)
+                p->min = api - 1;
+            if (api + 1 > p->max)
+                p->max = api + 1;
+        }
+    }
+    p->index = ApiIndexBuild(candidates, p->api_count);
+    free(candidates);
+    p->mapped[p->mapped_count].base = image_base;
+    p->mapped[p->mapped_count++].size = image_size;
+    p->heap = is64 ? 0x1D0000000ULL : 0x2000000;
+    p->mapped[p->mapped_count].base = p->heap;
+    p->mapped[p->mapped_count++].size = 0x100000;
+    p->image_base = image_base;
+    p->image_size = image_size;
+}
+
+static void free_process(process_t *p)
+{
+    ApiIndexFree(p->index);
+    free(p->apis);
+}
+
+static uint64_t get_pointer(const uint8_t *data, uint32_t pointer)
+{
+    uint64_t value = 0;
+    memcpy(&value, data, pointer);
+    return value;
+}
+
+static void put_pointer(uint8_t *data, uint64_t value, uint32_t pointer)
+{
+    memcpy(data, &value, pointer);
+}
+
+static int is_api(const process_t *p, uint64_t value)
+{
+    return ApiIndexCandidates(p->index, (uintptr_t)value, NULL) > 0;
+}
+
+// isInvalidMemoryForIat
+static int old_is_invalid(process_t *p, uint64_t value)
+{
+    return value == 0 || value == all_ones(p) || !is_mapped(p, value);
+}
+
+// A slot of the buffer findIATStartAndSize read, zeroes past its end
+static uint64_t old_slot(const process_t *p, const uint8_t *buffer, size_t size, size_t offset)
+{
+    uint64_t value = 0;
+    if (offset < size)
+        memcpy(&value, buffer + offset, size - offset < p->pointer ? size - offset : p->pointer);
+    return value;
+}
+
+// findIATStartAddress as it was, as an offset into the buffer
+static size_t old_find_start(process_t *p, const uint8_t *buffer, size_t size, size_t start)
+{
+    size_t offset = start, w = p->pointer;
+
+    while (offset != 0) {
+        if (old_is_invalid(p, old_slot(p, buffer, size, offset)) && offset >= w && old_is_invalid(p, old_slot(p, buffer, size, offset - w))
+            && offset >= 2 * w && !is_api(p, old_slot(p, buffer, size, offset - 2 * w)))
+            return offset;
+        offset -= w;
+    }
+    return 0;
+}
+
+// findIATSize as it was
+static size_t old_find_size(process_t *p, const uint8_t *buffer, size_t size, size_t iat)
+{
+    size_t offset = iat, w = p->pointer;
+
+    while (offset < size - 1) {
+        if (old_is_invalid(p, old_slot(p, buffer, size, offset)) && old_is_invalid(p, old_slot(p, buffer, size, offset + w))
+            && !is_api(p, old_slot(p, buffer, size, offset + 2 * w)))
+            return offset - iat;
+        offset += w;
+    }
+    return size;
+}
+
+// Nulls and apis are known from the values alone
+static int scan_mapped(void *context, uint64_t address)
+{
+    process_t *p = context;
+    if (address == 0 || address == all_ones(p) || is_api(p, address))
+        p->wasted++;
+    return is_mapped(context, address);
+}
+
+static int scan_init(IATSCAN *scan, process_t *p, const uint8_t *data, size_t size)
+{
+    return IatScanInit(scan, data, size, p->pointer, p->min, p->max, p->index, scan_mapped, p);
+}
+
+// findIATStartAndSize both ways from every slot, aligned as the old search needed
+static void compare_start_and_size(process_t *p, const uint8_t *buffer, size_t size, size_t from, size_t to, const char *what)
+{
+    IATSCAN scan;
+    int mismatches = 0;
+
+    CHECK(scan_init(&scan, p, buffer, size), "%s: scan failed", what);
+    for (size_t offset = from; offset < to && offset < size && mismatches < 5; offset += p->pointer) {
+        size_t old_start = old_find_start(p, buffer, size, offset), start = 0, length = 0;
+        size_t old_size = old_find_size(p, buffer, size, old_start);
+
+        if (!IatScanStart(&scan, offset, &start))
+            start = 0;
+        if (!IatScanEnd(&scan, start, &length))
+            length = size;
+        if (start != old_start || length != old_size) {
+            mismatches++;
+            CHECK(0, "%s: from %zx found %zx+%zx, expected %zx+%zx", what, offset, start, length, old_start, old_size);
+        }
+    }
+    IatScanFree(&scan);
+}
+
+// The verified slots and blocks, checked slot by slot
+static void compare_blocks(process_t *p, const uint8_t *data, size_t size, const char *what)
+{
+    IATSCAN scan;
+    IATBLOCK *blocks = malloc((size / p->pointer + 1) * sizeof(IATBLOCK));
+    size_t slots = (size + p->pointer - 1) / p->pointer, in_range = 0, apis = 0, count = 0, last = 0;
+    int ok = 1;
+
+    CHECK(scan_init(&scan, p, data, size), "%s: scan failed", what);
+    for (size_t slot = 0; slot < slots; slot++) {
+        uint64_t value = old_slot(p, data, size, slot * p->pointer);
+        if (value == 0 || value == all_ones(p) || !(value > p->min && value < p->max))
+            continue;
+        in_range++;
+        if (!is_api(p, value))
+            continue;
+        if (apis >= scan.Verified || scan.ApiSlots[apis] != slot)
+            ok = 0;
+        apis++;
+
+        // an api joins the block before it when close enough with no end between
+        if (count && (slot - last) * p->pointer <= IAT_MAX_GAP) {
+            size_t gap;
+            for (gap = last + 1; gap + 2 < slot; gap++)
+                if (old_is_invalid(p, old_slot(p, data, size, gap * p->pointer)) && old_is_invalid(p, old_slot(p, data, size, (gap + 1) * p->pointer))
+                    && !is_api(p, old_slot(p, data, size, (gap + 2) * p->pointer)))
+                    break;
+            if (gap + 2 >= slot) {
+                blocks[count - 1].Size = (slot + 1) * p->pointer - blocks[count - 1].Offset;
+                blocks[count - 1].Apis++;
+                last = slot;
+                continue;
+            }
+        }
+        blocks[count].Offset = slot * p->pointer;
+        blocks[count].Size = p->pointer;
+        blocks[count++].Apis = 1;
+        last = slot;
+    }
+    CHECK(ok && apis == scan.Verified && in_range == scan.InRange, "%s: %zu of %zu in range verified, expected %zu of %zu", what, scan.Verified, scan.InRange, apis, in_range);
+    CHECK(IatScanCluster(&scan) == count || !count, "%s: %zu blocks, expected %zu", what, scan.BlockCount, count);
+    CHECK(scan.BlockCount == count && (!count || !memcmp(scan.Blocks, blocks, count * sizeof(IATBLOCK))), "%s: blocks differ", what);
+    IatScanFree(&scan);
+    free(blocks);
+}
+
+// Slots of every kind, many of them at the edges of the api range
+static uint64_t random_slot(process_t *p)
+{
+    uint64_t r = next_random(), api = p->apis[next_random() % p->api_count];
+    switch (r % 16) {
+    case 0: case 1: return 0;
+    case 2: return all_ones(p);
+    case 3: return p->heap + (r >> 8) % 0x100000;
+    case 4: return p->min;
+    case 5: return p->max;
+    case 6: return p->min + 1 + (r >> 8) % 4;
+    case 7: return p->max - 1 - (r >> 8) % 4;
+    case 8: return api + 1;
+    case 9: return (r >> 8) & all_ones(p);
+    case 10: return p->is64 ? api ^ (uint64_t)1 << (32 + (r >> 8) % 32) : api ^ 0x80000000;
+    case 12: return (r >> 8) & 0xFFFF;
+    case 13: return all_ones(p) ^ ((r >> 8) & 0xFFFF);
+    default: return api;
+    }
+}
+
+static void test_slots(int is64)
+{
+    process_t p;
+    const char *what = is64 ? "x64 slots" : "x86 slots";
+
+    make_process(&p, is64, is64 ? 0x140000000ULL : 0x400000, 0x10000, 6, 50);
+    for (int trial = 0; trial < 200; trial++) {
+        size_t slots = 1 + next_random() % 300, size = slots * p.pointer - (trial % 5 == 0 ? next_random() % p.pointer : 0);
+        uint8_t *data = malloc(slots * p.pointer);
+        // runs of apis with gaps, as IATs are laid out, or anything at all
+        for (size_t i = 0; i < slots; i++)
+            put_pointer(data + i * p.pointer, trial % 2 ? random_slot(&p) : next_random() % 8 ? p.apis[next_random() % p.api_count] : random_slot(&p), p.pointer);
+        compare_blocks(&p, data, size, what);
+        compare_start_and_size(&p, data, size, 0, size, what);
+        free(data);
+    }
+
+    CHECK(!p.wasted, "%s: %zu queries for nulls or apis", what, p.wasted);
+
+    // no apis, so nothing in range
+    {
+        uint8_t data[64];
+        IATSCAN scan;
+        for (size_t i = 0; i < sizeof(data); i += p.pointer)
+            put_pointer(data + i, p.apis[i % p.api_count], p.pointer);
+        CHECK(IatScanInit(&scan, data, sizeof(data), p.pointer, 5, 5, p.index, scan_mapped, &p) && !scan.InRange, "%s: empty range", what);
+        IatScanFree(&scan);
+        CHECK(IatScanInit(&scan, data, sizeof(data), p.pointer, all_ones(&p), 0, NULL, scan_mapped, &p) && !scan.InRange, "%s: no apis", what);
+        IatScanFree(&scan);
+    }
+
+    // each slot asked about once
+    {
+        uint8_t data[16] = { 0 };
+        IATSCAN scan;
+        put_pointer(data, p.heap, p.pointer);
+        put_pointer(data + p.pointer, all_ones(&p) ^ 0x1000, p.pointer);
+        CHECK(scan_init(&scan, &p, data, sizeof(data)), "%s: scan failed", what);
+        for (int i = 0; i < 2; i++)
+            CHECK(!IatScanIsInvalid(&scan, 0) && IatScanIsInvalid(&scan, 1) && scan.Queries == 2, "%s: %zu queries", what, scan.Queries);
+        IatScanFree(&scan);
+    }
+
+    // a single unaligned slot past the end reads as 0
+    {
+        uint8_t data[3] = { 1, 2, 3 };
+        IATSCAN scan;
+        CHECK(scan_init(&scan, &p, data, 3) && scan.Slots == 1 && IatScanValue(&scan, 0) == 0x030201 && IatScanValue(&scan, 1) == 0, "%s: short data", what);
+        CHECK(IatScanIsInvalid(&scan, 1) && !IatScanIsApi(&scan, 1), "%s: slot past the end", what);
+        IatScanFree(&scan);
+    }
+    free_process(&p);
+}
+
+// The old advanced search: call and jmp through memory in the code, the
+// pointers they use kept in order and the outliers filtered
+typedef struct {
+    uint64_t *pointers;
+    size_t count, capacity;
+} pointers_t;
+
+static void add_pointer(pointers_t *list, uint64_t pointer)
+{
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 256;
+        list->pointers = realloc(list->pointers, list->capacity * sizeof(uint64_t));
+    }
+    list->pointers[list->count++] = pointer;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// isIATPointerValid without the redirect check
+static int old_pointer_valid(process_t *p, uint64_t pointer)
+{
+    if (pointer < p->image_base || pointer + p->pointer > p->image_base + p->image_size)
+        return 0;
+    return is_api(p, get_pointer(p->image + (pointer - p->image_base), p->pointer));
+}
+
+static void old_filter(process_t *p, uint64_t *a, size_t *count)
+{
+    size_t n = *count, i;
+    uint64_t last;
+    int erased = 1;
+
+    if (n <= 2)
+        return;
+    i = n / 2;
+    last = a[i++];
+    for (; i < n; i++) {
+        if (a[i] - last > 0x100 && (!old_pointer_valid(p, last) || !old_pointer_valid(p, a[i]))) {
+            n = i;
+            break;
+        }
+        last = a[i];
+    }
+    while (erased) {
+        if (n <= 1)
+            break;
+        last = a[0];
+        for (i = 1; i < n; i++) {
+            if (a[i] - last > 0x100) {
+                int last_valid = old_pointer_valid(p, last), current_valid = old_pointer_valid(p, a[i]);
+                if (!last_valid || !current_valid) {
+                    if (!last_valid)
+                        i--;
+                    memmove(a + i, a + i + 1, (n - i - 1) * sizeof(uint64_t));
+                    n--;
+                    erased = 1;
+                    break;
+                }
+            }
+            erased = 0;
+            last = a[i];
+        }
+    }
+    *count = n;
+}
+
+static int old_advanced(process_t *p, uint64_t code_base, size_t code_size, uint64_t *address, uint32_t *size)
+{
+    static _DInst result[MAX_INSTRUCTIONS];
+    const uint8_t *buffer = p->image + (code_base - p->image_base);
+    pointers_t list = { 0 };
+    size_t memory = code_size, unique = 0;
+    uint64_t base = code_base;
+    unsigned int count;
+
+    for (;;) {
+        _CodeInfo ci;
+        size_t next;
+
+        memset(&ci, 0, sizeof(ci));
+        ci.code = buffer;
+        ci.codeLen = (int)memory;
+        ci.dt = p->is64 ? Decode64Bits : Decode32Bits;
+        ci.codeOffset = (_OffsetType)base;
+        count = 0;
+        if (distorm_decompose(&ci, result, MAX_INSTRUCTIONS, &count) == DECRES_INPUTERR || !count)
+            break;
+        for (unsigned int i = 0; i < count; i++) {
+            if (result[i].flags == FLAG_NOT_DECODABLE || (META_GET_FC(result[i].meta) != FC_CALL && META_GET_FC(result[i].meta) != FC_UNC_BRANCH) || result[i].size < 5)
+                continue;
+            if (p->is64 && (result[i].flags & FLAG_RIP_RELATIVE))
+                add_pointer(&list, INSTRUCTION_GET_RIP_TARGET(&result[i]));
+            else if (!p->is64 && result[i].ops[0].type == O_DISP)
+                add_pointer(&list, (uint32_t)result[i].disp);
+        }
+        next = (size_t)(result[count - 1].addr - base) + result[count - 1].size;
+        buffer += next;
+        if (memory <= next)
+            break;
+        memory -= next;
+        base += next;
+    }
+
+    // as a std::set
+    if (list.count) {
+        qsort(list.pointers, list.count, sizeof(uint64_t), compare_u64);
+        unique = 1;
+        for (size_t i = 1; i < list.count; i++)
+            if (list.pointers[i] != list.pointers[unique - 1])
+                list.pointers[unique++] = list.pointers[i];
+    }
+    old_filter(p, list.pointers, &unique);
+    *address = 0;
+    *size = 0;
+    if (unique) {
+        *address = list.pointers[0];
+        *size = (uint32_t)(list.pointers[unique - 1] - list.pointers[0] + p->pointer);
+    }
+    free(list.pointers);
+    return unique && *size <= 2000000 * p->pointer;
+}
+
+// findIATAdvanced: the block with the most apis
+static int new_advanced(process_t *p, uint64_t *address, uint32_t *size, size_t *blocks)
+{
+    IATSCAN scan;
+    PIATBLOCK best = NULL;
+    int found = 0;
+
+    if (scan_init(&scan, p, p->image, p->image_size) && IatScanCluster(&scan)) {
+        for (size_t i = 0; i < scan.BlockCount; i++)
+            if (!best || scan.Blocks[i].Apis > best->Apis)
+                best = &scan.Blocks[i];
+        *address = p->image_base + best->Offset;
+        *size = (uint32_t)best->Size;
+        found = 1;
+    }
+    *blocks = scan.BlockCount;
+    IatScanFree(&scan);
+    return found;
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    uint64_t base;
+    int is64;
+    uint64_t code_base;         // the executable section holding the entry point
+    size_t code_size;
+    uint64_t iat, iat_size;     // as the imports describe it
+    size_t modules, apis_per_module;
+} image_t;
+
+// Code with calls through the IAT among ordinary instructions, an IAT of
+// modules separated by nulls with some entries redirected to the heap or
+// unresolved, and data with api pointers of its own
+static void generate_image(image_t *img, int is64, size_t size)
+{
+    static const uint8_t filler[][4] = { { 1, 0x90 }, { 2, 0x55 }, { 3, 0x8b, 0xec }, { 2, 0xc3 }, { 3, 0x33, 0xc0 }, { 3, 0x85, 0xc0 }, { 2, 0x50 }, { 3, 0x74, 0x05 } };
+    uint32_t w = is64 ? 8 : 4;
+    size_t code_size = size / 2, iat = code_size + 0x1000, entries, position = 0;
+
+    memset(img, 0, sizeof(*img));
+    img->is64 = is64;
+    img->size = size;
+    img->base = is64 ? 0x140000000ULL : 0x400000;
+    img->data = calloc(size, 1);
+    img->code_base = img->base + 0x1000;
+    img->code_size = code_size - 0x1000;
+    img->modules = 4 + next_random() % 8;
+    img->apis_per_module = 20 + next_random() % 60;
+    entries = img->modules * (img->apis_per_module + 1);
+    img->iat = img->base + iat;
+    img->iat_size = (entries - 1) * w;
+
+    // the IAT's slots are filled in once the process is made
+    while (position + 8 < code_size - 0x1000) {
+        uint8_t *code = img->data + 0x1000 + position;
+        if (position < 12 || next_random() % 4 == 0) {
+            // the first calls go through the first and last apis
+            uint64_t slot = img->iat + (position == 0 ? 0 : position < 12 ? entries - 2 : next_random() % (entries - 1)) * w;
+            code[0] = 0xff;
+            code[1] = next_random() % 2 ? 0x15 : 0x25;
+            if (is64) {
+                int32_t rel = (int32_t)(slot - (img->base + 0x1000 + position + 6));
+                memcpy(code + 2, &rel, 4);
+            }
+            else {
+                uint32_t abs = (uint32_t)slot;
+                memcpy(code + 2, &abs, 4);
+            }
+            position += 6;
+        }
+        else {
+            const uint8_t *f = filler[next_random() % 8];
+            memcpy(code, f + 1, f[0] - 1);
+            position += f[0] - 1;
+        }
+    }
+}
+
+static void fill_image(image_t *img, process_t *p)
+{
+    uint32_t w = p->pointer;
+    size_t iat = img->iat - img->base, slot = 0;
+
+    for (size_t m = 0; m < img->modules; m++) {
+        for (size_t j = 0; j < img->apis_per_module; j++, slot++) {
+            uint64_t value = p->apis[m * p->api_count / img->modules + j];
+            uint64_t r = next_random() % 64;
+            // never the first or last, which bound the IAT, and no null
+            // beside another, which would end it
+            if (slot && !(m == img->modules - 1 && j == img->apis_per_module - 1))
+                value = r == 0 ? p->heap + 0x100 : r == 1 && j % 2 && j + 1 < img->apis_per_module ? 0 : value;
+            put_pointer(img->data + iat + slot * w, value, w);
+        }
+        slot++;
+    }
+
+    // data: random values and some api pointers, alone or a few together
+    for (size_t offset = iat + slot * w + 0x400; offset + w <= img->size; offset += w) {
+        uint64_t r = next_random();
+        put_pointer(img->data + offset, r % 200 == 0 ? p->apis[r % p->api_count] : r % 3 ? 0 : r >> 8 & all_ones(p), w);
+    }
+}
+
+static void compare_searches(process_t *p, const image_t *img, const char *what, int old_exact)
+{
+    uint64_t old_address = 0, address = 0;
+    uint32_t old_size = 0, size = 0;
+    size_t blocks = 0;
+    int old_found = old_advanced(p, img->code_base, img->code_size, &old_address, &old_size);
+    int found = new_advanced(p, &address, &size, &blocks);
+
+    CHECK(found && address == img->iat && size == img->iat_size, "%s: IAT at %llx+%x, expected %llx+%llx", what,
+        (unsigned long long)address, size, (unsigned long long)img->iat, (unsigned long long)img->iat_size);
+    if (old_exact)
+        CHECK(old_found && old_address == address && old_size == size, "%s: old search found %llx+%x, not %llx+%x", what,
+            (unsigned long long)old_address, old_size, (unsigned long long)address, size);
+    // pointers called through next to the IAT, such as the guard pointers
+    // after it, took the old search past its ends
+    else if (old_found)
+        CHECK(old_address < address + size && address < old_address + old_size, "%s: old search found %llx+%x away from %llx+%x", what,
+            (unsigned long long)old_address, old_size, (unsigned long long)address, size);
+    if (!old_exact)
+        printf("%s: IAT %llx+%x in one of %zu blocks, old search %s %llx+%x\n", what, (unsigned long long)address, size, blocks,
+            old_found ? "found" : "failed", (unsigned long long)old_address, old_size);
+}
+
+static void test_generated(int is64)
+{
+    for (int trial = 0; trial < 12; trial++) {
+        image_t img;
+        process_t p;
+        char what[64];
+
+        generate_image(&img, is64, 0x10000 << (trial % 4));
+        make_process(&p, is64, img.base, img.size, img.modules, 100);
+        fill_image(&img, &p);
+        p.image = img.data;
+        snprintf(what, sizeof(what), "%s image %d", is64 ? "x64" : "x86", trial);
+        compare_searches(&p, &img, what, 1);
+        compare_blocks(&p, img.data, img.size, what);
+        compare_start_and_size(&p, img.data, img.size, img.iat - img.base - 0x40, img.iat - img.base + img.iat_size + 0x40, what);
+        free_process(&p);
+        free(img.data);
+    }
+}
+
+static uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] | p[1] << 8); }
+static uint32_t get32(const uint8_t *p) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+
+// A PE file mapped as the loader would, its imports bound to made-up apis
+static int load_image(const char *path, image_t *img, process_t *p)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t *raw;
+    long size;
+    uint32_t nt, opt, sections, imports, entry, w, modules = 0;
+    uint64_t low = ~(uint64_t)0, high = 0;
+
+    if (!f)
+        return 0;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    raw = malloc(size > 0 ? size : 1);
+    if (size < 0x200 || fread(raw, 1, size, f) != (size_t)size || get16(raw) != 0x5a4d || (nt = get32(raw + 0x3c)) > (uint32_t)size - 0x108 || get32(raw + nt) != 0x4550) {
+        fclose(f);
+        free(raw);
+        return 0;
+    }
+    fclose(f);
+
+    memset(img, 0, sizeof(*img));
+    opt = nt + 0x18;
+    img->is64 = get16(raw + opt) == 0x20b;
+    w = img->is64 ? 8 : 4;
+    img->base = img->is64 ? (uint64_t)get32(raw + opt + 24) | (uint64_t)get32(raw + opt + 28) << 32 : get32(raw + opt + 28);
+    img->size = get32(raw + opt + 56);
+    img->data = calloc(img->size, 1);
+    entry = get32(raw + opt + 16);
+    imports = get32(raw + opt + (img->is64 ? 120 : 104));
+    sections = get16(raw + nt + 6);
+    for (uint32_t s = 0; s < sections; s++) {
+        const uint8_t *h = raw + opt + get16(raw + nt + 20) + s * 40;
+        uint32_t va = get32(h + 12), length = get32(h + 16), offset = get32(h + 20), virtual_size = get32(h + 8);
+        if (offset >= (uint32_t)size || va >= img->size)
+            continue;
+        if (length > (uint32_t)size - offset)
+            length = (uint32_t)size - offset;
+        if (length > img->size - va)
+            length = (uint32_t)img->size - va;
+        memcpy(img->data + va, raw + offset, length);
+        if ((get32(h + 36) & 0x20000000) && entry >= va && entry < va + virtual_size) {
+            img->code_base = img->base + va;
+            img->code_size = length;
+        }
+    }
+    free(raw);
+
+    // a module for each import descriptor, with an api for each thunk
+    for (uint32_t d = imports; imports && d + 20 <= img->size && get32(img->data + d + 12); d += 20)
+        modules++;
+    if (!modules || !img->code_size || modules > MAX_MODULES) {
+        free(img->data);
+        return 0;
+    }
+    make_process(p, img->is64, img->base, img->size, modules, 1000);
+    modules = 0;
+    for (uint32_t d = imports; d + 20 <= img->size && get32(img->data + d + 12); d += 20, modules++) {
+        uint32_t thunk = get32(img->data + d + 16);
+        for (size_t j = 0; thunk + w <= img->size && get_pointer(img->data + thunk, w) && j < 1000; j++, thunk += w) {
+            put_pointer(img->data + thunk, p->apis[modules * 1000 + j], w);
+            if (img->base + thunk < low)
+                low = img->base + thunk;
+            if (img->base + thunk + w > high)
+                high = img->base + thunk + w;
+        }
+    }
+    img->iat = low;
+    img->iat_size = high - low;
+    p->image = img->data;
+    return 1;
+}
+
+static void test_file(const char *path)
+{
+    image_t img;
+    process_t p;
+
+    if (!load_image(path, &img, &p)) {
+        printf("%s: no imports to bind\n", path);
+        return;
+    }
+    compare_searches(&p, &img, path, 0);
+    compare_blocks(&p, img.data, img.size, path);
+    compare_start_and_size(&p, img.data, img.size, img.iat - img.base, img.iat - img.base + img.iat_size, path);
+    free_process(&p);
+    free(img.data);
+}
+
+static void bench_image(process_t *p, const image_t *img, const char *what)
+{
+    double start, old_ms, new_ms, old_walk_ms, new_walk_ms;
+    uint64_t address;
+    uint32_t size;
+    size_t blocks, rounds = img->size < (1 << 20) ? 50 : 2, old_queries, new_queries, iat = img->iat - img->base;
+    IATSCAN scan;
+
+    start = now();
+    for (size_t i = 0; i < rounds; i++)
+        old_advanced(p, img->code_base, img->code_size, &address, &size);
+    old_ms = (now() - start) / rounds;
+    start = now();
+    for (size_t i = 0; i < rounds; i++)
+        new_advanced(p, &address, &size, &blocks);
+    new_ms = (now() - start) / rounds;
+
+    // the start and size from the middle of the IAT
+    p->queries = 0;
+    start = now();
+    for (size_t i = 0; i < rounds; i++)
+        old_find_size(p, img->data, img->size, old_find_start(p, img->data, img->size, iat + img->iat_size / 2 / p->pointer * p->pointer));
+    old_walk_ms = (now() - start) / rounds;
+    old_queries = p->queries / rounds;
+    p->queries = 0;
+    start = now();
+    for (size_t i = 0; i < rounds; i++) {
+        size_t found = 0, length;
+        scan_init(&scan, p, img->data, img->size);
+        IatScanStart(&scan, iat + img->iat_size / 2 / p->pointer * p->pointer, &found);
+        IatScanEnd(&scan, found, &length);
+        IatScanFree(&scan);
+    }
+    new_walk_ms = (now() - start) / rounds;
+    new_queries = p->queries / rounds;
+
+    printf("%s, %zuKB: advanced search %.3fms decomposing, %.3fms scanning (%.1fx); start and size %.3fms with %zu queries, %.3fms with %zu\n",
+        what, img->size >> 10, old_ms, new_ms, old_ms / new_ms, old_walk_ms, old_queries, new_walk_ms, new_queries);
+}
+
+static void bench(int argc, char **argv)
+{
+    for (int i = 2; i < argc; i++) {
+        image_t img;
+        process_t p;
+        if (!load_image(argv[i], &img, &p))
+            continue;
+        bench_image(&p, &img, argv[i]);
+        free_process(&p);
+        free(img.data);
+    }
+    for (int is64 = 0; is64 < 2; is64++) {
+        image_t img;
+        process_t p;
+        generate_image(&img, is64, 16 << 20);
+        make_process(&p, is64, img.base, img.size, img.modules, 100);
+        fill_image(&img, &p);
+        p.image = img.data;
+        bench_image(&p, &img, is64 ? "generated x64" : "generated x86");
+        free_process(&p);
+        free(img.data);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int bench_mode = argc > 1 && !strcmp(argv[1], "bench");
+
+    test_slots(0);
+    test_slots(1);
+    test_generated(0);
+    test_generated(1);
+    for (int i = bench_mode ? 2 : 1; i < argc; i++)
+        test_file(argv[i]);
+    if (bench_mode)
+        bench(argc, argv);
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+    return failures != 0;
+}
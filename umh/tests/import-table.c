@@ -0,0 +1,638 @@
+// Tests for the flat import table behind ImportRebuilder: the import
+// section and IAT written from it are checked byte for byte against the
+// old calculateImportSizes/fillImportSection pass over a copy of the module
+// map, with and without OriginalFirstThunk arrays, for 32 and 64-bit
+// pointers, after a move to a new IAT, and over module lists with breaks in
+// their thunks, imports by ordinal and long names. What is written is also
+// parsed back and compared with the module list it came from.
+// Portable harness, build on Linux with:
+//   gcc -O2 -Wall -I../CAPE -Wl,--wrap=malloc,--wrap=realloc,--wrap=calloc -o import-table import-table.c ../CAPE/ImportTable.c
+// PE files given on the command line have their import directories read into
+// a module list the way ApiReader lists them, and rebuilt both ways.
+// Run "./import-table bench" for timings and allocation counts over a module
+// list of 12000 imports.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ImportTable.h"
+
+#define MAX_PATH 260
+#define DESCRIPTOR_SIZE 20
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static size_t allocations, allocated;
+
+void *__real_malloc(size_t size);
+void *__real_realloc(void *p, size_t size);
+void *__real_calloc(size_t count, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    allocations++;
+    allocated += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+    allocations++;
+    allocated += size;
+    return __real_realloc(p, size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    allocations++;
+    allocated += count * size;
+    return __real_calloc(count, size);
+}
+
+static uint16_t get16(const unsigned char *p) { return p[0] | p[1] << 8; }
+static uint32_t get32(const unsigned char *p) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+static uint64_t get64(const unsigned char *p) { return get32(p) | (uint64_t)get32(p + 4) << 32; }
+static void put16(unsigned char *p, uint16_t v) { p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8); }
+static void put32(unsigned char *p, uint32_t v) { put16(p, (uint16_t)v); put16(p + 2, (uint16_t)(v >> 16)); }
+static void put64(unsigned char *p, uint64_t v) { put32(p, (uint32_t)v); put32(p + 4, (uint32_t)(v >> 32)); }
+static uint64_t get_pointer(const unsigned char *p, size_t size) { return size == 8 ? get64(p) : get32(p); }
+static void put_pointer(unsigned char *p, uint64_t v, size_t size) { if (size == 8) put64(p, v); else put32(p, (uint32_t)v); }
+
+// The module map as ApiReader fills it: a node for each module and each
+// thunk, in order of first thunk and of RVA, laid out as ImportModuleThunk
+// and ImportThunk are
+typedef struct thunk_node {
+    char moduleName[MAX_PATH];
+    char name[MAX_PATH];
+    uint64_t va, rva;
+    uint16_t ordinal;
+    uint64_t apiAddressVA;
+    uint16_t hint;
+    int valid, suspect;
+    uint64_t key;
+    struct thunk_node *next;
+} thunk_node;
+
+typedef struct module_node {
+    char moduleName[MAX_PATH];
+    thunk_node *thunks;
+    uint64_t firstThunk, key;
+    struct module_node *next;
+} module_node;
+
+static module_node *add_module(module_node **list, uint64_t first_thunk, const char *name)
+{
+    module_node *module = calloc(1, sizeof(*module)), **at = list;
+    snprintf(module->moduleName, MAX_PATH, "%s", name);
+    module->firstThunk = module->key = first_thunk;
+    while (*at)
+        at = &(*at)->next;
+    *at = module;
+    return module;
+}
+
+static void add_thunk(module_node *module, uint64_t rva, const char *name, uint16_t ordinal, uint16_t hint)
+{
+    thunk_node *thunk = calloc(1, sizeof(*thunk)), **at = &module->thunks;
+    snprintf(thunk->moduleName, MAX_PATH, "%s", module->moduleName);
+    snprintf(thunk->name, MAX_PATH, "%s", name);
+    thunk->rva = thunk->key = rva;
+    thunk->ordinal = ordinal;
+    thunk->hint = hint;
+    thunk->valid = 1;
+    while (*at)
+        at = &(*at)->next;
+    *at = thunk;
+}
+
+static void free_list(module_node *list)
+{
+    while (list) {
+        module_node *module = list;
+        list = list->next;
+        while (module->thunks) {
+            thunk_node *thunk = module->thunks;
+            module->thunks = thunk->next;
+            free(thunk);
+        }
+        free(module);
+    }
+}
+
+// The copy rebuildImportTable took of the map before working on it
+static module_node *copy_list(const module_node *list)
+{
+    module_node *copy = NULL;
+    for (; list; list = list->next) {
+        module_node *module = add_module(&copy, list->firstThunk, list->moduleName);
+        for (const thunk_node *thunk = list->thunks; thunk; thunk = thunk->next) {
+            thunk_node *node = malloc(sizeof(*node)), **at = &module->thunks;
+            *node = *thunk;
+            node->next = NULL;
+            while (*at)
+                at = &(*at)->next;
+            *at = node;
+        }
+    }
+    return copy;
+}
+
+// Stands in for getMemoryPointerFromRVA over the section holding the IAT
+typedef struct {
+    unsigned char *data;
+    uint64_t rva;
+    size_t size;
+} iat_t;
+
+static unsigned char *slot(void *context, uint64_t rva)
+{
+    iat_t *iat = context;
+    if (rva < iat->rva || rva - iat->rva + 16 > iat->size)
+        return NULL;
+    return iat->data + (rva - iat->rva);
+}
+
+typedef struct {
+    size_t descriptors, names, thunks, size;
+} sizes_t;
+
+// calculateImportSizes and fillImportSection as they were
+static void old_sizes(const module_node *list, size_t pointer, sizes_t *sizes)
+{
+    memset(sizes, 0, sizeof(*sizes));
+    for (const module_node *module = list; module; module = module->next)
+        sizes->descriptors++;
+    sizes->descriptors++;
+    for (const module_node *module = list; module; module = module->next) {
+        uint64_t last = module->firstThunk - pointer;
+        sizes->names += strlen(module->moduleName) + 1;
+        for (const thunk_node *thunk = module->thunks; thunk; thunk = thunk->next) {
+            if (last + pointer != thunk->rva) {
+                sizes->descriptors++;
+                sizes->thunks += pointer + pointer;
+            }
+            if (thunk->name[0] != '\0') {
+                sizes->names += 2;
+                sizes->names += strlen(thunk->name) + 1;
+            }
+            sizes->thunks += pointer;
+            last = thunk->rva;
+        }
+        sizes->thunks += pointer;
+    }
+    sizes->size = sizes->thunks + sizes->names + sizes->descriptors * DESCRIPTOR_SIZE;
+}
+
+static size_t old_fill(const module_node *list, const sizes_t *sizes, size_t pointer, unsigned char *section, uint32_t section_rva, size_t start, int use_oft, iat_t *iat)
+{
+    uint64_t flag = pointer == 8 ? 0x8000000000000000ULL : 0x80000000;
+    size_t offset = start, offset_oft = start;
+    unsigned char *descriptor, *thunk_at, *by_name;
+
+    if (use_oft)
+        offset += sizes->thunks;
+    descriptor = section + offset;
+    offset += sizes->descriptors * DESCRIPTOR_SIZE;
+
+    for (const module_node *module = list; module; module = module->next) {
+        char dll_name[MAX_PATH];
+        size_t length;
+        strncpy(dll_name, module->moduleName, MAX_PATH);
+        length = strlen(dll_name) + 1;
+        memcpy(section + offset, dll_name, length);
+        put32(descriptor + 16, (uint32_t)module->firstThunk);
+        put32(descriptor + 12, (uint32_t)(section_rva + offset));
+        if (use_oft)
+            put32(descriptor, (uint32_t)(section_rva + offset_oft));
+        offset += length;
+        by_name = section + offset;
+        uint64_t last = module->firstThunk - pointer;
+
+        for (const thunk_node *thunk = module->thunks; thunk; thunk = thunk->next) {
+            if (use_oft) {
+                thunk_at = section + offset_oft;
+                offset_oft += pointer;
+            }
+            else
+                thunk_at = slot(iat, thunk->rva);
+            if (!thunk_at)
+                return 0;
+            if (last + pointer != thunk->rva) {
+                unsigned char *old = descriptor;
+                descriptor += DESCRIPTOR_SIZE;
+                put32(descriptor + 16, (uint32_t)thunk->rva);
+                put32(descriptor + 12, get32(old + 12));
+                if (use_oft) {
+                    put32(descriptor, (uint32_t)(section_rva + offset_oft));
+                    thunk_at = section + offset_oft;
+                    offset_oft += pointer;
+                }
+            }
+            last = thunk->rva;
+
+            length = 0;
+            if (thunk->name[0] == '\0')
+                put_pointer(thunk_at, (thunk->ordinal & 0xffff) | flag, pointer);
+            else {
+                put16(by_name, thunk->hint);
+                length = strlen(thunk->name) + 1;
+                memcpy(by_name + 2, thunk->name, length);
+                put_pointer(thunk_at, section_rva + offset, pointer);
+                put_pointer(thunk_at + pointer, 0, pointer);
+                length += 2;
+            }
+            offset += length;
+            by_name += length;
+        }
+        offset_oft += pointer;
+        descriptor += DESCRIPTOR_SIZE;
+    }
+    return offset;
+}
+
+static void old_move(module_node *list, uint64_t old_rva, uint64_t new_rva)
+{
+    for (module_node *module = list; module; module = module->next) {
+        module->firstThunk = module->firstThunk - old_rva + new_rva;
+        for (thunk_node *thunk = module->thunks; thunk; thunk = thunk->next)
+            thunk->rva = thunk->rva - old_rva + new_rva;
+    }
+}
+
+// flattenModuleList
+static int flatten(const module_node *list, IMPORTTABLE *table)
+{
+    size_t modules = 0, thunks = 0;
+    for (const module_node *module = list; module; module = module->next) {
+        modules++;
+        for (const thunk_node *thunk = module->thunks; thunk; thunk = thunk->next)
+            thunks++;
+    }
+    if (!ImportTableInit(table, modules, thunks, (modules + thunks) * 32))
+        return 0;
+    for (const module_node *module = list; module; module = module->next) {
+        if (!ImportTableAddModule(table, module->firstThunk, module->moduleName))
+            return 0;
+        for (const thunk_node *thunk = module->thunks; thunk; thunk = thunk->next)
+            if (!ImportTableAddEntry(table, thunk->rva, thunk->name, thunk->ordinal, thunk->hint))
+                return 0;
+    }
+    return 1;
+}
+
+// Reads the descriptors back and checks they describe the module list
+static int parse_back(const module_node *list, const unsigned char *section, uint32_t section_rva, size_t section_size, size_t directory, int use_oft, const iat_t *iat, size_t pointer)
+{
+    uint64_t flag = pointer == 8 ? 0x8000000000000000ULL : 0x80000000;
+    const module_node *module = list;
+    const thunk_node *thunk = list ? list->thunks : NULL;
+
+    for (const unsigned char *descriptor = section + directory; get32(descriptor + 12) || get32(descriptor + 16); descriptor += DESCRIPTOR_SIZE) {
+        uint32_t name = get32(descriptor + 12), first = get32(descriptor + 16), oft = get32(descriptor);
+        if (name < section_rva || name - section_rva >= section_size)
+            return 0;
+        // Runs after the first share the module's descriptor name
+        while (module && !thunk && module->next && module->firstThunk != first) {
+            module = module->next;
+            thunk = module->thunks;
+        }
+        if (!module || strcmp((const char *)section + (name - section_rva), module->moduleName))
+            return 0;
+        for (size_t i = 0;; i++) {
+            const unsigned char *at = use_oft ? section + (oft - section_rva) + i * pointer : slot((iat_t *)iat, first + i * pointer);
+            uint64_t value = at ? get_pointer(at, pointer) : 0;
+            if (!value)
+                break;
+            if (!thunk || thunk->rva != first + i * pointer)
+                return 0;
+            if (value & flag) {
+                if (thunk->name[0] || (uint16_t)value != thunk->ordinal)
+                    return 0;
+            }
+            else if (value - section_rva >= section_size || get16(section + (value - section_rva)) != thunk->hint
+                || strcmp((const char *)section + (value - section_rva) + 2, thunk->name))
+                return 0;
+            thunk = thunk->next;
+        }
+        if (!thunk && module->next) {
+            module = module->next;
+            thunk = module->thunks;
+        }
+    }
+    return !thunk && (!module || !module->next);
+}
+
+// Rebuilds list both ways in every mode, returning how many were compared;
+// slots are spacing apart in the IAT the list was read from
+static int compare(const module_node *list, uint64_t iat_rva, size_t iat_size, size_t spacing, const char *what)
+{
+    int compared = 0;
+
+    for (int mode = 0; mode < 8; mode++) {
+        size_t pointer = mode & 1 ? 8 : 4, start = mode & 4 ? 0x40 + iat_size : 0;
+        int use_oft = (mode & 2) != 0, move = (mode & 4) != 0;
+        uint32_t section_rva = (uint32_t)((iat_rva + iat_size + 0x10FFF) & ~0xFFFULL);
+        module_node *old_list = copy_list(list);
+        IMPORTTABLE table;
+        IMPORTLAYOUT layout;
+        sizes_t sizes;
+        uint64_t new_iat = section_rva + 0x40;
+
+        if (!flatten(list, &table)) {
+            CHECK(0, "%s: could not flatten", what);
+            free_list(old_list);
+            return compared;
+        }
+        // enableNewIatInSection moves the IAT into the new section, after
+        // the jump table
+        if (move) {
+            old_move(old_list, iat_rva, new_iat);
+            ImportTableMove(&table, iat_rva, new_iat);
+        }
+
+        old_sizes(old_list, pointer, &sizes);
+        ImportTableLayout(&table, pointer, &layout);
+        CHECK(sizes.descriptors == layout.Descriptors && sizes.names == layout.NamesSize && sizes.thunks == layout.ThunksSize && sizes.size == layout.Size,
+            "%s mode %d: sizes %zu %zu %zu %zu, expected %zu %zu %zu %zu", what, mode, layout.Descriptors, layout.NamesSize, layout.ThunksSize, layout.Size,
+            sizes.descriptors, sizes.names, sizes.thunks, sizes.size);
+
+        size_t section_size = start + sizes.size;
+        unsigned char *old_section = calloc(section_size + 16, 1), *new_section = calloc(section_size + 16, 1);
+        iat_t old_iat = { calloc(iat_size + 16, 1), move ? new_iat : iat_rva, iat_size + 16 };
+        iat_t new_iat_buffer = { calloc(iat_size + 16, 1), old_iat.rva, iat_size + 16 };
+        if (move) {
+            // which then lies in the section itself
+            free(old_iat.data);
+            free(new_iat_buffer.data);
+            old_iat.data = old_section + 0x40;
+            new_iat_buffer.data = new_section + 0x40;
+            old_iat.size = new_iat_buffer.size = iat_size;
+            memset(old_section, 0xFF, start);
+            memset(new_section, 0xFF, start);
+        }
+
+        size_t old_end = old_fill(old_list, &sizes, pointer, old_section, section_rva, start, use_oft, &old_iat);
+        size_t new_end = ImportTableWrite(&table, &layout, pointer, new_section, section_rva, start, use_oft, slot, &new_iat_buffer);
+        CHECK(old_end == new_end, "%s mode %d: section ends at %zu, expected %zu", what, mode, new_end, old_end);
+        CHECK(!memcmp(old_section, new_section, section_size + 16), "%s mode %d: section written differently", what, mode);
+        if (!move)
+            CHECK(!memcmp(old_iat.data, new_iat_buffer.data, iat_size + 16), "%s mode %d: IAT written differently", what, mode);
+        if (old_end && !move && pointer <= spacing)
+            CHECK(parse_back(list, new_section, section_rva, section_size, start + (use_oft ? layout.ThunksSize : 0), use_oft, &new_iat_buffer, pointer),
+                "%s mode %d: does not parse back to the module list", what, mode);
+        compared++;
+
+        if (!move) {
+            free(old_iat.data);
+            free(new_iat_buffer.data);
+        }
+        free(old_section);
+        free(new_section);
+        ImportTableFree(&table);
+        free_list(old_list);
+    }
+    return compared;
+}
+
+static void random_name(char *name, size_t length)
+{
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    for (size_t i = 0; i < length; i++)
+        name[i] = letters[next_random() % (sizeof(letters) - 1)];
+    name[length] = 0;
+}
+
+// A module list over an IAT at iat_rva, with a null slot between modules and
+// sometimes breaks in a module's thunks
+static module_node *random_list(uint64_t iat_rva, size_t pointer, int modules, int thunks, uint64_t *iat_size)
+{
+    module_node *list = NULL;
+    uint64_t rva = iat_rva;
+    char name[MAX_PATH];
+
+    for (int m = 0; m < modules; m++) {
+        random_name(name, next_random() % 8 == 0 ? 200 + next_random() % 55 : 4 + next_random() % 12);
+        strcat(name, ".dll");
+        module_node *module = add_module(&list, rva, name);
+        int count = thunks ? thunks : (int)(next_random() % 40);
+        for (int t = 0; t < count; t++) {
+            if (t && next_random() % 24 == 0)
+                rva += pointer * (1 + next_random() % 3);
+            if (next_random() % 6 == 0)
+                add_thunk(module, rva, "", (uint16_t)next_random(), 0);
+            else {
+                random_name(name, next_random() % 32 == 0 ? 200 + next_random() % 59 : 3 + next_random() % 24);
+                add_thunk(module, rva, name, 0, (uint16_t)next_random());
+            }
+            rva += pointer;
+        }
+        rva += pointer;
+    }
+    *iat_size = rva - iat_rva + pointer;
+    return list;
+}
+
+static void test_generated(void)
+{
+    int lists = 0, compared = 0;
+
+    for (int trial = 0; trial < 300; trial++) {
+        uint64_t iat_rva = 0x1000 * (1 + next_random() % 64), iat_size;
+        module_node *list = random_list(iat_rva, 8, (int)(next_random() % 24), 0, &iat_size);
+        char what[32];
+        snprintf(what, sizeof(what), "list %d", trial);
+        compared += compare(list, iat_rva, iat_size, 8, what);
+        free_list(list);
+        lists++;
+    }
+
+    // A thunk outside the IAT section fails both ways
+    module_node *list = NULL;
+    module_node *module = add_module(&list, 0x2000, "kernel32.dll");
+    add_thunk(module, 0x2000, "Sleep", 0, 1);
+    add_thunk(module, 0x9000, "ExitProcess", 0, 2);
+    IMPORTTABLE table;
+    IMPORTLAYOUT layout;
+    unsigned char section[0x400] = { 0 }, iat_data[0x40] = { 0 };
+    iat_t iat = { iat_data, 0x2000, sizeof(iat_data) };
+    flatten(list, &table);
+    ImportTableLayout(&table, 8, &layout);
+    CHECK(ImportTableWrite(&table, &layout, 8, section, 0x10000, 0, 0, slot, &iat) == 0, "thunk outside the IAT written");
+    CHECK(layout.Descriptors == 3, "%zu descriptors for a module in two runs", layout.Descriptors);
+    ImportTableFree(&table);
+    free_list(list);
+
+    // Names too long for the pool entries are refused
+    char *long_name = malloc(0x10001);
+    memset(long_name, 'a', 0x10000);
+    long_name[0x10000] = 0;
+    ImportTableInit(&table, 0, 0, 0);
+    CHECK(!ImportTableAddEntry(&table, 0x1000, "Sleep", 0, 0), "entry added without a module");
+    CHECK(ImportTableAddModule(&table, 0x1000, "kernel32.dll") && !ImportTableAddModule(&table, 0x1000, long_name), "long module name added");
+    CHECK(!ImportTableAddEntry(&table, 0x1000, long_name, 0, 0) && table.EntryCount == 0, "long import name added");
+    ImportTableFree(&table);
+    free(long_name);
+
+    printf("%d generated module lists rebuilt %d ways\n", lists, compared);
+}
+
+// RVA to file offset, or 0
+static uint64_t file_offset(long size, const unsigned char *headers, int sections, uint64_t rva)
+{
+    for (int i = 0; i < sections; i++) {
+        const unsigned char *header = headers + i * 40;
+        uint32_t va = get32(header + 12), vs = get32(header + 8), raw = get32(header + 20), raw_size = get32(header + 16);
+        if (rva >= va && rva < (uint64_t)va + (vs > raw_size ? vs : raw_size) && rva - va < raw_size && raw + (rva - va) < (uint64_t)size)
+            return raw + (rva - va);
+    }
+    return 0;
+}
+
+static void test_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    unsigned char *file;
+    long size;
+
+    if (!f)
+        return;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    file = malloc(size + 1);
+    if (fread(file, 1, size, f) != (size_t)size)
+        size = 0;
+    fclose(f);
+
+    uint32_t lfanew = size > 0x40 ? get32(file + 0x3c) : 0;
+    if (size < 0x40 || get16(file) != 0x5A4D || (uint64_t)lfanew + 0x108 > (uint64_t)size || get32(file + lfanew) != 0x4550) {
+        printf("%s: not a PE file\n", path);
+        free(file);
+        return;
+    }
+    const unsigned char *optional = file + lfanew + 24;
+    int pe64 = get16(optional) == 0x20B;
+    size_t pointer = pe64 ? 8 : 4;
+    const unsigned char *directory = optional + (pe64 ? 112 : 96) + 8;
+    const unsigned char *headers = optional + get16(file + lfanew + 20);
+    int sections = get16(file + lfanew + 6);
+
+    module_node *list = NULL;
+    uint64_t low = UINT64_MAX, high = 0;
+    size_t imports = 0;
+    uint64_t at = file_offset(size, headers, sections, get32(directory));
+    for (; at && at + DESCRIPTOR_SIZE <= (uint64_t)size && get32(file + at + 12); at += DESCRIPTOR_SIZE) {
+        uint32_t oft = get32(file + at), first = get32(file + at + 16);
+        uint64_t name = file_offset(size, headers, sections, get32(file + at + 12)), thunks = file_offset(size, headers, sections, oft ? oft : first);
+        if (!name || !thunks)
+            break;
+        module_node *module = add_module(&list, first, (const char *)file + name);
+        for (uint64_t i = 0; thunks + (i + 1) * pointer <= (uint64_t)size; i++) {
+            uint64_t value = get_pointer(file + thunks + i * pointer, pointer), by_name;
+            if (!value)
+                break;
+            if (value >> (pointer * 8 - 1))
+                add_thunk(module, first + i * pointer, "", (uint16_t)value, 0);
+            else if ((by_name = file_offset(size, headers, sections, value)))
+                add_thunk(module, first + i * pointer, (const char *)file + by_name + 2, 0, get16(file + by_name));
+            imports++;
+            if (first + i * pointer > high)
+                high = first + i * pointer;
+        }
+        if (first < low)
+            low = first;
+    }
+
+    if (!list) {
+        printf("%s: no imports\n", path);
+        free(file);
+        return;
+    }
+
+    int modules = 0;
+    for (module_node *module = list; module; module = module->next)
+        modules++;
+    compare(list, low, high - low + 2 * pointer, pointer, path);
+    printf("%s: %s, %d modules, %zu imports rebuilt 8 ways\n", path, pe64 ? "PE32+" : "PE32", modules, imports);
+    free_list(list);
+    free(file);
+}
+
+static void bench(void)
+{
+    enum { MODULES = 300, THUNKS = 40, ROUNDS = 20 };
+    uint64_t iat_rva = 0x20000, iat_size;
+    module_node *list = random_list(iat_rva, 8, MODULES, THUNKS, &iat_size);
+    double old_ms = 0, new_ms = 0;
+    size_t old_allocations = 0, new_allocations = 0, old_bytes = 0, new_bytes = 0;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        unsigned char *iat_data = calloc(iat_size + 16, 1);
+        iat_t iat = { iat_data, iat_rva, iat_size + 16 };
+        size_t before = allocations, bytes = allocated;
+        double start = now();
+        module_node *copy = copy_list(list);
+        sizes_t sizes;
+        old_sizes(copy, 8, &sizes);
+        unsigned char *section = calloc(sizes.size, 1);
+        old_fill(copy, &sizes, 8, section, 0x100000, 0, 1, &iat);
+        free_list(copy);
+        old_ms += now() - start;
+        old_allocations += allocations - before;
+        old_bytes += allocated - bytes;
+        free(section);
+
+        IMPORTTABLE table;
+        IMPORTLAYOUT layout;
+        before = allocations;
+        bytes = allocated;
+        start = now();
+        flatten(list, &table);
+        ImportTableLayout(&table, 8, &layout);
+        section = calloc(layout.Size, 1);
+        ImportTableWrite(&table, &layout, 8, section, 0x100000, 0, 1, slot, &iat);
+        ImportTableFree(&table);
+        new_ms += now() - start;
+        new_allocations += allocations - before;
+        new_bytes += allocated - bytes;
+        free(section);
+        free(iat_data);
+    }
+    printf("%d modules, %d imports: map copy and two passes %.2f ms, %zu allocations of %zuKB; flat %.2f ms, %zu allocations of %zuKB, %.2fx\n",
+        MODULES, MODULES * THUNKS, old_ms / ROUNDS, old_allocations / ROUNDS, old_bytes / ROUNDS >> 10,
+        new_ms / ROUNDS, new_allocations / ROUNDS, new_bytes / ROUNDS >> 10, old_ms / new_ms);
+    free_list(list);
+}
+
+int main(int argc, char **argv)
+{
+    int bench_mode = argc > 1 && !strcmp(argv[1], "bench");
+
+    test_generated();
+    for (int i = bench_mode ? 2 : 1; i < argc; i++)
+        test_file(argv[i]);
+    if (bench_mode)
+        bench();
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+    return failures != 0;
+}
@@ -0,0 +1,211 @@
+// Replays synthetic injection event streams (process create/open, handle
+// reuse, section maps, drops) against the pid/handle maps used by
+// Injection.c, checking them against the linked-list bookkeeping they
+// replace. Portable harness, build on Linux with:
+//   gcc -O2 -Wall -I../CAPE -o injection-index injection-index.c ../CAPE/PtrMap.c
+// Run "./injection-index bench" for lookup throughput.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "PtrMap.h"
+
+#define MAX_INFOS 512
+
+typedef struct info {
+    uintptr_t pid, handle;
+    struct info *next;
+} info_t;
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// The original bookkeeping: a list walked front to back
+static info_t *list;
+
+static info_t *list_by_pid(uintptr_t pid)
+{
+    for (info_t *i = list; i; i = i->next)
+        if (i->pid == pid)
+            return i;
+    return NULL;
+}
+
+static info_t *list_by_handle(uintptr_t handle)
+{
+    for (info_t *i = list; i; i = i->next)
+        if (i->handle == handle)
+            return i;
+    return NULL;
+}
+
+static PTRMAP by_pid, by_handle;
+
+// Mirrors SetInjectionInfoHandle in Injection.c
+static void set_handle(info_t *info, uintptr_t handle)
+{
+    if (info->handle && PtrMapGet(&by_handle, info->handle) == info)
+        PtrMapRemove(&by_handle, info->handle);
+    info->handle = handle;
+    if (handle)
+        PtrMapSet(&by_handle, handle, info);
+}
+
+static void test_event_stream(void)
+{
+    int infos = 0;
+
+    PtrMapInit(&by_pid);
+    PtrMapInit(&by_handle);
+    list = NULL;
+
+    for (int step = 0; step < 300000; step++) {
+        uintptr_t pid = 4 * (1 + next_random() % 600);
+        // a small handle space forces reuse across processes
+        uintptr_t handle = 4 * (1 + next_random() % 300);
+        int op = next_random() % 100;
+        info_t *info = list_by_pid(pid);
+
+        if (op < 20) {
+            // CreateProcess / OpenProcess / first write: create or re-handle
+            if (!info && infos < MAX_INFOS) {
+                info = calloc(1, sizeof(info_t));
+                info->pid = pid;
+                // appended, as TerminateHandler relies on creation order
+                info_t **tail = &list;
+                while (*tail)
+                    tail = &(*tail)->next;
+                *tail = info;
+                infos++;
+                CHECK(PtrMapSet(&by_pid, pid, info), "set pid");
+            }
+            if (info) {
+                // a recycled handle value now refers to this process
+                info_t *old = list_by_handle(handle);
+                if (old && old != info)
+                    old->handle = 0;
+                set_handle(info, handle);
+            }
+        } else if (op < 30) {
+            // DropInjectionInfo (process closed)
+            info_t *drop = PtrMapGet(&by_handle, handle);
+            CHECK(drop == list_by_handle(handle), "drop lookup");
+            if (drop) {
+                info_t **p = &list;
+                while (*p != drop)
+                    p = &(*p)->next;
+                *p = drop->next;
+                PtrMapRemove(&by_handle, handle);
+                CHECK(PtrMapRemove(&by_pid, drop->pid) == drop, "drop pid");
+                free(drop);
+                infos--;
+            }
+        } else {
+            // lookups from the map/resume/context handlers
+            CHECK(PtrMapGet(&by_pid, pid) == info, "pid %lu", (unsigned long)pid);
+            CHECK(PtrMapGet(&by_handle, handle) == list_by_handle(handle), "handle %lx", (unsigned long)handle);
+        }
+        CHECK(by_pid.Count == (size_t)infos, "pid count %zu %d", by_pid.Count, infos);
+    }
+
+    while (list) {
+        info_t *next = list->next;
+        free(list);
+        list = next;
+    }
+    PtrMapFree(&by_pid);
+    PtrMapFree(&by_handle);
+}
+
+static void test_map_churn(void)
+{
+    // dense inserts and removals exercise backward-shift deletion
+    static void *oracle[4096];
+    PTRMAP map;
+
+    PtrMapInit(&map);
+    CHECK(PtrMapGet(&map, 0) == NULL && PtrMapRemove(&map, 0) == NULL, "empty map");
+    CHECK(!PtrMapSet(&map, 1, NULL), "null value");
+    for (int step = 0; step < 1000000; step++) {
+        uintptr_t key = next_random() % 4096;
+        void *value = (void *)(uintptr_t)(step + 1);
+        if (next_random() % 3) {
+            CHECK(PtrMapSet(&map, key << 2, value), "set");
+            oracle[key] = value;
+        } else {
+            CHECK(PtrMapRemove(&map, key << 2) == oracle[key], "remove %lu", (unsigned long)key);
+            oracle[key] = NULL;
+        }
+        if (step % 10000 == 0) {
+            size_t count = 0;
+            for (int k = 0; k < 4096; k++) {
+                CHECK(PtrMapGet(&map, (uintptr_t)k << 2) == oracle[k], "get %d", k);
+                count += oracle[k] != NULL;
+            }
+            CHECK(map.Count == count, "count");
+        }
+    }
+    PtrMapFree(&map);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(void)
+{
+    static const size_t sizes[] = {16, 256, 4096};
+    size_t lookups = 4000000, hits = 0;
+
+    for (int k = 0; k < 3; k++) {
+        size_t n = sizes[k];
+        info_t *infos = calloc(n, sizeof(info_t));
+        double t0, t1, t2;
+
+        PtrMapInit(&by_pid);
+        list = NULL;
+        for (size_t i = 0; i < n; i++) {
+            infos[i].pid = 4 * (i + 1);
+            infos[i].next = list;
+            list = &infos[i];
+            PtrMapSet(&by_pid, infos[i].pid, &infos[i]);
+        }
+        t0 = now();
+        for (size_t i = 0; i < lookups; i++)
+            hits += PtrMapGet(&by_pid, 4 * (1 + next_random() % (n * 2))) != NULL;
+        t1 = now();
+        for (size_t i = 0; i < lookups / 100; i++)
+            hits += list_by_pid(4 * (1 + next_random() % (n * 2))) != NULL;
+        t2 = now();
+        printf("%5zu processes: map lookup %6.1f ns, list walk %8.1f ns (%zu hits)\n", n,
+            (t1 - t0) / lookups * 1e9, (t2 - t1) / (lookups / 100) * 1e9, hits);
+        PtrMapFree(&by_pid);
+        free(infos);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    test_map_churn();
+    test_event_stream();
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        bench();
+
+    return failures != 0;
+}
@@ -0,0 +1,324 @@
+// Tests for the registry key path building behind get_key_path and the
+// per-handle cache of kernel key names: predefined roots, subkeys joined with
+// embedded nulls written out, \REGISTRY prefixes rewritten to HKEY_ names,
+// and handle values closed and reused for other keys. Portable harness, build
+// on Linux with:
+//   gcc -O2 -Wall -pthread -I../CAPE -o key-path key-path.c ../CAPE/KeyPath.c ../CAPE/PathCache.c ../CAPE/Xxh64.c
+// Run "./key-path bench" for an enumeration-heavy replay.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include "KeyPath.h"
+#include "PathCache.h"
+
+#define SIZE 512
+#define HANDLES 256
+
+static const wchar_t user_key[] = L"\\REGISTRY\\USER\\S-1-5-21-3623811015-3361044348-30300820-1013";
+static size_t user_key_length;
+
+// What NtQueryKey would return for each open handle value
+static const wchar_t *kernel_names[HANDLES];
+static unsigned long queries;
+static PPATHCACHE cache;
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// Mirrors get_key_path for a key relative to a root handle
+static size_t resolve(uintptr_t root, const wchar_t *subkey, size_t subkey_length, wchar_t *path, size_t size)
+{
+    const wchar_t *name = KeyPathPredefinedRoot(root);
+    size_t length;
+
+    if (name) {
+        wcscpy(path, name);
+        length = wcslen(name);
+    } else {
+        length = PathCacheLookup(cache, root, L"", 0, path, size);
+        if (!length) {
+            queries++;
+            name = kernel_names[root / 4];
+            if (!name)
+                return 0;
+            length = wcslen(name);
+            if (length >= size)
+                return 0;
+            wcscpy(path, name);
+            PathCacheInsert(cache, root, L"", 0, path, length);
+        }
+    }
+
+    length = KeyPathJoin(path, size, length, subkey, subkey_length);
+    if (!length)
+        return 0;
+
+    return KeyPathNormalize(path, size, length, user_key, user_key_length);
+}
+
+static void close_key(uintptr_t handle)
+{
+    kernel_names[handle / 4] = NULL;
+    PathCacheDropRoot(cache, handle);
+}
+
+static int resolves_to(uintptr_t root, const wchar_t *subkey, const wchar_t *expected)
+{
+    wchar_t path[SIZE];
+    size_t length = resolve(root, subkey, wcslen(subkey), path, SIZE);
+    if (length != wcslen(expected) || wcscmp(path, expected)) {
+        printf("  got \"%ls\" (%zu)\n  expected \"%ls\"\n", path, length, expected);
+        return 0;
+    }
+    return 1;
+}
+
+static void test_predefined(void)
+{
+    static const struct {
+        uint32_t value;
+        const wchar_t *name;
+    } roots[] = {
+        {0x80000000, L"HKEY_CLASSES_ROOT"},
+        {0x80000001, L"HKEY_CURRENT_USER"},
+        {0x80000002, L"HKEY_LOCAL_MACHINE"},
+        {0x80000003, L"HKEY_USERS"},
+        {0x80000004, L"HKEY_PERFORMANCE_DATA"},
+        {0x80000050, L"HKEY_PERFORMANCE_TEXT"},
+        {0x80000060, L"HKEY_PERFORMANCE_NLSTEXT"},
+        {0x80000005, L"HKEY_CURRENT_CONFIG"},
+        {0x80000006, L"HKEY_DYN_DATA"},
+        {0x80000007, L"HKEY_CURRENT_USER_LOCAL_SETTINGS"},
+    };
+
+    for (size_t i = 0; i < sizeof(roots) / sizeof(roots[0]); i++) {
+        const wchar_t *name = KeyPathPredefinedRoot(KEY_PATH_ROOT(roots[i].value));
+        CHECK(name && !wcscmp(name, roots[i].name), "root %08x", roots[i].value);
+    }
+    CHECK(KeyPathPredefinedRoot(KEY_PATH_ROOT(0x80000008)) == NULL, "not predefined");
+    CHECK(KeyPathPredefinedRoot(0x1c4) == NULL, "open key");
+    CHECK(KeyPathPredefinedRoot(0) == NULL, "null");
+    if (sizeof(uintptr_t) == 8)
+        CHECK(KeyPathPredefinedRoot(0x80000002) == NULL, "predefined values are sign extended");
+
+    // Never queried or cached
+    queries = 0;
+    CHECK(resolves_to(KEY_PATH_ROOT(0x80000002), L"SOFTWARE\\Microsoft\\Windows", L"HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\Windows"), "hklm");
+    CHECK(resolves_to(KEY_PATH_ROOT(0x80000001), L"Software", L"HKEY_CURRENT_USER\\Software"), "hkcu");
+    CHECK(resolves_to(KEY_PATH_ROOT(0x80000000), L"", L"HKEY_CLASSES_ROOT\\"), "empty subkey");
+    CHECK(queries == 0, "predefined roots queried %lu times", queries);
+}
+
+static void test_join(void)
+{
+    wchar_t path[SIZE];
+    static const wchar_t with_nulls[] = {L'a', L'\0', L'b', L'\0'};
+    size_t length;
+
+    wcscpy(path, L"HKEY_USERS");
+    length = KeyPathJoin(path, SIZE, 10, with_nulls, 4);
+    CHECK(length == 21 && !wcscmp(path, L"HKEY_USERS\\a\\x00b\\x00"), "nulls written out: %ls", path);
+    CHECK(KeyPathEncodedLength(with_nulls, 4) == 10 && KeyPathEncodedLength(with_nulls, 0) == 0, "encoded length");
+
+    // Fits exactly with its terminator, or not at all
+    wcscpy(path, L"HKEY_USERS");
+    CHECK(KeyPathJoin(path, 15, 10, L"abc", 3) == 14 && !wcscmp(path, L"HKEY_USERS\\abc"), "exact fit");
+    wcscpy(path, L"HKEY_USERS");
+    CHECK(KeyPathJoin(path, 14, 10, L"abc", 3) == 0 && !wcscmp(path, L"HKEY_USERS"), "one short");
+    CHECK(KeyPathJoin(path, 20, 10, with_nulls, 4) == 0, "encoding counted");
+
+    // Only the given length of the subkey is used
+    wcscpy(path, L"HKEY_USERS");
+    CHECK(KeyPathJoin(path, SIZE, 10, L"abcdef", 2) == 13 && !wcscmp(path, L"HKEY_USERS\\ab"), "subkey length");
+}
+
+static int normalizes_to(const wchar_t *kernel_name, const wchar_t *expected)
+{
+    wchar_t path[SIZE];
+    size_t length;
+
+    wcscpy(path, kernel_name);
+    length = KeyPathNormalize(path, SIZE, wcslen(path), user_key, user_key_length);
+    if (length != wcslen(expected) || wcscmp(path, expected)) {
+        printf("  got \"%ls\" (%zu)\n  expected \"%ls\"\n", path, length, expected);
+        return 0;
+    }
+    return 1;
+}
+
+static void test_normalize(void)
+{
+    wchar_t path[32];
+
+    CHECK(normalizes_to(L"\\REGISTRY\\MACHINE\\SOFTWARE\\Classes", L"HKEY_LOCAL_MACHINE\\SOFTWARE\\Classes"), "machine");
+    CHECK(normalizes_to(L"\\REGISTRY\\MACHINE", L"HKEY_LOCAL_MACHINE"), "machine root");
+    CHECK(normalizes_to(L"\\Registry\\Machine\\System", L"HKEY_LOCAL_MACHINE\\System"), "case");
+    CHECK(normalizes_to(L"\\REGISTRY\\MACHINEX\\a", L"\\REGISTRY\\MACHINEX\\a"), "not at a boundary");
+    CHECK(normalizes_to(L"\\REGISTRY\\USER\\.DEFAULT\\Control Panel", L"HKEY_USERS\\.DEFAULT\\Control Panel"), "users");
+    CHECK(normalizes_to(L"\\REGISTRY\\USER\\S-1-5-18", L"HKEY_USERS\\S-1-5-18"), "another user");
+    CHECK(normalizes_to(L"\\REGISTRY\\USER\\S-1-5-21-3623811015-3361044348-30300820-1013\\Software\\Run", L"HKEY_CURRENT_USER\\Software\\Run"), "current user");
+    CHECK(normalizes_to(L"\\REGISTRY\\USER\\S-1-5-21-3623811015-3361044348-30300820-1013", L"HKEY_CURRENT_USER"), "current user root");
+    CHECK(normalizes_to(L"\\REGISTRY\\USER\\s-1-5-21-3623811015-3361044348-30300820-1013_CLASSES\\CLSID", L"HKEY_CURRENT_USER\\Software\\Classes\\CLSID"), "user classes");
+    CHECK(normalizes_to(L"\\REGISTRY\\USER\\S-1-5-21-3623811015-3361044348-30300820-10134\\x", L"HKEY_USERS\\S-1-5-21-3623811015-3361044348-30300820-10134\\x"), "longer sid");
+    CHECK(normalizes_to(L"HKEY_LOCAL_MACHINE\\SOFTWARE", L"HKEY_LOCAL_MACHINE\\SOFTWARE"), "already normal");
+    CHECK(normalizes_to(L"\\REGISTRY\\A", L"\\REGISTRY\\A"), "other hive");
+
+    // Without the user's key, only the machine and users prefixes change
+    wcscpy(path, L"\\REGISTRY\\USER\\S-1");
+    CHECK(KeyPathNormalize(path, 32, wcslen(path), NULL, 0) == 14 && !wcscmp(path, L"HKEY_USERS\\S-1"), "no user key");
+
+    // \REGISTRY\MACHINE grows by one character, which must fit
+    wcscpy(path, L"\\REGISTRY\\MACHINE\\ab");
+    CHECK(KeyPathNormalize(path, 21, 20, NULL, 0) == 20 && !wcscmp(path, L"\\REGISTRY\\MACHINE\\ab"), "no room");
+    CHECK(KeyPathNormalize(path, 22, 20, NULL, 0) == 21 && !wcscmp(path, L"HKEY_LOCAL_MACHINE\\ab"), "room");
+}
+
+// Open keys are queried once per handle until closed; a reused handle value
+// gets the new key's name
+static void test_handles(void)
+{
+    wchar_t path[SIZE];
+
+    cache = PathCacheCreate(64);
+    queries = 0;
+
+    kernel_names[0x1c4 / 4] = L"\\REGISTRY\\MACHINE\\SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Run";
+    kernel_names[0x1c8 / 4] = L"\\REGISTRY\\USER\\S-1-5-21-3623811015-3361044348-30300820-1013\\Environment";
+
+    for (int i = 0; i < 100; i++) {
+        CHECK(resolves_to(0x1c4, L"Updater", L"HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Run\\Updater"), "run key");
+        CHECK(resolves_to(0x1c8, L"TEMP", L"HKEY_CURRENT_USER\\Environment\\TEMP"), "environment");
+    }
+    CHECK(queries == 2, "queried %lu times", queries);
+
+    close_key(0x1c4);
+    CHECK(resolve(0x1c4, L"x", 1, path, SIZE) == 0 && queries == 3, "closed handle is queried and fails");
+    kernel_names[0x1c4 / 4] = L"\\REGISTRY\\MACHINE\\SYSTEM\\ControlSet001\\Services";
+    CHECK(resolves_to(0x1c4, L"Disk\\Enum", L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Services\\Disk\\Enum"), "reused handle");
+    CHECK(resolves_to(0x1c8, L"TEMP", L"HKEY_CURRENT_USER\\Environment\\TEMP"), "other handle kept");
+    CHECK(queries == 4, "queried %lu times", queries);
+
+    // A name that fills the buffer is rejected once joined
+    CHECK(resolve(0x1c4, L"x", 1, path, 47) == 0, "name too long");
+    CHECK(resolve(0x1c4, L"x", 1, path, 49) == 0, "subkey too long");
+    CHECK(resolve(0x1c4, L"x", 1, path, 51) == 50 && !wcscmp(path, L"HKEY_LOCAL_MACHINE\\SYSTEM\\ControlSet001\\Services\\x"), "long enough");
+
+    close_key(0x1c4);
+    close_key(0x1c8);
+    PathCacheDestroy(cache);
+}
+
+// Random opens, closes and lookups over a handle table, against the names
+// that would be built without the cache
+static void test_random(void)
+{
+    static wchar_t names[HANDLES][64];
+    wchar_t path[SIZE], expected[SIZE];
+
+    cache = PathCacheCreate(32);
+
+    for (int step = 0; step < 100000; step++) {
+        uintptr_t handle = (1 + next_random() % (HANDLES - 1)) * 4;
+        int op = next_random() % 4;
+
+        if (op == 0) {
+            if (kernel_names[handle / 4])
+                close_key(handle);
+            swprintf(names[handle / 4], 64, L"\\REGISTRY\\MACHINE\\SOFTWARE\\k%d", (int)(next_random() % 1000));
+            kernel_names[handle / 4] = names[handle / 4];
+        } else if (op == 1) {
+            if (kernel_names[handle / 4])
+                close_key(handle);
+        } else {
+            size_t length = resolve(handle, L"v", 1, path, SIZE);
+            if (!kernel_names[handle / 4])
+                CHECK(length == 0, "step %d: closed handle resolved", step);
+            else {
+                swprintf(expected, SIZE, L"HKEY_LOCAL_MACHINE%ls\\v", kernel_names[handle / 4] + 17);
+                CHECK(length == wcslen(expected) && !wcscmp(path, expected), "step %d: %ls", step, path);
+            }
+        }
+    }
+
+    for (int i = 0; i < HANDLES; i++)
+        kernel_names[i] = NULL;
+    PathCacheDestroy(cache);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A sample walking the uninstall and services keys: each subkey is opened,
+// every value queried, and the key closed, with the parent handle used for
+// every enumeration step. Kernel queries stand in for NtQueryKey.
+static void bench(void)
+{
+    enum { KEYS = 200, VALUES = 40 };
+    static wchar_t names[KEYS + 1][96];
+    wchar_t path[SIZE], value[32];
+    unsigned long uncached_queries = 0;
+    size_t total = 0;
+    double t0, t1;
+
+    cache = PathCacheCreate(512);
+    queries = 0;
+    swprintf(names[0], 96, L"\\REGISTRY\\MACHINE\\SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Uninstall");
+    kernel_names[1] = names[0];
+
+    t0 = now();
+    for (int round = 0; round < 10; round++) {
+        for (int k = 0; k < KEYS; k++) {
+            uintptr_t handle = 8 + (k % 16) * 4;
+            swprintf(names[k + 1], 96, L"%ls\\{%08x-0000-0000-0000-%012x}", names[0], k, k * 7);
+            total += resolve(4, names[k + 1] + wcslen(names[0]) + 1, 38, path, SIZE);   // RegEnumKeyExW
+            kernel_names[handle / 4] = names[k + 1];
+            uncached_queries++;
+            for (int v = 0; v < VALUES; v++) {
+                swprintf(value, 32, L"Value%d", v);
+                total += resolve(handle, value, wcslen(value), path, SIZE);      // RegQueryValueExW
+                uncached_queries++;
+            }
+            close_key(handle);
+        }
+    }
+    t1 = now();
+
+    printf("%d keys x %d values x 10 rounds: %lu kernel queries (%lu without the cache), %.0f ns per path (%zu)\n",
+        KEYS, VALUES, queries, uncached_queries, (t1 - t0) / (10 * KEYS * (VALUES + 1)) * 1e9, total);
+
+    kernel_names[1] = NULL;
+    PathCacheDestroy(cache);
+}
+
+int main(int argc, char **argv)
+{
+    user_key_length = wcslen(user_key);
+
+    test_predefined();
+    test_join();
+    test_normalize();
+    test_handles();
+    test_random();
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        bench();
+
+    return failures != 0;
+}
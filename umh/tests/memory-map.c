@@ -0,0 +1,492 @@
+// Tests for the address space snapshot behind ProcessAccessHelp's memory
+// queries and partial reads. An arena of this process is carved into
+// readable, executable, inaccessible and unmapped regions, which stand in for
+// a target's committed, guarded and free memory: lookups are checked against
+// querying the OS directly, and reads against the arena's contents with
+// zeroes for the gaps. A fake OS covers reads that fail in bulk but not one
+// region at a time, and regions that change after the snapshot was taken.
+// Portable harness, build on Linux with:
+//   gcc -O2 -Wall -I../CAPE -o memory-map memory-map.c ../CAPE/MemoryMap.c
+// The OS is queried through /proc/self/maps and read with process_vm_readv.
+// Run "./memory-map bench" for the queries a dump's reads and page checks
+// make with and without the snapshot.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "MemoryMap.h"
+
+#define PAGE 0x1000
+#define USER_SPACE_END 0x800000000000ULL
+
+#define PAGE_NOACCESS 0x01
+#define PAGE_READONLY 0x02
+#define PAGE_READWRITE 0x04
+#define PAGE_EXECUTE 0x10
+#define PAGE_EXECUTE_READ 0x20
+#define PAGE_EXECUTE_READWRITE 0x40
+#define MEM_PRIVATE 0x20000
+#define MEM_MAPPED 0x40000
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// The OS as VirtualQueryEx and ReadProcessMemory would see this process:
+// mappings are committed, gaps between them free
+static size_t os_queries, os_reads;
+
+static int linux_query(void *context, uint64_t address, PMEMREGION region)
+{
+    FILE *f = fopen("/proc/self/maps", "r");
+    unsigned long long start, end, previous = 0;
+    char perms[8], line[512];
+    int found = 0;
+
+    (void)context;
+    os_queries++;
+    if (!f || address >= USER_SPACE_END) {
+        if (f)
+            fclose(f);
+        return 0;
+    }
+    memset(region, 0, sizeof(*region));
+    while (!found && fgets(line, sizeof(line), f)) {
+        unsigned long long offset;
+        unsigned long inode;
+        if (sscanf(line, "%llx-%llx %7s %llx %*s %lu", &start, &end, perms, &offset, &inode) != 5 || start >= USER_SPACE_END)
+            continue;
+        if (address < start) {
+            region->Base = previous;
+            region->Size = start - previous;
+            found = 1;
+        }
+        else if (address < end) {
+            int r = perms[0] == 'r', w = perms[1] == 'w', x = perms[2] == 'x';
+            region->Base = region->AllocationBase = start;
+            region->Size = end - start;
+            region->State = MEMREGION_COMMIT;
+            region->Protect = x ? (w ? PAGE_EXECUTE_READWRITE : r ? PAGE_EXECUTE_READ : PAGE_EXECUTE)
+                : w ? PAGE_READWRITE : r ? PAGE_READONLY : PAGE_NOACCESS;
+            region->AllocationProtect = region->Protect;
+            region->Type = inode ? MEM_MAPPED : MEM_PRIVATE;
+            return fclose(f), 1;
+        }
+        previous = end;
+    }
+    fclose(f);
+    if (!found) {
+        region->Base = previous;
+        region->Size = USER_SPACE_END - previous;
+    }
+    region->State = MEMREGION_FREE;
+    region->Protect = PAGE_NOACCESS;
+    return 1;
+}
+
+static int linux_read(void *context, uint64_t address, void *buffer, size_t size)
+{
+    struct iovec local = { buffer, size }, remote = { (void *)(uintptr_t)address, size };
+    (void)context;
+    os_reads++;
+    return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == (ssize_t)size;
+}
+
+static const MEMORYOS linux_os = { linux_query, linux_read, NULL };
+
+static int is_executable(uint32_t protect)
+{
+    return (protect & (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE)) != 0;
+}
+
+// An arena of regions of one to four pages: readable, read-only, executable,
+// inaccessible or unmapped
+enum { READWRITE, READONLY, EXECUTE, GUARD, HOLE, KINDS };
+
+typedef struct {
+    unsigned char *base;
+    size_t pages;
+    unsigned char *kind;      // per page
+    unsigned char *expected;  // contents with zeroes for holes
+} arena_t;
+
+static void make_arena(arena_t *arena, size_t regions, int guards)
+{
+    size_t page = 0;
+    arena->pages = regions * 4;
+    arena->base = mmap(NULL, arena->pages * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    arena->kind = calloc(arena->pages, 1);
+    arena->expected = malloc(arena->pages * PAGE);
+    for (size_t i = 0; i < arena->pages * PAGE; i++)
+        arena->base[i] = (unsigned char)next_random();
+    memcpy(arena->expected, arena->base, arena->pages * PAGE);
+    for (size_t r = 0; r < regions; r++) {
+        size_t pages = 1 + next_random() % 4;
+        int kind = (int)(next_random() % KINDS);
+        if (kind == GUARD && !guards)
+            kind = READWRITE;
+        if (page + pages > arena->pages)
+            pages = arena->pages - page;
+        if (!pages)
+            break;
+        memset(arena->kind + page, kind, pages);
+        page += pages;
+    }
+    for (size_t p = 0; p < arena->pages; p++) {
+        unsigned char *at = arena->base + p * PAGE;
+        switch (arena->kind[p]) {
+        case READONLY: mprotect(at, PAGE, PROT_READ); break;
+        case EXECUTE: mprotect(at, PAGE, PROT_READ | PROT_EXEC); break;
+        case GUARD: mprotect(at, PAGE, PROT_NONE); break;
+        case HOLE: munmap(at, PAGE); memset(arena->expected + p * PAGE, 0, PAGE); break;
+        }
+    }
+}
+
+static void free_arena(arena_t *arena)
+{
+    munmap(arena->base, arena->pages * PAGE);
+    free(arena->kind);
+    free(arena->expected);
+}
+
+static void test_lookups(void)
+{
+    arena_t arena;
+    MEMORYMAP map;
+    MEMREGION direct;
+    int compared = 0;
+
+    make_arena(&arena, 96, 1);
+    MemoryMapInit(&map, &linux_os);
+
+    for (int i = 0; i < 2000; i++) {
+        uint64_t address = (uint64_t)(uintptr_t)arena.base + next_random() % (arena.pages * PAGE);
+        PMEMREGION region = MemoryMapQuery(&map, address);
+        if (!linux_query(NULL, address, &direct) || !region) {
+            CHECK(0, "no region at %llx", (unsigned long long)address);
+            continue;
+        }
+        CHECK(region->Base == direct.Base && region->Size == direct.Size && region->State == direct.State && region->Protect == direct.Protect,
+            "region at %llx is %llx+%llx state %x protect %x, expected %llx+%llx state %x protect %x", (unsigned long long)address,
+            (unsigned long long)region->Base, (unsigned long long)region->Size, region->State, region->Protect,
+            (unsigned long long)direct.Base, (unsigned long long)direct.Size, direct.State, direct.Protect);
+        compared++;
+    }
+    CHECK(map.Queries <= map.Count, "%zu queries for %zu regions", map.Queries, map.Count);
+    for (size_t i = 1; i < map.Count; i++)
+        CHECK(map.Regions[i - 1].Base + map.Regions[i - 1].Size <= map.Regions[i].Base, "regions %zu and %zu out of order", i - 1, i);
+    printf("%d lookups in %zu regions\n", compared, map.Count);
+
+    // A range added in one pass answers every lookup inside it
+    MemoryMapReset(&map);
+    size_t added = MemoryMapAddRange(&map, (uint64_t)(uintptr_t)arena.base, arena.pages * PAGE);
+    size_t queries = map.Queries;
+    for (int i = 0; i < 1000; i++)
+        MemoryMapQuery(&map, (uint64_t)(uintptr_t)arena.base + next_random() % (arena.pages * PAGE));
+    CHECK(map.Queries == queries, "%zu queries after the range was added", map.Queries - queries);
+    CHECK(added == map.Count && added > 1 && map.Regions[0].Base <= (uint64_t)(uintptr_t)arena.base, "%zu regions added", added);
+
+    // Until it is reset the snapshot keeps what it saw
+    size_t hole = 1;
+    while (hole < arena.pages - 1 && arena.kind[hole] != READWRITE)
+        hole++;
+    uint64_t address = (uint64_t)(uintptr_t)arena.base + hole * PAGE;
+    munmap(arena.base + hole * PAGE, PAGE);
+    CHECK(MemoryMapQuery(&map, address)->State == MEMREGION_COMMIT, "snapshot changed without a reset");
+    MemoryMapReset(&map);
+    CHECK(MemoryMapQuery(&map, address)->State == MEMREGION_FREE, "unmapped page committed after a reset");
+    CHECK(MemoryMapQuery(&map, USER_SPACE_END) == NULL, "region past the end of user space");
+
+    MemoryMapFree(&map);
+    free_arena(&arena);
+}
+
+static void test_reads(void)
+{
+    arena_t arena;
+    MEMORYMAP map;
+    unsigned char *buffer;
+    int succeeded = 0, failed = 0;
+
+    make_arena(&arena, 128, 1);
+    buffer = malloc(arena.pages * PAGE);
+    MemoryMapInit(&map, &linux_os);
+
+    for (int i = 0; i < 3000; i++) {
+        size_t start = next_random() % (arena.pages * PAGE), size = 1 + next_random() % (16 * PAGE), guarded = 0;
+        if (start + size > arena.pages * PAGE)
+            size = arena.pages * PAGE - start;
+        for (size_t p = start / PAGE; p <= (start + size - 1) / PAGE; p++)
+            guarded |= arena.kind[p] == GUARD;
+        memset(buffer, 0xCC, size);
+        int read = MemoryMapRead(&map, (uint64_t)(uintptr_t)arena.base + start, size, buffer);
+        if (guarded)
+            CHECK(!read, "read over an inaccessible page at %zx+%zx succeeded", start, size);
+        else {
+            CHECK(read && !memcmp(buffer, arena.expected + start, size), "read at %zx+%zx %s", start, size, read ? "differs" : "failed");
+            succeeded++;
+        }
+        failed += !read;
+    }
+
+    // Committed regions that follow on are read in one call
+    size_t first = 0, last;
+    while (first + 1 < arena.pages && !(arena.kind[first] < GUARD && arena.kind[first + 1] < GUARD && arena.kind[first] != arena.kind[first + 1]))
+        first++;
+    for (last = first + 1; last + 1 < arena.pages && arena.kind[last + 1] < GUARD; last++)
+        ;
+    if (first + 1 < arena.pages) {
+        size_t reads = map.Reads;
+        CHECK(MemoryMapRead(&map, (uint64_t)(uintptr_t)arena.base + first * PAGE, (last - first + 1) * PAGE, buffer), "read of committed pages failed");
+        CHECK(map.Reads == reads + 1, "%zu reads for %zu committed pages", map.Reads - reads, last - first + 1);
+    }
+
+    printf("%d reads, %d over inaccessible pages refused\n", succeeded, failed);
+    MemoryMapFree(&map);
+    free(buffer);
+    free_arena(&arena);
+}
+
+// A fake OS of fixed regions, whose reads fail when they span more than one
+// unless told otherwise, as a read across protections can
+typedef struct {
+    MEMREGION regions[8];
+    int count;
+    int bulk_fails;
+    unsigned char memory[0x8000];
+} fake_os_t;
+
+static int fake_query(void *context, uint64_t address, PMEMREGION region)
+{
+    fake_os_t *os = context;
+    for (int i = 0; i < os->count; i++)
+        if (address >= os->regions[i].Base && address < os->regions[i].Base + os->regions[i].Size) {
+            *region = os->regions[i];
+            return 1;
+        }
+    return 0;
+}
+
+static int fake_read(void *context, uint64_t address, void *buffer, size_t size)
+{
+    fake_os_t *os = context;
+    MEMREGION region;
+    if (!fake_query(os, address, &region) || region.State != MEMREGION_COMMIT || (os->bulk_fails && address + size > region.Base + region.Size))
+        return 0;
+    if (address + size > sizeof(os->memory))
+        return 0;
+    memcpy(buffer, os->memory + address, size);
+    return 1;
+}
+
+static void test_fake(void)
+{
+    static fake_os_t os;
+    MEMORYOS fake = { fake_query, fake_read, &os };
+    MEMORYMAP map;
+    unsigned char buffer[0x8000];
+
+    for (size_t i = 0; i < sizeof(os.memory); i++)
+        os.memory[i] = (unsigned char)next_random();
+    os.regions[0] = (MEMREGION){ 0x0000, 0x2000, 0, 0, MEMREGION_COMMIT, PAGE_READWRITE, MEM_PRIVATE };
+    os.regions[1] = (MEMREGION){ 0x2000, 0x1000, 0, 0, MEMREGION_COMMIT, PAGE_EXECUTE_READ, MEM_PRIVATE };
+    os.regions[2] = (MEMREGION){ 0x3000, 0x1000, 0, 0, MEMREGION_RESERVE, PAGE_NOACCESS, MEM_PRIVATE };
+    os.regions[3] = (MEMREGION){ 0x4000, 0x3000, 0, 0, MEMREGION_COMMIT, PAGE_READONLY, MEM_PRIVATE };
+    os.count = 4;
+    os.bulk_fails = 1;
+
+    // A run that can't be read in one call is read a region at a time
+    MemoryMapInit(&map, &fake);
+    CHECK(MemoryMapRead(&map, 0x1800, 0x5000, buffer), "split read failed");
+    CHECK(!memcmp(buffer, os.memory + 0x1800, 0x1800) && !memcmp(buffer + 0x2800, os.memory + 0x4000, 0x2800), "split read differs");
+    CHECK(buffer[0x1800] == 0 && !memcmp(buffer + 0x1800, buffer + 0x1801, 0xFFF), "reserved page not zeroed");
+    CHECK(map.Reads == 4, "%zu reads for two committed runs, one split", map.Reads);
+    CHECK(!MemoryMapRead(&map, 0x6000, 0x2000, buffer), "read past the last region succeeded");
+
+    os.bulk_fails = 0;
+    MemoryMapReset(&map);
+    map.Reads = 0;
+    CHECK(MemoryMapRead(&map, 0x0, 0x3000, buffer) && map.Reads == 1, "%zu reads for one committed run", map.Reads);
+
+    // Regions that grew after the snapshot was taken don't overlap the ones
+    // it already has
+    MemoryMapReset(&map);
+    MemoryMapQuery(&map, 0x2000);
+    MemoryMapQuery(&map, 0x4000);
+    os.regions[2] = (MEMREGION){ 0x1000, 0x5000, 0, 0, MEMREGION_COMMIT, PAGE_READWRITE, MEM_PRIVATE };
+    os.regions[0].Size = 0x1000;
+    PMEMREGION region = MemoryMapQuery(&map, 0x3800);
+    CHECK(region && region->Base == 0x3000 && region->Size == 0x1000, "grown region kept as %llx+%llx",
+        region ? (unsigned long long)region->Base : 0, region ? (unsigned long long)region->Size : 0);
+    region = MemoryMapQuery(&map, 0x1800);
+    CHECK(region && region->Base == 0x1000 && region->Size == 0x1000, "grown region kept as %llx+%llx",
+        region ? (unsigned long long)region->Base : 0, region ? (unsigned long long)region->Size : 0);
+    for (size_t i = 1; i < map.Count; i++)
+        CHECK(map.Regions[i - 1].Base + map.Regions[i - 1].Size <= map.Regions[i].Base, "regions %zu and %zu overlap", i - 1, i);
+
+    MemoryMapFree(&map);
+}
+
+// What a dump asked the OS before: a query for every region of a partial
+// read, every IAT pointer checked, and every step of the searches for
+// executable memory around the IAT
+typedef int (*query_t)(void *context, uint64_t address, PMEMREGION region);
+
+static int snapshot_query(void *context, uint64_t address, PMEMREGION region)
+{
+    PMEMREGION found = MemoryMapQuery(context, address);
+    if (found)
+        *region = *found;
+    return found != NULL;
+}
+
+static int old_read_partly(uint64_t address, size_t size, unsigned char *buffer)
+{
+    MEMREGION region;
+    size_t read_bytes = 0, to_read;
+    uint64_t part = address;
+
+    if (linux_read(NULL, address, buffer, size))
+        return 1;
+    do {
+        if (!linux_query(NULL, part, &region))
+            break;
+        to_read = region.Size;
+        if (read_bytes + to_read > size)
+            to_read = size - read_bytes;
+        if (region.State == MEMREGION_COMMIT) {
+            if (!linux_read(NULL, part, buffer + read_bytes, to_read))
+                break;
+        }
+        else
+            memset(buffer + read_bytes, 0, to_read);
+        read_bytes += to_read;
+        part += region.Size;
+    } while (read_bytes < size);
+    return read_bytes == size;
+}
+
+static void executable_pages(query_t query, void *context, uint64_t start, uint64_t *base, uint64_t *size)
+{
+    MEMREGION region;
+    uint64_t address;
+
+    *size = *base = 0;
+    if (!query(context, start, &region))
+        return;
+    do {
+        *size = region.Size;
+        *base = region.Base;
+        address = region.Base - 1;
+        if (!query(context, address, &region))
+            break;
+    } while (is_executable(region.Protect));
+    address = *base;
+    region.Size = *size;
+    *size = 0;
+    do {
+        address += region.Size;
+        *size += region.Size;
+        if (!query(context, address, &region))
+            break;
+    } while (is_executable(region.Protect));
+}
+
+static void bench(void)
+{
+    enum { REGIONS = 512, SECTIONS = 8, POINTERS = 4000, SEARCHES = 200 };
+    arena_t arena;
+    MEMORYMAP map;
+    unsigned char *buffer;
+    uint64_t arena_base, section_size, base, size, old_sum = 0, new_sum = 0;
+    double start, old_ms, new_ms;
+    size_t old_queries, old_reads, new_queries, new_reads;
+    uint64_t addresses;
+    int misread = 0;
+
+    make_arena(&arena, REGIONS, 0);
+    arena_base = (uint64_t)(uintptr_t)arena.base;
+    section_size = arena.pages / SECTIONS * PAGE;
+    buffer = malloc(section_size);
+
+    addresses = rng;
+    os_queries = os_reads = 0;
+    start = now();
+    // a section starting inside a region was read as if from its start
+    for (int s = 0; s < SECTIONS; s++)
+        misread += !old_read_partly(arena_base + s * section_size, section_size, buffer) || memcmp(buffer, arena.expected + s * section_size, section_size);
+    for (int i = 0; i < POINTERS; i++) {
+        MEMREGION region;
+        old_sum += linux_query(NULL, arena_base + next_random() % (arena.pages * PAGE), &region) && region.State == MEMREGION_COMMIT;
+    }
+    for (int i = 0; i < SEARCHES; i++) {
+        executable_pages(linux_query, NULL, arena_base + next_random() % (arena.pages * PAGE), &base, &size);
+        old_sum += size;
+    }
+    old_ms = now() - start;
+    old_queries = os_queries;
+    old_reads = os_reads;
+
+    rng = addresses;
+    os_queries = os_reads = 0;
+    start = now();
+    MemoryMapInit(&map, &linux_os);
+    MemoryMapAddRange(&map, arena_base, arena.pages * PAGE);
+    for (int s = 0; s < SECTIONS; s++) {
+        if (!linux_read(NULL, arena_base + s * section_size, buffer, section_size))
+            CHECK(MemoryMapRead(&map, arena_base + s * section_size, section_size, buffer), "section %d not read", s);
+        CHECK(!memcmp(buffer, arena.expected + s * section_size, section_size), "section %d differs", s);
+    }
+    for (int i = 0; i < POINTERS; i++) {
+        MEMREGION region;
+        new_sum += snapshot_query(&map, arena_base + next_random() % (arena.pages * PAGE), &region) && region.State == MEMREGION_COMMIT;
+    }
+    for (int i = 0; i < SEARCHES; i++) {
+        executable_pages(snapshot_query, &map, arena_base + next_random() % (arena.pages * PAGE), &base, &size);
+        new_sum += size;
+    }
+    new_ms = now() - start;
+    new_queries = os_queries;
+    new_reads = os_reads;
+    CHECK(old_sum == new_sum, "answers differ: %llu and %llu", (unsigned long long)old_sum, (unsigned long long)new_sum);
+
+    printf("%d regions, %d section reads, %d pointer checks, %d executable searches: %zu queries and %zu reads in %.1f ms before, %zu queries and %zu reads in %.1f ms with the snapshot, %zu queries avoided, %.1fx (%d sections misread before)\n",
+        REGIONS, SECTIONS, POINTERS, SEARCHES, old_queries, old_reads, old_ms, new_queries, new_reads, new_ms, old_queries - new_queries, old_ms / new_ms, misread);
+
+    MemoryMapFree(&map);
+    free(buffer);
+    free_arena(&arena);
+}
+
+int main(int argc, char **argv)
+{
+    test_lookups();
+    test_reads();
+    test_fake();
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        bench();
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+    return failures != 0;
+}
@@ -0,0 +1,413 @@
+// Tests for the module map behind is_in_dll_range and
+// convert_address_to_dll_name_and_offset: range boundaries, adjacent and
+// overlapping modules, names interned across loads and unloads, random
+// load/unload churn against a linear scan of the same ranges, and lookups
+// running alongside a loader thread. Portable harness, build on Linux with:
+//   gcc -O2 -Wall -pthread -I../CAPE -o module-map module-map.c ../CAPE/ModuleMap.c
+// Run "./module-map bench" for lookups against 50 to 1000 loaded modules.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "ModuleMap.h"
+
+#define SLOTS 1024
+#define SLOT_SIZE 0x100000
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// The same ranges kept the way the old dll_ranges array was scanned
+typedef struct {
+    uintptr_t base, end;
+    char name[32];
+} range_t;
+
+static range_t ranges[SLOTS * 4];
+static int range_count;
+
+static void model_add(uintptr_t base, uintptr_t end, const char *name)
+{
+    int i, j;
+
+    for (i = j = 0; i < range_count; i++)
+        if (ranges[i].end <= base || ranges[i].base >= end)
+            ranges[j++] = ranges[i];
+    range_count = j;
+    ranges[range_count].base = base;
+    ranges[range_count].end = end;
+    strcpy(ranges[range_count].name, name);
+    range_count++;
+}
+
+static void model_remove(uintptr_t base)
+{
+    for (int i = 0; i < range_count; i++) {
+        if (ranges[i].base == base) {
+            ranges[i] = ranges[--range_count];
+            return;
+        }
+    }
+}
+
+static const range_t *model_lookup(uintptr_t address)
+{
+    for (int i = 0; i < range_count; i++)
+        if (address >= ranges[i].base && address < ranges[i].end)
+            return &ranges[i];
+    return NULL;
+}
+
+static int add(PMODULEMAP map, uintptr_t base, uintptr_t end, const char *name)
+{
+    return ModuleMapAdd(map, base, end, name, strlen(name));
+}
+
+static void expect(PMODULEMAP map, uintptr_t address, uintptr_t base, const char *name)
+{
+    uintptr_t found_base = 0;
+    const char *found_name = NULL;
+    int found = ModuleMapLookup(map, address, &found_base, &found_name);
+
+    if (!name) {
+        CHECK(!found, "0x%lx: found %s at 0x%lx", (unsigned long)address, found_name ? found_name : "(null)", (unsigned long)found_base);
+        return;
+    }
+    CHECK(found && found_base == base && found_name && !strcmp(found_name, name),
+        "0x%lx: expected %s at 0x%lx, got %s at 0x%lx", (unsigned long)address, name, (unsigned long)base,
+        found ? (found_name ? found_name : "(null)") : "nothing", (unsigned long)found_base);
+}
+
+static void test_boundaries(void)
+{
+    PMODULEMAP map = ModuleMapCreate();
+
+    CHECK(!ModuleMapLookup(map, 0x1000, NULL, NULL), "empty map");
+    CHECK(!add(map, 0x2000, 0x2000, "empty.dll"), "empty range accepted");
+    CHECK(!add(map, 0x3000, 0x2000, "inverted.dll"), "inverted range accepted");
+    CHECK(ModuleMapCount(map) == 0, "count %zu", ModuleMapCount(map));
+
+    add(map, 0x10000, 0x20000, "a.dll");
+    add(map, 0x20000, 0x30000, "b.dll");       // adjacent
+    add(map, 0x40000, 0x50000, "c.dll");
+    expect(map, 0xffff, 0, NULL);
+    expect(map, 0x10000, 0x10000, "a.dll");
+    expect(map, 0x1ffff, 0x10000, "a.dll");
+    expect(map, 0x20000, 0x20000, "b.dll");
+    expect(map, 0x2ffff, 0x20000, "b.dll");
+    expect(map, 0x30000, 0, NULL);
+    expect(map, 0x3ffff, 0, NULL);
+    expect(map, 0x4ffff, 0x40000, "c.dll");
+    expect(map, 0x50000, 0, NULL);
+    expect(map, UINTPTR_MAX, 0, NULL);
+    CHECK(ModuleMapCount(map) == 3, "count %zu", ModuleMapCount(map));
+
+    // a range at the very top of the address space
+    add(map, UINTPTR_MAX - 0xfff, UINTPTR_MAX, "top.dll");
+    expect(map, UINTPTR_MAX - 1, UINTPTR_MAX - 0xfff, "top.dll");
+    expect(map, UINTPTR_MAX, 0, NULL);
+
+    // unnamed ranges, as used for the dll ranges
+    CHECK(ModuleMapAdd(map, 0x60000, 0x70000, NULL, 0), "unnamed range rejected");
+    {
+        const char *name = "x";
+        uintptr_t base = 0;
+        CHECK(ModuleMapLookup(map, 0x65000, &base, &name) && base == 0x60000 && !name, "unnamed range lookup");
+    }
+
+    ModuleMapDestroy(map);
+}
+
+static void test_overlap(void)
+{
+    PMODULEMAP map = ModuleMapCreate();
+
+    add(map, 0x10000, 0x20000, "a.dll");
+    add(map, 0x30000, 0x40000, "b.dll");
+    add(map, 0x50000, 0x60000, "c.dll");
+    add(map, 0x70000, 0x80000, "d.dll");
+
+    // reloading the same range replaces it
+    add(map, 0x10000, 0x20000, "a2.dll");
+    expect(map, 0x18000, 0x10000, "a2.dll");
+    CHECK(ModuleMapCount(map) == 4, "count %zu", ModuleMapCount(map));
+
+    // overlapping the tail of one and the head of the next drops both
+    add(map, 0x38000, 0x58000, "e.dll");
+    expect(map, 0x30000, 0, NULL);
+    expect(map, 0x38000, 0x38000, "e.dll");
+    expect(map, 0x57fff, 0x38000, "e.dll");
+    expect(map, 0x58000, 0, NULL);
+    expect(map, 0x70000, 0x70000, "d.dll");
+    CHECK(ModuleMapCount(map) == 3, "count %zu", ModuleMapCount(map));
+
+    // a range inside another replaces it, one spanning several drops them all
+    add(map, 0x71000, 0x72000, "f.dll");
+    expect(map, 0x70000, 0, NULL);
+    expect(map, 0x71800, 0x71000, "f.dll");
+    add(map, 0x0, 0x100000, "g.dll");
+    expect(map, 0x10000, 0x0, "g.dll");
+    expect(map, 0x71800, 0x0, "g.dll");
+    CHECK(ModuleMapCount(map) == 1, "count %zu", ModuleMapCount(map));
+
+    // removal is by exact base only
+    CHECK(!ModuleMapRemove(map, 0x10000), "removed by inner address");
+    CHECK(ModuleMapRemove(map, 0x0), "not removed by base");
+    CHECK(!ModuleMapRemove(map, 0x0), "removed twice");
+    CHECK(ModuleMapCount(map) == 0, "count %zu", ModuleMapCount(map));
+
+    ModuleMapDestroy(map);
+}
+
+static void test_names(void)
+{
+    PMODULEMAP map = ModuleMapCreate();
+    const char *first, *second, *third;
+
+    add(map, 0x10000, 0x20000, "kernel32.dll");
+    ModuleMapLookup(map, 0x10000, NULL, &first);
+    CHECK(ModuleMapRemove(map, 0x10000), "remove");
+
+    // names outlive their modules and are shared by later loads
+    CHECK(!strcmp(first, "kernel32.dll"), "name after unload: %s", first);
+    add(map, 0x90000, 0xa0000, "kernel32.dll");
+    ModuleMapLookup(map, 0x90000, NULL, &second);
+    CHECK(first == second, "name not interned");
+
+    // names are taken by length, not terminator, and are case sensitive
+    ModuleMapAdd(map, 0xb0000, 0xc0000, "KERNEL32.dll trailing", 12);
+    ModuleMapLookup(map, 0xb0000, NULL, &third);
+    CHECK(third != first && !strcmp(third, "KERNEL32.dll"), "name %s", third);
+    ModuleMapAdd(map, 0xc0000, 0xd0000, "kernel32.dll.mui", 12);
+    ModuleMapLookup(map, 0xc0000, NULL, &third);
+    CHECK(third == first, "prefix not interned");
+
+    // enough distinct names to grow the name table several times
+    for (int i = 0; i < 1000; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "module%d.dll", i);
+        add(map, 0x1000000 + (uintptr_t)i * 0x1000, 0x1000000 + (uintptr_t)i * 0x1000 + 0x800, name);
+    }
+    for (int i = 0; i < 1000; i += 37) {
+        char name[32];
+        snprintf(name, sizeof(name), "module%d.dll", i);
+        expect(map, 0x1000000 + (uintptr_t)i * 0x1000 + 0x7ff, 0x1000000 + (uintptr_t)i * 0x1000, name);
+        expect(map, 0x1000000 + (uintptr_t)i * 0x1000 + 0x800, 0, NULL);
+    }
+    CHECK(!strcmp(first, "kernel32.dll"), "name after growth: %s", first);
+
+    ModuleMapDestroy(map);
+}
+
+// Loads and unloads of modules of random sizes in random slots, with
+// overlapping reloads, checked against a linear scan after every step
+static void test_churn(void)
+{
+    PMODULEMAP map = ModuleMapCreate();
+    int steps = 0;
+
+    range_count = 0;
+    for (int round = 0; round < 20000; round++) {
+        uintptr_t slot = next_random() % SLOTS;
+        uintptr_t base = 0x10000000 + slot * SLOT_SIZE + (next_random() % 4) * 0x10000;
+        unsigned int op = next_random() % 8;
+
+        if (op < 4) {
+            uintptr_t end = base + 0x1000 + (next_random() % (op == 0 ? 4 * SLOT_SIZE : SLOT_SIZE / 2));
+            char name[32];
+            snprintf(name, sizeof(name), "m%u.dll", (unsigned int)(next_random() % 300));
+            CHECK(add(map, base, end, name), "add failed");
+            model_add(base, end, name);
+        } else if (op < 7) {
+            const range_t *r = range_count ? &ranges[next_random() % range_count] : NULL;
+            uintptr_t target = r ? r->base : base;
+            CHECK(ModuleMapRemove(map, target) == (model_lookup(target) && model_lookup(target)->base == target), "remove 0x%lx", (unsigned long)target);
+            model_remove(target);
+        } else {
+            CHECK(!ModuleMapRemove(map, base + 1), "removed by inner address");
+        }
+
+        CHECK(ModuleMapCount(map) == (size_t)range_count, "count %zu, expected %d", ModuleMapCount(map), range_count);
+
+        for (int probe = 0; probe < 8; probe++) {
+            uintptr_t address;
+            const range_t *r;
+
+            if (range_count && probe < 4) {
+                r = &ranges[next_random() % range_count];
+                switch (probe) {
+                case 0: address = r->base; break;
+                case 1: address = r->end - 1; break;
+                case 2: address = r->end; break;
+                default: address = r->base - 1; break;
+                }
+            }
+            else
+                address = 0x10000000 + next_random() % ((SLOTS + 4) * (uintptr_t)SLOT_SIZE);
+
+            r = model_lookup(address);
+            expect(map, address, r ? r->base : 0, r ? r->name : NULL);
+            steps++;
+        }
+        if (failures > 20)
+            break;
+    }
+
+    ModuleMapDestroy(map);
+    printf("churn: %d lookups checked\n", steps);
+}
+
+// Lookups from several threads while another loads and unloads modules
+static PMODULEMAP shared_map;
+static int stop;
+
+static void *reader(void *arg)
+{
+    unsigned long bad = 0;
+    (void)arg;
+
+    for (int pass = 0; pass < 2000; pass++) {
+        for (uintptr_t i = 0; i < 64; i++) {
+            uintptr_t base = 0;
+            const char *name = NULL;
+            // the static modules never move
+            if (!ModuleMapLookup(shared_map, 0x100000 + i * 0x20000 + 0x800, &base, &name) || base != 0x100000 + i * 0x20000 || !name || name[0] != 's')
+                bad++;
+            // the churning ones are either absent or whole
+            if (ModuleMapLookup(shared_map, 0x100000 + i * 0x20000 + 0x10800, &base, &name) && (base != 0x100000 + i * 0x20000 + 0x10000 || !name || name[0] != 'c'))
+                bad++;
+        }
+    }
+
+    return (void *)bad;
+}
+
+static void *loader(void *arg)
+{
+    unsigned long rounds = 0;
+    (void)arg;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        uintptr_t i = next_random() % 64;
+        char name[32];
+        snprintf(name, sizeof(name), "churn%lu.dll", rounds++ % 500);
+        add(shared_map, 0x100000 + i * 0x20000 + 0x10000, 0x100000 + i * 0x20000 + 0x11000, name);
+        ModuleMapRemove(shared_map, 0x100000 + ((i * 7) % 64) * 0x20000 + 0x10000);
+    }
+
+    return (void *)rounds;
+}
+
+static void test_threads(void)
+{
+    pthread_t threads[4], loader_thread;
+    unsigned long bad = 0;
+    void *ret;
+
+    shared_map = ModuleMapCreate();
+    for (uintptr_t i = 0; i < 64; i++)
+        add(shared_map, 0x100000 + i * 0x20000, 0x100000 + i * 0x20000 + 0x1000, "static.dll");
+
+    __atomic_store_n(&stop, 0, __ATOMIC_RELEASE);
+    pthread_create(&loader_thread, NULL, loader, NULL);
+    for (int t = 0; t < 4; t++)
+        pthread_create(&threads[t], NULL, reader, NULL);
+    for (int t = 0; t < 4; t++) {
+        pthread_join(threads[t], &ret);
+        bad += (unsigned long)ret;
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    pthread_join(loader_thread, &ret);
+
+    CHECK(bad == 0, "%lu inconsistent lookups", bad);
+    ModuleMapDestroy(shared_map);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Caller attribution resolves a handful of stack frames per hooked call,
+// most of them inside modules and some on the heap or stack
+static void bench(void)
+{
+    static const int counts[] = { 50, 100, 250, 500, 1000 };
+    enum { LOOKUPS = 2000000 };
+
+    for (unsigned int c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        PMODULEMAP map = ModuleMapCreate();
+        uintptr_t *addresses = malloc(LOOKUPS * sizeof(uintptr_t));
+        size_t linear_hits = 0, map_hits = 0;
+        double t0, t1, t2;
+
+        range_count = 0;
+        for (int i = 0; i < counts[c]; i++) {
+            uintptr_t base = 0x70000000 + (uintptr_t)i * 0x200000;
+            uintptr_t end = base + 0x1000 + next_random() % 0x1ff000;
+            char name[32];
+            snprintf(name, sizeof(name), "module%d.dll", i);
+            add(map, base, end, name);
+            model_add(base, end, name);
+        }
+        // shuffle the linear table into load order rather than address order
+        for (int i = range_count - 1; i > 0; i--) {
+            int j = (int)(next_random() % (i + 1));
+            range_t tmp = ranges[i];
+            ranges[i] = ranges[j];
+            ranges[j] = tmp;
+        }
+        for (int i = 0; i < LOOKUPS; i++) {
+            if (next_random() % 4)
+                addresses[i] = 0x70000000 + next_random() % ((uintptr_t)counts[c] * 0x200000);
+            else
+                addresses[i] = 0x10000000 + next_random() % 0x1000000;
+        }
+
+        t0 = now();
+        for (int i = 0; i < LOOKUPS; i++)
+            linear_hits += model_lookup(addresses[i]) != NULL;
+        t1 = now();
+        for (int i = 0; i < LOOKUPS; i++) {
+            uintptr_t base;
+            const char *name;
+            map_hits += ModuleMapLookup(map, addresses[i], &base, &name);
+        }
+        t2 = now();
+
+        printf("%4d modules: linear %.1f ns, map %.1f ns per lookup (%zu/%zu hits)\n", counts[c],
+            (t1 - t0) / LOOKUPS * 1e9, (t2 - t1) / LOOKUPS * 1e9, linear_hits, map_hits);
+
+        free(addresses);
+        ModuleMapDestroy(map);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    test_boundaries();
+    test_overlap();
+    test_names();
+    test_churn();
+    test_threads();
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        bench();
+
+    return failures != 0;
+}
@@ -0,0 +1,409 @@
+// Tests for the path normalization cache behind ensure_absolute_unicode_path
+// and path_from_object_attributes: which raw path shapes may be cached (\??\,
+// \Device\HarddiskVolume, UNC, drive letters, short 8.3 names), random
+// lookups, inserts and root drops checked against a plain LRU list, handle
+// value reuse after close, and threads sharing one cache. Portable harness,
+// build on Linux with:
+//   gcc -O2 -Wall -pthread -I../CAPE -o path-cache path-cache.c ../CAPE/PathCache.c ../CAPE/Xxh64.c
+// Run "./path-cache bench" for hit rates and timings over a file activity trace.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <pthread.h>
+#include "PathCache.h"
+
+#define KEYS 64
+#define ROOTS 4
+#define CAPACITY 16
+#define THREADS 4
+
+typedef struct {
+    uintptr_t root;
+    int key;
+    int value;
+} oracle_t;
+
+static oracle_t oracle[CAPACITY];   // most recently used first
+static int oracle_count;
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static int absolute(const wchar_t *path)
+{
+    return PathCacheIsAbsolute(path, wcslen(path));
+}
+
+static void test_shapes(void)
+{
+    static const wchar_t *cached[] = {
+        L"\\??\\C:\\Windows\\System32\\kernel32.dll",
+        L"\\??\\c:/users/public/a.txt",
+        L"\\Device\\HarddiskVolume2\\Users\\user\\AppData\\Local\\Temp\\x.tmp",
+        L"\\DEVICE\\HarddiskVolume3",
+        L"\\\\?\\globalroot\\Device\\Mup\\server\\share\\f",
+        L"\\SystemRoot\\System32\\drivers\\etc\\hosts",
+        L"C:\\Program Files\\Common Files\\x.dll",
+        L"z:/mapped/drive",
+        L"\\\\server\\share\\dir\\file.doc",
+        L"\\\\?\\C:\\very\\long\\path",
+        L"\\\\.\\PhysicalDrive0",
+        L"\\\\?\\Volume{6b29fc40-ca47-1067-b31d-00dd010662da}\\x",
+    };
+    static const wchar_t *uncached[] = {
+        L"",
+        L"C:",
+        L"C:foo\\bar",                      // relative to the current directory on C:
+        L"\\Windows\\notepad.exe",           // relative to the current drive
+        L"foo\\bar.txt",
+        L"..\\up.txt",
+        L"\\\\",
+        L"\\??\\UNC",
+        L"\\??\\GLOBALROOT\\Device\\HarddiskVolume2\\x",  // kept verbatim, cheap already
+        L"C:\\PROGRA~1\\COMMON~1\\x.dll",    // short names
+        L"\\Device\\HarddiskVolume2\\Users\\ADMINI~1\\x",
+        L"\\??\\C:\\DOCUME~1\\user",
+        L"\\\\server\\share\\LONGFI~1.DOC",
+        L"1:\\x",
+    };
+
+    for (size_t i = 0; i < sizeof(cached) / sizeof(cached[0]); i++)
+        CHECK(absolute(cached[i]), "%ls should be cacheable", cached[i]);
+    for (size_t i = 0; i < sizeof(uncached) / sizeof(uncached[0]); i++)
+        CHECK(!absolute(uncached[i]), "%ls should not be cacheable", uncached[i]);
+
+    // Only the given length is looked at
+    CHECK(!PathCacheIsAbsolute(L"C:\\x", 2), "truncated drive");
+    CHECK(PathCacheIsAbsolute(L"C:\\x~1", 4), "tilde past length");
+}
+
+static void test_basic(void)
+{
+    static const wchar_t raw[] = L"\\??\\C:\\Users\\user\\Desktop\\sample.exe";
+    static const wchar_t resolved[] = L"C:\\Users\\user\\Desktop\\sample.exe";
+    PPATHCACHE cache = PathCacheCreate(4);
+    PATHCACHESTATS stats;
+    wchar_t out[64];
+    wchar_t name[8];
+
+    CHECK(PathCacheLookup(cache, 0, raw, wcslen(raw), out, 64) == 0, "empty");
+    CHECK(PathCacheInsert(cache, 0, raw, wcslen(raw), resolved, wcslen(resolved)), "insert");
+    CHECK(PathCacheLookup(cache, 0, raw, wcslen(raw), out, 64) == wcslen(resolved) && !wcscmp(out, resolved), "hit");
+
+    // Must fit with its terminator
+    CHECK(PathCacheLookup(cache, 0, raw, wcslen(raw), out, wcslen(resolved)) == 0, "too small");
+    CHECK(PathCacheLookup(cache, 0, raw, wcslen(raw), out, wcslen(resolved) + 1) == wcslen(resolved), "exact fit");
+
+    // Keys are exact: case, length and root all matter
+    CHECK(PathCacheLookup(cache, 0, L"\\??\\c:\\Users\\user\\Desktop\\sample.exe", wcslen(raw), out, 64) == 0, "case");
+    CHECK(PathCacheLookup(cache, 0, raw, wcslen(raw) - 1, out, 64) == 0, "prefix");
+    CHECK(PathCacheLookup(cache, 8, raw, wcslen(raw), out, 64) == 0, "root");
+
+    // Replacing keeps one entry
+    CHECK(PathCacheInsert(cache, 0, raw, wcslen(raw), L"D:\\x", 4), "replace");
+    CHECK(PathCacheLookup(cache, 0, raw, wcslen(raw), out, 64) == 4 && !wcscmp(out, L"D:\\x"), "replaced");
+
+    // Least recently used goes first: touch the oldest before filling up
+    for (int i = 0; i < 3; i++) {
+        swprintf(name, 8, L"n%d", i);
+        PathCacheInsert(cache, 0, name, 2, L"v", 1);
+    }
+    CHECK(PathCacheLookup(cache, 0, raw, wcslen(raw), out, 64), "still there");
+    PathCacheInsert(cache, 0, L"n3", 2, L"v", 1);
+    CHECK(PathCacheLookup(cache, 0, L"n0", 2, out, 64) == 0, "n0 evicted");
+    CHECK(PathCacheLookup(cache, 0, raw, wcslen(raw), out, 64), "touched entry kept");
+
+    // Empty and over-long paths are not cached
+    CHECK(!PathCacheInsert(cache, 0, L"e", 1, L"", 0), "empty path");
+    {
+        size_t long_length = PATH_CACHE_MAX_LENGTH + 1;
+        wchar_t *long_path = malloc(long_length * sizeof(wchar_t));
+        wmemset(long_path, L'a', long_length);
+        CHECK(!PathCacheInsert(cache, 0, long_path, long_length, L"x", 1), "long name");
+        CHECK(!PathCacheInsert(cache, 0, L"x", 1, long_path, long_length), "long path");
+        CHECK(PathCacheInsert(cache, 0, long_path, long_length - 1, long_path, long_length - 1), "max length");
+        free(long_path);
+    }
+
+    PathCacheGetStats(cache, &stats);
+    CHECK(stats.Entries == 4 && stats.Evictions == 2, "entries %zu evictions %zu", stats.Entries, stats.Evictions);
+
+    PathCacheFlush(cache);
+    PathCacheGetStats(cache, &stats);
+    CHECK(stats.Entries == 0, "flushed");
+    CHECK(PathCacheLookup(cache, 0, raw, wcslen(raw), out, 64) == 0, "gone after flush");
+    CHECK(PathCacheInsert(cache, 0, raw, wcslen(raw), resolved, wcslen(resolved)), "usable after flush");
+    PathCacheDestroy(cache);
+
+    CHECK(PathCacheCreate(0) == NULL, "zero capacity");
+    CHECK(PathCacheLookup(NULL, 0, raw, 1, out, 64) == 0 && !PathCacheInsert(NULL, 0, raw, 1, raw, 1), "null cache");
+}
+
+// Object names relative to directory handles; a closed handle's value is
+// reused for a different directory
+static void test_roots(void)
+{
+    PPATHCACHE cache = PathCacheCreate(64);
+    wchar_t out[128];
+    uintptr_t temp = 0x1c4, system = 0x1c8;
+
+    PathCacheInsert(cache, temp, L"a.txt", 5, L"\\Device\\HarddiskVolume2\\Temp\\a.txt", 34);
+    PathCacheInsert(cache, temp, L"b.txt", 5, L"\\Device\\HarddiskVolume2\\Temp\\b.txt", 34);
+    PathCacheInsert(cache, temp, L"", 0, L"\\Device\\HarddiskVolume2\\Temp", 28);
+    PathCacheInsert(cache, system, L"a.txt", 5, L"\\Device\\HarddiskVolume2\\Windows\\System32\\a.txt", 46);
+    PathCacheInsert(cache, 0, L"a.txt", 5, L"C:\\a.txt", 8);
+
+    CHECK(PathCacheLookup(cache, temp, L"", 0, out, 128) == 28, "handle only");
+    CHECK(PathCacheLookup(cache, system, L"a.txt", 5, out, 128) == 46 && !wcscmp(out + 24, L"Windows\\System32\\a.txt"), "other root");
+
+    CHECK(PathCacheDropRoot(cache, temp) == 3, "dropped");
+    CHECK(PathCacheDropRoot(cache, temp) == 0, "dropped twice");
+    CHECK(PathCacheDropRoot(cache, 0) == 0, "raw paths have no root");
+    CHECK(PathCacheLookup(cache, temp, L"a.txt", 5, out, 128) == 0, "closed handle");
+    CHECK(PathCacheLookup(cache, temp, L"", 0, out, 128) == 0, "closed handle name");
+    CHECK(PathCacheLookup(cache, system, L"a.txt", 5, out, 128) == 46, "other handle kept");
+    CHECK(PathCacheLookup(cache, 0, L"a.txt", 5, out, 128) == 8, "raw path kept");
+
+    // The value comes back for another directory
+    PathCacheInsert(cache, temp, L"a.txt", 5, L"\\Device\\HarddiskVolume3\\a.txt", 29);
+    CHECK(PathCacheLookup(cache, temp, L"a.txt", 5, out, 128) == 29 && !wcscmp(out, L"\\Device\\HarddiskVolume3\\a.txt"), "reused handle");
+    PathCacheDestroy(cache);
+}
+
+static int oracle_find(uintptr_t root, int key)
+{
+    for (int i = 0; i < oracle_count; i++)
+        if (oracle[i].root == root && oracle[i].key == key)
+            return i;
+    return -1;
+}
+
+static void oracle_touch(int i)
+{
+    oracle_t entry = oracle[i];
+    memmove(&oracle[1], &oracle[0], i * sizeof(oracle_t));
+    oracle[0] = entry;
+}
+
+static void make_name(wchar_t *name, int key)
+{
+    swprintf(name, 32, L"\\Device\\HarddiskVolume2\\f%d", key);
+}
+
+// Random operations with few roots and keys and a small capacity, so that
+// collisions, replacement, eviction and drops all happen often
+static void test_random(void)
+{
+    PPATHCACHE cache = PathCacheCreate(CAPACITY);
+    wchar_t name[32], path[32], out[32];
+    PATHCACHESTATS stats;
+
+    for (int step = 0; step < 200000; step++) {
+        int op = next_random() % 8;
+        uintptr_t root = (next_random() % ROOTS) * 4;
+        int key = next_random() % KEYS;
+        int i = oracle_find(root, key);
+
+        make_name(name, key);
+
+        if (op < 4) {
+            size_t length = PathCacheLookup(cache, root, name, wcslen(name), out, 32);
+            if (i < 0)
+                CHECK(length == 0, "step %d: unexpected hit", step);
+            else {
+                swprintf(path, 32, L"C:\\f%d", oracle[i].value);
+                CHECK(length == wcslen(path) && !wcscmp(out, path), "step %d: wrong path", step);
+                oracle_touch(i);
+            }
+        } else if (op < 7) {
+            int value = next_random() % 100000;
+            swprintf(path, 32, L"C:\\f%d", value);
+            CHECK(PathCacheInsert(cache, root, name, wcslen(name), path, wcslen(path)), "step %d: insert", step);
+            if (i < 0) {
+                if (oracle_count == CAPACITY)
+                    oracle_count--;
+                i = oracle_count++;
+                oracle[i].root = root;
+                oracle[i].key = key;
+            }
+            oracle[i].value = value;
+            oracle_touch(i);
+        } else {
+            size_t expected = 0;
+            for (int j = 0; j < oracle_count; ) {
+                if (root && oracle[j].root == root) {
+                    memmove(&oracle[j], &oracle[j + 1], (oracle_count - j - 1) * sizeof(oracle_t));
+                    oracle_count--;
+                    expected++;
+                } else
+                    j++;
+            }
+            CHECK(PathCacheDropRoot(cache, root) == expected, "step %d: dropped", step);
+        }
+    }
+
+    PathCacheGetStats(cache, &stats);
+    CHECK(stats.Entries == (size_t)oracle_count, "entries %zu expected %d", stats.Entries, oracle_count);
+    PathCacheDestroy(cache);
+}
+
+static PPATHCACHE shared;
+
+static void *thread_work(void *arg)
+{
+    uint64_t state = (uintptr_t)arg * 0x9E3779B97F4A7C15ULL;
+    wchar_t name[32], path[32], out[32];
+
+    for (int step = 0; step < 50000; step++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        int key = state % KEYS;
+        uintptr_t root = (state >> 8) % ROOTS * 4;
+
+        make_name(name, key);
+        // A key always maps to the same path, whoever inserts it
+        swprintf(path, 32, L"C:\\%d\\f%d", (int)root, key);
+
+        switch ((state >> 16) % 8) {
+        case 0:
+            PathCacheDropRoot(shared, root);
+            break;
+        case 1:
+        case 2:
+            PathCacheInsert(shared, root, name, wcslen(name), path, wcslen(path));
+            break;
+        default:
+            if (PathCacheLookup(shared, root, name, wcslen(name), out, 32) && wcscmp(out, path))
+                return (void *)1;
+        }
+    }
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    pthread_t threads[THREADS];
+    void *result;
+
+    shared = PathCacheCreate(CAPACITY);
+    for (int i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, thread_work, (void *)(uintptr_t)(i + 1));
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], &result);
+        CHECK(result == NULL, "thread %d got another key's path", i);
+    }
+    PathCacheDestroy(shared);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A file activity trace shaped like a typical detonation: a few dozen system
+// and profile paths asked for constantly, a few hundred less often, and a
+// stream of paths seen once (fresh temp files), in every raw form the hooks see
+#define HOT 48
+#define WARM 400
+#define TRACE 400000
+
+static wchar_t *trace_path(int kind, int n)
+{
+    static const wchar_t *forms[] = {
+        L"\\??\\C:\\Windows\\System32\\%ls%d.dll",
+        L"\\Device\\HarddiskVolume2\\Users\\user\\AppData\\Roaming\\Microsoft\\%ls%d",
+        L"C:\\Users\\user\\AppData\\Local\\Temp\\%ls%d.tmp",
+        L"\\\\fileserver\\share\\documents\\%ls%d.docx",
+        L"\\SystemRoot\\Fonts\\%ls%d.ttf",
+    };
+    static const wchar_t *kinds[] = {L"hot", L"warm", L"once"};
+    wchar_t *path = malloc(256 * sizeof(wchar_t));
+    swprintf(path, 256, forms[n % 5], kinds[kind], n);
+    return path;
+}
+
+static void bench(void)
+{
+    static const unsigned int capacities[] = {64, 256, 512, 2048};
+    wchar_t **trace = malloc(TRACE * sizeof(wchar_t *));
+    wchar_t *resolved = malloc(32768 * sizeof(wchar_t));
+    wchar_t *hot[HOT], *warm[WARM];
+    int unique = 0;
+
+    for (int i = 0; i < HOT; i++)
+        hot[i] = trace_path(0, i);
+    for (int i = 0; i < WARM; i++)
+        warm[i] = trace_path(1, i);
+    for (int i = 0; i < TRACE; i++) {
+        unsigned int r = next_random() % 100;
+        if (r < 70)
+            trace[i] = hot[next_random() % HOT];
+        else if (r < 95)
+            trace[i] = warm[next_random() % WARM];
+        else {
+            trace[i] = trace_path(2, unique++);
+        }
+    }
+
+    for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+        PPATHCACHE cache = PathCacheCreate(capacities[c]);
+        PATHCACHESTATS stats;
+        double t0 = now();
+        for (int i = 0; i < TRACE; i++) {
+            size_t length = wcslen(trace[i]);
+            if (!PathCacheIsAbsolute(trace[i], length))
+                continue;
+            if (!PathCacheLookup(cache, 0, trace[i], length, resolved, 32768)) {
+                // stands in for GetFullPathNameW/GetLongPathNameW
+                wcscpy(resolved, L"C:\\");
+                wcscat(resolved, trace[i] + length / 2);
+                PathCacheInsert(cache, 0, trace[i], length, resolved, wcslen(resolved));
+            }
+        }
+        double t1 = now();
+        PathCacheGetStats(cache, &stats);
+        printf("capacity %4u: hit rate %.1f%%, %.0f ns per path (%zu evictions)\n", capacities[c],
+            100.0 * stats.Hits / (stats.Hits + stats.Misses), (t1 - t0) / TRACE * 1e9, stats.Evictions);
+        PathCacheDestroy(cache);
+    }
+
+    for (int i = 0; i < TRACE; i++)
+        if (wcsstr(trace[i], L"once"))
+            free(trace[i]);
+    for (int i = 0; i < HOT; i++)
+        free(hot[i]);
+    for (int i = 0; i < WARM; i++)
+        free(warm[i]);
+    free(trace);
+    free(resolved);
+}
+
+int main(int argc, char **argv)
+{
+    test_shapes();
+    test_basic();
+    test_roots();
+    test_random();
+    test_threads();
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        bench();
+
+    return failures != 0;
+}
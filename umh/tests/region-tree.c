@@ -0,0 +1,235 @@
+// Randomized tests for the tracked region interval tree against a brute-force
+// list, plus a lookup benchmark. Portable harness, build on Linux with:
+//   gcc -O2 -Wall -I../CAPE -o region-tree region-tree.c ../CAPE/RegionTree.c
+// Run "./region-tree bench" for timings at 10k-1M regions.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "RegionTree.h"
+
+#define MAX_ORACLE 4096
+
+typedef struct {
+    uintptr_t start, end;
+    void *data;
+} range_t;
+
+static range_t oracle[MAX_ORACLE];
+static int oracle_count, failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static int oracle_find(uintptr_t start)
+{
+    for (int i = 0; i < oracle_count; i++)
+        if (oracle[i].start == start)
+            return i;
+    return -1;
+}
+
+static void oracle_remove(int i)
+{
+    oracle[i] = oracle[--oracle_count];
+}
+
+static size_t oracle_overlap_count(uintptr_t s, uintptr_t e)
+{
+    size_t n = 0;
+    for (int i = 0; i < oracle_count; i++)
+        if (oracle[i].start < e && oracle[i].end > s)
+            n++;
+    return n;
+}
+
+typedef struct {
+    uintptr_t last_start, s, e;
+    int ordered, bad;
+} walk_t;
+
+static void check_walk(uintptr_t start, uintptr_t end, void *data, void *context)
+{
+    walk_t *w = context;
+    int i = oracle_find(start);
+    if (start < w->last_start)
+        w->ordered = 0;
+    w->last_start = start;
+    if (!(start < w->e && end > w->s) || i < 0 || oracle[i].end != end || oracle[i].data != data)
+        w->bad = 1;
+}
+
+static int check_node(PREGIONNODE n, uintptr_t lo, uintptr_t hi, int *height, uintptr_t *maxend)
+{
+    int hl = 0, hr = 0, count = 0;
+    uintptr_t ml = 0, mr = 0;
+    if (!n) {
+        *height = 0;
+        *maxend = 0;
+        return 0;
+    }
+    CHECK(n->Start >= lo && n->Start <= hi, "bst order");
+    count += check_node(n->Left, lo, n->Start - 1, &hl, &ml);
+    count += check_node(n->Right, n->Start + 1, hi, &hr, &mr);
+    CHECK(abs(hl - hr) <= 1, "balance %d %d", hl, hr);
+    *height = (hl > hr ? hl : hr) + 1;
+    CHECK(n->Height == *height, "height");
+    *maxend = n->End;
+    if (ml > *maxend)
+        *maxend = ml;
+    if (mr > *maxend)
+        *maxend = mr;
+    CHECK(n->MaxEnd == *maxend, "maxend");
+    return count + 1;
+}
+
+static void check_invariants(PREGIONTREE t)
+{
+    int height;
+    uintptr_t maxend;
+    int count = check_node(t->Root, 0, UINTPTR_MAX, &height, &maxend);
+    CHECK(count == oracle_count && t->Count == (size_t)oracle_count, "count %d %zu %d", count, t->Count, oracle_count);
+}
+
+static int removed_callbacks;
+
+static void count_removed(uintptr_t start, uintptr_t end, void *data, void *context)
+{
+    (void)start, (void)end, (void)data, (void)context;
+    removed_callbacks++;
+}
+
+static void test_random(int overlapping)
+{
+    REGIONTREE t;
+    RegionTreeInit(&t);
+    oracle_count = 0;
+
+    for (int step = 0; step < 200000; step++) {
+        uintptr_t s = (next_random() % 4096) * 0x1000;
+        uintptr_t len = (1 + next_random() % (overlapping ? 64 : 8)) * 0x1000;
+        uintptr_t e = s + len;
+        int op = next_random() % 100, i;
+
+        if (op < 35 && oracle_count < MAX_ORACLE - 2) {
+            if (!overlapping && oracle_overlap_count(s, e))
+                continue;
+            void *data = (void *)(uintptr_t)step;
+            int ok = RegionTreeInsert(&t, s, e, data);
+            CHECK(ok == (oracle_find(s) < 0), "insert %lx", (unsigned long)s);
+            if (ok)
+                oracle[oracle_count++] = (range_t){s, e, data};
+        } else if (op < 55) {
+            i = oracle_find(s);
+            void *data = RegionTreeRemove(&t, s);
+            CHECK(data == (i < 0 ? NULL : oracle[i].data), "remove %lx", (unsigned long)s);
+            if (i >= 0)
+                oracle_remove(i);
+        } else if (op < 70) {
+            i = oracle_find(s);
+            CHECK(RegionTreeLookup(&t, s) == (i < 0 ? NULL : oracle[i].data), "lookup");
+        } else if (op < 85) {
+            walk_t w = {0, s, e, 1, 0};
+            size_t count = RegionTreeOverlaps(&t, s, e, check_walk, &w);
+            CHECK(count == oracle_overlap_count(s, e) && w.ordered && !w.bad, "overlaps %zu", count);
+        }
+        if (step % 1000 == 0)
+            check_invariants(&t);
+    }
+    check_invariants(&t);
+
+    removed_callbacks = 0;
+    RegionTreeFree(&t, count_removed, NULL);
+    CHECK(removed_callbacks == oracle_count && t.Root == NULL && t.Count == 0, "free");
+}
+
+static void test_edges(void)
+{
+    REGIONTREE t;
+    RegionTreeInit(&t);
+
+    CHECK(!RegionTreeInsert(&t, 10, 10, NULL), "empty range");
+    CHECK(RegionTreeInsert(&t, 0x1000, 0x3000, (void *)1), "insert");
+    CHECK(!RegionTreeInsert(&t, 0x1000, 0x2000, (void *)2), "duplicate start");
+    CHECK(RegionTreeOverlaps(&t, 0, 0x1000, NULL, NULL) == 0, "before");
+    CHECK(RegionTreeOverlaps(&t, 0xfff, 0x1001, NULL, NULL) == 1, "first byte");
+    CHECK(RegionTreeOverlaps(&t, 0x2fff, 0x3000, NULL, NULL) == 1, "last byte");
+    CHECK(RegionTreeOverlaps(&t, 0x3000, 0x4000, NULL, NULL) == 0, "end is exclusive");
+    CHECK(RegionTreeOverlaps(&t, 0x2000, 0x2000, NULL, NULL) == 0, "empty query");
+    CHECK(RegionTreeRemove(&t, 0x2000) == NULL && RegionTreeRemove(&t, 0x1000) == (void *)1, "remove by start");
+    CHECK(t.Count == 0 && t.Root == NULL, "empty");
+    RegionTreeFree(&t, NULL, NULL);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(void)
+{
+    static const size_t sizes[] = {10000, 100000, 1000000};
+
+    for (int k = 0; k < 3; k++) {
+        size_t n = sizes[k], lookups = 2000000, hits = 0;
+        REGIONTREE t;
+        double t0, t1, t2;
+
+        RegionTreeInit(&t);
+        t0 = now();
+        for (size_t i = 0; i < n; i++) {
+            uintptr_t s = ((uintptr_t)(next_random() % (n * 16))) << 16;
+            RegionTreeInsert(&t, s, s + 0x10000, (void *)s);
+        }
+        t1 = now();
+        for (size_t i = 0; i < lookups; i++) {
+            uintptr_t p = ((uintptr_t)(next_random() % (n * 16))) << 16;
+            hits += RegionTreeLookup(&t, p) != NULL;
+        }
+        t2 = now();
+        printf("%8zu regions: insert %6.1f ns, lookup %6.1f ns (%zu hits)\n", t.Count,
+            (t1 - t0) / n * 1e9, (t2 - t1) / lookups * 1e9, hits);
+
+        // the linked list walk this replaces, on a sample of queries
+        range_t *list = malloc(n * sizeof(range_t));
+        for (size_t i = 0; i < n; i++)
+            list[i].start = ((uintptr_t)(next_random() % (n * 16))) << 16;
+        t1 = now();
+        for (size_t i = 0; i < 2000; i++) {
+            uintptr_t p = ((uintptr_t)(next_random() % (n * 16))) << 16;
+            for (size_t j = 0; j < n; j++)
+                if (list[j].start == p) {
+                    hits++;
+                    break;
+                }
+        }
+        t2 = now();
+        printf("%8zu regions: linked list walk %9.1f ns (%zu hits)\n", n, (t2 - t1) / 2000 * 1e9, hits);
+        free(list);
+        RegionTreeFree(&t, NULL, NULL);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    test_edges();
+    test_random(0);
+    test_random(1);
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        bench();
+
+    return failures != 0;
+}
@@ -0,0 +1,581 @@
+// Tests for the relocation engine behind PeParser's reBasePEImage: real
+// relocatable PE files are rebased to several bases and compared byte for
+// byte against a plain reference that looks every fixup's section up on its
+// own, then moved back to their preferred base the way a dump is and
+// compared with the file. Generated images cover HIGH, LOW and HIGHADJ
+// fixups, pages straddling sections, fixups straddling the end of section
+// data, unsorted and overlapping sections, malformed blocks and sections
+// Prepare refuses. Portable harness, build on Linux with:
+//   gcc -O2 -Wall -I../CAPE -o relocate relocate.c ../CAPE/Relocate.c
+// Relocatable PE files given on the command line are loaded from their
+// sections and rebased the same way.
+// Run "./relocate bench" for fixups per second over a 64MB image.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "Relocate.h"
+
+#define MAX_SECTIONS 16
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static uint16_t get16(const unsigned char *p) { return p[0] | p[1] << 8; }
+static uint32_t get32(const unsigned char *p) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+static uint64_t get64(const unsigned char *p) { return get32(p) | (uint64_t)get32(p + 4) << 32; }
+static void put16(unsigned char *p, uint16_t v) { p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8); }
+static void put32(unsigned char *p, uint32_t v) { put16(p, (uint16_t)v); put16(p + 2, (uint16_t)(v >> 16)); }
+static void put64(unsigned char *p, uint64_t v) { put32(p, (uint32_t)v); put32(p + 4, (uint32_t)(v >> 32)); }
+
+typedef struct {
+    uint32_t va, vs;
+    unsigned char *data;
+    uint32_t data_size;
+} section_t;
+
+typedef struct {
+    int count;
+    section_t sections[MAX_SECTIONS];
+    unsigned char *relocs;
+    size_t relocs_size;
+} image_t;
+
+typedef struct {
+    size_t applied, unchanged, outside, unsupported;
+    int malformed;
+    int prepared[MAX_SECTIONS];
+} counts_t;
+
+static int find_section(const image_t *image, uint32_t rva)
+{
+    for (int i = 0; i < image->count; i++)
+        if (rva >= image->sections[i].va && (uint64_t)rva < (uint64_t)image->sections[i].va + image->sections[i].vs)
+            return i;
+    return -1;
+}
+
+// Every fixup looked up on its own, the way the PE format describes them
+static void reference(image_t *image, uint64_t delta, uint64_t check_base, uint64_t check_size, const int *refuse, counts_t *counts)
+{
+    int refused[MAX_SECTIONS] = { 0 };
+    size_t offset = 0;
+
+    memset(counts, 0, sizeof(*counts));
+    while (offset + 8 <= image->relocs_size) {
+        const unsigned char *block = image->relocs + offset;
+        uint32_t page = get32(block), block_size = get32(block + 4);
+        if (!block_size)
+            break;
+        if (block_size < 8 || block_size > image->relocs_size - offset) {
+            counts->malformed = 1;
+            break;
+        }
+        size_t entries = (block_size - 8) / 2;
+        for (size_t i = 0; i < entries; i++) {
+            uint16_t entry = get16(block + 8 + i * 2), low = 0;
+            unsigned type = entry >> 12, width;
+            uint32_t rva = page + (entry & 0xFFF);
+            uint64_t value;
+            if (type == RELOC_HIGHADJ) {
+                if (i + 1 >= entries) {
+                    counts->malformed = 1;
+                    break;
+                }
+                low = get16(block + 8 + ++i * 2);
+            }
+            if (type == RELOC_ABSOLUTE)
+                continue;
+            int s = find_section(image, rva);
+            if (s < 0) {
+                counts->outside++;
+                continue;
+            }
+            section_t *section = &image->sections[s];
+            width = type == RELOC_DIR64 ? 8 : type == RELOC_HIGHLOW ? 4 : type == RELOC_HIGH || type == RELOC_LOW || type == RELOC_HIGHADJ ? 2 : 0;
+            if (!width) {
+                counts->unsupported++;
+                continue;
+            }
+            uint64_t at = rva - section->va;
+            if (refused[s] || at + width > section->data_size) {
+                counts->outside++;
+                continue;
+            }
+            unsigned char *p = section->data + at;
+            switch (type) {
+            case RELOC_DIR64:
+                value = get64(p);
+                if (check_size && value - check_base >= check_size) {
+                    counts->unchanged++;
+                    continue;
+                }
+                value += delta;
+                break;
+            case RELOC_HIGHLOW:
+                value = get32(p);
+                if (check_size && (uint32_t)(value - check_base) >= check_size) {
+                    counts->unchanged++;
+                    continue;
+                }
+                value = (uint32_t)(value + delta);
+                break;
+            case RELOC_LOW:
+                value = (uint16_t)(get16(p) + delta);
+                break;
+            case RELOC_HIGH:
+                value = (uint32_t)(((uint32_t)get16(p) << 16) + (uint32_t)delta) >> 16;
+                break;
+            default:
+                value = (uint32_t)(((uint32_t)get16(p) << 16) + (int16_t)low + (uint32_t)delta + 0x8000) >> 16;
+                break;
+            }
+            if (!counts->prepared[s]) {
+                counts->prepared[s] = 1;
+                if (refuse && refuse[s]) {
+                    refused[s] = 1;
+                    counts->outside++;
+                    continue;
+                }
+            }
+            if (width == 8)
+                put64(p, value);
+            else if (width == 4)
+                put32(p, (uint32_t)value);
+            else
+                put16(p, (uint16_t)value);
+            counts->applied++;
+        }
+        offset += block_size;
+    }
+}
+
+// reBasePEImage's loop before the engine, with its block walk put right and
+// fixups past the section data left alone rather than overrun
+static size_t old_rebase(image_t *image, int pe64, uint64_t new_base, uint64_t image_base, uint32_t size_of_image)
+{
+    uint64_t delta = new_base - image_base;
+    size_t offset = 0, applied = 0;
+
+    while (offset + 8 <= image->relocs_size) {
+        const unsigned char *block = image->relocs + offset;
+        uint32_t block_size = get32(block + 4);
+        if (block_size < 8 || block_size > image->relocs_size - offset)
+            break;
+        for (size_t i = 0; i < (block_size - 8) / 2; i++) {
+            uint16_t entry = get16(block + 8 + i * 2);
+            if (!entry)
+                continue;
+            uint32_t rva = get32(block) + (entry & 0xFFF);
+            int s = find_section(image, rva);
+            if (s < 0 || rva - image->sections[s].va + (pe64 ? 8 : 4) > image->sections[s].data_size)
+                continue;
+            unsigned char *p = image->sections[s].data + (rva - image->sections[s].va);
+            if (pe64) {
+                uint64_t value = get64(p);
+                if (value - new_base < size_of_image) {
+                    s = find_section(image, rva);
+                    put64(image->sections[s].data + (rva - image->sections[s].va), value - delta);
+                    applied++;
+                }
+            }
+            else {
+                uint32_t value = get32(p);
+                if ((uint32_t)(value - new_base) < size_of_image) {
+                    s = find_section(image, rva);
+                    put32(image->sections[s].data + (rva - image->sections[s].va), value - (uint32_t)delta);
+                    applied++;
+                }
+            }
+        }
+        offset += block_size;
+    }
+    return applied;
+}
+
+typedef struct {
+    RELOCSECTION *sections;
+    const int *refuse;
+    unsigned char *copies[MAX_SECTIONS];
+    int calls[MAX_SECTIONS];
+} prepare_t;
+
+// Stands in for makeSectionWritable: the engine starts on views of the
+// sections it must not write to, and gets a copy of one when it needs it
+static unsigned char *prepare(void *context, size_t index)
+{
+    prepare_t *state = context;
+    state->calls[index]++;
+    if (state->refuse && state->refuse[index])
+        return NULL;
+    state->copies[index] = malloc(state->sections[index].DataSize + 1);
+    memcpy(state->copies[index], state->sections[index].Data, state->sections[index].DataSize);
+    return state->copies[index];
+}
+
+static void engine(image_t *image, uint64_t delta, uint64_t check_base, uint64_t check_size, RELOCRESULT *result)
+{
+    RELOCSECTION sections[MAX_SECTIONS];
+    for (int i = 0; i < image->count; i++) {
+        sections[i].VirtualAddress = image->sections[i].va;
+        sections[i].VirtualSize = image->sections[i].vs;
+        sections[i].Data = image->sections[i].data;
+        sections[i].DataSize = image->sections[i].data_size;
+        sections[i].Prepared = 0;
+    }
+    RelocApply(image->relocs, image->relocs_size, sections, image->count, delta, check_base, check_size, NULL, NULL, result);
+}
+
+static int same_data(const image_t *a, const image_t *b)
+{
+    for (int i = 0; i < a->count; i++)
+        if (memcmp(a->sections[i].data, b->sections[i].data, a->sections[i].data_size))
+            return 0;
+    return 1;
+}
+
+static void copy_image(image_t *to, const image_t *from)
+{
+    *to = *from;
+    for (int i = 0; i < from->count; i++) {
+        to->sections[i].data = malloc(from->sections[i].data_size + 1);
+        memcpy(to->sections[i].data, from->sections[i].data, from->sections[i].data_size);
+    }
+}
+
+static void free_image(image_t *image)
+{
+    for (int i = 0; i < image->count; i++)
+        free(image->sections[i].data);
+}
+
+static int same_counts(const RELOCRESULT *result, const counts_t *counts)
+{
+    return result->Applied == counts->applied && result->Unchanged == counts->unchanged && result->Outside == counts->outside
+        && result->Unsupported == counts->unsupported && !result->Malformed == !counts->malformed;
+}
+
+static void test_file(const char *path)
+{
+    static const uint64_t bases32[] = { 0x10000000, 0x7FFF0000, 0x10000, 0x400000 };
+    static const uint64_t bases64[] = { 0x180000000ULL, 0x7FF600000000ULL, 0x10000, 0x140000000ULL };
+    FILE *f = fopen(path, "rb");
+    unsigned char *file;
+    long size;
+    image_t image = { 0 };
+
+    if (!f)
+        return;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    file = malloc(size + 1);
+    if (fread(file, 1, size, f) != (size_t)size)
+        size = 0;
+    fclose(f);
+
+    uint32_t lfanew = size > 0x40 ? get32(file + 0x3c) : 0;
+    if (size < 0x40 || get16(file) != 0x5A4D || (uint64_t)lfanew + 0x108 > (uint64_t)size || get32(file + lfanew) != 0x4550) {
+        printf("%s: not a PE file\n", path);
+        free(file);
+        return;
+    }
+    const unsigned char *optional = file + lfanew + 24;
+    int pe64 = get16(optional) == 0x20B;
+    uint64_t image_base = pe64 ? get64(optional + 24) : get32(optional + 28);
+    uint32_t size_of_image = get32(optional + 56);
+    const unsigned char *directory = optional + (pe64 ? 112 : 96) + 5 * 8;
+    uint32_t reloc_rva = get32(directory), reloc_size = get32(directory + 4);
+    const unsigned char *headers = optional + get16(file + lfanew + 20);
+    image.count = get16(file + lfanew + 6);
+    if (image.count > MAX_SECTIONS || headers + image.count * 40 > file + size) {
+        printf("%s: too many sections\n", path);
+        free(file);
+        return;
+    }
+
+    // The sections as readPeSectionsFromFile holds them, and the directory
+    // as the image holds it
+    for (int i = 0; i < image.count; i++) {
+        const unsigned char *header = headers + i * 40;
+        uint32_t raw = get32(header + 20), raw_size = get32(header + 16);
+        section_t *section = &image.sections[i];
+        section->vs = get32(header + 8);
+        section->va = get32(header + 12);
+        if (raw > (uint32_t)size)
+            raw_size = 0;
+        else if (raw_size > (uint32_t)size - raw)
+            raw_size = size - raw;
+        section->data = malloc(raw_size + 1);
+        memcpy(section->data, file + raw, raw_size);
+        section->data_size = raw_size;
+        if (reloc_rva >= section->va && reloc_rva - section->va < section->vs) {
+            uint32_t at = reloc_rva - section->va;
+            image.relocs = section->data + (at < raw_size ? at : raw_size);
+            image.relocs_size = at < raw_size ? (raw_size - at < reloc_size ? raw_size - at : reloc_size) : 0;
+        }
+    }
+
+    if (!reloc_rva || !image.relocs_size) {
+        printf("%s: no relocations\n", path);
+        free_image(&image);
+        free(file);
+        return;
+    }
+
+    image_t original;
+    copy_image(&original, &image);
+    size_t fixups = 0;
+    int as_before = 1;
+    const uint64_t *bases = pe64 ? bases64 : bases32;
+
+    for (int b = 0; b < 4; b++) {
+        uint64_t new_base = b == 3 ? image_base + 0x10000 : bases[b];
+        image_t expected, moved;
+        RELOCRESULT result;
+        counts_t counts;
+
+        // Loaded at the new base
+        copy_image(&expected, &original);
+        expected.relocs = image.relocs;
+        reference(&expected, new_base - image_base, 0, 0, NULL, &counts);
+        copy_image(&moved, &original);
+        moved.relocs = image.relocs;
+        engine(&moved, new_base - image_base, 0, 0, &result);
+        CHECK(same_data(&moved, &expected), "%s at 0x%llx: rebased differently", path, (unsigned long long)new_base);
+        CHECK(same_counts(&result, &counts), "%s at 0x%llx: %zu fixups applied, %zu expected", path, (unsigned long long)new_base, result.Applied, counts.applied);
+        CHECK(!result.Malformed && !result.Unsupported && !result.Outside, "%s at 0x%llx: %d %zu %zu", path, (unsigned long long)new_base, result.Malformed, result.Unsupported, result.Outside);
+        fixups = result.Applied;
+
+        // and dumped back to the preferred base
+        image_t old;
+        copy_image(&old, &moved);
+        engine(&moved, image_base - new_base, new_base, size_of_image, &result);
+        CHECK(same_data(&moved, &original), "%s from 0x%llx: not moved back", path, (unsigned long long)new_base);
+        CHECK(result.Applied == fixups && !result.Unchanged, "%s from 0x%llx: %zu of %zu fixups moved back", path, (unsigned long long)new_base, result.Applied, fixups);
+        old_rebase(&old, pe64, new_base, image_base, size_of_image);
+        if (!same_data(&old, &moved))
+            as_before = 0;
+
+        free_image(&old);
+        free_image(&moved);
+        free_image(&expected);
+    }
+
+    printf("%s: %s, %u bytes of relocations, %zu fixups, rebased 4 ways%s\n", path, pe64 ? "PE32+" : "PE32",
+        (unsigned)image.relocs_size, fixups, as_before ? ", moved back as before" : ", moved back unlike before");
+    free_image(&original);
+    free_image(&image);
+    free(file);
+}
+
+static void test_generated(void)
+{
+    int trials = 0, straddling = 0, unsorted = 0, malformed = 0, refusals = 0;
+
+    for (int trial = 0; trial < 4000; trial++) {
+        image_t image = { 0 }, expected;
+        int refuse[MAX_SECTIONS] = { 0 };
+        uint32_t va = (next_random() % 4) * 0x800;
+        uint64_t base = next_random() % 2 ? 0x10000000 : 0x180000000ULL;
+
+        image.count = 1 + next_random() % 8;
+        for (int i = 0; i < image.count; i++) {
+            section_t *section = &image.sections[i];
+            uint32_t vs = next_random() % 3 == 0 ? next_random() % 0x1800 : 0x1000 * (1 + next_random() % 4);
+            section->va = va;
+            section->vs = vs;
+            section->data_size = next_random() % 4 == 0 ? next_random() % (vs + 0x20) : vs;
+            section->data = malloc(section->data_size + 1);
+            // Mostly pointers into the image, so a check range has some to keep
+            for (uint32_t j = 0; j < section->data_size; j++)
+                section->data[j] = (unsigned char)next_random();
+            for (uint32_t j = 0; j + 8 <= section->data_size; j += 4)
+                if (next_random() % 2)
+                    put64(section->data + j, base + next_random() % 0x10000);
+            va += vs + (next_random() % 3 == 0 ? (next_random() % 4) * 0x100 : 0);
+            refuse[i] = next_random() % 10 == 0;
+            refusals += refuse[i];
+        }
+        if (next_random() % 10 == 0) {
+            // Out of order, or one section over another
+            int a = next_random() % image.count, b = next_random() % image.count;
+            section_t swap = image.sections[a];
+            image.sections[a] = image.sections[b];
+            image.sections[b] = swap;
+            if (next_random() % 2)
+                image.sections[a].vs += 0x1800;
+            unsorted++;
+        }
+
+        size_t capacity = 0x10000, used = 0;
+        unsigned char *relocs = calloc(capacity, 1);
+        int blocks = 1 + next_random() % 12;
+        uint32_t page = 0;
+        for (int b = 0; b < blocks && used + 8 + 0x400 < capacity; b++) {
+            size_t entries = next_random() % 6 == 0 ? next_random() % 4 : next_random() % 300;
+            unsigned type = next_random() % 3 == 0 ? RELOC_HIGHLOW : RELOC_DIR64;
+            page = next_random() % 4 ? page + 0x1000 * (next_random() % 3) : (uint32_t)(next_random() % (va + 0x2000));
+            if (next_random() % 8 == 0)
+                page += 0x800;
+            put32(relocs + used, page);
+            put32(relocs + used + 4, (uint32_t)(8 + entries * 2));
+            for (size_t e = 0; e < entries; e++) {
+                uint16_t offset = next_random() % 0x1000;
+                if (next_random() % 16 == 0)
+                    type = (unsigned)(next_random() % 12);
+                else if (next_random() % 8 == 0)
+                    type = next_random() % 2 ? RELOC_HIGHLOW : RELOC_DIR64;
+                put16(relocs + used + 8 + e * 2, (uint16_t)(type << 12 | offset));
+                if (offset > 0xFF8 || page % 0x1000)
+                    straddling++;
+                // HIGHADJ's low half may be any value
+                if (type == RELOC_HIGHADJ && e + 1 < entries && next_random() % 2)
+                    put16(relocs + used + 8 + ++e * 2, (uint16_t)next_random());
+            }
+            if (entries % 2 && next_random() % 2)
+                entries++;
+            used += 8 + entries * 2;
+        }
+        if (next_random() % 8 == 0) {
+            // A block too short, or one past the end
+            put32(relocs + used, page);
+            put32(relocs + used + 4, next_random() % 2 ? (uint32_t)(next_random() % 8) : 0x10000);
+            used += 8;
+            malformed++;
+        }
+        else if (next_random() % 8 == 0)
+            used += 8 + next_random() % 8;
+        else if (next_random() % 8 == 0)
+            used -= next_random() % 8;
+        image.relocs = relocs;
+        image.relocs_size = used;
+
+        uint64_t delta = next_random(), check_base = 0, check_size = 0;
+        if (next_random() % 2) {
+            check_base = base + next_random() % 0x8000;
+            check_size = next_random() % 0x10000;
+        }
+        else if (next_random() % 4 == 0)
+            delta = (next_random() % 0x100) << 16;
+
+        // The engine starts on views and copies sections as it writes to them
+        int *refusing = next_random() % 2 ? refuse : NULL;
+        RELOCSECTION sections[MAX_SECTIONS];
+        prepare_t state = { sections, refusing, { 0 }, { 0 } };
+        image_t views;
+        RELOCRESULT result;
+        counts_t counts;
+        copy_image(&views, &image);
+        copy_image(&expected, &image);
+        for (int i = 0; i < image.count; i++) {
+            sections[i].VirtualAddress = views.sections[i].va;
+            sections[i].VirtualSize = views.sections[i].vs;
+            sections[i].Data = views.sections[i].data;
+            sections[i].DataSize = views.sections[i].data_size;
+            sections[i].Prepared = 0;
+        }
+        reference(&expected, delta, check_base, check_size, refusing, &counts);
+        RelocApply(relocs, used, sections, image.count, delta, check_base, check_size, prepare, &state, &result);
+
+        CHECK(same_counts(&result, &counts), "trial %d: applied %zu/%zu unchanged %zu/%zu outside %zu/%zu unsupported %zu/%zu malformed %d/%d", trial,
+            result.Applied, counts.applied, result.Unchanged, counts.unchanged, result.Outside, counts.outside, result.Unsupported, counts.unsupported, result.Malformed, counts.malformed);
+        CHECK(same_data(&views, &image), "trial %d: a view was written to", trial);
+        for (int i = 0; i < image.count; i++) {
+            const unsigned char *data = state.copies[i] ? state.copies[i] : views.sections[i].data;
+            CHECK(state.calls[i] == counts.prepared[i], "trial %d: section %d prepared %d times", trial, i, state.calls[i]);
+            CHECK(!memcmp(data, expected.sections[i].data, image.sections[i].data_size), "trial %d: section %d relocated differently", trial, i);
+            free(state.copies[i]);
+        }
+
+        free_image(&views);
+        free_image(&expected);
+        free_image(&image);
+        free(relocs);
+        trials++;
+    }
+    printf("%d generated images, %d with unsorted sections, %d malformed, %d straddling fixups, %d sections refused\n",
+        trials, unsorted, malformed, straddling, refusals);
+}
+
+static void bench(void)
+{
+    enum { SECTIONS = 16, SECTION_SIZE = 4 << 20, STRIDE = 16, ROUNDS = 3 };
+    const uint64_t image_base = 0x180000000ULL, new_base = 0x7FF600000000ULL;
+    const uint32_t size_of_image = SECTIONS * SECTION_SIZE;
+    size_t pages = (size_t)size_of_image / 0x1000, block_size = 8 + 0x1000 / STRIDE * 2;
+    image_t image = { 0 };
+    double old_ms = 0, new_ms = 0;
+    size_t fixups = pages * (0x1000 / STRIDE), applied = 0;
+
+    image.count = SECTIONS;
+    for (int i = 0; i < SECTIONS; i++) {
+        image.sections[i].va = 0x1000 + i * SECTION_SIZE;
+        image.sections[i].vs = SECTION_SIZE;
+        image.sections[i].data_size = SECTION_SIZE;
+        image.sections[i].data = malloc(SECTION_SIZE);
+        for (uint32_t j = 0; j < SECTION_SIZE; j += 8)
+            put64(image.sections[i].data + j, new_base + next_random() % size_of_image);
+    }
+    image.relocs_size = pages * block_size;
+    image.relocs = malloc(image.relocs_size);
+    for (size_t p = 0; p < pages; p++) {
+        unsigned char *block = image.relocs + p * block_size;
+        put32(block, (uint32_t)(0x1000 + p * 0x1000));
+        put32(block + 4, (uint32_t)block_size);
+        for (int e = 0; e < 0x1000 / STRIDE; e++)
+            put16(block + 8 + e * 2, (uint16_t)(RELOC_DIR64 << 12 | e * STRIDE));
+    }
+
+    // Each round moves the image back to its base and then forward again
+    for (int round = 0; round < ROUNDS; round++) {
+        RELOCRESULT result;
+        double start = now();
+        applied += old_rebase(&image, 1, new_base, image_base, size_of_image);
+        old_ms += now() - start;
+        engine(&image, new_base - image_base, 0, 0, &result);
+
+        start = now();
+        engine(&image, image_base - new_base, new_base, size_of_image, &result);
+        new_ms += now() - start;
+        applied += result.Applied;
+        engine(&image, new_base - image_base, 0, 0, &result);
+    }
+    CHECK(applied == fixups * ROUNDS * 2, "%zu of %zu fixups applied", applied, fixups * ROUNDS * 2);
+    printf("%uMB image, %zu DIR64 fixups: per fixup lookup %.0f ms (%.1fM fixups/s), engine %.0f ms (%.1fM fixups/s), %.2fx\n",
+        size_of_image >> 20, fixups, old_ms / ROUNDS, fixups / (old_ms / ROUNDS) / 1e3, new_ms / ROUNDS, fixups / (new_ms / ROUNDS) / 1e3, old_ms / new_ms);
+    free_image(&image);
+    free(image.relocs);
+}
+
+int main(int argc, char **argv)
+{
+    int bench_mode = argc > 1 && !strcmp(argv[1], "bench");
+
+    test_generated();
+    for (int i = bench_mode ? 2 : 1; i < argc; i++)
+        test_file(argv[i]);
+    if (bench_mode)
+        bench();
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+    return failures != 0;
+}
@@ -0,0 +1,261 @@
+// Staleness tests for the compiled Yara rules cache: a cache is written for a
+// set of rule sources, then the sources, libyara version and compile flags are
+// changed and the cache must be rejected, while an unchanged set (in any
+// order) must be accepted with its blobs intact. The cache file is also
+// round-tripped through a read-only mapping as YaraInit loads it. Portable
+// harness, build on Linux with:
+//   gcc -O2 -Wall -I../CAPE -o rules-cache rules-cache.c ../CAPE/RulesCache.c ../CAPE/Xxh64.c
+// Run "./rules-cache bench" for manifest and validation timings with 1k rule files.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "RulesCache.h"
+
+#define YARA_VERSION 0x040300
+#define FLAGS 3
+#define SOURCES 4
+
+static const char *names[SOURCES] = {"Emotet.yar", "Cobalt.yar", "Upx.yar", "Zz.yar"};
+static char *contents[SOURCES];
+static unsigned char blob[4096], immediate[512];
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static void build_manifest(PRULESMANIFEST m, uint32_t version, uint32_t flags, const int *order, int count)
+{
+    RulesManifestInit(m, version, flags);
+    for (int i = 0; i < count; i++) {
+        int k = order ? order[i] : i;
+        RulesManifestAdd(m, names[k], contents[k], strlen(contents[k]));
+    }
+}
+
+// writes a cache for the current sources with two blobs
+static unsigned char *write_cache(size_t *size)
+{
+    RULESMANIFEST m;
+    RULESCACHEBLOB blobs[2] = {{blob, sizeof(blob)}, {immediate, sizeof(immediate)}};
+    build_manifest(&m, YARA_VERSION, FLAGS, NULL, SOURCES);
+    *size = RulesCacheSize(&m, blobs, 2);
+    unsigned char *cache = malloc(*size);
+    CHECK(RulesCacheWrite(&m, blobs, 2, cache, *size) == *size, "write");
+    CHECK(RulesCacheWrite(&m, blobs, 2, cache, *size - 1) == 0, "short buffer");
+    RulesManifestFree(&m);
+    return cache;
+}
+
+static RULESCACHESTATUS validate(const unsigned char *cache, size_t size, uint32_t version, uint32_t flags, const int *order, int count)
+{
+    RULESMANIFEST m;
+    RULESCACHEBLOB blobs[RULES_CACHE_MAX_BLOBS];
+    unsigned int blob_count = 0;
+    build_manifest(&m, version, flags, order, count);
+    RULESCACHESTATUS status = RulesCacheValidate(cache, size, &m, blobs, &blob_count);
+    if (status == RULES_CACHE_VALID) {
+        CHECK(blob_count == 2, "blob count %u", blob_count);
+        CHECK(blobs[0].Size == sizeof(blob) && !memcmp(blobs[0].Data, blob, sizeof(blob)), "rules blob");
+        CHECK(blobs[1].Size == sizeof(immediate) && !memcmp(blobs[1].Data, immediate, sizeof(immediate)), "immediate blob");
+    }
+    RulesManifestFree(&m);
+    return status;
+}
+
+static void test_staleness(void)
+{
+    static const int reversed[SOURCES] = {3, 2, 1, 0};
+    static const int renamed_order[SOURCES] = {0, 1, 2, 3};
+    size_t size;
+    unsigned char *cache;
+    char *saved;
+
+    for (int i = 0; i < SOURCES; i++) {
+        contents[i] = malloc(256);
+        snprintf(contents[i], 256, "rule R%d { strings: $a = \"%016llx\" condition: $a }", i, (unsigned long long)next_random());
+    }
+    for (size_t i = 0; i < sizeof(blob); i++)
+        blob[i] = (unsigned char)next_random();
+    for (size_t i = 0; i < sizeof(immediate); i++)
+        immediate[i] = (unsigned char)next_random();
+
+    cache = write_cache(&size);
+
+    CHECK(validate(cache, size, YARA_VERSION, FLAGS, NULL, SOURCES) == RULES_CACHE_VALID, "unchanged");
+    CHECK(validate(cache, size, YARA_VERSION, FLAGS, reversed, SOURCES) == RULES_CACHE_VALID, "enumeration order");
+    CHECK(validate(cache, size, YARA_VERSION + 1, FLAGS, NULL, SOURCES) == RULES_CACHE_VERSION, "yara version");
+    CHECK(validate(cache, size, YARA_VERSION, FLAGS ^ 2, NULL, SOURCES) == RULES_CACHE_FLAGS, "flags");
+    CHECK(validate(cache, size, YARA_VERSION, FLAGS, NULL, SOURCES - 1) == RULES_CACHE_STALE, "file removed");
+
+    // Same size, one byte different: only the content hash can tell
+    contents[2][20] ^= 1;
+    CHECK(validate(cache, size, YARA_VERSION, FLAGS, NULL, SOURCES) == RULES_CACHE_STALE, "content changed");
+    contents[2][20] ^= 1;
+
+    // Truncated to a shorter file
+    saved = contents[1];
+    contents[1] = strdup(saved);
+    contents[1][10] = '\0';
+    CHECK(validate(cache, size, YARA_VERSION, FLAGS, NULL, SOURCES) == RULES_CACHE_STALE, "size changed");
+    free(contents[1]);
+    contents[1] = saved;
+
+    // Renamed with identical content
+    names[3] = "Zy.yar";
+    CHECK(validate(cache, size, YARA_VERSION, FLAGS, renamed_order, SOURCES) == RULES_CACHE_STALE, "renamed");
+    names[3] = "Zz.yar";
+
+    // Added: a cache written for fewer files than are present
+    free(cache);
+    {
+        RULESMANIFEST m;
+        RULESCACHEBLOB blobs[2] = {{blob, sizeof(blob)}, {immediate, sizeof(immediate)}};
+        build_manifest(&m, YARA_VERSION, FLAGS, NULL, SOURCES - 1);
+        size = RulesCacheSize(&m, blobs, 2);
+        cache = malloc(size);
+        RulesCacheWrite(&m, blobs, 2, cache, size);
+        RulesManifestFree(&m);
+    }
+    CHECK(validate(cache, size, YARA_VERSION, FLAGS, NULL, SOURCES) == RULES_CACHE_STALE, "file added");
+    CHECK(validate(cache, size, YARA_VERSION, FLAGS, NULL, SOURCES - 1) == RULES_CACHE_VALID, "subset");
+    free(cache);
+}
+
+static void test_corruption(void)
+{
+    size_t size;
+    unsigned char *cache = write_cache(&size);
+
+    CHECK(validate(cache, 0, YARA_VERSION, FLAGS, NULL, SOURCES) == RULES_CACHE_CORRUPT, "empty");
+    for (size_t cut = 1; cut < size; cut += 1 + cut / 4)
+        CHECK(validate(cache, size - cut, YARA_VERSION, FLAGS, NULL, SOURCES) == RULES_CACHE_CORRUPT, "truncated by %zu", cut);
+
+    // A flipped bit anywhere after the magic is caught by the checksum or the layout checks
+    for (int i = 0; i < 2000; i++) {
+        size_t offset = 4 + next_random() % (size - 4);
+        unsigned char bit = 1 << (next_random() % 8);
+        cache[offset] ^= bit;
+        RULESCACHESTATUS status = validate(cache, size, YARA_VERSION, FLAGS, NULL, SOURCES);
+        CHECK(status != RULES_CACHE_VALID, "bit flip at %zu", offset);
+        cache[offset] ^= bit;
+    }
+
+    // A legacy raw yara rules file is not a cache
+    memcpy(cache, "YARA", 4);
+    CHECK(validate(cache, size, YARA_VERSION, FLAGS, NULL, SOURCES) == RULES_CACHE_CORRUPT, "bad magic");
+    free(cache);
+}
+
+// Write to a temporary name then rename over the cache, and load through a read-only mapping
+static void test_mapped(void)
+{
+    char path[] = "/tmp/rules-cache-XXXXXX", temp[64];
+    size_t size;
+    unsigned char *cache = write_cache(&size);
+    int fd = mkstemp(path);
+
+    CHECK(fd >= 0, "mkstemp");
+    close(fd);
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+    fd = open(temp, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+    CHECK(write(fd, cache, size) == (ssize_t)size, "write file");
+    close(fd);
+    CHECK(rename(temp, path) == 0, "replace");
+
+    fd = open(path, O_RDONLY);
+    struct stat st;
+    fstat(fd, &st);
+    void *view = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    CHECK(view != MAP_FAILED && (size_t)st.st_size == size, "map");
+    CHECK(validate(view, st.st_size, YARA_VERSION, FLAGS, NULL, SOURCES) == RULES_CACHE_VALID, "mapped");
+    munmap(view, st.st_size);
+    unlink(path);
+    free(cache);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Startup cost of the staleness check: hashing 1k rule sources and validating
+// a cache holding a 2MB compiled blob. Compilation itself needs libyara.
+static void bench(void)
+{
+    enum { FILES = 1000, RULE_SIZE = 2048, BLOB_SIZE = 2 << 20, ROUNDS = 20 };
+    char (*file_names)[32] = malloc(FILES * 32);
+    char *sources = malloc((size_t)FILES * RULE_SIZE);
+    unsigned char *compiled = malloc(BLOB_SIZE);
+    RULESMANIFEST m;
+    RULESCACHEBLOB blobs[1] = {{compiled, BLOB_SIZE}};
+    RULESCACHEBLOB out[RULES_CACHE_MAX_BLOBS];
+    unsigned int count;
+    int valid = 0;
+    double t0, t1, t2;
+
+    for (int i = 0; i < FILES; i++)
+        snprintf(file_names[i], 32, "rule_%04d_%08x.yar", i, (unsigned)next_random());
+    for (size_t i = 0; i < (size_t)FILES * RULE_SIZE; i++)
+        sources[i] = 'a' + next_random() % 26;
+    for (size_t i = 0; i < BLOB_SIZE; i++)
+        compiled[i] = (unsigned char)i;
+
+    t0 = now();
+    for (int r = 0; r < ROUNDS; r++) {
+        RulesManifestInit(&m, YARA_VERSION, FLAGS);
+        for (int i = 0; i < FILES; i++)
+            RulesManifestAdd(&m, file_names[(i * 7 + r) % FILES], sources + (size_t)((i * 7 + r) % FILES) * RULE_SIZE, RULE_SIZE);
+        if (r < ROUNDS - 1)
+            RulesManifestFree(&m);
+    }
+    t1 = now();
+
+    size_t size = RulesCacheSize(&m, blobs, 1);
+    unsigned char *cache = malloc(size);
+    RulesCacheWrite(&m, blobs, 1, cache, size);
+    t2 = now();
+    for (int r = 0; r < ROUNDS; r++)
+        valid += RulesCacheValidate(cache, size, &m, out, &count) == RULES_CACHE_VALID;
+    double t3 = now();
+
+    printf("%d files (%d KB): manifest %.2f ms, validate %zu KB cache %.2f ms (%d/%d valid)\n", FILES, FILES * RULE_SIZE / 1024,
+        (t1 - t0) / ROUNDS * 1e3, size / 1024, (t3 - t2) / ROUNDS * 1e3, valid, ROUNDS);
+
+    RulesManifestFree(&m);
+    free(cache);
+    free(compiled);
+    free(sources);
+    free(file_names);
+}
+
+int main(int argc, char **argv)
+{
+    test_staleness();
+    test_corruption();
+    test_mapped();
+    for (int i = 0; i < SOURCES; i++)
+        free(contents[i]);
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        bench();
+
+    return failures != 0;
+}
@@ -0,0 +1,265 @@
+// Tests for the Yara scan cache: region event traces (scans, writes,
+// protection changes, frees) are replayed through the cached scan path used by
+// YaraScan with a stub scanner, and every decision is checked against scanning
+// each time. Portable harness, build on Linux with:
+//   gcc -O2 -Wall -I../CAPE -o scan-cache scan-cache.c ../CAPE/ScanCache.c ../CAPE/RegionTree.c ../CAPE/Xxh64.c
+// Run "./scan-cache bench" for scans avoided and timings over a longer trace.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ScanCache.h"
+
+#define REGIONS 32
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+} region_t;
+
+static region_t regions[REGIONS];
+static size_t scans, skipped;
+static int uncached;
+static unsigned char *race_at;     // a byte the sample flips while it is being scanned
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// Stub scanner: one "rule" matching each occurrence of the string EVIL
+static unsigned int stub_scan(const unsigned char *p, size_t size)
+{
+    unsigned int matches = 0;
+    scans++;
+    for (size_t i = 0; i + 4 <= size; i++)
+        if (p[i] == 'E' && !memcmp(p + i, "EVIL", 4))
+            matches++;
+    return matches;
+}
+
+// The YaraScan path: regions that matched before are always rescanned, and a
+// result is only kept if the region still has the digest taken before the scan
+static unsigned int cached_scan(PSCANCACHE cache, const unsigned char *p, size_t size, int *scanned)
+{
+    unsigned int matches = 0;
+    uint64_t digest;
+
+    if (uncached) {
+        *scanned = 1;
+        return stub_scan(p, size);
+    }
+
+    digest = ScanCacheDigest(cache, p, size);
+    if (ScanCacheLookup(cache, (uintptr_t)p, size, digest, &matches) && !matches) {
+        skipped++;
+        *scanned = 0;
+        return 0;
+    }
+    *scanned = 1;
+    if (race_at)
+        *race_at ^= 1;
+    matches = stub_scan(p, size);
+    if (ScanCacheDigest(cache, p, size) == digest)
+        ScanCacheStore(cache, (uintptr_t)p, size, digest, matches);
+    return matches;
+}
+
+static void new_region(region_t *r, size_t size)
+{
+    free(r->data);
+    r->size = size;
+    r->data = calloc(1, size);
+    for (size_t i = 0; i < size; i += 1 + next_random() % 64)
+        r->data[i] = (unsigned char)next_random();
+}
+
+static void replay(size_t events, size_t max_size, size_t limit, int verify)
+{
+    SCANCACHE cache;
+    ScanCacheInit(&cache, limit, 0x1234);
+
+    for (int i = 0; i < REGIONS; i++)
+        new_region(&regions[i], 64 + next_random() % max_size);
+
+    for (size_t e = 0; e < events; e++) {
+        region_t *r = &regions[next_random() % REGIONS];
+        int op = next_random() % 100;
+
+        if (op < 70) {
+            // repeated scans, of the whole region or a trimmed size
+            size_t size = next_random() % 4 ? r->size : 1 + next_random() % r->size;
+            int scanned;
+            unsigned int matches = cached_scan(&cache, r->data, size, &scanned);
+            if (verify) {
+                size_t before = scans;
+                unsigned int expected = stub_scan(r->data, size);
+                scans = before;
+                CHECK(scanned ? matches == expected : expected == 0, "scan decision: %u matches, expected %u", matches, expected);
+            }
+        } else if (op < 85) {
+            // in-process write nobody tells us about: the digest has to catch it
+            size_t at = next_random() % r->size;
+            if (next_random() % 8 == 0 && at + 4 <= r->size)
+                memcpy(r->data + at, "EVIL", 4);
+            else
+                r->data[at] ^= 1 + (next_random() % 255);
+        } else if (op < 95) {
+            // protection change over part of the region
+            size_t at = next_random() % r->size;
+            ScanCacheInvalidate(&cache, (uintptr_t)r->data + at, 1 + next_random() % (r->size - at));
+            if (verify) {
+                unsigned int m;
+                CHECK(!ScanCacheLookup(&cache, (uintptr_t)r->data, r->size, ScanCacheDigest(&cache, r->data, r->size), &m), "entry survived invalidation");
+            }
+        } else {
+            // free and reallocate
+            ScanCacheInvalidate(&cache, (uintptr_t)r->data, r->size);
+            new_region(r, 64 + next_random() % max_size);
+        }
+        CHECK(cache.Entries.Count <= limit, "limit");
+    }
+    ScanCacheFree(&cache);
+    CHECK(cache.Entries.Count == 0, "free");
+}
+
+static void test_digest(void)
+{
+    // XXH64 reference vectors, seed 0
+    static const struct { const char *s; uint64_t h; } v[] = {
+        {"", 0xEF46DB3751D8E999ULL},
+        {"a", 0xD24EC4F1A98C6E5BULL},
+        {"abc", 0x44BC2CF5AD770999ULL},
+        {"message digest", 0x066ED728FCEEB3BEULL},
+        {"abcdefghijklmnopqrstuvwxyz", 0xCFE1F278FA89835CULL},
+        {"12345678901234567890123456789012345678901234567890123456789012345678901234567890", 0xE04A477F19EE145DULL},
+    };
+    SCANCACHE cache;
+    unsigned char buf[300];
+
+    ScanCacheInit(&cache, 0, 0);
+    for (size_t i = 0; i < sizeof(v) / sizeof(v[0]); i++)
+        CHECK(ScanCacheDigest(&cache, v[i].s, strlen(v[i].s)) == v[i].h, "xxh64(\"%s\")", v[i].s);
+
+    // every length and every byte position matters
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = (unsigned char)i;
+    for (size_t len = 1; len < sizeof(buf); len++) {
+        uint64_t h = ScanCacheDigest(&cache, buf, len);
+        CHECK(h != ScanCacheDigest(&cache, buf, len - 1), "length %zu", len);
+        buf[len / 2] ^= 0x80;
+        CHECK(h != ScanCacheDigest(&cache, buf, len), "byte %zu of %zu", len / 2, len);
+        buf[len / 2] ^= 0x80;
+    }
+    cache.Seed = 1;
+    CHECK(ScanCacheDigest(&cache, buf, 64) != ScanCacheDigest(&(SCANCACHE){.Seed = 2}, buf, 64), "seeded");
+}
+
+static void test_edges(void)
+{
+    SCANCACHE cache;
+    unsigned int m = 99;
+
+    ScanCacheInit(&cache, 0, 0);
+    ScanCacheStore(&cache, 0x1000, 0x1000, 42, 0);
+    CHECK(ScanCacheLookup(&cache, 0x1000, 0x1000, 42, &m) && m == 0, "hit");
+    CHECK(!ScanCacheLookup(&cache, 0x1000, 0x800, 42, &m), "size differs");
+    CHECK(!ScanCacheLookup(&cache, 0x1000, 0x1000, 43, &m), "digest differs");
+    ScanCacheStore(&cache, 0x1000, 0x800, 7, 2);
+    CHECK(cache.Entries.Count == 1 && ScanCacheLookup(&cache, 0x1000, 0x800, 7, &m) && m == 2, "replaced");
+    // overlapping entries from differently sized scans are all invalidated
+    for (uintptr_t b = 0x1100; b < 0x1100 + 200 * 0x10; b += 0x10)
+        ScanCacheStore(&cache, b, 0x4000, b, 0);
+    CHECK(ScanCacheInvalidate(&cache, 0x1ffff, 1) == 0, "invalidate beyond");
+    CHECK(ScanCacheInvalidate(&cache, 0x1d70, 1) == 200, "invalidate point");
+    CHECK(ScanCacheInvalidate(&cache, 0, SIZE_MAX) == 1, "invalidate everything");
+    CHECK(cache.Entries.Count == 0, "all invalidated");
+    ScanCacheStore(&cache, UINTPTR_MAX - 10, 100, 1, 0);
+    CHECK(cache.Entries.Count == 0, "wrapping store");
+    ScanCacheFree(&cache);
+}
+
+// Content that changes between the digest and the scan is not cached under
+// the digest of what was there before
+static void test_racing_write(void)
+{
+    SCANCACHE cache;
+    unsigned char buf[256] = { 0 };
+    int scanned;
+
+    ScanCacheInit(&cache, 16, 0x1234);
+    memcpy(buf + 100, "EVIL", 4);
+    race_at = buf + 100;
+    CHECK(cached_scan(&cache, buf, sizeof(buf), &scanned) == 0 && scanned, "racing scan");
+    race_at = NULL;
+    CHECK(cache.Entries.Count == 0, "racing scan cached");
+    buf[100] = 'E';
+    CHECK(cached_scan(&cache, buf, sizeof(buf), &scanned) == 1 && scanned, "content as it was before the race");
+    ScanCacheFree(&cache);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(void)
+{
+    double t;
+    size_t events = 20000, total;
+
+    for (uncached = 1; uncached >= 0; uncached--) {
+        scans = skipped = 0;
+        rng = 1;
+        t = now();
+        replay(events, 1 << 20, 4096, 0);
+        t = now() - t;
+        total = scans + skipped;
+        printf("%s %zu scan requests, %zu scanned, %zu avoided (%.1f%%), %.3f s\n", uncached ? "uncached:" : "cached:  ",
+            total, scans, skipped, 100.0 * skipped / total, t);
+    }
+
+    SCANCACHE cache;
+    unsigned char *buf = malloc(64 << 20);
+    memset(buf, 0x41, 64 << 20);
+    ScanCacheInit(&cache, 0, 0);
+    t = now();
+    volatile uint64_t sink = ScanCacheDigest(&cache, buf, 64 << 20);
+    t = now() - t;
+    (void)sink;
+    printf("digest:   %.2f GB/s\n", (64 << 20) / t / 1e9);
+    t = now();
+    stub_scan(buf, 64 << 20);
+    t = now() - t;
+    printf("stub scan: %.2f GB/s (yara is typically far slower)\n", (64 << 20) / t / 1e9);
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    test_digest();
+    test_edges();
+    test_racing_write();
+    replay(200000, 4096, 16, 1);
+    replay(20000, 4096, 4096, 1);
+    printf("%zu scans, %zu avoided\n", scans, skipped);
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        bench();
+
+    for (int i = 0; i < REGIONS; i++)
+        free(regions[i].data);
+
+    return failures != 0;
+}
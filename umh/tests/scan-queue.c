@@ -0,0 +1,389 @@
+// Tests for the background scan queue behind YaraScan, using a stub matcher in
+// place of yara: snapshot semantics, completion on the draining thread,
+// back-pressure and the synchronous fallback, concurrent submitters and
+// shutdown. Portable harness, build on Linux with:
+//   gcc -O2 -Wall -pthread -I../CAPE -o scan-queue scan-queue.c ../CAPE/ScanQueue.c
+// Run "./scan-queue bench" for caller latency and throughput against scanning
+// synchronously.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "ScanQueue.h"
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { __sync_fetch_and_add(&failures, 1); printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Stub matcher: one "rule" matching each occurrence of EVIL, scanned `passes`
+// times over to stand in for the cost of a real rule set
+static int passes = 1;
+
+static int stub_match(const unsigned char *p, size_t size)
+{
+    int matches = 0;
+    for (int pass = 0; pass < passes; pass++) {
+        matches = 0;
+        for (size_t i = 0; i + 4 <= size; i++)
+            if (p[i] == 'E' && !memcmp(p + i, "EVIL", 4))
+                matches++;
+    }
+    return matches;
+}
+
+typedef struct {
+    int expected;
+    int completed;
+    int shared;     // any producer may drain it
+    pthread_t drainer;
+    double posted;
+} request_t;
+
+static int threads_started, gate_closed;
+static size_t completions;
+static double latency_total, latency_max;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void thread_start(void *context)
+{
+    (void)context;
+    __sync_fetch_and_add(&threads_started, 1);
+}
+
+static void scan(PSCANJOB job, void *context)
+{
+    (void)context;
+    while (__atomic_load_n(&gate_closed, __ATOMIC_ACQUIRE))
+        sched_yield();
+    job->Result = stub_match(job->Snapshot, job->Size);
+}
+
+static void complete(PSCANJOB job, void *context)
+{
+    request_t *r = job->Context;
+    double latency = now() - r->posted;
+    (void)context;
+    CHECK(job->Snapshot == NULL, "snapshot freed once scanned");
+    CHECK(r->expected < 0 || job->Result == r->expected, "result %d, expected %d", job->Result, r->expected);
+    CHECK(r->shared || pthread_equal(pthread_self(), r->drainer), "completion off the draining thread");
+    r->completed++;
+    pthread_mutex_lock(&stats_lock);
+    completions++;
+    latency_total += latency;
+    if (latency > latency_max)
+        latency_max = latency;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static PSCANQUEUE shared_queue;
+
+static PSCANQUEUE create(unsigned int threads, size_t depth, size_t limit)
+{
+    SCANQUEUECONFIG config = {threads, depth, limit, scan, complete, thread_start, NULL};
+    return ScanQueueCreate(&config);
+}
+
+static void fill(unsigned char *buf, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        buf[i] = (unsigned char)next_random();
+    for (int n = next_random() % 5; n; n--)
+        memcpy(buf + next_random() % (size - 3), "EVIL", 4);
+}
+
+// Submits a region as YaraScan does: snapshot and post, or scan in place when refused
+static int submit(PSCANQUEUE q, request_t *r, unsigned char *buf, size_t size, int expected)
+{
+    PSCANJOB job;
+
+    r->expected = expected;
+    r->completed = 0;
+    r->shared = q && q == shared_queue;
+    r->drainer = pthread_self();
+    r->posted = now();
+    job = ScanQueueReserve(q, (uintptr_t)buf, size, r);
+    if (!job)
+        return 0;
+    CHECK(job->Address == (uintptr_t)buf && job->Size == size && job->Context == r, "reserved job");
+    memcpy(job->Snapshot, buf, size);
+    ScanQueuePost(q, job);
+    return 1;
+}
+
+static void test_snapshots(void)
+{
+    enum { N = 500 };
+    static request_t req[N];
+    static unsigned char buf[4096];
+    SCANQUEUESTATS stats;
+    PSCANQUEUE q;
+    size_t drained = 0;
+
+    threads_started = 0;
+    q = create(4, N, N * sizeof(buf));
+    CHECK(q != NULL, "create");
+
+    for (int i = 0; i < N; i++) {
+        size_t size = 4 + next_random() % (sizeof(buf) - 3);
+        fill(buf, size);
+        CHECK(submit(q, &req[i], buf, size, stub_match(buf, size)), "submit %d", i);
+        // the region changes as soon as the caller returns; the snapshot must not
+        memset(buf, 'E', size);
+        if (i % 50 == 0)
+            drained += ScanQueueDrain(q);
+    }
+    drained += ScanQueueFlush(q);
+    CHECK(drained == N, "drained %zu", drained);
+    for (int i = 0; i < N; i++)
+        CHECK(req[i].completed == 1, "request %d completed %d times", i, req[i].completed);
+
+    ScanQueueGetStats(q, &stats);
+    CHECK(stats.Posted == N && stats.Scanned == N && stats.Completed == N && stats.Rejected == 0, "stats");
+    CHECK(stats.Outstanding == 0 && stats.SnapshotBytes == 0, "released");
+    CHECK(ScanQueueDrain(q) == 0 && ScanQueueFlush(q) == 0, "nothing left");
+    ScanQueueDestroy(q);
+    CHECK(threads_started == 4, "%d threads started", threads_started);
+}
+
+static void test_backpressure(void)
+{
+    static unsigned char buf[1000];
+    request_t req[8];
+    SCANQUEUESTATS stats;
+    PSCANQUEUE q = create(2, 4, 2500);
+    PSCANJOB job;
+
+    fill(buf, sizeof(buf));
+
+    // workers are held, so reservations stay outstanding
+    __atomic_store_n(&gate_closed, 1, __ATOMIC_RELEASE);
+    CHECK(submit(q, &req[0], buf, 1000, stub_match(buf, 1000)) && submit(q, &req[1], buf, 1000, stub_match(buf, 1000)), "first two");
+    CHECK(!submit(q, &req[2], buf, 1000, stub_match(buf, 1000)), "snapshot limit");
+    CHECK(submit(q, &req[3], buf, 400, stub_match(buf, 400)) && submit(q, &req[4], buf, 100, stub_match(buf, 100)), "under the limit");
+    CHECK(!submit(q, &req[5], buf, 1, stub_match(buf, 1)), "depth");
+    CHECK(ScanQueueDrain(q) == 0, "nothing scanned yet");
+
+    ScanQueueGetStats(q, &stats);
+    CHECK(stats.Outstanding == 4 && stats.SnapshotBytes == 2500 && stats.Rejected == 2, "held");
+
+    __atomic_store_n(&gate_closed, 0, __ATOMIC_RELEASE);
+    CHECK(ScanQueueFlush(q) == 4, "flush");
+    CHECK(req[0].completed && req[1].completed && !req[2].completed && req[3].completed && req[4].completed && !req[5].completed, "completions");
+
+    // a cancelled reservation (the copy faulted) gives back its share
+    job = ScanQueueReserve(q, 0x1000, 2500, NULL);
+    CHECK(job != NULL, "reserve all");
+    CHECK(ScanQueueReserve(q, 0x1000, 1, NULL) == NULL, "full");
+    ScanQueueCancel(q, job);
+    ScanQueueGetStats(q, &stats);
+    CHECK(stats.Outstanding == 0 && stats.SnapshotBytes == 0, "cancelled");
+    CHECK(ScanQueueReserve(q, 0x1000, 0, NULL) == NULL, "empty region");
+    CHECK(ScanQueueFlush(q) == 0, "flush after cancel");
+    ScanQueueDestroy(q);
+}
+
+static void test_shutdown(void)
+{
+    enum { N = 64 };
+    static request_t req[N];
+    static unsigned char buf[N][2048];
+    int posted = 0;
+    PSCANQUEUE q = create(3, N, sizeof(buf));
+
+    for (int i = 0; i < N; i++) {
+        fill(buf[i], sizeof(buf[i]));
+        posted += submit(q, &req[i], buf[i], sizeof(buf[i]), stub_match(buf[i], sizeof(buf[i])));
+    }
+    CHECK(posted == N, "posted %d", posted);
+    // destroying the queue finishes and completes everything already posted
+    ScanQueueDestroy(q);
+    for (int i = 0; i < N; i++)
+        CHECK(req[i].completed == 1, "request %d", i);
+
+    SCANQUEUECONFIG none = {0, 1, 1, scan, complete, NULL, NULL};
+    CHECK(ScanQueueCreate(&none) == NULL, "no threads");
+    ScanQueueDestroy(NULL);
+    CHECK(ScanQueueReserve(NULL, 0x1000, 1, NULL) == NULL && ScanQueueDrain(NULL) == 0, "no queue");
+}
+
+typedef struct {
+    PSCANQUEUE q;
+    int regions;
+    size_t size;
+    int seed;
+    int synchronous;
+    int verify;
+    double busy;
+} producer_t;
+
+static pthread_barrier_t producers_done;
+
+// A monitored thread: scans regions it touches, draining completions as it goes
+static void *producer(void *arg)
+{
+    producer_t *p = arg;
+    request_t *req = calloc(p->regions, sizeof(request_t));
+    unsigned char *buf = malloc(p->size);
+    uint64_t state = p->seed;
+
+    for (int i = 0; i < p->regions; i++) {
+        for (size_t j = 0; j < p->size; j++) {
+            state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+            buf[j] = (unsigned char)state;
+        }
+        memcpy(buf + state % (p->size - 3), "EVIL", 4);
+        int expected = p->verify ? stub_match(buf, p->size) : -1;
+
+        double t = now();
+        if (p->q)
+            ScanQueueDrain(p->q);
+        if (!p->q || !submit(p->q, &req[i], buf, p->size, expected)) {
+            // the synchronous fallback
+            int matches = stub_match(buf, p->size);
+            CHECK(!p->verify || matches == expected, "synchronous scan");
+            req[i].completed = 1;
+            p->synchronous++;
+        }
+        p->busy += now() - t;
+    }
+    // other producers may be draining this producer's jobs, so wait for them all
+    if (p->q)
+        ScanQueueFlush(p->q);
+    pthread_barrier_wait(&producers_done);
+    for (int i = 0; i < p->regions; i++)
+        CHECK(req[i].completed == 1, "request completed %d times", req[i].completed);
+    free(buf);
+    free(req);
+    return NULL;
+}
+
+// Runs producers against a queue (or synchronously with threads == 0) and
+// returns the elapsed time
+static double run_producers(int producers, unsigned int threads, int regions, size_t size, int verify, double *busy, int *synchronous)
+{
+    pthread_t tid[16];
+    producer_t p[16];
+    PSCANQUEUE q = threads ? create(threads, 64, 64 * size) : NULL;
+    double t = now();
+
+    shared_queue = q;
+    pthread_barrier_init(&producers_done, NULL, producers);
+    for (int i = 0; i < producers; i++) {
+        p[i] = (producer_t){q, regions, size, 1000 + i, 0, verify, 0};
+        pthread_create(&tid[i], NULL, producer, &p[i]);
+    }
+    *busy = 0;
+    *synchronous = 0;
+    for (int i = 0; i < producers; i++) {
+        pthread_join(tid[i], NULL);
+        *busy += p[i].busy;
+        *synchronous += p[i].synchronous;
+    }
+    pthread_barrier_destroy(&producers_done);
+    ScanQueueDestroy(q);
+    shared_queue = NULL;
+    return now() - t;
+}
+
+static void test_concurrent(void)
+{
+    double busy;
+    int synchronous;
+
+    completions = 0;
+    run_producers(4, 3, 300, 3000, 1, &busy, &synchronous);
+    CHECK(completions + synchronous == 4 * 300, "%zu completions, %d synchronous", completions, synchronous);
+}
+
+static void bench(void)
+{
+    static const size_t sizes[] = {64 << 10, 1 << 20, 8 << 20};
+    unsigned char *buf = malloc(8 << 20);
+
+    passes = 8;
+    fill(buf, 8 << 20);
+    for (int k = 0; k < 3; k++) {
+        size_t size = sizes[k];
+        int n = (int)((256 << 20) / size);
+        volatile int expected = 0;
+        double t = now();
+        for (int i = 0; i < n; i++)
+            expected = stub_match(buf, size);
+        t = now() - t;
+        printf("%5zu KB regions: synchronous %8.1f us per scan in the caller\n", size >> 10, t / n * 1e6);
+
+        for (unsigned int threads = 1; threads <= 4; threads *= 2) {
+            PSCANQUEUE q = create(threads, 64, 64 * size);
+            request_t *req = calloc(n, sizeof(request_t));
+            double caller = 0, total = now();
+            int refused = 0;
+
+            completions = 0;
+            latency_total = latency_max = 0;
+            for (int i = 0; i < n; i++) {
+                req[i].expected = expected;
+                double c = now();
+                ScanQueueDrain(q);
+                PSCANJOB job = ScanQueueReserve(q, (uintptr_t)buf, size, &req[i]);
+                if (job) {
+                    req[i].drainer = pthread_self();
+                    req[i].posted = now();
+                    memcpy(job->Snapshot, buf, size);
+                    ScanQueuePost(q, job);
+                } else {
+                    expected = stub_match(buf, size);
+                    refused++;
+                }
+                caller += now() - c;
+            }
+            ScanQueueFlush(q);
+            total = now() - total;
+            ScanQueueDestroy(q);
+            free(req);
+            printf("%5zu KB regions, %u workers: %8.1f us in the caller, %6.1f%% synchronous, %7.1f MB/s, latency mean %.1f ms max %.1f ms\n",
+                size >> 10, threads, caller / n * 1e6, 100.0 * refused / n, (double)n * size / total / 1e6,
+                completions ? latency_total / completions * 1e3 : 0, latency_max * 1e3);
+        }
+    }
+
+    for (unsigned int threads = 0; threads <= 4; threads += 2) {
+        double busy;
+        int synchronous;
+        double t = run_producers(4, threads, 200, 256 << 10, 0, &busy, &synchronous);
+        printf("4 producers, %u workers: %.3f s, %.1f us per region in the producers\n", threads, t, busy / 800 * 1e6);
+    }
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    test_snapshots();
+    test_backpressure();
+    test_shutdown();
+    test_concurrent();
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        bench();
+
+    return failures != 0;
+}
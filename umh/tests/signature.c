@@ -0,0 +1,439 @@
+// Tests for the masked signature scanner behind Scylla's findPattern and the
+// code finders in misc.c: signatures parsed from IDA-style strings, alone
+// and many to a set, are searched for in generated code and every match is
+// checked against a plain search that tries each signature at each offset.
+// Cases cover wildcard bytes and nibbles at the edges of a signature,
+// matches at the very ends of the data, partial matches overlapping the
+// real one, signatures without a fixed byte, searches stopped early and
+// malformed strings. Portable harness, build on Linux with:
+//   gcc -O2 -Wall -I../CAPE -o signature signature.c ../CAPE/Signature.c
+// PE files given on the command line have signatures cut from their .text
+// sections and searched for there.
+// Run "./signature bench [PE files]" for throughput over .text sections,
+// one signature at a time and 64 in one pass.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "Signature.h"
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int matches_at(const SIGPATTERN *pattern, const unsigned char *data)
+{
+    for (uint32_t i = 0; i < pattern->Length; i++)
+        if ((data[i] & pattern->Mask[i]) != pattern->Bytes[i])
+            return 0;
+    return 1;
+}
+
+// Matches as (offset, signature) pairs
+typedef struct {
+    size_t offset, index;
+} match_t;
+
+typedef struct {
+    match_t *matches;
+    size_t count, capacity;
+    const unsigned char *data;
+    size_t stop_after;
+} matches_t;
+
+static void add_match(matches_t *list, size_t offset, size_t index)
+{
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->matches = realloc(list->matches, list->capacity * sizeof(match_t));
+    }
+    list->matches[list->count].offset = offset;
+    list->matches[list->count].index = index;
+    list->count++;
+}
+
+static int collect(void *context, size_t index, const unsigned char *match)
+{
+    matches_t *list = context;
+    add_match(list, match - list->data, index);
+    return list->stop_after && list->count >= list->stop_after;
+}
+
+static void reference(const SIGPATTERN *patterns, size_t count, const unsigned char *data, size_t size, matches_t *list)
+{
+    for (size_t offset = 0; offset < size; offset++)
+        for (size_t i = 0; i < count; i++)
+            if (patterns[i].Length <= size - offset && matches_at(&patterns[i], data + offset))
+                add_match(list, offset, i);
+}
+
+static int by_offset(const void *a, const void *b)
+{
+    const match_t *x = a, *y = b;
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Checks a set's scan, and each signature's SigFind, against the reference
+static void compare(const SIGPATTERN *patterns, size_t count, const unsigned char *data, size_t size, const char *what)
+{
+    matches_t expected = { 0 }, found = { 0 };
+    SIGSET set;
+
+    reference(patterns, count, data, size, &expected);
+    SigSetInit(&set);
+    for (size_t i = 0; i < count; i++)
+        SigSetAdd(&set, &patterns[i]);
+    SigSetCompile(&set);
+    found.data = data;
+    size_t reported = SigSetScan(&set, data, size, collect, &found);
+    CHECK(reported == found.count, "%s: %zu matches reported, %zu returned", what, found.count, reported);
+
+    // each signature's matches come in address order
+    for (size_t i = 1; i < found.count; i++)
+        for (size_t j = i; j-- > 0;)
+            if (found.matches[j].index == found.matches[i].index) {
+                CHECK(found.matches[j].offset < found.matches[i].offset, "%s: signature %zu matched at %zx before %zx", what,
+                    found.matches[i].index, found.matches[j].offset, found.matches[i].offset);
+                break;
+            }
+
+    if (found.count)
+        qsort(found.matches, found.count, sizeof(match_t), by_offset);
+    CHECK(found.count == expected.count && (!found.count || !memcmp(found.matches, expected.matches, found.count * sizeof(match_t))),
+        "%s: %zu matches, expected %zu", what, found.count, expected.count);
+
+    for (size_t i = 0; i < count; i++) {
+        const unsigned char *first = SigFind(&patterns[i], data, size), *expected_first = NULL;
+        for (size_t j = 0; j < expected.count; j++)
+            if (expected.matches[j].index == i) {
+                expected_first = data + expected.matches[j].offset;
+                break;
+            }
+        CHECK(first == expected_first, "%s: signature %zu first found at %td, expected %td", what, i,
+            first ? first - data : -1, expected_first ? expected_first - data : -1);
+    }
+
+    free(expected.matches);
+    free(found.matches);
+    SigSetFree(&set);
+}
+
+// ProcessAccessHelp::findPattern as it was
+static const unsigned char *old_find_pattern(const unsigned char *start, size_t size, const unsigned char *pattern, const char *mask)
+{
+    size_t pos = 0, length = strlen(mask) - 1;
+    for (const unsigned char *p = start; p < start + size; p++) {
+        if (*p == pattern[pos] || mask[pos] == '?') {
+            if (mask[pos + 1] == 0)
+                return p - length;
+            pos++;
+        }
+        else
+            pos = 0;
+    }
+    return NULL;
+}
+
+static void test_parse(void)
+{
+    SIGPATTERN pattern;
+
+    CHECK(SigParse("8B FF 55 8B EC", &pattern) && pattern.Length == 5 && pattern.AnchorSize == 2 && !memcmp(pattern.Bytes, "\x8b\xff\x55\x8b\xec", 5),
+        "prologue signature");
+    CHECK(pattern.Anchor + 2 <= pattern.Length, "prologue anchored at %u", pattern.Anchor);
+    CHECK(SigParse("E8 ?? ?? ?? ??", &pattern) && pattern.Length == 5 && pattern.AnchorSize == 1 && pattern.Anchor == 0 && pattern.Mask[1] == 0,
+        "call signature");
+    CHECK(SigParse("  b? 78 ?6 ? 12\t", &pattern) && pattern.Length == 5 && pattern.Mask[0] == 0xF0 && pattern.Bytes[0] == 0xB0
+        && pattern.Mask[2] == 0x0F && pattern.Bytes[2] == 0x06 && pattern.Mask[3] == 0 && pattern.AnchorSize == 1 && pattern.Anchor == 1,
+        "nibble wildcards");
+    CHECK(SigParse("?? ?", &pattern) && pattern.Length == 2 && pattern.AnchorSize == 0, "signature without a fixed byte");
+    CHECK(!SigParse("", &pattern) && !SigParse("   ", &pattern), "empty signature");
+    CHECK(!SigParse("8B F", &pattern) && !SigParse("8BF", &pattern) && !SigParse("8G", &pattern) && !SigParse("???", &pattern), "malformed signature");
+
+    char long_text[SIG_MAX_LENGTH * 3 + 8] = "";
+    for (int i = 0; i < SIG_MAX_LENGTH; i++)
+        strcat(long_text, "90 ");
+    CHECK(SigParse(long_text, &pattern) && pattern.Length == SIG_MAX_LENGTH, "longest signature");
+    strcat(long_text, "90");
+    CHECK(!SigParse(long_text, &pattern), "signature too long");
+
+    unsigned char bytes[5] = { 0xB8, 0x78, 0x56, 0x34, 0x12 }, mask[5] = { 0xF8, 0xFF, 0xFF, 0xFF, 0xFF };
+    CHECK(SigFromMask(&pattern, bytes, mask, 5) && pattern.Bytes[0] == 0xB8 && pattern.AnchorSize == 2 && pattern.Anchor >= 1, "masked signature");
+    CHECK(!SigFromMask(&pattern, bytes, mask, 0) && !SigFromMask(&pattern, bytes, mask, SIG_MAX_LENGTH + 1), "masked signature length");
+}
+
+static void test_edges(void)
+{
+    SIGPATTERN patterns[6];
+    unsigned char data[64];
+
+    // A partial match overlapping the real one; findPattern started again
+    // after the byte that broke the partial match, and missed it
+    memcpy(data, "\xAA\xAA\xAA\xAB\x00", 5);
+    SigParse("AA AA AB", &patterns[0]);
+    CHECK(SigFind(&patterns[0], data, 5) == data + 1, "overlapping partial match missed");
+    CHECK(old_find_pattern(data, 5, (const unsigned char *)"\xAA\xAA\xAB", "xxx") == NULL, "old findPattern found the overlapping match");
+    compare(patterns, 1, data, 5, "overlapping");
+
+    // Matches at the very ends, with wildcards at the edges
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (unsigned char)next_random();
+    data[0] = 0x55;
+    data[1] = 0x8B;
+    data[62] = 0xC2;
+    data[63] = 0x08;
+    SigParse("55 8B ?? ??", &patterns[0]);
+    SigParse("?? ?? C2 08", &patterns[1]);
+    SigParse("? 8B", &patterns[2]);
+    SigParse("C2 08 ??", &patterns[3]);
+    SigParse("?? ?? ??", &patterns[4]);
+    SigParse("5? ?B", &patterns[5]);
+    CHECK(SigFind(&patterns[0], data, 64) == data && SigFind(&patterns[1], data, 64) == data + 60, "matches at the ends");
+    CHECK(SigFind(&patterns[3], data, 64) == NULL, "match past the end");
+    CHECK(SigFind(&patterns[0], data, 3) == NULL && SigFind(&patterns[0], data, 0) == NULL, "match longer than the data");
+    compare(patterns, 6, data, 64, "edges");
+    for (size_t size = 0; size <= 64; size++)
+        compare(patterns, 6, data + 64 - size, size, "edges, shortened");
+
+    // A search stopped at the second match
+    matches_t found = { 0 };
+    SIGSET set;
+    memset(data, 0x90, sizeof(data));
+    SigSetInit(&set);
+    SigSetAdd(&set, &patterns[4]);
+    SigSetAdd(&set, &patterns[2]);
+    SigSetCompile(&set);
+    found.data = data;
+    found.stop_after = 2;
+    CHECK(SigSetScan(&set, data, sizeof(data), collect, &found) == 2 && found.count == 2, "search not stopped");
+    CHECK(SigSetScan(&set, data, sizeof(data), NULL, NULL) == sizeof(data) - 2, "matches counted without a callback");
+
+    // A set changed since it was compiled isn't searched
+    SigSetAdd(&set, &patterns[0]);
+    CHECK(SigSetScan(&set, data, sizeof(data), NULL, NULL) == 0, "uncompiled set searched");
+    SigSetCompile(&set);
+    CHECK(SigSetScan(&set, data, sizeof(data), NULL, NULL) == sizeof(data) - 2, "recompiled set");
+    SigSetFree(&set);
+    free(found.matches);
+}
+
+// Code-like data: a few common bytes much of the time, as x86 code has
+static void fill_code(unsigned char *data, size_t size)
+{
+    static const unsigned char common[] = { 0x00, 0xFF, 0x8B, 0x48, 0x89, 0xE8, 0x24, 0xCC, 0x0F, 0x83, 0x45, 0xC3 };
+    for (size_t i = 0; i < size; i++) {
+        uint64_t r = next_random();
+        data[i] = r % 3 ? common[(r >> 8) % sizeof(common)] : (unsigned char)(r >> 16);
+    }
+}
+
+// A signature cut from data at offset, with some bytes and nibbles wild
+static void cut_signature(const unsigned char *data, size_t offset, size_t length, int wild, SIGPATTERN *pattern)
+{
+    unsigned char mask[SIG_MAX_LENGTH];
+    for (size_t i = 0; i < length; i++) {
+        uint64_t r = next_random() % 16;
+        mask[i] = !wild || r > 4 ? 0xFF : r > 2 ? 0x00 : r > 1 ? 0xF0 : r ? 0x0F : 0xF8;
+    }
+    SigFromMask(pattern, data + offset, mask, length);
+}
+
+static void test_generated(void)
+{
+    enum { SIZE = 0x4000 };
+    unsigned char *data = malloc(SIZE);
+    SIGPATTERN patterns[200];
+    int sets = 0;
+
+    for (int trial = 0; trial < 60; trial++) {
+        size_t count = trial < 20 ? 1 : 1 + next_random() % 200;
+        fill_code(data, SIZE);
+        for (size_t i = 0; i < count; i++) {
+            size_t length = 1 + next_random() % (next_random() % 8 ? 12 : SIG_MAX_LENGTH);
+            cut_signature(data, next_random() % (SIZE - length), length, (int)(next_random() % 4), &patterns[i]);
+        }
+        char what[32];
+        snprintf(what, sizeof(what), "set %d", trial);
+        compare(patterns, count, data, SIZE, what);
+        sets++;
+    }
+    printf("%d generated sets searched\n", sets);
+    free(data);
+}
+
+static unsigned char *read_text(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    unsigned char *file, *text = NULL;
+    long length;
+
+    *size = 0;
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    file = malloc(length + 1);
+    if (fread(file, 1, length, f) != (size_t)length)
+        length = 0;
+    fclose(f);
+
+    if (length > 0x40 && file[0] == 'M' && file[1] == 'Z') {
+        uint32_t lfanew;
+        memcpy(&lfanew, file + 0x3c, 4);
+        if ((uint64_t)lfanew + 24 < (uint64_t)length && !memcmp(file + lfanew, "PE\0\0", 4)) {
+            uint16_t sections, optional;
+            memcpy(&sections, file + lfanew + 6, 2);
+            memcpy(&optional, file + lfanew + 20, 2);
+            for (int i = 0; i < sections; i++) {
+                const unsigned char *header = file + lfanew + 24 + optional + i * 40;
+                uint32_t raw_size, raw;
+                if (header + 40 > file + length)
+                    break;
+                memcpy(&raw_size, header + 16, 4);
+                memcpy(&raw, header + 20, 4);
+                if (!memcmp(header, ".text", 6) && (uint64_t)raw + raw_size <= (uint64_t)length && raw_size > 0x1000) {
+                    text = malloc(raw_size);
+                    memcpy(text, file + raw, raw_size);
+                    *size = raw_size;
+                }
+            }
+        }
+    }
+    free(file);
+    return text;
+}
+
+static void test_file(const char *path)
+{
+    size_t size;
+    unsigned char *text = read_text(path, &size);
+    SIGPATTERN patterns[64];
+
+    if (!text) {
+        printf("%s: no .text section\n", path);
+        return;
+    }
+    for (int i = 0; i < 64; i++) {
+        size_t length = 5 + next_random() % 12;
+        cut_signature(text, next_random() % (size - length), length, i % 2, &patterns[i]);
+    }
+    compare(patterns, 1, text, size, path);
+    compare(patterns, 64, text, size, path);
+    printf("%s: %zuKB of .text searched\n", path, size >> 10);
+    free(text);
+}
+
+static volatile size_t sink;
+
+static void bench(int argc, char **argv)
+{
+    size_t size = 0, total = 0;
+    unsigned char *text = NULL;
+    SIGPATTERN patterns[64];
+    SIGSET set;
+    double start, old_ms = 0, one_ms = 0, each_ms = 0, set_ms = 0;
+    enum { ROUNDS = 8 };
+
+    // The .text sections given, one after another, or generated code
+    for (int i = 2; i < argc; i++) {
+        size_t part;
+        unsigned char *section = read_text(argv[i], &part);
+        if (!section)
+            continue;
+        text = realloc(text, size + part);
+        memcpy(text + size, section, part);
+        size += part;
+        free(section);
+    }
+    if (!text) {
+        size = 16 << 20;
+        text = malloc(size);
+        fill_code(text, size);
+    }
+
+    // Signatures of the kind misc.c and Scylla look for, which mostly don't
+    // match: prologues, calls and pushes of a given address
+    SigParse("8B FF 55 8B EC 83 EC ?? 53 56", &patterns[0]);
+    for (int i = 1; i < 64; i++) {
+        unsigned char bytes[12], mask[12];
+        for (int j = 0; j < 12; j++) {
+            bytes[j] = (unsigned char)next_random();
+            mask[j] = j % 5 == 4 ? 0 : 0xFF;
+        }
+        bytes[0] = i % 3 == 0 ? 0x68 : i % 3 == 1 ? 0xE8 : 0x48;
+        SigFromMask(&patterns[i], bytes, mask, 5 + i % 8);
+    }
+
+    for (int round = 0; round < ROUNDS; round++) {
+        unsigned char old_pattern[10];
+        char old_mask[11];
+        for (int j = 0; j < 10; j++) {
+            old_pattern[j] = patterns[0].Bytes[j];
+            old_mask[j] = patterns[0].Mask[j] ? 'x' : '?';
+        }
+        old_mask[10] = 0;
+
+        start = now();
+        sink += (size_t)old_find_pattern(text, size, old_pattern, old_mask);
+        old_ms += now() - start;
+
+        start = now();
+        sink += (size_t)SigFind(&patterns[0], text, size);
+        one_ms += now() - start;
+
+        start = now();
+        for (int i = 0; i < 64; i++)
+            sink += (size_t)SigFind(&patterns[i], text, size);
+        each_ms += now() - start;
+
+        start = now();
+        SigSetInit(&set);
+        for (int i = 0; i < 64; i++)
+            SigSetAdd(&set, &patterns[i]);
+        SigSetCompile(&set);
+        sink += SigSetScan(&set, text, size, NULL, NULL);
+        SigSetFree(&set);
+        set_ms += now() - start;
+    }
+    total = size * ROUNDS;
+    printf("%zuKB of %s: one signature %.0f MB/s with findPattern, %.0f MB/s filtered on its anchor (%.1fx); 64 signatures %.0f MB/s one at a time, %.0f MB/s in one pass (%.1fx)\n",
+        size >> 10, argc > 2 ? ".text" : "generated code", total / old_ms / 1e3, total / one_ms / 1e3, old_ms / one_ms,
+        total / each_ms / 1e3, total / set_ms / 1e3, each_ms / set_ms);
+    free(text);
+}
+
+int main(int argc, char **argv)
+{
+    int bench_mode = argc > 1 && !strcmp(argv[1], "bench");
+
+    test_parse();
+    test_edges();
+    test_generated();
+    for (int i = bench_mode ? 2 : 1; i < argc; i++)
+        test_file(argv[i]);
+    if (bench_mode)
+        bench(argc, argv);
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+    return failures != 0;
+}
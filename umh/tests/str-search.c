@@ -0,0 +1,336 @@
+// Differential fuzz tests for the vectorized memmem, stristr and wcsistr in
+// misc.c against the nested loops they replaced: random haystacks and
+// needles over alphabets built around the case bit (letters, '@' and '`',
+// '[' and '{', Latin-1 and wide letters that must not fold), every
+// alignment, exact-size allocations for the sanitizers and strings ending
+// against an inaccessible page. Portable harness, build on Linux with:
+//   gcc -O2 -Wall -I../CAPE -o str-search str-search.c ../CAPE/StrSearch.c
+// Run "./str-search bench" for timings over needle lengths 1-64 and
+// haystacks up to 64MB.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "StrSearch.h"
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// The replaced implementations, with towlower as it is in the C locale
+static char *naive_memmem(char *haystack, size_t hlen, char *needle, size_t nlen)
+{
+    if (nlen > hlen)
+        return NULL;
+    for (size_t i = 0; i < hlen - nlen + 1; i++)
+        if (!memcmp(haystack + i, needle, nlen))
+            return haystack + i;
+    return NULL;
+}
+
+static char *naive_stristr(char *haystack, const char *needle)
+{
+    int c = tolower(*needle);
+    if (c == '\0')
+        return haystack;
+    for (; *haystack; haystack++) {
+        if (tolower(*haystack) == c) {
+            for (size_t i = 0;;) {
+                if (needle[++i] == '\0')
+                    return haystack;
+                if (tolower(haystack[i]) != tolower(needle[i]))
+                    break;
+            }
+        }
+    }
+    return NULL;
+}
+
+static unsigned int c_towlower(unsigned int c)
+{
+    return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+static uint16_t *naive_wcsistr(uint16_t *haystack, const uint16_t *needle)
+{
+    unsigned int c = c_towlower(*needle);
+    if (c == 0)
+        return haystack;
+    for (; *haystack; haystack++) {
+        if (c_towlower(*haystack) == c) {
+            for (size_t i = 0;;) {
+                if (needle[++i] == 0)
+                    return haystack;
+                if (c_towlower(haystack[i]) != c_towlower(needle[i]))
+                    break;
+            }
+        }
+    }
+    return NULL;
+}
+
+static const unsigned char alphabet[] = { 'a', 'A', 'b', 'B', 'z', 'Z', '@', '`', '[', '{', 0x80, 0xc1, 0xe1, 0xff, 'x' };
+static const uint16_t wide_alphabet[] = { 'a', 'A', 'b', 'B', 'z', 'Z', '@', '`', '[', '{', 0xc1, 0xe1, 0x141, 0x161, 0xff41, 'x' };
+
+// Needles cut from the haystack with letters flipped, or random
+static size_t make_needle(unsigned char *needle, const unsigned char *text, size_t len, size_t max)
+{
+    size_t nlen = next_random() % (max + 1);
+    if (len && next_random() % 2) {
+        size_t from = next_random() % len;
+        if (nlen > len - from)
+            nlen = len - from;
+        memcpy(needle, text + from, nlen);
+        for (size_t i = 0; i < nlen; i++)
+            if (isalpha(needle[i]) && next_random() % 3 == 0)
+                needle[i] ^= 0x20;
+    } else
+        for (size_t i = 0; i < nlen; i++)
+            needle[i] = alphabet[next_random() % sizeof(alphabet)];
+    return nlen;
+}
+
+static void test_memmem(void)
+{
+    unsigned char text[400], needle[80];
+
+    for (int round = 0; round < 200000; round++) {
+        size_t len = next_random() % (round % 8 ? 48 : sizeof(text)), nlen;
+        int letters = 1 + next_random() % sizeof(alphabet);
+        for (size_t i = 0; i < len; i++)
+            text[i] = alphabet[next_random() % letters];
+        nlen = make_needle(needle, text, len, round % 4 ? 8 : 70);
+
+        // Exact sizes at every alignment
+        size_t off = next_random() % 16;
+        char *h = malloc(off + len + 1), *n = malloc(nlen + 1);
+        memcpy(h + off, text, len);
+        memcpy(n, needle, nlen);
+        char *expect = naive_memmem(h + off, len, n, nlen);
+        const char *got = StrSearchMemory(h + off, len, n, nlen);
+        if (expect != got) {
+            CHECK(0, "memmem round %d len %zu nlen %zu: %td vs %td", round, len, nlen, expect ? expect - h : -1, got ? got - h : -1);
+            free(h);
+            free(n);
+            return;
+        }
+        free(h);
+        free(n);
+    }
+}
+
+static void test_stristr(void)
+{
+    unsigned char text[400], needle[80];
+
+    for (int round = 0; round < 200000; round++) {
+        size_t len = next_random() % (round % 8 ? 48 : sizeof(text)), nlen;
+        int letters = 1 + next_random() % sizeof(alphabet);
+        for (size_t i = 0; i < len; i++)
+            text[i] = alphabet[next_random() % letters];
+        nlen = make_needle(needle, text, len, round % 4 ? 8 : 70);
+
+        size_t off = next_random() % 16;
+        char *h = malloc(off + len + 1), *n = malloc(nlen + 1);
+        memcpy(h + off, text, len);
+        h[off + len] = '\0';
+        memcpy(n, needle, nlen);
+        n[nlen] = '\0';
+        char *expect = naive_stristr(h + off, n), *got = StrSearchNoCase(h + off, n);
+        if (expect != got) {
+            CHECK(0, "stristr round %d len %zu nlen %zu: %td vs %td", round, len, nlen, expect ? expect - h : -1, got ? got - h : -1);
+            free(h);
+            free(n);
+            return;
+        }
+        free(h);
+        free(n);
+    }
+}
+
+static void test_wcsistr(void)
+{
+    uint16_t text[400], needle[80];
+
+    for (int round = 0; round < 200000; round++) {
+        size_t len = next_random() % (round % 8 ? 48 : 400), nlen = next_random() % (round % 4 ? 9 : 71);
+        int letters = 1 + next_random() % (sizeof(wide_alphabet) / 2);
+        for (size_t i = 0; i < len; i++)
+            text[i] = wide_alphabet[next_random() % letters];
+        if (len && next_random() % 2) {
+            size_t from = next_random() % len;
+            if (nlen > len - from)
+                nlen = len - from;
+            memcpy(needle, text + from, nlen * 2);
+            for (size_t i = 0; i < nlen; i++)
+                if (needle[i] < 128 && isalpha(needle[i]) && next_random() % 3 == 0)
+                    needle[i] ^= 0x20;
+        } else
+            for (size_t i = 0; i < nlen; i++)
+                needle[i] = wide_alphabet[next_random() % (sizeof(wide_alphabet) / 2)];
+
+        size_t off = next_random() % 8;
+        uint16_t *h = malloc((off + len + 1) * 2), *n = malloc((nlen + 1) * 2);
+        memcpy(h + off, text, len * 2);
+        h[off + len] = 0;
+        memcpy(n, needle, nlen * 2);
+        n[nlen] = 0;
+        uint16_t *expect = naive_wcsistr(h + off, n), *got = StrSearchNoCaseWide(h + off, n);
+        if (expect != got) {
+            CHECK(0, "wcsistr round %d len %zu nlen %zu: %td vs %td", round, len, nlen, expect ? expect - h : -1, got ? got - h : -1);
+            free(h);
+            free(n);
+            return;
+        }
+        free(h);
+        free(n);
+    }
+}
+
+// Matches straddling the chunks terminated haystacks are searched in
+static void test_long(void)
+{
+    size_t len = 300000;
+    char *h = malloc(len + 1);
+    uint16_t *w = malloc((len + 1) * 2), needle_w[40];
+    char needle[40];
+
+    for (int round = 0; round < 200; round++) {
+        for (size_t i = 0; i < len; i++)
+            w[i] = h[i] = "abcAB"[next_random() % 5];
+        h[len] = w[len] = 0;
+        size_t nlen = 1 + next_random() % 39, at = next_random() % (len - nlen);
+        if (round % 2)
+            at = (0x400 << (next_random() % 8)) - next_random() % nlen;
+        for (size_t i = 0; i < nlen; i++)
+            needle[i] = needle_w[i] = "xyXY"[next_random() % 4];
+        needle[nlen] = needle_w[nlen] = 0;
+        memcpy(h + at, needle, nlen);
+        for (size_t i = 0; i < nlen; i++)
+            w[at + i] = needle_w[i] ^ 0x20;
+        CHECK(StrSearchNoCase(h, needle) == naive_stristr(h, needle), "long stristr at %zu", at);
+        CHECK(StrSearchNoCaseWide(w, needle_w) == w + at && naive_wcsistr(w, needle_w) == w + at, "long wcsistr at %zu", at);
+        CHECK(StrSearchMemory(h, len, needle, nlen) == naive_memmem(h, len, needle, nlen), "long memmem at %zu", at);
+    }
+    free(h);
+    free(w);
+}
+
+// Haystacks ending at the last byte before an inaccessible page, at every
+// alignment; any read past the terminator would fault
+static void test_page_end(void)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    unsigned char *map = mmap(NULL, page * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uint16_t wneedle[] = { 'Q', 'r', 0 };
+
+    mprotect(map + page, page, PROT_NONE);
+    for (size_t len = 0; len < 80; len++) {
+        char *h = (char *)map + page - len - 1;
+        uint16_t *w = (uint16_t *)(map + page) - len - 1;
+        memset(h, 'q', len);
+        h[len] = '\0';
+        CHECK(StrSearchNoCase(h, "QR") == NULL, "page end %zu", len);
+        CHECK(StrSearchMemory(h, len + 1, "q", 2) == (len ? h + len - 1 : NULL), "memmem page end %zu", len);
+        // Over the same bytes
+        for (size_t i = 0; i < len; i++)
+            w[i] = 'q';
+        w[len] = 0;
+        CHECK(StrSearchNoCaseWide(w, wneedle) == NULL, "wide page end %zu", len);
+    }
+    munmap(map, page * 2);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Worst case, a needle that is not there, in text of lower case words
+static void bench(void)
+{
+    static const size_t sizes[] = { 4096, 1 << 20, 64 << 20 };
+    static const size_t needles[] = { 1, 2, 4, 8, 16, 32, 64 };
+    size_t max = 64 << 20;
+    char *h = malloc(max + 1), needle[65];
+    uint16_t *w = malloc(max + 2), wneedle[65];
+
+    for (size_t i = 0; i < max; i++)
+        h[i] = next_random() % 6 ? 'a' + next_random() % 26 : ' ';
+    for (size_t i = 0; i < max / 2; i++)
+        w[i] = h[i];
+
+    printf("%-10s %6s %15s %15s %15s %15s %15s %15s\n", "haystack", "needle", "memmem", "vector", "stristr", "vector", "wcsistr", "vector");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = sizes[s], rounds = (256 << 20) / len / 4;
+        if (rounds < 1)
+            rounds = 1;
+        h[len] = '\0';
+        w[len / 2] = 0;
+        for (size_t n = 0; n < sizeof(needles) / sizeof(needles[0]); n++) {
+            size_t nlen = needles[n];
+            double t[7];
+            volatile uintptr_t sink = 0;
+            for (size_t i = 0; i < nlen; i++)
+                wneedle[i] = needle[i] = i == nlen - 1 ? '#' : "OfThe"[i % 5];
+            needle[nlen] = wneedle[nlen] = 0;
+            t[0] = now();
+            for (size_t r = 0; r < rounds; r++)
+                sink += (uintptr_t)naive_memmem(h, len, needle, nlen);
+            t[1] = now();
+            for (size_t r = 0; r < rounds; r++)
+                sink += (uintptr_t)StrSearchMemory(h, len, needle, nlen);
+            t[2] = now();
+            for (size_t r = 0; r < rounds; r++)
+                sink += (uintptr_t)naive_stristr(h, needle);
+            t[3] = now();
+            for (size_t r = 0; r < rounds; r++)
+                sink += (uintptr_t)StrSearchNoCase(h, needle);
+            t[4] = now();
+            for (size_t r = 0; r < rounds; r++)
+                sink += (uintptr_t)naive_wcsistr(w, wneedle);
+            t[5] = now();
+            for (size_t r = 0; r < rounds; r++)
+                sink += (uintptr_t)StrSearchNoCaseWide(w, wneedle);
+            t[6] = now();
+            printf("%-10zu %6zu", len, nlen);
+            for (int i = 0; i < 6; i++)
+                printf(" %10.1f MB/s", (double)len * rounds / (t[i + 1] - t[i]) / (1 << 20));
+            printf("\n");
+        }
+        h[len] = 'a';
+        w[len / 2] = 'a';
+    }
+    free(h);
+    free(w);
+}
+
+int main(int argc, char **argv)
+{
+    test_memmem();
+    test_stristr();
+    test_wcsistr();
+    test_long();
+    test_page_end();
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        bench();
+
+    return failures != 0;
+}
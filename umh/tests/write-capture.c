@@ -0,0 +1,285 @@
+// Tests for the cross-process write capture behind WriteMemoryHandler:
+// out-of-order, overlapping, partial and reserved (PE image) writes are
+// checked against a byte-map oracle. Portable harness, build on Linux with:
+//   gcc -O2 -Wall -I../CAPE -o write-capture write-capture.c ../CAPE/WriteCapture.c
+// Run "./write-capture bench" for merges/sec.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include "WriteCapture.h"
+
+#define SPACE 0x40000
+#define BASE 0x10000000
+
+static unsigned char value[SPACE], written[SPACE];
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static void check_capture(PWRITECAPTURE c)
+{
+    size_t bytes = 0, i, a;
+
+    for (i = 0; i < c->Count; i++) {
+        PWRITECAPTUREBLOCK b = &c->Blocks[i];
+        bytes += b->Capacity;
+        CHECK(b->Start <= b->End && b->End - b->Start <= b->Capacity, "block %zu bounds", i);
+        CHECK(b->Reserved >= b->End, "block %zu reserved", i);
+        if (i) {
+            PWRITECAPTUREBLOCK p = &c->Blocks[i - 1];
+            CHECK(p->Reserved + WRITECAPTURE_MERGE_GAP < b->Start, "blocks %zu/%zu should have merged", i - 1, i);
+        }
+        // captured bytes are the latest written, gaps are zero
+        for (a = b->Start; a < b->End; a++) {
+            size_t o = a - BASE;
+            if (b->Data[a - b->Start] != (written[o] ? value[o] : 0)) {
+                CHECK(0, "byte %lx: %02x != %02x", (unsigned long)a, b->Data[a - b->Start], written[o] ? value[o] : 0);
+                break;
+            }
+        }
+        // blocks end on a written byte
+        if (b->End > b->Start)
+            CHECK(written[b->End - 1 - BASE], "block %zu ends past the last write", i);
+    }
+    CHECK(bytes == c->Bytes, "byte accounting %zu != %zu", bytes, c->Bytes);
+    CHECK(!c->Limit || c->Bytes <= c->Limit, "limit exceeded");
+    // every written byte is captured
+    for (a = 0; a < SPACE; a++)
+        if (written[a] && !WriteCaptureFind(c, BASE + a)) {
+            CHECK(0, "written byte %lx not captured", (unsigned long)(BASE + a));
+            break;
+        }
+}
+
+static void write_bytes(PWRITECAPTURE c, size_t offset, size_t size)
+{
+    static unsigned char buf[0x20000];
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        buf[i] = (unsigned char)next_random() | 1;
+    PWRITECAPTUREBLOCK b = WriteCaptureAdd(c, BASE + offset, buf, size);
+    CHECK(b && b->Start <= BASE + offset && b->End >= BASE + offset + size, "add %lx+%zx", (unsigned long)offset, size);
+    if (b) {
+        memcpy(value + offset, buf, size);
+        memset(written + offset, 1, size);
+    }
+}
+
+static void reset(PWRITECAPTURE c, size_t limit)
+{
+    WriteCaptureFree(c);
+    WriteCaptureInit(c, limit);
+    memset(value, 0, sizeof(value));
+    memset(written, 0, sizeof(written));
+}
+
+static void test_random(void)
+{
+    WRITECAPTURE c;
+
+    WriteCaptureInit(&c, 0);
+    for (int round = 0; round < 400; round++) {
+        reset(&c, 0);
+        int writes = 1 + next_random() % 200;
+        for (int w = 0; w < writes; w++) {
+            size_t size = 1 + next_random() % (next_random() % 4 ? 0x100 : 0x4000);
+            size_t offset = next_random() % (SPACE - size);
+            if (next_random() % 10 == 0) {
+                // a header write reserving the image extent
+                PWRITECAPTUREBLOCK b = WriteCaptureReserve(&c, BASE + offset, 1 + next_random() % 0x10000);
+                CHECK(b != NULL, "reserve");
+            } else
+                write_bytes(&c, offset, size);
+            if (w % 16 == 0)
+                check_capture(&c);
+        }
+        check_capture(&c);
+    }
+    WriteCaptureFree(&c);
+}
+
+static void test_image_out_of_order(void)
+{
+    // a PE image written section by section, last section first, headers last,
+    // with unwritten section padding in between
+    static const size_t sections[][2] = {{0x5000, 0x800}, {0x3000, 0x1a00}, {0x1000, 0x1fff}};
+    WRITECAPTURE c;
+    PWRITECAPTUREBLOCK b;
+
+    WriteCaptureInit(&c, 0);
+    reset(&c, 0);
+    CHECK(WriteCaptureReserve(&c, BASE, 0x6000) != NULL, "reserve image");
+    for (int i = 0; i < 3; i++)
+        write_bytes(&c, sections[i][0], sections[i][1]);
+    CHECK(c.Count == 1, "sections merged into the image, %zu blocks", c.Count);
+    write_bytes(&c, 0, 0x400);
+    b = WriteCaptureFind(&c, BASE);
+    CHECK(c.Count == 1 && b && b->Start == BASE && b->End == BASE + 0x5800 && b->Writes == 4, "image block");
+    check_capture(&c);
+
+    // a relocation fixup inside the image overwrites in place
+    write_bytes(&c, 0x1010, 4);
+    CHECK(c.Count == 1 && b->Writes == 5, "fixup");
+    check_capture(&c);
+
+    // a distant shellcode write gets its own block, a partial overlap then bridges
+    write_bytes(&c, 0x20000, 0x100);
+    CHECK(c.Count == 2, "separate shellcode block");
+    write_bytes(&c, 0x1ff80, 0x100);
+    CHECK(c.Count == 2 && c.Blocks[1].Start == BASE + 0x1ff80, "overlap below");
+    write_bytes(&c, 0x6800, 0x19000);
+    CHECK(c.Count == 1, "bridged");
+    check_capture(&c);
+    WriteCaptureFree(&c);
+}
+
+static void test_partial_and_limit(void)
+{
+    WRITECAPTURE c;
+    unsigned char buf[0x100] = {1};
+
+    WriteCaptureInit(&c, 0);
+    reset(&c, 0x3000);
+    CHECK(WriteCaptureAdd(&c, BASE, buf, 0) == NULL, "empty write");
+    CHECK(WriteCaptureAdd(&c, UINTPTR_MAX - 0x10, buf, 0x20) == NULL, "wrapping write");
+    CHECK(WriteCaptureReserve(&c, UINTPTR_MAX - 0x10, 0x20) == NULL, "wrapping reserve");
+
+    // partial writes within the gap merge; the gap reads as zero
+    write_bytes(&c, 0x100, 0x10);
+    write_bytes(&c, 0x800, 0x10);
+    CHECK(c.Count == 1 && c.Blocks[0].End - c.Blocks[0].Start == 0x710, "gap merge");
+    write_bytes(&c, 0x80, 0x100);
+    check_capture(&c);
+
+    // over the limit the write is refused and the capture left intact
+    WRITECAPTURE before = c;
+    CHECK(WriteCaptureAdd(&c, BASE + 0x900, buf, 0x2900) == NULL, "limit");
+    CHECK(c.Count == before.Count && c.Bytes == before.Bytes && c.Blocks[0].End == before.Blocks[0].End, "unchanged after failure");
+    check_capture(&c);
+    // a smaller write still fits
+    write_bytes(&c, 0x900, 0x100);
+    check_capture(&c);
+    WriteCaptureFree(&c);
+}
+
+static sigjmp_buf fault_jump;
+
+static void fault_handler(int sig)
+{
+    (void)sig;
+    siglongjmp(fault_jump, 1);
+}
+
+static void test_faulting_buffer(void)
+{
+    // WriteMemoryHandler copies the sample's buffer under __try: a fault while
+    // merging two blocks must leave the capture whole for the next write
+    WRITECAPTURE c;
+    struct sigaction action, previous;
+    void *buf = mmap(NULL, 0x2000, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    volatile int faulted = 0;
+
+    WriteCaptureInit(&c, 0);
+    reset(&c, 0);
+    write_bytes(&c, 0x1000, 0x100);
+    write_bytes(&c, 0x3000, 0x100);
+    CHECK(c.Count == 2 && buf != MAP_FAILED, "two blocks");
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = fault_handler;
+    sigaction(SIGSEGV, &action, &previous);
+    if (!sigsetjmp(fault_jump, 1))
+        WriteCaptureAdd(&c, BASE + 0x1800, buf, 0x1700);
+    else
+        faulted = 1;
+    sigaction(SIGSEGV, &previous, NULL);
+
+    CHECK(faulted, "buffer read faulted");
+    CHECK(c.Count == 1 && c.Blocks[0].Start == BASE + 0x1000 && c.Blocks[0].End == BASE + 0x3100 && c.Blocks[0].Writes == 2, "merged before the fault");
+    check_capture(&c);
+    write_bytes(&c, 0x1800, 0x1700);
+    check_capture(&c);
+    WriteCaptureFree(&c);
+    munmap(buf, 0x2000);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(void)
+{
+    static unsigned char chunk[0x1000];
+    static const size_t chunks[] = {0x10, 0x100, 0x1000};
+    WRITECAPTURE c;
+    double t;
+
+    for (int k = 0; k < 3; k++) {
+        size_t size = chunks[k], image = 64 << 20, n = image / size, i, merges = 0;
+
+        // sequential chunks, as an image copied a page or a field at a time
+        WriteCaptureInit(&c, 0);
+        t = now();
+        for (i = 0; i < n; i++)
+            merges += WriteCaptureAdd(&c, 0x400000 + i * size, chunk, size) != NULL;
+        t = now() - t;
+        printf("sequential %5zu-byte writes: %7.2f M merges/s, %6.2f GB/s\n", size, merges / t / 1e6, (double)image / t / 1e9);
+        WriteCaptureFree(&c);
+
+        // the same chunks in random order into a reserved image
+        WriteCaptureInit(&c, 0);
+        WriteCaptureReserve(&c, 0x400000, image);
+        merges = 0;
+        t = now();
+        for (i = 0; i < n; i++)
+            merges += WriteCaptureAdd(&c, 0x400000 + (next_random() % n) * size, chunk, size) != NULL;
+        t = now() - t;
+        printf("random     %5zu-byte writes: %7.2f M merges/s (%zu blocks)\n", size, merges / t / 1e6, c.Count);
+        WriteCaptureFree(&c);
+    }
+
+    // scattered shellcode writes; blocks are a sorted array, so inserts cost O(blocks)
+    static const size_t slots[] = {100, 1000, 10000};
+    for (int k = 0; k < 3; k++) {
+        size_t n = 1000000, merges = 0;
+        WriteCaptureInit(&c, 0);
+        t = now();
+        for (size_t i = 0; i < n; i++)
+            merges += WriteCaptureAdd(&c, (uintptr_t)(next_random() % slots[k]) * 0x10000, chunk, 0x40) != NULL;
+        t = now() - t;
+        printf("scattered     64-byte writes: %7.2f M merges/s (%zu blocks)\n", merges / t / 1e6, c.Count);
+        WriteCaptureFree(&c);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    test_image_out_of_order();
+    test_partial_and_limit();
+    test_faulting_buffer();
+    test_random();
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        bench();
+
+    return failures != 0;
+}
@@ -0,0 +1,195 @@
+// Tests for the zero-scan helpers behind ScanForNonZero, ReverseScanForNonZero
+// and ScanPageForNonZero. Portable harness, build on Linux with:
+//   gcc -O2 -Wall -I../CAPE -o zero-scan zero-scan.c ../CAPE/ZeroScan.c
+// Run "./zero-scan bench" for throughput numbers.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "ZeroScan.h"
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { failures++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static size_t naive_forward(const unsigned char *b, size_t size)
+{
+    size_t i;
+    for (i = 0; i < size; i++)
+        if (b[i])
+            return i;
+    return size;
+}
+
+static size_t naive_reverse(const unsigned char *b, size_t size)
+{
+    size_t i;
+    for (i = size; i > 0; i--)
+        if (b[i-1])
+            return i;
+    return 0;
+}
+
+static void check_buffer(const unsigned char *b, size_t size)
+{
+    size_t f = ZeroScanForward(b, size), r = ZeroScanReverse(b, size);
+    CHECK(f == naive_forward(b, size), "forward %p+%zu: %zu != %zu", b, size, f, naive_forward(b, size));
+    CHECK(r == naive_reverse(b, size), "reverse %p+%zu: %zu != %zu", b, size, r, naive_reverse(b, size));
+    CHECK(ZeroScanIsZero(b, size) == (naive_forward(b, size) == size), "iszero %p+%zu", b, size);
+}
+
+static void test_alignments(void)
+{
+    static const size_t sizes[] = {0, 1, 2, 15, 16, 17, 63, 64, 65, 127, 200, 4095, 4096, 4097, 8191, 3*4096+77};
+    size_t buflen = 5*4096, s, offset, pos;
+    unsigned char *buf = aligned_alloc(4096, buflen);
+
+    for (s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+        for (offset = 0; offset < 80; offset++) {
+            unsigned char *b = buf + offset;
+            size_t size = sizes[s];
+            memset(buf, 0, buflen);
+            check_buffer(b, size);
+            // Non-zero bytes just outside the range must be ignored
+            if (offset)
+                b[-1] = 0xff;
+            b[size] = 0xff;
+            check_buffer(b, size);
+            b[size] = 0;
+            for (pos = 0; pos < size; pos += (size > 512 && pos > 64 && pos < size - 64) ? 61 : 1) {
+                b[pos] = (unsigned char)(pos | 1);
+                check_buffer(b, size);
+                if (pos + 7 < size) {
+                    b[pos + 7] = 0x80;
+                    check_buffer(b, size);
+                    b[pos + 7] = 0;
+                }
+                b[pos] = 0;
+            }
+        }
+    }
+    free(buf);
+}
+
+static sigjmp_buf fault_jmp;
+
+static void fault_handler(int sig)
+{
+    (void)sig;
+    siglongjmp(fault_jmp, 1);
+}
+
+// Emulates the __try/__except wrappers in CAPE.c: a fault returns -1
+static long guarded_forward(const unsigned char *b, size_t size)
+{
+    if (sigsetjmp(fault_jmp, 1))
+        return -1;
+    return (long)ZeroScanForward(b, size);
+}
+
+static long guarded_reverse(const unsigned char *b, size_t size)
+{
+    if (sigsetjmp(fault_jmp, 1))
+        return -1;
+    return (long)ZeroScanReverse(b, size);
+}
+
+static void test_guard_pages(void)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE), tail;
+    unsigned char *map = mmap(NULL, page * 5, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    unsigned char *data = map + page;
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = fault_handler;
+    sigaction(SIGSEGV, &sa, NULL);
+
+    // Guard pages on either side of three data pages
+    mprotect(map, page, PROT_NONE);
+    mprotect(map + page * 4, page, PROT_NONE);
+
+    // Buffers flush against either guard must never be read past
+    for (tail = 0; tail < 130; tail++) {
+        unsigned char *b = data + tail;
+        size_t size = page * 3 - tail;
+        CHECK(guarded_forward(b, size) == (long)size, "forward read outside buffer, start +%zu", tail);
+        CHECK(guarded_reverse(b, size) == 0, "reverse read outside buffer, start +%zu", tail);
+        CHECK(guarded_forward(data, size) == (long)size, "forward read outside buffer, end -%zu", tail);
+        CHECK(guarded_reverse(data, size) == 0, "reverse read outside buffer, end -%zu", tail);
+    }
+
+    // Inaccessible tail: data found before the guard is reported, otherwise the scan faults
+    data[page * 3 - 1] = 1;
+    CHECK(guarded_forward(data, page * 4) == (long)(page * 3 - 1), "forward before guard");
+    data[page * 3 - 1] = 0;
+    CHECK(guarded_forward(data, page * 4) == -1, "forward should fault in guard");
+    CHECK(guarded_reverse(data, page * 4) == -1, "reverse should fault in guard");
+
+    // Inaccessible middle page
+    mprotect(data + page, page, PROT_NONE);
+    data[page * 2 + 5] = 1;
+    CHECK(guarded_reverse(data, page * 3) == (long)(page * 2 + 6), "reverse before guard");
+    data[page * 2 + 5] = 0;
+    CHECK(guarded_reverse(data, page * 3) == -1, "reverse should fault in guard");
+    data[100] = 1;
+    CHECK(guarded_forward(data, page * 3) == 100, "forward before guard");
+
+    signal(SIGSEGV, SIG_DFL);
+    munmap(map, page * 5);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(void)
+{
+    size_t size = 256 << 20, i;
+    unsigned char *b = aligned_alloc(4096, size);
+    volatile size_t sink = 0;
+    double t;
+
+    memset(b, 0, size);
+    b[size / 2 + 3] = 1;
+
+    t = now();
+    for (i = 0; i < 4; i++)
+        sink += naive_reverse(b + 1, size - 1) + naive_forward(b + 1, size - 1);
+    t = now() - t;
+    printf("byte loop:       %6.2f GB/s\n", 4.0 * size / t / 1e9);
+
+    t = now();
+    for (i = 0; i < 4; i++)
+        sink += ZeroScanReverse(b + 1, size - 1) + ZeroScanForward(b + 1, size - 1);
+    t = now() - t;
+    printf("ZeroScan:        %6.2f GB/s\n", 4.0 * size / t / 1e9);
+
+    b[size / 2 + 3] = 0;
+    t = now();
+    for (i = 0; i < 8; i++)
+        sink += ZeroScanIsZero(b, size);
+    t = now() - t;
+    printf("ZeroScanIsZero:  %6.2f GB/s (all zero)\n", 8.0 * size / t / 1e9);
+    free(b);
+}
+
+int main(int argc, char **argv)
+{
+    test_alignments();
+    test_guard_pages();
+    printf("%s (%d failures)\n", failures ? "FAILED" : "OK", failures);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        bench();
+
+    return failures != 0;
+}
@@ -442,12 +442,8 @@ static DWORD WINAPI _watchdog_thread(LPVOID param)
 		for (i = 0; i < capemonaddrs_num; i++) {
 			char *dllname2 = convert_address_to_dll_name_and_offset(capemonaddrs[i], &off);
 			sprintf(msg + strlen(msg), " %s+%x(0x%lx)", dllname2 ? dllname2 : "", off, capemonaddrs[i]);
-			if (dllname2)
-				free(dllname2);
 		}
 
-		if (dllname)
-			free(dllname);
 		ResumeThread((HANDLE)param);
 		pipe(msg);
 	}